@@ -0,0 +1,167 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "callbacks.h"
+#include "couch-kvstore/couch-kvstore.h"
+#include "item.h"
+#include "kvstore.h"
+#include "mutation_log.h"
+#include "tests/module_tests/test_helpers.h"
+#include "vbucket_bgfetch_item.h"
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <platform/dirutils.h>
+#include <platform/make_unique.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+/**
+ * Benchmark of warmup's loading of the working set named by an access log,
+ * on a cold page cache: the log is read a batch at a time, and the values
+ * of each batch fetched with CouchKVStore::getMulti().
+ *
+ * The first parameter is the order of the log:
+ *   0 - unordered, as the AccessScanner wrote it before V3 (hash table
+ *       order)
+ *   1 - seqno order, as it writes it now
+ * The second selects the read backend (0 - sync, 1 - auto), as values are
+ * only read in file order by the async one.
+ */
+class AccessLogLoadBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        cb::io::rmrf(dbname);
+        remove(logPath.c_str());
+        config = std::make_unique<KVStoreConfig>(
+                1024, 4, dbname, "couchdb", 0, false /*persistnamespace*/);
+        config->setReadBackend(state.range(1) ? "auto" : "sync");
+        kvstore = std::make_unique<CouchKVStore>(*config);
+
+        vbucket_state vbstate(
+                vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+        kvstore->snapshotVBucket(
+                vbid, vbstate, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT);
+
+        const std::string value(1024, 'x');
+        CustomCallback<mutation_result> setCb;
+        kvstore->begin();
+        for (size_t i = 0; i < numItems; i++) {
+            Item item(makeStoredDocKey("key_" + std::to_string(i)),
+                      0, 0, value.data(), value.size(),
+                      nullptr, 0, 0, i + 1);
+            kvstore->set(item, setCb);
+        }
+        kvstore->commit(nullptr /*no collections manifest*/);
+
+        // The working set: a random quarter of the items.
+        std::vector<uint64_t> seqnos(numItems);
+        std::iota(seqnos.begin(), seqnos.end(), 1);
+        std::shuffle(seqnos.begin(), seqnos.end(), std::mt19937_64(0));
+        seqnos.resize(numItems / 4);
+        if (state.range(0)) {
+            std::sort(seqnos.begin(), seqnos.end());
+        }
+        {
+            MutationLog log(logPath);
+            log.open();
+            for (auto seqno : seqnos) {
+                auto key = makeStoredDocKey("key_" + std::to_string(seqno - 1));
+                log.newItem(vbid, key, state.range(0) ? seqno : 0);
+            }
+            log.commit1();
+            log.commit2();
+        }
+
+        auto files = cb::io::findFilesWithPrefix(dbname, "0.couch");
+        fd = open(files.front().c_str(), O_RDONLY);
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        close(fd);
+        kvstore.reset();
+        config.reset();
+        cb::io::rmrf(dbname);
+        remove(logPath.c_str());
+    }
+
+protected:
+    static bool addKey(void* arg, uint16_t vb, const DocKey& key) {
+        vb_bgfetch_item_ctx_t ctx;
+        ctx.isMetaOnly = GetMetaOnly::No;
+        (*static_cast<vb_bgfetch_queue_t*>(arg))[key] = std::move(ctx);
+        return true;
+    }
+
+    /// Load the working set as warmup does. @return the number of values
+    size_t load() {
+        MutationLog log(logPath);
+        log.open(true);
+        MutationLogHarvester harvester(log);
+        harvester.setVBucket(vbid);
+        size_t loaded = 0;
+        auto it = log.begin();
+        do {
+            it = harvester.loadBatch(it, batchSize);
+            vb_bgfetch_queue_t itms;
+            harvester.apply(&itms, &addKey);
+            kvstore->getMulti(vbid, itms);
+            for (auto& itm : itms) {
+                if (itm.second.value.getStatus() == ENGINE_SUCCESS) {
+                    ++loaded;
+                }
+            }
+        } while (it != log.end());
+        return loaded;
+    }
+
+    const std::string dbname = "access_log_load_bench.db";
+    const std::string logPath = "access_log_load_bench.log";
+    const uint16_t vbid = 0;
+    const size_t numItems = 200000;
+    // warmup_batch_size's default.
+    const size_t batchSize = 10000;
+
+    std::unique_ptr<KVStoreConfig> config;
+    std::unique_ptr<CouchKVStore> kvstore;
+    int fd = -1;
+};
+
+BENCHMARK_DEFINE_F(AccessLogLoadBench, LoadWorkingSet)
+(benchmark::State& state) {
+    state.SetLabel(std::string(state.range(0) ? "seqno order" : "unordered") +
+                   (state.range(1) ? ", auto" : ", sync"));
+    size_t loaded = 0;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        state.ResumeTiming();
+
+        loaded += load();
+    }
+    state.SetItemsProcessed(loaded);
+}
+
+BENCHMARK_REGISTER_F(AccessLogLoadBench, LoadWorkingSet)
+        ->Args({0, 0})
+        ->Args({1, 0})
+        ->Args({0, 1})
+        ->Args({1, 1})
+        ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "bloomfilter.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <benchmark/benchmark.h>
+#include <platform/make_unique.h>
+#include <valgrind/valgrind.h>
+
+/**
+ * Benchmarks for BloomFilter::maybeKeyExists throughput, on a filter sized
+ * (at the default 1% false positive probability) for the keys added.
+ *
+ * The first parameter selects the filter layout:
+ *   0 - standard, one hash and memory access per bit.
+ *   1 - blocked, all of a key's bits in one cache line.
+ * The second parameter is the number of keys, so that the filter fits in
+ * or exceeds the caches.
+ */
+class BloomFilterBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        const size_t nkeys = RUNNING_ON_VALGRIND ? 100 : state.range(1);
+        filter = std::make_unique<BloomFilter>(
+                nkeys, 0.01, BFILTER_ENABLED, state.range(0) != 0);
+
+        keys.clear();
+        missingKeys.clear();
+        for (size_t i = 0; i < nkeys; i++) {
+            keys.push_back(makeStoredDocKey("key_" + std::to_string(i)));
+            missingKeys.push_back(
+                    makeStoredDocKey("missing_" + std::to_string(i)));
+        }
+        for (const auto& key : keys) {
+            filter->addKey(key);
+        }
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        filter.reset();
+    }
+
+protected:
+    static void setLabel(benchmark::State& state) {
+        state.SetLabel(state.range(0) ? "blocked" : "standard");
+    }
+
+    std::unique_ptr<BloomFilter> filter;
+    std::vector<StoredDocKey> keys;
+    std::vector<StoredDocKey> missingKeys;
+};
+
+BENCHMARK_DEFINE_F(BloomFilterBench, MaybeKeyExists)
+(benchmark::State& state) {
+    setLabel(state);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(
+                filter->maybeKeyExists(keys[i++ % keys.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_DEFINE_F(BloomFilterBench, MaybeKeyExistsMissing)
+(benchmark::State& state) {
+    setLabel(state);
+    size_t i = 0;
+    size_t positives = 0;
+    while (state.KeepRunning()) {
+        positives +=
+                filter->maybeKeyExists(missingKeys[i++ % missingKeys.size()]);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["fp_rate"] = double(positives) / state.iterations();
+}
+
+BENCHMARK_REGISTER_F(BloomFilterBench, MaybeKeyExists)
+        ->Ranges({{0, 1}, {10000, 1000000}});
+BENCHMARK_REGISTER_F(BloomFilterBench, MaybeKeyExistsMissing)
+        ->Ranges({{0, 1}, {10000, 1000000}});
@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "checkpoint.h"
+#include "ep_vb.h"
+#include "failover-table.h"
+#include "tests/module_tests/test_helpers.h"
+#include "tests/module_tests/vbucket_test.h"
+
+#include <benchmark/benchmark.h>
+#include <platform/make_unique.h>
+#include <valgrind/valgrind.h>
+
+/**
+ * Benchmarks for CheckpointManager::queueDirty() and
+ * getAllItemsForCursor(), queueing a mix of new and de-duplicated keys (each
+ * key is queued twice).
+ */
+class CheckpointBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        vbucket = std::make_unique<EPVBucket>(0,
+                                              vbucket_state_active,
+                                              stats,
+                                              checkpointConfig,
+                                              /*kvshard*/ nullptr,
+                                              /*lastSeqno*/ 0,
+                                              /*lastSnapStart*/ 0,
+                                              /*lastSnapEnd*/ 0,
+                                              /*table*/ nullptr,
+                                              std::make_shared<DummyCB>(),
+                                              /*newSeqnoCb*/ nullptr,
+                                              config,
+                                              VALUE_ONLY);
+
+        // Enough items to span many checkpoint chunks and to exceed the
+        // D$, but only a handful under Valgrind.
+        const size_t numItems = RUNNING_ON_VALGRIND ? 10 : 200000;
+        const size_t numKeys = numItems / 2;
+        toQueue.clear();
+        toQueue.reserve(numItems);
+        for (size_t ii = 0; ii < numItems; ++ii) {
+            toQueue.emplace_back(new Item(
+                    makeStoredDocKey("key_" + std::to_string(ii % numKeys)),
+                    vbucket->getId(),
+                    queue_op::set,
+                    /*revSeq*/ 0,
+                    /*bySeq*/ 0));
+        }
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        manager.reset();
+        vbucket.reset();
+        toQueue.clear();
+    }
+
+protected:
+    /// Create a new manager, with a DCP cursor as well as the persistence
+    /// cursor.
+    void createManager() {
+        manager = std::make_unique<CheckpointManager>(
+                stats,
+                vbucket->getId(),
+                checkpointConfig,
+                /*lastSeqno*/ 0,
+                /*lastSnapStart*/ 0,
+                /*lastSnapEnd*/ 0,
+                std::make_shared<DummyCB>());
+        manager->registerCursorBySeqno(
+                dcpCursor, 0, MustSendCheckpointEnd::NO);
+    }
+
+    void queueAll() {
+        for (auto& qi : toQueue) {
+            manager->queueDirty(*vbucket,
+                                qi,
+                                GenerateBySeqno::Yes,
+                                GenerateCas::Yes,
+                                /*preLinkDocCtx*/ nullptr);
+        }
+    }
+
+    const std::string dcpCursor = "eq_dcpq:bench";
+    EPStats stats;
+    CheckpointConfig checkpointConfig;
+    Configuration config;
+    std::unique_ptr<VBucket> vbucket;
+    std::unique_ptr<CheckpointManager> manager;
+    std::vector<queued_item> toQueue;
+};
+
+BENCHMARK_DEFINE_F(CheckpointBench, QueueDirty)(benchmark::State& state) {
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        createManager();
+        state.ResumeTiming();
+
+        queueAll();
+
+        state.PauseTiming();
+        manager.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * toQueue.size());
+}
+
+BENCHMARK_DEFINE_F(CheckpointBench, GetAllItemsForCursor)
+(benchmark::State& state) {
+    size_t itemsRead = 0;
+    std::vector<queued_item> items;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        createManager();
+        queueAll();
+        items.clear();
+        state.ResumeTiming();
+
+        manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+        itemsRead += items.size();
+        items.clear();
+        manager->getAllItemsForCursor(dcpCursor, items);
+        itemsRead += items.size();
+
+        state.PauseTiming();
+        manager.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(itemsRead);
+}
+
+BENCHMARK_REGISTER_F(CheckpointBench, QueueDirty)
+        ->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(CheckpointBench, GetAllItemsForCursor)
+        ->Unit(benchmark::kMillisecond);
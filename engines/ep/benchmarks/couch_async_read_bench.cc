@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "callbacks.h"
+#include "couch-kvstore/couch-kvstore.h"
+#include "item.h"
+#include "kvstore.h"
+#include "tests/module_tests/test_helpers.h"
+#include "vbucket_bgfetch_item.h"
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <platform/dirutils.h>
+#include <platform/make_unique.h>
+#include <unistd.h>
+
+/**
+ * Benchmark of CouchKVStore::getMulti() on a cold page cache: the batched
+ * background fetch of random documents.
+ *
+ * The first parameter selects the read backend:
+ *   0 - sync (one pread at a time)
+ *   1 - auto (io_uring, else a thread pool)
+ * The second the read queue depth.
+ */
+class CouchAsyncReadBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        cb::io::rmrf(dbname);
+        config = std::make_unique<KVStoreConfig>(
+                1024, 4, dbname, "couchdb", 0, false /*persistnamespace*/);
+        config->setReadBackend(state.range(0) ? "auto" : "sync")
+                .setReadQueueDepth(state.range(1));
+        kvstore = std::make_unique<CouchKVStore>(*config);
+
+        vbucket_state vbstate(
+                vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+        kvstore->snapshotVBucket(
+                vbid, vbstate, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT);
+
+        // Enough 4KiB documents that a batch rarely finds two in a block.
+        const std::string value(4096, 'x');
+        CustomCallback<mutation_result> setCb;
+        keys.clear();
+        kvstore->begin();
+        for (size_t i = 0; i < numItems; i++) {
+            keys.push_back(makeStoredDocKey("key_" + std::to_string(i)));
+            Item item(keys.back(), 0, 0, value.data(), value.size(),
+                      nullptr, 0, 0, i + 1);
+            kvstore->set(item, setCb);
+        }
+        kvstore->commit(nullptr /*no collections manifest*/);
+
+        auto files = cb::io::findFilesWithPrefix(dbname, "0.couch");
+        fd = open(files.front().c_str(), O_RDONLY);
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        close(fd);
+        kvstore.reset();
+        config.reset();
+        cb::io::rmrf(dbname);
+    }
+
+protected:
+    const std::string dbname = "couch_async_read_bench.db";
+    const uint16_t vbid = 0;
+    const size_t numItems = 50000;
+    const size_t batchSize = 64;
+
+    std::unique_ptr<KVStoreConfig> config;
+    std::unique_ptr<CouchKVStore> kvstore;
+    std::vector<StoredDocKey> keys;
+    int fd = -1;
+};
+
+BENCHMARK_DEFINE_F(CouchAsyncReadBench, GetMulti)(benchmark::State& state) {
+    state.SetLabel(state.range(0) ? "auto" : "sync");
+    size_t next = 0;
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        vb_bgfetch_queue_t itms;
+        for (size_t i = 0; i < batchSize; i++) {
+            next = (next + 7919) % keys.size();
+            vb_bgfetch_item_ctx_t ctx;
+            ctx.isMetaOnly = GetMetaOnly::No;
+            itms[keys[next]] = std::move(ctx);
+        }
+        state.ResumeTiming();
+
+        kvstore->getMulti(vbid, itms);
+    }
+    state.SetItemsProcessed(state.iterations() * batchSize);
+}
+
+BENCHMARK_REGISTER_F(CouchAsyncReadBench, GetMulti)
+        ->Args({0, 1})
+        ->Args({1, 1})
+        ->Args({1, 8})
+        ->Args({1, 64});
@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "callbacks.h"
+#include "couch-kvstore/couch-kvstore.h"
+#include "item.h"
+#include "kvstore.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <platform/dirutils.h>
+#include <platform/make_unique.h>
+
+/**
+ * Benchmark of CouchKVStore with and without the value log: loading large
+ * documents, updating a tenth of them, and compacting. The counters report
+ * the bytes written by the load (couchstore and value log) and by the
+ * compaction (including the value log's garbage collection).
+ *
+ * The parameter is the value log threshold (0 - no value log).
+ */
+class CouchValueLogBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        cb::io::rmrf(dbname);
+        config = std::make_unique<KVStoreConfig>(
+                1024, 4, dbname, "couchdb", 0, false /*persistnamespace*/);
+        config->setValueLogThreshold(state.range(0));
+        kvstore = std::make_unique<CouchKVStore>(*config);
+
+        vbucket_state vbstate(
+                vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+        kvstore->snapshotVBucket(
+                vbid, vbstate, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT);
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        kvstore.reset();
+        config.reset();
+        cb::io::rmrf(dbname);
+    }
+
+protected:
+    /// Write numItems / step documents, every step'th.
+    void write(size_t step) {
+        // Incompressible, as large values usually are.
+        std::string value(valueSize, '\0');
+        CustomCallback<mutation_result> setCb;
+        kvstore->begin();
+        for (size_t i = 0; i < numItems; i += step) {
+            for (auto& c : value) {
+                c = char(random());
+            }
+            Item item(makeStoredDocKey("key_" + std::to_string(i)),
+                      0, 0, value.data(), value.size(),
+                      nullptr, 0, 0, ++seqno);
+            kvstore->set(item, setCb);
+        }
+        kvstore->commit(nullptr /*no collections manifest*/);
+    }
+
+    size_t getStat(const char* name) {
+        size_t value = 0;
+        kvstore->getStat(name, value);
+        return value;
+    }
+
+    const std::string dbname = "couch_value_log_bench.db";
+    const uint16_t vbid = 0;
+    const size_t numItems = 10000;
+    const size_t valueSize = 16384;
+
+    std::unique_ptr<KVStoreConfig> config;
+    std::unique_ptr<CouchKVStore> kvstore;
+    int64_t seqno = 0;
+};
+
+BENCHMARK_DEFINE_F(CouchValueLogBench, LoadUpdateCompact)
+(benchmark::State& state) {
+    state.SetLabel(state.range(0) ? "value log" : "couchstore");
+    size_t loadBytes = 0;
+    size_t compactBytes = 0;
+    const auto& stats = kvstore->getKVStoreStat();
+    while (state.KeepRunning()) {
+        const size_t writeBytes = getStat("io_total_write_bytes");
+        const size_t compactWriteBytes = getStat("io_compaction_write_bytes");
+        const size_t logWriteBytes = stats.io_value_log_write_bytes;
+        const size_t logGcBytes = stats.io_value_log_gc_bytes;
+
+        write(1);
+        write(10);
+
+        compaction_ctx cctx;
+        cctx.purge_before_seq = 0;
+        cctx.purge_before_ts = 0;
+        cctx.curr_time = 0;
+        cctx.drop_deletes = 0;
+        cctx.db_file_id = vbid;
+        kvstore->compactDB(&cctx);
+
+        const size_t compacted =
+                getStat("io_compaction_write_bytes") - compactWriteBytes;
+        loadBytes += getStat("io_total_write_bytes") - writeBytes - compacted +
+                     stats.io_value_log_write_bytes - logWriteBytes;
+        compactBytes += compacted + stats.io_value_log_gc_bytes - logGcBytes;
+    }
+    state.counters["LoadWriteBytes"] = double(loadBytes) / state.iterations();
+    state.counters["CompactionWriteBytes"] =
+            double(compactBytes) / state.iterations();
+    state.SetItemsProcessed(state.iterations() * (numItems + numItems / 10));
+}
+
+BENCHMARK_REGISTER_F(CouchValueLogBench, LoadUpdateCompact)
+        ->Arg(0)
+        ->Arg(4096);
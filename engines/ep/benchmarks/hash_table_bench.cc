@@ -0,0 +1,259 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "hash_table.h"
+#include "item.h"
+#include "stats.h"
+#include "stored_value_factories.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <benchmark/benchmark.h>
+#include <platform/make_unique.h>
+#include <valgrind/valgrind.h>
+
+/**
+ * Benchmarks for HashTable get / set throughput.
+ *
+ * The first parameter selects the bucket layout:
+ *   0 - plain chained buckets (fingerprints not consulted).
+ *   1 - buckets with key fingerprints.
+ */
+class HashTableBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        if (state.thread_index != 0) {
+            return;
+        }
+        const bool useFingerprints = state.range(0) != 0;
+
+        // Use a large number of items for normal runs so the HashTable
+        // exceeds the D$, but only a handful under Valgrind.
+        const size_t nitems = RUNNING_ON_VALGRIND ? 100 : 1000000;
+
+        ht = std::make_unique<HashTable>(
+                stats,
+                std::make_unique<StoredValueFactory>(stats),
+                /*initialSize*/ 47,
+                /*locks*/ 47,
+                /*resizeStepSize*/ 0,
+                useFingerprints);
+
+        keys.clear();
+        missingKeys.clear();
+        for (size_t i = 0; i < nitems; i++) {
+            keys.push_back(makeStoredDocKey("key_" + std::to_string(i)));
+            missingKeys.push_back(
+                    makeStoredDocKey("missing_" + std::to_string(i)));
+        }
+        for (const auto& key : keys) {
+            Item item(key, 0, 0, key.data(), key.size());
+            ht->set(item);
+        }
+        ht->resize();
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            ht.reset();
+        }
+    }
+
+protected:
+    static void setLabel(benchmark::State& state) {
+        state.SetLabel(state.range(0) ? "fingerprints" : "chained");
+    }
+
+    EPStats stats;
+    std::unique_ptr<HashTable> ht;
+    std::vector<StoredDocKey> keys;
+    std::vector<StoredDocKey> missingKeys;
+};
+
+BENCHMARK_DEFINE_F(HashTableBench, Find)(benchmark::State& state) {
+    setLabel(state);
+    // Each thread starts at a different point in the key space.
+    size_t i = state.thread_index * (keys.size() / state.threads);
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(ht->find(keys[i++ % keys.size()],
+                                          TrackReference::Yes,
+                                          WantsDeleted::No));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_DEFINE_F(HashTableBench, FindMissing)(benchmark::State& state) {
+    setLabel(state);
+    size_t i = state.thread_index * (missingKeys.size() / state.threads);
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(
+                ht->find(missingKeys[i++ % missingKeys.size()],
+                         TrackReference::Yes,
+                         WantsDeleted::No));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_DEFINE_F(HashTableBench, Set)(benchmark::State& state) {
+    setLabel(state);
+    size_t i = state.thread_index * (keys.size() / state.threads);
+    while (state.KeepRunning()) {
+        const auto& key = keys[i++ % keys.size()];
+        Item item(key, 0, 0, key.data(), key.size());
+        benchmark::DoNotOptimize(ht->set(item));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_REGISTER_F(HashTableBench, Find)
+        ->Range(0, 1)
+        ->Threads(1)
+        ->Threads(8)
+        ->Threads(32);
+BENCHMARK_REGISTER_F(HashTableBench, FindMissing)
+        ->Range(0, 1)
+        ->Threads(1)
+        ->Threads(8)
+        ->Threads(32);
+BENCHMARK_REGISTER_F(HashTableBench, Set)
+        ->Range(0, 1)
+        ->Threads(1)
+        ->Threads(8)
+        ->Threads(32);
+
+/**
+ * Benchmarks for reads of a small set of hot keys, which all map to a
+ * handful of hash bucket locks and hence are heavily contended.
+ *
+ * The first parameter selects how lookups are performed:
+ *   0 - under the hash bucket lock.
+ *   1 - mutex-free, registering as a reader of the lock stripe.
+ */
+class HashTableHotKeyBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        if (state.thread_index != 0) {
+            return;
+        }
+        ht = std::make_unique<HashTable>(
+                stats,
+                std::make_unique<StoredValueFactory>(stats),
+                /*initialSize*/ 47,
+                /*locks*/ 47,
+                /*resizeStepSize*/ 0,
+                /*useFingerprints*/ true,
+                /*mutexFreeReads*/ state.range(0) != 0);
+
+        keys.clear();
+        for (size_t i = 0; i < 8; i++) {
+            keys.push_back(makeStoredDocKey("hot_" + std::to_string(i)));
+        }
+        for (const auto& key : keys) {
+            Item item(key, 0, 0, key.data(), key.size());
+            ht->set(item);
+            // Mark as referenced so subsequent finds need no NRU update.
+            ht->find(key, TrackReference::Yes, WantsDeleted::No);
+        }
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        if (state.thread_index == 0) {
+            ht.reset();
+        }
+    }
+
+protected:
+    EPStats stats;
+    std::unique_ptr<HashTable> ht;
+    std::vector<StoredDocKey> keys;
+};
+
+BENCHMARK_DEFINE_F(HashTableHotKeyBench, Find)(benchmark::State& state) {
+    state.SetLabel(state.range(0) ? "mutex_free" : "locked");
+    size_t i = state.thread_index;
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(ht->find(
+                keys[i++ % keys.size()], TrackReference::Yes, WantsDeleted::No));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_REGISTER_F(HashTableHotKeyBench, Find)
+        ->Range(0, 1)
+        ->Threads(1)
+        ->Threads(8)
+        ->Threads(32);
+
+/**
+ * Memory used by the HashTables of a bucket with 1024 vBuckets holding
+ * 10,000 items, when each vBucket has its own ht_locks (argument 0), or all
+ * share the given number of ht_shared_locks.
+ *
+ * Reports the HashTable overhead (bucket arrays, locks and HashTable
+ * objects; not the StoredValues themselves) in the HashTableBytes counter.
+ */
+static void HashTableSharedLocksMemory(benchmark::State& state) {
+    const size_t numVBuckets = 1024;
+    const size_t numItems = RUNNING_ON_VALGRIND ? 1000 : 10000;
+    const size_t sharedLockCount = state.range(0);
+
+    std::vector<StoredDocKey> keys;
+    for (size_t i = 0; i < numItems; i++) {
+        keys.push_back(makeStoredDocKey("key_" + std::to_string(i)));
+    }
+
+    EPStats stats;
+    size_t bytes = 0;
+    while (state.KeepRunning()) {
+        std::shared_ptr<HashTable::LockSet> sharedLocks;
+        if (sharedLockCount) {
+            sharedLocks = std::make_shared<HashTable::LockSet>(
+                    sharedLockCount, /*mutexFreeReads*/ false);
+        }
+
+        std::vector<std::unique_ptr<HashTable>> tables;
+        for (size_t vb = 0; vb < numVBuckets; vb++) {
+            tables.push_back(std::make_unique<HashTable>(
+                    stats,
+                    std::make_unique<StoredValueFactory>(stats),
+                    /*initialSize*/ 47,
+                    /*locks*/ 47,
+                    /*resizeStepSize*/ 0,
+                    /*useFingerprints*/ true,
+                    /*mutexFreeReads*/ false,
+                    sharedLocks));
+        }
+        for (size_t i = 0; i < keys.size(); i++) {
+            Item item(keys[i], 0, 0, keys[i].data(), keys[i].size());
+            tables[i % numVBuckets]->set(item);
+        }
+
+        bytes = sharedLocks ? sharedLocks->memorySize() : 0;
+        for (auto& ht : tables) {
+            ht->resize();
+            bytes += ht->memorySize();
+        }
+    }
+    state.SetLabel(sharedLockCount ? "shared locks" : "per-vBucket locks");
+    state.counters["HashTableBytes"] = bytes;
+    state.counters["HashTableBytesPerItem"] = bytes / numItems;
+}
+
+BENCHMARK(HashTableSharedLocksMemory)
+        ->Arg(0)
+        ->Arg(1024)
+        ->Arg(4096)
+        ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "callbacks.h"
+#include "checkpoint.h"
+#include "couch-kvstore/couch-kvstore.h"
+#include "ep_vb.h"
+#include "failover-table.h"
+#include "item.h"
+#include "kvstore.h"
+#include "tests/module_tests/test_helpers.h"
+#include "tests/module_tests/vbucket_test.h"
+
+#include <benchmark/benchmark.h>
+#include <platform/dirutils.h>
+#include <platform/make_unique.h>
+
+#include <algorithm>
+
+/**
+ * Benchmark of the part of warmup a metadata image replaces: building a
+ * vbucket's hash table of (non-resident) keys and metadata, by a key dump of
+ * its couchstore file or from the image written at shutdown.
+ *
+ * The parameters are the number of items, and whether to use the image.
+ */
+class WarmupImageBench : public benchmark::Fixture {
+public:
+    void SetUp(const benchmark::State& state) override {
+        const size_t numItems = state.range(0);
+        cb::io::rmrf(dbname);
+        kvConfig = std::make_unique<KVStoreConfig>(
+                1024, 4, dbname, "couchdb", 0, false /*persistnamespace*/);
+        kvstore = std::make_unique<CouchKVStore>(*kvConfig);
+
+        vbucket_state vbstate(
+                vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+        kvstore->snapshotVBucket(
+                vbid, vbstate, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT);
+
+        const std::string value(64, 'x');
+        CustomCallback<mutation_result> setCb;
+        const size_t batchSize = 100000;
+        for (size_t i = 0; i < numItems; i += batchSize) {
+            kvstore->begin();
+            for (size_t j = i; j < std::min(numItems, i + batchSize); j++) {
+                Item item(makeStoredDocKey("key_" + std::to_string(j)),
+                          0, 0, value.data(), value.size(),
+                          nullptr, 0, 0, j + 1);
+                kvstore->set(item, setCb);
+            }
+            kvstore->commit(nullptr /*no collections manifest*/);
+        }
+
+        vb = std::make_unique<EPVBucket>(vbid,
+                                         vbucket_state_active,
+                                         stats,
+                                         checkpointConfig,
+                                         /*kvshard*/ nullptr,
+                                         /*lastSeqno*/ numItems,
+                                         /*lastSnapStart*/ 0,
+                                         /*lastSnapEnd*/ numItems,
+                                         std::make_unique<FailoverTable>(1),
+                                         std::make_shared<DummyCB>(),
+                                         /*newSeqnoCb*/ nullptr,
+                                         config,
+                                         VALUE_ONLY);
+        vb->setPersistenceSeqno(numItems);
+        vb->ht.resize(numItems);
+
+        keyDump();
+        vb->persistMetadataImage(imagePath);
+    }
+
+    void TearDown(const benchmark::State& state) override {
+        vb.reset();
+        kvstore.reset();
+        kvConfig.reset();
+        cb::io::rmrf(dbname);
+        remove(imagePath.c_str());
+    }
+
+protected:
+    /// Inserts each key scanned into the vbucket, as warmup's key dump does.
+    class KeyDumpCallback : public Callback<GetValue> {
+    public:
+        KeyDumpCallback(EPVBucket& vb) : vb(vb) {
+        }
+
+        void callback(GetValue& val) override {
+            vb.insertFromWarmup(*val.item, true /*eject*/, val.isPartial());
+        }
+
+    private:
+        EPVBucket& vb;
+    };
+
+    void keyDump() {
+        auto cb = std::make_shared<KeyDumpCallback>(*vb);
+        auto cl = std::make_shared<NoLookupCallback>();
+        ScanContext* ctx =
+                kvstore->initScanContext(cb,
+                                         cl,
+                                         vbid,
+                                         0,
+                                         DocumentFilter::NO_DELETES,
+                                         ValueFilter::KEYS_ONLY);
+        kvstore->scan(ctx);
+        kvstore->destroyScanContext(ctx);
+    }
+
+    const std::string dbname = "warmup_image_bench.db";
+    const std::string imagePath = "warmup_image_bench.metaimage";
+    const uint16_t vbid = 0;
+
+    EPStats stats;
+    CheckpointConfig checkpointConfig;
+    Configuration config;
+    std::unique_ptr<KVStoreConfig> kvConfig;
+    std::unique_ptr<CouchKVStore> kvstore;
+    std::unique_ptr<EPVBucket> vb;
+};
+
+BENCHMARK_DEFINE_F(WarmupImageBench, LoadKeys)(benchmark::State& state) {
+    const bool useImage = state.range(1);
+    state.SetLabel(useImage ? "metadata image" : "key dump");
+    while (state.KeepRunning()) {
+        state.PauseTiming();
+        vb->ht.clear();
+        state.ResumeTiming();
+
+        size_t restored;
+        if (!useImage || !vb->restoreMetadataImage(imagePath, restored)) {
+            keyDump();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_REGISTER_F(WarmupImageBench, LoadKeys)
+        ->Args({1000000, 0})
+        ->Args({1000000, 1})
+        ->Args({10000000, 0})
+        ->Args({10000000, 1})
+        ->Unit(benchmark::kMillisecond);
@@ -29,7 +29,10 @@
 #include "mutation_log.h"
 #include "vb_count_visitor.h"
 
+#include <algorithm>
+#include <functional>
 #include <numeric>
+#include <queue>
 
 class ItemAccessVisitor : public VBucketVisitor, public HashTableVisitor {
 public:
@@ -57,12 +60,16 @@ public:
         name = name + "." + s.str();
         prev = name + ".old";
         next = name + ".next";
+        runs = name + ".runs";
+        blockSize = conf.getAlogBlockSize();
 
-        log = std::make_unique<MutationLog>(next, conf.getAlogBlockSize());
+        // Don't append to the runs of an earlier, interrupted scan.
+        remove(runs.c_str());
+        log = std::make_unique<MutationLog>(runs, blockSize);
         log->open();
         if (!log->isOpen()) {
             LOG(EXTENSION_LOG_WARNING, "Failed to open access log: '%s'",
-                next.c_str());
+                runs.c_str());
             log.reset();
         } else {
             LOG(EXTENSION_LOG_NOTICE, "Attempting to generate new access file "
@@ -77,17 +84,19 @@ public:
                     "INFO: Skipping expired/deleted item: %" PRIu64,
                     v.getBySeqno());
             } else {
-                accessed.push_back(StoredDocKey(v.getKey()));
+                accessed.emplace_back(v.getBySeqno(), v.getKey());
                 return ++items_scanned < items_to_scan;
             }
         }
         return true;
     }
 
+    /// Write the keys accessed, as a run sorted by seqno.
     void update() {
         if (log != nullptr) {
-            for (auto it = accessed.begin(); it != accessed.end(); ++it) {
-                log->newItem(currentBucket->getId(), *it);
+            std::sort(accessed.begin(), accessed.end());
+            for (const auto& item : accessed) {
+                log->newItem(currentBucket->getId(), item.second, item.first);
             }
         }
         accessed.clear();
@@ -128,7 +137,19 @@ public:
             if (num_items == 0) {
                 LOG(EXTENSION_LOG_NOTICE, "The new access log file is empty. "
                     "Delete it without replacing the current access log...");
-                remove(next.c_str());
+                remove(runs.c_str());
+                updateStateFinalizer(true);
+                return;
+            }
+
+            if (mergeRuns()) {
+                remove(runs.c_str());
+            } else if (rename(runs.c_str(), next.c_str()) == -1) {
+                // The runs are still a valid (if less ordered) log.
+                LOG(EXTENSION_LOG_WARNING, "Failed to rename access log file "
+                    "from '%s' to '%s': %s", runs.c_str(), next.c_str(),
+                    strerror(errno));
+                remove(runs.c_str());
                 updateStateFinalizer(true);
                 return;
             }
@@ -169,6 +190,105 @@ public:
     }
 
 private:
+    // The most runs mergeRuns() merges at once; with the default
+    // alog_block_size their block buffers take about 1MiB.
+    static const size_t maxMergeRuns = 128;
+
+    /**
+     * Write the new access log, next, from the log of runs written by the
+     * visit: each vBucket's runs (each of at most items_to_scan keys, sorted
+     * by seqno) are merged, so that the vBucket's keys are in seqno order.
+     *
+     * A vBucket's runs are contiguous in the log, so each vBucket is merged
+     * as soon as its last run has been found. Each run being merged holds an
+     * iterator (with its block buffer), so at most maxMergeRuns are merged
+     * at once; a vBucket with more runs than that is written as several
+     * merged runs, each in seqno order.
+     *
+     * @return true if next was written
+     */
+    bool mergeRuns() {
+        try {
+            MutationLog in(runs, blockSize);
+            in.open(true);
+            const auto end = in.end();
+
+            remove(next.c_str());
+            MutationLog out(next, blockSize);
+            out.open();
+            if (!out.isOpen()) {
+                return false;
+            }
+
+            // The start of each run of the vBucket being merged. Each run is
+            // ended by a commit.
+            std::vector<MutationLog::iterator> heads;
+            uint16_t vbid = 0;
+            bool runStart = true;
+            for (auto it = in.begin(); it != end; ++it) {
+                const auto le = *it;
+                if (le->type() != MutationLogType::New) {
+                    runStart = true;
+                } else if (runStart) {
+                    if (!heads.empty() && (le->vbucket() != vbid ||
+                                           heads.size() == maxMergeRuns)) {
+                        mergeHeads(vbid, heads, end, out);
+                    }
+                    vbid = le->vbucket();
+                    heads.push_back(it);
+                    runStart = false;
+                }
+            }
+            if (!heads.empty()) {
+                mergeHeads(vbid, heads, end, out);
+            }
+            return out.flush();
+        } catch (std::exception& e) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Failed to merge the runs of access log file '%s' into "
+                "'%s': %s",
+                runs.c_str(),
+                next.c_str(),
+                e.what());
+            return false;
+        }
+    }
+
+    /**
+     * Merge the runs starting at heads (all of vBucket vbid) into out as
+     * one run, and clear heads.
+     */
+    void mergeHeads(uint16_t vbid,
+                    std::vector<MutationLog::iterator>& heads,
+                    const MutationLog::iterator& end,
+                    MutationLog& out) {
+        // The runs by the seqno of their head, least first.
+        using Head = std::pair<uint64_t, size_t>;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> queue;
+        for (size_t ii = 0; ii < heads.size(); ++ii) {
+            queue.emplace((*heads[ii])->bySeqno(), ii);
+        }
+        while (!queue.empty()) {
+            const size_t run = queue.top().second;
+            auto& head = heads[run];
+            queue.pop();
+            {
+                const auto le = *head;
+                out.newItem(vbid, le->key(), le->bySeqno());
+            }
+            ++head;
+            if (head != end) {
+                const auto le = *head;
+                if (le->type() == MutationLogType::New) {
+                    queue.emplace(le->bySeqno(), run);
+                }
+            }
+        }
+        heads.clear();
+        out.commit1();
+        out.commit2();
+    }
+
     /**
      * Finalizer method called at the end of completing a visit.
      * @param created_log: Did we successfully create a MutationLog object on
@@ -196,10 +316,13 @@ private:
     hrtime_t taskStart;
     std::string prev;
     std::string next;
+    std::string runs;
     std::string name;
+    size_t blockSize;
     uint16_t shardID;
 
-    std::vector<StoredDocKey> accessed;
+    // The seqno and key of each item accessed since the last pause.
+    std::vector<std::pair<uint64_t, StoredDocKey>> accessed;
 
     std::unique_ptr<MutationLog> log;
     std::atomic<bool> &stateFinalizer;
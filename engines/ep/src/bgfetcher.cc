@@ -25,39 +25,115 @@
 #include "executorthread.h"
 #include "kv_bucket.h"
 #include "kvshard.h"
+#include "statwriter.h"
 #include "tasks.h"
 #include "vbucket_bgfetch_item.h"
 
 const double BgFetcher::sleepInterval = MIN_SLEEP_TIME;
 
 BgFetcher::BgFetcher(KVBucket& s, KVShard& k)
-    : BgFetcher(&s, &k, s.getEPEngine().getEpStats()) {
+    : BgFetcher(&s,
+                &k,
+                s.getEPEngine().getEpStats(),
+                std::chrono::microseconds(s.getEPEngine()
+                                                  .getConfiguration()
+                                                  .getBgFetchMaxWindow()),
+                s.getEPEngine().getConfiguration().getBgFetchTasksPerShard()) {
 }
 
 void BgFetcher::start() {
     bool inverse = false;
     pendingFetch.compare_exchange_strong(inverse, true);
     ExecutorPool* iom = ExecutorPool::get();
-    auto task = std::make_shared<MultiBGFetcherTask>(
-            &(store->getEPEngine()), this, false);
-    this->setTaskId(task->getId());
-    iom->schedule(task);
+    for (size_t i = 0; i < numTasks; ++i) {
+        auto task = std::make_shared<MultiBGFetcherTask>(
+                &(store->getEPEngine()), this, false);
+        taskIds.push_back(task->getId());
+        iom->schedule(task);
+    }
 }
 
 void BgFetcher::stop() {
     bool inverse = true;
     pendingFetch.compare_exchange_strong(inverse, false);
-    ExecutorPool::get()->cancel(taskId);
+    for (const auto taskId : taskIds) {
+        ExecutorPool::get()->cancel(taskId);
+    }
+    taskIds.clear();
+    std::lock_guard<std::mutex> lh(idleMutex);
+    idleTasks.clear();
 }
 
 void BgFetcher::notifyBGEvent(void) {
     ++stats.numRemainingBgItems;
+    ++queuedItems;
+    ++arrivals;
     bool inverse = false;
     if (pendingFetch.compare_exchange_strong(inverse, true)) {
+        // Wake one idle task to take this batch. If none is idle, the first
+        // task to finish its batch will see pendingFetch and run again.
+        size_t taskId;
+        {
+            std::lock_guard<std::mutex> lh(idleMutex);
+            if (idleTasks.empty()) {
+                return;
+            }
+            taskId = idleTasks.back();
+            idleTasks.pop_back();
+        }
         ExecutorPool::get()->wake(taskId);
     }
 }
 
+void BgFetcher::setIdle(size_t taskId, bool idle) {
+    std::lock_guard<std::mutex> lh(idleMutex);
+    auto it = std::find(idleTasks.begin(), idleTasks.end(), taskId);
+    if (idle && it == idleTasks.end()) {
+        idleTasks.push_back(taskId);
+    } else if (!idle && it != idleTasks.end()) {
+        idleTasks.erase(it);
+    }
+}
+
+std::chrono::microseconds BgFetcher::getFetchWindow() {
+    if (maxWindow == std::chrono::microseconds::zero()) {
+        return std::chrono::microseconds::zero();
+    }
+
+    const auto now = ProcessClock::now();
+    std::lock_guard<std::mutex> lh(estimateMutex);
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 now - lastArrivalSample)
+                                 .count();
+    if (elapsed > 0) {
+        const double rate = double(arrivals.exchange(0)) / elapsed;
+        arrivalRate = (arrivalRate * 7 + rate) / 8;
+        lastArrivalSample = now;
+    }
+
+    return computeFetchWindow(
+            maxWindow, arrivalRate, fetchLatency, queuedItems.load());
+}
+
+std::chrono::microseconds BgFetcher::computeFetchWindow(
+        std::chrono::microseconds maxWindow,
+        double arrivalRate,
+        double fetchLatency,
+        size_t queued) {
+    // Waiting longer than a fraction of the time the read takes costs more
+    // latency than the bigger batch saves. And it is only worth waiting if
+    // enough requests are expected meanwhile to grow the batch by half: at
+    // low load a request is fetched at once, and a deep queue is already a
+    // good batch.
+    const double window =
+            std::min(double(maxWindow.count()), fetchLatency / 4);
+    const double expected = arrivalRate * window;
+    if (queued == 0 || expected < 1 || expected < queued / 2.0) {
+        return std::chrono::microseconds::zero();
+    }
+    return std::chrono::microseconds(int64_t(window));
+}
+
 size_t BgFetcher::doFetch(VBucket::id_type vbId,
                           vb_bgfetch_queue_t& itemsToFetch) {
     ProcessClock::time_point startTime(ProcessClock::now());
@@ -71,9 +147,41 @@ size_t BgFetcher::doFetch(VBucket::id_type vbId,
                 .count());
 
     shard->getROUnderlying()->getMulti(vbId, itemsToFetch);
+    recordBatch(itemsToFetch.size(), startTime);
+
+    return completeFetch(vbId, itemsToFetch, startTime);
+}
 
+size_t BgFetcher::doFetch(multi_vb_bgfetch_queue_t& queues) {
+    ProcessClock::time_point startTime(ProcessClock::now());
+    size_t numDocs = 0;
+    for (const auto& queue : queues) {
+        numDocs += queue.second.size();
+    }
+    LOG(EXTENSION_LOG_DEBUG,
+        "BgFetcher is fetching data, numVbs:%" PRIu64 " numDocs:%" PRIu64
+        " startTime:%" PRIu64,
+        uint64_t(queues.size()),
+        uint64_t(numDocs),
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+                startTime.time_since_epoch())
+                .count());
+
+    shard->getROUnderlying()->getMultiVBuckets(queues);
+    recordBatch(numDocs, startTime);
+
+    size_t fetched = 0;
+    for (auto& queue : queues) {
+        fetched += completeFetch(queue.first, queue.second, startTime);
+    }
+    return fetched;
+}
+
+size_t BgFetcher::completeFetch(VBucket::id_type vbId,
+                                vb_bgfetch_queue_t& itemsFetched,
+                                ProcessClock::time_point startTime) {
     std::vector<bgfetched_item_t> fetchedItems;
-    for (const auto& fetch : itemsToFetch) {
+    for (const auto& fetch : itemsFetched) {
         auto& key = fetch.first;
         const vb_bgfetch_item_ctx_t& bg_item_ctx = fetch.second;
 
@@ -81,6 +189,10 @@ size_t BgFetcher::doFetch(VBucket::id_type vbId,
             // We don't want to transfer ownership of itm here as we clean it
             // up at the end of this method in clearItems()
             fetchedItems.push_back(std::make_pair(key, itm.get()));
+            waitHisto.add(
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                            startTime - itm->initTime)
+                            .count());
         }
     }
 
@@ -97,18 +209,55 @@ size_t BgFetcher::doFetch(VBucket::id_type vbId,
     return fetchedItems.size();
 }
 
+void BgFetcher::recordBatch(size_t size, ProcessClock::time_point startTime) {
+    const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            ProcessClock::now() - startTime);
+    batchSizeHisto.add(size);
+
+    std::lock_guard<std::mutex> lh(estimateMutex);
+    fetchLatency = (fetchLatency * 7 + latency.count()) / 8;
+}
+
 bool BgFetcher::run(GlobalTask *task) {
+    setIdle(task->getId(), false);
+
+    // Delay the fetch while a window is open for the batch to grow.
+    // pendingFetch stays set meanwhile, so new requests don't wake a task.
+    const auto now = ProcessClock::now();
+    int64_t end = windowEnd.load();
+    if (end == 0) {
+        const auto window = getFetchWindow();
+        if (window != std::chrono::microseconds::zero()) {
+            const int64_t newEnd = to_ns_since_epoch(now + window).count();
+            end = windowEnd.compare_exchange_strong(end, newEnd) ? newEnd
+                                                                 : end;
+        }
+    }
+    if (end != 0) {
+        const ProcessClock::time_point endTime{std::chrono::nanoseconds(end)};
+        if (now < endTime) {
+            task->snooze(endTime - now);
+            return true;
+        }
+        windowEnd.compare_exchange_strong(end, 0);
+    }
+
     size_t num_fetched_items = 0;
     bool inverse = true;
     pendingFetch.compare_exchange_strong(inverse, false);
 
-    std::vector<uint16_t> bg_vbs(pendingVbs.size());
+    std::vector<uint16_t> bg_vbs;
     {
         LockHolder lh(queueMutex);
         bg_vbs.assign(pendingVbs.begin(), pendingVbs.end());
         pendingVbs.clear();
     }
 
+    // Vbuckets sharing a file are read together; otherwise each is fetched
+    // (and completed) in turn.
+    const bool coalesce = !bg_vbs.empty() &&
+                          shard->getROUnderlying()->getNumVbsPerFile() > 1;
+    multi_vb_bgfetch_queue_t queues;
     for (const uint16_t vbId : bg_vbs) {
         VBucketPtr vb = shard->getBucket(vbId);
         if (vb) {
@@ -125,17 +274,26 @@ bool BgFetcher::run(GlobalTask *task) {
 
             auto items = vb->getBGFetchItems();
             if (items.size() > 0) {
-                num_fetched_items += doFetch(vbId, items);
+                if (coalesce) {
+                    queues[vbId] = std::move(items);
+                } else {
+                    num_fetched_items += doFetch(vbId, items);
+                }
             }
         }
     }
+    if (!queues.empty()) {
+        num_fetched_items += doFetch(queues);
+    }
 
     stats.numRemainingBgItems.fetch_sub(num_fetched_items);
+    queuedItems.fetch_sub(num_fetched_items);
 
     if (!pendingFetch.load()) {
         // wait a bit until next fetch request arrives
         double sleep = std::max(store->getBGFetchDelay(), sleepInterval);
         task->snooze(sleep);
+        setIdle(task->getId(), true);
 
         if (pendingFetch.load()) {
             // check again a new fetch request could have arrived
@@ -155,3 +313,15 @@ bool BgFetcher::pendingJob() const {
     }
     return false;
 }
+
+void BgFetcher::addStats(const std::string& prefix,
+                         ADD_STAT add_stat,
+                         const void* cookie) {
+    add_prefixed_stat(prefix, "batch_size", batchSizeHisto, add_stat, cookie);
+    add_prefixed_stat(prefix, "wait", waitHisto, add_stat, cookie);
+}
+
+void BgFetcher::resetStats() {
+    batchSizeHisto.reset();
+    waitHisto.reset();
+}
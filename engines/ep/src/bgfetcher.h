@@ -20,9 +20,12 @@
 
 #include "config.h"
 
+#include <chrono>
 #include <list>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "item.h"
 #include "kvstore.h"
@@ -36,7 +39,16 @@ class GlobalTask;
 
 /**
  * Dispatcher job responsible for batching data reads and push to
- * underlying storage
+ * underlying storage.
+ *
+ * A batch is whatever has been queued for the shard's vbuckets when a fetch
+ * task runs. With a maximum fetch window, the fetch may be delayed a little
+ * when that is expected to grow the batch: only while requests arrive
+ * faster than the queue would otherwise be drained, and by no more than a
+ * fraction of the observed disk latency (see getFetchWindow()). Several
+ * fetch tasks may run per shard, so a new batch can be fetched while
+ * earlier ones are still waiting on disk. Vbuckets sharing a KVStore file
+ * are fetched together.
  */
 class BgFetcher {
 public:
@@ -47,15 +59,35 @@ public:
      * @param s  The store
      * @param k  The shard to which this background fetcher belongs
      * @param st reference to statistics
+     * @param maxWindow the longest a fetch may be delayed to let its batch
+     *        grow (0 - never delayed)
+     * @param numTasks the number of fetch tasks, i.e. of batches which may
+     *        be outstanding at once
      */
-    BgFetcher(KVBucket* s, KVShard* k, EPStats &st) :
-        store(s), shard(k), taskId(0), stats(st), pendingFetch(false) {}
+    BgFetcher(KVBucket* s,
+              KVShard* k,
+              EPStats& st,
+              std::chrono::microseconds maxWindow =
+                      std::chrono::microseconds::zero(),
+              size_t numTasks = 1)
+        : store(s),
+          shard(k),
+          stats(st),
+          maxWindow(maxWindow),
+          numTasks(numTasks),
+          pendingFetch(false),
+          queuedItems(0),
+          arrivals(0),
+          windowEnd(0),
+          lastArrivalSample(ProcessClock::now()) {
+    }
 
     /**
      * Construct a BgFetcher
      *
      * Equivalent to above constructor except stats reference is obtained
-     * from KVBucket's reference to EPEngine's epstats.
+     * from KVBucket's reference to EPEngine's epstats, and the window and
+     * number of tasks from its configuration.
      *
      * @param s The store
      * @param k The shard to which this background fetcher belongs
@@ -77,23 +109,105 @@ public:
     bool run(GlobalTask *task);
     bool pendingJob(void) const;
     void notifyBGEvent(void);
-    void setTaskId(size_t newId) { taskId = newId; }
     void addPendingVB(VBucket::id_type vbId) {
         LockHolder lh(queueMutex);
         pendingVbs.insert(vbId);
     }
 
+    /**
+     * How long to delay fetching the queued items, so that more requests
+     * can join the batch.
+     *
+     * @return the window, or zero to fetch now
+     */
+    std::chrono::microseconds getFetchWindow();
+
+    /**
+     * The fetch window for the given estimates (see getFetchWindow()).
+     *
+     * @param maxWindow the longest the fetch may be delayed
+     * @param arrivalRate requests arriving per µs
+     * @param fetchLatency time (µs) a batch takes to read
+     * @param queued requests queued and not yet fetched
+     * @return the window, or zero to fetch now
+     */
+    static std::chrono::microseconds computeFetchWindow(
+            std::chrono::microseconds maxWindow,
+            double arrivalRate,
+            double fetchLatency,
+            size_t queued);
+
+    /**
+     * Forget requests which were queued but will not be fetched, as their
+     * vbucket has gone.
+     */
+    void dropQueuedItems(size_t count) {
+        queuedItems.fetch_sub(count);
+    }
+
+    /// Add the batch size and wait time histograms, named prefix:<stat>.
+    void addStats(const std::string& prefix,
+                  ADD_STAT add_stat,
+                  const void* cookie);
+
+    void resetStats();
+
 private:
+    /// Fetch one vbucket's items. @return the number of items fetched
     size_t doFetch(VBucket::id_type vbId, vb_bgfetch_queue_t& items);
 
+    /// Fetch several vbuckets' items together. @return as above
+    size_t doFetch(multi_vb_bgfetch_queue_t& queues);
+
+    /**
+     * Complete the fetched items of a vbucket, fetched from startTime.
+     * @return the number of items completed
+     */
+    size_t completeFetch(VBucket::id_type vbId,
+                         vb_bgfetch_queue_t& itemsFetched,
+                         ProcessClock::time_point startTime);
+
+    /// Account a batch of the given size, fetched from startTime.
+    void recordBatch(size_t size, ProcessClock::time_point startTime);
+
+    /// Mark the task as idle (snoozing with nothing to fetch), or not.
+    void setIdle(size_t taskId, bool idle);
+
     KVBucket* store;
     KVShard* shard;
-    size_t taskId;
+    std::vector<size_t> taskIds;
     std::mutex queueMutex;
     EPStats &stats;
+    const std::chrono::microseconds maxWindow;
+    const size_t numTasks;
 
     std::atomic<bool> pendingFetch;
     std::set<VBucket::id_type> pendingVbs;
+
+    //! Guards idleTasks.
+    std::mutex idleMutex;
+    //! The ids of the tasks which are idle, and so may be woken to fetch.
+    std::vector<size_t> idleTasks;
+
+    //! Requests queued and not yet fetched.
+    std::atomic<size_t> queuedItems;
+    //! Requests queued since the arrival rate was last sampled.
+    std::atomic<size_t> arrivals;
+    //! End (ns since epoch) of the window fetching is delayed for, if any.
+    std::atomic<int64_t> windowEnd;
+
+    //! Guards the estimates below, from which the fetch window is derived.
+    std::mutex estimateMutex;
+    ProcessClock::time_point lastArrivalSample;
+    //! Moving average of the request arrival rate (per µs).
+    double arrivalRate = 0;
+    //! Moving average of the time (µs) a batch takes to read.
+    double fetchLatency = 0;
+
+    //! Items per batch read from the KVStore.
+    Histogram<size_t> batchSizeHisto;
+    //! Time (µs) requests waited in the queue before their batch was read.
+    Histogram<hrtime_t> waitHisto;
 };
 
 #endif  // SRC_BGFETCHER_H_
@@ -71,6 +71,14 @@ public:
      */
     static Blob* Copy(const Blob& other);
 
+    /**
+     * Returns the number of bytes allocated for a Blob of the given length
+     * (as returned by length()).
+     */
+    static size_t getAllocationSize(size_t len) {
+        return sizeof(Blob) + len - sizeof(Blob(0, 0).data);
+    }
+
     // Actual accessorish things.
 
     /**
@@ -191,10 +199,6 @@ protected:
 
     explicit Blob(const Blob& other);
 
-    static size_t getAllocationSize(size_t len) {
-        return sizeof(Blob) + len - sizeof(Blob(0, 0).data);
-    }
-
     const uint32_t size;
     const uint8_t extMetaLen;
 
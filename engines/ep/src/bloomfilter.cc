@@ -21,7 +21,15 @@
 
 #include "murmurhash3.h"
 
+#include <platform/platform.h>
+
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #if __x86_64__ || __ppc64__
 #define MURMURHASH_3 MurmurHash3_x64_128
@@ -29,19 +37,40 @@
 #define MURMURHASH_3 MurmurHash3_x86_128
 #endif
 
+const size_t BloomFilter::blockBits;
+
+static const size_t wordsPerBlock = BloomFilter::blockBits / 64;
+
 BloomFilter::BloomFilter(size_t key_count, double false_positive_prob,
-                         bfilter_status_t new_status) {
+                         bfilter_status_t new_status, bool blocked)
+    : blocked(blocked) {
 
     status = new_status;
     filterSize = estimateFilterSize(key_count, false_positive_prob);
+    if (blocked) {
+        filterSize = estimateBlockedFilterSize(key_count, false_positive_prob);
+    }
     noOfHashes = estimateNoOfHashes(key_count);
     keyCounter = 0;
-    bitArray.assign(filterSize, false);
+    allocate();
 }
 
 BloomFilter::~BloomFilter() {
     status = BFILTER_DISABLED;
+    release();
+}
+
+void BloomFilter::allocate() {
+    // Room to align the start to a cache line.
+    bitArray.assign((filterSize + 63) / 64 + wordsPerBlock - 1, 0);
+    auto addr = reinterpret_cast<uintptr_t>(bitArray.data());
+    bits = bitArray.data() + ((64 - addr % 64) % 64) / sizeof(uint64_t);
+}
+
+void BloomFilter::release() {
     bitArray.clear();
+    bitArray.shrink_to_fit();
+    bits = nullptr;
 }
 
 size_t BloomFilter::estimateFilterSize(size_t key_count,
@@ -54,6 +83,50 @@ size_t BloomFilter::estimateNoOfHashes(size_t key_count) {
     return round(((double) filterSize / key_count) * (log(2.0)));
 }
 
+/// Round bits up to a whole number of blocks (at least one).
+static size_t roundToBlocks(size_t bits) {
+    const size_t blockBits = BloomFilter::blockBits;
+    return std::max(size_t(1), (bits + blockBits - 1) / blockBits) * blockBits;
+}
+
+double BloomFilter::blockedFalsePositiveRate(size_t key_count,
+                                             size_t filter_size,
+                                             size_t hashes) {
+    // The number of keys in a block is Poisson distributed; a block with i
+    // keys gives a false positive with probability (1 - (1 - 1/B)^(k*i))^k.
+    const double perBlock = double(key_count) * blockBits / filter_size;
+    const size_t maxKeys = size_t(perBlock + 10 * sqrt(perBlock) + 10);
+    double probKeys = exp(-perBlock);
+    double rate = 0;
+    for (size_t i = 0; i <= maxKeys; i++) {
+        rate += probKeys *
+                pow(1 - pow(1 - 1.0 / blockBits, double(hashes * i)), hashes);
+        probKeys *= perBlock / (i + 1);
+    }
+    return rate;
+}
+
+size_t BloomFilter::estimateBlockedFilterSize(size_t key_count,
+                                              double false_positive_prob) {
+    // Start from the size of a standard filter, and grow it until the
+    // uneven spread of keys over blocks no longer pushes the rate above
+    // that configured.
+    size_t size = roundToBlocks(filterSize);
+    if (key_count == 0) {
+        return size;
+    }
+    for (int i = 0; i < 100; i++) {
+        const size_t hashes = std::max(
+                size_t(1), size_t(round(double(size) / key_count * log(2.0))));
+        if (blockedFalsePositiveRate(key_count, size, hashes) <=
+            false_positive_prob) {
+            break;
+        }
+        size = roundToBlocks(size + size / 50);
+    }
+    return size;
+}
+
 uint64_t BloomFilter::hashDocKey(const DocKey& key, uint32_t iteration) {
     uint64_t result = 0;
     uint32_t seed = iteration + (uint32_t(key.getDocNamespace()) * noOfHashes);
@@ -61,6 +134,58 @@ uint64_t BloomFilter::hashDocKey(const DocKey& key, uint32_t iteration) {
     return result;
 }
 
+uint64_t* BloomFilter::getBlock(const DocKey& key, uint64_t* mask) {
+    const uint64_t hash = hashDocKey(key, 0);
+
+    // The upper half of the hash picks the block, and the bits within it
+    // are the top bits of successive steps of a 64-bit LCG seeded with the
+    // hash. (Double hashing within a block repeats patterns enough to
+    // raise the false positive rate well above what's expected.)
+    const uint64_t block = ((hash >> 32) * (filterSize / blockBits)) >> 32;
+    uint64_t state = hash;
+    std::memset(mask, 0, wordsPerBlock * sizeof(uint64_t));
+    for (uint32_t i = 0; i < noOfHashes; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        const uint32_t bit = uint32_t(state >> 55); // 9 bits: [0, 512)
+        mask[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    return bits + block * wordsPerBlock;
+}
+
+/// Whether all the bits of mask are set in block (both 64-byte aligned).
+static bool blockContains(const uint64_t* block, const uint64_t* mask) {
+#if defined(__AVX2__)
+    for (size_t i = 0; i < wordsPerBlock; i += 4) {
+        const __m256i b =
+                _mm256_load_si256(reinterpret_cast<const __m256i*>(block + i));
+        const __m256i m =
+                _mm256_load_si256(reinterpret_cast<const __m256i*>(mask + i));
+        if (!_mm256_testc_si256(b, m)) {
+            return false;
+        }
+    }
+    return true;
+#elif defined(__SSE2__)
+    for (size_t i = 0; i < wordsPerBlock; i += 2) {
+        const __m128i b =
+                _mm_load_si128(reinterpret_cast<const __m128i*>(block + i));
+        const __m128i m =
+                _mm_load_si128(reinterpret_cast<const __m128i*>(mask + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, m), m)) !=
+            0xffff) {
+            return false;
+        }
+    }
+    return true;
+#else
+    uint64_t missing = 0;
+    for (size_t i = 0; i < wordsPerBlock; i++) {
+        missing |= mask[i] & ~block[i];
+    }
+    return missing == 0;
+#endif
+}
+
 void BloomFilter::setStatus(bfilter_status_t to) {
     switch (status) {
         case BFILTER_DISABLED:
@@ -71,7 +196,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_PENDING:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                release();
             } else if (to == BFILTER_COMPACTING) {
                 status = to;
             }
@@ -79,7 +204,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_COMPACTING:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                release();
             } else if (to == BFILTER_ENABLED) {
                 status = to;
             }
@@ -87,7 +212,7 @@ void BloomFilter::setStatus(bfilter_status_t to) {
         case BFILTER_ENABLED:
             if (to == BFILTER_DISABLED) {
                 status = to;
-                bitArray.clear();
+                release();
             } else if (to == BFILTER_COMPACTING) {
                 status = to;
             }
@@ -116,12 +241,22 @@ std::string BloomFilter::getStatusString() {
 void BloomFilter::addKey(const DocKey& key) {
     if (status == BFILTER_COMPACTING || status == BFILTER_ENABLED) {
         bool overlap = true;
-        for (uint32_t i = 0; i < noOfHashes; i++) {
-            uint64_t result = hashDocKey(key, i);
-            if (overlap && bitArray[result % filterSize] == 0) {
-                overlap = false;
+        if (blocked) {
+            alignas(64) uint64_t mask[wordsPerBlock];
+            uint64_t* block = getBlock(key, mask);
+            overlap = blockContains(block, mask);
+            for (size_t i = 0; i < wordsPerBlock; i++) {
+                block[i] |= mask[i];
+            }
+        } else {
+            for (uint32_t i = 0; i < noOfHashes; i++) {
+                uint64_t result = hashDocKey(key, i) % filterSize;
+                uint64_t bit = uint64_t(1) << (result % 64);
+                if (overlap && (bits[result / 64] & bit) == 0) {
+                    overlap = false;
+                }
+                bits[result / 64] |= bit;
             }
-            bitArray[result % filterSize] = 1;
         }
         if (!overlap) {
             keyCounter++;
@@ -131,9 +266,13 @@ void BloomFilter::addKey(const DocKey& key) {
 
 bool BloomFilter::maybeKeyExists(const DocKey& key) {
     if (status == BFILTER_COMPACTING || status == BFILTER_ENABLED) {
+        if (blocked) {
+            alignas(64) uint64_t mask[wordsPerBlock];
+            return blockContains(getBlock(key, mask), mask);
+        }
         for (uint32_t i = 0; i < noOfHashes; i++) {
-            uint64_t result = hashDocKey(key, i);
-            if (bitArray[result % filterSize] == 0) {
+            uint64_t result = hashDocKey(key, i) % filterSize;
+            if ((bits[result / 64] & (uint64_t(1) << (result % 64))) == 0) {
                 // The key does NOT exist.
                 return false;
             }
@@ -158,3 +297,72 @@ size_t BloomFilter::getFilterSize() {
         return 0;
     }
 }
+
+namespace {
+/**
+ * Layout of a serialized filter; followed by its bits, as 64-bit words. All
+ * are in network byte order.
+ */
+struct SerializedHeader {
+    uint64_t blocked;
+    uint64_t filterSize;
+    uint64_t noOfHashes;
+    uint64_t keyCounter;
+};
+} // anonymous namespace
+
+std::string BloomFilter::serialize() const {
+    const SerializedHeader header{htonll(blocked),
+                                  htonll(filterSize),
+                                  htonll(noOfHashes),
+                                  htonll(keyCounter)};
+    const size_t words = (filterSize + 63) / 64;
+    std::string data(sizeof(header) + words * sizeof(uint64_t), '\0');
+    std::memcpy(&data[0], &header, sizeof(header));
+    if (bits) {
+        for (size_t i = 0; i < words; i++) {
+            const uint64_t word = htonll(bits[i]);
+            std::memcpy(&data[sizeof(header) + i * sizeof(word)],
+                        &word,
+                        sizeof(word));
+        }
+    }
+    return data;
+}
+
+std::unique_ptr<BloomFilter> BloomFilter::deserialize(
+        const std::string& data) {
+    SerializedHeader header;
+    if (data.size() < sizeof(header)) {
+        return nullptr;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    header.blocked = ntohll(header.blocked);
+    header.filterSize = ntohll(header.filterSize);
+    header.noOfHashes = ntohll(header.noOfHashes);
+    header.keyCounter = ntohll(header.keyCounter);
+    const size_t words = (header.filterSize + 63) / 64;
+    if (header.filterSize == 0 || header.noOfHashes == 0 ||
+        header.blocked > 1 ||
+        data.size() != sizeof(header) + words * sizeof(uint64_t) ||
+        (header.blocked && header.filterSize % blockBits != 0)) {
+        return nullptr;
+    }
+
+    // Not using make_unique due to the protected constructor.
+    std::unique_ptr<BloomFilter> filter(new BloomFilter());
+    filter->status = BFILTER_ENABLED;
+    filter->blocked = header.blocked;
+    filter->filterSize = header.filterSize;
+    filter->noOfHashes = header.noOfHashes;
+    filter->keyCounter = header.keyCounter;
+    filter->allocate();
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        std::memcpy(&word,
+                    data.data() + sizeof(header) + i * sizeof(word),
+                    sizeof(word));
+        filter->bits[i] = ntohll(word);
+    }
+    return filter;
+}
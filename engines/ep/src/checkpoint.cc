@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <platform/checked_snprintf.h>
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
@@ -124,7 +125,10 @@ Checkpoint::Checkpoint(EPStats& st,
       numItems(0),
       numMetaItems(0),
       memOverhead(0),
-      effectiveMemUsage(0) {
+      keyIndexMemory(keyIndex.memorySize() + metaKeyIndex.memorySize()),
+      effectiveMemUsage(0),
+      highestExpelledSeqno(0) {
+    memOverhead += keyIndexMemory;
     stats.memOverhead->fetch_add(memorySize());
     if (stats.memOverhead->load() >= GIGANTOR) {
         LOG(EXTENSION_LOG_WARNING,
@@ -165,7 +169,7 @@ void Checkpoint::popBackCheckpointEndItem() {
 }
 
 bool Checkpoint::keyExists(const DocKey& key) {
-    return keyIndex.find(key) != keyIndex.end();
+    return keyIndex.find(key) != nullptr;
 }
 
 queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
@@ -176,7 +180,8 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
                         ") is not OPEN");
     }
     queue_dirty_t rv;
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    const index_entry* existing = keyIndex.find(qi->getKey());
+    CheckpointQueue::iterator currPos;
     // Check if the item is a meta item
     if (qi->isCheckPointMetaItem()) {
         // empty items act only as a dummy element for the start of the
@@ -189,10 +194,10 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         toWrite.push_back(qi);
     } else {
         // Check if this checkpoint already had an item for the same key
-        if (it != keyIndex.end()) {
+        if (existing) {
             rv = EXISTING_ITEM;
-            CheckpointQueue::iterator currPos = it->second.position;
-            const int64_t currMutationId{it->second.mutation_id};
+            currPos = existing->position;
+            const int64_t currMutationId{existing->mutation_id};
 
             // Given the key already exists, need to check all cursors in this
             // Checkpoint and see if the existing item for this key is to
@@ -211,7 +216,7 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
                                                                 : keyIndex;
 
                     auto cursor_item_idx = index.find(cursor_item->getKey());
-                    if (cursor_item_idx == keyIndex.end()) {
+                    if (cursor_item_idx == nullptr) {
                         throw std::logic_error("Checkpoint::queueDirty: Unable "
                                 "to find key with"
                                 " op:" + to_string(cursor_item->getOperation()) +
@@ -226,7 +231,7 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
                     // decrement if the the existing item is strictly less than
                     // the cursor, as meta-items can share a seqno with
                     // a non-meta item but are logically before them.
-                    int64_t cursor_mutation_id{cursor_item_idx->second.mutation_id};
+                    int64_t cursor_mutation_id{cursor_item_idx->mutation_id};
                     if (cursor_item->isCheckPointMetaItem()) {
                         --cursor_mutation_id;
                     }
@@ -249,8 +254,9 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
             }
 
             toWrite.push_back(qi);
-            // Remove the existing item for the same key from the list.
-            toWrite.erase(currPos);
+            // The existing item for the same key is removed from the list
+            // once the index refers to the new item (below) - the index
+            // entry's key is that of the item it refers to.
         } else {
             ++numItems;
             rv = NEW_ITEM;
@@ -267,13 +273,13 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         // the list.
         if (qi->isCheckPointMetaItem()) {
             // We add a meta item only once to a checkpoint
-            metaKeyIndex[qi->getKey()] = entry;
+            metaKeyIndex.set(qi->getKey(), entry);
         } else {
-            keyIndex[qi->getKey()] = entry;
+            keyIndex.set(qi->getKey(), entry);
         }
         if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getKey().size() +
-                                  sizeof(index_entry) + sizeof(queued_item);
+            updateKeyIndexMemory();
+            size_t newEntrySize = sizeof(queued_item);
             memOverhead += newEntrySize;
             stats.memOverhead->fetch_add(newEntrySize);
             if (stats.memOverhead->load() >= GIGANTOR) {
@@ -285,6 +291,11 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         }
     }
 
+    if (rv != NEW_ITEM) {
+        // Remove the existing item for the same key from the list.
+        toWrite.erase(currPos);
+    }
+
     // Notify flusher if in case queued item is a checkpoint meta item or
     // vbpersist state.
     if (qi->getOperation() == queue_op::checkpoint_start ||
@@ -312,16 +323,21 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
 
     CheckpointQueue::iterator itr = toWrite.begin();
     uint64_t seqno = pPrevCheckpoint->getMutationIdForKey(Checkpoint::DummyKey, true);
-    metaKeyIndex[Checkpoint::DummyKey].mutation_id = seqno;
+    metaKeyIndex.find(Checkpoint::DummyKey)->mutation_id = seqno;
     (*itr)->setBySeqno(seqno);
 
     seqno = pPrevCheckpoint->getMutationIdForKey(Checkpoint::CheckpointStartKey, true);
-    metaKeyIndex[Checkpoint::CheckpointStartKey].mutation_id = seqno;
+    metaKeyIndex.find(Checkpoint::CheckpointStartKey)->mutation_id = seqno;
     ++itr;
     (*itr)->setBySeqno(seqno);
 
-    // Iterate in reverse over the previous checkpoints' items, inserting them
-    // into the current checkpoint as necessary.
+    // An item to be (re)queued, with its mutation id.
+    using QueuedEntry = std::pair<queued_item, int64_t>;
+
+    // Iterate in reverse over the previous checkpoints' items, collecting
+    // those which need inserting into the current checkpoint.
+    std::vector<QueuedEntry> prevItems;
+    std::vector<StoredDocKey> prevMetaKeys;
     for (auto rit = pPrevCheckpoint->rbegin(); rit != pPrevCheckpoint->rend();
             ++rit) {
         const auto key = (*rit)->getKey();
@@ -331,15 +347,15 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
                 // For the two 'normal' operations, re-insert into the current
                 // checkpoint if the key isn't already present (if it is already
                 // present then it must be an older revision and hence we can
-                // safely discard it).
-                if (keyIndex.find(key) == keyIndex.end()) {
-                    // Skip the first two meta items (empty & checkpoint start).
-                    auto pos = std::next(toWrite.begin(), 2);
-                    toWrite.insert(pos, *rit);
-                    index_entry entry = {--pos, static_cast<int64_t>(pPrevCheckpoint->
-                                                    getMutationIdForKey(key, false))};
-                    keyIndex[key] = entry;
-                    newEntryMemOverhead += key.size() + sizeof(index_entry);
+                // safely discard it). Keys are unique within the previous
+                // checkpoint, as it has already been de-duplicated.
+                if (keyIndex.find(key) == nullptr) {
+                    prevItems.emplace_back(
+                            *rit,
+                            static_cast<int64_t>(
+                                    pPrevCheckpoint->getMutationIdForKey(
+                                            key, false)));
+                    newEntryMemOverhead += sizeof(queued_item);
                     ++numItems;
                     ++numNewItems;
 
@@ -370,14 +386,16 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
             case queue_op::set_vbucket_state:
             case queue_op::system_event:
                 // Need to re-insert these into the correct place in the index.
-                if (metaKeyIndex.find(key) == metaKeyIndex.end()) {
-                    // Skip the first two meta items (empty & checkpoint start).
-                    auto pos = std::next(toWrite.begin(), 2);
-                    toWrite.insert(pos, *rit);
-                    auto mutationId = static_cast<int64_t>(
-                            pPrevCheckpoint->getMutationIdForKey(key, true));
-                    metaKeyIndex[key] = {--pos, mutationId};
-                    newEntryMemOverhead += key.size() + sizeof(index_entry);
+                if (metaKeyIndex.find(key) == nullptr &&
+                    std::find(prevMetaKeys.begin(), prevMetaKeys.end(), key) ==
+                            prevMetaKeys.end()) {
+                    prevMetaKeys.push_back(key);
+                    prevItems.emplace_back(
+                            *rit,
+                            static_cast<int64_t>(
+                                    pPrevCheckpoint->getMutationIdForKey(
+                                            key, true)));
+                    newEntryMemOverhead += sizeof(queued_item);
                     ++numMetaItems;
                     ++numNewItems;
 
@@ -388,6 +406,42 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
         }
     }
 
+    // The collected items belong after the first two meta items (empty &
+    // checkpoint start), in their original order. Rather than move every
+    // item of this checkpoint back, requeue those two meta items at the
+    // front, followed by the collected items, and erase their old positions;
+    // iterators to this checkpoint's other items remain valid. The caller
+    // repositions any cursors.
+    const auto oldEmpty = toWrite.begin();
+    const auto oldStart = std::next(oldEmpty);
+    std::vector<QueuedEntry> front;
+    front.reserve(prevItems.size() + 2);
+    for (const auto& qi : {*oldEmpty, *oldStart}) {
+        front.emplace_back(qi, metaKeyIndex.find(qi->getKey())->mutation_id);
+    }
+    front.insert(front.end(), prevItems.rbegin(), prevItems.rend());
+
+    std::vector<queued_item> frontItems;
+    frontItems.reserve(front.size());
+    for (const auto& item : front) {
+        frontItems.push_back(item.first);
+    }
+    toWrite.prepend(frontItems);
+
+    // (Index entries must move before the items they refer to are erased.)
+    auto pos = toWrite.begin();
+    for (const auto& item : front) {
+        const auto& qi = item.first;
+        if (qi->getKey().size() > 0) {
+            auto& index = qi->isCheckPointMetaItem() ? metaKeyIndex : keyIndex;
+            index.set(qi->getKey(), {pos, item.second});
+        }
+        ++pos;
+    }
+    toWrite.erase(oldStart);
+    toWrite.erase(oldEmpty);
+    updateKeyIndexMemory();
+
     /**
      * Update snapshot start of current checkpoint to the first
      * item's sequence number, after merge completed, as items
@@ -395,6 +449,8 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
      * checkpoint.
      */
     setSnapshotStartSeqno(getLowSeqno());
+    highestExpelledSeqno = std::max(highestExpelledSeqno,
+                                    pPrevCheckpoint->getHighestExpelledSeqno());
 
     memOverhead += newEntryMemOverhead;
     stats.memOverhead->fetch_add(newEntryMemOverhead);
@@ -405,13 +461,44 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
     return numNewItems;
 }
 
+ExpelResult Checkpoint::expelItems(CheckpointQueue::iterator last) {
+    ExpelResult result;
+    auto itr = toWrite.begin();
+    while (itr != last) {
+        if (itr == toWrite.end()) {
+            throw std::invalid_argument(
+                    "Checkpoint::expelItems: last is not in checkpoint " +
+                    std::to_string(checkpointId));
+        }
+        auto next = std::next(itr);
+        const auto& qi = *itr;
+        if (!qi->isCheckPointMetaItem()) {
+            highestExpelledSeqno = qi->getBySeqno();
+            result.memory += qi->size() + sizeof(queued_item);
+            ++result.count;
+            effectiveMemUsage -= std::min(effectiveMemUsage, qi->size());
+            // The index entry refers to the item's key, so must be removed
+            // first.
+            keyIndex.erase(qi->getKey());
+            toWrite.erase(itr);
+        }
+        itr = next;
+    }
+
+    numItems -= result.count;
+    const size_t overhead = result.count * sizeof(queued_item);
+    memOverhead -= overhead;
+    stats.memOverhead->fetch_sub(overhead);
+    return result;
+}
+
 uint64_t Checkpoint::getMutationIdForKey(const DocKey& key, bool isMeta) {
     uint64_t mid = 0;
-    checkpoint_index& chkIdx = isMeta ? metaKeyIndex : keyIndex;
+    CheckpointIndex& chkIdx = isMeta ? metaKeyIndex : keyIndex;
 
-    checkpoint_index::iterator it = chkIdx.find(key);
-    if (it != chkIdx.end()) {
-        mid = it->second.mutation_id;
+    const index_entry* entry = chkIdx.find(key);
+    if (entry) {
+        mid = entry->mutation_id;
     } else {
         throw std::invalid_argument("key{" +
                                     std::string(reinterpret_cast<const char*>(key.data())) +
@@ -422,6 +509,18 @@ uint64_t Checkpoint::getMutationIdForKey(const DocKey& key, bool isMeta) {
     return mid;
 }
 
+void Checkpoint::updateKeyIndexMemory() {
+    const size_t current = keyIndex.memorySize() + metaKeyIndex.memorySize();
+    if (current > keyIndexMemory) {
+        memOverhead += current - keyIndexMemory;
+        stats.memOverhead->fetch_add(current - keyIndexMemory);
+    } else {
+        memOverhead -= keyIndexMemory - current;
+        stats.memOverhead->fetch_sub(keyIndexMemory - current);
+    }
+    keyIndexMemory = current;
+}
+
 bool Checkpoint::isEligibleToBeUnreferenced() {
     const std::set<std::string> &cursors = getCursorNameList();
     std::set<std::string>::const_iterator cit = cursors.begin();
@@ -678,7 +777,9 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(
         uint64_t en = (*itr)->getHighSeqno();
         uint64_t st = (*itr)->getLowSeqno();
 
-        if (startBySeqno < st) {
+        const uint64_t expelled = (*itr)->getHighestExpelledSeqno();
+
+        if (startBySeqno < st || startBySeqno < expelled) {
             // Requested sequence number is before the start of this
             // checkpoint, position cursor at the checkpoint start.
             connCursors[name] = CheckpointCursor(name, itr, (*itr)->begin(),
@@ -686,7 +787,14 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(
                                                  false,
                                                  needsCheckPointEndMetaItem);
             (*itr)->registerCursorName(name);
-            result.first = (*itr)->getLowSeqno();
+            if (expelled > 0) {
+                // Items up to `expelled` are no longer in memory; report the
+                // first seqno which is, so the caller backfills the rest.
+                result.first = expelled + 1;
+                result.second = true;
+            } else {
+                result.first = (*itr)->getLowSeqno();
+            }
             break;
         } else if (startBySeqno <= en) {
             // Requested sequence number lies within this checkpoint.
@@ -722,8 +830,10 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(
         }
     }
 
-    result.second = (result.first == checkpointList.front()->getLowSeqno()) ?
-                    true : false;
+    if (!result.second) {
+        result.second =
+                result.first == checkpointList.front()->getLowSeqno();
+    }
 
     if (result.first == std::numeric_limits<uint64_t>::max()) {
         /*
@@ -1021,6 +1131,44 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
     return numUnrefItems;
 }
 
+ExpelResult CheckpointManager::expelUnreferencedCheckpointItems() {
+    LockHolder lh(queueLock);
+
+    // Only the oldest checkpoint can have items which every cursor has
+    // processed - any cursor not in it has moved past all of it.
+    auto oldest = checkpointList.begin();
+    std::vector<CheckpointQueue::iterator> positions;
+    for (const auto& cursor : connCursors) {
+        if (cursor.second.currentCheckpoint == oldest) {
+            positions.push_back(cursor.second.currentPos);
+        }
+    }
+    if (positions.empty()) {
+        // Unreferenced; removeClosedUnrefCheckpoints() frees the whole
+        // checkpoint once it is closed.
+        return {};
+    }
+
+    // Cursors point at the last item they processed, so expel up to (but
+    // not including) the earliest cursor position.
+    auto earliest = (*oldest)->begin();
+    while (std::find(positions.begin(), positions.end(), earliest) ==
+           positions.end()) {
+        ++earliest;
+    }
+
+    const auto result = (*oldest)->expelItems(earliest);
+    if (result.count > 0) {
+        numItems.fetch_sub(result.count);
+        for (auto& cursor : connCursors) {
+            cursor.second.decrOffset(result.count);
+        }
+        stats.itemsExpelledFromCheckpoints.fetch_add(result.count);
+        stats.memFreedByCheckpointItemExpel.fetch_add(result.memory);
+    }
+    return result;
+}
+
 void CheckpointManager::removeInvalidCursorsOnCheckpoint(
                                                      Checkpoint *pCheckpoint) {
     std::list<std::string> invalidCursorNames;
@@ -2049,6 +2197,14 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
         checked_snprintf(buf, sizeof(buf), "vb_%d:mem_usage", vbucketId);
         add_casted_stat(buf, getMemoryUsage_UNLOCKED(), add_stat, cookie);
 
+        size_t keyIndexMemUsage = 0;
+        for (const auto& checkpoint : checkpointList) {
+            keyIndexMemUsage += checkpoint->getKeyIndexMemory();
+        }
+        checked_snprintf(buf, sizeof(buf), "vb_%d:key_index_mem_usage",
+                         vbucketId);
+        add_casted_stat(buf, keyIndexMemUsage, add_stat, cookie);
+
         cursor_index::iterator cur_it = connCursors.begin();
         for (; cur_it != connCursors.end(); ++cur_it) {
             checked_snprintf(buf, sizeof(buf),
@@ -21,6 +21,8 @@
 #include "config.h"
 
 #include "callbacks.h"
+#include "checkpoint_index.h"
+#include "checkpoint_queue.h"
 #include "ep_types.h"
 #include "item.h"
 #include "monotonic.h"
@@ -59,18 +61,6 @@ enum checkpoint_state {
 
 const char* to_string(enum checkpoint_state);
 
-// List is used for queueing mutations as vector incurs shift operations for
-// deduplication.
-typedef std::list<queued_item> CheckpointQueue;
-
-/**
- * A checkpoint index entry.
- */
-struct index_entry {
-    CheckpointQueue::iterator position;
-    int64_t mutation_id;
-};
-
 typedef struct {
     uint64_t start;
     uint64_t end;
@@ -89,11 +79,6 @@ enum class MustSendCheckpointEnd {
     YES
 };
 
-/**
- * The checkpoint index maps a key to a checkpoint index_entry.
- */
-typedef std::unordered_map<StoredDocKey, index_entry> checkpoint_index;
-
 /**
  * List of pairs containing checkpoint cursor name and corresponding flag
  * indicating whether we must send checkpoint end meta item for the cursor
@@ -284,6 +269,16 @@ enum queue_dirty_t {
     NEW_ITEM
 };
 
+/**
+ * Result of expelling items from a checkpoint.
+ */
+struct ExpelResult {
+    /// Number of items expelled.
+    size_t count = 0;
+    /// Estimated memory released (items plus their queue overhead).
+    size_t memory = 0;
+};
+
 /**
  * Representation of a checkpoint used in the unified queue for persistence and
  * replication.
@@ -554,10 +549,36 @@ public:
 
     /**
      * Returns the memory held by all the queued items which includes
-     * key, metadata and the blob.
+     * key, metadata and the blob, plus the queue's chunks holding them.
      */
     size_t getMemConsumption() {
-        return effectiveMemUsage;
+        return effectiveMemUsage + toWrite.memorySize();
+    }
+
+    /**
+     * Expel the non-meta items from the start of this checkpoint up to (but
+     * not including) the given position, releasing their memory. Meta items
+     * and the checkpoint's metadata (id, state, snapshot range) are kept.
+     * Every cursor must already have processed the expelled items.
+     * @param last the earliest cursor position in this checkpoint.
+     * @return the number of items expelled and the memory released.
+     */
+    ExpelResult expelItems(CheckpointQueue::iterator last);
+
+    /**
+     * Returns the highest seqno expelled from this checkpoint, or 0 if none
+     * have been. Items up to this seqno can no longer be read from memory.
+     */
+    uint64_t getHighestExpelledSeqno() const {
+        return highestExpelledSeqno;
+    }
+
+    /**
+     * Returns the memory used by this checkpoint's key indexes (included in
+     * memorySize()).
+     */
+    size_t getKeyIndexMemory() const {
+        return keyIndexMemory;
     }
 
     static const StoredDocKey DummyKey;
@@ -579,14 +600,24 @@ private:
     size_t numMetaItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
     CheckpointQueue                toWrite;
-    checkpoint_index               keyIndex;
+    CheckpointIndex                keyIndex;
     /* Index for meta keys like "dummy_key" */
-    checkpoint_index               metaKeyIndex;
+    CheckpointIndex                metaKeyIndex;
     size_t                         memOverhead;
+    // Memory used by keyIndex and metaKeyIndex (included in memOverhead).
+    size_t                         keyIndexMemory;
 
     // The following stat is to contain the memory consumption of all
     // the queued items in the given checkpoint.
     size_t                         effectiveMemUsage;
+    // Highest seqno of the items expelled from this checkpoint (0 if none).
+    uint64_t                       highestExpelledSeqno;
+
+    /**
+     * Account any change in the memory used by the key indexes in
+     * memOverhead (and the global stats).
+     */
+    void updateKeyIndexMemory();
 
     friend std::ostream& operator <<(std::ostream& os, const Checkpoint& m);
 };
@@ -636,6 +667,15 @@ public:
     size_t removeClosedUnrefCheckpoints(VBucket& vbucket,
                                         bool& newOpenCheckpointCreated);
 
+    /**
+     * Expel the items at the start of the oldest checkpoint which every
+     * cursor has already processed, so a slow cursor holding a checkpoint
+     * open doesn't keep all its items in memory. The checkpoint itself
+     * (and its meta items) remain.
+     * @return the number of items expelled and the memory released.
+     */
+    ExpelResult expelUnreferencedCheckpointItems();
+
     /**
      * Register the cursor for getting items whose bySeqno values are between
      * startBySeqno and endBySeqno, and close the open checkpoint if endBySeqno
@@ -645,7 +685,8 @@ public:
      *        must not be skipped for the cursor.
      * @return Cursor registration result which consists of (1) the bySeqno with
      * which the cursor can start and (2) flag indicating if the cursor starts
-     * with the first item on a checkpoint.
+     * with the first item on a checkpoint, or after items which have been
+     * expelled (i.e. earlier items may need backfilling).
      */
     CursorRegResult registerCursorBySeqno(
                             const std::string &name,
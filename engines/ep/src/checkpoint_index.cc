@@ -0,0 +1,129 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "checkpoint_index.h"
+
+#include <cstring>
+
+// A checkpoint always indexes at least a couple of meta items; start small as
+// there are two indexes per checkpoint.
+static const size_t initialCapacity = 8;
+
+static bool sameKey(const DocKey& a, const DocKey& b) {
+    return a.size() == b.size() &&
+           a.getDocNamespace() == b.getDocNamespace() &&
+           std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+CheckpointIndex::CheckpointIndex()
+    : slots(new Slot[initialCapacity]()),
+      capacity(initialCapacity),
+      numEntries(0) {
+}
+
+index_entry* CheckpointIndex::find(const DocKey& key) {
+    auto& slot = slots[findSlot(key, key.hash())];
+    return slot.used ? &slot.entry : nullptr;
+}
+
+const index_entry* CheckpointIndex::find(const DocKey& key) const {
+    const auto& slot = slots[findSlot(key, key.hash())];
+    return slot.used ? &slot.entry : nullptr;
+}
+
+bool CheckpointIndex::set(const DocKey& key, const index_entry& entry) {
+    const uint32_t hash = key.hash();
+    auto* slot = &slots[findSlot(key, hash)];
+    if (slot->used) {
+        slot->entry = entry;
+        return false;
+    }
+
+    // Keep the load factor at or below 3/4.
+    if ((numEntries + 1) * 4 > capacity * 3) {
+        grow();
+        slot = &slots[findSlot(key, hash)];
+    }
+    slot->entry = entry;
+    slot->hash = hash;
+    slot->used = true;
+    ++numEntries;
+    return true;
+}
+
+bool CheckpointIndex::erase(const DocKey& key) {
+    const size_t mask = capacity - 1;
+    size_t hole = findSlot(key, key.hash());
+    if (!slots[hole].used) {
+        return false;
+    }
+    slots[hole] = Slot();
+    --numEntries;
+
+    // Shift back any following entries in the probe sequence which could
+    // occupy the hole, so lookups never stop early at it.
+    for (size_t next = (hole + 1) & mask; slots[next].used;
+         next = (next + 1) & mask) {
+        const size_t home = slots[next].hash & mask;
+        // Can the entry at `next` move to `hole` - i.e. is its home not
+        // cyclically within (hole, next]?
+        const bool movable = (hole <= next) ? (home <= hole || home > next)
+                                            : (home <= hole && home > next);
+        if (movable) {
+            slots[hole] = slots[next];
+            slots[next] = Slot();
+            hole = next;
+        }
+    }
+    return true;
+}
+
+void CheckpointIndex::clear() {
+    slots.reset(new Slot[initialCapacity]());
+    capacity = initialCapacity;
+    numEntries = 0;
+}
+
+size_t CheckpointIndex::findSlot(const DocKey& key, uint32_t hash) const {
+    const size_t mask = capacity - 1;
+    for (size_t ii = hash & mask;; ii = (ii + 1) & mask) {
+        const auto& slot = slots[ii];
+        if (!slot.used ||
+            (slot.hash == hash &&
+             sameKey((*slot.entry.position)->getKey(), key))) {
+            return ii;
+        }
+    }
+}
+
+void CheckpointIndex::grow() {
+    std::unique_ptr<Slot[]> old(new Slot[capacity * 2]());
+    old.swap(slots);
+    const size_t oldCapacity = capacity;
+    capacity *= 2;
+
+    const size_t mask = capacity - 1;
+    for (size_t ii = 0; ii < oldCapacity; ++ii) {
+        if (old[ii].used) {
+            size_t pos = old[ii].hash & mask;
+            while (slots[pos].used) {
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = old[ii];
+        }
+    }
+}
@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "checkpoint_queue.h"
+
+#include <memcached/dockey.h>
+
+#include <cstdint>
+#include <memory>
+
+/**
+ * A checkpoint index entry.
+ */
+struct index_entry {
+    CheckpointQueue::iterator position;
+    int64_t mutation_id;
+};
+
+/**
+ * The checkpoint index maps the key of each item in a Checkpoint to its
+ * index_entry.
+ *
+ * A flat, open-addressing (linear probing) hash table. Entries don't hold a
+ * copy of their key - an entry's key is that of the item at its position, so
+ * adding an entry doesn't allocate (other than when the table grows) and key
+ * memory isn't duplicated. Consequently an entry must be updated (via set())
+ * or erased before its item is erased from the CheckpointQueue.
+ */
+class CheckpointIndex {
+public:
+    CheckpointIndex();
+
+    /**
+     * Return the entry for the given key, or nullptr if there is none.
+     */
+    index_entry* find(const DocKey& key);
+
+    const index_entry* find(const DocKey& key) const;
+
+    /**
+     * Add or replace the entry for the given key.
+     *
+     * @param key the key; must be the key of the item at entry.position.
+     * @return true if a new entry was added.
+     */
+    bool set(const DocKey& key, const index_entry& entry);
+
+    /**
+     * Remove the entry for the given key, if any.
+     * @return true if an entry was removed.
+     */
+    bool erase(const DocKey& key);
+
+    /// Remove all entries.
+    void clear();
+
+    /// Number of entries.
+    size_t size() const {
+        return numEntries;
+    }
+
+    /// Bytes used by the index.
+    size_t memorySize() const {
+        return sizeof(CheckpointIndex) + capacity * sizeof(Slot);
+    }
+
+private:
+    struct Slot {
+        index_entry entry;
+        uint32_t hash;
+        bool used;
+    };
+
+    /**
+     * Return the slot holding the given key, or the (empty) slot where it
+     * would be inserted.
+     */
+    size_t findSlot(const DocKey& key, uint32_t hash) const;
+
+    /// Double the capacity, re-inserting all entries.
+    void grow();
+
+    std::unique_ptr<Slot[]> slots;
+    // Number of slots; always a power of two.
+    size_t capacity;
+    size_t numEntries;
+};
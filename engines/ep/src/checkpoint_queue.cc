@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "checkpoint_queue.h"
+
+#include <platform/make_unique.h>
+
+#include <stdexcept>
+
+CheckpointQueue::CheckpointQueue()
+    : head(std::make_unique<Chunk>()),
+      tail(head.get()),
+      numItems(0),
+      numChunks(1) {
+}
+
+CheckpointQueue::~CheckpointQueue() {
+    // Free the chunks iteratively, rather than recursively via each chunk's
+    // next pointer.
+    while (head) {
+        head = std::move(head->next);
+    }
+}
+
+void CheckpointQueue::prepend(const std::vector<queued_item>& items) {
+    if (items.empty()) {
+        return;
+    }
+    auto first = std::make_unique<Chunk>();
+    Chunk* last = first.get();
+    size_t added = 1;
+    for (const auto& item : items) {
+        if (last->used == ChunkSize) {
+            last->next = std::make_unique<Chunk>();
+            last->next->prev = last;
+            last = last->next.get();
+            ++added;
+        }
+        last->items[last->used++] = item;
+    }
+
+    head->prev = last;
+    last->next = std::move(head);
+    head = std::move(first);
+    numItems += items.size();
+    numChunks += added;
+}
+
+void CheckpointQueue::erase(iterator pos) {
+    if (pos.queue != this || pos.chunk == nullptr || !*pos) {
+        throw std::invalid_argument(
+                "CheckpointQueue::erase: pos does not refer to an item");
+    }
+    Chunk* chunk = pos.chunk;
+    chunk->items[pos.slot].reset();
+    ++chunk->erased;
+    --numItems;
+
+    if (chunk->erased == chunk->used && chunk != tail &&
+        chunk != head.get()) {
+        // Nothing in this chunk can be referenced any more; unlink (and
+        // free) it.
+        std::unique_ptr<Chunk> next = std::move(chunk->next);
+        next->prev = chunk->prev;
+        chunk->prev->next = std::move(next);
+        --numChunks;
+    }
+}
+
+void CheckpointQueue::clear() {
+    std::unique_ptr<Chunk> rest = std::move(head->next);
+    while (rest) {
+        rest = std::move(rest->next);
+    }
+    head->items.fill(queued_item());
+    head->used = 0;
+    head->erased = 0;
+    tail = head.get();
+    numItems = 0;
+    numChunks = 1;
+}
+
+void CheckpointQueue::appendChunk() {
+    tail->next = std::make_unique<Chunk>();
+    tail->next->prev = tail;
+    tail = tail->next.get();
+    ++numChunks;
+}
@@ -0,0 +1,314 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "item.h"
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/**
+ * The ordered sequence of items in a Checkpoint.
+ *
+ * Items are appended into fixed-size chunks, so queueing an item normally
+ * costs no allocation and readers walk contiguous memory. Items are only
+ * ever appended (or, when checkpoints are merged, prepended); erase() (used when an item is de-duplicated) replaces the
+ * item with a tombstone which iteration skips. Hence erasing never moves
+ * other items, and an iterator to an item remains valid until that item is
+ * erased - as with std::list, which this replaces.
+ *
+ * Once every item in a chunk has been erased the chunk is freed (unless it
+ * is the last one, which is still being appended to), so a checkpoint which
+ * repeatedly de-duplicates the same keys does not accumulate tombstones.
+ *
+ * end() is a fixed sentinel: items appended after an iterator reached the
+ * last item are visited by incrementing that iterator, and decrementing
+ * end() always gives the (current) last item.
+ *
+ * Not thread-safe; guarded by the CheckpointManager's queueLock.
+ */
+class CheckpointQueue {
+    struct Chunk;
+
+public:
+    /// Number of items per chunk.
+    static const size_t ChunkSize = 64;
+
+    template <typename Value>
+    class Iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = queued_item;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Value*;
+        using reference = Value&;
+
+        Iterator() : queue(nullptr), chunk(nullptr), slot(0) {
+        }
+
+        // Allow conversion from iterator to const_iterator.
+        template <typename Other,
+                  typename = typename std::enable_if<
+                          std::is_const<Value>::value &&
+                          !std::is_const<Other>::value>::type>
+        Iterator(const Iterator<Other>& other)
+            : queue(other.queue), chunk(other.chunk), slot(other.slot) {
+        }
+
+        reference operator*() const {
+            return chunk->items[slot];
+        }
+
+        pointer operator->() const {
+            return &chunk->items[slot];
+        }
+
+        Iterator& operator++() {
+            CheckpointQueue::advance(chunk, slot);
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        Iterator& operator--() {
+            if (chunk == nullptr) {
+                // end(); move back from the last slot.
+                Chunk* c = queue->tail;
+                size_t s = c->used;
+                CheckpointQueue::retreat(c, s);
+                chunk = c;
+                slot = s;
+            } else {
+                CheckpointQueue::retreat(chunk, slot);
+            }
+            return *this;
+        }
+
+        Iterator operator--(int) {
+            Iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+
+        template <typename Other>
+        bool operator==(const Iterator<Other>& other) const {
+            return chunk == other.chunk && slot == other.slot;
+        }
+
+        template <typename Other>
+        bool operator!=(const Iterator<Other>& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        Iterator(const CheckpointQueue* queue, Chunk* chunk, size_t slot)
+            : queue(queue), chunk(chunk), slot(slot) {
+        }
+
+        const CheckpointQueue* queue;
+        // Null for end().
+        Chunk* chunk;
+        size_t slot;
+
+        friend class CheckpointQueue;
+        template <typename>
+        friend class Iterator;
+    };
+
+    using iterator = Iterator<queued_item>;
+    using const_iterator = Iterator<const queued_item>;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    CheckpointQueue();
+
+    ~CheckpointQueue();
+
+    CheckpointQueue(const CheckpointQueue&) = delete;
+    CheckpointQueue& operator=(const CheckpointQueue&) = delete;
+
+    /// Append an item.
+    void push_back(const queued_item& item) {
+        if (tail->used == ChunkSize) {
+            appendChunk();
+        }
+        tail->items[tail->used++] = item;
+        ++numItems;
+    }
+
+    /**
+     * Insert the items, in order, before the first item, in chunks of their
+     * own. Iterators to existing items remain valid, and the cost is
+     * proportional to the number of items inserted.
+     */
+    void prepend(const std::vector<queued_item>& items);
+
+    /**
+     * Erase the item at the given position. Iterators to the erased item
+     * are invalidated; all other iterators remain valid.
+     */
+    void erase(iterator pos);
+
+    /// Erase the last item.
+    void pop_back() {
+        erase(--end());
+    }
+
+    queued_item& back() {
+        return *--end();
+    }
+
+    const queued_item& back() const {
+        return *--end();
+    }
+
+    bool empty() const {
+        return numItems == 0;
+    }
+
+    /// Number of items (excluding erased items).
+    size_t size() const {
+        return numItems;
+    }
+
+    /// Erase all items.
+    void clear();
+
+    iterator begin() {
+        return first<iterator>();
+    }
+
+    const_iterator begin() const {
+        return first<const_iterator>();
+    }
+
+    iterator end() {
+        return iterator(this, nullptr, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, nullptr, 0);
+    }
+
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    /// Number of chunks currently allocated.
+    size_t getNumChunks() const {
+        return numChunks;
+    }
+
+    /// Bytes used by the queue's chunks (excluding the items themselves).
+    size_t memorySize() const {
+        return sizeof(CheckpointQueue) + numChunks * sizeof(Chunk);
+    }
+
+private:
+    struct Chunk {
+        std::array<queued_item, ChunkSize> items;
+        // Number of slots which have been appended to.
+        size_t used = 0;
+        // Number of those slots which have since been erased.
+        size_t erased = 0;
+        Chunk* prev = nullptr;
+        std::unique_ptr<Chunk> next;
+    };
+
+    template <typename It>
+    It first() const {
+        Chunk* chunk = head.get();
+        size_t slot = 0;
+        if (chunk->used == 0 || !chunk->items[0]) {
+            advance(chunk, slot);
+        }
+        return It(this, chunk, slot);
+    }
+
+    /**
+     * Move to the next item (skipping tombstones), or to end() (null chunk)
+     * if there is none.
+     */
+    static void advance(Chunk*& chunk, size_t& slot) {
+        ++slot;
+        while (chunk) {
+            for (; slot < chunk->used; ++slot) {
+                if (chunk->items[slot]) {
+                    return;
+                }
+            }
+            chunk = chunk->next.get();
+            slot = 0;
+        }
+    }
+
+    /**
+     * Move to the previous item (skipping tombstones).
+     * @throws std::out_of_range if there is no previous item (i.e. at the
+     *         first item, or end() of an empty queue).
+     */
+    static void retreat(Chunk*& chunk, size_t& slot) {
+        Chunk* c = chunk;
+        size_t s = slot;
+        while (true) {
+            while (s > 0) {
+                if (c->items[--s]) {
+                    chunk = c;
+                    slot = s;
+                    return;
+                }
+            }
+            if (c->prev == nullptr) {
+                throw std::out_of_range(
+                        "CheckpointQueue::retreat: no item before position");
+            }
+            c = c->prev;
+            s = c->used;
+        }
+    }
+
+    void appendChunk();
+
+    std::unique_ptr<Chunk> head;
+    Chunk* tail;
+    size_t numItems;
+    size_t numChunks;
+};
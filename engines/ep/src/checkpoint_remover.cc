@@ -28,7 +28,8 @@
 #include "connmap.h"
 
 /**
- * Remove all the closed unreferenced checkpoints for each vbucket.
+ * Remove all the closed unreferenced checkpoints for each vbucket, and
+ * (if enabled) expel the already processed items of the oldest checkpoint.
  */
 class CheckpointVisitor : public VBucketVisitor {
 public:
@@ -37,9 +38,10 @@ public:
      * Construct a CheckpointVisitor.
      */
     CheckpointVisitor(KVBucketIface* s, EPStats &st,
-                      std::atomic<bool> &sfin)
+                      std::atomic<bool> &sfin, bool expel)
         : store(s), stats(st), removed(0), taskStart(gethrtime()),
-          wasHighMemoryUsage(s->isMemoryUsageTooHigh()), stateFinalizer(sfin) {}
+          wasHighMemoryUsage(s->isMemoryUsageTooHigh()), stateFinalizer(sfin),
+          expelEnabled(expel) {}
 
     void visitBucket(VBucketPtr &vb) override {
         bool newCheckpointCreated = false;
@@ -60,6 +62,18 @@ public:
                 removed, vb->getId());
         }
         removed = 0;
+
+        if (expelEnabled) {
+            const auto expelled =
+                    vb->checkpointManager.expelUnreferencedCheckpointItems();
+            if (expelled.count > 0) {
+                LOG(EXTENSION_LOG_DEBUG,
+                    "Expelled %" PRIu64 " items (%" PRIu64 " bytes) from "
+                    "checkpoints of VBucket %d",
+                    uint64_t(expelled.count), uint64_t(expelled.memory),
+                    vb->getId());
+            }
+        }
     }
 
     void complete() override {
@@ -82,6 +96,7 @@ private:
     hrtime_t                   taskStart;
     bool                       wasHighMemoryUsage;
     std::atomic<bool>         &stateFinalizer;
+    bool                       expelEnabled;
 };
 
 void ClosedUnrefCheckpointRemoverTask::cursorDroppingIfNeeded(void) {
@@ -97,6 +112,8 @@ void ClosedUnrefCheckpointRemoverTask::cursorDroppingIfNeeded(void) {
         size_t amountOfMemoryToClear = stats.getTotalMemoryUsed() -
                                           stats.cursorDroppingLThreshold.load();
         size_t memoryCleared = 0;
+        const bool expelEnabled =
+                engine->getConfiguration().isChkExpelEnabled();
         KVBucketIface* kvBucket = engine->getKVBucket();
         // Get a list of active vbuckets sorted by memory usage
         // of their respective checkpoint managers.
@@ -107,6 +124,16 @@ void ClosedUnrefCheckpointRemoverTask::cursorDroppingIfNeeded(void) {
                 uint16_t vbid = it.first;
                 VBucketPtr vb = kvBucket->getVBucket(vbid);
                 if (vb) {
+                    if (expelEnabled) {
+                        // Expelling already processed items doesn't force
+                        // any stream to backfill, so try it before dropping
+                        // cursors.
+                        memoryCleared += vb->checkpointManager
+                                .expelUnreferencedCheckpointItems().memory;
+                        if (memoryCleared >= amountOfMemoryToClear) {
+                            break;
+                        }
+                    }
                     // Get a list of cursors that can be dropped from the
                     // vbucket's checkpoint manager, so as to unreference
                     // an estimated number of checkpoints.
@@ -140,8 +167,11 @@ bool ClosedUnrefCheckpointRemoverTask::run(void) {
     if (available.compare_exchange_strong(inverse, false)) {
         cursorDroppingIfNeeded();
         KVBucketIface* kvBucket = engine->getKVBucket();
-        auto pv =
-                std::make_unique<CheckpointVisitor>(kvBucket, stats, available);
+        auto pv = std::make_unique<CheckpointVisitor>(
+                kvBucket,
+                stats,
+                available,
+                engine->getConfiguration().isChkExpelEnabled());
         kvBucket->visit(std::move(pv),
                         "Checkpoint Remover",
                         TaskId::ClosedUnrefCheckpointRemoverVisitorTask);
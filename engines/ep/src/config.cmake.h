@@ -4,6 +4,7 @@
 #cmakedefine HAVE_ALLOCA_H ${HAVE_ALLOCA_H}
 #cmakedefine HAVE_ARPA_INET_H ${HAVE_ARPA_INET_H}
 #cmakedefine HAVE_ATOMIC_H ${HAVE_ATOMIC_H}
+#cmakedefine HAVE_LINUX_IO_URING_H ${HAVE_LINUX_IO_URING_H}
 #cmakedefine HAVE_MACH_MACH_TIME_H ${HAVE_MACH_MACH_TIME_H}
 #cmakedefine HAVE_MEMORY ${HAVE_MEMORY}
 #cmakedefine HAVE_NETDB_H ${HAVE_NETDB_H}
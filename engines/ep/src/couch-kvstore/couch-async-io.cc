@@ -0,0 +1,924 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-async-io.h"
+
+#include <platform/make_unique.h>
+#include <platform/platform.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define EP_HAVE_IO_URING 1
+#endif
+#endif
+
+static ssize_t doPread(const AsyncReader::Request& req) {
+    ssize_t rv;
+    do {
+        rv = ::pread(req.fd, req.buf, req.nbytes, req.offset);
+    } while (rv == -1 && errno == EINTR);
+    return rv == -1 ? -errno : rv;
+}
+
+#ifdef EP_HAVE_IO_URING
+
+/**
+ * AsyncReader using an io_uring, driven directly through the system calls.
+ *
+ * Any thread may queue reads in the submission ring; one thread at a time
+ * waits in the kernel for completions and hands them out, so the reads of
+ * concurrent callers are outstanding together.
+ */
+class UringReader : public AsyncReader {
+public:
+    explicit UringReader(size_t queueDepth);
+
+    ~UringReader();
+
+    void read(Request* reqs, size_t count) override;
+
+    const char* getName() const override {
+        return "uring";
+    }
+
+private:
+    struct Batch {
+        size_t remaining;
+    };
+
+    struct Pending {
+        Request* req;
+        Batch* batch;
+        iovec iov;
+    };
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+
+    /// Queue the read in the submission ring. Called with mutex held.
+    void queue(Pending& pending);
+
+    /**
+     * Remove the reads queued but not yet passed to the kernel, completing
+     * them with the given error. Called with mutex held.
+     */
+    void failUnsubmitted(int error);
+
+    /**
+     * Hand out all available completions. Called with mutex held, and only
+     * while no thread waits in the kernel (else its wakeup could be taken).
+     */
+    void reap();
+
+    void unmap();
+
+    int ringFd;
+    unsigned entries;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Reads queued and not yet completed.
+    unsigned inflight;
+    // Reads queued but not yet passed to the kernel.
+    unsigned unsubmitted;
+    // Whether a thread is waiting in the kernel for completions.
+    bool waiting;
+};
+
+UringReader::UringReader(size_t queueDepth)
+    : AsyncReader(queueDepth),
+      ringFd(-1),
+      entries(0),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqesSize(0),
+      inflight(0),
+      unsubmitted(0),
+      waiting(false) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = syscall(__NR_io_uring_setup, unsigned(queueDepth), &params);
+    if (ringFd < 0) {
+        throw std::system_error(
+                errno, std::system_category(), "UringReader: io_uring_setup");
+    }
+    entries = params.sq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqRing = mmap(nullptr,
+                  sqRingSize,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  ringFd,
+                  IORING_OFF_SQ_RING);
+    cqRing = mmap(nullptr,
+                  cqRingSize,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  ringFd,
+                  IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr,
+                                           sqesSize,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           ringFd,
+                                           IORING_OFF_SQES));
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        int error = errno;
+        unmap();
+        throw std::system_error(
+                error, std::system_category(), "UringReader: mmap");
+    }
+
+    auto* sq = static_cast<char*>(sqRing);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto* cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+UringReader::~UringReader() {
+    unmap();
+}
+
+void UringReader::unmap() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+        ::close(ringFd);
+    }
+}
+
+int UringReader::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter,
+                   ringFd,
+                   toSubmit,
+                   minComplete,
+                   flags,
+                   nullptr,
+                   0);
+}
+
+void UringReader::read(Request* reqs, size_t count) {
+    Batch batch{count};
+    std::vector<Pending> pending(count);
+    // The completion ring is twice the size of the submission ring, so
+    // limiting what's outstanding to the latter means it can't overflow.
+    const size_t limit = std::min(queueDepth, size_t(entries));
+    size_t next = 0;
+
+    std::unique_lock<std::mutex> lh(mutex);
+    while (batch.remaining > 0) {
+        while (next < count && inflight < limit) {
+            pending[next] = {&reqs[next],
+                             &batch,
+                             {reqs[next].buf, reqs[next].nbytes}};
+            queue(pending[next]);
+            ++next;
+        }
+
+        if (unsubmitted > 0) {
+            int rv = enter(unsubmitted, 0, 0);
+            if (rv >= 0) {
+                unsubmitted -= rv;
+            } else if (errno != EINTR &&
+                       ((errno != EAGAIN && errno != EBUSY) ||
+                        inflight == unsubmitted)) {
+                // Nothing in the kernel whose completion would free up
+                // resources for another attempt.
+                failUnsubmitted(errno);
+                cond.notify_all();
+                continue;
+            }
+        }
+
+        if (waiting) {
+            // The waiting thread hands out our completions.
+            cond.wait(lh);
+            continue;
+        }
+
+        reap();
+        if (batch.remaining == 0) {
+            break;
+        }
+        if (next < count && inflight < limit) {
+            // Completions made room for more of ours; queue them rather
+            // than wait (there may be nothing left to wait for).
+            continue;
+        }
+
+        waiting = true;
+        lh.unlock();
+        enter(0, 1, IORING_ENTER_GETEVENTS);
+        lh.lock();
+        waiting = false;
+        reap();
+        cond.notify_all();
+    }
+}
+
+void UringReader::queue(Pending& pending) {
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & *sqMask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    // READV rather than READ; it has been supported since io_uring was
+    // introduced.
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = pending.req->fd;
+    sqe.off = pending.req->offset;
+    sqe.addr = reinterpret_cast<uint64_t>(&pending.iov);
+    sqe.len = 1;
+    sqe.user_data = reinterpret_cast<uint64_t>(&pending);
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++inflight;
+    ++unsubmitted;
+}
+
+void UringReader::failUnsubmitted(int error) {
+    // The kernel hasn't consumed them, so the tail can simply be wound back.
+    unsigned tail = *sqTail;
+    for (; unsubmitted > 0; --unsubmitted) {
+        --tail;
+        auto* pending = reinterpret_cast<Pending*>(
+                sqes[sqArray[tail & *sqMask]].user_data);
+        pending->req->result = -error;
+        --pending->batch->remaining;
+        --inflight;
+    }
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+}
+
+void UringReader::reap() {
+    unsigned head = *cqHead;
+    const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes[head & *cqMask];
+        auto* pending = reinterpret_cast<Pending*>(cqe.user_data);
+        pending->req->result = cqe.res;
+        --pending->batch->remaining;
+        --inflight;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif // EP_HAVE_IO_URING
+
+/**
+ * AsyncReader for kernels without io_uring: ordinary preads, performed by a
+ * pool of queueDepth - 1 threads of the reader's own plus the calling
+ * thread, so up to queueDepth of a batch are outstanding at once.
+ *
+ * Each read() queues its batch; the pool threads take requests from the
+ * queued batches in turn, and the caller works through its own batch
+ * alongside them. The caller never waits for a pool thread to pick up a
+ * request - only for one it has already started - so busy pool threads
+ * just mean the caller does more of its own batch.
+ */
+class PreadReader : public AsyncReader {
+public:
+    explicit PreadReader(size_t queueDepth);
+
+    ~PreadReader();
+
+    void read(Request* reqs, size_t count) override;
+
+    const char* getName() const override {
+        return "pread";
+    }
+
+private:
+    struct Batch {
+        Request* reqs;
+        size_t count;
+        // Index in reqs of the next request to read.
+        size_t next;
+        // Number of requests not yet completed.
+        size_t remaining;
+    };
+
+    static void threadMain(void* arg) {
+        static_cast<PreadReader*>(arg)->runThread();
+    }
+
+    void runThread();
+
+    /// Stop and join the pool threads.
+    void stop();
+
+    /// Read the batch's next request. Called with mutex held (via lh).
+    void readOne(Batch& batch, std::unique_lock<std::mutex>& lh);
+
+    std::mutex mutex;
+    std::condition_variable workCond;
+    std::condition_variable doneCond;
+    // Batches with requests not yet started.
+    std::deque<Batch*> batches;
+    bool shutdown;
+    std::vector<cb_thread_t> threads;
+};
+
+PreadReader::PreadReader(size_t queueDepth)
+    : AsyncReader(queueDepth), shutdown(false) {
+    for (size_t ii = 1; ii < queueDepth; ++ii) {
+        cb_thread_t thread;
+        if (cb_create_named_thread(
+                    &thread, threadMain, this, 0, "mc:async_pread") != 0) {
+            // Destructor won't run; stop those already started.
+            stop();
+            throw std::runtime_error("PreadReader: Error creating thread");
+        }
+        threads.push_back(thread);
+    }
+}
+
+PreadReader::~PreadReader() {
+    stop();
+}
+
+void PreadReader::stop() {
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        shutdown = true;
+    }
+    workCond.notify_all();
+    for (auto& thread : threads) {
+        cb_join_thread(thread);
+    }
+    threads.clear();
+}
+
+void PreadReader::read(Request* reqs, size_t count) {
+    if (count == 1 || threads.empty()) {
+        for (size_t ii = 0; ii < count; ++ii) {
+            reqs[ii].result = doPread(reqs[ii]);
+        }
+        return;
+    }
+
+    Batch batch{reqs, count, 0, count};
+    std::unique_lock<std::mutex> lh(mutex);
+    batches.push_back(&batch);
+    workCond.notify_all();
+    while (batch.next < batch.count) {
+        readOne(batch, lh);
+    }
+    auto it = std::find(batches.begin(), batches.end(), &batch);
+    if (it != batches.end()) {
+        batches.erase(it);
+    }
+    doneCond.wait(lh, [&batch] { return batch.remaining == 0; });
+}
+
+void PreadReader::runThread() {
+    std::unique_lock<std::mutex> lh(mutex);
+    while (true) {
+        workCond.wait(lh, [this] { return shutdown || !batches.empty(); });
+        if (shutdown) {
+            return;
+        }
+        // Take one request, then rotate so concurrent batches share the
+        // pool.
+        Batch* batch = batches.front();
+        batches.pop_front();
+        if (batch->next < batch->count) {
+            batches.push_back(batch);
+            readOne(*batch, lh);
+        }
+    }
+}
+
+void PreadReader::readOne(Batch& batch, std::unique_lock<std::mutex>& lh) {
+    Request& req = batch.reqs[batch.next++];
+    lh.unlock();
+    req.result = doPread(req);
+    lh.lock();
+    if (--batch.remaining == 0) {
+        doneCond.notify_all();
+    }
+}
+
+std::unique_ptr<AsyncReader> AsyncReader::create(const std::string& backend,
+                                                 size_t queueDepth) {
+    if (queueDepth == 0) {
+        throw std::invalid_argument(
+                "AsyncReader::create: queueDepth must be non-zero");
+    }
+    if (backend == "uring" || backend == "auto") {
+#ifdef EP_HAVE_IO_URING
+        try {
+            return std::make_unique<UringReader>(queueDepth);
+        } catch (const std::system_error&) {
+            if (backend == "uring") {
+                throw;
+            }
+        }
+#else
+        if (backend == "uring") {
+            throw std::system_error(ENOSYS,
+                                    std::system_category(),
+                                    "AsyncReader::create: io_uring is not "
+                                    "supported on this platform");
+        }
+#endif
+        return std::make_unique<PreadReader>(queueDepth);
+    }
+    if (backend == "pread") {
+        return std::make_unique<PreadReader>(queueDepth);
+    }
+    throw std::invalid_argument("AsyncReader::create: unknown backend:" +
+                                backend);
+}
+
+couch_file_handle AsyncFileOps::constructor(couchstore_error_info_t* errinfo) {
+    return reinterpret_cast<couch_file_handle>(new File);
+}
+
+couchstore_error_t AsyncFileOps::open(couchstore_error_info_t* errinfo,
+                                      couch_file_handle* h,
+                                      const char* path,
+                                      int oflag) {
+    auto* file = reinterpret_cast<File*>(*h);
+    int fd;
+    do {
+        fd = ::open(path, oflag, 0666);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        errinfo->error = errno;
+        return errno == ENOENT ? COUCHSTORE_ERROR_NO_SUCH_FILE
+                               : COUCHSTORE_ERROR_OPEN_FILE;
+    }
+    file->fd = fd;
+    file->path = path;
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t AsyncFileOps::close(couchstore_error_info_t* errinfo,
+                                       couch_file_handle h) {
+    auto* file = reinterpret_cast<File*>(h);
+    int fd = file->fd;
+    file->fd = -1;
+    if (fd != -1 && ::close(fd) == -1) {
+        errinfo->error = errno;
+        return COUCHSTORE_ERROR_FILE_CLOSE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+ssize_t AsyncFileOps::pread(couchstore_error_info_t* errinfo,
+                            couch_file_handle h,
+                            void* buf,
+                            size_t nbytes,
+                            cs_off_t offset) {
+    auto* file = reinterpret_cast<File*>(h);
+    AsyncReader::Request req{file->fd, buf, nbytes, offset, 0};
+    reader.read(&req, 1);
+    if (req.result < 0) {
+        errinfo->error = int(-req.result);
+        return COUCHSTORE_ERROR_READ;
+    }
+    return req.result;
+}
+
+ssize_t AsyncFileOps::pwrite(couchstore_error_info_t* errinfo,
+                             couch_file_handle h,
+                             const void* buf,
+                             size_t nbytes,
+                             cs_off_t offset) {
+    auto* file = reinterpret_cast<File*>(h);
+    ssize_t rv;
+    do {
+        rv = ::pwrite(file->fd, buf, nbytes, offset);
+    } while (rv == -1 && errno == EINTR);
+    if (rv == -1) {
+        errinfo->error = errno;
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return rv;
+}
+
+cs_off_t AsyncFileOps::goto_eof(couchstore_error_info_t* errinfo,
+                                couch_file_handle h) {
+    auto* file = reinterpret_cast<File*>(h);
+    cs_off_t rv = ::lseek(file->fd, 0, SEEK_END);
+    if (rv == -1) {
+        errinfo->error = errno;
+        return COUCHSTORE_ERROR_READ;
+    }
+    return rv;
+}
+
+couchstore_error_t AsyncFileOps::sync(couchstore_error_info_t* errinfo,
+                                      couch_file_handle h) {
+    auto* file = reinterpret_cast<File*>(h);
+    int rv;
+    do {
+#ifdef __linux__
+        rv = ::fdatasync(file->fd);
+#else
+        rv = ::fsync(file->fd);
+#endif
+    } while (rv == -1 && errno == EINTR);
+    if (rv == -1) {
+        errinfo->error = errno;
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t AsyncFileOps::advise(couchstore_error_info_t* errinfo,
+                                        couch_file_handle h,
+                                        cs_off_t offset,
+                                        cs_off_t len,
+                                        couchstore_file_advice_t advice) {
+#ifdef POSIX_FADV_NORMAL
+    auto* file = reinterpret_cast<File*>(h);
+    int posixAdvice;
+    switch (advice) {
+    case COUCHSTORE_FILE_ADVICE_NORMAL:
+        posixAdvice = POSIX_FADV_NORMAL;
+        break;
+    case COUCHSTORE_FILE_ADVICE_SEQUENTIAL:
+        posixAdvice = POSIX_FADV_SEQUENTIAL;
+        break;
+    case COUCHSTORE_FILE_ADVICE_RANDOM:
+        posixAdvice = POSIX_FADV_RANDOM;
+        break;
+    case COUCHSTORE_FILE_ADVICE_WILLNEED:
+        posixAdvice = POSIX_FADV_WILLNEED;
+        break;
+    case COUCHSTORE_FILE_ADVICE_DONTNEED:
+        posixAdvice = POSIX_FADV_DONTNEED;
+        break;
+    default:
+        return COUCHSTORE_SUCCESS;
+    }
+    int rv = posix_fadvise(file->fd, offset, len, posixAdvice);
+    if (rv != 0) {
+        errinfo->error = rv;
+        return COUCHSTORE_ERROR_READ;
+    }
+#endif
+    return COUCHSTORE_SUCCESS;
+}
+
+void AsyncFileOps::destructor(couch_file_handle h) {
+    delete reinterpret_cast<File*>(h);
+}
+
+couch_file_handle ReadStageOps::constructor(couchstore_error_info_t* errinfo) {
+    auto* sf = new StagedFile{wrapped_ops.constructor(errinfo), {}};
+    return reinterpret_cast<couch_file_handle>(sf);
+}
+
+couchstore_error_t ReadStageOps::open(couchstore_error_info_t* errinfo,
+                                      couch_file_handle* h,
+                                      const char* path,
+                                      int oflag) {
+    auto* sf = reinterpret_cast<StagedFile*>(*h);
+    sf->path = path;
+    return wrapped_ops.open(errinfo, &sf->orig_handle, path, oflag);
+}
+
+couchstore_error_t ReadStageOps::close(couchstore_error_info_t* errinfo,
+                                       couch_file_handle h) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    return wrapped_ops.close(errinfo, sf->orig_handle);
+}
+
+ssize_t ReadStageOps::pread(couchstore_error_info_t* errinfo,
+                            couch_file_handle h,
+                            void* buf,
+                            size_t nbytes,
+                            cs_off_t offset) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    const ReadStage* stage = ReadStage::current();
+    if (stage) {
+        ssize_t staged = stage->read(sf->path, buf, nbytes, offset);
+        if (staged >= 0) {
+            return staged;
+        }
+    }
+    return wrapped_ops.pread(errinfo, sf->orig_handle, buf, nbytes, offset);
+}
+
+ssize_t ReadStageOps::pwrite(couchstore_error_info_t* errinfo,
+                             couch_file_handle h,
+                             const void* buf,
+                             size_t nbytes,
+                             cs_off_t offset) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    return wrapped_ops.pwrite(errinfo, sf->orig_handle, buf, nbytes, offset);
+}
+
+cs_off_t ReadStageOps::goto_eof(couchstore_error_info_t* errinfo,
+                                couch_file_handle h) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    return wrapped_ops.goto_eof(errinfo, sf->orig_handle);
+}
+
+couchstore_error_t ReadStageOps::sync(couchstore_error_info_t* errinfo,
+                                      couch_file_handle h) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    return wrapped_ops.sync(errinfo, sf->orig_handle);
+}
+
+couchstore_error_t ReadStageOps::advise(couchstore_error_info_t* errinfo,
+                                        couch_file_handle h,
+                                        cs_off_t offset,
+                                        cs_off_t len,
+                                        couchstore_file_advice_t advice) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    return wrapped_ops.advise(errinfo, sf->orig_handle, offset, len, advice);
+}
+
+void ReadStageOps::destructor(couch_file_handle h) {
+    auto* sf = reinterpret_cast<StagedFile*>(h);
+    wrapped_ops.destructor(sf->orig_handle);
+    delete sf;
+}
+
+static thread_local const ReadStage* currentStage = nullptr;
+
+ReadStage::Scope::Scope(const ReadStage& stage) : previous(currentStage) {
+    currentStage = &stage;
+}
+
+ReadStage::Scope::~Scope() {
+    currentStage = previous;
+}
+
+const ReadStage* ReadStage::current() {
+    return currentStage;
+}
+
+void ReadStage::add(cs_off_t offset,
+                    std::shared_ptr<const std::vector<char>> buffer,
+                    size_t start,
+                    size_t len,
+                    bool atEof) {
+    if (len == 0 && !atEof) {
+        return;
+    }
+    auto it = regions.find(offset);
+    if (it != regions.end() && it->second.len >= len) {
+        return;
+    }
+    regions[offset] = {std::move(buffer), start, len, atEof};
+}
+
+void ReadStage::clear() {
+    regions.clear();
+}
+
+ssize_t ReadStage::read(const std::string& file,
+                        void* buf,
+                        size_t nbytes,
+                        cs_off_t offset) const {
+    if (file != path) {
+        return -1;
+    }
+    auto it = regions.upper_bound(offset);
+    if (it == regions.begin()) {
+        return -1;
+    }
+    --it;
+    const size_t start = size_t(offset - it->first);
+    const Region& region = it->second;
+    if (start > region.len) {
+        return -1;
+    }
+    size_t len = region.len - start;
+    if (len < nbytes) {
+        if (!region.atEof) {
+            return -1;
+        }
+    } else {
+        len = nbytes;
+    }
+    std::memcpy(buf, region.buffer->data() + region.start + start, len);
+    return len;
+}
+
+const size_t FilePrefetcher::chunkSize;
+
+FilePrefetcher::FilePrefetcher(AsyncReader& reader, const std::string& path)
+    : reader(reader),
+      fd(::open(path.c_str(), O_RDONLY)),
+      window(reader.getQueueDepth() * chunkSize),
+      stage(path),
+      readFrom(0),
+      readTo(0),
+      aheadValid(0) {
+}
+
+FilePrefetcher::~FilePrefetcher() {
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+std::vector<FilePrefetcher::Extent> FilePrefetcher::coalesce(
+        std::vector<Extent> extents, size_t maxGap) {
+    std::sort(extents.begin(), extents.end());
+    std::vector<Extent> merged;
+    for (const auto& extent : extents) {
+        if (!merged.empty()) {
+            auto& last = merged.back();
+            const cs_off_t lastEnd = last.first + last.second;
+            if (extent.first <= lastEnd + cs_off_t(maxGap)) {
+                const cs_off_t end = extent.first + extent.second;
+                last.second = std::max(lastEnd, end) - last.first;
+                continue;
+            }
+        }
+        merged.push_back(extent);
+    }
+    return merged;
+}
+
+FilePrefetcher::Fetched FilePrefetcher::fetch(std::vector<Extent> extents,
+                                              size_t maxGap,
+                                              ReadStage& stage) {
+    std::sort(extents.begin(), extents.end());
+    const auto reads = coalesce(extents, maxGap);
+    Fetched fetched{reads.size(), 0};
+    if (fd == -1) {
+        return fetched;
+    }
+
+    std::vector<std::shared_ptr<std::vector<char>>> buffers;
+    std::vector<AsyncReader::Request> reqs;
+    for (const auto& read : reads) {
+        buffers.push_back(std::make_shared<std::vector<char>>(read.second));
+        for (size_t done = 0; done < read.second; done += chunkSize) {
+            reqs.push_back({fd,
+                            buffers.back()->data() + done,
+                            std::min(chunkSize, read.second - done),
+                            cs_off_t(read.first + done),
+                            0});
+        }
+    }
+    reader.read(reqs.data(), reqs.size());
+
+    // Each read's requests are consecutive in reqs; it's good up to the
+    // first which failed or came up short.
+    std::vector<size_t> valid(reads.size());
+    std::vector<bool> atEof(reads.size());
+    auto req = reqs.begin();
+    for (size_t ii = 0; ii < reads.size(); ++ii) {
+        bool complete = true;
+        for (size_t done = 0; done < reads[ii].second;
+             done += chunkSize, ++req) {
+            if (!complete) {
+                continue;
+            }
+            if (req->result > 0) {
+                valid[ii] += size_t(req->result);
+            }
+            if (req->result != ssize_t(req->nbytes)) {
+                complete = false;
+                atEof[ii] = req->result >= 0;
+            }
+        }
+        fetched.bytes += valid[ii];
+    }
+
+    // Split each read between the extents it was merged from (both being
+    // in offset order).
+    size_t ii = 0;
+    for (const auto& extent : extents) {
+        while (extent.first >= reads[ii].first + cs_off_t(reads[ii].second) &&
+               ii + 1 < reads.size()) {
+            ++ii;
+        }
+        const size_t start = size_t(extent.first - reads[ii].first);
+        if (start > valid[ii]) {
+            continue;
+        }
+        const size_t len = std::min(extent.second, valid[ii] - start);
+        stage.add(extent.first,
+                  buffers[ii],
+                  start,
+                  len,
+                  atEof[ii] && len < extent.second);
+    }
+    return fetched;
+}
+
+void FilePrefetcher::readAhead(const Extent& extent) {
+    if (fd == -1) {
+        return;
+    }
+    const cs_off_t start = extent.first;
+    const cs_off_t end = start + extent.second;
+    if (start < readFrom || end > readTo) {
+        readWindow(start, start + std::max(window, extent.second));
+    } else if (size_t(start - readFrom) >= window / 2) {
+        readWindow(start, start + window);
+    }
+}
+
+void FilePrefetcher::readWindow(cs_off_t from, cs_off_t to) {
+    auto buffer = std::make_shared<std::vector<char>>(size_t(to - from));
+
+    // Keep what's already been read of the new window (when sliding it
+    // forward, its first half), reading only the rest.
+    size_t valid = 0;
+    const cs_off_t aheadEnd = readFrom + cs_off_t(aheadValid);
+    if (from >= readFrom && from < aheadEnd) {
+        valid = std::min(size_t(aheadEnd - from), buffer->size());
+        std::memcpy(buffer->data(), ahead->data() + (from - readFrom), valid);
+    }
+
+    std::vector<AsyncReader::Request> reqs;
+    for (size_t done = valid; done < buffer->size(); done += chunkSize) {
+        reqs.push_back({fd,
+                        buffer->data() + done,
+                        std::min(chunkSize, buffer->size() - done),
+                        cs_off_t(from + done),
+                        0});
+    }
+    reader.read(reqs.data(), reqs.size());
+
+    // Good up to the first read which failed or came up short.
+    bool atEof = false;
+    for (const auto& req : reqs) {
+        if (req.result > 0) {
+            valid += size_t(req.result);
+        }
+        if (req.result != ssize_t(req.nbytes)) {
+            atEof = req.result >= 0;
+            break;
+        }
+    }
+
+    stage.clear();
+    stage.add(from, buffer, 0, valid, atEof);
+    ahead = std::move(buffer);
+    aheadValid = valid;
+    readFrom = from;
+    readTo = to;
+}
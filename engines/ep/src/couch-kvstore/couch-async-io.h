@@ -0,0 +1,328 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Performs batches of file reads, keeping many of them outstanding at once
+ * so the device sees a deep queue rather than one read at a time.
+ *
+ * Two backends exist: io_uring (Linux 5.1+), and for kernels without it
+ * ordinary preads by a pool of threads belonging to the reader.
+ */
+class AsyncReader {
+public:
+    struct Request {
+        int fd;
+        void* buf;
+        size_t nbytes;
+        cs_off_t offset;
+        /// Set on completion: what pread() would return, or -errno.
+        ssize_t result;
+    };
+
+    /**
+     * Create a reader.
+     *
+     * @param backend "uring", "pread", or "auto" (io_uring if the kernel
+     *        supports it, otherwise pread)
+     * @param queueDepth maximum number of reads outstanding at once
+     * @throws std::invalid_argument if backend is unknown
+     * @throws std::system_error if "uring" is requested but unavailable
+     */
+    static std::unique_ptr<AsyncReader> create(const std::string& backend,
+                                               size_t queueDepth);
+
+    virtual ~AsyncReader() {
+    }
+
+    /**
+     * Perform the reads, returning once all of them have completed.
+     *
+     * Thread-safe; reads from concurrent callers are outstanding together
+     * (up to the queue depth).
+     */
+    virtual void read(Request* reqs, size_t count) = 0;
+
+    /// Name of the backend ("uring" or "pread").
+    virtual const char* getName() const = 0;
+
+    size_t getQueueDepth() const {
+        return queueDepth;
+    }
+
+protected:
+    explicit AsyncReader(size_t queueDepth) : queueDepth(queueDepth) {
+    }
+
+    const size_t queueDepth;
+};
+
+/**
+ * Posix FileOps for couchstore performing reads through an AsyncReader;
+ * a pread from couchstore is a batch of one, outstanding alongside those
+ * of any other thread reading through the same reader.
+ */
+class AsyncFileOps : public FileOpsInterface {
+public:
+    explicit AsyncFileOps(AsyncReader& reader) : reader(reader) {
+    }
+
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override;
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle,
+                            const char* path,
+                            int oflag) override;
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override;
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle,
+                  void* buf,
+                  size_t nbytes,
+                  cs_off_t offset) override;
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle,
+                   const void* buf,
+                   size_t nbytes,
+                   cs_off_t offset) override;
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override;
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override;
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override;
+    void destructor(couch_file_handle handle) override;
+
+private:
+    struct File {
+        int fd = -1;
+        std::string path;
+    };
+
+    AsyncReader& reader;
+};
+
+/**
+ * Regions of a file read ahead of couchstore needing them, held in memory
+ * so that couchstore's reads of them need no further I/O.
+ *
+ * While a Scope is active, reads on that thread through ReadStageOps of the
+ * file the stage belongs to are served from it when a region covers them;
+ * other reads go to the file as usual.
+ */
+class ReadStage {
+public:
+    /// Makes a stage the calling thread's for the Scope's lifetime.
+    class Scope {
+    public:
+        explicit Scope(const ReadStage& stage);
+
+        ~Scope();
+
+    private:
+        const ReadStage* previous;
+    };
+
+    explicit ReadStage(std::string path) : path(std::move(path)) {
+    }
+
+    /**
+     * Add a region of the file: len bytes of buffer from start. Regions
+     * may share a buffer, and overlap; of two starting at the same offset
+     * the longer is kept.
+     *
+     * @param atEof true if the region ends at the end of the file, so that
+     *        reads past it may be served short
+     */
+    void add(cs_off_t offset,
+             std::shared_ptr<const std::vector<char>> buffer,
+             size_t start,
+             size_t len,
+             bool atEof);
+
+    /// Remove all regions.
+    void clear();
+
+    /**
+     * Serve a read of the given file from the stage.
+     *
+     * @returns the number of bytes read, or -1 if the stage doesn't hold
+     *          them (or belongs to another file)
+     */
+    ssize_t read(const std::string& file,
+                 void* buf,
+                 size_t nbytes,
+                 cs_off_t offset) const;
+
+    /// The calling thread's stage, if any.
+    static const ReadStage* current();
+
+private:
+    struct Region {
+        std::shared_ptr<const std::vector<char>> buffer;
+        size_t start;
+        size_t len;
+        bool atEof;
+    };
+
+    const std::string path;
+    // Regions by offset. A read is served by the one starting closest
+    // before it, if that covers it.
+    std::map<cs_off_t, Region> regions;
+};
+
+/**
+ * FileOps serving reads covered by the calling thread's ReadStage from it,
+ * passing all else to the wrapped ops.
+ *
+ * Must be the outermost ops (above a BlockCacheOps in particular), so the
+ * stage sees couchstore's reads as issued rather than widened to blocks
+ * the stage may only partly hold.
+ */
+class ReadStageOps : public FileOpsInterface {
+public:
+    explicit ReadStageOps(FileOpsInterface& ops) : wrapped_ops(ops) {
+    }
+
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override;
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle,
+                            const char* path,
+                            int oflag) override;
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override;
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle,
+                  void* buf,
+                  size_t nbytes,
+                  cs_off_t offset) override;
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle,
+                   const void* buf,
+                   size_t nbytes,
+                   cs_off_t offset) override;
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override;
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override;
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override;
+    void destructor(couch_file_handle handle) override;
+
+private:
+    struct StagedFile {
+        couch_file_handle orig_handle;
+        std::string path;
+    };
+
+    FileOpsInterface& wrapped_ops;
+};
+
+/**
+ * Reads parts of a file ahead of couchstore reading them, as batches
+ * through an AsyncReader, into a ReadStage; couchstore's own reads of them
+ * are then served from memory.
+ *
+ * If the file cannot be opened prefetching does nothing, leaving couchstore
+ * to report any error when it reads the file itself.
+ */
+class FilePrefetcher {
+public:
+    /// Offset and length of a region of the file.
+    using Extent = std::pair<cs_off_t, size_t>;
+
+    FilePrefetcher(AsyncReader& reader, const std::string& path);
+
+    ~FilePrefetcher();
+
+    /**
+     * Sort the extents by offset and merge those overlapping or less than
+     * maxGap bytes apart, so a batch of scattered reads becomes fewer,
+     * larger ones in file order.
+     */
+    static std::vector<Extent> coalesce(std::vector<Extent> extents,
+                                        size_t maxGap);
+
+    struct Fetched {
+        /// Number of (merged) extents read.
+        size_t reads;
+        /// Number of bytes read.
+        size_t bytes;
+    };
+
+    /**
+     * Read the given extents (of documents, say) into the stage. Those
+     * overlapping or less than maxGap bytes apart are merged (see
+     * coalesce()) and read into one buffer, all reads outstanding together
+     * (up to the queue depth); the buffer is then split between the
+     * extents, each becoming a region of the stage.
+     *
+     * An extent whose read fails is left out, or cut short, leaving
+     * couchstore to read it (and report any error) itself.
+     */
+    Fetched fetch(std::vector<Extent> extents,
+                  size_t maxGap,
+                  ReadStage& stage);
+
+    /**
+     * For a pass through the file in (mostly) ascending offset order: the
+     * pass is about to read the given extent. Keeps a window of
+     * queueDepth * chunkSize bytes from it read into getAheadStage(),
+     * reading the next part of the window once the pass is half way through
+     * it (the part already read being kept).
+     */
+    void readAhead(const Extent& extent);
+
+    /// The window read by readAhead(), to serve the pass's reads from.
+    const ReadStage& getAheadStage() const {
+        return stage;
+    }
+
+    /// Size of each read issued.
+    static const size_t chunkSize = 128 * 1024;
+
+private:
+    /// Make [from, to) the window, reading whatever isn't already read.
+    void readWindow(cs_off_t from, cs_off_t to);
+
+    AsyncReader& reader;
+    int fd;
+    const size_t window;
+    // Holds the window read by readAhead(), as a single region.
+    ReadStage stage;
+    cs_off_t readFrom;
+    cs_off_t readTo;
+    std::shared_ptr<std::vector<char>> ahead;
+    // Bytes of ahead successfully read.
+    size_t aheadValid;
+};
@@ -0,0 +1,307 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-block-cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+
+const size_t CouchBlockCache::blockSize;
+const size_t BlockCacheOps::maxCachedRead;
+
+size_t CouchBlockCache::KeyHash::operator()(const Key& key) const {
+    size_t h = std::hash<uint64_t>()(key.block);
+    for (uint64_t v : {uint64_t(key.file.ino),
+                       uint64_t(key.file.dev),
+                       key.file.generation}) {
+        h ^= std::hash<uint64_t>()(v) + 0x9e3779b97f4a7c15ULL + (h << 6) +
+             (h >> 2);
+    }
+    return h;
+}
+
+CouchBlockCache::CouchBlockCache(size_t capacity)
+    : capacity(capacity),
+      shardBlocks(std::max(size_t(1), capacity / blockSize / numShards)),
+      fifoLimit(std::max(size_t(1), shardBlocks / 4)),
+      ghostLimit(shardBlocks / 2),
+      size(0) {
+}
+
+CouchBlockCache::~CouchBlockCache() = default;
+
+CouchBlockCache::FileId CouchBlockCache::identify(dev_t dev,
+                                                  ino_t ino,
+                                                  bool created) {
+    std::lock_guard<std::mutex> lh(generationsMutex);
+    auto res = generations.emplace(std::make_pair(dev, ino), nextGeneration);
+    if (res.second || created) {
+        res.first->second = nextGeneration++;
+    }
+    return {dev, ino, res.first->second};
+}
+
+void CouchBlockCache::forget(dev_t dev, ino_t ino) {
+    {
+        std::lock_guard<std::mutex> lh(generationsMutex);
+        if (generations.erase(std::make_pair(dev, ino)) == 0) {
+            // Never read through the cache.
+            return;
+        }
+    }
+
+    // A file's blocks are spread over every shard; removing a file is rare
+    // enough to walk them all (and drops blocks of its earlier generations
+    // too).
+    auto isFile = [dev, ino](const Key& key) {
+        return key.file.dev == dev && key.file.ino == ino;
+    };
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lh(shard.mutex);
+        for (auto* list : {&shard.fifo, &shard.main}) {
+            for (auto it = list->begin(); it != list->end();) {
+                if (!isFile(it->key)) {
+                    ++it;
+                    continue;
+                }
+                shard.entries.erase(it->key);
+                --(it->inMain ? shard.mainBlocks : shard.fifoBlocks);
+                size.fetch_sub(blockSize);
+                it = list->erase(it);
+            }
+        }
+        for (auto it = shard.ghosts.begin(); it != shard.ghosts.end();) {
+            if (isFile(*it)) {
+                shard.ghostIndex.erase(*it);
+                it = shard.ghosts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void CouchBlockCache::forget(const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0) {
+        forget(st.st_dev, st.st_ino);
+    }
+}
+
+CouchBlockCache::Shard& CouchBlockCache::getShard(const Key& key) {
+    return shards[KeyHash()(key) % numShards];
+}
+
+bool CouchBlockCache::lookup(const FileId& file, uint64_t block, char* buf) {
+    const Key key{file, block};
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lh(shard.mutex);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {
+        return false;
+    }
+    auto entry = it->second;
+    if (entry->inMain) {
+        shard.main.splice(shard.main.begin(), shard.main, entry);
+    }
+    std::memcpy(buf, entry->data.get(), blockSize);
+    return true;
+}
+
+void CouchBlockCache::insert(const FileId& file,
+                             uint64_t block,
+                             const char* data) {
+    const Key key{file, block};
+    std::unique_ptr<char[]> copy(new char[blockSize]);
+    std::memcpy(copy.get(), data, blockSize);
+
+    Shard& shard = getShard(key);
+    std::lock_guard<std::mutex> lh(shard.mutex);
+    if (shard.entries.count(key)) {
+        // Another reader missed on it too.
+        return;
+    }
+    while (shard.fifoBlocks + shard.mainBlocks >= shardBlocks) {
+        evict(shard);
+    }
+
+    // Read again since its eviction from the FIFO: it goes in the LRU.
+    auto ghost = shard.ghostIndex.find(key);
+    const bool inMain = ghost != shard.ghostIndex.end();
+    if (inMain) {
+        shard.ghosts.erase(ghost->second);
+        shard.ghostIndex.erase(ghost);
+    }
+    auto& list = inMain ? shard.main : shard.fifo;
+    list.push_front({key, std::move(copy), inMain});
+    shard.entries.emplace(key, list.begin());
+    (inMain ? shard.mainBlocks : shard.fifoBlocks)++;
+    size.fetch_add(blockSize);
+}
+
+void CouchBlockCache::evict(Shard& shard) {
+    const bool fromFifo = shard.fifoBlocks > fifoLimit || shard.main.empty();
+    auto& list = fromFifo ? shard.fifo : shard.main;
+    const Key key = list.back().key;
+    shard.entries.erase(key);
+    list.pop_back();
+    size.fetch_sub(blockSize);
+    if (!fromFifo) {
+        --shard.mainBlocks;
+        return;
+    }
+    --shard.fifoBlocks;
+    if (ghostLimit == 0) {
+        return;
+    }
+    if (shard.ghosts.size() == ghostLimit) {
+        shard.ghostIndex.erase(shard.ghosts.back());
+        shard.ghosts.pop_back();
+    }
+    shard.ghosts.push_front(key);
+    shard.ghostIndex.emplace(key, shard.ghosts.begin());
+}
+
+couch_file_handle BlockCacheOps::constructor(couchstore_error_info_t* errinfo) {
+    auto* cf = new CachedFile{wrapped_ops.constructor(errinfo), false, {}};
+    return reinterpret_cast<couch_file_handle>(cf);
+}
+
+couchstore_error_t BlockCacheOps::open(couchstore_error_info_t* errinfo,
+                                       couch_file_handle* h,
+                                       const char* path,
+                                       int flags) {
+    auto* cf = reinterpret_cast<CachedFile*>(*h);
+    struct stat before;
+    const bool existed = ::stat(path, &before) == 0;
+    couchstore_error_t errCode =
+            wrapped_ops.open(errinfo, &cf->orig_handle, path, flags);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        return errCode;
+    }
+
+    // The ops wrapped don't expose the fd, so identify the file by its
+    // path; if it was replaced while being opened, don't cache it.
+    struct stat after;
+    cf->cacheable = ::stat(path, &after) == 0 &&
+                    (!existed || (before.st_dev == after.st_dev &&
+                                  before.st_ino == after.st_ino));
+    if (cf->cacheable) {
+        const bool created =
+                !existed || after.st_size == 0 || (flags & O_TRUNC);
+        cf->id = cache.identify(after.st_dev, after.st_ino, created);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t BlockCacheOps::close(couchstore_error_info_t* errinfo,
+                                        couch_file_handle h) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    return wrapped_ops.close(errinfo, cf->orig_handle);
+}
+
+ssize_t BlockCacheOps::pread(couchstore_error_info_t* errinfo,
+                             couch_file_handle h,
+                             void* buf,
+                             size_t sz,
+                             cs_off_t off) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    if (mode == Mode::Bypass || !cf->cacheable || sz > maxCachedRead) {
+        return wrapped_ops.pread(errinfo, cf->orig_handle, buf, sz, off);
+    }
+
+    const size_t blockSize = CouchBlockCache::blockSize;
+    char block[CouchBlockCache::blockSize];
+    char* out = static_cast<char*>(buf);
+    size_t done = 0;
+    while (done < sz) {
+        const cs_off_t pos = off + done;
+        const uint64_t blockNo = pos / blockSize;
+        const size_t inBlock = pos % blockSize;
+        size_t avail = blockSize;
+        if (cache.lookup(cf->id, blockNo, block)) {
+            ++hits;
+        } else {
+            ++misses;
+            ssize_t got = wrapped_ops.pread(errinfo,
+                                            cf->orig_handle,
+                                            block,
+                                            blockSize,
+                                            blockNo * blockSize);
+            if (got < 0) {
+                return done ? ssize_t(done) : got;
+            }
+            avail = size_t(got);
+            // A block the file has grown past is complete, and (the file
+            // being append-only) will never change.
+            if (avail == blockSize) {
+                cache.insert(cf->id, blockNo, block);
+            }
+        }
+        if (avail <= inBlock) {
+            break;
+        }
+        const size_t len = std::min(avail - inBlock, sz - done);
+        std::memcpy(out + done, block + inBlock, len);
+        done += len;
+        if (avail < blockSize) {
+            break;
+        }
+    }
+    return done;
+}
+
+ssize_t BlockCacheOps::pwrite(couchstore_error_info_t* errinfo,
+                              couch_file_handle h,
+                              const void* buf,
+                              size_t sz,
+                              cs_off_t off) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    return wrapped_ops.pwrite(errinfo, cf->orig_handle, buf, sz, off);
+}
+
+cs_off_t BlockCacheOps::goto_eof(couchstore_error_info_t* errinfo,
+                                 couch_file_handle h) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    return wrapped_ops.goto_eof(errinfo, cf->orig_handle);
+}
+
+couchstore_error_t BlockCacheOps::sync(couchstore_error_info_t* errinfo,
+                                       couch_file_handle h) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    return wrapped_ops.sync(errinfo, cf->orig_handle);
+}
+
+couchstore_error_t BlockCacheOps::advise(couchstore_error_info_t* errinfo,
+                                         couch_file_handle h,
+                                         cs_off_t offs,
+                                         cs_off_t len,
+                                         couchstore_file_advice_t adv) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    return wrapped_ops.advise(errinfo, cf->orig_handle, offs, len, adv);
+}
+
+void BlockCacheOps::destructor(couch_file_handle h) {
+    auto* cf = reinterpret_cast<CachedFile*>(h);
+    wrapped_ops.destructor(cf->orig_handle);
+    delete cf;
+}
@@ -0,0 +1,235 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+#include <relaxed_atomic.h>
+
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+/**
+ * A size-bounded cache of couchstore file blocks, shared by all the vbucket
+ * files of a bucket, so that the B-tree nodes read by every lookup are
+ * served from memory rather than through a syscall to the page cache.
+ *
+ * couchstore files are append-only, so a block once read in full never
+ * changes; blocks are only made unreachable when their file is replaced
+ * (see identify()), and are dropped when it is removed (see forget()).
+ *
+ * Replacement is 2Q: a block enters a FIFO on its first read, and only
+ * moves to the main LRU if read again soon after. A scan reading each block
+ * once therefore cycles through the FIFO without evicting the (repeatedly
+ * read) index nodes in the LRU.
+ */
+class CouchBlockCache {
+public:
+    /// couchstore's block size, and the unit cached.
+    static const size_t blockSize = 4096;
+
+    /// Identity of the contents of a file.
+    struct FileId {
+        dev_t dev;
+        ino_t ino;
+        uint64_t generation;
+    };
+
+    /// @param capacity maximum bytes of block data held
+    explicit CouchBlockCache(size_t capacity);
+
+    ~CouchBlockCache();
+
+    /**
+     * Identify the file with the given device and inode. If created is true
+     * the file is new (empty), so any blocks cached for a previous file
+     * with the same inode are made unreachable.
+     */
+    FileId identify(dev_t dev, ino_t ino, bool created);
+
+    /**
+     * Forget the file with the given device and inode, which is about to be
+     * removed: drop its blocks, and its entry in the generations map. A
+     * file later given the same inode is identified afresh.
+     */
+    void forget(dev_t dev, ino_t ino);
+
+    /// forget() the file at path, if it exists.
+    void forget(const std::string& path);
+
+    /// Copy the block into buf (of blockSize) if cached.
+    bool lookup(const FileId& file, uint64_t block, char* buf);
+
+    /// Cache the block (blockSize bytes of data).
+    void insert(const FileId& file, uint64_t block, const char* data);
+
+    size_t getCapacity() const {
+        return capacity;
+    }
+
+    /// Bytes of block data currently held.
+    size_t getSize() const {
+        return size;
+    }
+
+private:
+    struct Key {
+        FileId file;
+        uint64_t block;
+
+        bool operator==(const Key& other) const {
+            return file.dev == other.file.dev && file.ino == other.file.ino &&
+                   file.generation == other.file.generation &&
+                   block == other.block;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        std::unique_ptr<char[]> data;
+        // In the main LRU (else the FIFO of blocks read once).
+        bool inMain;
+    };
+
+    /**
+     * An independently locked part of the cache. Both lists are ordered
+     * newest first.
+     */
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> fifo;
+        std::list<Entry> main;
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entries;
+        // Keys recently evicted from fifo; a miss on one goes to main.
+        std::list<Key> ghosts;
+        std::unordered_map<Key, std::list<Key>::iterator, KeyHash> ghostIndex;
+        size_t fifoBlocks = 0;
+        size_t mainBlocks = 0;
+    };
+
+    Shard& getShard(const Key& key);
+
+    /// Make room in the shard for one more block.
+    void evict(Shard& shard);
+
+    static const size_t numShards = 16;
+
+    const size_t capacity;
+    // Per shard: blocks in total, in the FIFO, and keys remembered.
+    const size_t shardBlocks;
+    const size_t fifoLimit;
+    const size_t ghostLimit;
+    std::array<Shard, numShards> shards;
+    Couchbase::RelaxedAtomic<size_t> size;
+
+    // The generation of each file identified and not yet forgotten.
+    // Generations are never reused, so blocks a reader inserts for a file
+    // as it is forgotten can't be served for a later one.
+    std::mutex generationsMutex;
+    std::map<std::pair<dev_t, ino_t>, uint64_t> generations;
+    uint64_t nextGeneration = 0;
+};
+
+/**
+ * FileOpsInterface implementation which serves reads through a
+ * CouchBlockCache, reading whole blocks from the wrapped ops on a miss.
+ *
+ * Reads larger than maxCachedRead (document bodies, mostly) bypass the
+ * cache, as do all reads by ops in Bypass mode. Every file written by the
+ * bucket must be opened through these ops (in either mode), so that a new
+ * file reusing an old one's inode is recognised.
+ */
+class BlockCacheOps : public FileOpsInterface {
+public:
+    enum class Mode {
+        /// Serve reads from the cache, adding the blocks missed.
+        Cached,
+        /// Read straight from the wrapped ops (for compaction and backfill,
+        /// which read most blocks of a file once, and would only displace
+        /// the blocks lookups need).
+        Bypass
+    };
+
+    BlockCacheOps(CouchBlockCache& cache,
+                  FileOpsInterface& ops,
+                  Mode mode,
+                  Couchbase::RelaxedAtomic<size_t>& hits,
+                  Couchbase::RelaxedAtomic<size_t>& misses)
+        : cache(cache),
+          wrapped_ops(ops),
+          mode(mode),
+          hits(hits),
+          misses(misses) {
+    }
+
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override;
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle,
+                            const char* path,
+                            int oflag) override;
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override;
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle,
+                  void* buf,
+                  size_t nbytes,
+                  cs_off_t offset) override;
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle,
+                   const void* buf,
+                   size_t nbytes,
+                   cs_off_t offset) override;
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override;
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override;
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override;
+    void destructor(couch_file_handle handle) override;
+
+    /// Largest read served through the cache.
+    static const size_t maxCachedRead = 4 * CouchBlockCache::blockSize;
+
+private:
+    struct CachedFile {
+        couch_file_handle orig_handle;
+        // Whether the file could be identified (else reads bypass the cache)
+        bool cacheable;
+        CouchBlockCache::FileId id;
+    };
+
+    CouchBlockCache& cache;
+    FileOpsInterface& wrapped_ops;
+    const Mode mode;
+    Couchbase::RelaxedAtomic<size_t>& hits;
+    Couchbase::RelaxedAtomic<size_t>& misses;
+};
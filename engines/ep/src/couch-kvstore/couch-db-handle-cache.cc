@@ -0,0 +1,123 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-db-handle-cache.h"
+
+#include <stdexcept>
+#include <string>
+
+DbHandleCache::DbHandleCache(size_t capacity,
+                             const DbGenerations& generations,
+                             std::function<void(Db*)> closeDb)
+    : capacity(capacity), generations(generations), closeDb(std::move(closeDb)) {
+    if (capacity == 0) {
+        throw std::invalid_argument(
+                "DbHandleCache: capacity must be non-zero");
+    }
+    entries.assign(generations.size(), lru.end());
+}
+
+DbHandleCache::~DbHandleCache() {
+    clear();
+}
+
+Db* DbHandleCache::take(uint16_t vbid, uint64_t fileRev) {
+    std::vector<Db*> closing;
+    Db* db = nullptr;
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        if (replacementsSeen != generations.getReplacements()) {
+            replacementsSeen = generations.getReplacements();
+            removeStale(closing);
+        }
+        auto entry = entries.at(vbid);
+        if (entry != lru.end()) {
+            const bool current = entry->fileRev == fileRev &&
+                                 entry->generation == generations.get(vbid);
+            db = remove(vbid);
+            if (!current) {
+                // Of an older revision or header; no use to anyone.
+                closing.push_back(db);
+                db = nullptr;
+            }
+        }
+    }
+    for (auto* stale : closing) {
+        closeDb(stale);
+    }
+    return db;
+}
+
+void DbHandleCache::put(uint16_t vbid,
+                        uint64_t fileRev,
+                        uint64_t generation,
+                        Db* db) {
+    Db* evicted = db;
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        if (generation == generations.get(vbid) &&
+            entries.at(vbid) == lru.end()) {
+            if (lru.size() == capacity) {
+                evicted = remove(lru.back().vbid);
+            } else {
+                evicted = nullptr;
+            }
+            lru.push_front({vbid, fileRev, generation, db});
+            entries[vbid] = lru.begin();
+        }
+    }
+    if (evicted) {
+        closeDb(evicted);
+    }
+}
+
+void DbHandleCache::clear() {
+    std::list<Entry> closing;
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        closing.swap(lru);
+        entries.assign(entries.size(), lru.end());
+    }
+    for (auto& entry : closing) {
+        closeDb(entry.db);
+    }
+}
+
+Db* DbHandleCache::remove(uint16_t vbid) {
+    auto entry = entries[vbid];
+    if (entry == lru.end()) {
+        return nullptr;
+    }
+    Db* db = entry->db;
+    lru.erase(entry);
+    entries[vbid] = lru.end();
+    return db;
+}
+
+void DbHandleCache::removeStale(std::vector<Db*>& closing) {
+    for (auto it = lru.begin(); it != lru.end();) {
+        if (it->generation != generations.get(it->vbid)) {
+            closing.push_back(it->db);
+            entries[it->vbid] = lru.end();
+            it = lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
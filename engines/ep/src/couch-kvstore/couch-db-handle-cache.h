@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <vector>
+
+/**
+ * The generation of each of a shard's vbucket files, shared by its RW and
+ * RO stores. The RW store advances a vbucket's generation whenever it
+ * commits to, replaces or deletes the file; a handle opened at an older
+ * generation may be reading an old header, and is stale.
+ */
+class DbGenerations {
+public:
+    explicit DbGenerations(size_t numVBuckets) : generations(numVBuckets) {
+    }
+
+    size_t size() const {
+        return generations.size();
+    }
+
+    uint64_t get(uint16_t vbid) const {
+        return generations.at(vbid);
+    }
+
+    /// The vbucket's file has been committed to.
+    void advance(uint16_t vbid) {
+        ++generations.at(vbid);
+    }
+
+    /**
+     * The vbucket's file has been replaced or deleted: as well as making
+     * its handles stale, have the caches close them promptly, so that they
+     * don't keep the old file's space.
+     */
+    void replace(uint16_t vbid) {
+        advance(vbid);
+        ++replacements;
+    }
+
+    uint64_t getReplacements() const {
+        return replacements;
+    }
+
+private:
+    std::vector<std::atomic<uint64_t>> generations;
+    std::atomic<uint64_t> replacements{0};
+};
+
+/**
+ * A bounded LRU cache of read-only couchstore Db handles, at most one per
+ * vbucket, so that gets and bgfetches can reuse an open file (and its
+ * parsed header) instead of opening it each time.
+ *
+ * Each store has its own cache. Writes don't touch the caches: they only
+ * advance the file's generation (see DbGenerations), and take() re-validates
+ * a handle against it, closing a stale one instead of returning it. After
+ * a file is replaced or deleted, the next take() of any vbucket also closes
+ * every stale handle.
+ *
+ * Handles are used by one reader at a time: take() removes the handle from
+ * the cache, and put() returns it.
+ */
+class DbHandleCache {
+public:
+    /**
+     * @param capacity maximum number of handles cached
+     * @param generations the generations of the vbuckets' files
+     * @param closeDb function closing (and freeing) a handle
+     */
+    DbHandleCache(size_t capacity,
+                  const DbGenerations& generations,
+                  std::function<void(Db*)> closeDb);
+
+    ~DbHandleCache();
+
+    /// The current generation of the vbucket's file.
+    uint64_t getGeneration(uint16_t vbid) const {
+        return generations.get(vbid);
+    }
+
+    /**
+     * Take the cached handle of the vbucket's file revision fileRev, if it
+     * is still of the file's current generation.
+     * @return the handle, or null if none is cached (or it was stale)
+     */
+    Db* take(uint16_t vbid, uint64_t fileRev);
+
+    /**
+     * Return a handle of the vbucket's file revision fileRev, opened (or
+     * taken) when its generation was generation. Closes the handle if the
+     * file has since been written to, or if a handle for the vbucket is
+     * already cached; else caches it, closing the least recently used if
+     * the cache is full.
+     */
+    void put(uint16_t vbid, uint64_t fileRev, uint64_t generation, Db* db);
+
+    /// Close all the handles cached.
+    void clear();
+
+private:
+    struct Entry {
+        uint16_t vbid;
+        uint64_t fileRev;
+        uint64_t generation;
+        Db* db;
+    };
+
+    /// Remove the vbucket's entry (if any), returning its handle.
+    Db* remove(uint16_t vbid);
+
+    /// Remove the entries of old generations, adding them to closing.
+    void removeStale(std::vector<Db*>& closing);
+
+    const size_t capacity;
+    const DbGenerations& generations;
+    const std::function<void(Db*)> closeDb;
+
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<Entry> lru;
+    // Per vbucket: its entry (lru.end() if none).
+    std::vector<std::list<Entry>::iterator> entries;
+    // The replacements seen when stale handles were last closed.
+    uint64_t replacementsSeen = 0;
+};
@@ -0,0 +1,178 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-deferred-sync.h"
+
+#include <algorithm>
+#include <memory>
+
+DeferredSyncOps::SyncPass::SyncPass(std::vector<DeferredFile*> work)
+    : work(std::move(work)), remaining(this->work.size()) {
+}
+
+void DeferredSyncOps::SyncPass::help() {
+    std::unique_lock<std::mutex> lh(mutex);
+    while (nextWork < work.size()) {
+        DeferredFile* df = work[nextWork++];
+        lh.unlock();
+        couchstore_error_info_t errinfo;
+        couchstore_error_t err = df->orig_ops->sync(&errinfo, df->orig_handle);
+        lh.lock();
+        if (err != COUCHSTORE_SUCCESS && firstError == COUCHSTORE_SUCCESS) {
+            firstError = err;
+        }
+        if (--remaining == 0) {
+            doneCond.notify_all();
+        }
+    }
+}
+
+couchstore_error_t DeferredSyncOps::SyncPass::wait() {
+    std::unique_lock<std::mutex> lh(mutex);
+    doneCond.wait(lh, [this] { return remaining == 0; });
+    return firstError;
+}
+
+DeferredSyncOps::DeferredSyncOps(FileOpsInterface& ops,
+                                 HelperScheduler scheduleHelper)
+    : wrapped_ops(ops), scheduleHelper(std::move(scheduleHelper)) {
+}
+
+couch_file_handle DeferredSyncOps::constructor(
+        couchstore_error_info_t* errinfo) {
+    FileOpsInterface* orig_ops = &wrapped_ops;
+    auto* df = new DeferredFile(orig_ops, orig_ops->constructor(errinfo));
+    return reinterpret_cast<couch_file_handle>(df);
+}
+
+couchstore_error_t DeferredSyncOps::open(couchstore_error_info_t* errinfo,
+                                         couch_file_handle* h,
+                                         const char* path,
+                                         int flags) {
+    auto* df = reinterpret_cast<DeferredFile*>(*h);
+    return df->orig_ops->open(errinfo, &df->orig_handle, path, flags);
+}
+
+couchstore_error_t DeferredSyncOps::close(couchstore_error_info_t* errinfo,
+                                          couch_file_handle h) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    couchstore_error_t err = syncNow(errinfo, df);
+    couchstore_error_t closeErr = df->orig_ops->close(errinfo, df->orig_handle);
+    return err != COUCHSTORE_SUCCESS ? err : closeErr;
+}
+
+ssize_t DeferredSyncOps::pread(couchstore_error_info_t* errinfo,
+                               couch_file_handle h,
+                               void* buf,
+                               size_t sz,
+                               cs_off_t off) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    return df->orig_ops->pread(errinfo, df->orig_handle, buf, sz, off);
+}
+
+ssize_t DeferredSyncOps::pwrite(couchstore_error_info_t* errinfo,
+                                couch_file_handle h,
+                                const void* buf,
+                                size_t sz,
+                                cs_off_t off) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    // Whatever was written before the deferred sync must be durable before
+    // this write.
+    couchstore_error_t err = syncNow(errinfo, df);
+    if (err != COUCHSTORE_SUCCESS) {
+        return err;
+    }
+    return df->orig_ops->pwrite(errinfo, df->orig_handle, buf, sz, off);
+}
+
+cs_off_t DeferredSyncOps::goto_eof(couchstore_error_info_t* errinfo,
+                                   couch_file_handle h) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    return df->orig_ops->goto_eof(errinfo, df->orig_handle);
+}
+
+couchstore_error_t DeferredSyncOps::sync(couchstore_error_info_t* errinfo,
+                                         couch_file_handle h) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    if (!df->syncPending) {
+        df->syncPending = true;
+        deferred.push_back(df);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t DeferredSyncOps::advise(couchstore_error_info_t* errinfo,
+                                           couch_file_handle h,
+                                           cs_off_t offs,
+                                           cs_off_t len,
+                                           couchstore_file_advice_t adv) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    return df->orig_ops->advise(errinfo, df->orig_handle, offs, len, adv);
+}
+
+void DeferredSyncOps::destructor(couch_file_handle h) {
+    auto* df = reinterpret_cast<DeferredFile*>(h);
+    if (df->syncPending) {
+        // Never closed; nothing more can be written so just forget it.
+        deferred.erase(std::find(deferred.begin(), deferred.end(), df));
+    }
+    df->orig_ops->destructor(df->orig_handle);
+    delete df;
+}
+
+couchstore_error_t DeferredSyncOps::syncDeferred() {
+    if (deferred.empty()) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    if (deferred.size() == 1 || !scheduleHelper) {
+        for (auto* df : deferred) {
+            couchstore_error_info_t errinfo;
+            couchstore_error_t syncErr =
+                    df->orig_ops->sync(&errinfo, df->orig_handle);
+            if (err == COUCHSTORE_SUCCESS) {
+                err = syncErr;
+            }
+        }
+    } else {
+        // Shared with the helper, which may only run after we're done (by
+        // when it finds nothing left to claim).
+        auto pass = std::make_shared<SyncPass>(deferred);
+        scheduleHelper([pass]() { pass->help(); });
+        pass->help();
+        err = pass->wait();
+    }
+
+    for (auto* df : deferred) {
+        df->syncPending = false;
+    }
+    deferred.clear();
+    return err;
+}
+
+couchstore_error_t DeferredSyncOps::syncNow(couchstore_error_info_t* errinfo,
+                                            DeferredFile* df) {
+    if (!df->syncPending) {
+        return COUCHSTORE_SUCCESS;
+    }
+    df->syncPending = false;
+    deferred.erase(std::find(deferred.begin(), deferred.end(), df));
+    return df->orig_ops->sync(errinfo, df->orig_handle);
+}
@@ -0,0 +1,158 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <libcouchstore/couch_db.h>
+#include <platform/platform.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * FileOpsInterface wrapper used to group commit several couchstore files.
+ *
+ * sync() doesn't sync the file, it only records that the file needs syncing.
+ * The sync is performed before the next write to the file - so couchstore's
+ * ordering guarantee, that the data is durable before the header referring to
+ * it is written, still holds - or by syncDeferred(), which syncs all files
+ * with an outstanding sync together, in parallel with a helper scheduled
+ * for the pass (CouchKVStore runs it as an ExecutorPool writer task, so
+ * each shard's group commit gets its own helper without dedicated
+ * threads).
+ *
+ * Hence after couchstore_commit() the file's new header is only durable once
+ * syncDeferred() has returned; files must be kept open until then (closing a
+ * file syncs it).
+ *
+ * Not thread-safe (other than internally); used by the flusher only.
+ */
+class DeferredSyncOps : public FileOpsInterface {
+public:
+    /**
+     * Runs the given function asynchronously (e.g. as an ExecutorPool task).
+     * The function never blocks waiting for the caller of syncDeferred(),
+     * so it may run at any time - even after syncDeferred() returned, when
+     * it has nothing left to do.
+     */
+    using HelperScheduler = std::function<void(std::function<void()>)>;
+
+    /**
+     * @param ops the FileOps to wrap
+     * @param scheduleHelper if set, syncDeferred() shares its files with a
+     *        helper it schedules with it; otherwise the calling thread syncs
+     *        them all.
+     */
+    DeferredSyncOps(FileOpsInterface& ops, HelperScheduler scheduleHelper = {});
+
+    couch_file_handle constructor(couchstore_error_info_t* errinfo) override;
+    couchstore_error_t open(couchstore_error_info_t* errinfo,
+                            couch_file_handle* handle,
+                            const char* path,
+                            int oflag) override;
+    couchstore_error_t close(couchstore_error_info_t* errinfo,
+                             couch_file_handle handle) override;
+    ssize_t pread(couchstore_error_info_t* errinfo,
+                  couch_file_handle handle,
+                  void* buf,
+                  size_t nbytes,
+                  cs_off_t offset) override;
+    ssize_t pwrite(couchstore_error_info_t* errinfo,
+                   couch_file_handle handle,
+                   const void* buf,
+                   size_t nbytes,
+                   cs_off_t offset) override;
+    cs_off_t goto_eof(couchstore_error_info_t* errinfo,
+                      couch_file_handle handle) override;
+    couchstore_error_t sync(couchstore_error_info_t* errinfo,
+                            couch_file_handle handle) override;
+    couchstore_error_t advise(couchstore_error_info_t* errinfo,
+                              couch_file_handle handle,
+                              cs_off_t offset,
+                              cs_off_t len,
+                              couchstore_file_advice_t advice) override;
+    void destructor(couch_file_handle handle) override;
+
+    /**
+     * Perform all deferred syncs.
+     *
+     * @return COUCHSTORE_SUCCESS, or the first error any sync returned
+     */
+    couchstore_error_t syncDeferred();
+
+    /// Number of files with a deferred sync.
+    size_t getNumDeferred() const {
+        return deferred.size();
+    }
+
+private:
+    struct DeferredFile {
+        DeferredFile(FileOpsInterface* ops, couch_file_handle handle)
+            : orig_ops(ops), orig_handle(handle), syncPending(false) {
+        }
+
+        FileOpsInterface* orig_ops;
+        couch_file_handle orig_handle;
+        bool syncPending;
+    };
+
+    /**
+     * The files of one syncDeferred() call, shared with its helper. The
+     * caller and the helper each claim files in turn; the caller never waits
+     * for the helper to start - only for a sync it has already started - so
+     * a late helper just means the caller does more of the pass.
+     */
+    class SyncPass {
+    public:
+        explicit SyncPass(std::vector<DeferredFile*> work);
+
+        /// Sync files of the pass until none are left unclaimed.
+        void help();
+
+        /**
+         * Wait until every file of the pass is synced.
+         *
+         * @return COUCHSTORE_SUCCESS, or the first error a sync returned
+         */
+        couchstore_error_t wait();
+
+    private:
+        std::mutex mutex;
+        std::condition_variable doneCond;
+        const std::vector<DeferredFile*> work;
+        // Index in work of the next file to sync.
+        size_t nextWork = 0;
+        // Number of files in work not yet synced.
+        size_t remaining;
+        couchstore_error_t firstError = COUCHSTORE_SUCCESS;
+    };
+
+    /// Perform the file's deferred sync (if any) now.
+    couchstore_error_t syncNow(couchstore_error_info_t* errinfo,
+                               DeferredFile* file);
+
+    FileOpsInterface& wrapped_ops;
+
+    // Files with a deferred sync.
+    std::vector<DeferredFile*> deferred;
+
+    const HelperScheduler scheduleHelper;
+};
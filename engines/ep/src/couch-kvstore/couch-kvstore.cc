@@ -46,20 +46,137 @@
 #include "common.h"
 #include "couch-kvstore/couch-kvstore.h"
 #include "ep_types.h"
+#include "executorpool.h"
+#include "objectregistry.h"
 #define STATWRITER_NAMESPACE couchstore_engine
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
+#include "tasks.h"
 #include "vbucket.h"
 #include "vbucket_bgfetch_item.h"
 
 #include <JSON_checker.h>
 #include <kvstore.h>
 #include <platform/compress.h>
+#include <platform/make_unique.h>
+
+#include <deque>
+
+// Document body reads of a bgfetch less than this far apart are merged;
+// reading the gap costs less than another I/O.
+static const size_t bgFetchMergeGap = 4096;
+
+// Number of documents whose references collectValueLog() updates at once.
+static const size_t valueLogCopyBatch = 1024;
+
+/// Context for recordDbDumpC(): the scan, its prefetcher (if any), and the
+/// value logs its values may be in.
+struct ScanCbCtx {
+    ScanContext* sctx;
+    FilePrefetcher* prefetcher;
+    ValueLogs* valueLogs;
+};
+
+/**
+ * content_meta flag of a document kept in the value log: its body is the
+ * ValueLog::Ref of its value.
+ */
+static const couchstore_content_meta_flags COUCH_DOC_IN_VALUE_LOG = 64;
+
+static bool isInValueLog(const DocInfo& docinfo) {
+    return docinfo.content_meta & COUCH_DOC_IN_VALUE_LOG;
+}
+
+/**
+ * Read the value of a document kept in the value log.
+ *
+ * @param body the document's body
+ * @param decompress true to inflate a value compressed by the store; else
+ *        such a value is returned as is, and compressed set
+ * @returns COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_CORRUPT if the value
+ *          couldn't be read
+ */
+static couchstore_error_t readLoggedValue(ValueLog& log,
+                                          sized_buf body,
+                                          bool decompress,
+                                          std::string& value,
+                                          bool& compressed) {
+    ValueLog::Ref ref;
+    if (!ValueLog::Ref::decode({body.buf, body.size}, ref) ||
+        !log.read(ref, value)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    compressed = ref.isCompressed();
+    if (compressed && decompress) {
+        cb::compression::Buffer inflated;
+        if (!cb::compression::inflate(cb::compression::Algorithm::Snappy,
+                                      value.data(),
+                                      value.size(),
+                                      inflated)) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        value.assign(inflated.data.get(), inflated.len);
+        compressed = false;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+/**
+ * The region of the file holding a document's body: couchstore writes it as
+ * a chunk with an 8 byte header, and the file has a marker byte at the start
+ * of every 4KiB block.
+ */
+static FilePrefetcher::Extent bodyExtent(const DocInfo* docinfo) {
+    const size_t chunkLen = docinfo->size + 8;
+    return {cs_off_t(docinfo->bp), chunkLen + chunkLen / 4095 + 1};
+}
+
+/**
+ * The whole blocks holding a document's body: couchstore's buffered reads
+ * read a block at a time, so only whole blocks can serve them from a
+ * ReadStage.
+ */
+static FilePrefetcher::Extent bodyBlocks(const DocInfo* docinfo) {
+    const size_t blockSize = CouchBlockCache::blockSize;
+    const auto extent = bodyExtent(docinfo);
+    const cs_off_t start = extent.first - extent.first % blockSize;
+    const cs_off_t end = extent.first + extent.second;
+    return {start,
+            (size_t(end - start) + blockSize - 1) / blockSize * blockSize};
+}
+
+using DocInfoPtr = std::unique_ptr<DocInfo, void (*)(DocInfo*)>;
+
+/// Deep copy of a DocInfo, in one allocation (as couchstore_free_docinfo()
+/// expects).
+static DocInfoPtr copyDocInfo(const DocInfo& from) {
+    char* buffer = static_cast<char*>(cb_calloc(
+            1, sizeof(DocInfo) + from.id.size + from.rev_meta.size));
+    DocInfo* docinfo = reinterpret_cast<DocInfo*>(buffer);
+    *docinfo = from;
+    docinfo->id.buf = buffer + sizeof(DocInfo);
+    std::memcpy(docinfo->id.buf, from.id.buf, from.id.size);
+    docinfo->rev_meta.buf = docinfo->id.buf + from.id.size;
+    std::memcpy(docinfo->rev_meta.buf, from.rev_meta.buf, from.rev_meta.size);
+    return DocInfoPtr(docinfo, couchstore_free_docinfo);
+}
 
 extern "C" {
     static int recordDbDumpC(Db *db, DocInfo *docinfo, void *ctx)
     {
-        return CouchKVStore::recordDbDump(db, docinfo, ctx);
+        auto* cbCtx = static_cast<ScanCbCtx*>(ctx);
+        if (cbCtx->prefetcher && docinfo->size > 0) {
+            cbCtx->prefetcher->readAhead(bodyBlocks(docinfo));
+        }
+        return CouchKVStore::recordDbDump(
+                db, docinfo, cbCtx->sctx, *cbCtx->valueLogs);
+    }
+
+    static int collectDocInfoC(Db *db, DocInfo *docinfo, void *ctx)
+    {
+        static_cast<std::vector<DocInfoPtr>*>(ctx)->push_back(
+                copyDocInfo(*docinfo));
+        return 0;
     }
 }
 
@@ -189,30 +306,23 @@ struct AllKeysCtx {
     uint32_t count;
 };
 
-couchstore_content_meta_flags CouchRequest::getContentMeta(const Item& it) {
+couchstore_content_meta_flags CouchRequest::getContentMeta(
+        protocol_binary_datatype_t datatype,
+        size_t nbytes,
+        bool compressValue) {
     couchstore_content_meta_flags rval;
 
-    if (mcbp::datatype::is_json(it.getDataType())) {
+    if (mcbp::datatype::is_json(datatype)) {
         rval = COUCH_DOC_IS_JSON;
     } else {
         rval = COUCH_DOC_NON_JSON_MODE;
     }
 
-    if (mcbp::datatype::is_snappy(it.getDataType())) {
-        // We are currently using couchstore in a mode where it will try to
-        // compress documents iff COUCH_DOC_IS_COMPRESSED is specified.
-        // This would cause a conflict if we tried to store a document which
-        // is already compressed.
-        //
-        // Luckily for us we don't support keeping objects compressed in
-        // memory yet, so this won't happen. Let's throw an exception
-        // to make sure that we fix this when we're going to support
-        // compressed objects.
-        throw std::logic_error(
-            "CouchRequest::getContentMeta: can't store compressed items");
-    }
-
-    if (it.getNBytes() > 0) {
+    // couchstore compresses (and, when read, decompresses) the bodies
+    // flagged COUCH_DOC_IS_COMPRESSED. A value which is already compressed
+    // is stored as is, its datatype saying so; as are all values when we
+    // do the compressing.
+    if (nbytes > 0 && !compressValue && !mcbp::datatype::is_snappy(datatype)) {
         // Don't try to compress empty bodies ;-)
         rval |= COUCH_DOC_IS_COMPRESSED;
     }
@@ -224,7 +334,8 @@ CouchRequest::CouchRequest(const Item& it,
                            uint64_t rev,
                            MutationRequestCallback& cb,
                            bool del,
-                           bool persistDocNamespace)
+                           bool persistDocNamespace,
+                           bool compressValue)
     : IORequest(it.getVBucketId(), cb, del, it.getKey()),
       value(it.getValue()),
       fileRevNum(rev) {
@@ -237,9 +348,22 @@ CouchRequest::CouchRequest(const Item& it,
         dbDoc.id = {const_cast<char*>(key.c_str()), it.getKey().size()};
     }
 
+    protocol_binary_datatype_t datatype = it.getDataType();
     if (it.getNBytes()) {
         dbDoc.data.buf = const_cast<char *>(value->getData());
         dbDoc.data.size = it.getNBytes();
+        // Values which don't shrink are stored uncompressed, saving their
+        // readers the inflate.
+        if (compressValue && !mcbp::datatype::is_snappy(datatype) &&
+            cb::compression::deflate(cb::compression::Algorithm::Snappy,
+                                     value->getData(),
+                                     it.getNBytes(),
+                                     deflated) &&
+            deflated.len < it.getNBytes()) {
+            dbDoc.data.buf = deflated.data.get();
+            dbDoc.data.size = deflated.len;
+            datatype |= PROTOCOL_BINARY_DATATYPE_SNAPPY;
+        }
     } else {
         dbDoc.data.buf = NULL;
         dbDoc.data.size = 0;
@@ -252,7 +376,7 @@ CouchRequest::CouchRequest(const Item& it,
         meta.setExptime(it.getExptime());
     }
 
-    meta.setDataType(it.getDataType());
+    meta.setDataType(datatype);
 
     dbDocInfo.db_seq = it.getBySeqno();
 
@@ -269,7 +393,8 @@ CouchRequest::CouchRequest(const Item& it,
         dbDocInfo.deleted = 0;
     }
     dbDocInfo.id = dbDoc.id;
-    dbDocInfo.content_meta = getContentMeta(it);
+    dbDocInfo.content_meta =
+            getContentMeta(datatype, dbDoc.data.size, compressValue);
 }
 
 CouchKVStore::CouchKVStore(KVStoreConfig& config)
@@ -280,22 +405,39 @@ CouchKVStore::CouchKVStore(KVStoreConfig& config,
                            FileOpsInterface& ops,
                            bool readOnly,
                            std::vector<std::atomic<uint64_t>>& dbFileRevMap,
-                           size_t fileRevMapSize)
+                           size_t fileRevMapSize,
+                           DbGenerations* dbGenerations,
+                           ValueLogs* valueLogs)
     : KVStore(config, readOnly),
       dbname(config.getDBName()),
       dbFileRevMap(dbFileRevMap),
       fileRevMap(fileRevMapSize),
+      dbGenerations(dbGenerations),
+      valueLogs(valueLogs),
       intransaction(false),
       scanCounter(0),
       logger(config.getLogger()),
       base_ops(ops) {
     createDataDir(dbname);
-    statCollectingFileOps = getCouchstoreStatsOps(st.fsStats, base_ops);
-    statCollectingFileOpsCompaction = getCouchstoreStatsOps(
-        st.fsStatsCompaction, base_ops);
+    createFileOps();
 
     // init db file map with default revision number, 1
     numDbFiles = configuration.getMaxVBuckets();
+
+    if (!dbGenerations) {
+        ownedDbGenerations = std::make_unique<DbGenerations>(numDbFiles);
+        this->dbGenerations = ownedDbGenerations.get();
+    }
+    if (configuration.getDbHandleCacheSize() > 0) {
+        dbHandleCache = std::make_unique<DbHandleCache>(
+                configuration.getDbHandleCacheSize(),
+                *this->dbGenerations,
+                [this](Db* db) { closeDatabaseHandle(db); });
+    }
+    if (!valueLogs) {
+        ownedValueLogs = std::make_unique<ValueLogs>(dbname, numDbFiles);
+        this->valueLogs = ownedValueLogs.get();
+    }
     cachedVBStates.reserve(numDbFiles);
 
     // pre-allocate lookup maps (vectors) given we have a relatively
@@ -314,7 +456,9 @@ CouchKVStore::CouchKVStore(KVStoreConfig& config, FileOpsInterface& ops)
                    ops,
                    false /*readonly*/,
                    fileRevMap,
-                   config.getMaxVBuckets()) {
+                   config.getMaxVBuckets(),
+                   nullptr,
+                   nullptr) {
 }
 
 CouchKVStore::CouchKVStore(const CouchKVStore& copyFrom)
@@ -322,6 +466,8 @@ CouchKVStore::CouchKVStore(const CouchKVStore& copyFrom)
       dbname(copyFrom.dbname),
       dbFileRevMap(copyFrom.dbFileRevMap),
       fileRevMap(copyFrom.fileRevMap.size()),
+      dbGenerations(copyFrom.dbGenerations),
+      valueLogs(copyFrom.valueLogs),
       numDbFiles(copyFrom.numDbFiles),
       intransaction(false),
       logger(copyFrom.logger),
@@ -331,9 +477,74 @@ CouchKVStore::CouchKVStore(const CouchKVStore& copyFrom)
         fileRevMap[ii].store(copyFrom.fileRevMap[ii].load());
     }
     createDataDir(dbname);
-    statCollectingFileOps = getCouchstoreStatsOps(st.fsStats, base_ops);
+    createFileOps();
+}
+
+void CouchKVStore::createFileOps() {
+    FileOpsInterface* ops = &base_ops;
+    const std::string& backend = configuration.getReadBackend();
+    // Only couchstore's own (posix) ops are replaced; tests inject theirs.
+    if (backend != "sync" && ops == couchstore_get_default_file_ops()) {
+        asyncReader = AsyncReader::create(backend,
+                                          configuration.getReadQueueDepth());
+        asyncFileOps = std::make_unique<AsyncFileOps>(*asyncReader);
+        ops = asyncFileOps.get();
+        logger.log(EXTENSION_LOG_INFO,
+                   "CouchKVStore: reading through %s, queue depth %" PRIu64,
+                   asyncReader->getName(),
+                   uint64_t(asyncReader->getQueueDepth()));
+    }
+    statCollectingFileOps = getCouchstoreStatsOps(st.fsStats, *ops);
     statCollectingFileOpsCompaction = getCouchstoreStatsOps(
-        st.fsStatsCompaction, base_ops);
+        st.fsStatsCompaction, *ops);
+    fileOps = statCollectingFileOps.get();
+    fileOpsScan = statCollectingFileOps.get();
+    fileOpsCompaction = statCollectingFileOpsCompaction.get();
+
+    CouchBlockCache* blockCache = configuration.getBlockCache().get();
+    if (blockCache) {
+        blockCacheOps = std::make_unique<BlockCacheOps>(
+                *blockCache,
+                *fileOps,
+                BlockCacheOps::Mode::Cached,
+                st.blockCacheHits,
+                st.blockCacheMisses);
+        blockCacheOpsScan = std::make_unique<BlockCacheOps>(
+                *blockCache,
+                *fileOpsScan,
+                BlockCacheOps::Mode::Bypass,
+                st.blockCacheHits,
+                st.blockCacheMisses);
+        blockCacheOpsCompaction = std::make_unique<BlockCacheOps>(
+                *blockCache,
+                *fileOpsCompaction,
+                BlockCacheOps::Mode::Bypass,
+                st.blockCacheHits,
+                st.blockCacheMisses);
+        fileOps = blockCacheOps.get();
+        fileOpsScan = blockCacheOpsScan.get();
+        fileOpsCompaction = blockCacheOpsCompaction.get();
+    }
+
+    if (asyncReader) {
+        readStageOps = std::make_unique<ReadStageOps>(*fileOps);
+        readStageOpsScan = std::make_unique<ReadStageOps>(*fileOpsScan);
+        fileOps = readStageOps.get();
+        fileOpsScan = readStageOpsScan.get();
+    }
+
+    // Share each group sync with a writer task, when there is an engine
+    // (and hence an ExecutorPool) to run it.
+    const uint16_t shardId = configuration.getShardId();
+    deferredSyncOps = std::make_unique<DeferredSyncOps>(
+            *fileOps, [shardId](std::function<void()> help) {
+                auto* engine = ObjectRegistry::getCurrentEngine();
+                if (engine) {
+                    ExecutorPool::get()->schedule(
+                            std::make_shared<DeferredSyncTask>(
+                                    engine, shardId, std::move(help)));
+                }
+            });
 }
 
 /**
@@ -342,16 +553,21 @@ CouchKVStore::CouchKVStore(const CouchKVStore& copyFrom)
 std::unique_ptr<CouchKVStore> CouchKVStore::makeReadOnlyStore() {
     // Not using make_unique due to the private constructor we're calling
     return std::unique_ptr<CouchKVStore>(
-            new CouchKVStore(configuration, fileRevMap));
+            new CouchKVStore(
+                    configuration, fileRevMap, *dbGenerations, *valueLogs));
 }
 
 CouchKVStore::CouchKVStore(KVStoreConfig& config,
-                           std::vector<std::atomic<uint64_t>>& dbFileRevMap)
+                           std::vector<std::atomic<uint64_t>>& dbFileRevMap,
+                           DbGenerations& dbGenerations,
+                           ValueLogs& valueLogs)
     : CouchKVStore(config,
                    *couchstore_get_default_file_ops(),
                    true /*readonly*/,
                    dbFileRevMap,
-                   0) {
+                   0,
+                   &dbGenerations,
+                   &valueLogs) {
 }
 
 void CouchKVStore::initialize() {
@@ -390,6 +606,10 @@ void CouchKVStore::initialize() {
 }
 
 CouchKVStore::~CouchKVStore() {
+    // The cached handles were opened through this store's file ops.
+    if (dbHandleCache) {
+        dbHandleCache->clear();
+    }
     close();
 
     for (std::vector<vbucket_state *>::iterator it = cachedVBStates.begin();
@@ -422,6 +642,7 @@ void CouchKVStore::reset(uint16_t vbucketId) {
         // KVBucket::vb_mutexes is used in this case.
         unlinkCouchFile(vbucketId, dbFileRevMap[vbucketId]);
         incrementRevision(vbucketId);
+        valueLogs->get(vbucketId).removeAll();
 
         setVBucketState(
                 vbucketId, *state, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT);
@@ -452,15 +673,19 @@ void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
                              fileRev,
                              requestcb,
                              deleteItem,
-                             configuration.shouldPersistDocNamespace());
+                             configuration.shouldPersistDocNamespace(),
+                             storeValuesCompressed());
     pendingReqsQ.push_back(req);
 }
 
 GetValue CouchKVStore::get(const DocKey& key, uint16_t vb, bool fetchDelete) {
+    // Before choosing the file, whose values may be in generations a
+    // concurrent compaction removes.
+    auto pin = valueLogs->get(vb).pin();
     Db *db = NULL;
     uint64_t fileRev = dbFileRevMap[vb];
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    uint64_t generation;
+    couchstore_error_t errCode = openReadDB(vb, fileRev, &db, generation);
     if (errCode != COUCHSTORE_SUCCESS) {
         ++st.numGetFailure;
         logger.log(EXTENSION_LOG_WARNING,
@@ -470,7 +695,12 @@ GetValue CouchKVStore::get(const DocKey& key, uint16_t vb, bool fetchDelete) {
     }
 
     GetValue gv = getWithHeader(db, key, vb, GetMetaOnly::No, fetchDelete);
-    closeDatabaseHandle(db);
+    releaseReadDB(vb,
+                  fileRev,
+                  generation,
+                  db,
+                  gv.getStatus() == ENGINE_SUCCESS ||
+                          gv.getStatus() == ENGINE_KEY_ENOENT);
     return gv;
 }
 
@@ -533,11 +763,13 @@ GetValue CouchKVStore::getWithHeader(void* dbHandle,
 
 void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
     int numItems = itms.size();
+    // Before choosing the file (see get()).
+    auto pin = valueLogs->get(vb).pin();
     uint64_t fileRev = dbFileRevMap[vb];
 
     Db *db = NULL;
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    uint64_t generation;
+    couchstore_error_t errCode = openReadDB(vb, fileRev, &db, generation);
     if (errCode != COUCHSTORE_SUCCESS) {
         logger.log(EXTENSION_LOG_WARNING,
                    "CouchKVStore::getMulti: openDB error:%s, "
@@ -568,8 +800,12 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
 
     GetMultiCbCtx ctx(*this, vb, itms);
 
-    errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
-                                        0, getMultiCbC, &ctx);
+    if (asyncReader && itms.size() > 1) {
+        errCode = getMultiStaged(db, ids, itms.size(), ctx);
+    } else {
+        errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
+                                            0, getMultiCbC, &ctx);
+    }
     if (errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure += numItems;
         logger.log(EXTENSION_LOG_WARNING, "CouchKVStore::getMulti: "
@@ -580,10 +816,54 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
             item.second.value.setStatus(couchErr2EngineErr(errCode));
         }
     }
-    closeDatabaseHandle(db);
+    releaseReadDB(vb, fileRev, generation, db, errCode == COUCHSTORE_SUCCESS);
     delete []ids;
 }
 
+couchstore_error_t CouchKVStore::getMultiStaged(Db* db,
+                                                sized_buf* ids,
+                                                size_t numIds,
+                                                GetMultiCbCtx& ctx) {
+    std::vector<DocInfoPtr> docinfos;
+    couchstore_error_t errCode = couchstore_docinfos_by_id(
+            db, ids, numIds, 0, collectDocInfoC, &docinfos);
+    if (errCode == COUCHSTORE_SUCCESS) {
+        std::vector<FilePrefetcher::Extent> extents;
+        for (const auto& docinfo : docinfos) {
+            if (docinfo->size == 0) {
+                continue;
+            }
+            auto it = ctx.fetches.find(makeDocKey(
+                    docinfo->id, configuration.shouldPersistDocNamespace()));
+            if (it != ctx.fetches.end() &&
+                it->second.isMetaOnly == GetMetaOnly::No) {
+                extents.push_back(bodyBlocks(docinfo.get()));
+            }
+        }
+
+        // Read the bodies all at once, in file order, merging neighbours,
+        // each document getting its part of the merged reads; fetchDoc()'s
+        // reads through fileOps are then served from the stage (by
+        // readStageOps, before they reach the block cache).
+        const char* path = couchstore_get_db_filename(db);
+        ReadStage stage(path);
+        const size_t numExtents = extents.size();
+        const auto fetched = FilePrefetcher(*asyncReader, path)
+                                     .fetch(std::move(extents),
+                                            bgFetchMergeGap,
+                                            stage);
+        st.io_bgfetch_reads_merged += numExtents - fetched.reads;
+        st.io_bgfetch_read_bytes += fetched.bytes;
+        st.bgFetchReadSize.add(fetched.bytes);
+
+        ReadStage::Scope scope(stage);
+        for (const auto& docinfo : docinfos) {
+            getMultiCb(db, docinfo.get(), &ctx);
+        }
+    }
+    return errCode;
+}
+
 void CouchKVStore::del(const Item &itm,
                        Callback<int> &cb) {
     if (isReadOnly()) {
@@ -603,7 +883,8 @@ void CouchKVStore::del(const Item &itm,
                              fileRev,
                              requestcb,
                              true,
-                             configuration.shouldPersistDocNamespace());
+                             configuration.shouldPersistDocNamespace(),
+                             storeValuesCompressed());
     pendingReqsQ.push_back(req);
 }
 
@@ -765,16 +1046,22 @@ static int edit_docinfo_hook(DocInfo **info, const sized_buf *item) {
  * @param metadata metadata of the document
  * @param item     buffer containing data and size
  * @param ctx      context for compaction
+ * @param valueLog the vbucket's value log
  * @param currtime current time
  */
 static int notify_expired_item(DocInfo& info,
                                MetaData& metadata,
                                sized_buf item,
                                compaction_ctx& ctx,
+                               ValueLog& valueLog,
                                time_t currtime) {
-    std::array<uint8_t, 1> ext_meta = {{metadata.getDataType()}};
+    // The value passed on (if any) is uncompressed.
+    std::array<uint8_t, 1> ext_meta = {
+            {uint8_t(metadata.getDataType() &
+                     ~PROTOCOL_BINARY_DATATYPE_SNAPPY)}};
     cb::char_buffer data;
     cb::compression::Buffer inflated;
+    std::string logged;
 
     if (mcbp::datatype::is_xattr(metadata.getDataType())) {
         if (item.buf == nullptr) {
@@ -782,11 +1069,25 @@ static int notify_expired_item(DocInfo& info,
             return COUCHSTORE_COMPACT_NEED_BODY;
         }
 
-        if (info.content_meta | COUCH_DOC_IS_COMPRESSED) {
+        data = {item.buf, item.size};
+        if (isInValueLog(info)) {
+            bool compressed;
+            auto err = readLoggedValue(valueLog, item, true, logged, compressed);
+            if (err != COUCHSTORE_SUCCESS) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "time_purge_hook: failed to read value log of document "
+                    "with seqno %" PRIu64 " revno: %" PRIu64,
+                    info.db_seq, info.rev_seq);
+                return err;
+            }
+            data = {&logged[0], logged.size()};
+        }
+        if ((info.content_meta & COUCH_DOC_IS_COMPRESSED) ||
+            mcbp::datatype::is_snappy(metadata.getDataType())) {
             using namespace cb::compression;
 
             if (!inflate(Algorithm::Snappy,
-                         item.buf, item.size, inflated)) {
+                         data.buf, data.len, inflated)) {
                 LOG(EXTENSION_LOG_WARNING,
                     "time_purge_hook: failed to inflate document with seqno %" PRIu64 ""
                     "revno: %" PRIu64, info.db_seq, info.rev_seq);
@@ -815,8 +1116,17 @@ static int notify_expired_item(DocInfo& info,
     return COUCHSTORE_SUCCESS;
 }
 
+/// Context of time_purge_hook(): the compaction, and the bytes of each of
+/// the vbucket's value log files which the documents kept refer to.
+struct CompactionHookCtx {
+    compaction_ctx& ctx;
+    ValueLog& valueLog;
+    std::unordered_map<uint64_t, uint64_t> liveBytes;
+};
+
 static int time_purge_hook(Db* d, DocInfo* info, sized_buf item, void* ctx_p) {
-    compaction_ctx* ctx = static_cast<compaction_ctx*>(ctx_p);
+    auto& hookCtx = *static_cast<CompactionHookCtx*>(ctx_p);
+    compaction_ctx* ctx = &hookCtx.ctx;
     const uint16_t vbid = ctx->db_file_id;
 
     if (info == nullptr) {
@@ -824,6 +1134,11 @@ static int time_purge_hook(Db* d, DocInfo* info, sized_buf item, void* ctx_p) {
         return couchstore_set_purge_seq(d, ctx->max_purged_seq[vbid]);
     }
 
+    if (isInValueLog(*info) && item.buf == nullptr) {
+        // Its body is needed to account for its value's space.
+        return COUCHSTORE_COMPACT_NEED_BODY;
+    }
+
     DbInfo infoDb;
     auto err = couchstore_db_info(d, &infoDb);
     if (err != COUCHSTORE_SUCCESS) {
@@ -867,8 +1182,12 @@ static int time_purge_hook(Db* d, DocInfo* info, sized_buf item, void* ctx_p) {
             if (exptime && exptime < currtime) {
                 int ret;
                 try {
-                    ret = notify_expired_item(*info, *metadata, item,
-                                             *ctx, currtime);
+                    ret = notify_expired_item(*info,
+                                              *metadata,
+                                              item,
+                                              *ctx,
+                                              hookCtx.valueLog,
+                                              currtime);
                 } catch (const std::bad_alloc&) {
                     LOG(EXTENSION_LOG_WARNING,
                         "time_purge_hook: memory allocation failed");
@@ -890,6 +1209,19 @@ static int time_purge_hook(Db* d, DocInfo* info, sized_buf item, void* ctx_p) {
         ctx->bloomFilterCallback->callback(ctx->db_file_id, key, deleted);
     }
 
+    if (isInValueLog(*info)) {
+        ValueLog::Ref ref;
+        if (!ValueLog::Ref::decode({item.buf, item.size}, ref)) {
+            LOG(EXTENSION_LOG_WARNING,
+                "time_purge_hook: invalid value log reference of document "
+                "with seqno %" PRIu64 " revno: %" PRIu64,
+                info->db_seq, info->rev_seq);
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        hookCtx.liveBytes[ref.generation] +=
+                ValueLog::headerSize + info->id.size + ref.length;
+    }
+
     return COUCHSTORE_COMPACT_KEEP_ITEM;
 }
 
@@ -908,7 +1240,7 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
 
     couchstore_compact_hook       hook = time_purge_hook;
     couchstore_docinfo_hook dhook = docinfo_hook;
-    FileOpsInterface         *def_iops = statCollectingFileOpsCompaction.get();
+    FileOpsInterface         *def_iops = fileOpsCompaction;
     Db                      *compactdb = NULL;
     Db                       *targetDb = NULL;
     couchstore_error_t         errCode = COUCHSTORE_SUCCESS;
@@ -922,6 +1254,8 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
     uint64_t                   fileRev = dbFileRevMap[vbid];
     uint64_t                   new_rev = fileRev + 1;
     hook_ctx->config = &configuration;
+    CompactionHookCtx compactHookCtx{*hook_ctx, valueLogs->get(vbid), {}};
+    std::vector<uint64_t> collectedValueLogs;
 
     // Open the source VBucket database file ...
     errCode = openDB(vbid,
@@ -954,8 +1288,13 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
     }
 
     // Perform COMPACTION of vbucket.couch.rev into vbucket.couch.rev.compact
-    errCode = couchstore_compact_db_ex(compactdb, compact_file.c_str(), flags,
-                                       hook, dhook, hook_ctx, def_iops);
+    errCode = couchstore_compact_db_ex(compactdb,
+                                       compact_file.c_str(),
+                                       flags,
+                                       hook,
+                                       dhook,
+                                       &compactHookCtx,
+                                       def_iops);
     if (errCode != COUCHSTORE_SUCCESS) {
         logger.log(EXTENSION_LOG_WARNING,
                    "CouchKVStore::compactDB:couchstore_compact_db_ex "
@@ -970,6 +1309,15 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
     // Close the source Database File once compaction is done
     closeDatabaseHandle(compactdb);
 
+    errCode = collectValueLog(vbid,
+                              compact_file,
+                              compactHookCtx.liveBytes,
+                              collectedValueLogs);
+    if (errCode != COUCHSTORE_SUCCESS) {
+        removeCompactFile(compact_file);
+        return false;
+    }
+
     // Rename the .compact file to one with the next revision number
     new_file = getDBFileName(dbname, vbid, new_rev);
     if (rename(compact_file.c_str(), new_file.c_str()) != 0) {
@@ -989,6 +1337,7 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
                        "CouchKVStore::compactDB: openDB#2 error:%s, file:%s, "
                        "fileRev:%" PRIu64, couchstore_strerror(errCode),
                        new_file.c_str(), new_rev);
+        forgetCachedBlocks(new_file);
         if (remove(new_file.c_str()) != 0) {
             logger.log(EXTENSION_LOG_WARNING,
                        "CouchKVStore::compactDB: remove error:%s, path:%s",
@@ -1023,11 +1372,206 @@ bool CouchKVStore::compactDBInternal(compaction_ctx* hook_ctx,
     // Removing the stale couch file
     unlinkCouchFile(vbid, fileRev);
 
+    // ... and the value log files only it referred to.
+    valueLogs->get(vbid).remove(collectedValueLogs);
+
     st.compactHisto.add((gethrtime() - start) / 1000);
 
     return true;
 }
 
+couchstore_error_t CouchKVStore::collectValueLog(
+        uint16_t vbid,
+        const std::string& compactFile,
+        const std::unordered_map<uint64_t, uint64_t>& liveBytes,
+        std::vector<uint64_t>& collected) {
+    auto& log = valueLogs->get(vbid);
+    std::vector<uint64_t> toCopy;
+    for (auto generation : log.seal()) {
+        auto live = liveBytes.find(generation);
+        if (live == liveBytes.end()) {
+            collected.push_back(generation);
+            continue;
+        }
+        const uint64_t size = log.getSize(generation);
+        const uint64_t garbage = size > live->second ? size - live->second : 0;
+        if (garbage > 0 &&
+            garbage >= configuration.getValueLogGcRatio() * size) {
+            toCopy.push_back(generation);
+        }
+    }
+    if (toCopy.empty()) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    couchstore_open_flags flags = 0;
+    if (!configuration.getBuffered()) {
+        flags |= COUCHSTORE_OPEN_FLAG_UNBUFFERED;
+    }
+    DbHolder db(this);
+    auto errCode = couchstore_open_db_ex(
+            compactFile.c_str(), flags, fileOpsCompaction, db.getDbAddress());
+    if (errCode != COUCHSTORE_SUCCESS) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "CouchKVStore::collectValueLog: couchstore_open_db_ex "
+                   "error:%s, name:%s",
+                   couchstore_strerror(errCode),
+                   compactFile.c_str());
+        return errCode;
+    }
+
+    struct Entry {
+        std::string key;
+        uint64_t seqno;
+        ValueLog::Ref ref;
+    };
+
+    for (auto generation : toCopy) {
+        std::vector<Entry> entries;
+        bool complete = log.forEach(
+                generation,
+                [&entries](cb::const_char_buffer key,
+                           uint64_t seqno,
+                           const ValueLog::Ref& ref) {
+                    entries.push_back({{key.data(), key.size()}, seqno, ref});
+                });
+
+        for (size_t begin = 0; begin < entries.size();
+             begin += valueLogCopyBatch) {
+            const size_t end =
+                    std::min(entries.size(), begin + valueLogCopyBatch);
+            std::vector<DocInfo*> infos;
+            std::vector<Doc> docs;
+            std::vector<std::array<char, ValueLog::Ref::encodedSize>> refs(
+                    end - begin);
+            docs.reserve(end - begin);
+
+            for (size_t idx = begin; idx < end; ++idx) {
+                const auto& entry = entries[idx];
+                DocInfo* info = nullptr;
+                if (couchstore_docinfo_by_id(db.getDb(),
+                                             entry.key.data(),
+                                             entry.key.size(),
+                                             &info) != COUCHSTORE_SUCCESS) {
+                    continue;
+                }
+
+                // Only copy the value the document still refers to.
+                Doc* doc = nullptr;
+                ValueLog::Ref ref;
+                if (info->db_seq != entry.seqno || !isInValueLog(*info) ||
+                    couchstore_open_doc_with_docinfo(
+                            db.getDb(), info, &doc, 0) != COUCHSTORE_SUCCESS ||
+                    !ValueLog::Ref::decode({doc->data.buf, doc->data.size},
+                                           ref) ||
+                    ref.generation != generation ||
+                    ref.offset != entry.ref.offset) {
+                    couchstore_free_document(doc);
+                    couchstore_free_docinfo(info);
+                    continue;
+                }
+                couchstore_free_document(doc);
+
+                std::string value;
+                if (!log.read(ref, value)) {
+                    logger.log(EXTENSION_LOG_WARNING,
+                               "CouchKVStore::collectValueLog: corrupt value "
+                               "of seqno:%" PRIu64 " in generation:%" PRIu64
+                               ", vb:%" PRIu16,
+                               entry.seqno,
+                               generation,
+                               vbid);
+                    couchstore_free_docinfo(info);
+                    complete = false;
+                    continue;
+                }
+
+                try {
+                    const auto copied = log.append(
+                            {entry.key.data(), entry.key.size()},
+                            entry.seqno,
+                            {value.data(), value.size()},
+                            ref.flags);
+                    copied.encode(refs[idx - begin].data());
+                } catch (const std::system_error& e) {
+                    logger.log(EXTENSION_LOG_WARNING,
+                               "CouchKVStore::collectValueLog: %s, vb:%" PRIu16,
+                               e.what(),
+                               vbid);
+                    couchstore_free_docinfo(info);
+                    for (auto* saved : infos) {
+                        couchstore_free_docinfo(saved);
+                    }
+                    return COUCHSTORE_ERROR_WRITE;
+                }
+                st.io_value_log_gc_bytes +=
+                        ValueLog::headerSize + entry.key.size() + value.size();
+
+                Doc copy{};
+                copy.id = info->id;
+                copy.data = {refs[idx - begin].data(), refs[idx - begin].size()};
+                docs.push_back(copy);
+                infos.push_back(info);
+            }
+
+            if (!infos.empty()) {
+                std::vector<Doc*> docPtrs;
+                for (auto& doc : docs) {
+                    docPtrs.push_back(&doc);
+                }
+                errCode = couchstore_save_documents(db.getDb(),
+                                                    docPtrs.data(),
+                                                    infos.data(),
+                                                    unsigned(infos.size()),
+                                                    COUCHSTORE_SEQUENCE_AS_IS);
+            }
+            for (auto* info : infos) {
+                couchstore_free_docinfo(info);
+            }
+            if (errCode != COUCHSTORE_SUCCESS) {
+                logger.log(EXTENSION_LOG_WARNING,
+                           "CouchKVStore::collectValueLog: "
+                           "couchstore_save_documents error:%s [%s], "
+                           "vb:%" PRIu16,
+                           couchstore_strerror(errCode),
+                           couchkvstore_strerrno(db.getDb(), errCode).c_str(),
+                           vbid);
+                return errCode;
+            }
+        }
+
+        if (complete) {
+            collected.push_back(generation);
+        } else {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "CouchKVStore::collectValueLog: keeping corrupt "
+                       "generation:%" PRIu64 ", vb:%" PRIu16,
+                       generation,
+                       vbid);
+        }
+    }
+
+    try {
+        log.sync();
+    } catch (const std::system_error& e) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "CouchKVStore::collectValueLog: %s, vb:%" PRIu16,
+                   e.what(),
+                   vbid);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    errCode = couchstore_commit(db.getDb());
+    if (errCode != COUCHSTORE_SUCCESS) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "CouchKVStore::collectValueLog: couchstore_commit "
+                   "error:%s [%s], vb:%" PRIu16,
+                   couchstore_strerror(errCode),
+                   couchkvstore_strerrno(db.getDb(), errCode).c_str(),
+                   vbid);
+    }
+    return errCode;
+}
+
 vbucket_state * CouchKVStore::getVBucketState(uint16_t vbucketId) {
     return cachedVBStates[vbucketId];
 }
@@ -1084,6 +1628,7 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId,
                 closeDatabaseHandle(db);
                 return false;
             }
+            dbGenerations->advance(vbucketId);
         }
 
         DbInfo info;
@@ -1185,6 +1730,12 @@ bool CouchKVStore::getStat(const char* name, size_t& value)  {
     } else if (strcmp("io_compaction_write_bytes", name) == 0) {
         value = st.fsStatsCompaction.totalBytesWritten;
         return true;
+    } else if (strcmp("Block_cache_hits", name) == 0) {
+        value = st.blockCacheHits;
+        return true;
+    } else if (strcmp("Block_cache_misses", name) == 0) {
+        value = st.blockCacheMisses;
+        return true;
     }
 
     return false;
@@ -1202,6 +1753,7 @@ void CouchKVStore::pendingTasks() {
 
         while (!queue.empty()) {
             std::string filename_str = queue.front();
+            forgetCachedBlocks(filename_str);
             if (remove(filename_str.c_str()) == -1) {
                 logger.log(EXTENSION_LOG_WARNING, "CouchKVStore::pendingTasks: "
                            "remove error:%d, file%s", errno,
@@ -1220,10 +1772,15 @@ ScanContext* CouchKVStore::initScanContext(std::shared_ptr<Callback<GetValue> >
                                            uint16_t vbid, uint64_t startSeqno,
                                            DocumentFilter options,
                                            ValueFilter valOptions) {
+    // Before choosing the file (see get()); held for the scan's lifetime.
+    ValueLog::Pin pin;
+    if (valOptions != ValueFilter::KEYS_ONLY) {
+        pin = valueLogs->get(vbid).pin();
+    }
     Db *db = NULL;
     uint64_t rev = dbFileRevMap[vbid];
-    couchstore_error_t errorCode = openDB(vbid, rev, &db,
-                                          COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errorCode = openDB(
+            vbid, rev, &db, COUCHSTORE_OPEN_FLAG_RDONLY, fileOpsScan);
     if (errorCode != COUCHSTORE_SUCCESS) {
         logger.log(EXTENSION_LOG_WARNING,
                    "CouchKVStore::initScanContext: openDB error:%s, "
@@ -1269,9 +1826,19 @@ ScanContext* CouchKVStore::initScanContext(std::shared_ptr<Callback<GetValue> >
 
     size_t scanId = scanCounter++;
 
+    std::unique_ptr<FilePrefetcher> prefetcher;
+    if (asyncReader && valOptions != ValueFilter::KEYS_ONLY) {
+        prefetcher = std::make_unique<FilePrefetcher>(
+                *asyncReader, couchstore_get_db_filename(db));
+    }
+
     {
         LockHolder lh(scanLock);
         scans[scanId] = db;
+        if (prefetcher) {
+            scanPrefetchers[scanId] = std::move(prefetcher);
+        }
+        scanValueLogPins[scanId] = std::move(pin);
     }
 
     ScanContext* sctx = new ScanContext(cb,
@@ -1311,6 +1878,7 @@ scan_error_t CouchKVStore::scan(ScanContext* ctx) {
     }
 
     Db* db;
+    ScanCbCtx cbCtx{ctx, nullptr, valueLogs};
     {
         LockHolder lh(scanLock);
         auto itr = scans.find(ctx->scanId);
@@ -1319,6 +1887,10 @@ scan_error_t CouchKVStore::scan(ScanContext* ctx) {
         }
 
         db = itr->second;
+        auto prefetcher = scanPrefetchers.find(ctx->scanId);
+        if (prefetcher != scanPrefetchers.end()) {
+            cbCtx.prefetcher = prefetcher->second.get();
+        }
     }
 
     uint64_t start = ctx->startSeqno;
@@ -1326,12 +1898,19 @@ scan_error_t CouchKVStore::scan(ScanContext* ctx) {
         start = ctx->lastReadSeqno + 1;
     }
 
+    // The scan's reads of bodies are served from what was read ahead.
+    std::unique_ptr<ReadStage::Scope> stageScope;
+    if (cbCtx.prefetcher) {
+        stageScope = std::make_unique<ReadStage::Scope>(
+                cbCtx.prefetcher->getAheadStage());
+    }
+
     couchstore_error_t errorCode;
     errorCode = couchstore_changes_since(db,
                                          start,
                                          getDocFilter(ctx->docFilter),
                                          recordDbDumpC,
-                                         static_cast<void*>(ctx));
+                                         static_cast<void*>(&cbCtx));
     if (errorCode != COUCHSTORE_SUCCESS) {
         if (errorCode == COUCHSTORE_ERROR_CANCEL) {
             return scan_again;
@@ -1358,6 +1937,8 @@ void CouchKVStore::destroyScanContext(ScanContext* ctx) {
         closeDatabaseHandle(itr->second);
         scans.erase(itr);
     }
+    scanPrefetchers.erase(ctx->scanId);
+    scanValueLogPins.erase(ctx->scanId);
     delete ctx;
 }
 
@@ -1443,6 +2024,36 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev) {
     }
 
     dbFileRevMap[vbucketId] = newFileRev;
+    dbGenerations->replace(vbucketId);
+}
+
+couchstore_error_t CouchKVStore::openReadDB(uint16_t vbid,
+                                            uint64_t fileRev,
+                                            Db** db,
+                                            uint64_t& generation) {
+    generation = 0;
+    if (dbHandleCache) {
+        // Before taking or opening the handle, so that a write between the
+        // two is noticed.
+        generation = dbHandleCache->getGeneration(vbid);
+        *db = dbHandleCache->take(vbid, fileRev);
+        if (*db) {
+            return COUCHSTORE_SUCCESS;
+        }
+    }
+    return openDB(vbid, fileRev, db, COUCHSTORE_OPEN_FLAG_RDONLY);
+}
+
+void CouchKVStore::releaseReadDB(uint16_t vbid,
+                                 uint64_t fileRev,
+                                 uint64_t generation,
+                                 Db* db,
+                                 bool reusable) {
+    if (dbHandleCache && reusable) {
+        dbHandleCache->put(vbid, fileRev, generation, db);
+    } else {
+        closeDatabaseHandle(db);
+    }
 }
 
 couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
@@ -1453,7 +2064,7 @@ couchstore_error_t CouchKVStore::openDB(uint16_t vbucketId,
     std::string dbFileName = getDBFileName(dbname, vbucketId, fileRev);
 
     if(ops == nullptr) {
-        ops = statCollectingFileOps.get();
+        ops = fileOps;
     }
 
     couchstore_error_t errorCode = COUCHSTORE_SUCCESS;
@@ -1525,6 +2136,7 @@ void CouchKVStore::populateFileNameMap(std::vector<std::string> &filenames,
             old_file << dbname << "/" << vbId << ".couch." << old_rev_num;
             if (access(old_file.str().c_str(), F_OK) == 0) {
                 if (!isReadOnly()) {
+                    forgetCachedBlocks(old_file.str());
                     if (remove(old_file.str().c_str()) == 0) {
                         logger.log(EXTENSION_LOG_INFO,
                                   "CouchKVStore::populateFileNameMap: Removed "
@@ -1567,7 +2179,8 @@ couchstore_error_t CouchKVStore::fetchDoc(Db* db,
 
     if (metaOnly == GetMetaOnly::Yes) {
         uint8_t extMeta[EXT_META_LEN];
-        extMeta[0] = metadata->getDataType();
+        // There's no value to be compressed.
+        extMeta[0] = metadata->getDataType() & ~PROTOCOL_BINARY_DATATYPE_SNAPPY;
         // Collections: TODO: Permanently restore to stored namespace
         auto it = std::make_unique<Item>(
                 makeDocKey(docinfo->id,
@@ -1596,8 +2209,17 @@ couchstore_error_t CouchKVStore::fetchDoc(Db* db,
         size_t valuelen = 0;
         void* valuePtr = nullptr;
         uint8_t extMeta = 0;
-        errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc,
-                                                   DECOMPRESS_DOC_BODIES);
+        cb::compression::Buffer inflated;
+        std::string logged;
+        bool loggedCompressed = false;
+        const bool v0 =
+                metadata->getVersionInitialisedFrom() == MetaData::Version::V0;
+        // When values are kept compressed they're returned as stored, bar
+        // those of V0 documents, whose datatype is determined from the
+        // uncompressed value.
+        const bool asStored = storeValuesCompressed() && !v0;
+        errCode = couchstore_open_doc_with_docinfo(
+                db, docinfo, &doc, asStored ? 0 : DECOMPRESS_DOC_BODIES);
         if (errCode == COUCHSTORE_SUCCESS) {
             if (doc == nullptr) {
                 throw std::logic_error("CouchKVStore::fetchDoc: doc is NULL");
@@ -1613,15 +2235,51 @@ couchstore_error_t CouchKVStore::fetchDoc(Db* db,
             valuelen = doc->data.size;
             valuePtr = doc->data.buf;
 
-            if (metadata->getVersionInitialisedFrom() == MetaData::Version::V0) {
+            if (isInValueLog(*docinfo)) {
+                errCode = readLoggedValue(valueLogs->get(vbId),
+                                          doc->data,
+                                          !asStored,
+                                          logged,
+                                          loggedCompressed);
+                if (errCode != COUCHSTORE_SUCCESS) {
+                    couchstore_free_document(doc);
+                    return errCode;
+                }
+                valuelen = logged.size();
+                valuePtr = &logged[0];
+            }
+
+            if (v0) {
                 // This is a super old version of a couchstore file.
                 // Try to determine if the document is JSON or raw bytes
                 extMeta = determine_datatype(doc->data);
             } else {
                 extMeta = metadata->getDataType();
+                if (asStored) {
+                    // couchstore (or the value log) compressed it, but
+                    // didn't record that in the datatype.
+                    if (valuelen &&
+                        ((docinfo->content_meta & COUCH_DOC_IS_COMPRESSED) ||
+                         loggedCompressed)) {
+                        extMeta |= PROTOCOL_BINARY_DATATYPE_SNAPPY;
+                    }
+                } else if (mcbp::datatype::is_snappy(extMeta)) {
+                    // Stored compressed by us (or the client).
+                    if (!cb::compression::inflate(
+                                cb::compression::Algorithm::Snappy,
+                                static_cast<const char*>(valuePtr),
+                                valuelen,
+                                inflated)) {
+                        couchstore_free_document(doc);
+                        return COUCHSTORE_ERROR_CORRUPT;
+                    }
+                    valuelen = inflated.len;
+                    valuePtr = inflated.data.get();
+                    extMeta &= ~PROTOCOL_BINARY_DATATYPE_SNAPPY;
+                }
             }
         } else if (errCode == COUCHSTORE_ERROR_DOC_NOT_FOUND && docinfo->deleted) {
-            extMeta = metadata->getDataType();
+            extMeta = metadata->getDataType() & ~PROTOCOL_BINARY_DATATYPE_SNAPPY;
         } else {
             return errCode;
         }
@@ -1660,14 +2318,17 @@ couchstore_error_t CouchKVStore::fetchDoc(Db* db,
     return COUCHSTORE_SUCCESS;
 }
 
-int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx) {
-
-    ScanContext* sctx = static_cast<ScanContext*>(ctx);
+int CouchKVStore::recordDbDump(Db* db,
+                               DocInfo* docinfo,
+                               ScanContext* sctx,
+                               ValueLogs& valueLogs) {
     std::shared_ptr<Callback<GetValue> > cb = sctx->callback;
     std::shared_ptr<Callback<CacheLookup> > cl = sctx->lookup;
 
     Doc *doc = nullptr;
     sized_buf value{nullptr, 0};
+    cb::compression::Buffer inflated;
+    std::string logged;
     uint64_t byseqno = docinfo->db_seq;
     uint16_t vbucketId = sctx->vbid;
 
@@ -1708,25 +2369,64 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx) {
         auto errCode = couchstore_open_doc_with_docinfo(db, docinfo, &doc,
                                                         openOptions);
 
+        bool loggedCompressed = false;
+        if (errCode == COUCHSTORE_SUCCESS && isInValueLog(*docinfo)) {
+            errCode = readLoggedValue(valueLogs.get(vbucketId),
+                                      doc->data,
+                                      openOptions & DECOMPRESS_DOC_BODIES,
+                                      logged,
+                                      loggedCompressed);
+            if (errCode != COUCHSTORE_SUCCESS) {
+                couchstore_free_document(doc);
+                doc = nullptr;
+            }
+        }
+
         if (errCode == COUCHSTORE_SUCCESS) {
             value = doc->data;
-            if (doc->data.size) {
+            if (isInValueLog(*docinfo)) {
+                value = {&logged[0], logged.size()};
+            }
+            if (value.size) {
                 if ((openOptions & DECOMPRESS_DOC_BODIES) == 0) {
-                    // We always store the document bodies compressed on disk,
-                    // but now the client _wanted_ to fetch the document
-                    // in a compressed mode.
-                    // We've never stored the "compressed" flag on disk
-                    // (as we don't keep items compressed in memory).
-                    // Update the datatype flag for this item to
-                    // reflect that it is compressed so that the
-                    // receiver of the object may notice (Note:
-                    // this is currently _ONLY_ happening via DCP
-                     auto datatype = metadata->getDataType();
-                     metadata->setDataType(datatype | PROTOCOL_BINARY_DATATYPE_SNAPPY);
+                    // The client _wanted_ to fetch the document in a
+                    // compressed mode. Bodies compressed by couchstore
+                    // don't have the "compressed" flag in their datatype
+                    // (values compressed before being stored do). Update
+                    // the datatype flag for this item to reflect that it
+                    // is compressed so that the receiver of the object may
+                    // notice (Note: this is currently _ONLY_ happening via
+                    // DCP
+                    if ((docinfo->content_meta & COUCH_DOC_IS_COMPRESSED) ||
+                        loggedCompressed) {
+                        auto datatype = metadata->getDataType();
+                        metadata->setDataType(
+                                datatype | PROTOCOL_BINARY_DATATYPE_SNAPPY);
+                    }
                 } else if (metadata->getVersionInitialisedFrom() == MetaData::Version::V0) {
                     // This is a super old version of a couchstore file.
                     // Try to determine if the document is JSON or raw bytes
-                    metadata->setDataType(determine_datatype(doc->data));
+                    metadata->setDataType(determine_datatype(value));
+                } else if (mcbp::datatype::is_snappy(
+                                   metadata->getDataType())) {
+                    // Stored compressed, which couchstore doesn't undo.
+                    if (!cb::compression::inflate(
+                                cb::compression::Algorithm::Snappy,
+                                value.buf,
+                                value.size,
+                                inflated)) {
+                        sctx->logger->log(EXTENSION_LOG_WARNING,
+                                          "CouchKVStore::recordDbDump: "
+                                          "failed to inflate document, "
+                                          "vb:%" PRIu16 ", seqno:%" PRIu64,
+                                          vbucketId,
+                                          docinfo->db_seq);
+                        couchstore_free_document(doc);
+                        return COUCHSTORE_SUCCESS;
+                    }
+                    value = {inflated.data.get(), inflated.len};
+                    metadata->setDataType(metadata->getDataType() &
+                                          ~PROTOCOL_BINARY_DATATYPE_SNAPPY);
                 }
             } else {
                 // No data, it cannot have a datatype!
@@ -1742,6 +2442,10 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx) {
                               vbucketId, docinfo->rev_seq);
             return COUCHSTORE_SUCCESS;
         }
+    } else if (mcbp::datatype::is_snappy(metadata->getDataType())) {
+        // Without its value, it cannot be compressed either.
+        metadata->setDataType(metadata->getDataType() &
+                              ~PROTOCOL_BINARY_DATATYPE_SNAPPY);
     }
 
     uint8_t extMeta = metadata->getDataType();
@@ -1786,6 +2490,32 @@ bool CouchKVStore::commit2couchstore(const Item* collectionsManifest) {
         return success;
     }
 
+    // A transaction normally covers a single vbucket, but the flusher may
+    // group several together; their requests are queued a vbucket at a time.
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < pendingCommitCnt; ++i) {
+        if (runs.empty() || pendingReqsQ[i]->getVBucketId() !=
+                                    pendingReqsQ[i - 1]->getVBucketId()) {
+            runs.emplace_back(i, i + 1);
+        } else {
+            runs.back().second = i + 1;
+        }
+    }
+    if (runs.size() > 1) {
+        if (collectionsManifest) {
+            throw std::logic_error(
+                    "CouchKVStore::commit2couchstore: a manifest can't be "
+                    "group committed, vb:" +
+                    std::to_string(collectionsManifest->getVBucketId()));
+        }
+        success = groupCommit2couchstore(runs);
+        for (auto* req : pendingReqsQ) {
+            delete req;
+        }
+        pendingReqsQ.clear();
+        return success;
+    }
+
     // Use the vbucket of the first item or the manifest item
     uint16_t vbucket2flush = pendingCommitCnt
                                      ? pendingReqsQ[0]->getVBucketId()
@@ -1847,6 +2577,85 @@ bool CouchKVStore::commit2couchstore(const Item* collectionsManifest) {
     return success;
 }
 
+bool CouchKVStore::groupCommit2couchstore(
+        const std::vector<std::pair<size_t, size_t>>& runs) {
+    const hrtime_t groupStart = gethrtime();
+    bool success = true;
+
+    // Each file is kept open until the group's deferred syncs are done.
+    std::deque<DbHolder> dbs;
+    std::vector<std::unique_ptr<kvstats_ctx>> kvctxs;
+    std::vector<couchstore_error_t> errCodes;
+
+    for (const auto& run : runs) {
+        const uint16_t vbid = pendingReqsQ[run.first]->getVBucketId();
+        // Use the current fileRev, compaction can't change this until we're
+        // done flushing.
+        uint64_t fileRev = dbFileRevMap[vbid];
+
+        std::vector<Doc*> docs;
+        std::vector<DocInfo*> docinfos;
+        docs.reserve(run.second - run.first);
+        docinfos.reserve(run.second - run.first);
+        for (size_t i = run.first; i < run.second; ++i) {
+            docs.push_back((Doc*)pendingReqsQ[i]->getDbDoc());
+            docinfos.push_back(pendingReqsQ[i]->getDbDocInfo());
+        }
+
+        kvctxs.push_back(std::make_unique<kvstats_ctx>(configuration));
+        kvctxs.back()->vbucket = vbid;
+        dbs.emplace_back(this);
+        couchstore_error_t errCode = saveDocs(vbid,
+                                              fileRev,
+                                              docs,
+                                              docinfos,
+                                              *kvctxs.back(),
+                                              nullptr,
+                                              deferredSyncOps.get(),
+                                              dbs.back().getDbAddress());
+        if (errCode) {
+            success = false;
+            logger.log(EXTENSION_LOG_WARNING,
+                       "CouchKVStore::groupCommit2couchstore: saveDocs "
+                       "error:%s, vb:%" PRIu16 ", rev:%" PRIu64,
+                       couchstore_strerror(errCode),
+                       vbid,
+                       fileRev);
+        }
+        errCodes.push_back(errCode);
+    }
+
+    // Now make the whole group durable.
+    const hrtime_t syncStart = gethrtime();
+    couchstore_error_t syncErr = deferredSyncOps->syncDeferred();
+    st.groupSyncHisto.add((gethrtime() - syncStart) / 1000);
+    if (syncErr) {
+        success = false;
+        logger.log(EXTENSION_LOG_WARNING,
+                   "CouchKVStore::groupCommit2couchstore: sync error:%s, "
+                   "vbuckets:%" PRIu64,
+                   couchstore_strerror(syncErr),
+                   uint64_t(runs.size()));
+        for (auto& errCode : errCodes) {
+            if (errCode == COUCHSTORE_SUCCESS) {
+                errCode = syncErr;
+            }
+        }
+    }
+    dbs.clear();
+
+    for (size_t i = 0; i < runs.size(); ++i) {
+        std::vector<CouchRequest*> committedReqs(
+                pendingReqsQ.begin() + runs[i].first,
+                pendingReqsQ.begin() + runs[i].second);
+        commitCallback(committedReqs, *kvctxs[i], errCodes[i]);
+    }
+
+    st.groupSize.add(runs.size());
+    st.groupCommitHisto.add((gethrtime() - groupStart) / 1000);
+    return success;
+}
+
 static int readDocInfos(Db *db, DocInfo *docinfo, void *ctx) {
     if (ctx == nullptr) {
         throw std::invalid_argument("readDocInfos: ctx must be non-NULL");
@@ -1872,7 +2681,9 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid,
                                           const std::vector<Doc*>& docs,
                                           std::vector<DocInfo*>& docinfos,
                                           kvstats_ctx& kvctx,
-                                          const Item* collectionsManifest) {
+                                          const Item* collectionsManifest,
+                                          FileOpsInterface* ops,
+                                          Db** keepOpen) {
     couchstore_error_t errCode;
     uint64_t fileRev = rev;
     DbInfo info;
@@ -1882,8 +2693,11 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid,
     }
 
     DbHolder db(this);
-    errCode = openDB(
-            vbid, fileRev, db.getDbAddress(), COUCHSTORE_OPEN_FLAG_CREATE);
+    errCode = openDB(vbid,
+                     fileRev,
+                     db.getDbAddress(),
+                     COUCHSTORE_OPEN_FLAG_CREATE,
+                     ops);
     if (errCode != COUCHSTORE_SUCCESS) {
         logger.log(EXTENSION_LOG_WARNING,
                    "CouchKVStore::saveDocs: openDB error:%s, vb:%" PRIu16
@@ -1921,6 +2735,15 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid,
                                       readDocInfos,
                                       &kvctx);
 
+            // Only referred to by docs until they're saved.
+            std::vector<std::array<char, ValueLog::Ref::encodedSize>> refs;
+            if (configuration.getValueLogThreshold()) {
+                errCode = logValues(vbid, docs, docinfos, refs);
+                if (errCode != COUCHSTORE_SUCCESS) {
+                    return errCode;
+                }
+            }
+
             hrtime_t cs_begin = gethrtime();
             uint64_t flags = COMPRESS_DOC_BODIES | COUCHSTORE_SEQUENCE_AS_IS;
             errCode = couchstore_save_documents(db.getDb(),
@@ -1965,6 +2788,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid,
                     couchkvstore_strerrno(db.getDb(), errCode).c_str());
             return errCode;
         }
+        dbGenerations->advance(vbid);
 
         st.batchSize.add(docs.size());
 
@@ -1989,11 +2813,70 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid,
     /* update stat */
     if(errCode == COUCHSTORE_SUCCESS) {
         st.docsCommitted = docs.size();
+        if (keepOpen) {
+            *keepOpen = db.releaseDb();
+        }
     }
 
     return errCode;
 }
 
+couchstore_error_t CouchKVStore::logValues(
+        uint16_t vbid,
+        const std::vector<Doc*>& docs,
+        std::vector<DocInfo*>& docinfos,
+        std::vector<std::array<char, ValueLog::Ref::encodedSize>>& refs) {
+    const size_t threshold = configuration.getValueLogThreshold();
+    auto& log = valueLogs->get(vbid);
+    // Sized up front: the docs refer to its elements.
+    refs.resize(docs.size());
+    try {
+        for (size_t idx = 0; idx < docs.size(); ++idx) {
+            Doc* doc = docs[idx];
+            DocInfo* info = docinfos[idx];
+            if (doc == nullptr || info->deleted || doc->data.size == 0 ||
+                doc->data.size < threshold) {
+                continue;
+            }
+
+            // couchstore would compress the body; the log has to instead.
+            cb::const_char_buffer value{doc->data.buf, doc->data.size};
+            uint8_t flags = 0;
+            cb::compression::Buffer deflated;
+            if ((info->content_meta & COUCH_DOC_IS_COMPRESSED) &&
+                cb::compression::deflate(cb::compression::Algorithm::Snappy,
+                                         doc->data.buf,
+                                         doc->data.size,
+                                         deflated) &&
+                deflated.len < doc->data.size) {
+                value = {deflated.data.get(), deflated.len};
+                flags |= ValueLog::Ref::Compressed;
+            }
+
+            const auto ref = log.append({info->id.buf, info->id.size},
+                                        info->db_seq,
+                                        value,
+                                        flags);
+            st.io_value_log_write_bytes +=
+                    ValueLog::headerSize + info->id.size + value.size();
+
+            ref.encode(refs[idx].data());
+            doc->data = {refs[idx].data(), refs[idx].size()};
+            info->size = refs[idx].size();
+            info->content_meta &= ~COUCH_DOC_IS_COMPRESSED;
+            info->content_meta |= COUCH_DOC_IN_VALUE_LOG;
+        }
+        log.sync();
+    } catch (const std::system_error& e) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "CouchKVStore::logValues: %s, vb:%" PRIu16,
+                   e.what(),
+                   vbid);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId) {
     if (vbucketId >= numDbFiles) {
         logger.log(EXTENSION_LOG_WARNING,
@@ -2609,6 +3492,7 @@ RollbackResult CouchKVStore::rollback(uint16_t vbid, uint64_t rollbackSeqno,
     if (errCode != COUCHSTORE_SUCCESS) {
         return RollbackResult(false, 0, 0, 0);
     }
+    dbGenerations->advance(vbid);
 
     vbucket_state *vb_state = cachedVBStates[vbid];
     return RollbackResult(true, vb_state->highSeqno,
@@ -2681,6 +3565,9 @@ void CouchKVStore::unlinkCouchFile(uint16_t vbucket,
         return;
     }
 
+    // (So that cached handles of the file are closed.)
+    dbGenerations->replace(vbucket);
+    forgetCachedBlocks(fname);
     if (remove(fname) == -1) {
         logger.log(EXTENSION_LOG_WARNING,
                    "CouchKVStore::unlinkCouchFile: remove error:%u, "
@@ -2694,6 +3581,13 @@ void CouchKVStore::unlinkCouchFile(uint16_t vbucket,
     }
 }
 
+void CouchKVStore::forgetCachedBlocks(const std::string& filename) {
+    CouchBlockCache* blockCache = configuration.getBlockCache().get();
+    if (blockCache) {
+        blockCache->forget(filename);
+    }
+}
+
 void CouchKVStore::removeCompactFile(const std::string &dbname,
                                      uint16_t vbid,
                                      uint64_t fileRev) {
@@ -2719,6 +3613,7 @@ void CouchKVStore::removeCompactFile(const std::string &filename) {
     }
 
     if (access(filename.c_str(), F_OK) == 0) {
+        forgetCachedBlocks(filename);
         if (remove(filename.c_str()) == 0) {
             logger.log(EXTENSION_LOG_WARNING,
                        "CouchKVStore::removeCompactFile: Removed compact "
@@ -2760,6 +3655,7 @@ bool CouchKVStore::persistCollectionsManifestItem(uint16_t vbid,
     if (errCode != COUCHSTORE_SUCCESS) {
         return false;
     }
+    dbGenerations->advance(vbid);
 
     return true;
 }
@@ -2790,6 +3686,9 @@ uint64_t CouchKVStore::prepareToDelete(uint16_t vbid) {
     cachedDeleteCount[vbid] = 0;
     cachedFileSize[vbid] = 0;
     cachedSpaceUsed[vbid] = 0;
+    // Unlike the file, the value log isn't per-revision: remove it now,
+    // before a new vbucket can append to it.
+    valueLogs->get(vbid).removeAll();
     return dbFileRevMap[vbid];
 }
 
@@ -22,14 +22,22 @@
 #include "libcouchstore/couch_db.h"
 #include <relaxed_atomic.h>
 
+#include <array>
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "configuration.h"
+#include "couch-kvstore/couch-async-io.h"
+#include "couch-kvstore/couch-block-cache.h"
+#include "couch-kvstore/couch-db-handle-cache.h"
+#include "couch-kvstore/couch-deferred-sync.h"
 #include "couch-kvstore/couch-fs-stats.h"
 #include "couch-kvstore/couch-kvstore-metadata.h"
+#include "couch-kvstore/couch-value-log.h"
+#include <platform/compress.h>
 #include <platform/histogram.h>
 #include <platform/strerror.h>
 #include "logger.h"
@@ -40,6 +48,7 @@
 #define COUCHSTORE_NO_OPTIONS 0
 
 class EventuallyPersistentEngine;
+struct GetMultiCbCtx;
 
 /**
  * Class representing a document to be persisted in couchstore.
@@ -55,12 +64,16 @@ public:
      * @param cb persistence callback
      * @param del flag indicating if it is an item deletion or not
      * @param persistDocNamespace true if we should store the key's namespace
+     * @param compressValue true if the value should be stored snappy
+     *        compressed, with its datatype saying so (rather than compressed
+     *        by couchstore)
      */
     CouchRequest(const Item& it,
                  uint64_t rev,
                  MutationRequestCallback& cb,
                  bool del,
-                 bool persistDocNamespace);
+                 bool persistDocNamespace,
+                 bool compressValue = false);
 
     virtual ~CouchRequest() {}
 
@@ -134,9 +147,14 @@ public:
     }
 
 protected:
-    static couchstore_content_meta_flags getContentMeta(const Item& it);
+    static couchstore_content_meta_flags getContentMeta(
+            protocol_binary_datatype_t datatype,
+            size_t nbytes,
+            bool compressValue);
 
     value_t value;
+    // The value as stored, when compressed here.
+    cb::compression::Buffer deflated;
 
     MetaData meta;
     uint64_t fileRevNum;
@@ -414,7 +432,10 @@ public:
 
     bool getStat(const char* name, size_t& value) override;
 
-    static int recordDbDump(Db *db, DocInfo *docinfo, void *ctx);
+    static int recordDbDump(Db* db,
+                            DocInfo* docinfo,
+                            ScanContext* sctx,
+                            ValueLogs& valueLogs);
     static int recordDbStat(Db *db, DocInfo *docinfo, void *ctx);
     static int getMultiCb(Db *db, DocInfo *docinfo, void *ctx);
     ENGINE_ERROR_CODE readVBState(Db *db, uint16_t vbId);
@@ -477,6 +498,14 @@ public:
     uint64_t prepareToDelete(uint16_t vbid) override;
 
 protected:
+    /**
+     * Whether values are stored snappy-compressed with their datatype, and
+     * read back as stored, rather than being compressed by couchstore.
+     */
+    bool storeValuesCompressed() const {
+        return configuration.getValueCompression() == "snappy";
+    }
+
     /*
      * Returns the DbInfo for the given vbucket database.
      */
@@ -495,6 +524,19 @@ protected:
     void close();
     bool commit2couchstore(const Item* collectionsManifest);
 
+    /**
+     * Commit pending requests covering several vbuckets as a group: each
+     * vbucket file is written and committed, with the final sync of every
+     * file deferred and then performed together, before the requests'
+     * callbacks are invoked.
+     *
+     * @param runs [begin, end) indexes into pendingReqsQ of each vbucket's
+     *        requests
+     * @return true if all vbuckets were committed successfully
+     */
+    bool groupCommit2couchstore(
+            const std::vector<std::pair<size_t, size_t>>& runs);
+
     uint64_t checkNewRevNum(std::string &dbname, bool newFile = false);
     void populateFileNameMap(std::vector<std::string> &filenames,
                              std::vector<uint16_t> *vbids);
@@ -517,6 +559,9 @@ protected:
      * @param kvctx a stats context object to update
      * @param collectionsManifest a pointer to an item which contains the
      *        manifest update data (can be nullptr)
+     * @param ops FileOps to open the file with (defaults to fileOps)
+     * @param keepOpen if non-null, on success the still open file is
+     *        returned here rather than closed; the caller must close it.
      *
      * @returns COUCHSTORE_SUCCESS or a failure code (failure paths log)
      */
@@ -525,7 +570,41 @@ protected:
                                 const std::vector<Doc*>& docs,
                                 std::vector<DocInfo*>& docinfos,
                                 kvstats_ctx& kvctx,
-                                const Item* collectionsManifest);
+                                const Item* collectionsManifest,
+                                FileOpsInterface* ops = nullptr,
+                                Db** keepOpen = nullptr);
+
+    /**
+     * Move the values of at least the configured threshold size to the
+     * vbucket's value log (and make them durable there): each doc's body
+     * becomes a reference to its value, encoded into refs.
+     *
+     * @returns COUCHSTORE_SUCCESS or COUCHSTORE_ERROR_WRITE (logged)
+     */
+    couchstore_error_t logValues(
+            uint16_t vbid,
+            const std::vector<Doc*>& docs,
+            std::vector<DocInfo*>& docinfos,
+            std::vector<std::array<char, ValueLog::Ref::encodedSize>>& refs);
+
+    /**
+     * Reclaim the space of the vbucket's value log files which are mostly
+     * garbage, by copying their live values (those the compacted file
+     * refers to) to the newest file, and updating the compacted file's
+     * references.
+     *
+     * @param compactFile the compacted file, not yet in use
+     * @param liveBytes the bytes of each value log file compactFile refers
+     *        to
+     * @param[out] collected the value log files compactFile doesn't refer
+     *        to, to be removed once it is in use
+     * @returns COUCHSTORE_SUCCESS or a failure code (failure paths log)
+     */
+    couchstore_error_t collectValueLog(
+            uint16_t vbid,
+            const std::string& compactFile,
+            const std::unordered_map<uint64_t, uint64_t>& liveBytes,
+            std::vector<uint64_t>& collected);
 
     void commitCallback(std::vector<CouchRequest *> &committedReqs,
                         kvstats_ctx &kvctx,
@@ -563,6 +642,9 @@ protected:
      */
     void unlinkCouchFile(uint16_t vbucket, uint64_t fRev);
 
+    /// Drop the block cache's blocks of the file, which is to be removed.
+    void forgetCachedBlocks(const std::string& filename);
+
     /**
      * Remove compact file
      *
@@ -599,10 +681,37 @@ protected:
      */
     std::vector<std::atomic<uint64_t>> fileRevMap;
 
+    /**
+     * The generations of the vbuckets' files, owned by the RW store (which
+     * advances them as it writes) and shared with the RO store.
+     */
+    std::unique_ptr<DbGenerations> ownedDbGenerations;
+    DbGenerations* dbGenerations;
+
+    /// This store's read-only handles kept open for gets and bgfetches;
+    /// null if disabled.
+    std::unique_ptr<DbHandleCache> dbHandleCache;
+
+    /**
+     * The vbuckets' value logs, owned by the RW store and shared with the
+     * RO store.
+     */
+    std::unique_ptr<ValueLogs> ownedValueLogs;
+    ValueLogs* valueLogs;
+
     uint16_t numDbFiles;
     std::vector<CouchRequest *> pendingReqsQ;
     bool intransaction;
 
+    /**
+     * Performs reads when the configured read backend isn't "sync":
+     * couchstore's own (through asyncFileOps, which then replaces base_ops)
+     * and the prefetching of document bodies for getMulti() and scans.
+     * Null when "sync", or when base_ops isn't couchstore's default ops.
+     */
+    std::unique_ptr<AsyncReader> asyncReader;
+    std::unique_ptr<AsyncFileOps> asyncFileOps;
+
     /**
      * FileOpsInterface implementation for couchstore which tracks
      * all bytes read/written by couchstore *except* compaction.
@@ -619,6 +728,34 @@ protected:
      */
     std::unique_ptr<FileOpsInterface> statCollectingFileOpsCompaction;
 
+    /**
+     * Serve reads through the bucket's block cache (if it has one),
+     * wrapping statCollectingFileOps(Compaction). Scans (backfills) and
+     * compaction read around the cache.
+     */
+    std::unique_ptr<BlockCacheOps> blockCacheOps;
+    std::unique_ptr<BlockCacheOps> blockCacheOpsScan;
+    std::unique_ptr<BlockCacheOps> blockCacheOpsCompaction;
+
+    /**
+     * Serve reads from the calling thread's ReadStage (getMulti()'s batch,
+     * or a scan's read-ahead window) if asyncReader. Outermost, so reads
+     * reach the stage before the block cache widens them.
+     */
+    std::unique_ptr<ReadStageOps> readStageOps;
+    std::unique_ptr<ReadStageOps> readStageOpsScan;
+
+    /// The FileOps couchstore is given: the outermost of the above.
+    FileOpsInterface* fileOps;
+    FileOpsInterface* fileOpsScan;
+    FileOpsInterface* fileOpsCompaction;
+
+    /**
+     * FileOpsInterface implementation used when group committing, which
+     * defers syncs so they can be performed together. Wraps fileOps.
+     */
+    std::unique_ptr<DeferredSyncOps> deferredSyncOps;
+
     /* deleted docs in each file, indexed by vBucket. RelaxedAtomic
        to allow stats access witout lock */
     std::vector<Couchbase::RelaxedAtomic<size_t>> cachedDeleteCount;
@@ -629,7 +766,12 @@ protected:
 
     std::atomic<size_t> scanCounter; //atomic counter for generating scan id
     std::map<size_t, Db*> scans; //map holding active scans
-    std::mutex scanLock; //lock guarding the scan map
+    // Read ahead of active scans which read values (if asyncReader)
+    std::map<size_t, std::unique_ptr<FilePrefetcher>> scanPrefetchers;
+    // Pins of the value logs of active scans which read values, keeping the
+    // generations their files refer to readable across compactions.
+    std::map<size_t, ValueLog::Pin> scanValueLogPins;
+    std::mutex scanLock; //lock guarding the scan maps
 
     Logger& logger;
 
@@ -653,12 +795,31 @@ private:
      *        read-only constructor is called, it doesn't need to resize the map
      *        as it will use a reference to the RW store's map, so 0 would be
      *        passed.
+     * @param dbGenerations the RW store's file generations (null for the
+     *        RW store itself, which creates them)
+     * @param valueLogs the RW store's value logs (null for the RW store
+     *        itself, which creates them)
      */
     CouchKVStore(KVStoreConfig& config,
                  FileOpsInterface& ops,
                  bool readOnly,
                  std::vector<std::atomic<uint64_t>>& dbFileRevMap,
-                 size_t fileRevMapSize);
+                 size_t fileRevMapSize,
+                 DbGenerations* dbGenerations,
+                 ValueLogs* valueLogs);
+
+    /// Create the file ops wrapping base_ops (and asyncReader, if used).
+    void createFileOps();
+
+    /**
+     * getMulti() of more than one document through asyncReader: one walk of
+     * the by-id index finds the documents, their bodies are read as one
+     * batch into a ReadStage, and each is then fetched from it.
+     */
+    couchstore_error_t getMultiStaged(Db* db,
+                                      sized_buf* ids,
+                                      size_t numIds,
+                                      GetMultiCbCtx& ctx);
 
     /**
      * Construct a read-only store - private as should be called via
@@ -667,9 +828,35 @@ private:
      * @param config configuration data for the store
      * @param dbFileRevMap a reference to the map (which should be data owned by
      *        the RW store).
+     * @param dbGenerations the RW store's file generations
+     * @param valueLogs the RW store's value logs
      */
     CouchKVStore(KVStoreConfig& config,
-                 std::vector<std::atomic<uint64_t>>& dbFileRevMap);
+                 std::vector<std::atomic<uint64_t>>& dbFileRevMap,
+                 DbGenerations& dbGenerations,
+                 ValueLogs& valueLogs);
+
+    /**
+     * Open the vbucket's file read-only, reusing a cached handle if there
+     * is one. The handle must be returned with releaseReadDB().
+     *
+     * @param[out] generation the file's generation when opened
+     */
+    couchstore_error_t openReadDB(uint16_t vbid,
+                                  uint64_t fileRev,
+                                  Db** db,
+                                  uint64_t& generation);
+
+    /**
+     * Return a handle from openReadDB(): cached for reuse if reusable (the
+     * reads through it didn't fail), else closed.
+     */
+    void releaseReadDB(uint16_t vbid,
+                       uint64_t fileRev,
+                       uint64_t generation,
+                       Db* db,
+                       bool reusable);
+
 
     class DbHolder {
     public:
@@ -0,0 +1,448 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "couch-kvstore/couch-value-log.h"
+
+#include <platform/crc32c.h>
+#include <platform/dirutils.h>
+#include <platform/make_unique.h>
+#include <platform/platform.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <system_error>
+#include <unistd.h>
+
+static const uint32_t entryMagic = 0x564c4f47; // "VLOG"
+
+static void putUint8(char*& out, uint8_t value) {
+    *out++ = char(value);
+}
+
+static void putUint32(char*& out, uint32_t value) {
+    value = htonl(value);
+    std::memcpy(out, &value, sizeof(value));
+    out += sizeof(value);
+}
+
+static void putUint64(char*& out, uint64_t value) {
+    value = htonll(value);
+    std::memcpy(out, &value, sizeof(value));
+    out += sizeof(value);
+}
+
+static uint8_t getUint8(const char*& in) {
+    return uint8_t(*in++);
+}
+
+static uint32_t getUint32(const char*& in) {
+    uint32_t value;
+    std::memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return ntohl(value);
+}
+
+static uint64_t getUint64(const char*& in) {
+    uint64_t value;
+    std::memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return ntohll(value);
+}
+
+static uint32_t checksum(const char* buf, size_t len, uint32_t crc = 0) {
+    return crc32c(reinterpret_cast<const uint8_t*>(buf), len, crc);
+}
+
+/// pread all of nbytes, retrying short reads. @return false on error or EOF
+static bool preadFully(int fd, char* buf, size_t nbytes, uint64_t offset) {
+    while (nbytes > 0) {
+        ssize_t rv = ::pread(fd, buf, nbytes, offset);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        buf += rv;
+        nbytes -= rv;
+        offset += rv;
+    }
+    return true;
+}
+
+void ValueLog::Ref::encode(char* out) const {
+    putUint64(out, generation);
+    putUint64(out, offset);
+    putUint32(out, length);
+    putUint32(out, crc);
+    putUint8(out, flags);
+}
+
+bool ValueLog::Ref::decode(cb::const_char_buffer in, Ref& ref) {
+    if (in.size() != encodedSize) {
+        return false;
+    }
+    const char* ptr = in.data();
+    ref.generation = getUint64(ptr);
+    ref.offset = getUint64(ptr);
+    ref.length = getUint32(ptr);
+    ref.crc = getUint32(ptr);
+    ref.flags = getUint8(ptr);
+    return true;
+}
+
+ValueLog::File::File(std::string path, int fd, uint64_t size)
+    : path(std::move(path)), fd(fd), size(size), syncPending(false) {
+}
+
+ValueLog::File::~File() {
+    ::close(fd);
+}
+
+ValueLog::Pin& ValueLog::Pin::operator=(Pin&& other) {
+    if (this != &other) {
+        if (log) {
+            log->unpin(epoch);
+        }
+        log = other.log;
+        epoch = other.epoch;
+        other.log = nullptr;
+    }
+    return *this;
+}
+
+ValueLog::Pin::~Pin() {
+    if (log) {
+        log->unpin(epoch);
+    }
+}
+
+ValueLog::ValueLog(const std::string& dir, uint16_t vbid)
+    : dir(dir), vbid(vbid), epoch(0), newest(1), dirSyncPending(false) {
+    const std::string prefix = std::to_string(vbid) + ".vlog.";
+    for (const auto& path : cb::io::findFilesWithPrefix(dir, prefix)) {
+        const std::string name = cb::io::basename(path);
+        char* end = nullptr;
+        const uint64_t generation =
+                strtoull(name.c_str() + prefix.size(), &end, 10);
+        if (*end != '\0' || generation == 0) {
+            continue;
+        }
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::system_error(errno,
+                                    std::system_category(),
+                                    "ValueLog: open of " + path + " failed");
+        }
+        const off_t size = ::lseek(fd, 0, SEEK_END);
+        files[generation] = std::make_shared<File>(path, fd, uint64_t(size));
+        newest = std::max(newest, generation + 1);
+    }
+}
+
+ValueLog::~ValueLog() = default;
+
+std::string ValueLog::getPath(uint64_t generation) const {
+    return dir + "/" + std::to_string(vbid) + ".vlog." +
+           std::to_string(generation);
+}
+
+std::shared_ptr<ValueLog::File> ValueLog::getFile(uint64_t generation) const {
+    std::lock_guard<std::mutex> lh(mutex);
+    auto it = files.find(generation);
+    if (it != files.end()) {
+        return it->second;
+    }
+    auto removedIt = removed.find(generation);
+    if (removedIt != removed.end()) {
+        return removedIt->second.file;
+    }
+    return {};
+}
+
+ValueLog::Pin ValueLog::pin() {
+    std::lock_guard<std::mutex> lh(mutex);
+    pins.insert(epoch);
+    return Pin(*this, epoch);
+}
+
+void ValueLog::unpin(uint64_t pinEpoch) {
+    std::lock_guard<std::mutex> lh(mutex);
+    auto it = pins.find(pinEpoch);
+    if (it != pins.end()) {
+        pins.erase(it);
+    }
+    pruneRemoved();
+}
+
+void ValueLog::pruneRemoved() {
+    // A file removed at epoch N is needed by Pins taken before it, i.e. of
+    // epochs below N.
+    for (auto it = removed.begin(); it != removed.end();) {
+        if (pins.empty() || *pins.begin() >= it->second.epoch) {
+            it = removed.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void ValueLog::syncDirectory() const {
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::system_error(errno,
+                                std::system_category(),
+                                "ValueLog: open of directory " + dir +
+                                        " failed");
+    }
+    const int rv = ::fsync(fd);
+    const int error = errno;
+    ::close(fd);
+    if (rv == -1) {
+        throw std::system_error(error,
+                                std::system_category(),
+                                "ValueLog: fsync of directory " + dir +
+                                        " failed");
+    }
+}
+
+ValueLog::Ref ValueLog::append(cb::const_char_buffer key,
+                               uint64_t seqno,
+                               cb::const_char_buffer value,
+                               uint8_t flags) {
+    auto file = getFile(newest);
+    if (!file) {
+        const std::string path = getPath(newest);
+        const int fd = ::open(path.c_str(), O_CREAT | O_RDWR, 0666);
+        if (fd == -1) {
+            throw std::system_error(errno,
+                                    std::system_category(),
+                                    "ValueLog::append: open of " + path +
+                                            " failed");
+        }
+        file = std::make_shared<File>(path, fd, 0);
+        dirSyncPending = true;
+        std::lock_guard<std::mutex> lh(mutex);
+        files[newest] = file;
+    }
+
+    Ref ref;
+    ref.generation = newest;
+    ref.offset = file->size + headerSize + key.size();
+    ref.length = uint32_t(value.size());
+    ref.crc = checksum(value.data(), value.size());
+    ref.flags = flags;
+
+    std::string entry(headerSize + key.size() + value.size(), '\0');
+    char* out = &entry[0];
+    putUint32(out, entryMagic);
+    putUint32(out, uint32_t(key.size()));
+    putUint32(out, ref.length);
+    putUint64(out, seqno);
+    putUint8(out, flags);
+    putUint32(out, ref.crc);
+    const size_t checked = out - entry.data();
+    std::memcpy(out + sizeof(uint32_t), key.data(), key.size());
+    putUint32(out, checksum(key.data(),
+                            key.size(),
+                            checksum(entry.data(), checked)));
+    std::memcpy(out + key.size(), value.data(), value.size());
+
+    // A failed write is overwritten by the next append, so a torn entry is
+    // only ever the last of a file.
+    const char* buf = entry.data();
+    size_t remaining = entry.size();
+    uint64_t offset = file->size;
+    while (remaining > 0) {
+        ssize_t rv = ::pwrite(file->fd, buf, remaining, offset);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno,
+                                    std::system_category(),
+                                    "ValueLog::append: write to " +
+                                            file->path + " failed");
+        }
+        buf += rv;
+        remaining -= rv;
+        offset += rv;
+    }
+    file->size = offset;
+    file->syncPending = true;
+    return ref;
+}
+
+void ValueLog::sync() {
+    auto file = getFile(newest);
+    if (file && file->syncPending) {
+        if (::fsync(file->fd) == -1) {
+            throw std::system_error(errno,
+                                    std::system_category(),
+                                    "ValueLog::sync: fsync of " + file->path +
+                                            " failed");
+        }
+        file->syncPending = false;
+    }
+    if (dirSyncPending) {
+        // The new file's directory entry must be durable too.
+        syncDirectory();
+        dirSyncPending = false;
+    }
+}
+
+bool ValueLog::read(const Ref& ref, std::string& value) const {
+    auto file = getFile(ref.generation);
+    if (!file) {
+        return false;
+    }
+    value.resize(ref.length);
+    if (!preadFully(file->fd, &value[0], ref.length, ref.offset)) {
+        return false;
+    }
+    return checksum(value.data(), value.size()) == ref.crc;
+}
+
+std::vector<uint64_t> ValueLog::seal() {
+    std::lock_guard<std::mutex> lh(mutex);
+    if (files.count(newest)) {
+        ++newest;
+    }
+    std::vector<uint64_t> sealed;
+    for (const auto& file : files) {
+        sealed.push_back(file.first);
+    }
+    return sealed;
+}
+
+uint64_t ValueLog::getSize(uint64_t generation) const {
+    std::lock_guard<std::mutex> lh(mutex);
+    auto it = files.find(generation);
+    return it == files.end() ? 0 : it->second->size;
+}
+
+uint64_t ValueLog::getTotalSize() const {
+    std::lock_guard<std::mutex> lh(mutex);
+    uint64_t size = 0;
+    for (const auto& file : files) {
+        size += file.second->size;
+    }
+    return size;
+}
+
+bool ValueLog::forEach(uint64_t generation,
+                       std::function<void(cb::const_char_buffer key,
+                                          uint64_t seqno,
+                                          const Ref& ref)> cb) const {
+    auto file = getFile(generation);
+    if (!file) {
+        return true;
+    }
+
+    const uint64_t size = file->size;
+    std::string header(headerSize, '\0');
+    std::string key;
+    uint64_t offset = 0;
+    while (offset < size) {
+        if (offset + headerSize > size) {
+            // Torn.
+            return true;
+        }
+        if (!preadFully(file->fd, &header[0], headerSize, offset)) {
+            return false;
+        }
+        const char* in = header.data();
+        const uint32_t magic = getUint32(in);
+        const uint32_t keyLen = getUint32(in);
+        Ref ref;
+        ref.generation = generation;
+        ref.length = getUint32(in);
+        const uint64_t seqno = getUint64(in);
+        ref.flags = getUint8(in);
+        ref.crc = getUint32(in);
+        const size_t checked = in - header.data();
+        const uint32_t headerCrc = getUint32(in);
+
+        if (magic != entryMagic) {
+            return false;
+        }
+        ref.offset = offset + headerSize + keyLen;
+        if (ref.offset > size) {
+            // Torn.
+            return true;
+        }
+        key.resize(keyLen);
+        if (!preadFully(file->fd, &key[0], keyLen, offset + headerSize) ||
+            checksum(key.data(), keyLen, checksum(header.data(), checked)) !=
+                    headerCrc) {
+            return false;
+        }
+        if (ref.offset + ref.length > size) {
+            // Torn.
+            return true;
+        }
+
+        cb({key.data(), key.size()}, seqno, ref);
+        offset = ref.offset + ref.length;
+    }
+    return true;
+}
+
+void ValueLog::remove(const std::vector<uint64_t>& generations) {
+    std::lock_guard<std::mutex> lh(mutex);
+    ++epoch;
+    for (auto generation : generations) {
+        auto it = files.find(generation);
+        if (it == files.end()) {
+            continue;
+        }
+        ::unlink(it->second->path.c_str());
+        removed[generation] = {epoch, std::move(it->second)};
+        files.erase(it);
+        if (generation == newest) {
+            ++newest;
+        }
+    }
+    pruneRemoved();
+}
+
+void ValueLog::removeAll() {
+    std::vector<uint64_t> generations;
+    {
+        std::lock_guard<std::mutex> lh(mutex);
+        for (const auto& file : files) {
+            generations.push_back(file.first);
+        }
+    }
+    remove(generations);
+}
+
+ValueLogs::ValueLogs(std::string dir, size_t numVBuckets)
+    : dir(std::move(dir)), logs(numVBuckets) {
+}
+
+ValueLog& ValueLogs::get(uint16_t vbid) {
+    std::lock_guard<std::mutex> lh(mutex);
+    auto& log = logs.at(vbid);
+    if (!log) {
+        log = std::make_unique<ValueLog>(dir, vbid);
+    }
+    return *log;
+}
@@ -0,0 +1,254 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <platform/sized_buffer.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * An append-only log of a vbucket's large document values, kept apart from
+ * its couchstore file (which stores a Ref to the value in its place), so
+ * that compacting the file doesn't copy them.
+ *
+ * The log is a series of files, <dir>/<vbid>.vlog.<generation>. Values are
+ * appended to the newest generation, which a new ValueLog (i.e. each
+ * process) starts afresh, and which seal() closes to appends. Space held by
+ * values no longer referred to is reclaimed a generation at a time, by
+ * copying its live values into the newest generation and removing it (see
+ * CouchKVStore::compactDB).
+ *
+ * Each entry is a header - magic, key length, value length, seqno, flags,
+ * the value's checksum, and a checksum of all that and the key - followed by
+ * the key and the value. The key is that of the document as stored in
+ * couchstore.
+ *
+ * append(), sync(), seal() and remove() are only called by the vbucket's
+ * writer (its flusher or compactor, which never run together); reads may
+ * come from any thread. A reader which may use an older couchstore file -
+ * one that refers to generations since removed - must hold a Pin (taken
+ * before it chooses the file), which keeps every generation removed after
+ * it was taken readable.
+ */
+class ValueLog {
+public:
+    /**
+     * Keeps the generations removed while it is held readable (see
+     * ValueLog::pin()). Movable; an empty Pin pins nothing.
+     */
+    class Pin {
+    public:
+        Pin() = default;
+
+        Pin(Pin&& other) {
+            *this = std::move(other);
+        }
+
+        Pin& operator=(Pin&& other);
+
+        ~Pin();
+
+    private:
+        Pin(ValueLog& log, uint64_t epoch) : log(&log), epoch(epoch) {
+        }
+
+        ValueLog* log = nullptr;
+        uint64_t epoch = 0;
+
+        friend class ValueLog;
+    };
+
+    /// Where a value is in the log, as stored in the document's body.
+    struct Ref {
+        enum Flags : uint8_t {
+            /// The value was snappy-compressed by the store (its datatype
+            /// doesn't say so).
+            Compressed = 0x1
+        };
+
+        bool isCompressed() const {
+            return flags & Compressed;
+        }
+
+        /// Serialize into encodedSize bytes at out.
+        void encode(char* out) const;
+
+        /// @return false if in isn't an encoded Ref
+        static bool decode(cb::const_char_buffer in, Ref& ref);
+
+        static const size_t encodedSize = 25;
+
+        uint64_t generation;
+        /// Offset of the value (not its entry) in the file.
+        uint64_t offset;
+        uint32_t length;
+        /// crc32c of the value.
+        uint32_t crc;
+        uint8_t flags;
+    };
+
+    /// Size of an entry's header.
+    static const size_t headerSize = 29;
+
+    /// Open the vbucket's log in dir, finding its existing generations.
+    ValueLog(const std::string& dir, uint16_t vbid);
+
+    ~ValueLog();
+
+    /**
+     * Append a value to the newest generation.
+     *
+     * @throws std::system_error if the write fails (the log is unchanged)
+     */
+    Ref append(cb::const_char_buffer key,
+               uint64_t seqno,
+               cb::const_char_buffer value,
+               uint8_t flags);
+
+    /**
+     * Make the values appended so far durable.
+     *
+     * @throws std::system_error if the sync fails
+     */
+    void sync();
+
+    /**
+     * Read the value ref refers to, checking it against its checksum.
+     *
+     * @return false if the value couldn't be read or is corrupt
+     */
+    bool read(const Ref& ref, std::string& value) const;
+
+    /**
+     * Close the newest generation to appends: later values go to a new one.
+     *
+     * @return all the generations but the new one, oldest first
+     */
+    std::vector<uint64_t> seal();
+
+    /// Size of a generation's file (0 if it doesn't exist).
+    uint64_t getSize(uint64_t generation) const;
+
+    /// Total size of the log's files.
+    uint64_t getTotalSize() const;
+
+    /**
+     * Invoke cb with the key, seqno and Ref of each entry of a generation,
+     * in order.
+     *
+     * @return false if an entry (other than one torn by a crash while being
+     *         appended) is corrupt; cb won't have seen those after it
+     */
+    bool forEach(uint64_t generation,
+                 std::function<void(cb::const_char_buffer key,
+                                    uint64_t seqno,
+                                    const Ref& ref)> cb) const;
+
+    /**
+     * Pin the log: generations removed from now on remain readable until
+     * the returned Pin is released.
+     */
+    Pin pin();
+
+    /**
+     * Remove generations. Their files are unlinked at once, but remain
+     * readable (by readers of older couchstore files) while any Pin taken
+     * before this call is held.
+     */
+    void remove(const std::vector<uint64_t>& generations);
+
+    /// Remove all of the log's generations.
+    void removeAll();
+
+private:
+    struct File {
+        File(std::string path, int fd, uint64_t size);
+        ~File();
+
+        const std::string path;
+        const int fd;
+        // Only changed by the writer, but read by any thread.
+        std::atomic<uint64_t> size;
+        std::atomic<bool> syncPending;
+    };
+
+    /// A removed generation, kept open while pinned.
+    struct RemovedFile {
+        // The removal's epoch: Pins of earlier epochs keep the file open.
+        uint64_t epoch;
+        std::shared_ptr<File> file;
+    };
+
+    std::string getPath(uint64_t generation) const;
+
+    /// The file of a generation (or a removed one still open), or null.
+    std::shared_ptr<File> getFile(uint64_t generation) const;
+
+    /// Release a Pin of the given epoch.
+    void unpin(uint64_t epoch);
+
+    /// Close the removed files no Pin needs. Called with mutex held.
+    void pruneRemoved();
+
+    /// fsync the log's directory, so a new generation's file is durable.
+    void syncDirectory() const;
+
+    const std::string dir;
+    const uint16_t vbid;
+
+    // Guards the members below.
+    mutable std::mutex mutex;
+    std::map<uint64_t, std::shared_ptr<File>> files;
+    // Removed generations' files which a Pin may still need.
+    std::map<uint64_t, RemovedFile> removed;
+    // Number of remove() calls so far.
+    uint64_t epoch;
+    // The epochs of the Pins held.
+    std::multiset<uint64_t> pins;
+    // The generation appended to (whose file is created by the first).
+    uint64_t newest;
+    // Set when the newest generation's file is created, until the directory
+    // is synced. Only used by the writer.
+    bool dirSyncPending;
+};
+
+/**
+ * The value logs of a bucket shard's vbuckets, each opened on first use.
+ * Shared by the shard's read-write and read-only CouchKVStores.
+ */
+class ValueLogs {
+public:
+    ValueLogs(std::string dir, size_t numVBuckets);
+
+    ValueLog& get(uint16_t vbid);
+
+private:
+    const std::string dir;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ValueLog>> logs;
+};
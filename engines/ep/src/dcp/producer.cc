@@ -504,7 +504,14 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
     if (mutationResponse) {
         try {
             itmCpy = mutationResponse->getItemCopy();
-            itmCpy->pruneValueAndOrXattrs(includeValue, includeXattrs);
+            if (!itmCpy->pruneValueAndOrXattrs(includeValue, includeXattrs)) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "%s (vb %d) Failed to snappy decompress the value of "
+                    "seqno:%" PRIu64 " to prune it; streaming it unpruned",
+                    logHeader(),
+                    mutationResponse->getVBucket(),
+                    *mutationResponse->getBySeqno());
+            }
         } catch (const std::bad_alloc&) {
             rejectResp = std::move(resp);
             LOG(EXTENSION_LOG_WARNING,
@@ -535,6 +542,15 @@ ENGINE_ERROR_CODE DcpProducer::step(struct dcp_message_producers* producers) {
             if (sizeAfter < sizeBefore) {
                 log.acknowledge(sizeBefore - sizeAfter);
             }
+        } else if (mcbp::datatype::is_snappy(itmCpy->getDataType())) {
+            // Kept compressed in memory (as read back from disk when
+            // couchstore_value_compression is snappy), but the consumer
+            // can't take it so.
+            if (!itmCpy->decompressValue()) {
+                LOG(EXTENSION_LOG_WARNING,
+                    "%s Failed to snappy decompress a compressed value!",
+                    logHeader());
+            }
         }
     }
 
@@ -36,6 +36,12 @@ void DefragmentVisitor::setDeadline(ProcessClock::time_point deadline) {
 
 bool DefragmentVisitor::visit(const HashTable::HashBucketLock& lh,
                               StoredValue& v) {
+    if (v.isValueInline()) {
+        // Stored within the StoredValue's own allocation; nothing to move.
+        visited_count++;
+        return progressTracker.shouldContinueVisiting(visited_count);
+    }
+
     const size_t value_len = v.valuelen();
 
     // value must be at least non-zero (also covers Items with null Blobs)
@@ -48,12 +54,13 @@ bool DefragmentVisitor::visit(const HashTable::HashBucketLock& lh,
         // It may be possible to add a reference to the blob without holding
         // any locks, therefore the check is somewhat of an estimate which
         // should be good enough.
-        if (v.getValue()->getAge() >= age_threshold &&
-            v.getValue().refCount() < 2) {
+        // getNonInlineValue() doesn't add a reference of its own.
+        const value_t& value = v.getNonInlineValue();
+        if (value->getAge() >= age_threshold && value.refCount() < 2) {
             v.reallocate();
             defrag_count++;
         } else {
-            v.getValue()->incrementAge();
+            value->incrementAge();
         }
     }
     visited_count++;
@@ -56,6 +56,17 @@ void EPBucket::deinitialize() {
     stopFlusher();
     stopBgFetcher();
 
+    // Everything has now been flushed (unless forced to shut down), so the
+    // bloom filters are valid for the files as they stand.
+    Configuration& config = engine.getConfiguration();
+    if (!stats.forceShutdown && config.isBfilterEnabled() &&
+        config.isBfilterPersist()) {
+        persistBloomFilters();
+    }
+    if (!stats.forceShutdown && config.isWarmupMetadataImage()) {
+        persistMetadataImages();
+    }
+
     KVBucket::deinitialize();
 }
 
@@ -258,7 +269,8 @@ VBucketPtr EPBucket::makeVBucket(VBucket::id_type id,
                                     maxCas,
                                     hlcEpochSeqno,
                                     mightContainXattrs,
-                                    collectionsManifest),
+                                    collectionsManifest,
+                                    sharedHtLocks),
                       VBucket::DeferredDeleter(engine));
 }
 
@@ -387,3 +399,18 @@ void EPBucket::notifyNewSeqno(const uint16_t vbid,
         notifyReplication(vbid, notifyCtx.bySeqno);
     }
 }
+
+void EPBucket::persistMetadataImages() {
+    size_t persisted = 0;
+    for (VBucketMap::id_type vbid = 0; vbid < vbMap.getSize(); vbid++) {
+        VBucketPtr vb = vbMap.getBucket(vbid);
+        auto* epVb = dynamic_cast<EPVBucket*>(vb.get());
+        if (epVb && epVb->persistMetadataImage(getMetadataImageFile(vbid))) {
+            ++persisted;
+        }
+    }
+    LOG(EXTENSION_LOG_NOTICE,
+        "EPBucket::persistMetadataImages: Persisted %" PRIu64
+        " metadata image(s)",
+        uint64_t(persisted));
+}
@@ -107,4 +107,11 @@ public:
     virtual bool isGetAllKeysSupported() const override {
         return true;
     }
+
+    /**
+     * Write every vbucket's metadata image to disk, for warmup to build the
+     * hash tables from. Only valid once everything has been persisted, at
+     * shutdown.
+     */
+    void persistMetadataImages();
 };
@@ -423,6 +423,8 @@ protocol_binary_response_status EventuallyPersistentEngine::setCheckpointParam(
             getConfiguration().setKeepClosedChks(cb_stob(valz));
         } else if (strcmp(keyz, "enable_chk_merge") == 0) {
             getConfiguration().setEnableChkMerge(cb_stob(valz));
+        } else if (strcmp(keyz, "chk_expel_enabled") == 0) {
+            getConfiguration().setChkExpelEnabled(cb_stob(valz));
         } else {
             msg = "Unknown config param";
             rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -547,6 +549,8 @@ protocol_binary_response_status EventuallyPersistentEngine::setFlushParam(
             ExecutorPool::get()->setNumNonIO(value);
         } else if (strcmp(keyz, "bfilter_enabled") == 0) {
             getConfiguration().setBfilterEnabled(cb_stob(valz));
+        } else if (strcmp(keyz, "bfilter_blocked") == 0) {
+            getConfiguration().setBfilterBlocked(cb_stob(valz));
         } else if (strcmp(keyz, "bfilter_residency_threshold") == 0) {
             getConfiguration().setBfilterResidencyThreshold(std::stof(valz));
         } else if (strcmp(keyz, "defragmenter_enabled") == 0) {
@@ -2073,9 +2077,11 @@ cb::EngineErrorItemPair EventuallyPersistentEngine::get_and_touch(const void* co
         auto* core = serverApi->core;
         expiry_time = core->abstime(core->realtime(exptime));
     }
+    const hrtime_t start = warmupOpStart();
     GetValue gv(kvBucket->getAndUpdateTtl(key, vbucket, cookie, expiry_time));
 
     auto rv = gv.getStatus();
+    recordWarmupOp(start, rv);
     if (rv == ENGINE_SUCCESS) {
         ++stats.numOpsGet;
         ++stats.numOpsStore;
@@ -2109,6 +2115,7 @@ cb::EngineErrorItemPair EventuallyPersistentEngine::get_if(const void* cookie,
                                                        std::function<bool(const item_info&)>filter) {
 
     auto* handle = reinterpret_cast<ENGINE_HANDLE*>(this);
+    const hrtime_t start = warmupOpStart();
 
     // Fetch an item from the hashtable (without trying to schedule a bg-fetch
     // and pass it through the filter. If the filter accepts the document
@@ -2147,6 +2154,7 @@ cb::EngineErrorItemPair EventuallyPersistentEngine::get_if(const void* cookie,
             }
             // FALLTHROUGH
         default:
+            recordWarmupOp(start, status);
             return cb::makeEngineErrorItemPair(cb::engine_errc(status));
         }
 
@@ -2165,12 +2173,14 @@ cb::EngineErrorItemPair EventuallyPersistentEngine::get_if(const void* cookie,
         info.value[0].iov_len = 0;
         if (filter(info)) {
             if (!gv.isPartial()) {
+                recordWarmupOp(start, ENGINE_SUCCESS);
                 return cb::makeEngineErrorItemPair(
                         cb::engine_errc::success, gv.item.release(), handle);
             }
             // We want this item, but we need to fetch it off disk
         } else {
             // the client don't care about this thing..
+            recordWarmupOp(start, ENGINE_SUCCESS);
             return cb::makeEngineErrorItemPair(cb::engine_errc::success);
         }
     }
@@ -2198,6 +2208,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::get_locked(const void* cookie,
         lock_timeout = default_timeout;
     }
 
+    const hrtime_t start = warmupOpStart();
     auto result = kvBucket->getLocked(key, vbucket, ep_current_time(),
                                       lock_timeout, cookie);
 
@@ -2206,6 +2217,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::get_locked(const void* cookie,
         *itm = result.item.release();
     }
 
+    recordWarmupOp(start, result.getStatus());
     return result.getStatus();
 }
 
@@ -2213,7 +2225,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::unlock(const void* cookie,
                                                      const DocKey& key,
                                                      uint16_t vbucket,
                                                      uint64_t cas) {
-    return kvBucket->unlockKey(key, vbucket, cas, ep_current_time());
+    const hrtime_t start = warmupOpStart();
+    const ENGINE_ERROR_CODE ret =
+            kvBucket->unlockKey(key, vbucket, cas, ep_current_time());
+    recordWarmupOp(start, ret);
+    return ret;
 }
 
 cb::EngineErrorCasPair EventuallyPersistentEngine::store_if(
@@ -2223,6 +2239,7 @@ cb::EngineErrorCasPair EventuallyPersistentEngine::store_if(
         ENGINE_STORE_OPERATION operation,
         cb::StoreIfPredicate predicate) {
     BlockTimer timer(&stats.storeCmdHisto);
+    const hrtime_t start = warmupOpStart();
     ENGINE_ERROR_CODE status;
     switch (operation) {
     case OPERATION_CAS:
@@ -2269,6 +2286,8 @@ cb::EngineErrorCasPair EventuallyPersistentEngine::store_if(
     case ENGINE_NOT_STORED:
     case ENGINE_NOT_MY_VBUCKET:
         if (isDegradedMode()) {
+            status = ENGINE_TMPFAIL;
+            recordWarmupOp(start, status);
             return {cb::engine_errc::temporary_failure, cas};
         }
         break;
@@ -2276,6 +2295,7 @@ cb::EngineErrorCasPair EventuallyPersistentEngine::store_if(
         break;
     }
 
+    recordWarmupOp(start, status);
     return {cb::engine_errc(status), item.getCas()};
 }
 
@@ -2382,6 +2402,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                         flusher->stateName(), add_stat, cookie);
         add_casted_stat("ep_flusher_todo",
                         epstats.flusher_todo, add_stat, cookie);
+        // The shards' flushers drain their queues in parallel.
+        uint64_t drainRate = 0;
+        const size_t numShards = kvBucket->getVBuckets().getNumShards();
+        for (size_t shard = 0; shard < numShards; ++shard) {
+            drainRate += kvBucket->getFlusher(shard)->getDrainRate();
+        }
+        add_casted_stat("ep_flusher_drain_rate", drainRate, add_stat, cookie);
         add_casted_stat("ep_total_persisted",
                         epstats.totalPersisted, add_stat, cookie);
         add_casted_stat("ep_uncommitted_items",
@@ -2429,6 +2456,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
     add_casted_stat("ep_overhead", stats.memOverhead, add_stat, cookie);
+    add_casted_stat("ep_expiry_index_memory", stats.expiryIndexMemory,
+                    add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
 
     add_casted_stat("ep_oom_errors", stats.oom_errors, add_stat, cookie);
@@ -2453,6 +2482,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_items_rm_from_checkpoints",
                     epstats.itemsRemovedFromCheckpoints,
                     add_stat, cookie);
+    add_casted_stat("ep_items_expelled_from_checkpoints",
+                    epstats.itemsExpelledFromCheckpoints,
+                    add_stat, cookie);
+    add_casted_stat("ep_mem_freed_by_checkpoint_item_expel",
+                    epstats.memFreedByCheckpointItemExpel,
+                    add_stat, cookie);
     add_casted_stat("ep_num_value_ejects", epstats.numValueEjects,
                     add_stat, cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects,
@@ -2460,6 +2495,23 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_num_not_my_vbuckets", epstats.numNotMyVBuckets,
                     add_stat, cookie);
 
+    const size_t cacheHits = epstats.cacheHits;
+    const size_t cacheMisses = epstats.cacheMisses;
+    add_casted_stat("ep_cache_hits", cacheHits, add_stat, cookie);
+    add_casted_stat("ep_cache_misses", cacheMisses, add_stat, cookie);
+    // A get which misses is re-executed once its value has been fetched,
+    // and so is also counted as a hit.
+    add_casted_stat("ep_cache_hit_ratio",
+                    cacheHits > cacheMisses
+                            ? (cacheHits - cacheMisses) * 100 / cacheHits
+                            : 0,
+                    add_stat,
+                    cookie);
+    add_casted_stat("ep_lfu_admission_rejects",
+                    epstats.lfuAdmissionRejects,
+                    add_stat,
+                    cookie);
+
     add_casted_stat("ep_pending_ops", epstats.pendingOps, add_stat, cookie);
     add_casted_stat("ep_pending_ops_total", epstats.pendingOpsTotal,
                     add_stat, cookie);
@@ -2636,11 +2688,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
         add_casted_stat("ep_io_compaction_write_bytes",  value, add_stat, cookie);
     }
     if (kvBucket->getKVStoreStat("Block_cache_hits", value,
-                                 KVBucketIface::KVSOption::RW)) {
+                                 KVBucketIface::KVSOption::BOTH)) {
         add_casted_stat("ep_block_cache_hits", value, add_stat, cookie);
     }
     if (kvBucket->getKVStoreStat("Block_cache_misses", value,
-                                 KVBucketIface::KVSOption::RW)) {
+                                 KVBucketIface::KVSOption::BOTH)) {
         add_casted_stat("ep_block_cache_misses", value, add_stat, cookie);
     }
 
@@ -2679,6 +2731,16 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_storedval_overhead", "unknown", add_stat, cookie);
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
+    add_casted_stat("ep_storedval_inline_num", stats.numInlineValues,
+                    add_stat, cookie);
+    add_casted_stat("ep_storedval_inline_size", stats.inlineValueSize,
+                    add_stat, cookie);
+    add_casted_stat("ep_storedval_inline_saved", stats.inlineValueSaved,
+                    add_stat, cookie);
+    add_casted_stat("ep_storedval_inline_capacity", stats.inlineValueCapacity,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_index_memory", stats.expiryIndexMemory,
+                    add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
 
     std::map<std::string, size_t> alloc_stats;
@@ -2778,7 +2840,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
 
         void visitBucket(VBucketPtr &vb) override {
             uint16_t vbid = vb->getId();
-            char buf[32];
+            char buf[64];
             try {
                 checked_snprintf(buf, sizeof(buf), "vb_%d:state", vbid);
                 add_casted_stat(buf, VBucket::toString(vb->getState()),
@@ -2812,6 +2874,19 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
                 add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
                 add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+                checked_snprintf(buf, sizeof(buf), "vb_%d:resize_migrated",
+                                 vbid);
+                add_casted_stat(buf, vb->ht.getResizeBucketsMigrated(),
+                                add_stat, cookie);
+                checked_snprintf(buf, sizeof(buf), "vb_%d:resize_pending",
+                                 vbid);
+                add_casted_stat(buf, vb->ht.getResizeBucketsPending(),
+                                add_stat, cookie);
+                checked_snprintf(buf, sizeof(buf),
+                                 "vb_%d:resize_max_lock_hold_us", vbid);
+                add_casted_stat(buf,
+                                vb->ht.getMaxResizeLockHoldTime().count(),
+                                add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
                 add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted",
@@ -3218,6 +3293,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
                                                            ADD_STAT add_stat) {
     add_casted_stat("bg_wait", stats.bgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_load", stats.bgLoadHisto, add_stat, cookie);
+    add_casted_stat("warmup_op", stats.warmupOpHisto, add_stat, cookie);
+    add_casted_stat(
+            "warmup_bg_fetch", stats.warmupBgFetchHisto, add_stat, cookie);
     add_casted_stat("set_with_meta", stats.setWithMetaHisto, add_stat, cookie);
     add_casted_stat("pending_ops", stats.pendingOpsHisto, add_stat, cookie);
 
@@ -4577,7 +4655,7 @@ EventuallyPersistentEngine::handleTrafficControlCmd(const void *cookie,
 
     switch (request->request.opcode) {
     case PROTOCOL_BINARY_CMD_ENABLE_TRAFFIC:
-        if (kvBucket->isWarmingUp()) {
+        if (kvBucket->isWarmingUp() && !kvBucket->isWarmupServingTraffic()) {
             // engine is still warming up, do not turn on data traffic yet
             status = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
             setErrorContext(cookie, "Persistent engine is still warming up!");
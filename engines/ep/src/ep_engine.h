@@ -125,6 +125,7 @@ public:
                                  uint16_t vbucket,
                                  ItemMetaData* item_meta,
                                  mutation_descr_t* mut_info) {
+        const hrtime_t start = warmupOpStart();
         ENGINE_ERROR_CODE ret = kvBucket->deleteItem(key,
                                                      cas,
                                                      vbucket,
@@ -134,11 +135,12 @@ public:
 
         if (ret == ENGINE_KEY_ENOENT || ret == ENGINE_NOT_MY_VBUCKET) {
             if (isDegradedMode()) {
-                return ENGINE_TMPFAIL;
+                ret = ENGINE_TMPFAIL;
             }
         } else if (ret == ENGINE_SUCCESS) {
             ++stats.numOpsDelete;
         }
+        recordWarmupOp(start, ret);
         return ret;
     }
 
@@ -156,6 +158,7 @@ public:
                           get_options_t options)
     {
         BlockTimer timer(&stats.getCmdHisto);
+        const hrtime_t start = warmupOpStart();
         GetValue gv(kvBucket->get(key, vbucket, cookie, options));
         ENGINE_ERROR_CODE ret = gv.getStatus();
 
@@ -166,10 +169,11 @@ public:
             }
         } else if (ret == ENGINE_KEY_ENOENT || ret == ENGINE_NOT_MY_VBUCKET) {
             if (isDegradedMode()) {
-                return ENGINE_TMPFAIL;
+                ret = ENGINE_TMPFAIL;
             }
         }
 
+        recordWarmupOp(start, ret);
         return ret;
     }
 
@@ -548,7 +552,9 @@ public:
     }
 
     bool isDegradedMode() const {
-        return kvBucket->isWarmingUp() || !trafficEnabled.load();
+        return (kvBucket->isWarmingUp() &&
+                !kvBucket->isWarmupServingTraffic()) ||
+               !trafficEnabled.load();
     }
 
     WorkLoadPolicy &getWorkLoadPolicy(void) {
@@ -678,6 +684,27 @@ protected:
     friend class KVBucket;
     friend class EPBucket;
 
+    /**
+     * @return the time a data operation starts at if it's to be recorded
+     * by recordWarmupOp() (traffic is being served during warmup), else 0
+     */
+    hrtime_t warmupOpStart() {
+        return kvBucket->isWarmupServingTraffic() ? gethrtime() : 0;
+    }
+
+    /**
+     * Record a data operation (get, get_if, get_and_touch, get_locked,
+     * unlock, delete or store) served during warmup, which started at start
+     * (from warmupOpStart()) and completed with status. An operation
+     * waiting on a background fetch is only recorded once it completes.
+     */
+    void recordWarmupOp(hrtime_t start, ENGINE_ERROR_CODE status) {
+        if (start && status != ENGINE_EWOULDBLOCK) {
+            ++stats.warmupOpsServed;
+            stats.warmupOpHisto.add((gethrtime() - start) / 1000);
+        }
+    }
+
     bool enableTraffic(bool enable) {
         bool inverse = !enable;
         return trafficEnabled.compare_exchange_strong(inverse, enable);
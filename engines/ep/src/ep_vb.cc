@@ -25,8 +25,26 @@
 #include "stored_value_factories.h"
 #include "tasks.h"
 #include "vbucket_bgfetch_item.h"
+#include "vbucket_image.h"
 #include "vbucketdeletiontask.h"
 
+#include <platform/platform.h>
+
+#include <cstring>
+
+/**
+ * Create the factory for the HashTable's StoredValues; storing small values
+ * inline if configured.
+ */
+static std::unique_ptr<AbstractStoredValueFactory> makeStoredValueFactory(
+        EPStats& st, Configuration& config) {
+    const size_t inlineSize = config.getHtInlineValueSize();
+    if (inlineSize > 0) {
+        return std::make_unique<InlineStoredValueFactory>(st, inlineSize);
+    }
+    return std::make_unique<StoredValueFactory>(st);
+}
+
 EPVBucket::EPVBucket(id_type i,
                      vbucket_state_t newState,
                      EPStats& st,
@@ -45,7 +63,8 @@ EPVBucket::EPVBucket(id_type i,
                      uint64_t maxCas,
                      int64_t hlcEpochSeqno,
                      bool mightContainXattrs,
-                     const std::string& collectionsManifest)
+                     const std::string& collectionsManifest,
+                     std::shared_ptr<HashTable::LockSet> htLocks)
     : VBucket(i,
               newState,
               st,
@@ -55,7 +74,7 @@ EPVBucket::EPVBucket(id_type i,
               lastSnapEnd,
               std::move(table),
               flusherCb,
-              std::make_unique<StoredValueFactory>(st),
+              makeStoredValueFactory(st, config),
               std::move(newSeqnoCb),
               config,
               evictionPolicy,
@@ -64,7 +83,8 @@ EPVBucket::EPVBucket(id_type i,
               maxCas,
               hlcEpochSeqno,
               mightContainXattrs,
-              collectionsManifest),
+              collectionsManifest,
+              std::move(htLocks)),
       multiBGFetchEnabled(kvshard
                                   ? kvshard->getROUnderlying()
                                             ->getStorageProperties()
@@ -90,10 +110,14 @@ ENGINE_ERROR_CODE EPVBucket::completeBGFetchForSingleItem(
     { // locking scope
         ReaderLockHolder rlh(getStateLock());
         auto hbl = ht.getLockedBucket(key);
+        // When tracking access frequencies the access has already been
+        // recorded by the request which scheduled the fetch.
         StoredValue* v = fetchValidValue(hbl,
                                          key,
                                          WantsDeleted::Yes,
-                                         TrackReference::Yes,
+                                         ht.isTrackingFrequency()
+                                                 ? TrackReference::No
+                                                 : TrackReference::Yes,
                                          QueueExpired::Yes);
 
         if (fetched_item.metaDataOnly) {
@@ -104,6 +128,7 @@ ENGINE_ERROR_CODE EPVBucket::completeBGFetchForSingleItem(
             } else if (status == ENGINE_KEY_ENOENT) {
                 if (v && v->isTempInitialItem()) {
                     v->setNonExistent();
+                    recordFilterFalsePositive();
                 }
                 /* If ENGINE_KEY_ENOENT is the status from storage and the temp
                  key is removed from hash table by the time bgfetch returns
@@ -152,7 +177,17 @@ ENGINE_ERROR_CODE EPVBucket::completeBGFetchForSingleItem(
                                 ") should be resident after calling "
                                 "restoreValue()");
                     }
+                    if (!admitToCache(key)) {
+                        // The value must be restored to satisfy the waiting
+                        // request, but mark it as unreferenced so the item
+                        // pager evicts it before more frequently used items.
+                        v->setNRUValue(MAX_NRU_VALUE);
+                        ++stats.lfuAdmissionRejects;
+                    }
                 } else if (status == ENGINE_KEY_ENOENT) {
+                    if (v->isTempInitialItem()) {
+                        recordFilterFalsePositive();
+                    }
                     v->setNonExistent();
                     if (eviction == FULL_EVICTION) {
                         // For the full eviction, we should notify
@@ -186,6 +221,18 @@ ENGINE_ERROR_CODE EPVBucket::completeBGFetchForSingleItem(
     return status;
 }
 
+bool EPVBucket::admitToCache(const DocKey& key) const {
+    if (!ht.isTrackingFrequency() ||
+        stats.getTotalMemoryUsed() <= stats.mem_low_wat.load()) {
+        // Not using the lfu eviction strategy, or there's space for
+        // everything.
+        return true;
+    }
+    // TinyLFU: only admit the value if it's more popular than the items
+    // currently being evicted to make space.
+    return ht.estimateFrequency(key) > ht.getVictimFrequency();
+}
+
 vb_bgfetch_queue_t EPVBucket::getBGFetchItems() {
     vb_bgfetch_queue_t fetches;
     LockHolder lh(pendingBGFetchesLock);
@@ -243,6 +290,10 @@ void EPVBucket::notifyAllPendingConnsFailed(EventuallyPersistentEngine& e) {
             }
         }
         stats.numRemainingBgItems.fetch_sub(num_of_deleted_pending_fetches);
+        if (shard && shard->getBgFetcher()) {
+            shard->getBgFetcher()->dropQueuedItems(
+                    num_of_deleted_pending_fetches);
+        }
         pendingBGFetches.clear();
     }
 
@@ -383,7 +434,7 @@ protocol_binary_response_status EPVBucket::evictKey(const DocKey& key,
     }
 
     if (v->isResident()) {
-        if (ht.unlocked_ejectItem(v, eviction)) {
+        if (ht.unlocked_ejectItem(v, getEjectionPolicy())) {
             *msg = "Ejected.";
 
             // Add key to bloom filter in case of full eviction mode
@@ -401,7 +452,11 @@ protocol_binary_response_status EPVBucket::evictKey(const DocKey& key,
 }
 
 bool EPVBucket::pageOut(const HashTable::HashBucketLock& lh, StoredValue*& v) {
-    return ht.unlocked_ejectItem(v, eviction);
+    return ht.unlocked_ejectItem(v, getEjectionPolicy());
+}
+
+item_eviction_policy_t EPVBucket::getEjectionPolicy() const {
+    return isRetainingPersistedDeletes() ? VALUE_ONLY : eviction;
 }
 
 void EPVBucket::queueBackfillItem(queued_item& qi,
@@ -527,7 +582,7 @@ EPVBucket::addTempItemAndBGFetch(HashTable::HashBucketLock& hbl,
     case TempAddStatus::NoMem:
         return ENGINE_ENOMEM;
     case TempAddStatus::BgFetch:
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         bgFetch(key, cookie, engine, bgFetchDelay, metadataOnly);
     }
     return ENGINE_EWOULDBLOCK;
@@ -618,7 +673,8 @@ MutationStatus EPVBucket::insertFromWarmup(Item& itm,
             if (v->getCas() == 0) {
                 v->setCas(itm.getCas());
                 v->setFlags(itm.getFlags());
-                v->setExptime(itm.getExptime());
+                ht.unlocked_setExptime(
+                        hbl.getHTLock(), *v, itm.getExptime());
                 v->setRevSeqno(itm.getRevSeqno());
             } else {
                 return MutationStatus::InvalidCas;
@@ -635,3 +691,194 @@ MutationStatus EPVBucket::insertFromWarmup(Item& itm,
 
     return MutationStatus::NotFound;
 }
+
+namespace {
+/**
+ * Magic of the image written by EPVBucket::persistMetadataImage(). Its body
+ * is a MetadataImageRecord and the key of each item, then the number of
+ * items (uint64_t); every field in network byte order.
+ */
+const uint64_t metadataImageMagic = 0x6d657461696d6733; // "metaimg3"
+
+struct MetadataImageRecord {
+    uint64_t cas;
+    uint64_t bySeqno;
+    uint64_t revSeqno;
+    uint32_t flags;
+    uint32_t exptime;
+    uint16_t keyLen;
+    uint8_t datatype;
+    uint8_t docNamespace;
+    uint32_t reserved;
+};
+
+/// Appends a record for each persisted item in a hash table to the image.
+class MetadataImageVisitor : public HashTableVisitor {
+public:
+    MetadataImageVisitor(VBucketImageWriter& writer) : writer(writer) {
+    }
+
+    bool visit(const HashTable::HashBucketLock& lh, StoredValue& v) override {
+        if (v.isTempItem()) {
+            return true;
+        }
+        // Including a deletion, which would leave the item on disk.
+        if (v.isDirty()) {
+            unpersisted = true;
+            return false;
+        }
+        // Warmup doesn't load system events either.
+        if (v.isDeleted() ||
+            v.getKey().getDocNamespace() == DocNamespace::System) {
+            return true;
+        }
+
+        MetadataImageRecord record;
+        record.cas = htonll(v.getCas());
+        record.bySeqno = htonll(v.getBySeqno());
+        record.revSeqno = htonll(v.getRevSeqno());
+        record.flags = htonl(v.getFlags());
+        record.exptime = htonl(uint32_t(v.getExptime()));
+        record.keyLen = htons(uint16_t(v.getKey().size()));
+        // As a key dump would load it: without a value to be compressed.
+        record.datatype = v.getDatatype() & ~PROTOCOL_BINARY_DATATYPE_SNAPPY;
+        record.docNamespace = uint8_t(v.getKey().getDocNamespace());
+        record.reserved = 0;
+        if (!writer.write(&record, sizeof(record)) ||
+            !writer.write(v.getKey().data(), v.getKey().size())) {
+            return false;
+        }
+        ++count;
+        return true;
+    }
+
+    VBucketImageWriter& writer;
+    uint64_t count = 0;
+    // An item hasn't been persisted: the image wouldn't match the file.
+    bool unpersisted = false;
+};
+} // anonymous namespace
+
+bool EPVBucket::persistMetadataImage(const std::string& path) {
+    if (eviction != VALUE_ONLY) {
+        return false;
+    }
+    if (hasUnpersistedCas()) {
+        LOG(EXTENSION_LOG_NOTICE,
+            "EPVBucket::persistMetadataImage: (vb %" PRIu16
+            ") Not writing '%s', as a locked item's CAS isn't on disk",
+            id,
+            path.c_str());
+        return false;
+    }
+
+    VBucketImageWriter writer(path,
+                              {metadataImageMagic,
+                               getId(),
+                               getPersistenceSeqno(),
+                               failovers->getLatestUUID(),
+                               0});
+    MetadataImageVisitor visitor(writer);
+    ht.visit(visitor);
+    if (visitor.unpersisted) {
+        LOG(EXTENSION_LOG_NOTICE,
+            "EPVBucket::persistMetadataImage: (vb %" PRIu16
+            ") Not writing '%s', as not every item is persisted",
+            id,
+            path.c_str());
+        return false;
+    }
+    const uint64_t count = htonll(visitor.count);
+    if (!writer.write(&count, sizeof(count)) || !writer.commit()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "EPVBucket::persistMetadataImage: (vb %" PRIu16
+            ") Failed to write '%s': %s",
+            id,
+            path.c_str(),
+            strerror(writer.getError()));
+        return false;
+    }
+    return true;
+}
+
+bool EPVBucket::restoreMetadataImage(const std::string& path,
+                                     size_t& restored) {
+    if (eviction != VALUE_ONLY) {
+        return false;
+    }
+    VBucketImageReader reader(path,
+                              {metadataImageMagic,
+                               getId(),
+                               getPersistenceSeqno(),
+                               failovers->getLatestUUID(),
+                               0});
+    const auto body = reader.getBody();
+    uint64_t count = 0;
+    if (reader.getStatus() == VBucketImageReader::Status::Missing) {
+        return false;
+    }
+    if (reader.getStatus() != VBucketImageReader::Status::Valid ||
+        body.size() < sizeof(count)) {
+        LOG(EXTENSION_LOG_NOTICE,
+            "EPVBucket::restoreMetadataImage: (vb %" PRIu16
+            ") Ignoring '%s', which doesn't match the vbucket",
+            id,
+            path.c_str());
+        return false;
+    }
+    const char* const end = body.data() + body.size() - sizeof(count);
+    std::memcpy(&count, end, sizeof(count));
+    count = ntohll(count);
+
+    size_t inserted = 0;
+    bool rv = true;
+    const char* ptr = body.data();
+    for (uint64_t i = 0; rv && i < count; ++i) {
+        MetadataImageRecord record;
+        if (size_t(end - ptr) < sizeof(record)) {
+            rv = false;
+            break;
+        }
+        std::memcpy(&record, ptr, sizeof(record));
+        ptr += sizeof(record);
+        const size_t keyLen = ntohs(record.keyLen);
+        if (size_t(end - ptr) < keyLen) {
+            rv = false;
+            break;
+        }
+        const DocKey key(reinterpret_cast<const uint8_t*>(ptr),
+                         keyLen,
+                         DocNamespace(record.docNamespace));
+        ptr += keyLen;
+
+        uint8_t datatype = record.datatype;
+        Item itm(key,
+                 ntohl(record.flags),
+                 ntohl(record.exptime),
+                 nullptr,
+                 0,
+                 &datatype,
+                 EXT_META_LEN,
+                 ntohll(record.cas),
+                 int64_t(ntohll(record.bySeqno)),
+                 getId(),
+                 ntohll(record.revSeqno));
+        switch (insertFromWarmup(itm, true /*eject*/, true /*keysOnly*/)) {
+        case MutationStatus::NotFound:
+            ++inserted;
+            break;
+        case MutationStatus::NoMem:
+            rv = false;
+            break;
+        default:
+            // Already in memory.
+            break;
+        }
+    }
+
+    if (!rv || ptr != end) {
+        return false;
+    }
+    restored = inserted;
+    return true;
+}
@@ -45,7 +45,8 @@ public:
               uint64_t maxCas = 0,
               int64_t hlcEpochSeqno = HlcCasSeqnoUninitialised,
               bool mightContainXattrs = false,
-              const std::string& collectionsManifest = "");
+              const std::string& collectionsManifest = "",
+              std::shared_ptr<HashTable::LockSet> htLocks = {});
 
     ~EPVBucket();
 
@@ -83,6 +84,14 @@ public:
 
     bool pageOut(const HashTable::HashBucketLock& lh, StoredValue*& v) override;
 
+    /**
+     * @return the policy to eject items with: the vbucket's, except that
+     *         while warmup may still load items, only values are ejected, so
+     *         that it finds newer items in memory rather than loading over
+     *         them.
+     */
+    item_eviction_policy_t getEjectionPolicy() const;
+
     bool areDeletedItemsAlwaysResident() const override;
 
     void addStats(bool details, ADD_STAT add_stat, const void* c) override;
@@ -151,6 +160,27 @@ public:
                                     bool eject,
                                     bool keyMetaDataOnly);
 
+    /**
+     * Write an image of the vbucket's keys and metadata to path, for
+     * restoreMetadataImage() to build the hash table from at the next
+     * warmup. Only possible under value eviction (where every key is in the
+     * hash table), once every item has been persisted.
+     *
+     * @return true if the image was written
+     */
+    bool persistMetadataImage(const std::string& path);
+
+    /**
+     * Insert the keys and metadata in the image written by
+     * persistMetadataImage() into the hash table (as non-resident items),
+     * if the image matches the vbucket's state as loaded from disk.
+     *
+     * @param [out] restored the number of items inserted, if successful
+     * @return true if the whole image was loaded; false if it doesn't match,
+     *         is corrupt or memory ran out (any items inserted remain)
+     */
+    bool restoreMetadataImage(const std::string& path, size_t& restored);
+
 protected:
     /**
      * queue a background fetch of the specified item.
@@ -196,6 +226,15 @@ private:
                           bool metadataOnly,
                           bool isReplication = false) override;
 
+    /**
+     * TinyLFU admission check for a value fetched from disk: when using the
+     * lfu eviction strategy and memory is under pressure, should the value
+     * be kept in preference to the items currently being evicted?
+     *
+     * @param key the key of the fetched value; its bucket lock must be held
+     */
+    bool admitToCache(const DocKey& key) const;
+
     /**
      * Helper function to update stats after completion of a background fetch
      * for either the value of metadata of a key.
@@ -197,7 +197,8 @@ VBucketPtr EphemeralBucket::makeVBucket(
                                            purgeSeqno,
                                            maxCas,
                                            mightContainXattrs,
-                                           collectionsManifest),
+                                           collectionsManifest,
+                                           sharedHtLocks),
                       VBucket::DeferredDeleter(engine));
 }
 
@@ -41,7 +41,8 @@ EphemeralVBucket::EphemeralVBucket(id_type i,
                                    uint64_t purgeSeqno,
                                    uint64_t maxCas,
                                    bool mightContainXattrs,
-                                   const std::string& collectionsManifest)
+                                   const std::string& collectionsManifest,
+                                   std::shared_ptr<HashTable::LockSet> htLocks)
     : VBucket(i,
               newState,
               st,
@@ -60,7 +61,8 @@ EphemeralVBucket::EphemeralVBucket(id_type i,
               maxCas,
               0, // Every item in ephemeral has a HLC cas
               mightContainXattrs,
-              collectionsManifest),
+              collectionsManifest,
+              std::move(htLocks)),
       seqList(std::make_unique<BasicLinkedList>(i, st)),
       backfillType(BackfillType::None) {
     /* Get the flow control policy */
@@ -91,7 +93,7 @@ bool EphemeralVBucket::pageOut(const HashTable::HashBucketLock& lh,
     if (getState() != vbucket_state_active) {
         return false;
     }
-    if (v->isDeleted() && !v->getValue()) {
+    if (v->isDeleted() && !v->hasValue()) {
         // If the item has already been deleted (and doesn't have a value
         // associated with it) then there's no further deletion possible,
         // until the deletion marker (tombstone) is later purged at the
@@ -46,7 +46,8 @@ public:
                      uint64_t purgeSeqno = 0,
                      uint64_t maxCas = 0,
                      bool mightContainXattrs = false,
-                     const std::string& collectionsManifest = "");
+                     const std::string& collectionsManifest = "",
+                     std::shared_ptr<HashTable::LockSet> htLocks = {});
 
     ENGINE_ERROR_CODE completeBGFetchForSingleItem(
             const DocKey& key,
@@ -0,0 +1,141 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "expiry_index.h"
+
+#include "stats.h"
+
+ExpiryIndex::ExpiryIndex(EPStats& stats)
+    : stats(stats), numKeys(0), memory(0) {
+    adjustMemory(sizeof(ExpiryIndex));
+}
+
+ExpiryIndex::~ExpiryIndex() {
+    clear();
+    adjustMemory(-static_cast<ssize_t>(memory));
+}
+
+void ExpiryIndex::update(const DocKey& key,
+                         time_t oldExptime,
+                         time_t newExptime) {
+    if (oldExptime == 0 && newExptime == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lh(mutex);
+    // If unchanged, still (re)insert the key - it may have been taken by
+    // takeExpired() since the caller last looked at the item.
+    if (oldExptime != 0 && oldExptime != newExptime) {
+        erase_UNLOCKED(key, oldExptime);
+    }
+    if (newExptime != 0) {
+        insert_UNLOCKED(key, newExptime);
+    }
+}
+
+std::vector<StoredDocKey> ExpiryIndex::takeExpired(time_t now, size_t limit) {
+    std::vector<StoredDocKey> expired;
+    std::lock_guard<std::mutex> lh(mutex);
+    auto slot = slots.begin();
+    // Items are expired if their expiry time is strictly before now.
+    while (slot != slots.end() && slot->first < now &&
+           expired.size() < limit) {
+        size_t freed = slotSize();
+        for (const auto& key : slot->second) {
+            freed += entrySize(key);
+        }
+        numKeys -= slot->second.size();
+        expired.insert(expired.end(),
+                       std::make_move_iterator(slot->second.begin()),
+                       std::make_move_iterator(slot->second.end()));
+        slot = slots.erase(slot);
+        adjustMemory(-static_cast<ssize_t>(freed));
+    }
+    return expired;
+}
+
+void ExpiryIndex::clear() {
+    std::lock_guard<std::mutex> lh(mutex);
+    slots.clear();
+    numKeys = 0;
+    adjustMemory(static_cast<ssize_t>(sizeof(ExpiryIndex)) -
+                 static_cast<ssize_t>(memory));
+}
+
+size_t ExpiryIndex::size() const {
+    std::lock_guard<std::mutex> lh(mutex);
+    return numKeys;
+}
+
+size_t ExpiryIndex::memorySize() const {
+    std::lock_guard<std::mutex> lh(mutex);
+    return memory;
+}
+
+size_t ExpiryIndex::entrySize(const DocKey& key) {
+    // Hash node (next pointer + cached hash) holding the key, its heap
+    // allocated data and the node's share of the bucket array.
+    return 3 * sizeof(void*) + sizeof(StoredDocKey) + key.size() + 1;
+}
+
+size_t ExpiryIndex::slotSize() {
+    // Tree node (colour + 3 pointers) holding the time and an empty set.
+    return 4 * sizeof(void*) + sizeof(time_t) + sizeof(KeySet);
+}
+
+void ExpiryIndex::insert_UNLOCKED(const DocKey& key, time_t exptime) {
+    auto slot = slots.find(exptime);
+    ssize_t added = 0;
+    if (slot == slots.end()) {
+        slot = slots.emplace(exptime, KeySet()).first;
+        added += slotSize();
+    }
+    if (slot->second.emplace(key).second) {
+        ++numKeys;
+        added += entrySize(key);
+    }
+    adjustMemory(added);
+}
+
+void ExpiryIndex::erase_UNLOCKED(const DocKey& key, time_t exptime) {
+    auto slot = slots.find(exptime);
+    if (slot == slots.end()) {
+        // Already taken by the pager.
+        return;
+    }
+    ssize_t freed = 0;
+    if (slot->second.erase(StoredDocKey(key)) != 0) {
+        --numKeys;
+        freed += entrySize(key);
+    }
+    if (slot->second.empty()) {
+        slots.erase(slot);
+        freed += slotSize();
+    }
+    adjustMemory(-freed);
+}
+
+void ExpiryIndex::adjustMemory(ssize_t delta) {
+    if (delta >= 0) {
+        memory += delta;
+        stats.memOverhead->fetch_add(delta);
+        stats.expiryIndexMemory.fetch_add(delta);
+    } else {
+        memory -= -delta;
+        stats.memOverhead->fetch_sub(-delta);
+        stats.expiryIndexMemory.fetch_sub(-delta);
+    }
+}
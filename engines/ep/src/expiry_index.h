@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "storeddockey.h"
+
+#include <limits>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+class EPStats;
+
+/**
+ * Index of the keys of a HashTable which have an expiry time, bucketed by
+ * that time (in seconds), so the expiry pager can find the expired items
+ * without visiting every item.
+ *
+ * The index is a hint: it may contain keys whose items have since been
+ * deleted or had their expiry time changed (e.g. if a caller did not know
+ * the previous expiry time), so callers must check the item is actually
+ * expired before acting on a key returned by takeExpired(). Every key whose
+ * item has an expiry time is present (with that time).
+ *
+ * The (estimated) memory used by the index is accounted in
+ * EPStats::memOverhead.
+ *
+ * Thread-safe; guarded by an internal mutex.
+ */
+class ExpiryIndex {
+public:
+    explicit ExpiryIndex(EPStats& stats);
+
+    ~ExpiryIndex();
+
+    /**
+     * Record that the item with the given key has changed expiry time.
+     *
+     * @param key the item's key
+     * @param oldExptime the previous expiry time, or 0 if it had none (or
+     *        was not indexed - e.g. deleted or a temp item)
+     * @param newExptime the new expiry time, or 0 if it should no longer be
+     *        indexed
+     */
+    void update(const DocKey& key, time_t oldExptime, time_t newExptime);
+
+    /**
+     * Remove and return all keys with an expiry time before `now` (i.e.
+     * which StoredValue::isExpired(now) would consider expired).
+     *
+     * @param limit stop once at least this many keys have been taken;
+     *        remaining expired keys are returned by subsequent calls.
+     */
+    std::vector<StoredDocKey> takeExpired(
+            time_t now, size_t limit = std::numeric_limits<size_t>::max());
+
+    /// Remove all keys from the index.
+    void clear();
+
+    /// Number of keys in the index.
+    size_t size() const;
+
+    /// Estimated number of bytes used by the index.
+    size_t memorySize() const;
+
+private:
+    using KeySet = std::unordered_set<StoredDocKey>;
+
+    /// Estimated bytes used by an entry for the given key.
+    static size_t entrySize(const DocKey& key);
+
+    /// Estimated bytes used by a (non-empty) slot.
+    static size_t slotSize();
+
+    void insert_UNLOCKED(const DocKey& key, time_t exptime);
+    void erase_UNLOCKED(const DocKey& key, time_t exptime);
+    void adjustMemory(ssize_t delta);
+
+    EPStats& stats;
+    mutable std::mutex mutex;
+    std::map<time_t, KeySet> slots;
+    size_t numKeys;
+    size_t memory;
+};
@@ -18,12 +18,44 @@
 #include "flusher.h"
 
 #include "common.h"
+#include "ep_engine.h"
+#include "objectregistry.h"
 #include "tasks.h"
 
+#include <platform/make_unique.h>
+
 #include <stdlib.h>
 
+#include <algorithm>
 #include <sstream>
 
+Flusher::Flusher(KVBucket* st, KVShard* k)
+    : store(st),
+      _state(State::Initializing),
+      taskId(0),
+      minSleepTime(0.1),
+      forceShutdownReceived(false),
+      doHighPriority(false),
+      numHighPriority(0),
+      pendingMutation(false),
+      shard(k),
+      pipelineDepth(st->getEPEngine()
+                            .getConfiguration()
+                            .getFlusherPipelineDepth()),
+      groupCommitSize(std::max(size_t(1),
+                               st->getEPEngine()
+                                       .getConfiguration()
+                                       .getFlusherGroupCommitSize())),
+      retryAfterCommit(false),
+      batchesInFlight(0),
+      batchesCommitted(0),
+      awaitedCommits(0),
+      committing(false),
+      commitTaskId(0),
+      drainStart(0),
+      drainItems(0),
+      drainRate(0) {
+}
 
 bool Flusher::stop(bool isForceShutdown) {
     forceShutdownReceived = isForceShutdown;
@@ -59,6 +91,9 @@ bool Flusher::pause(void) {
 bool Flusher::resume(void) {
     bool ret = transitionState(State::Running);
     wake();
+    if (commitTaskId > 0) {
+        ExecutorPool::get()->wake(commitTaskId);
+    }
     return ret;
 }
 
@@ -133,9 +168,154 @@ const char* Flusher::stateName() const {
 
 void Flusher::initialize() {
     LOG(EXTENSION_LOG_DEBUG, "Flusher::initialize: initializing");
+    if (pipelineDepth > 0 && commitTaskId == 0) {
+        ExTask task = std::make_shared<FlushCommitTask>(
+                ObjectRegistry::getCurrentEngine(), this, shard->getId());
+        commitTaskId = task->getId();
+        ExecutorPool::get()->schedule(task);
+    }
     transitionState(State::Running);
 }
 
+bool Flusher::commitStep(GlobalTask* task) {
+    std::vector<std::unique_ptr<VBucketFlushBatch>> batches;
+    bool stopped = false;
+    {
+        // Sleep until woken by the flusher task queueing a batch (or
+        // resuming); snooze before checking for work so a wake() racing
+        // with the check isn't lost.
+        task->snooze(INT_MAX);
+        std::lock_guard<std::mutex> lh(pipelineMutex);
+        const State state = _state.load();
+        if (state == State::Stopped) {
+            commitTaskId = 0;
+            stopped = true;
+        } else if (state == State::Pausing || state == State::Paused ||
+                   pipeline.empty()) {
+            return true;
+        } else {
+            // Commit everything queued (up to the group size) together.
+            while (!pipeline.empty() && batches.size() < groupCommitSize) {
+                batches.push_back(std::move(pipeline.front()));
+                pipeline.pop_front();
+            }
+            committing = true;
+        }
+    }
+    if (stopped) {
+        // Force shutdown; release what's still queued.
+        abandonBatches(false);
+        return false;
+    }
+
+    const size_t count = batches.size();
+    commitBatches(batches);
+
+    {
+        std::lock_guard<std::mutex> lh(pipelineMutex);
+        batchesInFlight -= count;
+        batchesCommitted += count;
+        committing = false;
+        if (!pipeline.empty()) {
+            task->wakeUp();
+        }
+    }
+    // The flusher task may be waiting for room in the pipeline, for a
+    // vbucket's batch to land, or to complete pausing / stopping.
+    wake();
+    return true;
+}
+
+void Flusher::commitBatches(
+        std::vector<std::unique_ptr<VBucketFlushBatch>>& batches) {
+    size_t items = 0;
+    for (const auto& batch : batches) {
+        items += batch->items.size();
+    }
+    recordFlushed(items);
+    if (store->commitFlushBatches(batches)) {
+        // Some items were rejected; have the flusher visit the vbuckets
+        // again.
+        notifyFlushEvent();
+    }
+    batches.clear();
+}
+
+bool Flusher::isPipelineFull() {
+    std::lock_guard<std::mutex> lh(pipelineMutex);
+    if (pipelineDepth > 0 && batchesInFlight > pipelineDepth) {
+        awaitedCommits = batchesCommitted;
+        return true;
+    }
+    return false;
+}
+
+bool Flusher::hasBatchesInFlight() {
+    std::lock_guard<std::mutex> lh(pipelineMutex);
+    awaitedCommits = batchesCommitted;
+    return batchesInFlight > 0;
+}
+
+void Flusher::snoozeUntilCommitted(GlobalTask* task) {
+    task->snooze(INT_MAX);
+    // The commit task wakes us after each commit; in case one completed
+    // before we snoozed, check whether we are still waiting.
+    std::lock_guard<std::mutex> lh(pipelineMutex);
+    if (batchesInFlight == 0 || batchesCommitted != awaitedCommits) {
+        task->wakeUp();
+    }
+}
+
+void Flusher::cancelCommitTask() {
+    const size_t id = commitTaskId.exchange(0);
+    if (id > 0) {
+        ExecutorPool::get()->cancel(id);
+    }
+}
+
+void Flusher::abandonBatches(bool includeGroup) {
+    std::vector<std::unique_ptr<VBucketFlushBatch>> batches;
+    if (includeGroup) {
+        batches.swap(group);
+    }
+    {
+        std::lock_guard<std::mutex> lh(pipelineMutex);
+        batchesInFlight -= pipeline.size();
+        for (auto& batch : pipeline) {
+            batches.push_back(std::move(batch));
+        }
+        pipeline.clear();
+    }
+    for (auto& batch : batches) {
+        store->abandonFlushBatch(*batch);
+    }
+}
+
+void Flusher::recordFlushed(int items) {
+    if (items > 0) {
+        drainItems.fetch_add(items);
+    }
+}
+
+void Flusher::beginDrainPeriod() {
+    if (drainStart == 0) {
+        drainStart = gethrtime();
+        drainItems.store(0);
+    }
+}
+
+void Flusher::endDrainPeriod() {
+    if (drainStart == 0) {
+        return;
+    }
+    const hrtime_t elapsed = gethrtime() - drainStart;
+    const uint64_t items = drainItems.load();
+    if (items > 0 && elapsed > 0) {
+        drainRate = (items * 1000000000ull) / elapsed;
+    }
+    drainStart = 0;
+}
+
 void Flusher::schedule_UNLOCKED() {
     ExecutorPool* iom = ExecutorPool::get();
     ExTask task = std::make_shared<FlusherTask>(
@@ -179,32 +359,83 @@ bool Flusher::step(GlobalTask *task) {
 
     case State::Paused:
     case State::Pausing:
+        // Indefinitely put task to sleep..
+        task->snooze(INT_MAX);
         if (currentState == State::Pausing) {
+            if (!group.empty()) {
+                // Commit the batches grouped so far; left prepared while
+                // paused, their vbuckets couldn't be flushed by anyone.
+                commitBatches(group);
+            }
+            {
+                // The commit task won't start another commit now, but let
+                // the one in progress (if any) land; it wakes us when done.
+                std::lock_guard<std::mutex> lh(pipelineMutex);
+                if (committing) {
+                    return true;
+                }
+            }
             transitionState(State::Paused);
         }
-        // Indefinitely put task to sleep..
-        task->snooze(INT_MAX);
         return true;
 
     case State::Running:
+        if (isPipelineFull()) {
+            snoozeUntilCommitted(task);
+            return true;
+        }
+        if (!canSnooze()) {
+            beginDrainPeriod();
+        }
         flushVB();
         if (_state == State::Running) {
+            if (retryAfterCommit) {
+                retryAfterCommit = false;
+                snoozeUntilCommitted(task);
+                return true;
+            }
             double tosleep = computeMinSleepTime();
             if (tosleep > 0) {
+                if (!hasBatchesInFlight()) {
+                    endDrainPeriod();
+                }
                 task->snooze(tosleep);
             }
         }
         return true;
 
     case State::Stopping:
-        LOG(EXTENSION_LOG_DEBUG,
-            "Flusher::step: stopping flusher (write of all dirty items)");
-        completeFlush();
+        // Write all dirty items, a step at a time, before stopping.
+        if (!canSnooze()) {
+            if (isPipelineFull()) {
+                snoozeUntilCommitted(task);
+                return true;
+            }
+            flushVB();
+            if (retryAfterCommit) {
+                retryAfterCommit = false;
+                snoozeUntilCommitted(task);
+            }
+            return true;
+        }
+        if (hasBatchesInFlight()) {
+            snoozeUntilCommitted(task);
+            return true;
+        }
+        if (!group.empty()) {
+            commitBatches(group);
+            return true;
+        }
+        cancelCommitTask();
+        endDrainPeriod();
         LOG(EXTENSION_LOG_DEBUG, "Flusher::step: stopped");
         transitionState(State::Stopped);
         return false;
 
     case State::Stopped:
+        // Force shutdown; release the batches not committed (the commit
+        // task may already have finished, or may never run again).
+        abandonBatches(true);
         taskId = 0;
         return false;
     }
@@ -214,12 +445,6 @@ bool Flusher::step(GlobalTask *task) {
                            std::to_string(int(currentState)));
 }
 
-void Flusher::completeFlush() {
-    while(!canSnooze()) {
-        flushVB();
-    }
-}
-
 double Flusher::computeMinSleepTime() {
     if (!canSnooze() || shard->highPriorityCount.load() > 0) {
         minSleepTime = DEFAULT_MIN_SLEEP_TIME;
@@ -231,6 +456,10 @@ double Flusher::computeMinSleepTime() {
 
 void Flusher::flushVB(void) {
     if (store->isDeleteAllScheduled() && shard->getId() != EP_PRIMARY_SHARD) {
+        // The deleteAll waits for prepared batches to be committed.
+        if (!group.empty()) {
+            commitBatches(group);
+        }
         // another shard is doing disk flush
         bool inverse = false;
         pendingMutation.compare_exchange_strong(inverse, true);
@@ -269,7 +498,7 @@ void Flusher::flushVB(void) {
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
         hpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
+        if (flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
             hpVbs.push(vbid);
         }
     } else {
@@ -278,8 +507,53 @@ void Flusher::flushVB(void) {
         }
         uint16_t vbid = lpVbs.front();
         lpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
+        if (flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
             lpVbs.push(vbid);
         }
     }
 }
+
+int Flusher::flushVBucket(uint16_t vbid) {
+    if (pipelineDepth == 0) {
+        if (groupCommitSize == 1) {
+            const int ret = store->flushVBucket(vbid);
+            recordFlushed(ret);
+            return ret;
+        }
+
+        auto batch = std::make_unique<VBucketFlushBatch>();
+        const int ret = store->prepareFlushBatch(vbid, *batch);
+        if (batch->vb) {
+            group.push_back(std::move(batch));
+        }
+        // Commit the group once it's full or there is nothing more to add
+        // to it now (a vbucket being retried may be waiting for its batch
+        // in the group to be committed).
+        if (!group.empty() &&
+            (group.size() >= groupCommitSize || ret == RETRY_FLUSH_VBUCKET ||
+             (hpVbs.empty() && lpVbs.empty()))) {
+            commitBatches(group);
+        }
+        return ret;
+    }
+
+    // step() only gets here when the pipeline has room for another batch.
+    auto batch = std::make_unique<VBucketFlushBatch>();
+    const int ret = store->prepareFlushBatch(vbid, *batch);
+    if (ret == RETRY_FLUSH_VBUCKET) {
+        // The vbucket may still have a batch in flight; rather than spin
+        // retrying it give the commit task a chance to complete one.
+        retryAfterCommit = hasBatchesInFlight();
+        return ret;
+    }
+
+    if (batch->vb) {
+        {
+            std::lock_guard<std::mutex> lh(pipelineMutex);
+            pipeline.push_back(std::move(batch));
+            ++batchesInFlight;
+        }
+        ExecutorPool::get()->wake(commitTaskId);
+    }
+    return ret;
+}
@@ -20,10 +20,15 @@
 
 #include "config.h"
 
+#include <platform/platform.h>
+
+#include <deque>
 #include <list>
 #include <map>
+#include <memory>
 #include <queue>
 #include <string>
+#include <vector>
 
 #include "kv_bucket.h"
 #include "executorthread.h"
@@ -39,20 +44,30 @@ class KVShard;
 
 /**
  * Manage persistence of data for an EPBucket.
+ *
+ * By default each vbucket is flushed in turn - its items are gathered and
+ * then written and committed - by the flusher task. When
+ * flusher_pipeline_depth is non-zero the commit is instead handed to a
+ * FlushCommitTask (also run by the writer threads), so the flusher task can
+ * gather the next vbucket(s) while the previous one is being committed; up
+ * to that many batches may be waiting behind the one being committed.
+ * Neither task blocks waiting for the other: each snoozes and is woken by
+ * the other when there is work for it. Pausing the flusher also pauses the
+ * commit task once the batch it is committing (if any) has landed.
+ *
+ * When flusher_group_commit_size is greater than one, up to that many
+ * vbuckets' batches are committed in a single KVStore transaction so the
+ * KVStore can make them durable together (group commit). Without pipelining
+ * the flusher task groups the vbuckets it visits in a row; with pipelining
+ * the commit task groups the batches queued for it.
+ *
+ * The drain rate - items persisted per second over the last period during
+ * which the flusher had work, from first finding items to the queue being
+ * empty - is recorded for the ep_flusher_drain_rate stat.
  */
 class Flusher {
 public:
-    Flusher(KVBucket* st, KVShard* k)
-        : store(st),
-          _state(State::Initializing),
-          taskId(0),
-          minSleepTime(0.1),
-          forceShutdownReceived(false),
-          doHighPriority(false),
-          numHighPriority(0),
-          pendingMutation(false),
-          shard(k) {
-    }
+    Flusher(KVBucket* st, KVShard* k);
 
     ~Flusher() {
         if (_state != State::Stopped) {
@@ -61,6 +76,7 @@ public:
                 stateName(_state));
             stop(true);
         }
+        cancelCommitTask();
     }
 
     bool stop(bool isForceShutdown = false);
@@ -71,6 +87,9 @@ public:
     void wake(void);
     bool step(GlobalTask *task);
 
+    /// Run one step of the commit task (used when pipelining).
+    bool commitStep(GlobalTask* task);
+
     const char * stateName() const;
 
     void notifyFlushEvent(void) {
@@ -84,6 +103,14 @@ public:
     }
     void setTaskId(size_t newId) { taskId = newId; }
 
+    /**
+     * Returns the items persisted per second over the last period the
+     * flusher was busy (0 if it has not yet drained anything).
+     */
+    uint64_t getDrainRate() const {
+        return drainRate;
+    }
+
 private:
     enum class State {
         Initializing,
@@ -97,13 +124,60 @@ private:
     bool transitionState(State to);
     bool validTransition(State to) const;
     void flushVB();
-    void completeFlush();
+    int flushVBucket(uint16_t vbid);
     void initialize();
     void schedule_UNLOCKED();
     double computeMinSleepTime();
 
     const char* stateName(State st) const;
 
+    /// Commit the given prepared batches (as a group), then clear them.
+    void commitBatches(
+            std::vector<std::unique_ptr<VBucketFlushBatch>>& batches);
+
+    /**
+     * True if the pipeline has no room for another batch. If so, the
+     * current number of commits is noted for snoozeUntilCommitted().
+     */
+    bool isPipelineFull();
+
+    /**
+     * True if any batches are queued for, or being committed by, the
+     * commit task. The current number of commits is noted for
+     * snoozeUntilCommitted().
+     */
+    bool hasBatchesInFlight();
+
+    /**
+     * Snooze the flusher task until the commit task completes another batch
+     * since the last isPipelineFull() / hasBatchesInFlight() (the commit
+     * task wakes the flusher task after each commit). Used instead of
+     * blocking the writer thread.
+     */
+    void snoozeUntilCommitted(GlobalTask* task);
+
+    /// Stop the commit task (if scheduled); nothing may be in flight.
+    void cancelCommitTask();
+
+    /**
+     * On a forced stop: give up on the batches queued for the commit task
+     * (and, from the flusher task, on those grouped), returning their items
+     * to their vbuckets unwritten (see KVBucket::abandonFlushBatch()).
+     *
+     * @param includeGroup whether to abandon group too; only the flusher
+     *        task may
+     */
+    void abandonBatches(bool includeGroup);
+
+    /// Record items persisted towards the current drain period.
+    void recordFlushed(int items);
+
+    /// Note the flusher is busy, starting a drain period if none is open.
+    void beginDrainPeriod();
+
+    /// Close the current drain period (if any), updating the drain rate.
+    void endDrainPeriod();
+
     bool canSnooze(void) {
         return lpVbs.empty() && hpVbs.empty() && !pendingMutation.load();
     }
@@ -126,6 +200,33 @@ private:
 
     KVShard *shard;
 
+    const size_t pipelineDepth;
+    const size_t groupCommitSize;
+    // Batches prepared but not yet committed when group committing without
+    // pipelining.
+    std::vector<std::unique_ptr<VBucketFlushBatch>> group;
+    // Set by flushVBucket() when a vbucket must wait for its batch in
+    // flight to be committed before it can be flushed again.
+    bool retryAfterCommit;
+    // Guards the members below.
+    std::mutex pipelineMutex;
+    // Batches prepared by the flusher task, in the order to commit them.
+    std::deque<std::unique_ptr<VBucketFlushBatch>> pipeline;
+    // Batches queued or being committed.
+    size_t batchesInFlight;
+    size_t batchesCommitted;
+    // Value of batchesCommitted the flusher task is waiting to change.
+    size_t awaitedCommits;
+    // The commit task is committing batches (which pausing waits for).
+    bool committing;
+    // Id of the FlushCommitTask, or 0 if not scheduled.
+    std::atomic<size_t> commitTaskId;
+
+    // Start of the current drain period (0 if none).
+    hrtime_t drainStart;
+    std::atomic<uint64_t> drainItems;
+    std::atomic<uint64_t> drainRate;
+
     DISALLOW_COPY_AND_ASSIGN(Flusher);
 };
 
@@ -0,0 +1,156 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "frequency_sketch.h"
+
+#include <algorithm>
+
+// Per-row multipliers used to derive four independent indices from a key's
+// hash.
+static const uint64_t rowSeeds[] = {0xc3a5c85c97cb3127ull,
+                                    0xb492b66fbe98f273ull,
+                                    0x9ae16a3b2f90404full,
+                                    0xcbf29ce484222325ull};
+
+static const int numRows = 4;
+
+// Mask of the low three bits of every counter; used when halving.
+static const uint64_t halveMask = 0x7777777777777777ull;
+
+static size_t nextPowerOfTwo(size_t n) {
+    size_t result = 1;
+    while (result < n) {
+        result <<= 1;
+    }
+    return result;
+}
+
+// Spreads the (possibly poorly distributed) key hash over all 32 bits.
+static uint32_t spread(uint32_t hash) {
+    hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
+    hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
+    return (hash >> 16) ^ hash;
+}
+
+FrequencySketch::FrequencySketch(size_t expectedItems)
+    : width(nextPowerOfTwo(std::max(expectedItems, size_t(16)))),
+      mask(width - 1),
+      sampleSize(10 * width),
+      table(new std::atomic<uint64_t>[width]),
+      additions(0),
+      numAgings(0) {
+    for (size_t i = 0; i < width; i++) {
+        table[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+// Returns the word holding the larger of each pair of counters in a and b.
+static uint64_t maxCounters(uint64_t a, uint64_t b) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 4) {
+        result |= std::max((a >> shift) & 0xf, (b >> shift) & 0xf) << shift;
+    }
+    return result;
+}
+
+FrequencySketch::FrequencySketch(size_t expectedItems,
+                                 const FrequencySketch& from)
+    : FrequencySketch(expectedItems) {
+    for (size_t i = 0; i < from.width; i++) {
+        const uint64_t word = from.table[i].load(std::memory_order_relaxed);
+        if (width >= from.width) {
+            // Growing - each old word is replicated to every new index
+            // which maps back onto it.
+            for (size_t j = i; j < width; j += from.width) {
+                table[j].store(word, std::memory_order_relaxed);
+            }
+        } else {
+            auto& to = table[i & mask];
+            to.store(maxCounters(to.load(std::memory_order_relaxed), word),
+                     std::memory_order_relaxed);
+        }
+    }
+    // Keep the same proportion of the (new) sample towards the next aging.
+    const size_t fromAdditions = from.additions.load();
+    additions.store(std::min(sampleSize - 1,
+                             fromAdditions * width / from.width),
+                    std::memory_order_relaxed);
+    numAgings.store(from.numAgings.load());
+}
+
+void FrequencySketch::increment(uint32_t hash) {
+    hash = spread(hash);
+    // Which group of four counters (one per row) within each word this key
+    // uses.
+    const int start = (hash & 3) << 2;
+
+    bool added = false;
+    for (int row = 0; row < numRows; row++) {
+        added |= tryIncrement(indexOf(hash, row), start + row);
+    }
+
+    if (added && (additions.fetch_add(1, std::memory_order_relaxed) + 1) ==
+                         sampleSize) {
+        age();
+    }
+}
+
+uint8_t FrequencySketch::estimate(uint32_t hash) const {
+    hash = spread(hash);
+    const int start = (hash & 3) << 2;
+
+    uint8_t frequency = MaxFrequency;
+    for (int row = 0; row < numRows; row++) {
+        const uint64_t word =
+                table[indexOf(hash, row)].load(std::memory_order_relaxed);
+        const uint8_t count = (word >> ((start + row) << 2)) & 0xf;
+        frequency = std::min(frequency, count);
+    }
+    return frequency;
+}
+
+void FrequencySketch::age() {
+    for (size_t i = 0; i < width; i++) {
+        uint64_t word = table[i].load(std::memory_order_relaxed);
+        while (!table[i].compare_exchange_weak(word,
+                                               (word >> 1) & halveMask,
+                                               std::memory_order_relaxed)) {
+        }
+    }
+    // Halving the counters leaves roughly half the samples' worth of
+    // history.
+    additions.store(sampleSize / 2, std::memory_order_relaxed);
+    ++numAgings;
+}
+
+size_t FrequencySketch::indexOf(uint32_t hash, int row) const {
+    uint64_t h = (hash + rowSeeds[row]) * rowSeeds[row];
+    h += h >> 32;
+    return h & mask;
+}
+
+bool FrequencySketch::tryIncrement(size_t index, int counter) {
+    const int shift = counter << 2;
+    uint64_t word = table[index].load(std::memory_order_relaxed);
+    do {
+        if (((word >> shift) & 0xf) == MaxFrequency) {
+            return false;
+        }
+    } while (!table[index].compare_exchange_weak(
+            word, word + (uint64_t(1) << shift), std::memory_order_relaxed));
+    return true;
+}
@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * An approximate, aging access frequency counter for a set of keys (a
+ * count-min sketch, as used by TinyLFU).
+ *
+ * Each key maps to one 4-bit counter in each of four rows; increment()
+ * bumps all of them (saturating at MaxFrequency) and estimate() returns the
+ * smallest, so collisions can only over-estimate a key's frequency. To
+ * forget old history, every counter is halved once the number of increments
+ * reaches ten times the sketch width - so estimates reflect recent
+ * popularity.
+ *
+ * Counters are packed sixteen to a 64-bit word, with all four counters of a
+ * key in distinct words. Memory use is 8 bytes per expected item.
+ *
+ * increment() and estimate() may be called concurrently; updates are
+ * lock-free but (as with any sketch) approximate - an increment which races
+ * with aging may be lost.
+ */
+class FrequencySketch {
+public:
+    /// Largest value a counter can hold.
+    static const uint8_t MaxFrequency = 15;
+
+    /**
+     * @param expectedItems the number of distinct keys the sketch should
+     *        track with reasonable accuracy.
+     */
+    explicit FrequencySketch(size_t expectedItems);
+
+    /**
+     * Creates a sketch sized for expectedItems, carrying over the counters
+     * of an existing sketch (e.g. when the owning HashTable is resized), so
+     * the access history is not lost.
+     *
+     * A key's counters live in the word at (index & mask) of each row, so
+     * when growing every new word is a copy of the old word it maps from,
+     * and estimates are unchanged. When shrinking, the old words folding
+     * onto a new word are merged taking the larger of each counter, which
+     * (as with any collision) may only over-estimate.
+     */
+    FrequencySketch(size_t expectedItems, const FrequencySketch& from);
+
+    /// Records an access to the key with the given hash.
+    void increment(uint32_t hash);
+
+    /// Returns the estimated (recent) access frequency of the given hash.
+    uint8_t estimate(uint32_t hash) const;
+
+    /// Halves every counter.
+    void age();
+
+    /// Returns the number of 64-bit words in the sketch.
+    size_t getWidth() const {
+        return width;
+    }
+
+    /// Returns the number of times the counters have been aged.
+    size_t getNumAgings() const {
+        return numAgings;
+    }
+
+    /// Returns the number of bytes used by the sketch.
+    size_t memorySize() const {
+        return sizeof(FrequencySketch) + width * sizeof(std::atomic<uint64_t>);
+    }
+
+private:
+    /**
+     * Returns the index of the word holding the key's counter for the given
+     * row.
+     */
+    size_t indexOf(uint32_t hash, int row) const;
+
+    /**
+     * Increments the given counter of the word, unless already saturated.
+     * @return true if the counter was incremented.
+     */
+    bool tryIncrement(size_t index, int counter);
+
+    const size_t width;
+    // width - 1; width is a power of two.
+    const size_t mask;
+    // Number of increments before the counters are aged.
+    const size_t sampleSize;
+    std::unique_ptr<std::atomic<uint64_t>[]> table;
+    std::atomic<size_t> additions;
+    std::atomic<size_t> numAgings;
+};
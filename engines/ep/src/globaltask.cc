@@ -30,6 +30,10 @@ static_assert(TaskPriority::FlusherTask < TaskPriority::ItemPager,
 static_assert(TaskPriority::ItemPager < TaskPriority::BackfillManagerTask,
               "ItemPager not less than BackfillManagerTask");
 
+static_assert(TaskPriority::VKeyStatBGFetchTask <
+                      TaskPriority::WarmupBackgroundLoadingData,
+              "VKeyStatBGFetchTask not less than WarmupBackgroundLoadingData");
+
 std::atomic<size_t> GlobalTask::task_id_counter(1);
 
 GlobalTask::GlobalTask(Taskable& t,
@@ -76,6 +80,11 @@ void GlobalTask::snooze(const double secs) {
     }
 }
 
+void GlobalTask::snooze(std::chrono::nanoseconds duration) {
+    setState(TASK_SNOOZED, TASK_RUNNING);
+    updateWaketime(ProcessClock::now() + duration);
+}
+
 void GlobalTask::wakeUp() {
     updateWaketime(ProcessClock::now());
 }
@@ -121,6 +121,12 @@ public:
      */
     virtual void snooze(const double secs);
 
+    /**
+     * Puts the task to sleep for a given duration, which (unlike the above)
+     * isn't rounded to whole seconds.
+     */
+    void snooze(std::chrono::nanoseconds duration);
+
     /// Wake up a task, setting it to run as soon as possible.
     void wakeUp();
 
@@ -21,7 +21,10 @@
 #include "stats.h"
 #include "stored_value_factories.h"
 
+#include <platform/make_unique.h>
+
 #include <cstring>
+#include <thread>
 
 static const ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3079, 6143, 12289, 24571, 49157,
@@ -36,10 +39,27 @@ std::ostream& operator<<(std::ostream& os, const HashTable::Position& pos) {
     return os;
 }
 
+HashTable::LockSet::LockSet(size_t count, bool mutexFreeReads)
+    : count(count), mutexes(new std::mutex[count]) {
+    if (count == 0) {
+        throw std::invalid_argument(
+                "HashTable::LockSet: count must be non-zero");
+    }
+    if (mutexFreeReads) {
+        stripes.reset(new StripeState[count]);
+    }
+}
+
 HashTable::HashTable(EPStats& st,
                      std::unique_ptr<AbstractStoredValueFactory> svFactory,
                      size_t initialSize,
-                     size_t locks)
+                     size_t locks,
+                     size_t resizeStepSize,
+                     bool useFingerprints,
+                     bool mutexFreeReads,
+                     std::shared_ptr<LockSet> sharedLocks,
+                     bool trackFrequency,
+                     bool indexExpiry)
     : maxDeletedRevSeqno(0),
       numTotalItems(0),
       numNonResidentItems(0),
@@ -51,18 +71,57 @@ HashTable::HashTable(EPStats& st,
       metaDataMemory(0),
       initialSize(initialSize),
       size(initialSize),
-      n_locks(locks),
+      n_locks(sharedLocks ? sharedLocks->size() : locks),
+      oldSize(0),
+      resizeCursor(0),
+      resizeStepSize(resizeStepSize),
+      maxResizeLockHoldTime(0),
+      useFingerprints(useFingerprints),
+      locksShared(sharedLocks != nullptr),
+      lockSet(sharedLocks
+                      ? std::move(sharedLocks)
+                      : std::make_shared<LockSet>(locks, mutexFreeReads)),
+      stripes(lockSet->stripes.get()),
+      mutexes(lockSet->mutexes.get()),
+      frequencySketch(trackFrequency
+                              ? std::make_unique<FrequencySketch>(initialSize)
+                              : nullptr),
+      victimFrequency(0),
+      expiryIndex(indexExpiry ? std::make_unique<ExpiryIndex>(st) : nullptr),
       stats(st),
       valFact(std::move(svFactory)),
       visitors(0),
+      pausedVisits(std::make_shared<std::atomic<size_t>>(0)),
       numItems(0),
       numResizes(0),
       numTempItems(0) {
-    values.resize(size);
-    mutexes = new std::mutex[n_locks];
+    values = table_type(size, useFingerprints);
     activeState = true;
 }
 
+/**
+ * Marks every lock stripe as being written for the lifetime of the object.
+ * Must be created after (and destroyed before) a MultiLockHolder over all
+ * of the ht_locks.
+ */
+class HashTable::AllStripesWriteGuard {
+public:
+    explicit AllStripesWriteGuard(HashTable& ht) : ht(ht) {
+        for (size_t i = 0; ht.stripes && i < ht.n_locks; i++) {
+            ht.stripes[i].beginWrite();
+        }
+    }
+
+    ~AllStripesWriteGuard() {
+        for (size_t i = 0; ht.stripes && i < ht.n_locks; i++) {
+            ht.stripes[i].endWrite();
+        }
+    }
+
+private:
+    HashTable& ht;
+};
+
 HashTable::~HashTable() {
     // Use unlocked clear for the destructor, avoids lock inversions on VBucket
     // delete
@@ -75,7 +134,6 @@ HashTable::~HashTable() {
         usleep(100);
 #endif
     }
-    delete []mutexes;
 }
 
 void HashTable::clear(bool deactivate) {
@@ -87,6 +145,7 @@ void HashTable::clear(bool deactivate) {
         }
     }
     MultiLockHolder mlh(mutexes, n_locks);
+    AllStripesWriteGuard writeGuard(*this);
     clear_UNLOCKED(deactivate);
 }
 
@@ -94,20 +153,36 @@ void HashTable::clear_UNLOCKED(bool deactivate) {
     if (deactivate) {
         setActiveState(false);
     }
-    size_t clearedMemSize = 0;
-    size_t clearedValSize = 0;
-    for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
+    size_t clearedMetaSize = 0;
+    for (int i = 0; i < (int)getNumBucketsTotal(); i++) {
+        auto bucket = getBucket(i);
+        while (bucket.head) {
             // Take ownership of the StoredValue from the vector, update
             // statistics and release it.
-            auto v = std::move(values[i]);
-            clearedMemSize += v->size();
-            clearedValSize += v->valuelen();
-            values[i] = std::move(v->getNext());
+            auto v = std::move(bucket.head);
+            clearedMetaSize += v->metaDataSize();
+            bucket.head = std::move(v->getNext());
+        }
+        if (bucket.fingerprints) {
+            *bucket.fingerprints = 0;
         }
     }
 
-    stats.currentSize.fetch_sub(clearedMemSize - clearedValSize);
+    if (oldSize != 0) {
+        // Abandon any in-progress incremental resize; the old bucket array
+        // is now empty.
+        stats.memOverhead->fetch_sub(memorySize());
+        oldValues = table_type();
+        oldSize.store(0);
+        resizeCursor.store(0);
+        stats.memOverhead->fetch_add(memorySize());
+    }
+
+    stats.currentSize.fetch_sub(clearedMetaSize);
+
+    if (expiryIndex) {
+        expiryIndex->clear();
+    }
 
     datatypeCounts.fill(0);
     numTotalItems.store(0);
@@ -132,6 +207,12 @@ static bool isCurrently(size_t size, ssize_t a, ssize_t b) {
 }
 
 void HashTable::resize() {
+    if (isResizing()) {
+        // Finish migrating the previous resize before considering another.
+        resize(size);
+        return;
+    }
+
     size_t ni = getNumInMemoryItems();
     int i(0);
     size_t new_size(0);
@@ -174,48 +255,162 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
+    // Complete any in-progress migration before starting another.
+    if (!completeResizeMigration()) {
+        return;
+    }
+
     // Don't resize to the same size, either.
     if (newSize == size) {
         return;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
-    if (visitors.load() > 0) {
-        // Do not allow a resize while any visitors are actually
-        // processing.  The next attempt will have to pick it up.  New
-        // visitors cannot start doing meaningful work (we own all
-        // locks at this point).
+    // When resizing incrementally, both bucket arrays share a single bucket
+    // number space which must also fit in an int.
+    if (resizeStepSize != 0 &&
+        (newSize + size) > static_cast<size_t>(std::numeric_limits<int>::max())) {
         return;
     }
 
-    // Get a place for the new items.
-    table_type newValues(newSize);
+    {
+        MultiLockHolder mlh(mutexes, n_locks);
+        AllStripesWriteGuard writeGuard(*this);
+        const auto lockedAt = ProcessClock::now();
+        if (visitors.load() > 0) {
+            // Do not allow a resize while any visitors are actually
+            // processing.  The next attempt will have to pick it up.  New
+            // visitors cannot start doing meaningful work (we own all
+            // locks at this point).
+            return;
+        }
 
-    stats.memOverhead->fetch_sub(memorySize());
-    ++numResizes;
+        // Get a place for the new items.
+        table_type newValues(newSize, useFingerprints);
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
-    size.store(newSize);
+        stats.memOverhead->fetch_sub(memorySize());
+        ++numResizes;
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            // unlink the front element from the hash chain at values[i].
-            auto v = std::move(values[i]);
-            values[i] = std::move(v->getNext());
+        if (frequencySketch) {
+            // The sketch's width must track the number of items; carry the
+            // existing counters over so resizing doesn't forget which items
+            // are hot.
+            frequencySketch = std::make_unique<FrequencySketch>(
+                    newSize, *frequencySketch);
+        }
 
-            // And re-link it into the correct place in newValues.
-            int newBucket = getBucketForHash(v->getKey().hash());
-            v->setNext(std::move(newValues[newBucket]));
-            newValues[newBucket] = std::move(v);
+        // Set the new size so all the hashy stuff works.
+        size_t prevSize = size;
+        size.store(newSize);
+
+        if (resizeStepSize != 0) {
+            // Incremental - keep the previous array around as the old bucket
+            // array; its contents are migrated by migrateResizeStep().
+            oldValues = std::move(values);
+            values = std::move(newValues);
+            resizeCursor.store(0);
+            oldSize.store(prevSize);
+            stats.memOverhead->fetch_add(memorySize());
+            recordResizeLockHoldTime(lockedAt);
+        } else {
+            // Move existing records into the new space.
+            for (size_t i = 0; i < prevSize; i++) {
+                rehashBucket(values[i], newValues);
+            }
+
+            // Finally assign the new table to values.
+            values = std::move(newValues);
+
+            stats.memOverhead->fetch_add(memorySize());
+            recordResizeLockHoldTime(lockedAt);
+            return;
         }
     }
 
-    // Finally assign the new table to values.
-    values = std::move(newValues);
+    completeResizeMigration();
+}
+
+bool HashTable::completeResizeMigration() {
+    // Migrate one step at a time, yielding the locks between each step so
+    // front-end operations can make progress.
+    while (isResizing()) {
+        if (!migrateResizeStep()) {
+            if (migrationBlockedByVisitors()) {
+                // Blocked by a visitor; the next resize() will resume.
+                return false;
+            }
+            std::this_thread::yield();
+        }
+    }
+    return true;
+}
+
+bool HashTable::migrateResizeStep() {
+    MultiLockHolder mlh(mutexes, n_locks);
+    AllStripesWriteGuard writeGuard(*this);
+    const auto lockedAt = ProcessClock::now();
+    if (!isResizing()) {
+        return true;
+    }
+    if (migrationBlockedByVisitors()) {
+        // Visitors iterate over both bucket arrays and rely on items not
+        // moving between them during the visit (including while a
+        // pauseResumeVisit() is paused).
+        return false;
+    }
+
+    const size_t end = std::min(resizeCursor + resizeStepSize, oldSize.load());
+    for (size_t i = resizeCursor; i < end; i++) {
+        rehashBucket(oldValues[i], values);
+    }
+    resizeCursor.store(end);
+
+    const bool complete = (end == oldSize);
+    if (complete) {
+        stats.memOverhead->fetch_sub(memorySize());
+        oldValues = table_type();
+        oldSize.store(0);
+        resizeCursor.store(0);
+        stats.memOverhead->fetch_add(memorySize());
+    }
+
+    recordResizeLockHoldTime(lockedAt);
+    return complete;
+}
+
+void HashTable::rehashBucket(Bucket from, table_type& to) {
+    while (from.head) {
+        // unlink the front element from the hash chain...
+        auto v = std::move(from.head);
+        from.head = std::move(v->getNext());
+
+        // ...and re-link it into the correct place in `to`.
+        const int newBucket = abs(static_cast<int>(v->getKey().hash()) %
+                                  static_cast<int>(to.size()));
+        linkIntoBucket(to[newBucket], std::move(v));
+    }
+    if (from.fingerprints) {
+        *from.fingerprints = 0;
+    }
+}
+
+void HashTable::updateFingerprints(Bucket bucket) {
+    if (!bucket.fingerprints) {
+        // Fingerprints are not in use.
+        return;
+    }
+    uint64_t fingerprints = 0;
+    for (StoredValue* v = bucket.head.get(); v; v = v->getNext().get()) {
+        fingerprints |= fingerprintForHash(v->getKey().hash());
+    }
+    *bucket.fingerprints = fingerprints;
+}
 
-    stats.memOverhead->fetch_add(memorySize());
+void HashTable::recordResizeLockHoldTime(ProcessClock::time_point start) {
+    const uint64_t held =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    ProcessClock::now() - start)
+                    .count();
+    atomic_setIfBigger(maxResizeLockHoldTime, held);
 }
 
 StoredValue* HashTable::find(const DocKey& key,
@@ -225,19 +420,86 @@ StoredValue* HashTable::find(const DocKey& key,
         throw std::logic_error("HashTable::find: Cannot call on a "
                 "non-active object");
     }
+    {
+        auto guard = tryMutexFreeRead(key);
+        if (guard) {
+            auto* v = mutex_free_find(guard, key, wantsDeleted);
+            // Only done if we don't need to update the item's reference
+            // state (see unlocked_find()) - that requires the lock. Access
+            // frequencies may be recorded under the guard.
+            if (!v || trackReference == TrackReference::No || v->isDeleted() ||
+                frequencySketch || v->getNRUValue() == MIN_NRU_VALUE) {
+                if (v && trackReference == TrackReference::Yes &&
+                    !v->isDeleted()) {
+                    recordAccess(key);
+                }
+                return const_cast<StoredValue*>(v);
+            }
+        }
+    }
     HashBucketLock hbl = getLockedBucket(key);
     return unlocked_find(key, hbl.getBucketNum(), wantsDeleted, trackReference);
 }
 
+HashTable::MutexFreeReadGuard HashTable::tryMutexFreeRead(
+        const DocKey& key) {
+    if (!stripes || !isActive()) {
+        return {};
+    }
+
+    const int bucket = getBucketForHash(key.hash());
+    const auto lock = mutexForBucket(bucket);
+    auto& stripe = stripes[lock];
+
+    // Register as a reader *before* checking for a writer; a writer
+    // flags the stripe before checking for readers, so one of us will see
+    // the other.
+    const bool noWriter = stripe.beginRead();
+    MutexFreeReadGuard guard(bucket, &stripe);
+    if (!noWriter) {
+        return {};
+    }
+
+    // Now registered no resize can start; check one didn't occur between
+    // choosing the bucket and registering.
+    if (bucket != getBucketForHash(key.hash())) {
+        return {};
+    }
+    return guard;
+}
+
+const StoredValue* HashTable::mutex_free_find(const MutexFreeReadGuard& guard,
+                                              const DocKey& key,
+                                              WantsDeleted wantsDeleted) {
+    if (!guard) {
+        throw std::invalid_argument(
+                "HashTable::mutex_free_find: guard not valid");
+    }
+    auto bucket = getBucket(guard.getBucketNum());
+    if (fingerprintExcludes(bucket, key.hash())) {
+        return nullptr;
+    }
+    for (StoredValue* v = bucket.head.get(); v; v = v->getNext().get()) {
+        if (v->hasKey(key)) {
+            if (wantsDeleted == WantsDeleted::Yes || !v->isDeleted()) {
+                return v;
+            }
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
 std::unique_ptr<Item> HashTable::getRandomKey(long rnd) {
     /* Try to locate a partition */
-    size_t start = rnd % size;
+    const size_t total = getNumBucketsTotal();
+    size_t start = rnd % total;
     size_t curr = start;
     std::unique_ptr<Item> ret;
 
     do {
         ret = getRandomKeyFromSlot(curr++);
-        if (curr == size) {
+        if (curr == total) {
             curr = 0;
         }
     } while (ret == NULL && curr != start);
@@ -277,6 +539,7 @@ MutationStatus HashTable::unlocked_updateStoredValue(
 
     MutationStatus status =
             v.isDirty() ? MutationStatus::WasDirty : MutationStatus::WasClean;
+    const time_t oldExptime = indexedExptime(v);
     if (!v.isResident() && !v.isDeleted() && !v.isTempItem()) {
         decrNumNonResidentItems();
     }
@@ -303,6 +566,11 @@ MutationStatus HashTable::unlocked_updateStoredValue(
 
     /* setValue() will mark v as undeleted if required */
     setValue(itm, v);
+    updateExpiryIndex(v, oldExptime);
+
+    if (!itm.isDeleted()) {
+        recordAccess(itm.getKey());
+    }
 
     return status;
 }
@@ -322,7 +590,8 @@ StoredValue* HashTable::unlocked_addNewStoredValue(const HashBucketLock& hbl,
     }
 
     // Create a new StoredValue and link it into the head of the bucket chain.
-    auto v = (*valFact)(itm, std::move(values[hbl.getBucketNum()]));
+    auto bucket = getBucket(hbl.getBucketNum());
+    auto v = (*valFact)(itm, std::move(bucket.head));
     increaseMetaDataSize(stats, v->metaDataSize());
     increaseCacheSize(v->size());
 
@@ -335,10 +604,14 @@ StoredValue* HashTable::unlocked_addNewStoredValue(const HashBucketLock& hbl,
     }
     if (v->isDeleted()) {
         ++numDeletedItems;
+    } else if (!v->isTempItem()) {
+        recordAccess(itm.getKey());
     }
-    values[hbl.getBucketNum()] = std::move(v);
+    updateExpiryIndex(*v, 0);
+    addFingerprint(bucket, *v);
+    bucket.head = std::move(v);
 
-    return values[hbl.getBucketNum()].get();
+    return bucket.head.get();
 }
 
 std::pair<StoredValue*, StoredValue::UniquePtr>
@@ -360,23 +633,26 @@ HashTable::unlocked_replaceByCopy(const HashBucketLock& hbl,
     auto releasedSv = unlocked_release(hbl, vToCopy.getKey());
 
     /* Copy the StoredValue and link it into the head of the bucket chain. */
-    auto newSv = valFact->copyStoredValue(
-            vToCopy, std::move(values[hbl.getBucketNum()]));
+    auto bucket = getBucket(hbl.getBucketNum());
+    auto newSv = valFact->copyStoredValue(vToCopy, std::move(bucket.head));
     if (newSv->isTempItem()) {
         ++numTempItems;
     } else {
         ++numItems;
         ++numTotalItems;
     }
-    values[hbl.getBucketNum()] = std::move(newSv);
+    updateExpiryIndex(*newSv, 0);
+    addFingerprint(bucket, *newSv);
+    bucket.head = std::move(newSv);
 
-    return {values[hbl.getBucketNum()].get(), std::move(releasedSv)};
+    return {bucket.head.get(), std::move(releasedSv)};
 }
 
 void HashTable::unlocked_softDelete(const std::unique_lock<std::mutex>& htLock,
                                     StoredValue& v,
                                     bool onlyMarkDeleted) {
     const bool alreadyDeleted = v.isDeleted();
+    const time_t oldExptime = indexedExptime(v);
     if (!v.isResident() && !v.isDeleted() && !v.isTempItem()) {
         decrNumNonResidentItems();
     }
@@ -391,24 +667,36 @@ void HashTable::unlocked_softDelete(const std::unique_lock<std::mutex>& htLock,
             ++numItems;
             ++numTotalItems;
         }
-        size_t len = v.valuelen();
+        // Take the size delta rather than valuelen(): an inline value is
+        // part of the StoredValue's own allocation.
+        const size_t oldSize = v.size();
         if (v.del()) {
-            reduceCacheSize(len);
+            reduceCacheSize(oldSize - v.size());
         }
     }
     if (!alreadyDeleted) {
         ++numDeletedItems;
     }
+    updateExpiryIndex(v, oldExptime);
 }
 
 StoredValue* HashTable::unlocked_find(const DocKey& key,
                                       int bucket_num,
                                       WantsDeleted wantsDeleted,
                                       TrackReference trackReference) {
-    for (StoredValue* v = values[bucket_num].get(); v; v = v->getNext().get()) {
+    auto bucket = getBucket(bucket_num);
+    if (fingerprintExcludes(bucket, key.hash())) {
+        // No key in this bucket's chain has the same fingerprint.
+        return NULL;
+    }
+    for (StoredValue* v = bucket.head.get(); v; v = v->getNext().get()) {
         if (v->hasKey(key)) {
             if (trackReference == TrackReference::Yes && !v->isDeleted()) {
-                v->referenced();
+                if (frequencySketch) {
+                    frequencySketch->increment(key.hash());
+                } else {
+                    v->referenced();
+                }
             }
             if (wantsDeleted == WantsDeleted::Yes || !v->isDeleted()) {
                 return v;
@@ -440,7 +728,7 @@ StoredValue::UniquePtr HashTable::unlocked_release(
 
     // Remove the first (should only be one) StoredValue with the given key.
     auto released = hashChainRemoveFirst(
-            values[hbl.getBucketNum()],
+            getBucket(hbl.getBucketNum()),
             [key](const StoredValue* v) { return v->hasKey(key); });
 
     if (!released) {
@@ -452,6 +740,10 @@ StoredValue::UniquePtr HashTable::unlocked_release(
     }
 
     // Update statistics now the item has been removed.
+    if (expiryIndex) {
+        expiryIndex->update(
+                released->getKey(), indexedExptime(*released), 0);
+    }
     reduceCacheSize(released->size());
     reduceMetaDataSize(stats, released->metaDataSize());
     if (released->isTempItem()) {
@@ -481,12 +773,13 @@ void HashTable::visit(HashTableVisitor &visitor) {
 
     size_t visited = 0;
     for (int l = 0; isActive() && l < static_cast<int>(n_locks); l++) {
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        for (int i = l; i < static_cast<int>(getNumBucketsTotal());
+             i += n_locks) {
             // (re)acquire mutex on each HashBucket, to minimise any impact
             // on front-end threads.
-            HashBucketLock lh(i, mutexes[l]);
+            HashBucketLock lh(i, mutexes[l], getStripeState(l));
 
-            StoredValue* v = values[i].get();
+            StoredValue* v = getBucket(i).head.get();
             if (v) {
                 // TODO: Perf: This check seems costly - do we think it's still
                 // worth keeping?
@@ -518,9 +811,10 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        for (int i = l; i < static_cast<int>(getNumBucketsTotal());
+             i += n_locks) {
             size_t depth = 0;
-            StoredValue* p = values[i].get();
+            StoredValue* p = getBucket(i).head.get();
             if (p) {
                 // TODO: Perf: This check seems costly - do we think it's still
                 // worth keeping?
@@ -552,6 +846,11 @@ HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor& visitor,
         return endPosition();
     }
 
+    if (start_pos.lock >= n_locks) {
+        // Already at the end (even if the table has since been resized).
+        return endPosition();
+    }
+
     bool paused = false;
 
     // To attempt to minimize the impact the visitor has on normal frontend
@@ -572,6 +871,9 @@ HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor& visitor,
     // Start from the requested lock number if in range.
     size_t lock = (start_pos.lock < n_locks) ? start_pos.lock : 0;
     size_t hash_bucket = 0;
+    // While an incremental resize is in progress the old bucket array is
+    // visited too; see getBucket().
+    const size_t total = getNumBucketsTotal();
 
     for (; isActive() && !paused && lock < n_locks; lock++) {
 
@@ -580,17 +882,18 @@ HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor& visitor,
         hash_bucket = lock;
         if (start_pos.lock == lock &&
             start_pos.ht_size == size &&
-            start_pos.hash_bucket < size) {
+            start_pos.hash_bucket < total) {
             hash_bucket = start_pos.hash_bucket;
         }
 
         // Iterate across all values in the hash buckets owned by this lock.
         // Note: we don't record how far into the bucket linked-list we
         // pause at; so any restart will begin from the next bucket.
-        for (; !paused && hash_bucket < size; hash_bucket += n_locks) {
-            HashBucketLock lh(hash_bucket, mutexes[lock]);
+        for (; !paused && hash_bucket < total; hash_bucket += n_locks) {
+            HashBucketLock lh(
+                    hash_bucket, mutexes[lock], getStripeState(lock));
 
-            StoredValue* v = values[hash_bucket].get();
+            StoredValue* v = getBucket(hash_bucket).head.get();
             while (!paused && v) {
                 StoredValue* tmp = v->getNext().get();
                 paused = !visitor.visit(lh, *v);
@@ -601,23 +904,36 @@ HashTable::Position HashTable::pauseResumeVisit(HashTableVisitor& visitor,
         // If the visitor paused us before we visited all hash buckets owned
         // by this lock, we don't want to skip the remaining hash buckets, so
         // stop the outer for loop from advancing to the next lock.
-        if (paused && hash_bucket < size) {
+        if (paused && hash_bucket < total) {
             break;
         }
 
-        // Finished all buckets owned by this lock. Set hash_bucket to 'size'
+        // Finished all buckets owned by this lock. Set hash_bucket to 'total'
         // to give a consistent marker for "end of lock".
-        hash_bucket = size;
+        hash_bucket = total;
+    }
+
+    if (lock >= n_locks) {
+        return endPosition();
     }
 
-    // Return the *next* location that should be visited.
-    return HashTable::Position(size, lock, hash_bucket);
+    // Return the *next* location that should be visited. It is pinned
+    // while we still count as a visitor, so no migration step can run
+    // before the pin is in place.
+    return HashTable::Position(size, lock, hash_bucket, pinMigration());
 }
 
 HashTable::Position HashTable::endPosition() const  {
     return HashTable::Position(size, n_locks, size);
 }
 
+std::shared_ptr<void> HashTable::pinMigration() {
+    auto counter = pausedVisits;
+    counter->fetch_add(1);
+    return std::shared_ptr<void>(
+            nullptr, [counter](void*) { counter->fetch_sub(1); });
+}
+
 bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
                                    item_eviction_policy_t policy) {
     if (vptr == nullptr) {
@@ -626,8 +942,9 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
     }
     if (policy == VALUE_ONLY) {
         if (vptr->eligibleForEviction(policy)) {
-            reduceCacheSize(vptr->valuelen());
+            const size_t oldSize = vptr->size();
             vptr->ejectValue();
+            reduceCacheSize(oldSize - vptr->size());
             ++stats.numValueEjects;
             ++numNonResidentItems;
             ++numEjects;
@@ -644,8 +961,12 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
 
             // Remove the item from the hash table.
             auto removed = hashChainRemoveFirst(
-                    values[bucket_num],
+                    getBucket(bucket_num),
                     [vptr](const StoredValue* v) { return v == vptr; });
+            if (expiryIndex) {
+                expiryIndex->update(
+                        removed->getKey(), indexedExptime(*removed), 0);
+            }
 
             if (removed->isResident()) {
                 ++stats.numValueEjects;
@@ -669,7 +990,12 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
 
 std::unique_ptr<Item> HashTable::getRandomKeyFromSlot(int slot) {
     auto lh = getLockedBucket(slot);
-    for (StoredValue* v = values[slot].get(); v; v = v->getNext().get()) {
+    if (static_cast<size_t>(slot) >= getNumBucketsTotal()) {
+        // An incremental resize completed since the slot was chosen.
+        return nullptr;
+    }
+    for (StoredValue* v = getBucket(slot).head.get(); v;
+         v = v->getNext().get()) {
         if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
             return v->toItem(false, 0);
         }
@@ -685,6 +1011,8 @@ bool HashTable::unlocked_restoreValue(
     if (!htLock || !isActive() || v.isResident()) {
         return false;
     }
+    const time_t oldExptime = indexedExptime(v);
+    const size_t oldSize = v.size();
 
     if (v.isTempInitialItem()) { // Regular item with the full eviction
         --numTempItems;
@@ -698,8 +1026,9 @@ bool HashTable::unlocked_restoreValue(
     }
 
     v.restoreValue(itm);
+    updateExpiryIndex(v, oldExptime);
 
-    increaseCacheSize(v.getValue()->length());
+    increaseCacheSize(v.size() - oldSize);
     return true;
 }
 
@@ -718,7 +1047,9 @@ void HashTable::unlocked_restoreMeta(const std::unique_lock<std::mutex>& htLock,
                 "call on a non-active HT object");
     }
 
+    const time_t oldExptime = indexedExptime(v);
     v.restoreMeta(itm);
+    updateExpiryIndex(v, oldExptime);
     if (!itm.isDeleted()) {
         --numTempItems;
         ++numItems;
@@ -727,6 +1058,18 @@ void HashTable::unlocked_restoreMeta(const std::unique_lock<std::mutex>& htLock,
     }
 }
 
+void HashTable::unlocked_setExptime(const std::unique_lock<std::mutex>& htLock,
+                                    StoredValue& v,
+                                    time_t exptime) {
+    if (!htLock) {
+        throw std::invalid_argument(
+                "HashTable::unlocked_setExptime: htLock not held");
+    }
+    const time_t oldExptime = indexedExptime(v);
+    v.setExptime(exptime);
+    updateExpiryIndex(v, oldExptime);
+}
+
 void HashTable::increaseCacheSize(size_t by) {
     cacheSize.fetch_add(by);
     memSize.fetch_add(by);
@@ -758,11 +1101,14 @@ std::ostream& operator<<(std::ostream& os, const HashTable& ht) {
        << " numInMemory:" << ht.getNumInMemoryItems()
        << " numDeleted:" << ht.getNumDeletedItems()
        << " values: " << std::endl;
-    for (const auto& chain : ht.values) {
-        if (chain) {
-            for (StoredValue* sv = chain.get(); sv != nullptr;
-                 sv = sv->getNext().get()) {
-                os << "    " << *sv << std::endl;
+    for (const auto* table : {&ht.values, &ht.oldValues}) {
+        for (size_t i = 0; i < table->size(); i++) {
+            const auto& head = table->head(i);
+            if (head) {
+                for (StoredValue* sv = head.get(); sv != nullptr;
+                     sv = sv->getNext().get()) {
+                    os << "    " << *sv << std::endl;
+                }
             }
         }
     }
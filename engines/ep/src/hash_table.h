@@ -18,11 +18,18 @@
 #pragma once
 
 #include "config.h"
+#include "expiry_index.h"
+#include "frequency_sketch.h"
 #include "storeddockey.h"
 #include "stored-value.h"
 
 #include <platform/histogram.h>
 #include <platform/non_negative_counter.h>
+#include <platform/processclock.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
 
 class AbstractStoredValueFactory;
 class HashTableStatVisitor;
@@ -91,6 +98,36 @@ enum class TempAddStatus : uint8_t {
  * period of time - until the deletion is recorded on disk by the Flusher, at
  * which point they are removed from the HashTable by PersistenceCallback (we
  * don't want to unnecessarily spend memory on items which have been deleted).
+ *
+ * Resizing can be performed either in one go (all ht_locks are held while
+ * every StoredValue is rehashed), or incrementally. In incremental mode the
+ * old and new bucket arrays are kept side by side, and buckets are migrated
+ * from the old array to the new one a bounded number at a time (similar to
+ * default_engine's assoc_expand). While a migration is in progress, a key
+ * lives in the old array if its old bucket has not yet been migrated, and in
+ * the new array otherwise. Both arrays share a single bucket number space -
+ * numbers [0, size) address the new array and [size, size + oldSize) the
+ * old one - so HashBucketLock and unlocked_* callers are unaffected.
+ *
+ * Each bucket holds, alongside the head of its StoredValue chain, a 64-bit
+ * fingerprint of the keys in that chain (one bit per key, selected by hash
+ * bits not used to pick the bucket). A lookup whose fingerprint bit is clear
+ * is rejected without dereferencing any StoredValue; four buckets share a
+ * cache line, so most misses cost a single cache line access.
+ *
+ * Optionally, lookups can be performed without acquiring the bucket's mutex
+ * (see tryMutexFreeRead()). This is *not* a seqlock: each lock stripe
+ * effectively becomes a reader-preferring read/write spinlock. Readers
+ * increment the stripe's reader count, then back off (falling back to the
+ * mutex) if a writer holds the stripe; writers, having acquired the mutex,
+ * flag the stripe as being written and spin (yielding) until registered
+ * readers have drained. Readers never block each other nor sleep on the
+ * mutex, and a StoredValue or Blob can never be freed while such a reader
+ * may be looking at it, so no deferred reclamation is needed. The price is
+ * an atomic read-modify-write of the stripe's cache line per read, so a hot
+ * stripe still bounces that line between readers' cores - the win over the
+ * mutex is avoiding its futex sleep/wake and serialised critical section,
+ * not avoiding shared writes (compare with HashTableHotKeyBench).
  */
 class HashTable {
 public:
@@ -118,10 +155,14 @@ public:
         }
 
     private:
-        Position(size_t ht_size_, int lock_, int hash_bucket_)
+        Position(size_t ht_size_,
+                 int lock_,
+                 int hash_bucket_,
+                 std::shared_ptr<void> migrationPin_ = {})
           : ht_size(ht_size_),
             lock(lock_),
-            hash_bucket(hash_bucket_) {}
+            hash_bucket(hash_bucket_),
+            migrationPin(std::move(migrationPin_)) {}
 
         // Size of the hashtable when the position was created.
         size_t ht_size;
@@ -129,11 +170,105 @@ public:
         size_t lock;
         // hash bucket ID (under the given lock) we are up to.
         size_t hash_bucket;
+        // Held by (every copy of) a paused position, to stop incremental
+        // resize migration moving items between the buckets it has and
+        // hasn't visited yet; see pauseResumeVisit().
+        std::shared_ptr<void> migrationPin;
 
         friend class HashTable;
         friend std::ostream& operator<<(std::ostream& os, const Position& pos);
     };
 
+    /**
+     * Per-lock-stripe state used to coordinate mutex-free readers with
+     * writers (holders of the stripe's mutex). Padded to its own cache line
+     * so stripes do not false-share.
+     *
+     * Readers and writers use the Dekker pattern: each publishes itself
+     * (readers increment `readers`, writers set `writing`) before checking
+     * for the other, with sequentially-consistent operations, so at least
+     * one of them will observe the other.
+     */
+    struct StripeState {
+        // Number of mutex-free readers currently reading the stripe.
+        std::atomic<uint32_t> readers{0};
+        // True while a writer holds the stripe.
+        std::atomic<bool> writing{false};
+        uint8_t padding[64 - sizeof(std::atomic<uint32_t>) -
+                        sizeof(std::atomic<bool>)];
+
+        /**
+         * Mark a writer as holding the stripe (the mutex must already be
+         * held), and spin until any registered readers have finished.
+         */
+        void beginWrite() {
+            writing.store(true);
+            while (readers.load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        /// Mark the writer as no longer holding the stripe.
+        void endWrite() {
+            writing.store(false);
+        }
+
+        /**
+         * Register as a reader of the stripe.
+         * @return true if no writer holds the stripe; if false the caller
+         *         must still call endRead().
+         */
+        bool beginRead() {
+            readers.fetch_add(1);
+            return !writing.load();
+        }
+
+        void endRead() {
+            readers.fetch_sub(1);
+        }
+    };
+
+    /**
+     * The array of locks (and their mutex-free read state) protecting a
+     * HashTable's buckets; bucket N is protected by lock N % size().
+     *
+     * A LockSet may be shared by many HashTables (e.g. by all vBuckets of a
+     * bucket - see ht_shared_locks), so each table does not need its own
+     * locks. Lock acquisition is unchanged: a bucket operation takes one lock,
+     * and whole-table operations (resize, clear) take all of them in order.
+     * The latter therefore stall *every* table sharing the set for as long
+     * as they hold the locks - a whole clear(), or a whole non-incremental
+     * resize(); an incremental resize (resizeStepSize != 0) bounds the stall
+     * to one migration step.
+     */
+    class LockSet {
+    public:
+        /**
+         * @param count the number of locks
+         * @param mutexFreeReads if true, allocate the per-lock state for
+         *        mutex-free reads (see tryMutexFreeRead()).
+         */
+        LockSet(size_t count, bool mutexFreeReads);
+
+        size_t size() const {
+            return count;
+        }
+
+        /// Returns the number of bytes used by the locks.
+        size_t memorySize() const {
+            return sizeof(LockSet) + (count * sizeof(std::mutex)) +
+                   (stripes ? count * sizeof(StripeState) : 0);
+        }
+
+    private:
+        const size_t count;
+        std::unique_ptr<std::mutex[]> mutexes;
+        // Null if mutex-free reads are disabled.
+        std::unique_ptr<StripeState[]> stripes;
+
+        friend class HashTable;
+    };
+
     /**
      * Represents a locked hash bucket that provides RAII semantics for the lock
      *
@@ -143,18 +278,36 @@ public:
     class HashBucketLock {
     public:
         HashBucketLock()
-            : bucketNum(-1) {}
-
-        HashBucketLock(int bucketNum, std::mutex& mutex)
-            : bucketNum(bucketNum), htLock(mutex) {
+            : bucketNum(-1), stripe(nullptr) {}
+
+        /**
+         * @param stripe if non-null, the mutex-free read state for the lock
+         *        stripe, which is marked as being written while locked.
+         */
+        HashBucketLock(int bucketNum,
+                       std::mutex& mutex,
+                       StripeState* stripe = nullptr)
+            : bucketNum(bucketNum), htLock(mutex), stripe(stripe) {
+            if (stripe) {
+                stripe->beginWrite();
+            }
         }
 
         HashBucketLock(HashBucketLock&& other)
-            : bucketNum(other.bucketNum), htLock(std::move(other.htLock)) {
+            : bucketNum(other.bucketNum),
+              htLock(std::move(other.htLock)),
+              stripe(other.stripe) {
+            other.stripe = nullptr;
         }
 
         HashBucketLock(const HashBucketLock& other) = delete;
 
+        ~HashBucketLock() {
+            if (htLock) {
+                unlock();
+            }
+        }
+
         int getBucketNum() const {
             return bucketNum;
         }
@@ -163,13 +316,67 @@ public:
             return htLock;
         }
 
-        std::unique_lock<std::mutex>& getHTLock() {
-            return htLock;
+        /**
+         * Release the lock before this object goes out of scope.
+         */
+        void unlock() {
+            if (stripe) {
+                stripe->endWrite();
+                stripe = nullptr;
+            }
+            htLock.unlock();
         }
 
     private:
         int bucketNum;
         std::unique_lock<std::mutex> htLock;
+        StripeState* stripe;
+    };
+
+    /**
+     * RAII guard for a mutex-free read of a hash bucket, returned by
+     * tryMutexFreeRead(). While a valid guard is held the StoredValues (and
+     * their values) in the bucket may be read - but not modified - without
+     * the bucket's lock.
+     *
+     * Note: the calling thread must not acquire the same bucket's lock while
+     * holding a guard (the writer would wait for the reader forever).
+     */
+    class MutexFreeReadGuard {
+    public:
+        MutexFreeReadGuard() : bucketNum(-1), stripe(nullptr) {}
+
+        MutexFreeReadGuard(MutexFreeReadGuard&& other)
+            : bucketNum(other.bucketNum), stripe(other.stripe) {
+            other.stripe = nullptr;
+        }
+
+        MutexFreeReadGuard(const MutexFreeReadGuard& other) = delete;
+
+        ~MutexFreeReadGuard() {
+            if (stripe) {
+                stripe->endRead();
+            }
+        }
+
+        /// @return true if the mutex-free read was started.
+        explicit operator bool() const {
+            return stripe != nullptr;
+        }
+
+        int getBucketNum() const {
+            return bucketNum;
+        }
+
+    private:
+        MutexFreeReadGuard(int bucketNum, StripeState* stripe)
+            : bucketNum(bucketNum), stripe(stripe) {
+        }
+
+        int bucketNum;
+        StripeState* stripe;
+
+        friend class HashTable;
     };
 
     /**
@@ -179,18 +386,41 @@ public:
      * @param svFactory Factory to use for constructing stored values
      * @param initialSize the number of hash table buckets to initially create.
      * @param locks the number of locks in the hash table
+     * @param resizeStepSize if non-zero, resize incrementally migrating at
+     *        most this many buckets per step; if zero resize in one go.
+     * @param useFingerprints if true, consult the per-bucket key
+     *        fingerprints to reject lookups without walking the chain.
+     * @param mutexFreeReads if true, allow lookups without acquiring the
+     *        bucket lock (see tryMutexFreeRead()).
+     * @param sharedLocks if non-null, the (shared) locks to use instead of
+     *        creating our own; locks and mutexFreeReads are then ignored.
+     *        Their memory is not included in memorySize() - it should be
+     *        accounted by the owner of the set.
+     * @param trackFrequency if true, estimate each key's access frequency
+     *        (see estimateFrequency()) instead of maintaining the items' NRU
+     *        state on reference.
+     * @param indexExpiry if true, maintain an index of the items' expiry
+     *        times (see takeExpiredKeys()).
      */
     HashTable(EPStats& st,
               std::unique_ptr<AbstractStoredValueFactory> svFactory,
               size_t initialSize,
-              size_t locks);
+              size_t locks,
+              size_t resizeStepSize = 0,
+              bool useFingerprints = true,
+              bool mutexFreeReads = false,
+              std::shared_ptr<LockSet> sharedLocks = {},
+              bool trackFrequency = false,
+              bool indexExpiry = false);
 
     ~HashTable();
 
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(std::mutex));
+            + table_type::memorySize(size, useFingerprints)
+            + table_type::memorySize(oldSize, useFingerprints)
+            + (locksShared ? 0 : lockSet->memorySize())
+            + (frequencySketch ? frequencySketch->memorySize() : 0);
     }
 
     /**
@@ -277,12 +507,54 @@ public:
     size_t getNumTempItems(void) { return numTempItems; }
 
     /**
-     * Automatically resize to fit the current data.
+     * Is an incremental resize currently migrating buckets from the old
+     * bucket array to the new one?
+     */
+    bool isResizing() const {
+        return oldSize != 0;
+    }
+
+    /**
+     * Get the number of old buckets migrated so far by the in-progress
+     * incremental resize (zero if no resize is in progress).
+     */
+    size_t getResizeBucketsMigrated() const {
+        return resizeCursor;
+    }
+
+    /**
+     * Get the number of old buckets which remain to be migrated by the
+     * in-progress incremental resize (zero if no resize is in progress).
+     */
+    size_t getResizeBucketsPending() const {
+        // Read without the ht_locks, so a completing resize may have reset
+        // oldSize between the two loads; clamp rather than underflow.
+        const size_t old = oldSize;
+        const size_t cursor = resizeCursor;
+        return old > cursor ? old - cursor : 0;
+    }
+
+    /**
+     * Get the longest time all of the ht_locks have been held by a single
+     * resize (or resize step).
+     */
+    std::chrono::microseconds getMaxResizeLockHoldTime() const {
+        return std::chrono::microseconds(maxResizeLockHoldTime.load());
+    }
+
+    /**
+     * Automatically resize to fit the current data. If an incremental resize
+     * is already in progress, continue migrating it instead.
      */
     void resize();
 
     /**
      * Resize to the specified size.
+     *
+     * In incremental mode this migrates the buckets one step at a time,
+     * releasing the ht_locks between steps. If the migration cannot be
+     * completed (because a visitor is running), it is resumed by the next
+     * call to resize().
      */
     void resize(size_t to);
 
@@ -385,6 +657,118 @@ public:
                              StoredValue& v,
                              bool onlyMarkDeleted);
 
+    /**
+     * Are key access frequencies being tracked (see estimateFrequency())?
+     */
+    bool isTrackingFrequency() const {
+        return frequencySketch != nullptr;
+    }
+
+    /**
+     * Record an access to the given key for frequency tracking; a no-op if
+     * frequencies are not tracked. Accesses are recorded implicitly by
+     * find() / unlocked_find() (with TrackReference::Yes) and when items are
+     * added or updated; this is for callers which read items via
+     * mutex_free_find().
+     *
+     * Must be called with the key's bucket lock or a mutex-free read guard
+     * for the key held.
+     */
+    void recordAccess(const DocKey& key) {
+        if (frequencySketch) {
+            frequencySketch->increment(key.hash());
+        }
+    }
+
+    /**
+     * Estimate how frequently the given key has recently been accessed, from
+     * 0 to FrequencySketch::MaxFrequency. Returns 0 if frequencies are not
+     * tracked.
+     *
+     * Must be called with the key's bucket lock or a mutex-free read guard
+     * for the key held.
+     */
+    uint8_t estimateFrequency(const DocKey& key) const {
+        return frequencySketch ? frequencySketch->estimate(key.hash()) : 0;
+    }
+
+    /**
+     * Is an index of the items' expiry times being maintained (see
+     * takeExpiredKeys())?
+     */
+    bool isIndexingExpiry() const {
+        return expiryIndex != nullptr;
+    }
+
+    /**
+     * Remove and return the keys of (potentially) expired items from the
+     * expiry index - i.e. those items which had an expiry time before `now`
+     * when last modified. Returns nothing if expiry is not indexed.
+     *
+     * The keys are only a hint; the caller must look each item up (under
+     * its bucket lock) and check that it is actually expired.
+     */
+    std::vector<StoredDocKey> takeExpiredKeys(time_t now) {
+        if (!expiryIndex) {
+            return {};
+        }
+        return expiryIndex->takeExpired(now);
+    }
+
+    /**
+     * Set the expiry time of the given item, keeping the expiry index (if
+     * any) up to date. Callers should use this rather than
+     * StoredValue::setExptime() directly.
+     *
+     * @param htLock Hash table lock that must be held
+     * @param v the item to update
+     * @param exptime the new expiry time
+     */
+    void unlocked_setExptime(const std::unique_lock<std::mutex>& htLock,
+                             StoredValue& v,
+                             time_t exptime);
+
+    /**
+     * The access frequency at or below which items are currently being
+     * chosen for eviction, as last set by the item pager. Used to decide
+     * whether to admit bgfetched values to the cache.
+     */
+    uint8_t getVictimFrequency() const {
+        return victimFrequency;
+    }
+
+    void setVictimFrequency(uint8_t frequency) {
+        victimFrequency = frequency;
+    }
+
+    /**
+     * Attempt to start a read of the bucket (without its mutex) which
+     * the given key hashes to.
+     *
+     * @param key the key to be read
+     * @return a valid guard if the read could be started; otherwise (if
+     *         mutex-free reads are disabled or a writer currently holds the
+     *         bucket's lock stripe) an invalid guard, in which case the
+     *         caller should fall back to getLockedBucket().
+     */
+    MutexFreeReadGuard tryMutexFreeRead(const DocKey& key);
+
+    /**
+     * Find an item within the bucket covered by a mutex-free read guard.
+     * Unlike unlocked_find() this never updates the item's reference (NRU)
+     * state, as the StoredValue must not be modified.
+     *
+     * @param guard a valid guard returned by tryMutexFreeRead(key)
+     * @param key the key of the item to find
+     * @param wantsDeleted true if soft deleted items should be returned
+     *
+     * @return a pointer to a StoredValue -- NULL if not found. Only valid
+     *         while the guard is held.
+     */
+    const StoredValue* mutex_free_find(const MutexFreeReadGuard& guard,
+                                       const DocKey& key,
+                                       WantsDeleted wantsDeleted);
+
     /**
      * Find an item within a specific bucket assuming you already
      * locked the bucket.
@@ -407,7 +791,16 @@ public:
      * @return HashBucektLock which contains a lock and the hash bucket number
      */
     inline HashBucketLock getLockedBucket(int bucket) {
-        return HashBucketLock(bucket, mutexes[mutexForBucket(bucket)]);
+        const auto lock = mutexForBucket(bucket);
+        return HashBucketLock(bucket, mutexes[lock], getStripeState(lock));
+    }
+
+    /**
+     * Get the total number of buckets, including those of the old bucket
+     * array while an incremental resize is in progress.
+     */
+    size_t getNumBucketsTotal() const {
+        return size + oldSize;
     }
 
     /**
@@ -424,7 +817,8 @@ public:
                         "Cannot call on a non-active object");
             }
             int bucket = getBucketForHash(h);
-            HashBucketLock rv(bucket, mutexes[mutexForBucket(bucket)]);
+            const auto lock = mutexForBucket(bucket);
+            HashBucketLock rv(bucket, mutexes[lock], getStripeState(lock));
             if (bucket == getBucketForHash(h)) {
                 return rv;
             }
@@ -481,6 +875,11 @@ public:
      * As a consequence, *DO NOT USE THIS METHOD* if you need to guarantee
      * that all items are visited!
      *
+     * While a paused position (or any copy of it) is held, incremental
+     * resize migration does not progress, so bucket numbers in the position
+     * remain valid and no item moves between visited and unvisited buckets.
+     * Drop it (e.g. assign a fresh Position) once the visit is abandoned.
+     *
      * @param visitor The visitor object to use.
      * @param start_pos At what position to start in the hashtable.
      * @return The final HashTable position visited; equal to
@@ -491,7 +890,8 @@ public:
 
     /**
      * Return a position at the end of the hashtable. Has similar semantics
-     * as STL end() (i.e. one past the last element).
+     * as STL end() (i.e. one past the last element). Unaffected by resize
+     * migration steps (it only refers to the current bucket array).
      */
     Position endPosition() const;
 
@@ -603,8 +1003,128 @@ public:
     std::atomic<size_t>       metaDataMemory;
 
 private:
-    // The container for actually holding the StoredValues.
-    using table_type = std::vector<StoredValue::UniquePtr>;
+    /**
+     * A single hash bucket - the chain of StoredValues which hash to it, and
+     * the fingerprint of their keys (see fingerprintForHash()); null if
+     * fingerprints are not in use.
+     */
+    struct Bucket {
+        StoredValue::UniquePtr& head;
+        uint64_t* fingerprints;
+    };
+
+    /**
+     * The container for actually holding the StoredValues. With fingerprints,
+     * buckets are stored in groups of four - the four fingerprints followed
+     * by the four chain heads - each group occupying one (aligned) cache
+     * line, so a lookup touches a single line until it has to dereference a
+     * StoredValue. Without fingerprints it is a plain array of chain heads,
+     * costing a pointer per bucket.
+     */
+    class table_type {
+    public:
+        table_type() = default;
+
+        table_type(size_t n, bool withFingerprints) : n(n) {
+            if (!withFingerprints) {
+                heads.resize(n);
+                return;
+            }
+            const size_t bytes = numGroups() * sizeof(BucketGroup);
+            // Room to align the first group to a cache line.
+            size_t space = bytes + alignof(BucketGroup);
+            groupStorage.reset(new char[space]);
+            void* start = groupStorage.get();
+            groups = static_cast<BucketGroup*>(
+                    std::align(alignof(BucketGroup), bytes, start, space));
+            for (size_t g = 0; g < numGroups(); g++) {
+                new (&groups[g]) BucketGroup();
+            }
+        }
+
+        table_type(table_type&& other) {
+            *this = std::move(other);
+        }
+
+        table_type& operator=(table_type&& other) {
+            if (this != &other) {
+                destroyGroups();
+                n = other.n;
+                heads = std::move(other.heads);
+                groupStorage = std::move(other.groupStorage);
+                groups = other.groups;
+                other.n = 0;
+                other.groups = nullptr;
+            }
+            return *this;
+        }
+
+        ~table_type() {
+            destroyGroups();
+        }
+
+        size_t size() const {
+            return n;
+        }
+
+        Bucket operator[](size_t i) {
+            if (groups == nullptr) {
+                return {heads[i], nullptr};
+            }
+            BucketGroup& group = groups[i / bucketsPerGroup];
+            const size_t slot = i % bucketsPerGroup;
+            return {group.heads[slot], &group.fingerprints[slot]};
+        }
+
+        const StoredValue::UniquePtr& head(size_t i) const {
+            if (groups == nullptr) {
+                return heads[i];
+            }
+            return groups[i / bucketsPerGroup].heads[i % bucketsPerGroup];
+        }
+
+        /// Bytes used by a table of n buckets (excluding the StoredValues).
+        static size_t memorySize(size_t n, bool withFingerprints) {
+            if (!withFingerprints) {
+                return n * sizeof(StoredValue::UniquePtr);
+            }
+            return ((n + bucketsPerGroup - 1) / bucketsPerGroup) *
+                   sizeof(BucketGroup);
+        }
+
+    private:
+        static const size_t bucketsPerGroup = 4;
+
+        struct alignas(64) BucketGroup {
+            uint64_t fingerprints[bucketsPerGroup] = {};
+            StoredValue::UniquePtr heads[bucketsPerGroup];
+        };
+        static_assert(sizeof(BucketGroup) == 64,
+                      "BucketGroup should occupy exactly one cache line");
+
+        size_t numGroups() const {
+            return (n + bucketsPerGroup - 1) / bucketsPerGroup;
+        }
+
+        void destroyGroups() {
+            if (groups == nullptr) {
+                return;
+            }
+            for (size_t g = 0; g < numGroups(); g++) {
+                groups[g].~BucketGroup();
+            }
+            groups = nullptr;
+            groupStorage.reset();
+        }
+
+        size_t n = 0;
+        // Used when fingerprints are disabled.
+        std::vector<StoredValue::UniquePtr> heads;
+        // Used when fingerprints are enabled; groups points at the first
+        // cache-line aligned byte of groupStorage.
+        std::unique_ptr<char[]> groupStorage;
+        BucketGroup* groups = nullptr;
+    };
 
     friend class StoredValue;
     friend std::ostream& operator<<(std::ostream& os, const HashTable& ht);
@@ -620,19 +1140,170 @@ private:
     std::atomic<size_t> size;
     size_t               n_locks;
     table_type values;
+
+    // Old bucket array, only non-empty while an incremental resize is
+    // migrating its contents into `values`.
+    table_type oldValues;
+    // Number of elements in `oldValues`; zero when not resizing.
+    std::atomic<size_t> oldSize;
+    // Index of the next bucket in `oldValues` to migrate; all buckets below
+    // it are empty and their items live in `values`.
+    std::atomic<size_t> resizeCursor;
+    // Maximum number of old buckets to migrate per step (zero => resize is
+    // not incremental).
+    const size_t resizeStepSize;
+    // Longest time (in microseconds) all ht_locks have been held by resize.
+    std::atomic<uint64_t> maxResizeLockHoldTime;
+    // Should lookups consult the bucket fingerprints?
+    const bool useFingerprints;
+    // Is lockSet shared (i.e. not accounted in our memorySize())?
+    const bool locksShared;
+    // The locks protecting the buckets; possibly shared with other
+    // HashTables.
+    std::shared_ptr<LockSet> lockSet;
+    // Mutex-free read state for each lock stripe (owned by lockSet); null if
+    // mutex-free reads are disabled.
+    StripeState* stripes;
+    // The locks themselves (owned by lockSet).
     std::mutex               *mutexes;
+    // Recent access frequency of our keys; null unless tracking frequency.
+    // Only replaced (on resize) while all locks and stripes are held.
+    std::unique_ptr<FrequencySketch> frequencySketch;
+    std::atomic<uint8_t> victimFrequency;
+    // Keys of the items with an expiry time; null unless indexing expiry.
+    // Accounts its own memory in EPStats::memOverhead.
+    std::unique_ptr<ExpiryIndex> expiryIndex;
     EPStats&             stats;
     std::unique_ptr<AbstractStoredValueFactory> valFact;
     std::atomic<size_t>       visitors;
+    // Number of paused pauseResumeVisit() positions held; shared with their
+    // pins, which may outlive the table.
+    std::shared_ptr<std::atomic<size_t>> pausedVisits;
     cb::NonNegativeCounter<size_t> numItems;
     std::atomic<size_t>       numResizes;
     std::atomic<size_t>       numTempItems;
     bool                 activeState;
 
     int getBucketForHash(int h) {
+        // Note: oldSize may be concurrently reset by a completing migration
+        // if the caller doesn't hold a lock, so only read it once.
+        const size_t old = oldSize;
+        if (old != 0) {
+            const int oldBucket = abs(h % static_cast<int>(old));
+            if (static_cast<size_t>(oldBucket) >= resizeCursor) {
+                // Not yet migrated - still lives in the old bucket array.
+                return static_cast<int>(size) + oldBucket;
+            }
+        }
         return abs(h % static_cast<int>(size));
     }
 
+    /**
+     * Returns the bucket for the given bucket number, which may address
+     * either the current or (while resizing) the old bucket array. The lock
+     * for the bucket must be held.
+     */
+    Bucket getBucket(int bucket_num) {
+        if (static_cast<size_t>(bucket_num) < size) {
+            return values[bucket_num];
+        }
+        return oldValues[bucket_num - size];
+    }
+
+    /**
+     * Returns the fingerprint bit for a key hash. Uses the high bits of a
+     * multiplicative hash of h, so it is independent of the (prime modulo)
+     * bucket selection.
+     */
+    static uint64_t fingerprintForHash(uint32_t h) {
+        return uint64_t(1) << ((h * 2654435761u) >> 26);
+    }
+
+    /**
+     * Link a StoredValue into the head of the given bucket's chain.
+     */
+    void linkIntoBucket(Bucket bucket, StoredValue::UniquePtr v) {
+        addFingerprint(bucket, *v);
+        v->setNext(std::move(bucket.head));
+        bucket.head = std::move(v);
+    }
+
+    /**
+     * Recalculate a bucket's fingerprint after StoredValue(s) have been
+     * removed from its chain.
+     */
+    void updateFingerprints(Bucket bucket);
+
+    /// Add v's key to the bucket's fingerprint.
+    static void addFingerprint(Bucket bucket, const StoredValue& v) {
+        if (bucket.fingerprints) {
+            *bucket.fingerprints |= fingerprintForHash(v.getKey().hash());
+        }
+    }
+
+    /**
+     * @return true if no key in the bucket's chain can match one with the
+     *         given hash (false if fingerprints are not in use).
+     */
+    static bool fingerprintExcludes(Bucket bucket, uint32_t hash) {
+        return bucket.fingerprints &&
+               (*bucket.fingerprints & fingerprintForHash(hash)) == 0;
+    }
+
+    /**
+     * Move every StoredValue in the given bucket into its bucket in `to`
+     * (which must be sized to the current size).
+     */
+    void rehashBucket(Bucket from, table_type& to);
+
+    /**
+     * Migrate all remaining buckets of an in-progress incremental resize,
+     * one step at a time.
+     *
+     * @return true if no migration remains, false if a visitor prevented
+     *         the migration from completing.
+     */
+    bool completeResizeMigration();
+
+    /**
+     * Migrate up to resizeStepSize buckets from the old bucket array into
+     * the current one, acquiring all ht_locks for the duration of the step.
+     *
+     * @return true if the migration is complete, false if there are more
+     *         buckets to migrate (or a visitor prevented progress).
+     */
+    bool migrateResizeStep();
+
+    /**
+     * Record the time all ht_locks were held by a resize (step).
+     */
+    void recordResizeLockHoldTime(ProcessClock::time_point start);
+
+    /**
+     * Returns the mutex-free read state of the given lock stripe, or nullptr
+     * if mutex-free reads are disabled.
+     */
+    StripeState* getStripeState(size_t lock) {
+        return stripes ? &stripes[lock] : nullptr;
+    }
+
+    /**
+     * @return a pin, for a paused Position, which blocks resize migration
+     *         until every copy of it is released.
+     */
+    std::shared_ptr<void> pinMigration();
+
+    /// @return true if visitors (running or paused) block resize migration.
+    bool migrationBlockedByVisitors() const {
+        return visitors.load() > 0 || pausedVisits->load() > 0;
+    }
+
+    /**
+     * RAII helper which marks every lock stripe as being written (waiting
+     * for mutex-free readers to drain), for use while all ht_locks are held.
+     */
+    class AllStripesWriteGuard;
+
     inline size_t mutexForBucket(size_t bucket_num) {
         if (!isActive()) {
             throw std::logic_error("HashTable::mutexForBucket: Cannot call on a "
@@ -679,8 +1350,39 @@ private:
         return nullptr;
     }
 
+    /**
+     * As above, but operating on the chain of the given bucket and keeping
+     * the bucket's fingerprint up to date.
+     */
+    template <typename Pred>
+    StoredValue::UniquePtr hashChainRemoveFirst(Bucket bucket, Pred p) {
+        auto removed = hashChainRemoveFirst(bucket.head, p);
+        if (removed) {
+            updateFingerprints(bucket);
+        }
+        return removed;
+    }
+
     void clear_UNLOCKED(bool deactivate);
 
+    /**
+     * Update the expiry index (if any) for a change to the given item, which
+     * previously had the given indexedExptime().
+     */
+    void updateExpiryIndex(const StoredValue& v, time_t oldExptime) {
+        if (expiryIndex) {
+            expiryIndex->update(v.getKey(), oldExptime, indexedExptime(v));
+        }
+    }
+
+    /**
+     * The expiry time the given item should be indexed under; 0 (not
+     * indexed) for deleted and temp items.
+     */
+    static time_t indexedExptime(const StoredValue& v) {
+        return (v.isDeleted() || v.isTempItem()) ? 0 : v.getExptime();
+    }
+
     /**
      * Increase the size of the cache
      */
@@ -283,12 +283,12 @@ item_info Item::toItemInfo(uint64_t vb_uuid, int64_t hlcEpoch) const {
     return info;
 }
 
-void Item::pruneValueAndOrXattrs(IncludeValue includeVal,
+bool Item::pruneValueAndOrXattrs(IncludeValue includeVal,
                                  IncludeXattrs includeXattrs) {
     if (!value) {
         // If the item does not have value (i.e. data and/or xattrs) then no
         // pruning is required.
-        return;
+        return true;
     }
 
     if (includeVal == IncludeValue::Yes) {
@@ -297,10 +297,19 @@ void Item::pruneValueAndOrXattrs(IncludeValue includeVal,
             // If we want to include the value and either, we want to include
             // the xattrs or there are no xattrs, then no pruning is required
             // and we can just return.
-            return;
+            return true;
         }
     }
 
+    // The xattrs can only be found in the uncompressed value (needed only
+    // if some of the value is kept).
+    if (mcbp::datatype::is_xattr(getDataType()) &&
+        (includeVal == IncludeValue::Yes ||
+         includeXattrs == IncludeXattrs::Yes) &&
+        !decompressValue()) {
+        return false;
+    }
+
     auto root = reinterpret_cast<const char*>(value->getData());
     const cb::const_char_buffer buffer{root, value->vlength()};
     const auto sz = cb::xattr::get_body_offset(buffer);
@@ -337,4 +346,5 @@ void Item::pruneValueAndOrXattrs(IncludeValue includeVal,
         setData(nullptr, 0, nullptr, 0);
         setDataType(PROTOCOL_BINARY_RAW_BYTES);
     }
+    return true;
 }
@@ -419,8 +419,10 @@ public:
      *
      * @param includeVal states whether the item should include value, or not
      * @param includeXattrs states whether the item should include xattrs or not
+     * @return false if a compressed value needing pruning couldn't be
+     *         inflated (the item is then left unchanged), else true
      **/
-    void pruneValueAndOrXattrs(IncludeValue includeVal,
+    bool pruneValueAndOrXattrs(IncludeValue includeVal,
                                IncludeXattrs includeXattrs);
 
 private:
@@ -23,6 +23,7 @@
 #include "ep_time.h"
 #include "kv_bucket_iface.h"
 
+#include <array>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
@@ -88,6 +89,24 @@ public:
             return true;
         }
 
+        if (currentBucket->ht.isTrackingFrequency()) {
+            // lfu strategy - NRU state is only used to flag values which
+            // failed cache admission.
+            if (!v.isResident() &&
+                store.getItemEvictionPolicy() == VALUE_ONLY) {
+                // Nothing to evict; don't skew the frequency distribution.
+                return true;
+            }
+            const uint8_t freq = currentBucket->ht.estimateFrequency(v.getKey());
+            const bool notAdmitted =
+                    v.getNRUValue() == MAX_NRU_VALUE &&
+                    freq <= currentBucket->ht.getVictimFrequency();
+            if (shouldEvictByFrequency(freq) || notAdmitted) {
+                doEviction(lh, &v);
+            }
+            return true;
+        }
+
         // always evict unreferenced items, or randomly evict referenced item
         double r = *pager_phase == PAGING_UNREFERENCED ?
             1 :
@@ -123,7 +142,11 @@ public:
         if (percent <= 0 || !pager_phase) {
             if (vBucketFilter(vb->getId())) {
                 currentBucket = vb;
-                vb->ht.visit(*this);
+                if (owner == EXPIRY_PAGER && vb->ht.isIndexingExpiry()) {
+                    visitExpiryIndex(*vb);
+                } else {
+                    vb->ht.visit(*this);
+                }
             }
             return;
         }
@@ -145,6 +168,9 @@ public:
             if (vBucketFilter(vb->getId())) {
                 currentBucket = vb;
                 vb->ht.visit(*this);
+                if (vb->ht.isTrackingFrequency()) {
+                    vb->ht.setVictimFrequency(getVictimFrequency());
+                }
             }
 
         } else { // stop eviction whenever memory usage is below low watermark
@@ -152,6 +178,30 @@ public:
         }
     }
 
+    /**
+     * Find the expired items of the given vBucket from its HashTable's
+     * expiry index, rather than visiting every item. Only active vBuckets
+     * expire items; the index of other vBuckets is left intact for when
+     * they are promoted.
+     */
+    void visitExpiryIndex(VBucket& vb) {
+        if (vb.getState() != vbucket_state_active) {
+            return;
+        }
+        for (const auto& key : vb.ht.takeExpiredKeys(startTime)) {
+            auto hbl = vb.ht.getLockedBucket(key);
+            const StoredValue* v = vb.ht.unlocked_find(key,
+                                                       hbl.getBucketNum(),
+                                                       WantsDeleted::No,
+                                                       TrackReference::No);
+            // The index may be stale - e.g. the item's expiry time was
+            // extended after we took its key; check it really has expired.
+            if (v && v->isExpired(startTime)) {
+                expired.push_back(*v->toItem(false, vb.getId()));
+            }
+        }
+    }
+
     void update() {
         store.deleteExpiredItems(expired, ExpireBy::Pager);
 
@@ -220,6 +270,54 @@ private:
         }
     }
 
+    /**
+     * Decide if an item with the given estimated access frequency should be
+     * evicted, such that (in expectation) the least frequently used
+     * `percent` of items are evicted.
+     *
+     * The distribution of frequencies is sampled from the items visited so
+     * far in this run: items less frequent than the percentile are evicted,
+     * and items at it are evicted with the probability needed to make up
+     * the target.
+     */
+    bool shouldEvictByFrequency(uint8_t freq) {
+        ++freqHistogram[freq];
+        ++freqSamples;
+
+        const double target = percent * freqSamples;
+        size_t below = 0;
+        for (uint8_t f = 0; f < freq; f++) {
+            below += freqHistogram[f];
+        }
+        if (below >= target) {
+            // Enough less frequent items to evict.
+            return false;
+        }
+        const size_t at = freqHistogram[freq];
+        if (below + at <= target) {
+            return true;
+        }
+        const double r =
+                static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
+        return r <= (target - below) / at;
+    }
+
+    /**
+     * Returns the highest access frequency at which items are currently
+     * being evicted (the `percent` percentile of the sampled frequencies).
+     */
+    uint8_t getVictimFrequency() const {
+        const double target = percent * freqSamples;
+        size_t cumulative = 0;
+        for (uint8_t f = 0; f < FrequencySketch::MaxFrequency; f++) {
+            cumulative += freqHistogram[f];
+            if (cumulative >= target) {
+                return f;
+            }
+        }
+        return FrequencySketch::MaxFrequency;
+    }
+
     void doEviction(const HashTable::HashBucketLock& lh, StoredValue* v) {
         item_eviction_policy_t policy = store.getItemEvictionPolicy();
         StoredDocKey key(v->getKey());
@@ -253,6 +351,11 @@ private:
     hrtime_t taskStart;
     std::atomic<item_pager_phase>* pager_phase;
     VBucketPtr currentBucket;
+
+    // Number of items visited with each estimated access frequency (lfu
+    // strategy only).
+    std::array<size_t, FrequencySketch::MaxFrequency + 1> freqHistogram{};
+    size_t freqSamples = 0;
 };
 
 ItemPager::ItemPager(EventuallyPersistentEngine *e, EPStats &st) :
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <time.h>
 
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -33,6 +34,7 @@
 #include <platform/make_unique.h>
 
 #include "access_scanner.h"
+#include "bgfetcher.h"
 #include "checkpoint_remover.h"
 #include "collections/manager.h"
 #include "conflict_resolution.h"
@@ -300,7 +302,9 @@ bool BloomFilterCallback::initTempFilter(uint16_t vbucketId) {
         estimated_count = initial_estimation;
     }
 
-    vb->initTempFilter(estimated_count, config.getBfilterFpProb());
+    vb->initTempFilter(estimated_count,
+                       config.getBfilterFpProb(),
+                       config.isBfilterBlocked());
 
     return true;
 }
@@ -353,6 +357,7 @@ KVBucket::KVBucket(EventuallyPersistentEngine& theEngine)
       vbMap(theEngine.getConfiguration(), *this),
       defragmenterTask(NULL),
       diskDeleteAll(false),
+      flushBatchesPending(0),
       bgFetchDelay(0),
       backfillMemoryThreshold(0.95),
       statsSnapshotTaskId(0),
@@ -386,6 +391,12 @@ KVBucket::KVBucket(EventuallyPersistentEngine& theEngine)
 
     *stats.memOverhead = sizeof(KVBucket);
 
+    if (config.getHtSharedLocks() > 0) {
+        sharedHtLocks = std::make_shared<HashTable::LockSet>(
+                config.getHtSharedLocks(), config.isHtMutexFreeReads());
+        stats.memOverhead->fetch_add(sharedHtLocks->memorySize());
+    }
+
     stats.setMaxDataSize(config.getMaxSize());
     config.addValueChangedListener("max_size",
                                    new StatsValueChangeListener(stats, *this));
@@ -545,6 +556,9 @@ KVBucket::~KVBucket() {
     delete [] vb_mutexes;
     LOG(EXTENSION_LOG_NOTICE, "Deleting defragmenterTask");
     defragmenterTask.reset();
+    if (sharedHtLocks) {
+        stats.memOverhead->fetch_sub(sharedHtLocks->memorySize());
+    }
 }
 
 const Flusher* KVBucket::getFlusher(uint16_t shardId) {
@@ -586,8 +600,10 @@ void KVBucket::deleteExpiredItem(Item& it,
     VBucketPtr vb = getVBucket(it.getVBucketId());
 
     if (vb) {
-        // Ignore items which have been created from temp items (negative seqno)
-        if (it.getBySeqno() >= 0) {
+        // Ignore items which have been created from temp items (negative
+        // seqno), and those whose (compressed) value can't be inflated for
+        // pre_expiry.
+        if (it.getBySeqno() >= 0 && it.decompressValue()) {
             auto info = it.toItemInfo(vb->failovers->getLatestUUID(),
                                       vb->getHLCEpochSeqno());
             if (engine.getServerApi()->document->pre_expiry(info)) {
@@ -878,7 +894,8 @@ ENGINE_ERROR_CODE KVBucket::setVBucketState_UNLOCKED(
             // Initialize bloom filters upon vbucket creation during
             // bucket creation and rebalance
             newvb->createFilter(config.getBfilterKeyCount(),
-                                config.getBfilterFpProb());
+                                config.getBfilterFpProb(),
+                                config.isBfilterBlocked());
         }
 
         // The first checkpoint for active vbucket should start with id 2.
@@ -1420,6 +1437,9 @@ void KVBucket::completeBGFetch(const DocKey& key,
             ENGINE_ERROR_CODE status =
                     vb->completeBGFetchForSingleItem(key, item, startTime);
             engine.notifyIOComplete(item.cookie, status);
+            if (isWarmupServingTraffic()) {
+                recordWarmupBGFetch(init);
+            }
         } else {
             LOG(EXTENSION_LOG_INFO, "vb:%" PRIu16 " file was deleted in the "
                 "middle of a bg fetch for key{%.*s}\n", vbucket, int(key.size()),
@@ -1442,6 +1462,9 @@ void KVBucket::completeBGFetchMulti(uint16_t vbId,
             ENGINE_ERROR_CODE status = vb->completeBGFetchForSingleItem(
                     key, *fetched_item, startTime);
             engine.notifyIOComplete(fetched_item->cookie, status);
+            if (isWarmupServingTraffic()) {
+                recordWarmupBGFetch(fetched_item->initTime);
+            }
         }
         LOG(EXTENSION_LOG_DEBUG,
             "EP Store completes %" PRIu64 " of batched background fetch "
@@ -1460,6 +1483,14 @@ void KVBucket::completeBGFetchMulti(uint16_t vbId,
     }
 }
 
+void KVBucket::recordWarmupBGFetch(ProcessClock::time_point init) {
+    ++stats.warmupBgFetched;
+    stats.warmupBgFetchHisto.add(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    ProcessClock::now() - init)
+                    .count());
+}
+
 GetValue KVBucket::getInternal(const DocKey& key,
                                uint16_t vbucket,
                                const void *cookie,
@@ -1777,7 +1808,7 @@ std::string KVBucket::validateKey(const DocKey& key, uint16_t vbucket,
         if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
         } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
+                                             v->getValueBody().data(),
                                              diskItem.getNBytes())) {
             return "data_mismatch";
         } else {
@@ -2099,7 +2130,6 @@ int KVBucket::flushVBucket(uint16_t vbid) {
     }
 
     int items_flushed = 0;
-    const hrtime_t flush_start = gethrtime();
 
     VBucketPtr vb = vbMap.getBucket(vbid);
     if (vb) {
@@ -2108,200 +2138,428 @@ int KVBucket::flushVBucket(uint16_t vbid) {
             return RETRY_FLUSH_VBUCKET; // to avoid blocking flusher
         }
 
-        std::vector<queued_item> items;
-        KVStore *rwUnderlying = getRWUnderlying(vbid);
-
-        while (!vb->rejectQueue.empty()) {
-            items.push_back(vb->rejectQueue.front());
-            vb->rejectQueue.pop();
+        VBucketFlushBatch batch;
+        batch.vb = vb;
+        batch.flushStart = gethrtime();
+        if (gatherFlushBatch_UNLOCKED(batch)) {
+            items_flushed = writeFlushBatch_UNLOCKED(batch);
+            if (items_flushed == RETRY_FLUSH_VBUCKET) {
+                return RETRY_FLUSH_VBUCKET;
+            }
         }
 
-        // Append any 'backfill' items (mutations added by a DCP stream).
-        vb->getBackfillItems(items);
+        getRWUnderlying(vbid)->pendingTasks();
+        if (completeVBucketFlush_UNLOCKED(*vb) == RETRY_FLUSH_VBUCKET) {
+            return RETRY_FLUSH_VBUCKET;
+        }
+    }
 
-        // Append all items outstanding for the persistence cursor.
-        snapshot_range_t range;
-        hrtime_t _begin_ = gethrtime();
-        range = vb->checkpointManager.getAllItemsForCursor(
-                CheckpointManager::pCursorName, items);
-        stats.persistenceCursorGetItemsHisto.add((gethrtime() - _begin_) / 1000);
+    return items_flushed;
+}
 
-        if (!items.empty()) {
-            while (!rwUnderlying->begin()) {
-                ++stats.beginFailed;
-                LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
-                    "Retry in 1 sec ...");
-                sleep(1);
+int KVBucket::prepareFlushBatch(uint16_t vbid, VBucketFlushBatch& batch) {
+    KVShard *shard = vbMap.getShardByVbId(vbid);
+    if (diskDeleteAll && !deleteAllTaskCtx.delay) {
+        if (shard->getId() == EP_PRIMARY_SHARD) {
+            // Let batches already prepared land before the reset.
+            if (flushBatchesPending > 0) {
+                return RETRY_FLUSH_VBUCKET;
             }
-            rwUnderlying->optimizeWrites(items);
+            flushOneDeleteAll();
+        } else {
+            // disk flush is pending just return
+            return 0;
+        }
+    }
 
-            Item *prev = NULL;
-            auto vbstate = vb->getVBucketState();
-            uint64_t maxSeqno = 0;
-            range.start = std::max(range.start, vbstate.lastSnapStart);
+    VBucketPtr vb = vbMap.getBucket(vbid);
+    if (!vb) {
+        return 0;
+    }
 
-            bool mustCheckpointVBState = false;
-            std::list<PersistenceCallback*>& pcbs = rwUnderlying->getPersistenceCbList();
+    std::unique_lock<std::mutex> lh(vb_mutexes[vbid], std::try_to_lock);
+    if (!lh.owns_lock() || vb->flushBatchPending) {
+        return RETRY_FLUSH_VBUCKET;
+    }
 
-            SystemEventFlush sef;
+    batch.vb = vb;
+    batch.flushStart = gethrtime();
+    if (!gatherFlushBatch_UNLOCKED(batch)) {
+        // The KVStore's pendingTasks() are left to the next commit, which
+        // may be in progress on another thread.
+        batch.vb.reset();
+        return completeVBucketFlush_UNLOCKED(*vb);
+    }
 
-            for (const auto& item : items) {
+    vb->flushBatchPending = true;
+    ++flushBatchesPending;
+    return batch.items.size();
+}
 
-                if (!item->shouldPersist()) {
-                    continue;
+int KVBucket::commitFlushBatch(VBucketFlushBatch& batch) {
+    VBucketPtr& vb = batch.vb;
+    const uint16_t vbid = vb->getId();
+    int items_flushed = 0;
+    {
+        LockHolder lh(vb_mutexes[vbid]);
+        if (vbMap.getBucket(vbid) == vb) {
+            items_flushed = writeFlushBatch_UNLOCKED(batch);
+            if (items_flushed != RETRY_FLUSH_VBUCKET) {
+                getRWUnderlying(vbid)->pendingTasks();
+                if (completeVBucketFlush_UNLOCKED(*vb) ==
+                    RETRY_FLUSH_VBUCKET) {
+                    items_flushed = RETRY_FLUSH_VBUCKET;
                 }
+            }
+        } else {
+            // The vbucket was deleted (or reset) after the batch was
+            // prepared; its items are no longer wanted.
+            for (const auto& item : batch.items) {
+                --stats.diskQueueSize;
+                vb->doStatsForFlushing(*item, item->size());
+            }
+        }
+        vb->flushBatchPending = false;
+    }
+    --flushBatchesPending;
+    return items_flushed;
+}
 
-                // SystemEventFlush needs to check the item
-                sef.process(item);
-
-                if (item->getOperation() == queue_op::set_vbucket_state) {
-                    // No actual item explicitly persisted to (this op exists
-                    // to ensure a commit occurs with the current vbstate);
-                    // flag that we must trigger a snapshot even if there are
-                    // no 'real' items in the checkpoint.
-                    mustCheckpointVBState = true;
-
-                    // Update queuing stats how this item has logically been
-                    // processed.
-                    --stats.diskQueueSize;
-                    vb->doStatsForFlushing(*item, item->size());
-
-                } else if (!prev || prev->getKey() != item->getKey()) {
-                    prev = item.get();
-                    ++items_flushed;
-                    PersistenceCallback *cb = flushOneDelOrSet(item, vb);
-                    if (cb) {
-                        pcbs.push_back(cb);
-                    }
+void KVBucket::abandonFlushBatch(VBucketFlushBatch& batch) {
+    VBucketPtr& vb = batch.vb;
+    {
+        LockHolder lh(vb_mutexes[vb->getId()]);
+        // Return the items to the vbucket unwritten, still counted as
+        // waiting for persistence.
+        for (auto& item : batch.items) {
+            vb->rejectQueue.push(std::move(item));
+        }
+        batch.items.clear();
+        vb->flushBatchPending = false;
+    }
+    --flushBatchesPending;
+}
+
+bool KVBucket::commitFlushBatches(
+        std::vector<std::unique_ptr<VBucketFlushBatch>>& batches) {
+    bool retry = false;
+    std::vector<VBucketFlushBatch*> group;
+    for (auto& batch : batches) {
+        // A collections manifest is written with its vbucket's commit, so
+        // such a batch must be committed on its own.
+        if (batches.size() == 1 || batch->sef.getCollectionsManifestItem()) {
+            retry |= (commitFlushBatch(*batch) == RETRY_FLUSH_VBUCKET);
+        } else {
+            group.push_back(batch.get());
+        }
+    }
+    if (group.empty()) {
+        return retry;
+    }
+
+    // Lock the vbuckets in order, so two lockers of several vbuckets can't
+    // deadlock.
+    std::sort(group.begin(),
+              group.end(),
+              [](const VBucketFlushBatch* a, const VBucketFlushBatch* b) {
+                  return a->vb->getId() < b->vb->getId();
+              });
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(group.size());
+    for (auto* batch : group) {
+        locks.emplace_back(vb_mutexes[batch->vb->getId()]);
+    }
+
+    KVStore* rwUnderlying = getRWUnderlying(group.front()->vb->getId());
+    beginFlush(*rwUnderlying);
+
+    std::vector<int> flushed(group.size(), 0);
+    std::vector<bool> current(group.size(), false);
+    int total_flushed = 0;
+    for (size_t ii = 0; ii < group.size(); ++ii) {
+        auto& batch = *group[ii];
+        const uint16_t vbid = batch.vb->getId();
+        if (vbMap.getBucket(vbid) != batch.vb) {
+            // The vbucket was deleted (or reset) after the batch was
+            // prepared; its items are no longer wanted.
+            for (const auto& item : batch.items) {
+                --stats.diskQueueSize;
+                batch.vb->doStatsForFlushing(*item, item->size());
+            }
+            continue;
+        }
+        current[ii] = true;
+        flushed[ii] = queueFlushBatch_UNLOCKED(batch);
+        if (flushed[ii] == RETRY_FLUSH_VBUCKET) {
+            // None of its items were written, so it's left out of the
+            // group's commit.
+            retry = true;
+        } else {
+            total_flushed += flushed[ii];
+        }
+    }
 
-                    maxSeqno = std::max(maxSeqno, (uint64_t)item->getBySeqno());
-                    vbstate.maxCas = std::max(vbstate.maxCas, item->getCas());
-                    if (item->isDeleted()) {
-                        vbstate.maxDeletedSeqno =
-                                std::max(vbstate.maxDeletedSeqno,
-                                         item->getRevSeqno());
-                    }
-                    ++stats.flusher_todo;
+    // One commit for the whole group; the KVStore makes the vbuckets
+    // durable together.
+    if (total_flushed > 0) {
+        commit(*rwUnderlying, nullptr);
+    }
+    rwUnderlying->pendingTasks();
 
-                } else {
-                    // Item is the same key as the previous[1] one - don't need
-                    // to flush to disk.
-                    // [1] Previous here really means 'next' - optimizeWrites()
-                    //     above has actually re-ordered items such that items
-                    //     with the same key are ordered from high->low seqno.
-                    //     This means we only write the highest (i.e. newest)
-                    //     item for a given key, and discard any duplicate,
-                    //     older items.
-                    --stats.diskQueueSize;
-                    vb->doStatsForFlushing(*item, item->size());
-                }
+    for (size_t ii = 0; ii < group.size(); ++ii) {
+        auto& batch = *group[ii];
+        if (current[ii] && flushed[ii] != RETRY_FLUSH_VBUCKET) {
+            flushBatchPersisted_UNLOCKED(batch, flushed[ii]);
+            if (completeVBucketFlush_UNLOCKED(*batch.vb) ==
+                RETRY_FLUSH_VBUCKET) {
+                retry = true;
             }
+        }
+        batch.vb->flushBatchPending = false;
+    }
+    locks.clear();
+    flushBatchesPending -= group.size();
+    return retry;
+}
 
+bool KVBucket::gatherFlushBatch_UNLOCKED(VBucketFlushBatch& batch) {
+    VBucket& vb = *batch.vb;
+    std::vector<queued_item> items;
 
-            {
-                ReaderLockHolder rlh(vb->getStateLock());
-                if (vb->getState() == vbucket_state_active) {
-                    if (maxSeqno) {
-                        range.start = maxSeqno;
-                        range.end = maxSeqno;
-                    }
-                }
+    while (!vb.rejectQueue.empty()) {
+        items.push_back(vb.rejectQueue.front());
+        vb.rejectQueue.pop();
+    }
 
-                // Update VBstate based on the changes we have just made,
-                // then tell the rwUnderlying the 'new' state
-                // (which will persisted as part of the commit() below).
-                vbstate.lastSnapStart = range.start;
-                vbstate.lastSnapEnd = range.end;
-
-                // Track the lowest seqno written in spock and record it as
-                // the HLC epoch, a seqno which we can be sure the value has a
-                // HLC CAS.
-                vbstate.hlcCasEpochSeqno = vb->getHLCEpochSeqno();
-                if (vbstate.hlcCasEpochSeqno == HlcCasSeqnoUninitialised) {
-                    vbstate.hlcCasEpochSeqno = range.start;
-                    vb->setHLCEpochSeqno(range.start);
-                }
+    // Append any 'backfill' items (mutations added by a DCP stream).
+    vb.getBackfillItems(items);
 
-                // Track if the VB has xattrs present
-                vbstate.mightContainXattrs = vb->mightContainXattrs();
+    // Append all items outstanding for the persistence cursor.
+    hrtime_t _begin_ = gethrtime();
+    batch.range = vb.checkpointManager.getAllItemsForCursor(
+            CheckpointManager::pCursorName, items);
+    stats.persistenceCursorGetItemsHisto.add((gethrtime() - _begin_) / 1000);
 
-                // Do we need to trigger a persist of the state?
-                // If there are no "real" items to flush, and we encountered
-                // a set_vbucket_state meta-item.
-                auto options = VBStatePersist::VBSTATE_CACHE_UPDATE_ONLY;
-                if ((items_flushed == 0) && mustCheckpointVBState) {
-                    options = VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT;
-                }
+    if (items.empty()) {
+        return false;
+    }
 
-                if (rwUnderlying->snapshotVBucket(vb->getId(), vbstate,
-                                                  options) != true) {
-                    return RETRY_FLUSH_VBUCKET;
-                }
+    KVStore::optimizeWrites(items);
 
-                if (vb->setBucketCreation(false)) {
-                    LOG(EXTENSION_LOG_INFO, "VBucket %" PRIu16 " created", vbid);
-                }
-            }
+    Item* prev = nullptr;
+    batch.items.reserve(items.size());
+    for (auto& item : items) {
+        if (!item->shouldPersist()) {
+            continue;
+        }
 
-            /* Perform an explicit commit to disk if the commit
-             * interval reaches zero and if there is a non-zero number
-             * of items to flush.
-             * Or if there is a manifest item
-             */
-            if (items_flushed > 0 || sef.getCollectionsManifestItem()) {
-                commit(*rwUnderlying, sef.getCollectionsManifestItem());
+        // SystemEventFlush needs to check the item
+        batch.sef.process(item);
 
-                // Now the commit is complete, vBucket file must exist.
-                if (vb->setBucketCreation(false)) {
-                    LOG(EXTENSION_LOG_INFO, "VBucket %" PRIu16 " created", vbid);
-                }
-            }
+        if (item->getOperation() == queue_op::set_vbucket_state) {
+            // No actual item explicitly persisted to (this op exists
+            // to ensure a commit occurs with the current vbstate);
+            // flag that we must trigger a snapshot even if there are
+            // no 'real' items in the checkpoint.
+            batch.mustCheckpointVBState = true;
 
-            hrtime_t flush_end = gethrtime();
-            uint64_t trans_time = (flush_end - flush_start) / 1000000;
-
-            lastTransTimePerItem.store((items_flushed == 0) ? 0 :
-                                       static_cast<double>(trans_time) /
-                                       static_cast<double>(items_flushed));
-            stats.cumulativeFlushTime.fetch_add(trans_time);
-            stats.flusher_todo.store(0);
-            stats.totalPersistVBState++;
-
-            if (vb->rejectQueue.empty()) {
-                vb->setPersistedSnapshot(range.start, range.end);
-                uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
-                if (highSeqno > 0 &&
-                    highSeqno != vb->getPersistenceSeqno()) {
-                    vb->setPersistenceSeqno(highSeqno);
-                }
+            // Update queuing stats how this item has logically been
+            // processed.
+            --stats.diskQueueSize;
+            vb.doStatsForFlushing(*item, item->size());
+
+        } else if (!prev || prev->getKey() != item->getKey()) {
+            prev = item.get();
+            batch.items.push_back(std::move(item));
+
+        } else {
+            // Item is the same key as the previous[1] one - don't need
+            // to flush to disk.
+            // [1] Previous here really means 'next' - optimizeWrites()
+            //     above has actually re-ordered items such that items
+            //     with the same key are ordered from high->low seqno.
+            //     This means we only write the highest (i.e. newest)
+            //     item for a given key, and discard any duplicate,
+            //     older items.
+            --stats.diskQueueSize;
+            vb.doStatsForFlushing(*item, item->size());
+        }
+    }
+    return true;
+}
+
+int KVBucket::writeFlushBatch_UNLOCKED(VBucketFlushBatch& batch) {
+    KVStore *rwUnderlying = getRWUnderlying(batch.vb->getId());
+    beginFlush(*rwUnderlying);
+
+    int items_flushed = queueFlushBatch_UNLOCKED(batch);
+    if (items_flushed == RETRY_FLUSH_VBUCKET) {
+        return RETRY_FLUSH_VBUCKET;
+    }
+
+    /* Perform an explicit commit to disk if the commit
+     * interval reaches zero and if there is a non-zero number
+     * of items to flush.
+     * Or if there is a manifest item
+     */
+    if (items_flushed > 0 || batch.sef.getCollectionsManifestItem()) {
+        commit(*rwUnderlying, batch.sef.getCollectionsManifestItem());
+    }
+
+    flushBatchPersisted_UNLOCKED(batch, items_flushed);
+    return items_flushed;
+}
+
+void KVBucket::beginFlush(KVStore& rwUnderlying) {
+    while (!rwUnderlying.begin()) {
+        ++stats.beginFailed;
+        LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
+            "Retry in 1 sec ...");
+        sleep(1);
+    }
+}
+
+int KVBucket::queueFlushBatch_UNLOCKED(VBucketFlushBatch& batch) {
+    VBucketPtr& vb = batch.vb;
+    const uint16_t vbid = vb->getId();
+    KVStore *rwUnderlying = getRWUnderlying(vbid);
+    snapshot_range_t& range = batch.range;
+    int items_flushed = 0;
+
+    auto vbstate = vb->getVBucketState();
+    uint64_t maxSeqno = 0;
+    range.start = std::max(range.start, vbstate.lastSnapStart);
+
+    // The vbucket state is updated before any item is written, so if that
+    // fails nothing of the batch is in the transaction - which may be
+    // shared with other vbuckets' batches (commitFlushBatches()).
+    for (const auto& item : batch.items) {
+        ++items_flushed;
+        maxSeqno = std::max(maxSeqno, (uint64_t)item->getBySeqno());
+        vbstate.maxCas = std::max(vbstate.maxCas, item->getCas());
+        if (item->isDeleted()) {
+            vbstate.maxDeletedSeqno =
+                    std::max(vbstate.maxDeletedSeqno, item->getRevSeqno());
+        }
+    }
+
+    {
+        ReaderLockHolder rlh(vb->getStateLock());
+        if (vb->getState() == vbucket_state_active) {
+            if (maxSeqno) {
+                range.start = maxSeqno;
+                range.end = maxSeqno;
             }
         }
 
-        rwUnderlying->pendingTasks();
+        // Update VBstate based on the changes we have just made,
+        // then tell the rwUnderlying the 'new' state
+        // (which will persisted as part of the commit() below).
+        vbstate.lastSnapStart = range.start;
+        vbstate.lastSnapEnd = range.end;
 
-        if (vb->checkpointManager.getNumCheckpoints() > 1) {
-            wakeUpCheckpointRemover();
+        // Track the lowest seqno written in spock and record it as
+        // the HLC epoch, a seqno which we can be sure the value has a
+        // HLC CAS.
+        vbstate.hlcCasEpochSeqno = vb->getHLCEpochSeqno();
+        if (vbstate.hlcCasEpochSeqno == HlcCasSeqnoUninitialised) {
+            vbstate.hlcCasEpochSeqno = range.start;
+            vb->setHLCEpochSeqno(range.start);
         }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
-            uint64_t seqno = vb->getPersistenceSeqno();
-            uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-            vb->notifyHighPriorityRequests(
-                    engine, seqno, HighPriorityVBNotify::Seqno);
-            vb->notifyHighPriorityRequests(
-                    engine, chkid, HighPriorityVBNotify::ChkPersistence);
-            if (chkid > 0 && chkid != vb->getPersistenceCheckpointId()) {
-                vb->setPersistenceCheckpointId(chkid);
+        // Track if the VB has xattrs present
+        vbstate.mightContainXattrs = vb->mightContainXattrs();
+
+        // Do we need to trigger a persist of the state?
+        // If there are no "real" items to flush, and we encountered
+        // a set_vbucket_state meta-item.
+        auto options = VBStatePersist::VBSTATE_CACHE_UPDATE_ONLY;
+        if ((items_flushed == 0) && batch.mustCheckpointVBState) {
+            options = VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT;
+        }
+
+        if (rwUnderlying->snapshotVBucket(vb->getId(), vbstate,
+                                          options) != true) {
+            // Nothing was written; flush the items again next time.
+            for (auto& item : batch.items) {
+                vb->rejectQueue.push(std::move(item));
             }
-        } else {
+            batch.items.clear();
             return RETRY_FLUSH_VBUCKET;
         }
+
+        if (vb->setBucketCreation(false)) {
+            LOG(EXTENSION_LOG_INFO, "VBucket %" PRIu16 " created", vbid);
+        }
+    }
+
+    std::list<PersistenceCallback*>& pcbs = rwUnderlying->getPersistenceCbList();
+    for (const auto& item : batch.items) {
+        PersistenceCallback *cb = flushOneDelOrSet(item, vb);
+        if (cb) {
+            pcbs.push_back(cb);
+        }
+        ++stats.flusher_todo;
     }
 
     return items_flushed;
 }
 
+void KVBucket::flushBatchPersisted_UNLOCKED(VBucketFlushBatch& batch,
+                                            int items_flushed) {
+    VBucketPtr& vb = batch.vb;
+    const uint16_t vbid = vb->getId();
+    KVStore *rwUnderlying = getRWUnderlying(vbid);
+    snapshot_range_t& range = batch.range;
+
+    if (items_flushed > 0 || batch.sef.getCollectionsManifestItem()) {
+        // Now the commit is complete, vBucket file must exist.
+        if (vb->setBucketCreation(false)) {
+            LOG(EXTENSION_LOG_INFO, "VBucket %" PRIu16 " created", vbid);
+        }
+    }
+
+    hrtime_t flush_end = gethrtime();
+    uint64_t trans_time = (flush_end - batch.flushStart) / 1000000;
+
+    lastTransTimePerItem.store((items_flushed == 0) ? 0 :
+                               static_cast<double>(trans_time) /
+                               static_cast<double>(items_flushed));
+    stats.cumulativeFlushTime.fetch_add(trans_time);
+    stats.flusher_todo.store(0);
+    stats.totalPersistVBState++;
+
+    if (vb->rejectQueue.empty()) {
+        vb->setPersistedSnapshot(range.start, range.end);
+        uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
+        if (highSeqno > 0 &&
+            highSeqno != vb->getPersistenceSeqno()) {
+            vb->setPersistenceSeqno(highSeqno);
+        }
+    }
+}
+
+int KVBucket::completeVBucketFlush_UNLOCKED(VBucket& vb) {
+    if (vb.checkpointManager.getNumCheckpoints() > 1) {
+        wakeUpCheckpointRemover();
+    }
+
+    if (!vb.rejectQueue.empty()) {
+        return RETRY_FLUSH_VBUCKET;
+    }
+
+    vb.checkpointManager.itemsPersisted();
+    uint64_t seqno = vb.getPersistenceSeqno();
+    uint64_t chkid = vb.checkpointManager.getPersistenceCursorPreChkId();
+    vb.notifyHighPriorityRequests(engine, seqno, HighPriorityVBNotify::Seqno);
+    vb.notifyHighPriorityRequests(
+            engine, chkid, HighPriorityVBNotify::ChkPersistence);
+    if (chkid > 0 && chkid != vb.getPersistenceCheckpointId()) {
+        vb.setPersistenceCheckpointId(chkid);
+    }
+    return 0;
+}
+
 void KVBucket::commit(KVStore& kvstore, const Item* collectionsManifest) {
     std::list<PersistenceCallback*>& pcbs = kvstore.getPersistenceCbList();
     BlockTimer timer(&stats.diskCommitHisto, "disk_commit", stats.timingLog);
@@ -2391,6 +2649,15 @@ void KVBucket::warmupCompleted() {
     // persisted.
     scheduleVBStatePersist();
 
+    // Warmup no longer loads items over any deletes made while it served
+    // traffic.
+    for (auto vbid : vbMap.getBuckets()) {
+        VBucketPtr vb = getVBucket(vbid);
+        if (vb) {
+            vb->releasePersistedDeletes();
+        }
+    }
+
     if (engine.getConfiguration().getAlogPath().length() > 0) {
 
         if (engine.getConfiguration().isAccessScannerEnabled()) {
@@ -2475,6 +2742,10 @@ bool KVBucket::isWarmingUp() {
     return warmupTask && !warmupTask->isComplete();
 }
 
+bool KVBucket::isWarmupServingTraffic() {
+    return isWarmingUp() && warmupTask->isServingTraffic();
+}
+
 bool KVBucket::shouldSetVBStateBlock(const void* cookie) {
     if (warmupTask) {
         return warmupTask->shouldSetVBStateBlock(cookie);
@@ -2670,6 +2941,30 @@ void KVBucket::setAllBloomFilters(bool to) {
     }
 }
 
+std::string KVBucket::getBloomFilterFile(uint16_t vbid) {
+    return engine.getConfiguration().getDbname() + "/" +
+           std::to_string(vbid) + ".bloom";
+}
+
+std::string KVBucket::getMetadataImageFile(uint16_t vbid) {
+    return engine.getConfiguration().getDbname() + "/" +
+           std::to_string(vbid) + ".metaimage";
+}
+
+void KVBucket::persistBloomFilters() {
+    size_t persisted = 0;
+    for (VBucketMap::id_type vbid = 0; vbid < vbMap.getSize(); vbid++) {
+        VBucketPtr vb = vbMap.getBucket(vbid);
+        if (vb && vb->persistFilter(getBloomFilterFile(vbid))) {
+            ++persisted;
+        }
+    }
+    LOG(EXTENSION_LOG_NOTICE,
+        "KVBucket::persistBloomFilters: Persisted %" PRIu64
+        " bloom filter(s)",
+        uint64_t(persisted));
+}
+
 void KVBucket::visit(VBucketVisitor &visitor)
 {
     for (VBucketMap::id_type vbid = 0; vbid < vbMap.getSize(); ++vbid) {
@@ -2770,6 +3065,9 @@ void KVBucket::resetUnderlyingStats(void)
         KVShard *shard = vbMap.shards[i].get();
         shard->getRWUnderlying()->resetStats();
         shard->getROUnderlying()->resetStats();
+        if (shard->getBgFetcher()) {
+            shard->getBgFetcher()->resetStats();
+        }
     }
 
     for (size_t i = 0; i < GlobalTask::allTaskIds.size(); i++) {
@@ -2805,6 +3103,11 @@ void KVBucket::addKVStoreTimingStats(ADD_STAT add_stat, const void* cookie) {
         for (auto* store : underlyingSet) {
             store->addTimingStats(add_stat, cookie);
         }
+
+        if (auto* bgFetcher = vbMap.shards[i]->getBgFetcher()) {
+            bgFetcher->addStats(
+                    "bgfetcher_" + std::to_string(i), add_stat, cookie);
+        }
     }
 }
 
@@ -2853,6 +3156,11 @@ TaskStatus KVBucket::rollback(uint16_t vbid, uint64_t rollbackSeqno) {
         return TaskStatus::Abort;
     }
 
+    if (vb->flushBatchPending) {
+        // Wait for the flusher to commit the items it has already taken.
+        return TaskStatus::Reschedule;
+    }
+
     ReaderLockHolder rlh(vb->getStateLock());
     if (vb->getState() == vbucket_state_replica) {
         uint64_t prevHighSeqno = static_cast<uint64_t>
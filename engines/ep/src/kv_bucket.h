@@ -21,6 +21,7 @@
 #include "mutation_log.h"
 #include "storeddockey.h"
 #include "stored-value.h"
+#include "systemevent.h"
 #include "task_type.h"
 #include "vbucket.h"
 #include "vbucketmap.h"
@@ -35,6 +36,23 @@ namespace Collections {
 class Manager;
 }
 
+/**
+ * The items gathered for persisting one vbucket, when flushing in two steps:
+ * KVBucket::prepareFlushBatch() collects, sorts and de-duplicates them and
+ * KVBucket::commitFlushBatch() writes and commits them.
+ */
+struct VBucketFlushBatch {
+    VBucketPtr vb;
+    // Items to write - one per key, in the order optimizeWrites() sorted them.
+    std::vector<queued_item> items;
+    snapshot_range_t range = {0, 0};
+    // A set_vbucket_state meta-item was gathered, so the vbucket state must
+    // be persisted even if there are no items to write.
+    bool mustCheckpointVBState = false;
+    SystemEventFlush sef;
+    hrtime_t flushStart = 0;
+};
+
 /**
  * VBucket visitor callback adaptor.
  */
@@ -599,6 +617,18 @@ public:
 
     void setAllBloomFilters(bool to);
 
+    /// The file a vbucket's bloom filter is kept in across a restart.
+    std::string getBloomFilterFile(uint16_t vbid);
+
+    /// The file a vbucket's metadata image is kept in across a restart.
+    std::string getMetadataImageFile(uint16_t vbid);
+
+    /**
+     * Write every vbucket's bloom filter to disk, for warmup to restore.
+     * Only valid once everything has been persisted, at shutdown.
+     */
+    void persistBloomFilters();
+
     float getBfiltersResidencyThreshold() {
         return bfilterResidencyThreshold;
     }
@@ -633,6 +663,8 @@ public:
 
     bool isWarmingUp();
 
+    bool isWarmupServingTraffic();
+
     /**
      * Method checks with Warmup if a setVBState should block.
      * On returning true, Warmup will have saved the cookie ready for
@@ -658,6 +690,50 @@ public:
      */
     int flushVBucket(uint16_t vbid);
 
+    /**
+     * First step of a pipelined flush: gather the items waiting for
+     * persistence in a given vbucket into a batch, ready for
+     * commitFlushBatch(). Doesn't touch the vbucket's KVStore transaction, so
+     * may run while a batch for another vbucket of the same shard is being
+     * committed.
+     *
+     * At most one batch per vbucket may be outstanding; until it has been
+     * committed further calls for the vbucket return RETRY_FLUSH_VBUCKET.
+     *
+     * @param vbid The id of the vbucket to flush
+     * @param batch Set to the gathered batch. batch.vb is left null if there
+     *        is nothing to commit.
+     * @return The number of items to be flushed, or RETRY_FLUSH_VBUCKET
+     */
+    int prepareFlushBatch(uint16_t vbid, VBucketFlushBatch& batch);
+
+    /**
+     * Second step of a pipelined flush: write and commit a batch returned by
+     * prepareFlushBatch(). If the vbucket has since been deleted the batch is
+     * discarded.
+     *
+     * @return The number of items flushed, or RETRY_FLUSH_VBUCKET
+     */
+    int commitFlushBatch(VBucketFlushBatch& batch);
+
+    /**
+     * Give up on a batch returned by prepareFlushBatch() without writing
+     * it (the flusher was force-stopped): its items are returned to the
+     * vbucket's rejectQueue, and the vbucket may be flushed again.
+     */
+    void abandonFlushBatch(VBucketFlushBatch& batch);
+
+    /**
+     * Write and commit several batches returned by prepareFlushBatch(), all
+     * for vbuckets of the same shard, in a single KVStore transaction so the
+     * KVStore can make them durable together (group commit). A batch with a
+     * collections manifest update is committed on its own.
+     *
+     * @return true if any of the vbuckets must be flushed again
+     */
+    bool commitFlushBatches(
+            std::vector<std::unique_ptr<VBucketFlushBatch>>& batches);
+
     void commit(KVStore& kvstore, const Item* collectionsManifest);
 
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
@@ -818,6 +894,13 @@ protected:
     void warmupCompleted();
     void stopWarmup(void);
 
+    /**
+     * Record a background fetch completed while warmup serves traffic.
+     *
+     * @param init the time when the background fetch was queued
+     */
+    void recordWarmupBGFetch(ProcessClock::time_point init);
+
     /**
      * Compaction of a database file
      *
@@ -826,6 +909,52 @@ protected:
     void compactInternal(compaction_ctx *ctx);
 
     void flushOneDeleteAll(void);
+
+    /**
+     * Gather the items waiting for persistence in batch.vb. The vbucket's
+     * flush mutex must be held.
+     *
+     * @return false if there was nothing to gather
+     */
+    bool gatherFlushBatch_UNLOCKED(VBucketFlushBatch& batch);
+
+    /**
+     * Write the gathered items and commit them along with the vbucket state.
+     * The vbucket's flush mutex must be held.
+     *
+     * @return The number of items flushed, or RETRY_FLUSH_VBUCKET
+     */
+    int writeFlushBatch_UNLOCKED(VBucketFlushBatch& batch);
+
+    /// Begin a KVStore transaction, retrying until it succeeds.
+    void beginFlush(KVStore& rwUnderlying);
+
+    /**
+     * Write the gathered items and the vbucket state to the current KVStore
+     * transaction. The vbucket's flush mutex must be held.
+     *
+     * @return The number of items written, or RETRY_FLUSH_VBUCKET if the
+     *         vbucket state couldn't be updated, in which case nothing was
+     *         written and the items are moved to the vbucket's rejectQueue
+     */
+    int queueFlushBatch_UNLOCKED(VBucketFlushBatch& batch);
+
+    /**
+     * Update the vbucket and flush stats once the transaction holding the
+     * batch has been committed. The vbucket's flush mutex must be held.
+     */
+    void flushBatchPersisted_UNLOCKED(VBucketFlushBatch& batch,
+                                      int items_flushed);
+
+    /**
+     * Post-flush processing of a vbucket (checkpoint and high priority
+     * request notifications). The vbucket's flush mutex must be held.
+     *
+     * @return RETRY_FLUSH_VBUCKET if items were rejected and must be flushed
+     *         again, otherwise 0
+     */
+    int completeVBucketFlush_UNLOCKED(VBucket& vb);
+
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           VBucketPtr &vb);
 
@@ -892,9 +1021,15 @@ protected:
     /* Array of mutexes for each vbucket
      * Used by flush operations: flushVB, deleteVB, compactVB, snapshotVB */
     std::mutex                          *vb_mutexes;
+    // If non-null, the locks shared by all vBuckets' HashTables (see
+    // ht_shared_locks).
+    std::shared_ptr<HashTable::LockSet> sharedHtLocks;
     std::deque<MutationLog>       accessLog;
 
     std::atomic<bool> diskDeleteAll;
+    // Number of batches prepared by prepareFlushBatch() but not yet
+    // committed, across all shards.
+    std::atomic<size_t> flushBatchesPending;
     struct DeleteAllTaskCtx {
         DeleteAllTaskCtx() : delay(true), cookie(NULL) {
         }
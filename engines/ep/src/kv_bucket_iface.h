@@ -652,6 +652,12 @@ public:
 
     virtual bool isWarmingUp() = 0;
 
+    /**
+     * @return true if warmup is in progress, and data traffic is served
+     *         while it loads values (see warmup_serve_traffic)
+     */
+    virtual bool isWarmupServingTraffic() = 0;
+
     virtual bool maybeEnableTraffic(void) = 0;
 
     /**
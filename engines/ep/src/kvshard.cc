@@ -28,10 +28,13 @@
 #include "kvshard.h"
 
 /* [EPHE TODO]: Consider not using KVShard for ephemeral bucket */
-KVShard::KVShard(uint16_t id, KVBucket& kvBucket)
+KVShard::KVShard(uint16_t id,
+                 KVBucket& kvBucket,
+                 std::shared_ptr<CouchBlockCache> blockCache)
     : kvConfig(kvBucket.getEPEngine().getConfiguration(), id),
       vbuckets(kvConfig.getMaxVBuckets()),
       highPriorityCount(0) {
+    kvConfig.setBlockCache(std::move(blockCache));
     const std::string backend = kvConfig.getBackend();
     if (backend == "couchdb") {
         auto stores = KVStoreFactory::create(kvConfig);
@@ -54,6 +54,7 @@
  *
  */
 class BgFetcher;
+class CouchBlockCache;
 class Flusher;
 class KVBucket;
 
@@ -61,7 +62,13 @@ class KVShard {
 public:
     // Identifier for a KVShard
     typedef uint16_t id_type;
-    KVShard(KVShard::id_type id, KVBucket& store);
+    /**
+     * @param blockCache block cache shared by all shards' KVStores (null
+     *        for none)
+     */
+    KVShard(KVShard::id_type id,
+            KVBucket& store,
+            std::shared_ptr<CouchBlockCache> blockCache);
     ~KVShard();
 
     KVStore* getRWUnderlying() {
@@ -32,6 +32,7 @@
 #include "statwriter.h"
 #include "kvstore.h"
 #include "vbucket.h"
+#include "vbucket_bgfetch_item.h"
 #include <platform/dirutils.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -43,6 +44,13 @@ KVStoreConfig::KVStoreConfig(Configuration& config, uint16_t shardid)
                     config.getBackend(),
                     shardid,
                     config.isCollectionsPrototypeEnabled()) {
+    readBackend = config.getCouchstoreReadBackend();
+    readQueueDepth = config.getCouchstoreReadQueueDepth();
+    dbHandleCacheSize = config.getCouchstoreDbHandleCacheSize();
+    valueCompression = config.getCouchstoreValueCompression();
+    valueLogThreshold = config.getCouchstoreValueLogThreshold();
+    valueLogGcRatio = config.getCouchstoreValueLogGcRatio();
+    rocksdbBlockCacheSize = config.getRocksdbBlockCacheSize();
 }
 
 KVStoreConfig::KVStoreConfig(uint16_t _maxVBuckets,
@@ -58,7 +66,14 @@ KVStoreConfig::KVStoreConfig(uint16_t _maxVBuckets,
       shardId(_shardId),
       logger(&global_logger),
       buffered(true),
-      persistDocNamespace(_persistDocNamespace) {
+      persistDocNamespace(_persistDocNamespace),
+      readBackend("sync"),
+      readQueueDepth(16),
+      dbHandleCacheSize(0),
+      valueCompression("couchstore"),
+      valueLogThreshold(0),
+      valueLogGcRatio(0.5),
+      rocksdbBlockCacheSize(0) {
 }
 
 KVStoreConfig& KVStoreConfig::setLogger(Logger& _logger) {
@@ -71,6 +86,48 @@ KVStoreConfig& KVStoreConfig::setBuffered(bool _buffered) {
     return *this;
 }
 
+KVStoreConfig& KVStoreConfig::setReadBackend(const std::string& backend) {
+    readBackend = backend;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setReadQueueDepth(size_t depth) {
+    readQueueDepth = depth;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setDbHandleCacheSize(size_t size) {
+    dbHandleCacheSize = size;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setValueCompression(
+        const std::string& compression) {
+    valueCompression = compression;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setValueLogThreshold(size_t threshold) {
+    valueLogThreshold = threshold;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setValueLogGcRatio(float ratio) {
+    valueLogGcRatio = ratio;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setRocksdbBlockCacheSize(size_t size) {
+    rocksdbBlockCacheSize = size;
+    return *this;
+}
+
+KVStoreConfig& KVStoreConfig::setBlockCache(
+        std::shared_ptr<CouchBlockCache> cache) {
+    blockCache = std::move(cache);
+    return *this;
+}
+
 KVStoreRWRO KVStoreFactory::create(KVStoreConfig& config) {
     std::string backend = config.getBackend();
     if (backend == "couchdb") {
@@ -254,6 +311,16 @@ void KVStore::addStats(ADD_STAT add_stat, const void *c) {
     addStat(prefix, "io_num_write", st.io_num_write, add_stat, c);
     addStat(prefix, "io_read_bytes", st.io_read_bytes, add_stat, c);
     addStat(prefix, "io_write_bytes", st.io_write_bytes, add_stat, c);
+    addStat(prefix, "io_bgfetch_reads_merged", st.io_bgfetch_reads_merged,
+            add_stat, c);
+    addStat(prefix, "io_bgfetch_read_bytes", st.io_bgfetch_read_bytes,
+            add_stat, c);
+    addStat(prefix, "io_value_log_write_bytes", st.io_value_log_write_bytes,
+            add_stat, c);
+    addStat(prefix, "io_value_log_gc_bytes", st.io_value_log_gc_bytes,
+            add_stat, c);
+    addStat(prefix, "block_cache_hits", st.blockCacheHits, add_stat, c);
+    addStat(prefix, "block_cache_misses", st.blockCacheMisses, add_stat, c);
 
     const size_t read = st.fsStats.totalBytesRead.load() +
                         st.fsStatsCompaction.totalBytesRead.load();
@@ -289,6 +356,10 @@ void KVStore::addTimingStats(ADD_STAT add_stat, const void *c) {
     addStat(prefix, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix, "bulkSize",    st.batchSize,        add_stat, c);
+    addStat(prefix, "group_commit", st.groupCommitHisto, add_stat, c);
+    addStat(prefix, "group_sync",  st.groupSyncHisto,   add_stat, c);
+    addStat(prefix, "groupSize",   st.groupSize,        add_stat, c);
+    addStat(prefix, "bgFetchReadSize", st.bgFetchReadSize, add_stat, c);
 
     //file ops stats
     addStat(prefix, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
@@ -299,12 +370,13 @@ void KVStore::addTimingStats(ADD_STAT add_stat, const void *c) {
     addStat(prefix, "fsReadSeek",  st.fsStats.readSeekHisto,  add_stat, c);
 }
 
-void KVStore::optimizeWrites(std::vector<queued_item>& items) {
-    if (isReadOnly()) {
-        throw std::logic_error(
-                "KVStore::optimizeWrites: Not valid on a "
-                "read-only object");
+void KVStore::getMultiVBuckets(multi_vb_bgfetch_queue_t& itms) {
+    for (auto& vb : itms) {
+        getMulti(vb.first, vb.second);
     }
+}
+
+void KVStore::optimizeWrites(std::vector<queued_item>& items) {
     if (items.empty()) {
         return;
     }
@@ -32,6 +32,7 @@
 #include <cstring>
 #include <list>
 #include <map>
+#include <memory>
 #include <relaxed_atomic.h>
 #include <string>
 #include <unordered_map>
@@ -39,6 +40,7 @@
 #include <vector>
 
 /* Forward declarations */
+class CouchBlockCache;
 class Item;
 class KVStore;
 class PersistenceCallback;
@@ -48,6 +50,8 @@ struct vb_bgfetch_item_ctx_t;
 
 using vb_bgfetch_queue_t =
         std::unordered_map<StoredDocKey, vb_bgfetch_item_ctx_t>;
+/// The bgfetch queues of several vbuckets, by vbucket id.
+using multi_vb_bgfetch_queue_t = std::map<uint16_t, vb_bgfetch_queue_t>;
 
 enum class GetMetaOnly { Yes, No };
 
@@ -339,6 +343,12 @@ public:
       io_num_write(0),
       io_read_bytes(0),
       io_write_bytes(0),
+      io_bgfetch_reads_merged(0),
+      io_bgfetch_read_bytes(0),
+      io_value_log_write_bytes(0),
+      io_value_log_gc_bytes(0),
+      blockCacheHits(0),
+      blockCacheMisses(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
       writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
     }
@@ -355,6 +365,12 @@ public:
         numDelFailure = 0;
         numOpenFailure = 0;
         numVbSetFailure = 0;
+        io_bgfetch_reads_merged = 0;
+        io_bgfetch_read_bytes = 0;
+        io_value_log_write_bytes = 0;
+        io_value_log_gc_bytes = 0;
+        blockCacheHits = 0;
+        blockCacheMisses = 0;
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -366,6 +382,10 @@ public:
         commitHisto.reset();
         saveDocsHisto.reset();
         batchSize.reset();
+        groupCommitHisto.reset();
+        groupSyncHisto.reset();
+        groupSize.reset();
+        bgFetchReadSize.reset();
         fsStats.reset();
     }
 
@@ -393,6 +413,18 @@ public:
     Couchbase::RelaxedAtomic<size_t> io_read_bytes;
     //! Number of bytes written (key + value + application rev metadata)
     Couchbase::RelaxedAtomic<size_t> io_write_bytes;
+    //! Number of bgfetch body reads saved by merging them with neighbours
+    Couchbase::RelaxedAtomic<size_t> io_bgfetch_reads_merged;
+    //! Number of bytes read ahead of bgfetches (including merged gaps)
+    Couchbase::RelaxedAtomic<size_t> io_bgfetch_read_bytes;
+    //! Number of bytes appended to value logs by commits
+    Couchbase::RelaxedAtomic<size_t> io_value_log_write_bytes;
+    //! Number of bytes appended to value logs by compaction (live values
+    //! copied out of the files collected)
+    Couchbase::RelaxedAtomic<size_t> io_value_log_gc_bytes;
+    //! Number of blocks read from / missing in the block cache
+    Couchbase::RelaxedAtomic<size_t> blockCacheHits;
+    Couchbase::RelaxedAtomic<size_t> blockCacheMisses;
 
     /* for flush and vb delete, no error handling in KVStore, such
      * failure should be tracked in MC-engine  */
@@ -415,6 +447,14 @@ public:
     Histogram<hrtime_t> saveDocsHisto;
     // Batch size while saving documents
     Histogram<size_t> batchSize;
+    // Time taken to commit a group of vbuckets together
+    Histogram<hrtime_t> groupCommitHisto;
+    // Time spent making a group commit durable (its deferred syncs)
+    Histogram<hrtime_t> groupSyncHisto;
+    // Number of vbuckets in each group commit
+    Histogram<size_t> groupSize;
+    // Bytes read ahead of each batched bgfetch
+    Histogram<size_t> bgFetchReadSize;
     //Time spent in vbucket snapshot
     Histogram<hrtime_t> snapshotHisto;
 
@@ -579,6 +619,103 @@ public:
      */
     KVStoreConfig& setBuffered(bool _buffered);
 
+    /**
+     * How reads are issued: "sync" (directly by the reading thread), or the
+     * AsyncReader backend to use ("auto", "uring" or "pread").
+     *
+     * Only recognised by CouchKVStore
+     */
+    const std::string& getReadBackend() const {
+        return readBackend;
+    }
+
+    KVStoreConfig& setReadBackend(const std::string& backend);
+
+    /**
+     * Maximum number of reads outstanding when the read backend isn't
+     * "sync".
+     *
+     * Only recognised by CouchKVStore
+     */
+    size_t getReadQueueDepth() const {
+        return readQueueDepth;
+    }
+
+    KVStoreConfig& setReadQueueDepth(size_t depth);
+
+    /**
+     * Cache of file blocks shared by the bucket's KVStores, or null for
+     * none.
+     *
+     * Only recognised by CouchKVStore
+     */
+    const std::shared_ptr<CouchBlockCache>& getBlockCache() const {
+        return blockCache;
+    }
+
+    KVStoreConfig& setBlockCache(std::shared_ptr<CouchBlockCache> cache);
+
+    /**
+     * Maximum number of read-only file handles kept open for reuse by gets
+     * and bgfetches (0 for none).
+     *
+     * Only recognised by CouchKVStore
+     */
+    size_t getDbHandleCacheSize() const {
+        return dbHandleCacheSize;
+    }
+
+    KVStoreConfig& setDbHandleCacheSize(size_t size);
+
+    /**
+     * How document values are compressed on disk: "couchstore" (by
+     * couchstore, as each body is written and read) or "snappy" (values are
+     * stored snappy-compressed with their datatype, and read back as such).
+     *
+     * Only recognised by CouchKVStore
+     */
+    const std::string& getValueCompression() const {
+        return valueCompression;
+    }
+
+    KVStoreConfig& setValueCompression(const std::string& compression);
+
+    /**
+     * Size (as stored) from which values are kept in the vbucket's value
+     * log rather than its file (0 to keep them all in the file).
+     *
+     * Only recognised by CouchKVStore
+     */
+    size_t getValueLogThreshold() const {
+        return valueLogThreshold;
+    }
+
+    KVStoreConfig& setValueLogThreshold(size_t threshold);
+
+    /**
+     * Fraction of a value log file which must be garbage for compaction to
+     * collect it.
+     *
+     * Only recognised by CouchKVStore
+     */
+    float getValueLogGcRatio() const {
+        return valueLogGcRatio;
+    }
+
+    KVStoreConfig& setValueLogGcRatio(float ratio);
+
+    /**
+     * Bytes of RocksDB blocks cached, split evenly between the shards (0
+     * for no cache).
+     *
+     * Only recognised by RocksDBKVStore
+     */
+    size_t getRocksdbBlockCacheSize() const {
+        return rocksdbBlockCacheSize;
+    }
+
+    KVStoreConfig& setRocksdbBlockCacheSize(size_t size);
+
     bool shouldPersistDocNamespace() const {
         return persistDocNamespace;
     }
@@ -596,6 +733,14 @@ private:
     Logger* logger;
     bool buffered;
     bool persistDocNamespace;
+    std::string readBackend;
+    size_t readQueueDepth;
+    std::shared_ptr<CouchBlockCache> blockCache;
+    size_t dbHandleCacheSize;
+    std::string valueCompression;
+    size_t valueLogThreshold;
+    float valueLogGcRatio;
+    size_t rocksdbBlockCacheSize;
 };
 
 class IORequest {
@@ -741,6 +886,13 @@ public:
         throw std::runtime_error("Backend does not support getMulti()");
     }
 
+    /**
+     * Get multiple items of several vbuckets. Backends keeping many
+     * vbuckets in one file (getNumVbsPerFile() > 1) can read them together;
+     * by default each vbucket's items are fetched in turn by getMulti().
+     */
+    virtual void getMultiVBuckets(multi_vb_bgfetch_queue_t& itms);
+
     /**
      * Get the number of vbuckets in a single database file
      *
@@ -852,8 +1004,11 @@ public:
     /**
      * This method is called before persisting a batch of data if you'd like to
      * do stuff to them that might improve performance at the IO layer.
+     *
+     * Touches no KVStore state, so may be called while the KVStore is
+     * committing another batch (as a pipelining flusher does).
      */
-    void optimizeWrites(std::vector<queued_item>& items);
+    static void optimizeWrites(std::vector<queued_item>& items);
 
     std::list<PersistenceCallback *>& getPersistenceCbList() {
         return pcbs;
@@ -861,7 +1016,8 @@ public:
 
     /**
      * This method is called after persisting a batch of data to perform any
-     * pending tasks on the underlying KVStore instance.
+     * pending tasks on the underlying KVStore instance. Called by whichever
+     * thread commits to the KVStore, never concurrently with a commit.
      */
     virtual void pendingTasks() = 0;
 
@@ -19,6 +19,7 @@
 
 #include <algorithm>
 #include <fcntl.h>
+#include <platform/compress.h>
 #include <platform/strerror.h>
 #include <string>
 #include <sys/stat.h>
@@ -254,8 +255,7 @@ static bool writeFully(file_handle_t fd, const uint8_t *buf, size_t nbytes) {
 
 MutationLog::MutationLog(const std::string &path,
                          const size_t bs)
-    : paddingHisto(GrowingWidthGenerator<uint32_t>(0, 8, 1.5), 32),
-    logPath(path),
+    : logPath(path),
     blockSize(bs),
     blockPos(HEADER_RESERVED),
     file(INVALID_FILE_VALUE),
@@ -294,10 +294,15 @@ void MutationLog::disable() {
     }
 }
 
-void MutationLog::newItem(uint16_t vbucket, const DocKey& key) {
+void MutationLog::newItem(uint16_t vbucket,
+                          const DocKey& key,
+                          uint64_t bySeqno) {
     if (isEnabled()) {
-        MutationLogEntry* mle = MutationLogEntry::newEntry(
-                entryBuffer.get(), MutationLogType::New, vbucket, key);
+        MutationLogEntry* mle = MutationLogEntry::newEntry(entryBuffer.get(),
+                                                           MutationLogType::New,
+                                                           vbucket,
+                                                           key,
+                                                           bySeqno);
         writeEntry(mle);
     }
 }
@@ -398,10 +403,11 @@ void MutationLog::readInitialBlock() {
 
     headerBlock.set(buf);
 
-    // Check the version is one we can handle, V1 and V2.
+    // Check the version is one we can handle, V1, V2 and V3.
     switch (headerBlock.version()) {
     case MutationLogVersion::V1:
     case MutationLogVersion::V2:
+    case MutationLogVersion::V3:
         break;
     default: {
         std::stringstream ss;
@@ -454,7 +460,12 @@ bool MutationLog::prepareWrites() {
         if (seek_result < 0) {
             return false;
         }
-        int64_t unaligned_bytes = seek_result % blockSize;
+        // Compressed blocks vary in length, so only the blocks of older
+        // versions are aligned.
+        int64_t unaligned_bytes = 0;
+        if (headerBlock.version() < MutationLogVersion::V3) {
+            unaligned_bytes = seek_result % blockSize;
+        }
         if (unaligned_bytes != 0) {
             LOG(EXTENSION_LOG_WARNING,
                 "WARNING: filesize %" PRId64 " not block aligned '%s': %s",
@@ -663,21 +674,37 @@ bool MutationLog::flush() {
         needWriteAccess();
         BlockTimer timer(&flushTimeHisto);
 
-        if (blockPos < blockSize) {
-            size_t padding(blockSize - blockPos);
-            memset(blockBuffer.get() + blockPos, 0x00, padding);
-            paddingHisto.add(padding);
+        // The block's entries are written snappy-compressed (and unpadded),
+        // preceded by the 2 byte crc, 2 byte item count and 4 byte length
+        // of the compressed entries.
+        cb::compression::Buffer deflated;
+        if (!cb::compression::deflate(
+                    cb::compression::Algorithm::Snappy,
+                    reinterpret_cast<const char*>(blockBuffer.get()) +
+                            HEADER_RESERVED,
+                    blockPos - HEADER_RESERVED,
+                    deflated)) {
+            disabled = true;
+            LOG(EXTENSION_LOG_WARNING,
+                "Disabling access log due to compression failure");
+            return false;
         }
 
-        entries = htons(entries);
-        memcpy(blockBuffer.get() + 2, &entries, sizeof(entries));
+        std::vector<uint8_t> block(COMPRESSED_HEADER_RESERVED + deflated.len);
+        uint16_t count(htons(entries));
+        memcpy(block.data() + 2, &count, sizeof(count));
+        uint32_t length(htonl(uint32_t(deflated.len)));
+        memcpy(block.data() + 4, &length, sizeof(length));
+        memcpy(block.data() + COMPRESSED_HEADER_RESERVED,
+               deflated.data.get(),
+               deflated.len);
 
-        uint32_t crc32(crc32buf(blockBuffer.get() + 2, blockSize - 2));
+        uint32_t crc32(crc32buf(block.data() + 2, block.size() - 2));
         uint16_t crc16(htons(crc32 & 0xffff));
-        memcpy(blockBuffer.get(), &crc16, sizeof(crc16));
+        memcpy(block.data(), &crc16, sizeof(crc16));
 
-        if (writeFully(file, blockBuffer.get(), blockSize)) {
-            logSize.fetch_add(blockSize);
+        if (writeFully(file, block.data(), block.size())) {
+            logSize.fetch_add(block.size());
             blockPos = HEADER_RESERVED;
             entries = 0;
         } else {
@@ -708,6 +735,11 @@ void MutationLog::writeEntry(MutationLogEntry *mle) {
                 "a closed log");
     }
     needWriteAccess();
+    if (headerBlock.version() != MutationLogVersion::Current) {
+        throw WriteException(
+                "MutationLog::writeEntry: Cannot append to a version " +
+                std::to_string(int(headerBlock.version())) + " log");
+    }
 
     size_t len(mle->len());
     if (blockPos + len > blockSize) {
@@ -777,6 +809,11 @@ void MutationLog::iterator::prepItem() {
                 MutationLogEntryV2::newEntry(p, bufferBytesRemaining())->len();
         break;
     }
+    case MutationLogVersion::V3: {
+        copyLen =
+                MutationLogEntryV3::newEntry(p, bufferBytesRemaining())->len();
+        break;
+    }
     }
 
     std::copy_n(p, copyLen, entryBuf.begin());
@@ -792,6 +829,10 @@ size_t MutationLog::iterator::getCurrentEntryLen() const {
         return MutationLogEntryV2::newEntry(entryBuf.begin(), entryBuf.size())
                 ->len();
     }
+    case MutationLogVersion::V3: {
+        return MutationLogEntryV3::newEntry(entryBuf.begin(), entryBuf.size())
+                ->len();
+    }
     }
     throw std::logic_error(
             "MutationLog::iterator::getCurrentEntryLen unknown version " +
@@ -831,22 +872,20 @@ MutationLog::MutationLogEntryHolder MutationLog::iterator::upgradeEntry()
     // The addition of more source versions would mean adding more const
     // pointers here.
     const MutationLogEntryV1* mleV1 = nullptr;
+    const MutationLogEntryV2* mleV2 = nullptr;
     std::unique_ptr<uint8_t[]> allocated;
 
-    // With only two versions this code is a little unnecessary but will
-    // cause the addition of V3 to fail compile. The aim is that the addition of
-    // V3 should now be obvious. I.e. we can step V1->V2->V3 or V2->V3
+    // The addition of V4 will fail compile until handled here and below. We
+    // step V1->V2->V3 or V2->V3
     switch (log->headerBlock.version()) {
     case MutationLogVersion::V1: {
         mleV1 = MutationLogEntryV1::newEntry(entryBuf.begin(), entryBuf.size());
         break;
     }
-    /* If V3 exists then add a case for V2, for example:
     case MutationLogVersion::V2: {
         mleV2 = MutationLogEntryV2::newEntry(entryBuf.begin(), entryBuf.size());
         break;
     }
-    */
     case MutationLogVersion::Current: {
         throw std::invalid_argument(
                 "MutationLog::iterator::upgradeEntry cannot"
@@ -869,25 +908,24 @@ MutationLog::MutationLogEntryHolder MutationLog::iterator::upgradeEntry()
         allocated = std::make_unique<uint8_t[]>(
                 MutationLogEntryV2::len(mleV1->getKeylen()));
 
-        // Now in-place construct into the buffer
-        (void) new (allocated.get()) MutationLogEntryV2(*mleV1);
-        // If adding more cases, we should assign the above "new" pointer to a
-        // mleV2 and allow the next case to read it.
+        // Now in-place construct into the buffer and assign to mleV2 for the
+        // next case to read.
+        mleV2 = new (allocated.get()) MutationLogEntryV2(*mleV1);
 
         // fall through
     }
-    /* If V3 exists then add a case (which is hit by V2 falling through)
     case MutationLogVersion::V3: {
-        // Upgrade V2 to V3
+        // Upgrade V2 to V3.
         // Alloc a buffer using the length read from V2 as input to V3::len
-        allocated = std::make_unique<uint8_t[]>(
-                MutationLogEntryV3::len(mleV2->getKeylen()));
+        std::unique_ptr<uint8_t[]> upgraded = std::make_unique<uint8_t[]>(
+                MutationLogEntryV3::len(mleV2->key().size()));
 
-        // Now in-place construct into the new buffer and assign to mleV3
-        mleV3 = new (allocated.get()) MutationLogEntryV3(*mleV3);
+        // Now in-place construct into the new buffer (which replaces any
+        // buffer mleV2 was constructed in).
+        (void) new (upgraded.get()) MutationLogEntryV3(*mleV2);
+        allocated = std::move(upgraded);
         // fall through
     }
-    */
     }
 
     // transfer ownership to the MutationLogEntryHolder and mark that it's
@@ -914,26 +952,34 @@ void MutationLog::iterator::nextBlock() {
                 "log is enabled and not open");
     }
 
-    ssize_t bytesread = pread(log->fd(), buf.data(), buf.size(), offset);
-    if (bytesread < 1) {
-        isEnd = true;
-        return;
-    }
-    if (bytesread != (ssize_t)(log->header().blockSize())) {
-        LOG(EXTENSION_LOG_WARNING, "FATAL: too few bytes read in access log"
-                "'%s': %s", log->getLogFile().c_str(), strerror(errno));
-        throw ShortReadException();
-    }
-    offset += bytesread;
-
-    // block starts with 2 byte crc and 2 byte item count
-    uint32_t crc32(crc32buf(buf.data() + sizeof(uint16_t), buf.size() - sizeof(uint16_t)));
-    uint16_t computed_crc16(crc32 & 0xffff);
-    uint16_t retrieved_crc16;
-    memcpy(&retrieved_crc16, buf.data(), sizeof(retrieved_crc16));
-    retrieved_crc16 = ntohs(retrieved_crc16);
-    if (computed_crc16 != retrieved_crc16) {
-        throw CRCReadException();
+    if (log->headerBlock.version() >= MutationLogVersion::V3) {
+        if (!readCompressedBlock()) {
+            isEnd = true;
+            return;
+        }
+    } else {
+        ssize_t bytesread = pread(log->fd(), buf.data(), buf.size(), offset);
+        if (bytesread < 1) {
+            isEnd = true;
+            return;
+        }
+        if (bytesread != (ssize_t)(log->header().blockSize())) {
+            LOG(EXTENSION_LOG_WARNING, "FATAL: too few bytes read in access log"
+                    "'%s': %s", log->getLogFile().c_str(), strerror(errno));
+            throw ShortReadException();
+        }
+        offset += bytesread;
+
+        // block starts with 2 byte crc and 2 byte item count
+        uint32_t crc32(crc32buf(buf.data() + sizeof(uint16_t),
+                                buf.size() - sizeof(uint16_t)));
+        uint16_t computed_crc16(crc32 & 0xffff);
+        uint16_t retrieved_crc16;
+        memcpy(&retrieved_crc16, buf.data(), sizeof(retrieved_crc16));
+        retrieved_crc16 = ntohs(retrieved_crc16);
+        if (computed_crc16 != retrieved_crc16) {
+            throw CRCReadException();
+        }
     }
 
     std::copy_n(buf.data() + sizeof(uint16_t),
@@ -949,6 +995,66 @@ void MutationLog::iterator::nextBlock() {
     prepItem();
 }
 
+bool MutationLog::iterator::readCompressedBlock() {
+    std::vector<uint8_t> block(COMPRESSED_HEADER_RESERVED);
+    ssize_t bytesread = pread(log->fd(), block.data(), block.size(), offset);
+    if (bytesread < 1) {
+        return false;
+    }
+    if (bytesread != ssize_t(block.size())) {
+        LOG(EXTENSION_LOG_WARNING, "FATAL: too few bytes read in access log"
+                "'%s': %s", log->getLogFile().c_str(), strerror(errno));
+        throw ShortReadException();
+    }
+
+    uint32_t length;
+    memcpy(&length, block.data() + 4, sizeof(length));
+    length = ntohl(length);
+    // Snappy expands a block by at most a sixth (plus a few bytes), so a
+    // greater length can only be corruption.
+    if (length > 2 * buf.size()) {
+        throw ReadException("Invalid compressed block length " +
+                            std::to_string(length));
+    }
+    block.resize(COMPRESSED_HEADER_RESERVED + length);
+    bytesread = pread(log->fd(),
+                      block.data() + COMPRESSED_HEADER_RESERVED,
+                      length,
+                      offset + COMPRESSED_HEADER_RESERVED);
+    if (bytesread != ssize_t(length)) {
+        LOG(EXTENSION_LOG_WARNING, "FATAL: too few bytes read in access log"
+                "'%s': %s", log->getLogFile().c_str(), strerror(errno));
+        throw ShortReadException();
+    }
+    offset += block.size();
+
+    uint32_t crc32(crc32buf(block.data() + sizeof(uint16_t),
+                            block.size() - sizeof(uint16_t)));
+    uint16_t retrieved_crc16;
+    memcpy(&retrieved_crc16, block.data(), sizeof(retrieved_crc16));
+    if ((crc32 & 0xffff) != ntohs(retrieved_crc16)) {
+        throw CRCReadException();
+    }
+
+    // Inflate into buf after the crc and item count, as if it had been read
+    // uncompressed.
+    cb::compression::Buffer inflated;
+    if (!cb::compression::inflate(
+                cb::compression::Algorithm::Snappy,
+                reinterpret_cast<const char*>(block.data()) +
+                        COMPRESSED_HEADER_RESERVED,
+                length,
+                inflated) ||
+        inflated.len > buf.size() - HEADER_RESERVED) {
+        throw ReadException("Failed to inflate access log block");
+    }
+    std::copy_n(block.data(), HEADER_RESERVED, buf.begin());
+    std::copy_n(inflated.data.get(),
+                inflated.len,
+                buf.begin() + HEADER_RESERVED);
+    return true;
+}
+
 void MutationLog::resetCounts(size_t *items) {
     for (int i(0); i < int(MutationLogType::NumberOfTypes); ++i) {
         itemsLogged[i] = items[i];
@@ -969,15 +1075,15 @@ bool MutationLogHarvester::load() {
         switch (le->type()) {
         case MutationLogType::New:
             if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
-                loading[le->vbucket()].emplace(le->key());
+                loading[le->vbucket()].add(le->key());
             }
             break;
         case MutationLogType::Commit2:
             clean = true;
 
             for (const uint16_t vb : vbid_set) {
-                for (auto& item : loading[vb]) {
-                    committed[vb].emplace(item);
+                for (const auto& key : loading[vb].keys) {
+                    committed[vb].add(key);
                 }
             }
             loading.clear();
@@ -1011,7 +1117,7 @@ MutationLog::iterator MutationLogHarvester::loadBatch(
         switch (le->type()) {
         case MutationLogType::New:
             if (vbid_set.find(le->vbucket()) != vbid_set.end()) {
-                committed[le->vbucket()].emplace(le->key());
+                committed[le->vbucket()].add(le->key());
                 count++;
             }
             break;
@@ -1031,7 +1137,7 @@ MutationLog::iterator MutationLogHarvester::loadBatch(
 
 void MutationLogHarvester::apply(void *arg, mlCallback mlc) {
     for (const uint16_t vb : vbid_set) {
-        for (const auto& key : committed[vb]) {
+        for (const auto& key : committed[vb].keys) {
             if (!mlc(arg, vb, key)) { // Stop loading from an access log
                 return;
             }
@@ -1051,20 +1157,22 @@ void MutationLogHarvester::apply(void *arg, mlCallbackWithQueue mlc) {
         }
 
         // Remove any items which are no longer valid in the VBucket.
-        for (auto it = committed[vb].begin(); it != committed[vb].end(); ) {
-            if ((vbucket->ht.find(*it, TrackReference::No, WantsDeleted::No) ==
-                 nullptr)) {
-                it = committed[vb].erase(it);
-            }
-            else {
-                ++it;
-            }
-        }
-
-        if (!mlc(vb, committed[vb], arg)) {
+        auto& keys = committed[vb].keys;
+        keys.erase(std::remove_if(keys.begin(),
+                                  keys.end(),
+                                  [&vbucket](const StoredDocKey& key) {
+                                      return vbucket->ht.find(
+                                                     key,
+                                                     TrackReference::No,
+                                                     WantsDeleted::No) ==
+                                             nullptr;
+                                  }),
+                   keys.end());
+
+        if (!mlc(vb, keys, arg)) {
             return;
         }
-        committed[vb].clear();
+        committed.erase(vb);
     }
 }
 
@@ -36,6 +36,10 @@
  * during warmup there's no guarantee that the keys listed still exist - the
  * contents of the Access log is essentially just a hint / suggestion.
  *
+ * Since V3 each entry also records the seqno of the item, and blocks are
+ * snappy-compressed (so vary in length). The AccessScanner writes each
+ * vBucket's keys in seqno order - the order of their values in the vBucket's
+ * data file - so that warmup loads values in file order.
  */
 
 #include "config.h"
@@ -72,8 +76,10 @@ const int MUTATION_LOG_COMPACTOR_FREQ(3600);
 
 const size_t MIN_LOG_HEADER_SIZE(4096);
 const size_t HEADER_RESERVED(4);
+// A compressed (V3) block's 2 byte crc, 2 byte item count and 4 byte length.
+const size_t COMPRESSED_HEADER_RESERVED(8);
 
-enum class MutationLogVersion { V1 = 1, V2 = 2, Current = V2 };
+enum class MutationLogVersion { V1 = 1, V2 = 2, V3 = 3, Current = V3 };
 
 const size_t LOG_ENTRY_BUF_SIZE(512);
 
@@ -210,7 +216,7 @@ public:
 
     ~MutationLog();
 
-    void newItem(uint16_t vbucket, const DocKey& key);
+    void newItem(uint16_t vbucket, const DocKey& key, uint64_t bySeqno);
 
     void commit1();
 
@@ -399,6 +405,11 @@ public:
         /// @returns the length of the entry the iterator is currently at
         size_t getCurrentEntryLen() const;
         void nextBlock();
+        /**
+         * Read the compressed block at offset, inflating it into buf.
+         * @return false at the end of the log
+         */
+        bool readCompressedBlock();
         size_t bufferBytesRemaining();
         void prepItem();
 
@@ -435,8 +446,6 @@ public:
 
     //! Items logged by type.
     std::atomic<size_t> itemsLogged[int(MutationLogType::NumberOfTypes)];
-    //! Histogram of block padding sizes.
-    Histogram<uint32_t> paddingHisto;
     //! Flush time histogram.
     Histogram<hrtime_t> flushTimeHisto;
     //! Sync time histogram.
@@ -491,7 +500,7 @@ typedef std::pair<uint64_t, uint8_t> mutation_log_event_t;
  */
 typedef bool (*mlCallback)(void*, uint16_t, const DocKey&);
 typedef bool (*mlCallbackWithQueue)(uint16_t,
-                                    const std::set<StoredDocKey>&,
+                                    const std::vector<StoredDocKey>&,
                                     void *arg);
 
 /**
@@ -533,7 +542,7 @@ public:
 
     /**
      * Load a batch of entries from the file, starting from the given iterator.
-     * Loaded entries are inserted into `committed`, which is cleared at the
+     * Loaded entries are appended to `committed`, which is cleared at the
      * start of each call.
      *
      * @param start Iterator of where to start loading from.
@@ -546,7 +555,8 @@ public:
                                         size_t limit);
 
     /**
-     * Apply the processed log entries through the given function.
+     * Apply the processed log entries through the given function, in the
+     * order they were logged (each key once, at its first entry).
      */
     void apply(void *arg, mlCallback mlc);
     void apply(void *arg, mlCallbackWithQueue mlc);
@@ -564,12 +574,26 @@ public:
     }
 
 private:
+    /**
+     * The keys of a vbucket in log order, which for an access log is seqno
+     * order, without duplicates.
+     */
+    struct KeyList {
+        void add(const StoredDocKey& key) {
+            if (seen.insert(key).second) {
+                keys.push_back(key);
+            }
+        }
+
+        std::vector<StoredDocKey> keys;
+        std::set<StoredDocKey> seen;
+    };
 
     MutationLog &mlog;
     EventuallyPersistentEngine *engine;
     std::set<uint16_t> vbid_set;
 
-    std::unordered_map<uint16_t, std::set<StoredDocKey>> committed;
-    std::unordered_map<uint16_t, std::set<StoredDocKey>> loading;
+    std::unordered_map<uint16_t, KeyList> committed;
+    std::unordered_map<uint16_t, KeyList> loading;
     size_t itemsSeen[int(MutationLogType::NumberOfTypes)];
 };
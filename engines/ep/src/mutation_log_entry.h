@@ -34,6 +34,7 @@ enum class MutationLogType : uint8_t {
 std::string to_string(MutationLogType t);
 
 class MutationLogEntryV2;
+class MutationLogEntryV3;
 
 /**
  * An entry in the MutationLog.
@@ -305,6 +306,7 @@ public:
     }
 
 private:
+    friend MutationLogEntryV3;
     friend std::ostream& operator<<(std::ostream& out,
                                     const MutationLogEntryV2& e);
 
@@ -335,6 +337,181 @@ private:
                   "_type must be a uint8_t");
 };
 
-using MutationLogEntry = MutationLogEntryV2;
-
 std::ostream& operator<<(std::ostream& out, const MutationLogEntryV2& mle);
+
+/**
+ * An entry in the MutationLog.
+ * This is the V3 layout which adds the seqno of the item when it was logged,
+ * the order of its value in the vbucket's data file. The access log is
+ * written sorted by it, so that warmup reads values in file order.
+ */
+class MutationLogEntryV3 {
+public:
+    static const uint8_t MagicMarker = 0x47;
+
+    /**
+     * Construct a V3 from V2, the seqno of which isn't known (0).
+     */
+    MutationLogEntryV3(const MutationLogEntryV2& mleV2)
+        : _bySeqno(0),
+          _vbucket(mleV2._vbucket),
+          magic(MagicMarker),
+          _type(mleV2._type),
+          pad(0),
+          _key(DocKey(mleV2.key())) {
+    }
+
+    /**
+     * Initialize a new entry inside the given buffer.
+     *
+     * @param t the type of log entry
+     * @param vb the vbucket
+     * @param k the key
+     * @param bySeqno the seqno of the item
+     */
+    static MutationLogEntryV3* newEntry(uint8_t* buf,
+                                        MutationLogType t,
+                                        uint16_t vb,
+                                        const DocKey& k,
+                                        uint64_t bySeqno) {
+        return new (buf) MutationLogEntryV3(t, vb, k, bySeqno);
+    }
+
+    static MutationLogEntryV3* newEntry(uint8_t* buf,
+                                        MutationLogType t,
+                                        uint16_t vb) {
+        if (MutationLogType::Commit1 != t && MutationLogType::Commit2 != t) {
+            throw std::invalid_argument(
+                    "MutationLogEntryV3::newEntry: invalid type");
+        }
+        return new (buf) MutationLogEntryV3(t, vb);
+    }
+
+    /**
+     * Initialize a new entry using the contents of the given buffer.
+     *
+     * @param buf a chunk of memory thought to contain a valid
+     *        MutationLogEntryV3
+     * @param buflen the length of said buf
+     */
+    static const MutationLogEntryV3* newEntry(
+            std::vector<uint8_t>::const_iterator itr, size_t buflen) {
+        if (buflen < len(0)) {
+            throw std::invalid_argument(
+                    "MutationLogEntryV3::newEntry: buflen "
+                    "(which is " +
+                    std::to_string(buflen) +
+                    ") is less than minimum required (which is " +
+                    std::to_string(len(0)) + ")");
+        }
+
+        const auto* me = reinterpret_cast<const MutationLogEntryV3*>(&(*itr));
+
+        if (me->magic != MagicMarker) {
+            throw std::invalid_argument(
+                    "MutationLogEntryV3::newEntry: "
+                    "magic (which is " +
+                    std::to_string(me->magic) + ") is not equal to " +
+                    std::to_string(MagicMarker));
+        }
+        if (me->len() > buflen) {
+            throw std::invalid_argument(
+                    "MutationLogEntryV3::newEntry: "
+                    "entry length (which is " +
+                    std::to_string(me->len()) +
+                    ") is greater than available buflen (which is " +
+                    std::to_string(buflen) + ")");
+        }
+        return me;
+    }
+
+    void operator delete(void*) {
+        // Statically buffered.  There is no delete.
+        throw std::logic_error("MutationLogEntryV3 delete is not allowed");
+    }
+
+    /**
+     * The size of a MutationLogEntryV3, in bytes, containing a key of
+     * the specified length.
+     */
+    static size_t len(size_t klen) {
+        // the exact empty record size as will be packed into the layout
+        return sizeof(MutationLogEntryV3) + (klen - 1);
+    }
+
+    /**
+     * The number of bytes of the serialized form of this
+     * MutationLogEntryV3.
+     */
+    size_t len() const {
+        return len(_key.size());
+    }
+
+    /**
+     * This entry's key.
+     */
+    const SerialisedDocKey& key() const {
+        return _key;
+    }
+
+    /**
+     * The seqno of this entry's item (0 if unknown).
+     */
+    uint64_t bySeqno() const {
+        return ntohll(_bySeqno);
+    }
+
+    /**
+     * This entry's vbucket.
+     */
+    uint16_t vbucket() const {
+        return ntohs(_vbucket);
+    }
+
+    /**
+     * The type of this log entry.
+     */
+    MutationLogType type() const {
+        return _type;
+    }
+
+private:
+    friend std::ostream& operator<<(std::ostream& out,
+                                    const MutationLogEntryV3& e);
+
+    MutationLogEntryV3(MutationLogType t,
+                       uint16_t vb,
+                       const DocKey& k,
+                       uint64_t bySeqno)
+        : _bySeqno(htonll(bySeqno)),
+          _vbucket(htons(vb)),
+          magic(MagicMarker),
+          _type(t),
+          pad(0),
+          _key(k) {
+        (void)pad;
+        // Assert that _key is the final member
+        static_assert(
+                offsetof(MutationLogEntryV3, _key) ==
+                        (sizeof(MutationLogEntryV3) - sizeof(SerialisedDocKey)),
+                "_key must be the final member of MutationLogEntryV3");
+    }
+
+    MutationLogEntryV3(MutationLogType t, uint16_t vb)
+        : MutationLogEntryV3(
+                  t, vb, {nullptr, 0, DocNamespace::DefaultCollection}, 0) {
+    }
+
+    const uint64_t _bySeqno;
+    const uint16_t _vbucket;
+    const uint8_t magic;
+    const MutationLogType _type;
+    const uint8_t pad; // explicit padding to ensure _key is the final member
+    const SerialisedDocKey _key;
+
+    DISALLOW_COPY_AND_ASSIGN(MutationLogEntryV3);
+};
+
+using MutationLogEntry = MutationLogEntryV3;
+
+std::ostream& operator<<(std::ostream& out, const MutationLogEntryV3& mle);
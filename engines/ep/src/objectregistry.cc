@@ -123,6 +123,11 @@ void ObjectRegistry::onCreateStoredValue(const StoredValue *sv)
        }
        stats.numStoredVal++;
        stats.totalStoredValSize.fetch_add(size);
+       // The inline storage isn't part of the StoredValue's metaDataSize():
+       // account all of it here, whether or not a value is using it.
+       const size_t capacity = sv->getInlineCapacity();
+       stats.currentSize.fetch_add(capacity);
+       stats.inlineValueCapacity.fetch_add(capacity);
    }
 }
 
@@ -139,9 +144,39 @@ void ObjectRegistry::onDeleteStoredValue(const StoredValue *sv)
        }
        stats.totalStoredValSize.fetch_sub(size);
        stats.numStoredVal--;
+       const size_t capacity = sv->getInlineCapacity();
+       stats.currentSize.fetch_sub(capacity);
+       stats.inlineValueCapacity.fetch_sub(capacity);
    }
 }
 
+void ObjectRegistry::onSetInlineValue(size_t size)
+{
+   EventuallyPersistentEngine *engine = th->get();
+   if (verifyEngine(engine)) {
+       EPStats &stats = engine->getEpStats();
+       // The inline bytes are already in currentSize (as part of the
+       // StoredValue's inline capacity); account them as value memory.
+       stats.totalValueSize.fetch_add(size);
+       stats.inlineValueSize.fetch_add(size);
+       stats.inlineValueSaved.fetch_add(Blob::getAllocationSize(size) - size -
+                                        StoredValue::inlineValueOverhead);
+       stats.numInlineValues++;
+   }
+}
+
+void ObjectRegistry::onResetInlineValue(size_t size)
+{
+   EventuallyPersistentEngine *engine = th->get();
+   if (verifyEngine(engine)) {
+       EPStats &stats = engine->getEpStats();
+       stats.totalValueSize.fetch_sub(size);
+       stats.inlineValueSize.fetch_sub(size);
+       stats.inlineValueSaved.fetch_sub(Blob::getAllocationSize(size) - size -
+                                        StoredValue::inlineValueOverhead);
+       stats.numInlineValues--;
+   }
+}
 
 void ObjectRegistry::onCreateItem(const Item *pItem)
 {
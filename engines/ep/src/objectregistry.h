@@ -51,6 +51,13 @@ public:
     static void onCreateStoredValue(const StoredValue *sv);
     static void onDeleteStoredValue(const StoredValue *sv);
 
+    /**
+     * Account for a value of the given size (Blob::length()) being stored
+     * inline in (or removed from) a StoredValue, instead of in a Blob.
+     */
+    static void onSetInlineValue(size_t size);
+    static void onResetInlineValue(size_t size);
+
 
     static EventuallyPersistentEngine *getCurrentEngine();
 
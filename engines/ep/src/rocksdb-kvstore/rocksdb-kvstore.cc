@@ -19,32 +19,310 @@
 
 #include "rocksdb-kvstore.h"
 
+#include "collections/vbucket_manifest.h"
+#include "ep_time.h"
+#include "vbucket.h"
+
+#include <platform/make_unique.h>
+#include <rocksdb/convenience.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/statistics.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
+
 #include <string.h>
 #include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+namespace {
+
+const std::string seqnoFamilyName("seqno");
+const std::string localFamilyName("local");
+
+// Names of the local keys of each vbucket.
+const std::string vbstateKeyName("vbstate");
+const std::string manifestKeyName("collections_manifest");
+
+void appendBigEndian(std::string& dest, uint64_t value, size_t bytes) {
+    for (size_t ii = bytes; ii > 0; --ii) {
+        dest.push_back(static_cast<char>(value >> ((ii - 1) * 8)));
+    }
+}
+
+uint64_t readBigEndian(const char* src, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t ii = 0; ii < bytes; ++ii) {
+        value = (value << 8) | static_cast<uint8_t>(src[ii]);
+    }
+    return value;
+}
+
+std::string makeVBPrefix(uint16_t vbid) {
+    std::string prefix;
+    appendBigEndian(prefix, vbid, sizeof(vbid));
+    return prefix;
+}
+
+/**
+ * A key greater than every key of the vbucket: the byte following the
+ * prefix is a namespace (documents), the top byte of a seqno (the seqno
+ * index) or a character of a name (local), all less than 0xff.
+ */
+std::string makeVBEnd(uint16_t vbid) {
+    return makeVBPrefix(vbid) + '\xff';
+}
+
+bool hasPrefix(const rocksdb::Slice& s, const std::string& prefix) {
+    return s.size() >= prefix.size() &&
+           std::memcmp(s.data(), prefix.data(), prefix.size()) == 0;
+}
 
-static const size_t DEFAULT_VAL_SIZE(64 * 1024);
+/// Key of a document: vbucket, namespace and document key.
+std::string makeDocKey(uint16_t vbid, const DocKey& key) {
+    std::string dest = makeVBPrefix(vbid);
+    dest.push_back(static_cast<char>(key.getDocNamespace()));
+    dest.append(reinterpret_cast<const char*>(key.data()), key.size());
+    return dest;
+}
+
+DocKey grokDocKey(const rocksdb::Slice& s) {
+    const size_t header = sizeof(uint16_t) + sizeof(DocNamespace);
+    if (s.size() < header) {
+        throw std::invalid_argument("grokDocKey: key too short (size:" +
+                                    std::to_string(s.size()) + ")");
+    }
+    return DocKey(reinterpret_cast<const uint8_t*>(s.data() + header),
+                  s.size() - header,
+                  static_cast<DocNamespace>(s[sizeof(uint16_t)]));
+}
+
+/// Key of an entry of the seqno index: vbucket and seqno.
+std::string makeSeqnoKey(uint16_t vbid, uint64_t seqno) {
+    std::string dest = makeVBPrefix(vbid);
+    appendBigEndian(dest, seqno, sizeof(seqno));
+    return dest;
+}
+
+uint64_t grokSeqnoKey(const rocksdb::Slice& s) {
+    return readBigEndian(s.data() + sizeof(uint16_t), sizeof(uint64_t));
+}
+
+std::string makeLocalKey(uint16_t vbid, const std::string& name) {
+    return makeVBPrefix(vbid) + name;
+}
+
+/**
+ * The stored form of a document (or deletion), using the following
+ * layout:
+ *    uint64_t           cas          ]
+ *    uint64_t           revSeqno     ] ItemMetaData
+ *    uint32_t           flags        ]
+ *    uint32_t           exptime      ]
+ *    int64_t            bySeqno
+ *    uint8_t            datatype
+ *    uint8_t            deleted
+ *    uint32_t           value_len
+ *    uint8_t[value_len] value
+ */
+struct DocHeader {
+    ItemMetaData meta;
+    int64_t bySeqno;
+    uint8_t datatype;
+    bool deleted;
+    uint32_t valueLen;
+};
+
+const size_t docHeaderSize = sizeof(ItemMetaData) + sizeof(int64_t) +
+                             2 * sizeof(uint8_t) + sizeof(uint32_t);
+
+std::string makeDocValue(const Item& item, bool deleted) {
+    const uint32_t valueLen = item.getNBytes();
+    std::string dest;
+    dest.reserve(docHeaderSize + valueLen);
+    dest.append(reinterpret_cast<const char*>(&item.getMetaData()),
+                sizeof(ItemMetaData));
+
+    const int64_t bySeqno{item.getBySeqno()};
+    dest.append(reinterpret_cast<const char*>(&bySeqno), sizeof(bySeqno));
+    dest.push_back(static_cast<char>(item.getDataType()));
+    dest.push_back(deleted ? 1 : 0);
+    dest.append(reinterpret_cast<const char*>(&valueLen), sizeof(valueLen));
+    if (valueLen) {
+        dest.append(item.getData(), valueLen);
+    }
+    return dest;
+}
+
+DocHeader grokDocHeader(const rocksdb::Slice& s) {
+    if (s.size() < docHeaderSize) {
+        throw std::invalid_argument("grokDocHeader: value too short (size:" +
+                                    std::to_string(s.size()) + ")");
+    }
+    DocHeader header;
+    const char* src = s.data();
+    std::memcpy(&header.meta, src, sizeof(header.meta));
+    src += sizeof(header.meta);
+    std::memcpy(&header.bySeqno, src, sizeof(header.bySeqno));
+    src += sizeof(header.bySeqno);
+    header.datatype = static_cast<uint8_t>(*src++);
+    header.deleted = *src++ != 0;
+    std::memcpy(&header.valueLen, src, sizeof(header.valueLen));
+    if (s.size() < docHeaderSize + header.valueLen) {
+        throw std::invalid_argument("grokDocHeader: value truncated (size:" +
+                                    std::to_string(s.size()) + ")");
+    }
+    return header;
+}
+
+/**
+ * The stored form of a vbucket's state and document counts: the fields
+ * of vbucket_state (big-endian), the counts, then the failover table.
+ */
+std::string makeVBStateValue(const vbucket_state& state,
+                             size_t docCount,
+                             size_t deleteCount) {
+    std::string dest;
+    dest.push_back(static_cast<char>(state.state));
+    appendBigEndian(dest, state.checkpointId, 8);
+    appendBigEndian(dest, state.maxDeletedSeqno, 8);
+    appendBigEndian(dest, state.highSeqno, 8);
+    appendBigEndian(dest, state.purgeSeqno, 8);
+    appendBigEndian(dest, state.lastSnapStart, 8);
+    appendBigEndian(dest, state.lastSnapEnd, 8);
+    appendBigEndian(dest, state.maxCas, 8);
+    appendBigEndian(dest, state.hlcCasEpochSeqno, 8);
+    dest.push_back(state.mightContainXattrs ? 1 : 0);
+    appendBigEndian(dest, docCount, 8);
+    appendBigEndian(dest, deleteCount, 8);
+    dest.append(state.failovers);
+    return dest;
+}
+
+const size_t vbstateValueSize = 1 + 8 * 8 + 1 + 2 * 8;
+
+bool grokVBStateValue(const rocksdb::Slice& s,
+                      vbucket_state& state,
+                      size_t& docCount,
+                      size_t& deleteCount) {
+    if (s.size() < vbstateValueSize) {
+        return false;
+    }
+    const char* src = s.data();
+    state.state = static_cast<vbucket_state_t>(*src++);
+    auto next = [&src]() {
+        const uint64_t value = readBigEndian(src, 8);
+        src += 8;
+        return value;
+    };
+    state.checkpointId = next();
+    state.maxDeletedSeqno = next();
+    state.highSeqno = next();
+    state.purgeSeqno = next();
+    state.lastSnapStart = next();
+    state.lastSnapEnd = next();
+    state.maxCas = next();
+    state.hlcCasEpochSeqno = next();
+    state.mightContainXattrs = *src++ != 0;
+    docCount = next();
+    deleteCount = next();
+    state.failovers.assign(src, s.data() + s.size() - src);
+    return true;
+}
+
+} // anonymous namespace
+
+/**
+ * A pending set or delete, written to RocksDB on commit.
+ */
+class RocksRequest {
+public:
+    RocksRequest(const Item& item, MutationRequestCallback& cb, bool del)
+        : vbid(item.getVBucketId()),
+          key(makeDocKey(vbid, item.getKey())),
+          value(makeDocValue(item, del)),
+          seqno(item.getBySeqno()),
+          deleteItem(del),
+          callback(cb),
+          start(gethrtime()) {
+    }
+
+    const uint16_t vbid;
+    const std::string key;
+    const std::string value;
+    const int64_t seqno;
+    const bool deleteItem;
+    MutationRequestCallback callback;
+    const hrtime_t start;
+};
+
+void SeqnoIndexCompactionFilter::open(rocksdb::DB* db,
+                                      rocksdb::ColumnFamilyHandle* docs) {
+    this->db = db;
+    this->docs = docs;
+    ready = true;
+}
+
+void SeqnoIndexCompactionFilter::close() {
+    ready = false;
+}
+
+bool SeqnoIndexCompactionFilter::Filter(int level,
+                                        const rocksdb::Slice& key,
+                                        const rocksdb::Slice& existingValue,
+                                        std::string* newValue,
+                                        bool* valueChanged) const {
+    if (!ready) {
+        return false;
+    }
+    // A missing document has been purged (or its vbucket deleted).
+    std::string value;
+    rocksdb::ReadOptions options;
+    options.fill_cache = false;
+    rocksdb::Status s = db->Get(options, docs, existingValue, &value);
+    if (s.IsNotFound()) {
+        return true;
+    }
+    if (!s.ok()) {
+        return false;
+    }
+    try {
+        return uint64_t(grokDocHeader(value).bySeqno) != grokSeqnoKey(key);
+    } catch (const std::invalid_argument&) {
+        // Keep the entry, for the scan to report the bad document.
+        return false;
+    }
+}
 
 RocksDBKVStore::RocksDBKVStore(KVStoreConfig& config)
-    : KVStore(config), valBuffer(NULL), valSize(0), scanCounter(0) {
-    keyBuffer = static_cast<char*>(
-            calloc(1, sizeof(uint16_t) + std::numeric_limits<uint8_t>::max()));
-    cachedVBStates.reserve(configuration.getMaxVBuckets());
-    cachedVBStates.assign(configuration.getMaxVBuckets(), nullptr);
+    : KVStore(config),
+      logger(config.getLogger()),
+      intransaction(false),
+      scanCounter(0) {
+    const size_t numVBuckets = configuration.getMaxVBuckets();
+    cachedVBStates.reserve(numVBuckets);
+    cachedVBStates.assign(numVBuckets, nullptr);
+    cachedDocCount.assign(numVBuckets, Couchbase::RelaxedAtomic<size_t>(0));
+    cachedDeleteCount.assign(numVBuckets,
+                             Couchbase::RelaxedAtomic<size_t>(0));
 
     writeOptions.sync = true;
 
-    adjustValBuffer(DEFAULT_VAL_SIZE);
     open();
+    loadVBStates();
 }
 
 RocksDBKVStore::~RocksDBKVStore() {
     close();
-    free(keyBuffer);
-    free(valBuffer);
+    for (auto* state : cachedVBStates) {
+        delete state;
+    }
 }
 
 void RocksDBKVStore::open() {
     rdbOptions.create_if_missing = true;
+    rdbOptions.create_missing_column_families = true;
+    rdbOptions.statistics = rocksdb::CreateDBStatistics();
 
     /* Use a listener to set the appropriate engine in the
      * flusher threads RocksDB creates. We need the flusher threads to
@@ -54,6 +332,31 @@ void RocksDBKVStore::open() {
 
     rdbOptions.listeners.emplace_back(fsl);
 
+    // Each shard caches its share of the bucket's block cache size. Blocks
+    // are allocated by the (bucket's) threads reading them, so count
+    // towards the bucket's memory usage.
+    rocksdb::BlockBasedTableOptions tableOptions;
+    const size_t cacheSize = configuration.getRocksdbBlockCacheSize() /
+                             configuration.getMaxShards();
+    if (cacheSize > 0) {
+        blockCache = rocksdb::NewLRUCache(cacheSize);
+        tableOptions.block_cache = blockCache;
+    } else {
+        tableOptions.no_block_cache = true;
+    }
+
+    // Documents are looked up by key, so have bloom filters; the seqno
+    // index and local keys are only ever scanned, or few.
+    rocksdb::ColumnFamilyOptions indexOptions(rdbOptions);
+    indexOptions.table_factory.reset(
+            rocksdb::NewBlockBasedTableFactory(tableOptions));
+    rocksdb::ColumnFamilyOptions seqnoOptions(indexOptions);
+    seqnoOptions.compaction_filter = &seqnoIndexFilter;
+    tableOptions.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10));
+    rocksdb::ColumnFamilyOptions docOptions(rdbOptions);
+    docOptions.table_factory.reset(
+            rocksdb::NewBlockBasedTableFactory(tableOptions));
+
     const std::string dbdir = configuration.getDBName();
 
     cb::io::mkdirp(dbdir);
@@ -61,11 +364,21 @@ void RocksDBKVStore::open() {
     const std::string dbname =
             dbdir + "/rocksdb." + std::to_string(configuration.getShardId());
 
+    std::vector<rocksdb::ColumnFamilyDescriptor> families{
+            {rocksdb::kDefaultColumnFamilyName, docOptions},
+            {seqnoFamilyName, seqnoOptions},
+            {localFamilyName, indexOptions}};
+    std::vector<rocksdb::ColumnFamilyHandle*> handles;
     rocksdb::DB* dbPtr;
-    rocksdb::Status s = rocksdb::DB::Open(rdbOptions, dbname, &dbPtr);
+    rocksdb::Status s =
+            rocksdb::DB::Open(rdbOptions, dbname, families, &handles, &dbPtr);
 
     if (s.ok()) {
         db.reset(dbPtr);
+        defaultFamily.reset(handles[0]);
+        seqnoFamily.reset(handles[1]);
+        localFamily.reset(handles[2]);
+        seqnoIndexFilter.open(db.get(), defaultFamily.get());
     } else {
         throw std::runtime_error(
                 "RocksDBKVStore::open: failed to open database '" + dbname +
@@ -74,259 +387,859 @@ void RocksDBKVStore::open() {
 }
 
 void RocksDBKVStore::close() {
+    if (db) {
+        // The compaction filter reads the documents: wait for compactions
+        // to finish before destroying their family.
+        seqnoIndexFilter.close();
+        rocksdb::CancelAllBackgroundWork(db.get(), true);
+    }
+    defaultFamily.reset();
+    seqnoFamily.reset();
+    localFamily.reset();
     db.reset();
 }
 
-bool RocksDBKVStore::begin() {
-    if (!batch) {
-        batch = std::make_unique<rocksdb::WriteBatch>();
+void RocksDBKVStore::loadVBStates() {
+    std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(rocksdb::ReadOptions(), localFamily.get()));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        const rocksdb::Slice key = it->key();
+        if (key.size() != sizeof(uint16_t) + vbstateKeyName.size() ||
+            std::memcmp(key.data() + sizeof(uint16_t),
+                        vbstateKeyName.data(),
+                        vbstateKeyName.size()) != 0) {
+            continue;
+        }
+        const uint16_t vbid = readBigEndian(key.data(), sizeof(uint16_t));
+        if (vbid >= cachedVBStates.size()) {
+            continue;
+        }
+
+        auto state = std::make_unique<vbucket_state>();
+        size_t docCount = 0;
+        size_t deleteCount = 0;
+        if (!grokVBStateValue(it->value(), *state, docCount, deleteCount)) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::loadVBStates: invalid state for "
+                       "vb:%" PRIu16 " (size:%" PRIu64 ")",
+                       vbid,
+                       uint64_t(it->value().size()));
+            continue;
+        }
+
+        delete cachedVBStates[vbid];
+        cachedVBStates[vbid] = state.release();
+        cachedDocCount[vbid] = docCount;
+        cachedDeleteCount[vbid] = deleteCount;
+        if (cachedVBStates[vbid]->state != vbucket_state_dead) {
+            cachedValidVBCount++;
+        }
+    }
+    if (!it->status().ok()) {
+        throw std::runtime_error(
+                "RocksDBKVStore::loadVBStates: failed to read states: " +
+                it->status().ToString());
     }
-    return bool(batch);
+}
+
+void RocksDBKVStore::saveVBState(rocksdb::WriteBatch& batch,
+                                 uint16_t vbid,
+                                 size_t docCount,
+                                 size_t deleteCount) {
+    const vbucket_state* state = cachedVBStates[vbid];
+    if (state) {
+        batch.Put(localFamily.get(),
+                  makeLocalKey(vbid, vbstateKeyName),
+                  makeVBStateValue(*state, docCount, deleteCount));
+    }
+}
+
+bool RocksDBKVStore::begin() {
+    intransaction = true;
+    return intransaction;
 }
 
 bool RocksDBKVStore::commit(const Item* collectionsManifest) {
-    if (batch) {
-        rocksdb::Status s = db->Write(writeOptions, batch.get());
-        if (s.ok()) {
-            batch.reset();
+    if (intransaction) {
+        if (commitBatch(collectionsManifest)) {
+            intransaction = false;
         }
     }
-    return !batch;
+    return !intransaction;
 }
 
-void RocksDBKVStore::rollback() {
-    batch.reset();
-}
+bool RocksDBKVStore::commitBatch(const Item* collectionsManifest) {
+    if (pendingReqs.empty() && !collectionsManifest) {
+        return true;
+    }
+
+    hrtime_t start = gethrtime();
+    std::lock_guard<std::mutex> lh(writeLock);
+
+    // Find whether each key exists (and is deleted), to maintain the
+    // document counts and to tell the callbacks. Keys which the memtable
+    // and bloom filters rule out, or whose document is in memory, need no
+    // read; only the rest are read, with one MultiGet. The seqno index
+    // entry of a key's previous version isn't removed: scans skip it, and
+    // compaction drops it.
+    std::vector<std::string> values(pendingReqs.size());
+    std::vector<rocksdb::Status> statuses(pendingReqs.size(),
+                                          rocksdb::Status::NotFound());
+    std::vector<size_t> unresolved;
+    for (size_t ii = 0; ii < pendingReqs.size(); ++ii) {
+        bool found = false;
+        if (db->KeyMayExist(rocksdb::ReadOptions(),
+                            defaultFamily.get(),
+                            pendingReqs[ii]->key,
+                            &values[ii],
+                            &found)) {
+            if (found) {
+                statuses[ii] = rocksdb::Status::OK();
+            } else {
+                unresolved.push_back(ii);
+            }
+        }
+    }
+    if (!unresolved.empty()) {
+        std::vector<rocksdb::Slice> keys;
+        keys.reserve(unresolved.size());
+        for (auto ii : unresolved) {
+            keys.emplace_back(pendingReqs[ii]->key);
+        }
+        std::vector<rocksdb::ColumnFamilyHandle*> families(
+                keys.size(), defaultFamily.get());
+        std::vector<std::string> read;
+        auto readStatuses =
+                db->MultiGet(rocksdb::ReadOptions(), families, keys, &read);
+        for (size_t jj = 0; jj < unresolved.size(); ++jj) {
+            statuses[unresolved[jj]] = readStatuses[jj];
+            values[unresolved[jj]] = std::move(read[jj]);
+        }
+    }
+
+    struct KeyState {
+        bool exists;
+        bool deleted;
+    };
+    // The state of each key as of the request being added to the batch.
+    std::unordered_map<std::string, KeyState> current;
+    std::vector<bool> alive(pendingReqs.size());
+    std::unordered_map<uint16_t, std::pair<size_t, size_t>> counts;
+    rocksdb::WriteBatch batch;
+    bool success = true;
 
-void RocksDBKVStore::adjustValBuffer(const size_t to) {
-    // Save room for the flags, exp, etc...
-    size_t needed((sizeof(uint32_t) * 2) + to);
+    for (size_t ii = 0; ii < pendingReqs.size() && success; ++ii) {
+        const auto& req = *pendingReqs[ii];
+        auto found = current.find(req.key);
+        if (found == current.end()) {
+            KeyState state{false, false};
+            if (statuses[ii].ok()) {
+                state = {true, grokDocHeader(values[ii]).deleted};
+            } else if (!statuses[ii].IsNotFound()) {
+                logger.log(EXTENSION_LOG_WARNING,
+                           "RocksDBKVStore::commit: failed to read key, "
+                           "vb:%" PRIu16 ": %s",
+                           req.vbid,
+                           statuses[ii].ToString().c_str());
+                success = false;
+                break;
+            }
+            found = current.emplace(req.key, state).first;
+        }
+        auto& state = found->second;
+
+        auto vbCounts = counts.find(req.vbid);
+        if (vbCounts == counts.end()) {
+            const size_t docCount = cachedDocCount[req.vbid];
+            const size_t deleteCount = cachedDeleteCount[req.vbid];
+            vbCounts = counts.emplace(req.vbid,
+                                      std::make_pair(docCount, deleteCount))
+                               .first;
+        }
+        auto& docCount = vbCounts->second.first;
+        auto& deleteCount = vbCounts->second.second;
+
+        alive[ii] = state.exists && !state.deleted;
+        if (state.exists) {
+            if (state.deleted) {
+                --deleteCount;
+            } else {
+                --docCount;
+            }
+        }
+        if (req.deleteItem) {
+            ++deleteCount;
+        } else {
+            ++docCount;
+        }
+
+        batch.Put(defaultFamily.get(), req.key, req.value);
+        batch.Put(seqnoFamily.get(),
+                  makeSeqnoKey(req.vbid, req.seqno),
+                  req.key);
+        state = {true, req.deleteItem};
+    }
+
+    if (success) {
+        if (collectionsManifest) {
+            const uint16_t vbid = collectionsManifest->getVBucketId();
+            cb::const_char_buffer buffer(collectionsManifest->getData(),
+                                         collectionsManifest->getNBytes());
+            batch.Put(localFamily.get(),
+                      makeLocalKey(vbid, manifestKeyName),
+                      Collections::VB::Manifest::serialToJson(
+                              SystemEvent(collectionsManifest->getFlags()),
+                              buffer,
+                              collectionsManifest->getBySeqno()));
+            const size_t docCount = cachedDocCount[vbid];
+            const size_t deleteCount = cachedDeleteCount[vbid];
+            counts.emplace(vbid, std::make_pair(docCount, deleteCount));
+        }
+
+        // The flusher has already updated the cached state of each vbucket.
+        for (const auto& vbCounts : counts) {
+            saveVBState(batch,
+                        vbCounts.first,
+                        vbCounts.second.first,
+                        vbCounts.second.second);
+        }
+
+        rocksdb::Status s = db->Write(writeOptions, &batch);
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::commit: failed to write batch of "
+                       "%" PRIu64 " requests: %s",
+                       uint64_t(pendingReqs.size()),
+                       s.ToString().c_str());
+            success = false;
+        }
+    }
 
-    if (valBuffer == NULL || valSize < needed) {
-        void* buf = realloc(valBuffer, needed);
-        if (buf) {
-            valBuffer = static_cast<char*>(buf);
-            valSize = needed;
+    if (success) {
+        for (const auto& vbCounts : counts) {
+            cachedDocCount[vbCounts.first] = vbCounts.second.first;
+            cachedDeleteCount[vbCounts.first] = vbCounts.second.second;
         }
+        st.docsCommitted = pendingReqs.size();
+        st.batchSize.add(pendingReqs.size());
+        st.commitHisto.add((gethrtime() - start) / 1000);
+    }
+
+    for (size_t ii = 0; ii < pendingReqs.size(); ++ii) {
+        const auto& req = *pendingReqs[ii];
+        const size_t nbytes = req.key.size() + req.value.size();
+        ++st.io_num_write;
+        st.io_write_bytes += nbytes;
+
+        if (req.deleteItem) {
+            // 1 if the deletion was of an existing item, else 0.
+            int rv = success ? (alive[ii] ? 1 : 0) : -1;
+            if (success) {
+                st.delTimeHisto.add((gethrtime() - req.start) / 1000);
+            } else {
+                ++st.numDelFailure;
+            }
+            req.callback.delCb->callback(rv);
+        } else {
+            mutation_result p(success ? 1 : -1, !alive[ii]);
+            if (success) {
+                st.writeTimeHisto.add((gethrtime() - req.start) / 1000);
+                st.writeSizeHisto.add(nbytes);
+            } else {
+                ++st.numSetFailure;
+            }
+            req.callback.setCb->callback(p);
+        }
+    }
+    pendingReqs.clear();
+
+    return success;
+}
+
+void RocksDBKVStore::rollback() {
+    if (intransaction) {
+        pendingReqs.clear();
+        intransaction = false;
     }
 }
 
 std::vector<vbucket_state*> RocksDBKVStore::listPersistedVbuckets() {
-    // TODO RDB:  Something useful.
-    // std::map<std::pair<uint16_t, uint16_t>, vbucket_state> rv;
-    std::vector<vbucket_state*> rv;
-    return rv;
+    return cachedVBStates;
 }
 
 void RocksDBKVStore::set(const Item& itm, Callback<mutation_result>& cb) {
-    // TODO RDB: Consider using SliceParts to avoid copying if
-    // possible.
-    rocksdb::Slice k = mkKeySlice(itm.getVBucketId(), itm.getKey());
-    rocksdb::Slice v = mkValSlice(itm);
-
-    batch->Put(k, v);
+    if (!intransaction) {
+        throw std::invalid_argument(
+                "RocksDBKVStore::set: intransaction must be "
+                "true to perform a set operation.");
+    }
 
-    // TODO RDB: This callback should not really be called until
-    // after the batch is committed.
-    std::pair<int, bool> p(1, true);
-    cb.callback(p);
+    MutationRequestCallback requestcb;
+    requestcb.setCb = &cb;
+    pendingReqs.push_back(
+            std::make_unique<RocksRequest>(itm, requestcb, false));
 }
 
 GetValue RocksDBKVStore::get(const DocKey& key, uint16_t vb, bool fetchDelete) {
     return getWithHeader(nullptr, key, vb, GetMetaOnly::No, fetchDelete);
 }
 
-GetValue RocksDBKVStore::getWithHeader(
-        void* dbHandle,
-        const DocKey& key,
-        uint16_t vb,
-        GetMetaOnly getMetaOnly, // TODO RDB: get meta only
-        bool fetchDelete) {
-    rocksdb::Slice k(mkKeySlice(vb, key));
-    std::string value;
-
+GetValue RocksDBKVStore::getWithHeader(void* dbHandle,
+                                       const DocKey& key,
+                                       uint16_t vb,
+                                       GetMetaOnly getMetaOnly,
+                                       bool fetchDelete) {
+    hrtime_t start = gethrtime();
     // TODO RDB: use a PinnableSlice to avoid some memcpy
-    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), k, &value);
+    std::string value;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(),
+                                defaultFamily.get(),
+                                makeDocKey(vb, key),
+                                &value);
     if (!s.ok()) {
-        return GetValue{NULL, ENGINE_KEY_ENOENT};
+        if (s.IsNotFound()) {
+            return GetValue{NULL, ENGINE_KEY_ENOENT};
+        }
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::getWithHeader: failed to read key, "
+                   "vb:%" PRIu16 ": %s",
+                   vb,
+                   s.ToString().c_str());
+        ++st.numGetFailure;
+        return GetValue{NULL, ENGINE_TMPFAIL};
     }
-    return makeGetValue(vb, key, value);
+
+    GetValue rv = makeGetValue(vb, key, value, getMetaOnly);
+    st.readTimeHisto.add((gethrtime() - start) / 1000);
+    st.readSizeHisto.add(key.size() + rv.item->getNBytes());
+    return rv;
 }
 
 void RocksDBKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t& itms) {
-    // TODO RDB: RocksDB supports a multi get which we should use here.
-    for (auto& it : itms) {
-        auto& key = it.first;
-        rocksdb::Slice vbAndKey(mkKeySlice(vb, it.first));
-        std::string value;
-        rocksdb::Status s = db->Get(rocksdb::ReadOptions(), vbAndKey, &value);
-        if (s.ok()) {
-            it.second.value = makeGetValue(vb, key, value);
-            GetValue* rv = &it.second.value;
-            for (auto& fetch : it.second.bgfetched_list) {
-                fetch->value = rv;
+    multiGet({{vb, &itms}});
+}
+
+void RocksDBKVStore::getMultiVBuckets(multi_vb_bgfetch_queue_t& itms) {
+    std::vector<std::pair<uint16_t, vb_bgfetch_queue_t*>> queues;
+    queues.reserve(itms.size());
+    for (auto& vb : itms) {
+        queues.emplace_back(vb.first, &vb.second);
+    }
+    multiGet(queues);
+}
+
+void RocksDBKVStore::multiGet(
+        const std::vector<std::pair<uint16_t, vb_bgfetch_queue_t*>>& queues) {
+    std::vector<std::string> keys;
+    for (const auto& queue : queues) {
+        for (const auto& it : *queue.second) {
+            keys.push_back(makeDocKey(queue.first, it.first));
+        }
+    }
+    std::vector<rocksdb::Slice> slices(keys.begin(), keys.end());
+    std::vector<rocksdb::ColumnFamilyHandle*> families(keys.size(),
+                                                        defaultFamily.get());
+    std::vector<std::string> values;
+    auto statuses =
+            db->MultiGet(rocksdb::ReadOptions(), families, slices, &values);
+
+    size_t ii = 0;
+    for (const auto& queue : queues) {
+        const uint16_t vb = queue.first;
+        for (auto& it : *queue.second) {
+            auto& bg_itm_ctx = it.second;
+            const auto& status = statuses[ii];
+            const auto& value = values[ii];
+            ++ii;
+
+            if (status.ok()) {
+                bg_itm_ctx.value = makeGetValue(
+                        vb, it.first, value, bg_itm_ctx.isMetaOnly);
+            } else if (status.IsNotFound()) {
+                bg_itm_ctx.value.setStatus(ENGINE_KEY_ENOENT);
+            } else {
+                logger.log(EXTENSION_LOG_WARNING,
+                           "RocksDBKVStore::getMulti: failed to read key, "
+                           "vb:%" PRIu16 ": %s",
+                           vb,
+                           status.ToString().c_str());
+                if (bg_itm_ctx.isMetaOnly == GetMetaOnly::No) {
+                    ++st.numGetFailure;
+                }
+                bg_itm_ctx.value.setStatus(ENGINE_TMPFAIL);
             }
-        } else {
-            for (auto& fetch : it.second.bgfetched_list) {
-                fetch->value->setStatus(ENGINE_KEY_ENOENT);
+
+            for (auto& fetch : bg_itm_ctx.bgfetched_list) {
+                fetch->value = &bg_itm_ctx.value;
+                st.readTimeHisto.add(
+                        std::chrono::duration_cast<std::chrono::microseconds>(
+                                ProcessClock::now() - fetch->initTime)
+                                .count());
+                if (status.ok()) {
+                    st.readSizeHisto.add(it.first.size() +
+                                         bg_itm_ctx.value.item->getNBytes());
+                }
             }
         }
     }
 }
 
+bool RocksDBKVStore::deleteVBucketKeys(uint16_t vbid) {
+    const std::string begin = makeVBPrefix(vbid);
+    const std::string end = makeVBEnd(vbid);
+
+    rocksdb::WriteBatch batch;
+    batch.DeleteRange(defaultFamily.get(), begin, end);
+    batch.DeleteRange(seqnoFamily.get(), begin, end);
+    batch.DeleteRange(localFamily.get(), begin, end);
+
+    std::lock_guard<std::mutex> lh(writeLock);
+    rocksdb::Status s = db->Write(writeOptions, &batch);
+    if (!s.ok()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::deleteVBucketKeys: failed to delete "
+                   "vb:%" PRIu16 ": %s",
+                   vbid,
+                   s.ToString().c_str());
+        return false;
+    }
+    cachedDocCount[vbid] = 0;
+    cachedDeleteCount[vbid] = 0;
+    return true;
+}
+
 void RocksDBKVStore::reset(uint16_t vbucketId) {
-    if (db) {
-        // TODO RDB:  Implement.
+    vbucket_state* state = cachedVBStates[vbucketId];
+    if (!state) {
+        throw std::invalid_argument(
+                "RocksDBKVStore::reset: No entry in cached "
+                "states for vbucket " +
+                std::to_string(vbucketId));
+    }
+
+    state->reset();
+    if (deleteVBucketKeys(vbucketId)) {
+        rocksdb::WriteBatch batch;
+        saveVBState(batch, vbucketId, 0, 0);
+        std::lock_guard<std::mutex> lh(writeLock);
+        rocksdb::Status s = db->Write(writeOptions, &batch);
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::reset: failed to save state of "
+                       "vb:%" PRIu16 ": %s",
+                       vbucketId,
+                       s.ToString().c_str());
+        }
     }
 }
 
 void RocksDBKVStore::del(const Item& itm, Callback<int>& cb) {
-    rocksdb::Slice k(mkKeySlice(itm.getVBucketId(), itm.getKey()));
-    batch->Delete(k);
-    int rv(1);
-    cb.callback(rv);
+    if (!intransaction) {
+        throw std::invalid_argument(
+                "RocksDBKVStore::del: intransaction must be "
+                "true to perform a delete operation.");
+    }
+
+    MutationRequestCallback requestcb;
+    requestcb.delCb = &cb;
+    pendingReqs.push_back(std::make_unique<RocksRequest>(itm, requestcb, true));
 }
 
-static bool matches_prefix(rocksdb::Slice s, size_t len, const char* p) {
-    return s.size() >= len && std::memcmp(p, s.data(), len) == 0;
+uint64_t RocksDBKVStore::prepareToDelete(uint16_t vbid) {
+    // Unlike a couchstore file revision, the vbucket's keys can't be told
+    // apart from those of a vbucket recreated before delVBucket() runs, so
+    // delete them now: a range deletion is a single write.
+    deleteVBucketKeys(vbid);
+    return 0;
 }
 
 void RocksDBKVStore::delVBucket(uint16_t vb, uint64_t vb_version) {
-    rocksdb::Iterator* it = db->NewIterator(rocksdb::ReadOptions());
-    const char* prefix(reinterpret_cast<const char*>(&vb));
-    std::string start(prefix, sizeof(vb));
-    begin();
-    for (it->Seek(start);
-         it->Valid() && matches_prefix(it->key(), sizeof(vb), prefix);
-         it->Next()) {
-        batch->Delete(it->key());
+    // The keys were deleted by prepareToDelete(); reclaim their space.
+    const std::string begin = makeVBPrefix(vb);
+    const std::string end = makeVBEnd(vb);
+    const rocksdb::Slice beginSlice(begin);
+    const rocksdb::Slice endSlice(end);
+    for (auto* family :
+         {defaultFamily.get(), seqnoFamily.get(), localFamily.get()}) {
+        rocksdb::Status s = db->CompactRange(
+                rocksdb::CompactRangeOptions(), family, &beginSlice, &endSlice);
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::delVBucket: failed to compact "
+                       "vb:%" PRIu16 ": %s",
+                       vb,
+                       s.ToString().c_str());
+        }
     }
-    delete it;
-    commit(nullptr); // TODO RDB: pass non-null for collections manifest.
 }
 
 bool RocksDBKVStore::snapshotVBucket(uint16_t vbucketId,
                                      const vbucket_state& vbstate,
                                      VBStatePersist options) {
-    // TODO RDB:  Implement
+    hrtime_t start = gethrtime();
+
+    if (updateCachedVBState(vbucketId, vbstate) &&
+        (options == VBStatePersist::VBSTATE_PERSIST_WITHOUT_COMMIT ||
+         options == VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT)) {
+        std::lock_guard<std::mutex> lh(writeLock);
+        rocksdb::WriteBatch batch;
+        saveVBState(batch,
+                    vbucketId,
+                    cachedDocCount[vbucketId],
+                    cachedDeleteCount[vbucketId]);
+        rocksdb::Status s = db->Write(writeOptions, &batch);
+        if (!s.ok()) {
+            ++st.numVbSetFailure;
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::snapshotVBucket: failed to save "
+                       "state:%s, vb:%" PRIu16 ": %s",
+                       VBucket::toString(vbstate.state),
+                       vbucketId,
+                       s.ToString().c_str());
+            return false;
+        }
+    }
+
+    st.snapshotHisto.add((gethrtime() - start) / 1000);
+
     return true;
 }
 
-bool RocksDBKVStore::snapshotStats(const std::map<std::string, std::string>&) {
-    // TODO RDB:  Implement
-    return true;
+void RocksDBKVStore::destroyInvalidVBuckets(bool destroyOnlyOne) {
+    for (uint16_t vbid = 0; vbid < cachedVBStates.size(); ++vbid) {
+        vbucket_state* state = cachedVBStates[vbid];
+        if (!state || state->state != vbucket_state_dead) {
+            continue;
+        }
+        if (!deleteVBucketKeys(vbid)) {
+            continue;
+        }
+        delete state;
+        cachedVBStates[vbid] = nullptr;
+        if (destroyOnlyOne) {
+            return;
+        }
+    }
 }
 
-void RocksDBKVStore::destroyInvalidVBuckets(bool) {
-    // TODO RDB:  implement
+RollbackResult RocksDBKVStore::rollback(uint16_t vbid,
+                                        uint64_t rollbackSeqno,
+                                        std::shared_ptr<RollbackCB> cb) {
+    // RocksDB keeps no older versions of a vbucket to rewind to, so only a
+    // rollback to zero can be honoured; fail anything else so that the
+    // caller resets the vbucket rather than believing it was rewound.
+    logger.log(EXTENSION_LOG_WARNING,
+               "RocksDBKVStore::rollback: vb:%" PRIu16
+               " rollback to seqno:%" PRIu64
+               " is not supported, the vbucket must be reset",
+               vbid,
+               rollbackSeqno);
+    return RollbackResult(false, 0, 0, 0);
 }
 
 StorageProperties RocksDBKVStore::getStorageProperties(void) {
     StorageProperties rv(StorageProperties::EfficientVBDump::Yes,
                          StorageProperties::EfficientVBDeletion::Yes,
-                         StorageProperties::PersistedDeletion::No,
-                         // TODO RDB: Not strictly true, multiGet
-                         // does not yet use the underlying multi get
-                         // of RocksDB
+                         StorageProperties::PersistedDeletion::Yes,
                          StorageProperties::EfficientGet::Yes,
                          StorageProperties::ConcurrentWriteCompact::Yes);
     return rv;
 }
 
-rocksdb::Slice RocksDBKVStore::mkKeySlice(uint16_t vbid, const DocKey& k) {
-    std::memcpy(keyBuffer, &vbid, sizeof(vbid));
-    std::memcpy(keyBuffer + sizeof(vbid), k.data(), k.size());
-    return rocksdb::Slice(keyBuffer, sizeof(vbid) + k.size());
-}
-
-void RocksDBKVStore::grokKeySlice(const rocksdb::Slice& s,
-                                  uint16_t* v,
-                                  std::string* k) {
-    assert(s.size() > sizeof(uint16_t));
-    std::memcpy(v, s.data(), sizeof(uint16_t));
-    k->assign(s.data() + sizeof(uint16_t), s.size() - sizeof(uint16_t));
-}
-
-rocksdb::Slice RocksDBKVStore::mkValSlice(const Item& item) {
-    // Serialize an Item to the format to write to RocksDB.
-    // Using the following layout:
-    //    uint64_t           cas          ]
-    //    uint64_t           revSeqno     ] ItemMetaData
-    //    uint32_t           flags        ]
-    //    uint32_t           exptime      ]
-    //    uint64_t           bySeqno
-    //    uint8_t            datatype
-    //    uint32_t           value_len
-    //    uint8_t[value_len] value
-    //
-    adjustValBuffer(item.size());
-    char* dest = valBuffer;
-    std::memcpy(dest, &item.getMetaData(), sizeof(ItemMetaData));
-    dest += sizeof(ItemMetaData);
+bool RocksDBKVStore::compactDB(compaction_ctx* ctx) {
+    hrtime_t start = gethrtime();
+    const uint16_t vbid = ctx->db_file_id;
+    const std::string prefix = makeVBPrefix(vbid);
+    const std::string end = makeVBEnd(vbid);
 
-    const int64_t bySeqno{item.getBySeqno()};
-    std::memcpy(dest, &bySeqno, sizeof(bySeqno));
-    dest += sizeof(uint64_t);
+    // Find the deletions to purge, and notify expired items, from a
+    // snapshot of the vbucket (so without holding up the flusher).
+    const rocksdb::Snapshot* snapshot = db->GetSnapshot();
+    rocksdb::ReadOptions readOptions;
+    readOptions.snapshot = snapshot;
+    readOptions.fill_cache = false;
+    const uint64_t highSeqno = readHighSeqno(readOptions, vbid);
+    const time_t currtime = ep_real_time();
 
-    const uint8_t datatype{item.getDataType()};
-    std::memcpy(dest, &datatype, sizeof(datatype));
-    dest += sizeof(uint8_t);
+    std::vector<std::pair<std::string, int64_t>> purgeable;
+    std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(readOptions, defaultFamily.get()));
+    for (it->Seek(prefix); it->Valid() && hasPrefix(it->key(), prefix);
+         it->Next()) {
+        const auto header = grokDocHeader(it->value());
+        const DocKey key = grokDocKey(it->key());
+        if (header.deleted) {
+            if (uint64_t(header.bySeqno) != highSeqno &&
+                (ctx->drop_deletes ||
+                 (uint64_t(header.meta.exptime) < ctx->purge_before_ts &&
+                  (!ctx->purge_before_seq ||
+                   uint64_t(header.bySeqno) <= ctx->purge_before_seq)))) {
+                purgeable.emplace_back(it->key().ToString(), header.bySeqno);
+                continue;
+            }
+        } else if (header.meta.exptime && header.meta.exptime < currtime &&
+                   ctx->expiryCallback) {
+            auto gv = makeGetValue(vbid, key, it->value());
+            if (gv.item->decompressValue()) {
+                time_t expiryTime = currtime;
+                ctx->expiryCallback->callback(*gv.item, expiryTime);
+            }
+        }
 
-    const uint32_t valueLen = item.getNBytes();
-    std::memcpy(dest, &valueLen, sizeof(valueLen));
-    dest += sizeof(valueLen);
-    std::memcpy(dest, item.getValue()->getData(), valueLen);
-    dest += valueLen;
+        if (ctx->bloomFilterCallback) {
+            ctx->bloomFilterCallback->callback(
+                    ctx->db_file_id, key, header.deleted);
+        }
+    }
+    const rocksdb::Status iterStatus = it->status();
+    it.reset();
+    db->ReleaseSnapshot(snapshot);
+    if (!iterStatus.ok()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::compactDB: failed to read vb:%" PRIu16
+                   ": %s",
+                   vbid,
+                   iterStatus.ToString().c_str());
+        return false;
+    }
 
-    return rocksdb::Slice(valBuffer, dest - valBuffer);
-}
+    uint64_t maxPurgedSeqno = ctx->max_purged_seq[vbid];
+    if (!purgeable.empty()) {
+        // Only purge the deletions the flusher hasn't since overwritten.
+        std::lock_guard<std::mutex> lh(writeLock);
+        std::vector<rocksdb::Slice> keys;
+        keys.reserve(purgeable.size());
+        for (const auto& entry : purgeable) {
+            keys.emplace_back(entry.first);
+        }
+        std::vector<rocksdb::ColumnFamilyHandle*> families(
+                keys.size(), defaultFamily.get());
+        std::vector<std::string> values;
+        auto statuses =
+                db->MultiGet(rocksdb::ReadOptions(), families, keys, &values);
 
-std::unique_ptr<Item> RocksDBKVStore::grokValSlice(uint16_t vb,
-                                                   const DocKey& key,
-                                                   const rocksdb::Slice& s) {
-    // Reverse of mkValSlice - deserialize back into an Item.
+        rocksdb::WriteBatch batch;
+        size_t purged = 0;
+        uint64_t purgedSeqno = maxPurgedSeqno;
+        for (size_t ii = 0; ii < purgeable.size(); ++ii) {
+            if (!statuses[ii].ok() ||
+                grokDocHeader(values[ii]).bySeqno != purgeable[ii].second) {
+                continue;
+            }
+            batch.Delete(defaultFamily.get(), purgeable[ii].first);
+            batch.Delete(seqnoFamily.get(),
+                         makeSeqnoKey(vbid, purgeable[ii].second));
+            purgedSeqno = std::max(purgedSeqno,
+                                   uint64_t(purgeable[ii].second));
+            ++purged;
+        }
 
-    assert(s.size() >= sizeof(ItemMetaData) + sizeof(uint64_t) +
-                               sizeof(uint8_t) + sizeof(uint32_t));
+        const size_t deleteCount =
+                cachedDeleteCount[vbid] -
+                std::min(size_t(cachedDeleteCount[vbid]), purged);
+        vbucket_state* state = cachedVBStates[vbid];
+        if (state) {
+            state->purgeSeqno = std::max(state->purgeSeqno, purgedSeqno);
+        }
+        saveVBState(batch, vbid, cachedDocCount[vbid], deleteCount);
 
-    ItemMetaData meta;
-    const char* src = s.data();
-    std::memcpy(&meta, src, sizeof(meta));
-    src += sizeof(meta);
+        rocksdb::Status s = db->Write(writeOptions, &batch);
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::compactDB: failed to purge "
+                       "vb:%" PRIu16 ": %s",
+                       vbid,
+                       s.ToString().c_str());
+            return false;
+        }
+        cachedDeleteCount[vbid] = deleteCount;
+        maxPurgedSeqno = purgedSeqno;
+    }
+    ctx->max_purged_seq[vbid] = maxPurgedSeqno;
 
-    int64_t bySeqno;
-    std::memcpy(&bySeqno, src, sizeof(bySeqno));
-    src += sizeof(bySeqno);
+    const rocksdb::Slice beginSlice(prefix);
+    const rocksdb::Slice endSlice(end);
+    for (auto* family : {defaultFamily.get(), seqnoFamily.get()}) {
+        rocksdb::Status s = db->CompactRange(
+                rocksdb::CompactRangeOptions(), family, &beginSlice, &endSlice);
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::compactDB: failed to compact "
+                       "vb:%" PRIu16 ": %s",
+                       vbid,
+                       s.ToString().c_str());
+            return false;
+        }
+    }
 
-    uint8_t datatype;
-    std::memcpy(&datatype, src, sizeof(datatype));
-    src += sizeof(datatype);
+    st.compactHisto.add((gethrtime() - start) / 1000);
+    return true;
+}
 
-    uint32_t valueLen;
-    std::memcpy(&valueLen, src, sizeof(valueLen));
-    src += sizeof(valueLen);
+DBFileInfo RocksDBKVStore::getDbFileInfo(uint16_t vbid) {
+    // RocksDB has no per-vbucket files: estimate the size of the
+    // vbucket's key ranges.
+    const std::string begin = makeVBPrefix(vbid);
+    const std::string end = makeVBEnd(vbid);
+    const rocksdb::Range range(begin, end);
+    uint64_t total = 0;
+    for (auto* family : {defaultFamily.get(), seqnoFamily.get()}) {
+        uint64_t size = 0;
+        db->GetApproximateSizes(family, &range, 1, &size);
+        total += size;
+    }
+    return DBFileInfo(total, total);
+}
 
-    uint8_t extMeta[EXT_META_LEN];
-    extMeta[0] = datatype;
+DBFileInfo RocksDBKVStore::getAggrDbFileInfo() {
+    DBFileInfo info;
+    for (auto* family :
+         {defaultFamily.get(), seqnoFamily.get(), localFamily.get()}) {
+        uint64_t value = 0;
+        if (db->GetIntProperty(
+                    family, "rocksdb.total-sst-files-size", &value)) {
+            info.fileSize += value;
+        }
+        if (db->GetIntProperty(
+                    family, "rocksdb.estimate-live-data-size", &value)) {
+            info.spaceUsed += value;
+        }
+    }
+    return info;
+}
+
+bool RocksDBKVStore::getStat(const char* name, size_t& value) {
+    if (strcmp("Block_cache_hits", name) == 0) {
+        value = rdbOptions.statistics->getTickerCount(
+                rocksdb::BLOCK_CACHE_HIT);
+        return true;
+    } else if (strcmp("Block_cache_misses", name) == 0) {
+        value = rdbOptions.statistics->getTickerCount(
+                rocksdb::BLOCK_CACHE_MISS);
+        return true;
+    }
+    return false;
+}
+
+ENGINE_ERROR_CODE RocksDBKVStore::getAllKeys(
+        uint16_t vbid,
+        const DocKey start_key,
+        uint32_t count,
+        std::shared_ptr<Callback<const DocKey&>> cb) {
+    const std::string prefix = makeVBPrefix(vbid);
+    std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(rocksdb::ReadOptions(), defaultFamily.get()));
+    uint32_t found = 0;
+    for (it->Seek(makeDocKey(vbid, start_key));
+         found < count && it->Valid() && hasPrefix(it->key(), prefix);
+         it->Next()) {
+        if (grokDocHeader(it->value()).deleted) {
+            continue;
+        }
+        const DocKey key = grokDocKey(it->key());
+        cb->callback(key);
+        ++found;
+    }
+    if (!it->status().ok()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::getAllKeys: failed to read "
+                   "vb:%" PRIu16 ": %s",
+                   vbid,
+                   it->status().ToString().c_str());
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+bool RocksDBKVStore::persistCollectionsManifestItem(uint16_t vbid,
+                                                    const Item& manifestItem) {
+    cb::const_char_buffer buffer(manifestItem.getData(),
+                                 manifestItem.getNBytes());
+    const std::string manifest = Collections::VB::Manifest::serialToJson(
+            SystemEvent(manifestItem.getFlags()),
+            buffer,
+            manifestItem.getBySeqno());
 
-    return std::make_unique<Item>(key,
-                                  meta.flags,
-                                  meta.exptime,
-                                  src,
-                                  valueLen,
-                                  extMeta,
-                                  EXT_META_LEN,
-                                  meta.cas,
-                                  bySeqno,
-                                  vb,
-                                  meta.revSeqno);
+    std::lock_guard<std::mutex> lh(writeLock);
+    rocksdb::Status s = db->Put(writeOptions,
+                                localFamily.get(),
+                                makeLocalKey(vbid, manifestKeyName),
+                                manifest);
+    if (!s.ok()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::persistCollectionsManifestItem: failed "
+                   "to save the manifest of vb:%" PRIu16 ": %s",
+                   vbid,
+                   s.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string RocksDBKVStore::getCollectionsManifest(uint16_t vbid) {
+    std::string manifest;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(),
+                                localFamily.get(),
+                                makeLocalKey(vbid, manifestKeyName),
+                                &manifest);
+    if (!s.ok() && !s.IsNotFound()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::getCollectionsManifest: failed to read "
+                   "the manifest of vb:%" PRIu16 ": %s",
+                   vbid,
+                   s.ToString().c_str());
+    }
+    return manifest;
 }
 
 GetValue RocksDBKVStore::makeGetValue(uint16_t vb,
                                       const DocKey& key,
-                                      const std::string& value) {
-    rocksdb::Slice sval(value);
-    return GetValue(grokValSlice(vb, key, sval), ENGINE_SUCCESS, -1, 0);
+                                      const rocksdb::Slice& value,
+                                      GetMetaOnly getMetaOnly) {
+    const auto header = grokDocHeader(value);
+
+    uint8_t extMeta[EXT_META_LEN];
+    extMeta[0] = header.datatype;
+    const char* data = value.data() + docHeaderSize;
+    size_t nbytes = header.valueLen;
+    if (getMetaOnly == GetMetaOnly::Yes || nbytes == 0) {
+        // Without its value, it cannot be compressed.
+        extMeta[0] &= ~PROTOCOL_BINARY_DATATYPE_SNAPPY;
+        data = nullptr;
+        nbytes = 0;
+    }
+
+    auto item = std::make_unique<Item>(key,
+                                       header.meta.flags,
+                                       header.meta.exptime,
+                                       data,
+                                       nbytes,
+                                       extMeta,
+                                       EXT_META_LEN,
+                                       header.meta.cas,
+                                       header.bySeqno,
+                                       vb,
+                                       header.meta.revSeqno);
+    if (header.deleted) {
+        item->setDeleted();
+    }
+    return GetValue(std::move(item), ENGINE_SUCCESS, -1, 0);
+}
+
+uint64_t RocksDBKVStore::readHighSeqno(const rocksdb::ReadOptions& options,
+                                       uint16_t vbid) {
+    std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(options, seqnoFamily.get()));
+    it->Seek(makeVBEnd(vbid));
+    if (it->Valid()) {
+        it->Prev();
+    } else {
+        it->SeekToLast();
+    }
+    if (it->Valid() && hasPrefix(it->key(), makeVBPrefix(vbid))) {
+        return grokSeqnoKey(it->key());
+    }
+    return 0;
 }
 
 ScanContext* RocksDBKVStore::initScanContext(
@@ -336,16 +1249,167 @@ ScanContext* RocksDBKVStore::initScanContext(
         uint64_t startSeqno,
         DocumentFilter options,
         ValueFilter valOptions) {
-    // TODO RDB vmx 2016-10-29: implement
+    const rocksdb::Snapshot* snapshot = db->GetSnapshot();
+    rocksdb::ReadOptions readOptions;
+    readOptions.snapshot = snapshot;
+    readOptions.fill_cache = false;
+
+    const uint64_t highSeqno = readHighSeqno(readOptions, vbid);
+
+    // Every document is counted when scanning from the start; else count
+    // the entries of the seqno index from startSeqno, which (as stale
+    // entries are only dropped by compaction) may overestimate.
+    uint64_t count = 0;
+    if (startSeqno <= 1) {
+        count = size_t(cachedDocCount[vbid]) + cachedDeleteCount[vbid];
+    } else {
+        const std::string prefix = makeVBPrefix(vbid);
+        std::unique_ptr<rocksdb::Iterator> it(
+                db->NewIterator(readOptions, seqnoFamily.get()));
+        for (it->Seek(makeSeqnoKey(vbid, startSeqno));
+             it->Valid() && hasPrefix(it->key(), prefix);
+             it->Next()) {
+            ++count;
+        }
+    }
+
     size_t scanId = scanCounter++;
+    {
+        std::lock_guard<std::mutex> lh(scanLock);
+        scanSnapshots[scanId] = snapshot;
+    }
+
     return new ScanContext(cb,
                            cl,
                            vbid,
                            scanId,
                            startSeqno,
-                           99999999,
+                           highSeqno,
                            options,
                            valOptions,
-                           999999,
+                           count,
                            configuration);
 }
+
+scan_error_t RocksDBKVStore::scan(ScanContext* ctx) {
+    if (!ctx) {
+        return scan_failed;
+    }
+
+    if (ctx->lastReadSeqno == ctx->maxSeqno) {
+        return scan_success;
+    }
+
+    rocksdb::ReadOptions readOptions;
+    readOptions.fill_cache = false;
+    {
+        std::lock_guard<std::mutex> lh(scanLock);
+        auto itr = scanSnapshots.find(ctx->scanId);
+        if (itr == scanSnapshots.end()) {
+            return scan_failed;
+        }
+        readOptions.snapshot = itr->second;
+    }
+
+    uint64_t start = ctx->startSeqno;
+    if (ctx->lastReadSeqno != 0) {
+        start = ctx->lastReadSeqno + 1;
+    }
+
+    const std::string prefix = makeVBPrefix(ctx->vbid);
+    std::unique_ptr<rocksdb::Iterator> it(
+            db->NewIterator(readOptions, seqnoFamily.get()));
+    std::string value;
+    for (it->Seek(makeSeqnoKey(ctx->vbid, start));
+         it->Valid() && hasPrefix(it->key(), prefix);
+         it->Next()) {
+        const uint64_t seqno = grokSeqnoKey(it->key());
+        if (seqno > ctx->maxSeqno) {
+            break;
+        }
+
+        rocksdb::Status s = db->Get(
+                readOptions, defaultFamily.get(), it->value(), &value);
+        if (s.IsNotFound() || (s.ok() && grokDocHeader(value).bySeqno !=
+                                                 int64_t(seqno))) {
+            // A stale entry: the document has been purged, or written
+            // again at a later seqno.
+            ctx->lastReadSeqno = seqno;
+            continue;
+        }
+        if (!s.ok()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::scan: failed to read the document "
+                       "of vb:%" PRIu16 ", seqno:%" PRIu64 ": %s",
+                       ctx->vbid,
+                       seqno,
+                       s.ToString().c_str());
+            return scan_failed;
+        }
+
+        const DocKey key = grokDocKey(it->value());
+        if (ctx->docFilter == DocumentFilter::NO_DELETES &&
+            grokDocHeader(value).deleted) {
+            continue;
+        }
+
+        CacheLookup lookup(key, seqno, ctx->vbid);
+        ctx->lookup->callback(lookup);
+        if (ctx->lookup->getStatus() == ENGINE_KEY_EEXISTS) {
+            ctx->lastReadSeqno = seqno;
+            continue;
+        } else if (ctx->lookup->getStatus() == ENGINE_ENOMEM) {
+            return scan_again;
+        }
+
+        const bool onlyKeys = ctx->valFilter == ValueFilter::KEYS_ONLY;
+        GetValue gv = makeGetValue(ctx->vbid,
+                                   key,
+                                   value,
+                                   onlyKeys ? GetMetaOnly::Yes
+                                            : GetMetaOnly::No);
+        if (ctx->valFilter == ValueFilter::VALUES_DECOMPRESSED &&
+            !gv.item->decompressValue()) {
+            logger.log(EXTENSION_LOG_WARNING,
+                       "RocksDBKVStore::scan: failed to inflate document, "
+                       "vb:%" PRIu16 ", seqno:%" PRIu64,
+                       ctx->vbid,
+                       seqno);
+            ctx->lastReadSeqno = seqno;
+            continue;
+        }
+
+        GetValue rv(std::move(gv.item), ENGINE_SUCCESS, -1, onlyKeys);
+        ctx->callback->callback(rv);
+        if (ctx->callback->getStatus() == ENGINE_ENOMEM) {
+            return scan_again;
+        }
+        ctx->lastReadSeqno = seqno;
+    }
+
+    if (!it->status().ok()) {
+        logger.log(EXTENSION_LOG_WARNING,
+                   "RocksDBKVStore::scan: failed to read the seqno index of "
+                   "vb:%" PRIu16 ": %s",
+                   ctx->vbid,
+                   it->status().ToString().c_str());
+        return scan_failed;
+    }
+    return scan_success;
+}
+
+void RocksDBKVStore::destroyScanContext(ScanContext* ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lh(scanLock);
+        auto itr = scanSnapshots.find(ctx->scanId);
+        if (itr != scanSnapshots.end()) {
+            db->ReleaseSnapshot(itr->second);
+            scanSnapshots.erase(itr);
+        }
+    }
+    delete ctx;
+}
@@ -16,19 +16,36 @@
  */
 
 /**
- * Experimental RocksDB KVStore implementation
+ * RocksDB KVStore implementation
  *
  * Uses RocksDB (https://github.com/facebook/rocksdb) as a backend.
+ *
+ * Each shard has one database, with three column families:
+ *   - default: the documents (including deletions), keyed by vbucket and
+ *     document key.
+ *   - seqno: the by-seqno index of each vbucket, mapping the vbucket and
+ *     seqno of each document to its key; used by scans (backfill and
+ *     warmup). Commits don't remove the entry of a document's previous
+ *     version: scans skip such stale entries, and compaction drops them
+ *     (see SeqnoIndexCompactionFilter).
+ *   - local: per-vbucket state: the vbucket_state, the persisted document
+ *     counts and the collections manifest.
+ * All integers in keys are big-endian, so that keys sort by vbucket and
+ * then seqno.
  */
 
 #pragma once
 
 #include <platform/dirutils.h>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <vector>
 
 #include <kvstore.h>
 
+#include <rocksdb/cache.h>
+#include <rocksdb/compaction_filter.h>
 #include <rocksdb/db.h>
 #include <rocksdb/listener.h>
 #include <string>
@@ -37,7 +54,8 @@
 #include "vbucket_bgfetch_item.h"
 
 // Used to set the correct engine in the ObjectRegistry thread local
-// in RocksDB's flusher threads.
+// in RocksDB's flusher and compaction threads, so that their allocations
+// (including block cache entries) are accounted to the bucket.
 class FlushStartListener : public rocksdb::EventListener {
 public:
     FlushStartListener(EventuallyPersistentEngine* epe) : engine(epe) {
@@ -45,11 +63,56 @@ public:
     void OnFlushBegin(rocksdb::DB*, const rocksdb::FlushJobInfo&) override {
         ObjectRegistry::onSwitchThread(engine, false);
     }
+    void OnCompactionBegin(rocksdb::DB*,
+                           const rocksdb::CompactionJobInfo&) override {
+        ObjectRegistry::onSwitchThread(engine, false);
+    }
 
 private:
     EventuallyPersistentEngine* engine;
 };
 
+/**
+ * Compaction filter of the seqno index, dropping the entries which no
+ * longer refer to the current version of their document: the document
+ * has since been written again (at a later seqno), or purged.
+ *
+ * Only entries invisible to every snapshot are offered to the filter, so
+ * in-progress scans still see the entries of their snapshot.
+ */
+class SeqnoIndexCompactionFilter : public rocksdb::CompactionFilter {
+public:
+    /// Start filtering, reading the documents from the given family.
+    void open(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* docs);
+
+    /**
+     * Stop filtering; entries are kept until open() is called. Background
+     * compactions must have been stopped before db is closed.
+     */
+    void close();
+
+    bool Filter(int level,
+                const rocksdb::Slice& key,
+                const rocksdb::Slice& existingValue,
+                std::string* newValue,
+                bool* valueChanged) const override;
+
+    bool IgnoreSnapshots() const override {
+        return false;
+    }
+
+    const char* Name() const override {
+        return "SeqnoIndexCompactionFilter";
+    }
+
+private:
+    rocksdb::DB* db = nullptr;
+    rocksdb::ColumnFamilyHandle* docs = nullptr;
+    std::atomic<bool> ready{false};
+};
+
+class RocksRequest;
+
 /**
  * A persistence store based on rocksdb.
  */
@@ -111,8 +174,17 @@ public:
                            GetMetaOnly getMetaOnly,
                            bool fetchDelete = false) override;
 
+    /**
+     * Fetch the documents of a vbucket with a single RocksDB MultiGet.
+     */
     void getMulti(uint16_t vb, vb_bgfetch_queue_t& itms) override;
 
+    /**
+     * Fetch the documents of several vbuckets with a single MultiGet, as
+     * they all share the shard's DB.
+     */
+    void getMultiVBuckets(multi_vb_bgfetch_queue_t& itms) override;
+
     /**
      * Overrides del().
      */
@@ -122,10 +194,6 @@ public:
 
     std::vector<vbucket_state*> listPersistedVbuckets(void) override;
 
-    /**
-     * Take a snapshot of the stats in the main DB.
-     */
-    bool snapshotStats(const std::map<std::string, std::string>& m);
     /**
      * Take a snapshot of the vbucket states in the main DB.
      */
@@ -133,7 +201,13 @@ public:
                          const vbucket_state& vbstate,
                          VBStatePersist options) override;
 
-    void destroyInvalidVBuckets(bool);
+    /**
+     * Delete the keys of vbuckets whose persisted state is dead, and forget
+     * their cached state.
+     *
+     * @param destroyOnlyOne stop after the first such vbucket
+     */
+    void destroyInvalidVBuckets(bool destroyOnlyOne);
 
     size_t getNumShards() {
         return configuration.getMaxShards();
@@ -147,16 +221,16 @@ public:
         return 1024;
     }
 
-    bool compactDB(compaction_ctx*) override {
-        // Explicit compaction is not needed.
-        // Compaction is continuously occurring in separate threads
-        // under RocksDB's control
-        return true;
-    }
+    /**
+     * Purge the vbucket's deletions (and notify expired items) as
+     * CouchKVStore does, then have RocksDB compact the vbucket's key
+     * ranges. RocksDB otherwise compacts continuously in its own threads.
+     */
+    bool compactDB(compaction_ctx* ctx) override;
 
-    uint16_t getDBFileId(const protocol_binary_request_compact_db&) override {
-        // Not needed if there is no explicit compaction
-        return 0;
+    uint16_t getDBFileId(
+            const protocol_binary_request_compact_db& req) override {
+        return ntohs(req.message.header.request.vbucket);
     }
 
     vbucket_state* getVBucketState(uint16_t vbucketId) override {
@@ -164,36 +238,20 @@ public:
     }
 
     size_t getNumPersistedDeletes(uint16_t vbid) override {
-        // TODO vmx 2016-10-29: implement
-        return 0;
+        return cachedDeleteCount[vbid];
     }
 
-    DBFileInfo getDbFileInfo(uint16_t vbid) override {
-        // TODO vmx 2016-10-29: implement
-        DBFileInfo vbinfo;
-        return vbinfo;
-    }
+    DBFileInfo getDbFileInfo(uint16_t vbid) override;
 
-    DBFileInfo getAggrDbFileInfo() override {
-        // TODO vmx 2016-10-29: implement
-        DBFileInfo vbinfo;
-        return vbinfo;
-    }
+    DBFileInfo getAggrDbFileInfo() override;
 
     size_t getItemCount(uint16_t vbid) override {
-        // TODO vmx 2016-10-29: implement
-        return 0;
+        return cachedDocCount[vbid];
     }
 
     RollbackResult rollback(uint16_t vbid,
                             uint64_t rollbackSeqno,
-                            std::shared_ptr<RollbackCB> cb) override {
-        // TODO vmx 2016-10-29: implement
-        // NOTE vmx 2016-10-29: For LevelDB/RocksDB it will probably
-        // always be a full rollback as it doesn't support Couchstore
-        // like rollback semantics
-        return RollbackResult(false, 0, 0, 0);
-    }
+                            std::shared_ptr<RollbackCB> cb) override;
 
     void pendingTasks() override {
         // NOTE vmx 2016-10-29: Intentionally left empty;
@@ -203,10 +261,7 @@ public:
             uint16_t vbid,
             const DocKey start_key,
             uint32_t count,
-            std::shared_ptr<Callback<const DocKey&>> cb) override {
-        // TODO vmx 2016-10-29: implement
-        return ENGINE_SUCCESS;
-    }
+            std::shared_ptr<Callback<const DocKey&>> cb) override;
 
     ScanContext* initScanContext(std::shared_ptr<Callback<GetValue>> cb,
                                  std::shared_ptr<Callback<CacheLookup>> cl,
@@ -215,35 +270,25 @@ public:
                                  DocumentFilter options,
                                  ValueFilter valOptions) override;
 
-    scan_error_t scan(ScanContext* sctx) override {
-        // TODO vmx 2016-10-29: implement
-        return scan_success;
-    }
+    scan_error_t scan(ScanContext* sctx) override;
 
-    void destroyScanContext(ScanContext* ctx) override {
-        // TODO vmx 2016-10-29: implement
-        delete ctx;
-    }
+    void destroyScanContext(ScanContext* ctx) override;
 
     bool persistCollectionsManifestItem(uint16_t vbid,
-                                        const Item& manifestItem) override {
-        // TODO DJR 2017-05-19 implement this.
-        return false;
-    }
+                                        const Item& manifestItem) override;
 
-    std::string getCollectionsManifest(uint16_t vbid) override {
-        // TODO DJR 2017-05-19 implement this.
-        return "";
-    }
+    std::string getCollectionsManifest(uint16_t vbid) override;
 
     void incrementRevision(uint16_t vbid) override {
-        // TODO DJR 2017-05-19 implement this.
+        // Nothing to do: a vbucket's data isn't kept in per-revision files.
     }
 
-    uint64_t prepareToDelete(uint16_t vbid) override {
-        // TODO DJR 2017-05-19 implement this.
-        return 0;
-    }
+    /**
+     * Delete the vbucket's keys; delVBucket() later reclaims their space.
+     */
+    uint64_t prepareToDelete(uint16_t vbid) override;
+
+    bool getStat(const char* name, size_t& value) override;
 
     std::unique_ptr<RocksDBKVStore> makeReadOnlyStore() {
         // Not using make_unique due to the private constructor we're calling
@@ -252,38 +297,73 @@ public:
     }
 
 private:
-    /**
-     * Direct access to the DB.
-     */
-    std::unique_ptr<rocksdb::DB> db;
-    char* keyBuffer;
-    char* valBuffer;
-    size_t valSize;
-
-    rocksdb::Options rdbOptions;
-
     void open();
 
     void close();
 
-    rocksdb::Slice mkKeySlice(uint16_t, const DocKey& k);
-    rocksdb::SliceParts mkKeySliceParts(uint16_t, const DocKey& k);
-    void grokKeySlice(const rocksdb::Slice&, uint16_t*, std::string*);
+    /// Load the persisted vbucket states and document counts.
+    void loadVBStates();
 
-    void adjustValBuffer(const size_t);
+    /**
+     * Add the write saving the vbucket's cached state, with the given
+     * document counts, to the batch.
+     */
+    void saveVBState(rocksdb::WriteBatch& batch,
+                     uint16_t vbid,
+                     size_t docCount,
+                     size_t deleteCount);
+
+    /// Delete all of the vbucket's keys, and reset its document counts.
+    bool deleteVBucketKeys(uint16_t vbid);
 
-    rocksdb::Slice mkValSlice(const Item& item);
-    rocksdb::SliceParts mkValSliceParts(const Item& item);
-    std::unique_ptr<Item> grokValSlice(uint16_t vb,
-                                       const DocKey& key,
-                                       const rocksdb::Slice& s);
+    /// The highest seqno of the vbucket's documents, as read with options.
+    uint64_t readHighSeqno(const rocksdb::ReadOptions& options, uint16_t vbid);
+
+    /**
+     * Write the pending requests (and collections manifest, if any), and
+     * invoke their callbacks.
+     * @return true if the batch was written
+     */
+    bool commitBatch(const Item* collectionsManifest);
+
+    /// Fetch the documents of the given vbuckets' queues with one MultiGet.
+    void multiGet(const std::vector<std::pair<uint16_t, vb_bgfetch_queue_t*>>&
+                          queues);
 
     GetValue makeGetValue(uint16_t vb,
                           const DocKey& key,
-                          const std::string& value);
+                          const rocksdb::Slice& value,
+                          GetMetaOnly getMetaOnly = GetMetaOnly::No);
 
-    std::unique_ptr<rocksdb::WriteBatch> batch;
+    /**
+     * Direct access to the DB. The column family handles must be destroyed
+     * before it is.
+     */
+    std::unique_ptr<rocksdb::DB> db;
+    std::unique_ptr<rocksdb::ColumnFamilyHandle> defaultFamily;
+    std::unique_ptr<rocksdb::ColumnFamilyHandle> seqnoFamily;
+    std::unique_ptr<rocksdb::ColumnFamilyHandle> localFamily;
+
+    rocksdb::Options rdbOptions;
+    SeqnoIndexCompactionFilter seqnoIndexFilter;
     rocksdb::WriteOptions writeOptions;
 
+    // This shard's share of the bucket's block cache (null for none).
+    std::shared_ptr<rocksdb::Cache> blockCache;
+
+    Logger& logger;
+
+    bool intransaction;
+    std::vector<std::unique_ptr<RocksRequest>> pendingReqs;
+
+    // Serialises writes of the flusher with those of compaction, so that
+    // compaction only purges deletions which are still current.
+    std::mutex writeLock;
+
+    std::vector<Couchbase::RelaxedAtomic<size_t>> cachedDeleteCount;
+
+    // Snapshots of the in-progress scans, by scan id.
+    std::mutex scanLock;
+    std::map<size_t, const rocksdb::Snapshot*> scanSnapshots;
     std::atomic<size_t> scanCounter; // atomic counter for generating scan id
 };
@@ -63,6 +63,8 @@ public:
         warmedUpValues(0),
         warmDups(0),
         warmOOM(0),
+        warmupOpsServed(0),
+        warmupBgFetched(0),
         warmupMemUsedCap(0),
         warmupNumReadCap(0),
         replicationThrottleWriteQueueCap(0),
@@ -99,6 +101,8 @@ public:
         pagerRuns(0),
         expiryPagerRuns(0),
         itemsRemovedFromCheckpoints(0),
+        itemsExpelledFromCheckpoints(0),
+        memFreedByCheckpointItemExpel(0),
         numValueEjects(0),
         numFailedEjects(0),
         numNotMyVBuckets(0),
@@ -109,6 +113,11 @@ public:
         numStoredVal(0),
         totalStoredValSize(0),
         storedValOverhead(0),
+        numInlineValues(0),
+        inlineValueSize(0),
+        inlineValueSaved(0),
+        inlineValueCapacity(0),
+        expiryIndexMemory(0),
         memOverhead(0),
         numItem(0),
         totalMemory(0),
@@ -217,6 +226,10 @@ public:
     Counter warmDups;
     //! Number of OOM failures at warmup time.
     Counter warmOOM;
+    //! Number of gets and stores served while warmup served traffic.
+    Counter warmupOpsServed;
+    //! Number of background fetches completed while warmup served traffic.
+    Counter warmupBgFetched;
 
     //! Fill % of memory used during warmup we're going to enable traffic
     std::atomic<double> warmupMemUsedCap;
@@ -303,12 +316,23 @@ public:
     Counter expiryPagerRuns;
     //! Number of items removed from closed unreferenced checkpoints.
     Counter itemsRemovedFromCheckpoints;
+    //! Number of items expelled from the front of referenced checkpoints.
+    Counter itemsExpelledFromCheckpoints;
+    //! Estimated memory (in bytes) released by expelling checkpoint items.
+    Counter memFreedByCheckpointItemExpel;
     //! Number of times a value is ejected
     Counter numValueEjects;
     //! Number of times a value could not be ejected
     Counter numFailedEjects;
     //! Number of times "Not my bucket" happened
     Counter numNotMyVBuckets;
+    //! Number of gets served from a resident value.
+    Counter cacheHits;
+    //! Number of gets which had to fetch the value from disk.
+    Counter cacheMisses;
+    //! Number of bgfetched values not admitted to the cache by the LFU
+    //! eviction strategy (made the first candidates for eviction).
+    Counter lfuAdmissionRejects;
     //! Total size of stored objects.
     Counter currentSize;
     //! Total number of blob objects
@@ -323,6 +347,17 @@ public:
     Counter totalStoredValSize;
     //! Total size of StoredVal memory overhead
     Counter storedValOverhead;
+    //! Number of values stored inline in their StoredValue (no Blob)
+    Counter numInlineValues;
+    //! Total size of values stored inline in their StoredValue
+    Counter inlineValueSize;
+    //! Bytes saved by storing values inline (Blob headers not allocated)
+    Counter inlineValueSaved;
+    //! Total inline value storage allocated in StoredValues, used or not
+    Counter inlineValueCapacity;
+    //! Estimated memory used by the vBuckets' expiry indexes (included in
+    //! memOverhead)
+    Counter expiryIndexMemory;
     //! Amount of memory used to track items and what-not.
     cb::CachelinePadded<Counter> memOverhead;
     //! Total number of Item objects
@@ -392,6 +427,13 @@ public:
     //! Histogram of background wait loads.
     Histogram<hrtime_t> bgLoadHisto;
 
+    //! Histogram of the gets and stores served while warmup served traffic.
+    Histogram<hrtime_t> warmupOpHisto;
+
+    //! Histogram of the time from a background fetch being queued to its
+    //  completion, while warmup served traffic.
+    Histogram<hrtime_t> warmupBgFetchHisto;
+
     //! Max wall time of deleting a vbucket
     std::atomic<hrtime_t> vbucketDelMaxWalltime;
     //! Total wall time of deleting vbuckets
@@ -554,9 +596,14 @@ public:
         cursorsDropped.store(0);
         pagerRuns.store(0);
         itemsRemovedFromCheckpoints.store(0);
+        itemsExpelledFromCheckpoints.store(0);
+        memFreedByCheckpointItemExpel.store(0);
         numValueEjects.store(0);
         numFailedEjects.store(0);
         numNotMyVBuckets.store(0);
+        cacheHits.store(0);
+        cacheMisses.store(0);
+        lfuAdmissionRejects.store(0);
         bg_fetched.store(0);
         bgNumOperations.store(0);
         bgWait.store(0);
@@ -583,6 +630,8 @@ public:
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
         bgLoadHisto.reset();
+        warmupOpHisto.reset();
+        warmupBgFetchHisto.reset();
         setWithMetaHisto.reset();
         accessScannerHisto.reset();
         checkpointRemoverHisto.reset();
@@ -26,6 +26,8 @@
 
 #include <platform/cb_malloc.h>
 
+#include <cstring>
+
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
@@ -34,9 +36,9 @@ const int64_t StoredValue::state_collection_open = -6;
 StoredValue::StoredValue(const Item& itm,
                          UniquePtr n,
                          EPStats& stats,
-                         bool isOrdered)
-    : value(itm.getValue()),
-      chain_next_or_replacement(std::move(n)),
+                         bool isOrdered,
+                         uint8_t inlineCapacity)
+    : chain_next_or_replacement(std::move(n)),
       cas(itm.getCas()),
       revSeqno(itm.getRevSeqno()),
       bySeqno(itm.getBySeqno()),
@@ -49,10 +51,21 @@ StoredValue::StoredValue(const Item& itm,
       isOrdered(isOrdered),
       nru(itm.getNRUValue()),
       resident(!isTempItem()),
-      stale(false) {
+      hasInlineStorage(inlineCapacity != 0),
+      stale(false),
+      inlineValueLen(0) {
+    if (isOrdered && hasInlineStorage) {
+        throw std::invalid_argument(
+                "StoredValue::StoredValue: OrderedStoredValue cannot have "
+                "inline value storage");
+    }
+
     // Placement-new the key which lives in memory directly after this
     // object.
     new (key()) SerialisedDocKey(itm.getKey());
+    if (hasInlineStorage) {
+        inlineStorage()[0] = inlineCapacity;
+    }
 
     if (isTempInitialItem()) {
         markClean();
@@ -60,21 +73,24 @@ StoredValue::StoredValue(const Item& itm,
         markDirty();
     }
 
-    if (isTempItem()) {
-        resetValue();
+    if (!isTempItem()) {
+        assignValue(itm.getValue());
     }
 
     ObjectRegistry::onCreateStoredValue(this);
 }
 
 StoredValue::~StoredValue() {
+    if (isValueInline()) {
+        resetInlineValue();
+    }
     ObjectRegistry::onDeleteStoredValue(this);
 }
 
 StoredValue::StoredValue(const StoredValue& other,
                          UniquePtr n,
                          EPStats& stats)
-    : value(other.value),
+    : value(other.getValue()),
       chain_next_or_replacement(std::move(n)),
       cas(other.cas),
       revSeqno(other.revSeqno),
@@ -89,7 +105,9 @@ StoredValue::StoredValue(const StoredValue& other,
       isOrdered(other.isOrdered),
       nru(other.nru),
       resident(other.resident),
-      stale(false) {
+      hasInlineStorage(false),
+      stale(false),
+      inlineValueLen(0) {
     // Placement-new the key which lives in memory directly after this
     // object.
     StoredDocKey sKey(other.getKey());
@@ -145,7 +163,7 @@ void StoredValue::restoreValue(const Item& itm) {
     }
     datatype = itm.getDataType();
     deleted = itm.isDeleted();
-    value = itm.getValue();
+    assignValue(itm.getValue());
     resident = true;
 }
 
@@ -176,24 +194,45 @@ bool StoredValue::del() {
     }
 }
 
-size_t StoredValue::getRequiredStorage(const Item& item) {
+size_t StoredValue::getRequiredStorage(const Item& item,
+                                       size_t inlineCapacity) {
     return sizeof(StoredValue) +
-           SerialisedDocKey::getObjectSize(item.getKey().size());
+           SerialisedDocKey::getObjectSize(item.getKey().size()) +
+           (inlineCapacity ? inlineValueOverhead + inlineCapacity : 0);
 }
 
 std::unique_ptr<Item> StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    auto itm =
-            std::make_unique<Item>(getKey(),
-                                   getFlags(),
-                                   getExptime(),
-                                   value,
-                                   lck ? static_cast<uint64_t>(-1) : getCas(),
-                                   bySeqno,
-                                   vbucket,
-                                   getRevSeqno());
+    const uint64_t cas = lck ? static_cast<uint64_t>(-1) : getCas();
+    std::unique_ptr<Item> itm;
+    if (isValueInline()) {
+        // Copy straight from the inline storage into the Item's Blob.
+        auto* storage = const_cast<StoredValue&>(*this).inlineStorage();
+        const uint8_t extLen = storage[1];
+        auto* data = storage + inlineValueOverhead + FLEX_DATA_OFFSET;
+        itm = std::make_unique<Item>(getKey(),
+                                     getFlags(),
+                                     getExptime(),
+                                     data + extLen,
+                                     inlineValueLen - FLEX_DATA_OFFSET - extLen,
+                                     data,
+                                     extLen,
+                                     cas,
+                                     bySeqno,
+                                     vbucket,
+                                     getRevSeqno());
+    } else {
+        itm = std::make_unique<Item>(getKey(),
+                                     getFlags(),
+                                     getExptime(),
+                                     value,
+                                     cas,
+                                     bySeqno,
+                                     vbucket,
+                                     getRevSeqno());
+    }
 
     // This is a partial item...
-    if (value.get() == nullptr) {
+    if (valuelen() == 0) {
         itm->setDataType(datatype);
     }
 
@@ -228,12 +267,52 @@ std::unique_ptr<Item> StoredValue::toItemKeyOnly(uint16_t vbucket) const {
 }
 
 void StoredValue::reallocate() {
+    if (isValueInline()) {
+        // Lives in our own allocation; nothing to reallocate.
+        return;
+    }
     // Allocate a new Blob for this stored value; copy the existing Blob to
     // the new one and free the old.
     value_t new_val(Blob::Copy(*value));
     value.reset(new_val);
 }
 
+void StoredValue::assignValue(const value_t& newValue) {
+    if (isValueInline()) {
+        resetInlineValue();
+    }
+    if (newValue && newValue->length() <= getInlineCapacity()) {
+        // Copy the Blob's data (including extended meta) inline.
+        auto* storage = inlineStorage();
+        storage[1] = newValue->getExtLen();
+        std::memcpy(storage + inlineValueOverhead,
+                    newValue->getBlob(),
+                    newValue->length());
+        inlineValueLen = static_cast<uint8_t>(newValue->length());
+        value.reset();
+        ObjectRegistry::onSetInlineValue(inlineValueLen);
+    } else {
+        value = newValue;
+    }
+}
+
+value_t StoredValue::copyInlineValue() const {
+    const auto* storage = inlineStorage();
+    const uint8_t extLen = storage[1];
+    const char* data =
+            reinterpret_cast<const char*>(storage + inlineValueOverhead);
+    return value_t(Blob::New(data + FLEX_DATA_OFFSET + extLen,
+                             inlineValueLen - FLEX_DATA_OFFSET - extLen,
+                             reinterpret_cast<uint8_t*>(const_cast<char*>(
+                                     data + FLEX_DATA_OFFSET)),
+                             extLen));
+}
+
+void StoredValue::resetInlineValue() {
+    ObjectRegistry::onResetInlineValue(inlineValueLen);
+    inlineValueLen = 0;
+}
+
 void StoredValue::Deleter::operator()(StoredValue* val) {
     if (val->isOrdered) {
         delete static_cast<OrderedStoredValue*>(val);
@@ -269,7 +348,7 @@ bool StoredValue::operator==(const StoredValue& other) const {
 }
 
 bool StoredValue::deleteImpl() {
-    if (isDeleted() && !getValue()) {
+    if (isDeleted() && valuelen() == 0) {
         // SV is already marked as deleted and has no value - no further
         // deletion possible.
         return false;
@@ -307,7 +386,7 @@ void StoredValue::setValueImpl(const Item& itm) {
         resident = false;
     } else {
         resident = true;
-        value = itm.getValue();
+        assignValue(itm.getValue());
     }
 }
 
@@ -331,13 +410,30 @@ boost::optional<item_info> StoredValue::getItemInfo(uint64_t vbuuid) const {
             isDeleted() ? DocumentState::Deleted : DocumentState::Alive;
     info.nkey = getKey().size();
     info.key = getKey().data();
-    if (getValue()) {
-        info.value[0].iov_base = const_cast<char*>(getValue()->getData());
-        info.value[0].iov_len = getValue()->vlength();
+    if (hasValue()) {
+        // Point directly at the value (valid as long as the StoredValue is
+        // unchanged).
+        const auto body = getValueBody();
+        info.value[0].iov_base = const_cast<char*>(body.data());
+        info.value[0].iov_len = body.size();
     }
     return info;
 }
 
+cb::const_char_buffer StoredValue::getValueBody() const {
+    if (isValueInline()) {
+        const auto* storage = inlineStorage();
+        const uint8_t extLen = storage[1];
+        return {reinterpret_cast<const char*>(storage + inlineValueOverhead +
+                                              FLEX_DATA_OFFSET + extLen),
+                size_t(inlineValueLen - FLEX_DATA_OFFSET - extLen)};
+    }
+    if (value) {
+        return {value->getData(), value->vlength()};
+    }
+    return {};
+}
+
 std::ostream& operator<<(std::ostream& os, const StoredValue& sv) {
 
     // type, address
@@ -369,15 +465,19 @@ std::ostream& operator<<(std::ostream& os, const StoredValue& sv) {
     os << " exp:" << sv.getExptime();
 
     os << " vallen:" << sv.valuelen();
-    if (sv.getValue().get()) {
+    if (sv.isValueInline()) {
+        os << " inline";
+    }
+    if (sv.hasValue()) {
         os << " val:\"";
-        const char* data = sv.getValue()->getData();
+        const auto body = sv.getValueBody();
+        const char* data = body.data();
         // print up to first 40 bytes of value.
-        const size_t limit = std::min(size_t(40), sv.getValue()->vlength());
+        const size_t limit = std::min(size_t(40), body.size());
         for (size_t ii = 0; ii < limit; ii++) {
             os << data[ii];
         }
-        if (limit < sv.getValue()->vlength()) {
+        if (limit < body.size()) {
             os << " <cut>";
         }
         os << "\"";
@@ -25,6 +25,7 @@
 #include "utility.h"
 
 #include <boost/intrusive/list.hpp>
+#include <platform/sized_buffer.h>
 
 class Item;
 class OrderedStoredValue;
@@ -73,6 +74,31 @@ class OrderedStoredValue;
  *   length  {   | ...               |
  *               +-------------------+
  *
+ * Small values can optionally be stored inline, directly after the key, in
+ * the same allocation as the StoredValue (see InlineStoredValueFactory). Such
+ * StoredValues are allocated with a fixed capacity for the value, sized from
+ * the value they were created with (rounded up to fill the allocation's
+ * 16-byte quantum); while the current value fits it is
+ * copied into this space (the `value` pointer is then null), saving the
+ * separate Blob allocation and its header. Larger values are stored in a
+ * Blob as normal:
+ *
+ *               + - - - - - - - - - +
+ *  variable {   | key[]             |
+ *   length  {   + - - - - - - - - - +
+ *           {   | inline capacity   |
+ *           {   | inline extMetaLen |
+ *           {   | inline value[]    |
+ *               +-------------------+
+ *
+ * As an inline value lives only as long as its StoredValue, getValue()
+ * returns a copy (in a new Blob) of it; the value is never shared. Paths
+ * which only need the bytes use getValueBody() (or getItemInfo()) instead.
+ * toItem() still copies an inline value, into the Item's own Blob, as the
+ * Item may outlive the StoredValue. The whole inline capacity, used or not,
+ * is accounted in currentSize (by ObjectRegistry) for the StoredValue's
+ * lifetime: it is part of size() but not of metaDataSize().
+ *
  * OrderedStoredValue is a "subclass" of StoredValue, which is used by
  * Ephemeral buckets as it supports maintaining a seqno ordering of items in
  * memory (for Persistent buckets this ordering is maintained on-disk).
@@ -196,12 +222,55 @@ public:
     }
 
     /**
-     * Get this item's value.
+     * Get this item's value. If the value is stored inline this returns a
+     * copy of it.
+     */
+    value_t getValue() const {
+        if (isValueInline()) {
+            return copyInlineValue();
+        }
+        return value;
+    }
+
+    /**
+     * Get this item's value, which must not be stored inline, without
+     * copying it or adding a reference to it.
      */
-    const value_t &getValue() const {
+    const value_t& getNonInlineValue() const {
+        if (isValueInline()) {
+            throw std::logic_error(
+                    "StoredValue::getNonInlineValue: value is inline");
+        }
         return value;
     }
 
+    /**
+     * Get this item's value body (excluding extended meta) without copying
+     * it, from the inline storage or the Blob. Only valid until the value
+     * is next changed, i.e. while the hash bucket lock is held.
+     */
+    cb::const_char_buffer getValueBody() const;
+
+    /**
+     * True if this item has a value (stored inline or in a Blob).
+     */
+    bool hasValue() const {
+        return isValueInline() || value;
+    }
+
+    /**
+     * True if this item's value is currently stored inline, in the
+     * StoredValue's own allocation.
+     */
+    bool isValueInline() const {
+        return inlineValueLen != 0;
+    }
+
+    /// Return the number of bytes of inline value storage (zero if none).
+    size_t getInlineCapacity() const {
+        return hasInlineStorage ? inlineStorage()[0] : 0;
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -394,6 +463,9 @@ public:
      }
 
     size_t valuelen() const {
+        if (isValueInline()) {
+            return inlineValueLen;
+        }
         if (!value) {
             return 0;
         }
@@ -406,11 +478,16 @@ public:
      * @return the amount of memory used by this item.
      */
     size_t size() const {
-        return getObjectSize() + valuelen();
+        // An inline value is already part of the object's allocation.
+        return getObjectSize() + (isValueInline() ? 0 : valuelen());
     }
 
+    /**
+     * Get the size of this item's metadata: the object excluding the
+     * storage reserved for an inline value, which is value memory.
+     */
     size_t metaDataSize() const {
-        return getObjectSize();
+        return getObjectSize() - getInlineCapacity();
     }
 
     /**
@@ -447,6 +524,9 @@ public:
     /// Discard the value from this document.
     void resetValue() {
         value.reset();
+        if (isValueInline()) {
+            resetInlineValue();
+        }
     }
 
     /**
@@ -552,9 +632,16 @@ public:
     static const int64_t state_temp_init;
     static const int64_t state_collection_open;
 
+    /**
+     * Bytes of inline storage used in addition to the value itself (the
+     * capacity and extMetaLen fields).
+     */
+    static const size_t inlineValueOverhead = 2;
+
     /**
      * Return the size in byte of this object; both the fixed fields and the
-     * variable-length key. Doesn't include value size (allocated externally).
+     * variable-length key (and inline value storage, if any). Doesn't include
+     * the size of a value allocated externally.
      */
     inline size_t getObjectSize() const;
 
@@ -582,8 +669,15 @@ public:
      */
     bool operator==(const StoredValue& other) const;
 
-    /// Return how many bytes are need to store Item as a StoredValue
-    static size_t getRequiredStorage(const Item& item);
+    /**
+     * Return how many bytes are need to store Item as a StoredValue
+     *
+     * @param item the item to be stored
+     * @param inlineCapacity the number of bytes of value (Blob::length()) to
+     *        reserve for storing values inline; zero for none.
+     */
+    static size_t getRequiredStorage(const Item& item,
+                                     size_t inlineCapacity = 0);
 
 protected:
     /**
@@ -597,11 +691,15 @@ protected:
      *           which the new item is being inserted).
      * @param stats EPStats to update for this new StoredValue
      * @param isOrdered Are we constructing an OrderedStoredValue?
+     * @param inlineCapacity The number of bytes of inline value storage
+     *        allocated after the key (see getRequiredStorage()). Must be zero
+     *        for an OrderedStoredValue.
      */
     StoredValue(const Item& itm,
                 UniquePtr n,
                 EPStats& stats,
-                bool isOrdered);
+                bool isOrdered,
+                uint8_t inlineCapacity = 0);
 
     // Destructor. protected, as needs to be carefully deleted (via
     // StoredValue::Destructor) depending on the value of isOrdered flag.
@@ -642,7 +740,29 @@ protected:
      */
     void setValueImpl(const Item& itm);
 
+    /**
+     * Replace the value of this SV, storing it inline if it fits in the inline
+     * storage (if any).
+     */
+    void assignValue(const value_t& newValue);
+
+    /// Get the address of the inline value storage (following the key).
+    uint8_t* inlineStorage() {
+        return reinterpret_cast<uint8_t*>(key()) + getKey().getObjectSize();
+    }
+
+    const uint8_t* inlineStorage() const {
+        return const_cast<StoredValue&>(*this).inlineStorage();
+    }
+
+    /// Return a copy (in a new Blob) of the inline value.
+    value_t copyInlineValue() const;
+
+    /// Discard the inline value.
+    void resetInlineValue();
+
     friend class StoredValueFactory;
+    friend class InlineStoredValueFactory;
 
     value_t            value;          // 8 bytes
 
@@ -669,7 +789,8 @@ protected:
     const bool isOrdered : 1; //!< Is this an instance of OrderedStoredValue?
     uint8_t            nru       :  2; //!< True if referenced since last sweep
     bool               resident :  1;
-    bool unused : 1; // Unused bits in first byte of bitfields.
+    //! Was this object allocated with inline value storage?
+    bool hasInlineStorage : 1;
 
     // Indicates if a newer instance of the item is added. Logically part of
     // OSV, but is physically located in SV as there are spare bytes here.
@@ -684,6 +805,10 @@ protected:
     // Note (2): Only 1 bit of this is currently used; rest is "spare".
     std::atomic<bool> stale;
 
+    // Length (Blob::length()) of the value stored inline, or zero if the
+    // value is not stored inline.
+    uint8_t inlineValueLen;
+
     friend std::ostream& operator<<(std::ostream& os, const StoredValue& sv);
 };
 
@@ -830,5 +955,6 @@ size_t StoredValue::getObjectSize() const {
     if (isOrdered) {
         return sizeof(OrderedStoredValue) + getKey().getObjectSize();
     }
-    return sizeof(*this) + getKey().getObjectSize();
+    return sizeof(*this) + getKey().getObjectSize() +
+           (hasInlineStorage ? inlineValueOverhead + getInlineCapacity() : 0);
 }
@@ -21,8 +21,11 @@
  * Factories for creating StoredValue and subclasses of StoredValue.
  */
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 
+#include "item.h"
 #include "stored-value.h"
 
 /**
@@ -90,6 +93,69 @@ private:
     EPStats* stats;
 };
 
+/**
+ * Creator of StoredValue instances which store small values inline.
+ *
+ * Items whose value (Blob::length()) is no larger than the configured
+ * threshold are allocated with inline storage after the key, and the value
+ * is copied there instead of sharing the Item's Blob. The storage is sized
+ * to the value, rounded up (to at most the threshold) so the allocation
+ * fills its 16-byte allocator quantum: those bytes would be allocated
+ * anyway, and let a slightly larger later value stay inline. Later values
+ * which fit the same space are also stored inline; larger ones fall back
+ * to a Blob, leaving the storage unused (see ep_storedval_inline_capacity).
+ */
+class InlineStoredValueFactory : public AbstractStoredValueFactory {
+public:
+    using value_type = StoredValue;
+
+    /**
+     * @param s EPStats to update for created StoredValues
+     * @param maxInlineSize largest value to store inline; at most 255.
+     */
+    InlineStoredValueFactory(EPStats& s, size_t maxInlineSize)
+        : stats(&s), maxInlineSize(maxInlineSize) {
+        if (maxInlineSize > std::numeric_limits<uint8_t>::max()) {
+            throw std::invalid_argument(
+                    "InlineStoredValueFactory: maxInlineSize (which is " +
+                    std::to_string(maxInlineSize) + ") must be <= 255");
+        }
+    }
+
+    /**
+     * Create a concrete StoredValue object, with inline storage for the
+     * item's value if small enough.
+     */
+    StoredValue::UniquePtr operator()(const Item& itm,
+                                      StoredValue::UniquePtr next) override {
+        const auto& value = itm.getValue();
+        size_t capacity = 0;
+        if (value && value->length() <= maxInlineSize) {
+            const size_t storage =
+                    StoredValue::getRequiredStorage(itm, value->length());
+            capacity = std::min(maxInlineSize,
+                                value->length() + (16 - storage % 16) % 16);
+        }
+        return StoredValue::UniquePtr(
+                new (::operator new(
+                        StoredValue::getRequiredStorage(itm, capacity)))
+                        StoredValue(itm,
+                                    std::move(next),
+                                    *stats,
+                                    /*isOrdered*/ false,
+                                    static_cast<uint8_t>(capacity)));
+    }
+
+    StoredValue::UniquePtr copyStoredValue(const StoredValue& other,
+                                           StoredValue::UniquePtr next) override {
+        throw std::logic_error("Copy of StoredValue is not supported");
+    }
+
+private:
+    EPStats* stats;
+    const size_t maxInlineSize;
+};
+
 /**
  * Creator of OrderedStoredValue instances.
  */
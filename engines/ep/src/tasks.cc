@@ -36,6 +36,17 @@ bool FlusherTask::run() {
     return flusher->step(this);
 }
 
+bool FlushCommitTask::run() {
+    TRACE_EVENT0("ep-engine/task", "FlushCommitTask");
+    return flusher->commitStep(this);
+}
+
+bool DeferredSyncTask::run() {
+    TRACE_EVENT0("ep-engine/task", "DeferredSyncTask");
+    work();
+    return false;
+}
+
 bool CompactTask::run() {
     TRACE_EVENT("ep-engine/task", "CompactTask", compactCtx.db_file_id);
     return engine->getKVBucket()->doCompact(&compactCtx, cookie);
@@ -42,6 +42,9 @@ TASK(WarmupLoadingData, READER_TASK_IDX, 0)
 TASK(WarmupCompletion, READER_TASK_IDX, 0)
 TASK(SingleBGFetcherTask, READER_TASK_IDX, 1)
 TASK(VKeyStatBGFetchTask, READER_TASK_IDX, 3)
+TASK(WarmupBackgroundLoadAccessLog, READER_TASK_IDX, 4)
+TASK(WarmupBackgroundLoadingKVPairs, READER_TASK_IDX, 4)
+TASK(WarmupBackgroundLoadingData, READER_TASK_IDX, 4)
 
 // Aux IO tasks
 TASK(BackfillDiskLoad, AUXIO_TASK_IDX, 1)
@@ -56,6 +59,8 @@ TASK(BackfillManagerTask, AUXIO_TASK_IDX, 8)
 TASK(RollbackTask, WRITER_TASK_IDX, 1)
 TASK(CompactVBucketTask, WRITER_TASK_IDX, 2)
 TASK(FlusherTask, WRITER_TASK_IDX, 5)
+TASK(FlushCommitTask, WRITER_TASK_IDX, 5)
+TASK(DeferredSyncTask, WRITER_TASK_IDX, 5)
 TASK(StatSnap, WRITER_TASK_IDX, 9)
 
 // Non-IO tasks
@@ -25,6 +25,7 @@
 #include <platform/processclock.h>
 
 #include <array>
+#include <functional>
 #include <string>
 
 class EventuallyPersistentEngine;
@@ -55,6 +56,59 @@ private:
     std::string desc;
 };
 
+/**
+ * Commits the flush batches a pipelining Flusher has prepared (see
+ * flusher_pipeline_depth).
+ */
+class FlushCommitTask : public GlobalTask {
+public:
+    FlushCommitTask(EventuallyPersistentEngine* e,
+                    Flusher* f,
+                    uint16_t shardid,
+                    bool completeBeforeShutdown = true)
+        : GlobalTask(e, TaskId::FlushCommitTask, 0, completeBeforeShutdown),
+          flusher(f) {
+        std::stringstream ss;
+        ss << "Committing flush batches: shard " << shardid;
+        desc = ss.str();
+    }
+
+    bool run();
+
+    cb::const_char_buffer getDescription() {
+        return desc;
+    }
+
+private:
+    Flusher* flusher;
+    std::string desc;
+};
+
+/**
+ * Helps a CouchKVStore's group commit sync its files (see DeferredSyncOps),
+ * alongside the flusher which started it.
+ */
+class DeferredSyncTask : public GlobalTask {
+public:
+    DeferredSyncTask(EventuallyPersistentEngine* e,
+                     uint16_t shardid,
+                     std::function<void()> work)
+        : GlobalTask(e, TaskId::DeferredSyncTask, 0, false),
+          work(std::move(work)) {
+        desc = "Syncing deferred files: shard " + std::to_string(shardid);
+    }
+
+    bool run();
+
+    cb::const_char_buffer getDescription() {
+        return desc;
+    }
+
+private:
+    std::function<void()> work;
+    std::string desc;
+};
+
 /**
  * A task for compacting a vbucket db file
  */
@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <cstring>
 #include <functional>
 #include <list>
 #include <set>
@@ -32,6 +33,7 @@
 #include "failover-table.h"
 #include "flusher.h"
 #include "pre_link_document_context.h"
+#include "vbucket_image.h"
 #include "vbucketdeletiontask.h"
 
 #define STATWRITER_NAMESPACE vbucket
@@ -153,8 +155,18 @@ VBucket::VBucket(id_type i,
                  uint64_t maxCas,
                  int64_t hlcEpochSeqno,
                  bool mightContainXattrs,
-                 const std::string& collectionsManifest)
-    : ht(st, std::move(valFact), config.getHtSize(), config.getHtLocks()),
+                 const std::string& collectionsManifest,
+                 std::shared_ptr<HashTable::LockSet> htLocks)
+    : ht(st,
+         std::move(valFact),
+         config.getHtSize(),
+         config.getHtLocks(),
+         config.getHtResizeStep(),
+         config.isHtFingerprints(),
+         config.isHtMutexFreeReads(),
+         std::move(htLocks),
+         config.getItemEvictionStrategy() == "lfu",
+         config.isExpPagerUseIndex()),
       checkpointManager(st,
                         i,
                         chkConfig,
@@ -162,6 +174,7 @@ VBucket::VBucket(id_type i,
                         lastSnapStart,
                         lastSnapEnd,
                         flusherCb),
+      flushBatchPending(false),
       failovers(std::move(table)),
       opsCreate(0),
       opsUpdate(0),
@@ -186,6 +199,8 @@ VBucket::VBucket(id_type i,
       takeover_backed_up(false),
       persisted_snapshot_start(lastSnapStart),
       persisted_snapshot_end(lastSnapEnd),
+      bfTrueNegatives(0),
+      bfFalsePositives(0),
       rollbackItemCount(0),
       hlc(maxCas,
           hlcEpochSeqno,
@@ -198,7 +213,9 @@ VBucket::VBucket(id_type i,
       deferredDeletionCookie(nullptr),
       newSeqnoCb(std::move(newSeqnoCb)),
       manifest(collectionsManifest),
-      mayContainXattrs(mightContainXattrs) {
+      mayContainXattrs(mightContainXattrs),
+      retainDeletes(false),
+      unpersistedCas(false) {
     if (config.getConflictResolutionType().compare("lww") == 0) {
         conflictResolver.reset(new LastWriteWinsResolution());
     } else {
@@ -364,6 +381,8 @@ void VBucket::resetStats() {
     opsUpdate.store(0);
     opsDelete.store(0);
     opsReject.store(0);
+    bfTrueNegatives.store(0);
+    bfFalsePositives.store(0);
 
     stats.diskQueueSize.fetch_sub(dirtyQueueSize.exchange(0));
     dirtyQueueMem.store(0);
@@ -396,15 +415,28 @@ void VBucket::addStat(const char *nm, const T &val, ADD_STAT add_stat,
 }
 
 void VBucket::handlePreExpiry(StoredValue& v) {
-    value_t value = v.getValue();
-    if (value) {
+    if (v.hasValue()) {
         std::unique_ptr<Item> itm(v.toItem(false, id));
+        if (!v.isValueInline()) {
+            // The Item shares the StoredValue's Blob; pre_expiry modifies
+            // the value in place so give it a private copy. (toItem()
+            // already copied an inline value.)
+            value_t new_val(Blob::Copy(*v.getNonInlineValue()));
+            itm->setValue(new_val);
+        }
+        // pre_expiry works on the raw value (whose xattrs it prunes).
+        if (!itm->decompressValue()) {
+            LOG(EXTENSION_LOG_WARNING,
+                "VBucket::handlePreExpiry: (vb %" PRIu16
+                ") Failed to inflate value, seqno:%" PRId64,
+                id,
+                v.getBySeqno());
+            return;
+        }
         item_info itm_info;
         EventuallyPersistentEngine* engine = ObjectRegistry::getCurrentEngine();
         itm_info =
                 itm->toItemInfo(failovers->getLatestUUID(), getHLCEpochSeqno());
-        value_t new_val(Blob::Copy(*value));
-        itm->setValue(new_val);
 
         SERVER_HANDLE_V1* sapi = engine->getServerApi();
         /* TODO: In order to minimize allocations, the callback needs to
@@ -479,7 +511,9 @@ bool VBucket::isResidentRatioUnderThreshold(float threshold) {
     }
 }
 
-void VBucket::createFilter(size_t key_count, double probability) {
+void VBucket::createFilter(size_t key_count,
+                           double probability,
+                           bool blocked) {
     // Create the actual bloom filter upon vbucket creation during
     // scenarios:
     //      - Bucket creation
@@ -487,20 +521,22 @@ void VBucket::createFilter(size_t key_count, double probability) {
     LockHolder lh(bfMutex);
     if (bFilter == nullptr && tempFilter == nullptr) {
         bFilter = std::make_unique<BloomFilter>(key_count, probability,
-                                        BFILTER_ENABLED);
+                                        BFILTER_ENABLED, blocked);
     } else {
         LOG(EXTENSION_LOG_WARNING, "(vb %" PRIu16 ") Bloom filter / Temp filter"
             " already exist!", id);
     }
 }
 
-void VBucket::initTempFilter(size_t key_count, double probability) {
+void VBucket::initTempFilter(size_t key_count,
+                             double probability,
+                             bool blocked) {
     // Create a temp bloom filter with status as COMPACTING,
     // if the main filter is found to exist, set its state to
     // COMPACTING as well.
     LockHolder lh(bfMutex);
     tempFilter = std::make_unique<BloomFilter>(key_count, probability,
-                                     BFILTER_COMPACTING);
+                                     BFILTER_COMPACTING, blocked);
     if (bFilter) {
         bFilter->setStatus(BFILTER_COMPACTING);
     }
@@ -525,7 +561,11 @@ void VBucket::addToFilter(const DocKey& key) {
 bool VBucket::maybeKeyExistsInFilter(const DocKey& key) {
     LockHolder lh(bfMutex);
     if (bFilter) {
-        return bFilter->maybeKeyExists(key);
+        if (bFilter->maybeKeyExists(key)) {
+            return true;
+        }
+        ++bfTrueNegatives;
+        return false;
     } else {
         // If filter doesn't exist, allow the BgFetch to go through.
         return true;
@@ -622,6 +662,118 @@ size_t VBucket::getNumOfKeysInFilter() {
     }
 }
 
+void VBucket::recordFilterFalsePositive() {
+    LockHolder lh(bfMutex);
+    if (bFilter && (bFilter->getStatus() == BFILTER_COMPACTING ||
+                    bFilter->getStatus() == BFILTER_ENABLED)) {
+        ++bfFalsePositives;
+    }
+}
+
+namespace {
+/**
+ * Magic of the image written by VBucket::persistFilter(), whose body is the
+ * serialized filter.
+ */
+const uint64_t filterImageMagic = 0x6266696c74657233; // "bfilter3"
+
+/// Image flag: every key on disk is in the filter (not just the deleted and
+/// non-resident ones).
+const uint64_t filterImageAllKeys = 1;
+
+/// Adds the keys in a hash table to its vbucket's bloom filter.
+class FilterKeysVisitor : public HashTableVisitor {
+public:
+    FilterKeysVisitor(VBucket& vb) : vb(vb) {
+    }
+
+    bool visit(const HashTable::HashBucketLock& lh, StoredValue& v) override {
+        if (!v.isTempItem() || v.isTempDeletedItem()) {
+            vb.addToFilter(v.getKey());
+        }
+        return true;
+    }
+
+private:
+    VBucket& vb;
+};
+} // anonymous namespace
+
+bool VBucket::persistFilter(const std::string& path) {
+    {
+        LockHolder lh(bfMutex);
+        if (!bFilter || (bFilter->getStatus() != BFILTER_COMPACTING &&
+                         bFilter->getStatus() != BFILTER_ENABLED)) {
+            return false;
+        }
+    }
+
+    // Under full eviction the keys which are resident now won't be after
+    // warmup, so must be in the filter too.
+    const bool allKeys = eviction == FULL_EVICTION;
+    if (allKeys) {
+        FilterKeysVisitor visitor(*this);
+        ht.visit(visitor);
+    }
+
+    std::string data;
+    {
+        LockHolder lh(bfMutex);
+        if (!bFilter) {
+            return false;
+        }
+        data = bFilter->serialize();
+    }
+    VBucketImageWriter writer(path,
+                              {filterImageMagic,
+                               getId(),
+                               getPersistenceSeqno(),
+                               failovers->getLatestUUID(),
+                               allKeys ? filterImageAllKeys : 0});
+    if (!writer.write(data.data(), data.size()) || !writer.commit()) {
+        LOG(EXTENSION_LOG_WARNING,
+            "VBucket::persistFilter: (vb %" PRIu16 ") Failed to write '%s': %s",
+            id,
+            path.c_str(),
+            strerror(writer.getError()));
+        return false;
+    }
+    return true;
+}
+
+bool VBucket::restoreFilter(const std::string& path) {
+    VBucketImageReader reader(path,
+                              {filterImageMagic,
+                               getId(),
+                               getPersistenceSeqno(),
+                               failovers->getLatestUUID(),
+                               0});
+    if (reader.getStatus() == VBucketImageReader::Status::Missing) {
+        return false;
+    }
+    if (reader.getStatus() != VBucketImageReader::Status::Valid ||
+        (eviction == FULL_EVICTION &&
+         !(reader.getFlags() & filterImageAllKeys))) {
+        LOG(EXTENSION_LOG_NOTICE,
+            "VBucket::restoreFilter: (vb %" PRIu16
+            ") Ignoring '%s', which doesn't match the vbucket",
+            id,
+            path.c_str());
+        return false;
+    }
+
+    const auto body = reader.getBody();
+    auto filter =
+            BloomFilter::deserialize(std::string(body.data(), body.size()));
+    if (!filter) {
+        return false;
+    }
+    LockHolder lh(bfMutex);
+    bFilter = std::move(filter);
+    tempFilter.reset();
+    return true;
+}
+
 VBNotifyCtx VBucket::queueDirty(
         StoredValue& v,
         const GenerateBySeqno generateBySeqno,
@@ -839,7 +991,7 @@ ENGINE_ERROR_CODE VBucket::set(Item& itm,
         // full eviction.
         if (v) {
             // temp item is already created. Simply schedule a bg fetch job
-            hbl.getHTLock().unlock();
+            hbl.unlock();
             bgFetch(itm.getKey(), cookie, engine, bgFetchDelay, true);
             return ENGINE_EWOULDBLOCK;
         }
@@ -921,7 +1073,7 @@ ENGINE_ERROR_CODE VBucket::replace(Item& itm,
             break;
         case MutationStatus::NeedBgFetch: {
             // temp item is already created. Simply schedule a bg fetch job
-            hbl.getHTLock().unlock();
+            hbl.unlock();
             bgFetch(itm.getKey(), cookie, engine, bgFetchDelay, true);
             ret = ENGINE_EWOULDBLOCK;
             break;
@@ -993,7 +1145,7 @@ ENGINE_ERROR_CODE VBucket::addBackfillItem(Item& itm,
         setMaxCas(v->getCas());
         // we unlock ht lock here because we want to avoid potential lock
         // inversions arising from notifyNewSeqno() call
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         notifyNewSeqno(*notifyCtx);
     } break;
     case MutationStatus::NeedBgFetch:
@@ -1102,7 +1254,7 @@ ENGINE_ERROR_CODE VBucket::setWithMeta(Item& itm,
         }
         // we unlock ht lock here because we want to avoid potential lock
         // inversions arising from notifyNewSeqno() call
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         notifyNewSeqno(*notifyCtx);
     } break;
     case MutationStatus::NotFound:
@@ -1111,7 +1263,7 @@ ENGINE_ERROR_CODE VBucket::setWithMeta(Item& itm,
     case MutationStatus::NeedBgFetch: { // CAS operation with non-resident item
         // + full eviction.
         if (v) { // temp item is already created. Simply schedule a
-            hbl.getHTLock().unlock(); // bg fetch job.
+            hbl.unlock(); // bg fetch job.
             bgFetch(itm.getKey(), cookie, engine, bgFetchDelay, true);
             return ENGINE_EWOULDBLOCK;
         }
@@ -1153,7 +1305,7 @@ ENGINE_ERROR_CODE VBucket::deleteItem(const DocKey& key,
                     return ENGINE_KEY_ENOENT;
                 }
             } else if (v->isTempInitialItem()) {
-                hbl.getHTLock().unlock();
+                hbl.unlock();
                 bgFetch(key, cookie, engine, bgFetchDelay, true);
                 return ENGINE_EWOULDBLOCK;
             } else { // Non-existent or deleted key.
@@ -1392,12 +1544,12 @@ ENGINE_ERROR_CODE VBucket::deleteWithMeta(const DocKey& key,
         }
         // we unlock ht lock here because we want to avoid potential lock
         // inversions arising from notifyNewSeqno() call
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         notifyNewSeqno(*notifyCtx);
         break;
     }
     case MutationStatus::NeedBgFetch:
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         bgFetch(key, cookie, engine, bgFetchDelay, metaBgFetch);
         return ENGINE_EWOULDBLOCK;
     }
@@ -1436,7 +1588,7 @@ void VBucket::deleteExpiredItem(const Item& it,
                     processExpiredItem(hbl, *v);
             // we unlock ht lock here because we want to avoid potential lock
             // inversions arising from notifyNewSeqno() call
-            hbl.getHTLock().unlock();
+            hbl.unlock();
             notifyNewSeqno(notifyCtx);
         }
     } else {
@@ -1461,7 +1613,7 @@ void VBucket::deleteExpiredItem(const Item& it,
                         processExpiredItem(hbl, *v);
                 // we unlock ht lock here because we want to avoid potential
                 // lock inversions arising from notifyNewSeqno() call
-                hbl.getHTLock().unlock();
+                hbl.unlock();
                 notifyNewSeqno(notifyCtx);
             }
         }
@@ -1508,7 +1660,7 @@ ENGINE_ERROR_CODE VBucket::add(Item& itm,
         return addTempItemAndBGFetch(
                 hbl, itm.getKey(), cookie, engine, bgFetchDelay, true);
     case AddStatus::BgFetch:
-        hbl.getHTLock().unlock();
+        hbl.unlock();
         bgFetch(itm.getKey(), cookie, engine, bgFetchDelay, true);
         return ENGINE_EWOULDBLOCK;
     case AddStatus::Success:
@@ -1545,7 +1697,7 @@ std::pair<MutationStatus, GetValue> VBucket::processGetAndUpdateTtl(
         auto bySeqNo = v->getBySeqno();
         if (exptime_mutated) {
             v->markDirty();
-            v->setExptime(exptime);
+            ht.unlocked_setExptime(hbl.getHTLock(), *v, exptime);
             v->setRevSeqno(v->getRevSeqno() + 1);
         }
 
@@ -1565,7 +1717,7 @@ std::pair<MutationStatus, GetValue> VBucket::processGetAndUpdateTtl(
             rv.item->setCas(v->getCas());
             // we unlock ht lock here because we want to avoid potential lock
             // inversions arising from notifyNewSeqno() call
-            hbl.getHTLock().unlock();
+            hbl.unlock();
             notifyNewSeqno(notifyCtx);
         }
 
@@ -1627,6 +1779,34 @@ GetValue VBucket::getInternal(const DocKey& key,
     const bool metadataOnly = (options & ALLOW_META_ONLY);
     const bool getDeletedValue = (options & GET_DELETED_VALUE);
     const bool bgFetchRequired = (options & QUEUE_BG_FETCH);
+
+    {
+        // Fast path: a live, resident item which needs no NRU update can be
+        // returned without taking the hash bucket lock (access frequencies
+        // can be recorded under the guard). Anything else (deleted, temp,
+        // expired, non-resident, missing) falls through to the locked path
+        // below. The guard must be released before we acquire the bucket
+        // lock.
+        auto guard = ht.tryMutexFreeRead(key);
+        if (guard) {
+            const StoredValue* v =
+                    ht.mutex_free_find(guard, key, WantsDeleted::No);
+            if (v && !v->isTempItem() && v->isResident() &&
+                !v->isExpired(ep_real_time()) &&
+                (trackReference == TrackReference::No ||
+                 ht.isTrackingFrequency() ||
+                 v->getNRUValue() == MIN_NRU_VALUE)) {
+                if (trackReference == TrackReference::Yes) {
+                    ht.recordAccess(key);
+                }
+                if (options & TRACK_STATISTICS) {
+                    ++stats.cacheHits;
+                }
+                return getInternalResident(*v, options, getKeyOnly);
+            }
+        }
+    }
+
     auto hbl = ht.getLockedBucket(key);
     StoredValue* v = fetchValidValue(
             hbl, key, WantsDeleted::Yes, trackReference, QueueExpired::Yes);
@@ -1649,24 +1829,17 @@ GetValue VBucket::getInternal(const DocKey& key,
             auto queueBgFetch = (bgFetchRequired) ?
                     QueueBgFetch::Yes :
                     QueueBgFetch::No;
+            if (bgFetchRequired && (options & TRACK_STATISTICS)) {
+                ++stats.cacheMisses;
+            }
             return getInternalNonResident(
                     key, cookie, engine, bgFetchDelay, queueBgFetch, *v);
         }
 
-        // Should we hide (return -1) for the items' CAS?
-        const bool hideCas =
-                (options & HIDE_LOCKED_CAS) && v->isLocked(ep_current_time());
-        std::unique_ptr<Item> item;
-        if (getKeyOnly == GetKeyOnly::Yes) {
-            item = v->toItemKeyOnly(getId());
-        } else {
-            item = v->toItem(hideCas, getId());
+        if (options & TRACK_STATISTICS) {
+            ++stats.cacheHits;
         }
-        return GetValue(std::move(item),
-                        ENGINE_SUCCESS,
-                        v->getBySeqno(),
-                        !v->isResident(),
-                        v->getNRUValue());
+        return getInternalResident(*v, options, getKeyOnly);
     } else {
         if (!getDeletedValue && (eviction == VALUE_ONLY || diskFlushAll)) {
             return GetValue();
@@ -1677,6 +1850,9 @@ GetValue VBucket::getInternal(const DocKey& key,
             if (bgFetchRequired) { // Full eviction and need a bg fetch.
                 ec = addTempItemAndBGFetch(
                         hbl, key, cookie, engine, bgFetchDelay, metadataOnly);
+                if (!metadataOnly && (options & TRACK_STATISTICS)) {
+                    ++stats.cacheMisses;
+                }
             }
             return GetValue(NULL, ec, -1, true);
         } else {
@@ -1687,6 +1863,25 @@ GetValue VBucket::getInternal(const DocKey& key,
     }
 }
 
+GetValue VBucket::getInternalResident(const StoredValue& v,
+                                      get_options_t options,
+                                      GetKeyOnly getKeyOnly) {
+    // Should we hide (return -1) for the items' CAS?
+    const bool hideCas =
+            (options & HIDE_LOCKED_CAS) && v.isLocked(ep_current_time());
+    std::unique_ptr<Item> item;
+    if (getKeyOnly == GetKeyOnly::Yes) {
+        item = v.toItemKeyOnly(getId());
+    } else {
+        item = v.toItem(hideCas, getId());
+    }
+    return GetValue(std::move(item),
+                    ENGINE_SUCCESS,
+                    v.getBySeqno(),
+                    !v.isResident(),
+                    v.getNRUValue());
+}
+
 ENGINE_ERROR_CODE VBucket::getMetaData(const DocKey& key,
                                        const void* cookie,
                                        EventuallyPersistentEngine& engine,
@@ -1765,7 +1960,7 @@ ENGINE_ERROR_CODE VBucket::getKeyStats(const DocKey& key,
             return ENGINE_KEY_ENOENT;
         }
         if (eviction == FULL_EVICTION && v->isTempInitialItem()) {
-            hbl.getHTLock().unlock();
+            hbl.unlock();
             bgFetch(key, cookie, engine, bgFetchDelay, true);
             return ENGINE_EWOULDBLOCK;
         }
@@ -1831,6 +2026,7 @@ GetValue VBucket::getLocked(const DocKey& key,
         auto it = v->toItem(false, getId());
         it->setCas(nextHLCCas());
         v->setCas(it->getCas());
+        unpersistedCas.store(true);
 
         return GetValue(std::move(it));
 
@@ -1866,13 +2062,19 @@ void VBucket::deletedOnDiskCbk(const Item& queuedItem, bool deleted) {
     //  1. Item is existent in hashtable, and deleted flag is true
     //  2. rev seqno of queued item matches rev seqno of hash table item
     if (v && v->isDeleted() && (queuedItem.getRevSeqno() == v->getRevSeqno())) {
-        bool isDeleted = deleteStoredValue(hbl, *v);
-        if (!isDeleted) {
-            throw std::logic_error(
-                    "deletedOnDiskCbk:callback: "
-                    "Failed to delete key with seqno:" +
-                    std::to_string(v->getBySeqno()) + "' from bucket " +
-                    std::to_string(hbl.getBucketNum()));
+        if (retainDeletes.load()) {
+            // Warmup may yet load the item's older version from disk; the
+            // delete must stay to be found (and not be loaded over).
+            v->markClean();
+        } else {
+            bool isDeleted = deleteStoredValue(hbl, *v);
+            if (!isDeleted) {
+                throw std::logic_error(
+                        "deletedOnDiskCbk:callback: "
+                        "Failed to delete key with seqno:" +
+                        std::to_string(v->getBySeqno()) + "' from bucket " +
+                        std::to_string(hbl.getBucketNum()));
+            }
         }
 
         /**
@@ -1891,6 +2093,36 @@ void VBucket::deletedOnDiskCbk(const Item& queuedItem, bool deleted) {
     decrMetaDataDisk(queuedItem);
 }
 
+void VBucket::releasePersistedDeletes() {
+    if (!retainDeletes.exchange(false)) {
+        return;
+    }
+
+    // Collect the keys first, as the visitor holds the hash bucket locks.
+    class PersistedDeleteVisitor : public HashTableVisitor {
+    public:
+        bool visit(const HashTable::HashBucketLock& lh,
+                   StoredValue& v) override {
+            if (v.isDeleted() && !v.isTempItem() && !v.isDirty()) {
+                keys.emplace_back(v.getKey());
+            }
+            return true;
+        }
+
+        std::vector<StoredDocKey> keys;
+    } visitor;
+    ht.visit(visitor);
+
+    for (const auto& key : visitor.keys) {
+        auto hbl = ht.getLockedBucket(key);
+        StoredValue* v = ht.unlocked_find(
+                key, hbl.getBucketNum(), WantsDeleted::Yes, TrackReference::No);
+        if (v && v->isDeleted() && !v->isTempItem() && !v->isDirty()) {
+            deleteStoredValue(hbl, *v);
+        }
+    }
+}
+
 bool VBucket::deleteKey(const DocKey& key) {
     auto hbl = ht.getLockedBucket(key);
     StoredValue* v = ht.unlocked_find(
@@ -1969,6 +2201,16 @@ void VBucket::_addStats(bool details, ADD_STAT add_stat, const void* c) {
                 add_stat, c);
         addStat("bloom_filter_size", getFilterSize(), add_stat, c);
         addStat("bloom_filter_key_count", getNumOfKeysInFilter(), add_stat, c);
+        const size_t trueNegatives = bfTrueNegatives;
+        const size_t falsePositives = bfFalsePositives;
+        addStat("bloom_filter_true_negatives", trueNegatives, add_stat, c);
+        addStat("bloom_filter_false_positives", falsePositives, add_stat, c);
+        addStat("bloom_filter_fp_rate",
+                falsePositives ? double(falsePositives) /
+                                         (falsePositives + trueNegatives)
+                               : 0.0,
+                add_stat,
+                c);
         addStat("rollback_item_count", getRollbackItemCount(), add_stat, c);
         addStat("hp_vb_req_size", getHighPriorityChkSize(), add_stat, c);
         addStat("might_contain_xattrs", mightContainXattrs(), add_stat, c);
@@ -2240,7 +2482,7 @@ VBucket::processSoftDelete(const HashTable::HashBucketLock& hbl,
     if (use_meta) {
         v.setCas(metadata.cas);
         v.setFlags(metadata.flags);
-        v.setExptime(metadata.exptime);
+        ht.unlocked_setExptime(hbl.getHTLock(), v, metadata.exptime);
     }
 
     v.setRevSeqno(metadata.revSeqno);
@@ -2282,9 +2524,8 @@ VBucket::processExpiredItem(const HashTable::HashBucketLock& hbl,
      * but functionally correct and for performance reasons
      * only the system xattrs need to be stored.
      */
-    value_t value = v.getValue();
     bool onlyMarkDeleted =
-            value && mcbp::datatype::is_xattr(value->getDataType());
+            v.hasValue() && mcbp::datatype::is_xattr(v.getDatatype());
     v.setRevSeqno(v.getRevSeqno() + 1);
     VBNotifyCtx notifyCtx;
     StoredValue* newSv;
@@ -2518,10 +2759,9 @@ std::unique_ptr<Item> VBucket::pruneXattrDocument(
     // Need to take a copy of the value, prune it, and add it back
 
     // Create work-space document
-    std::vector<uint8_t> workspace(v.getValue()->vlength());
-    std::copy_n(v.getValue()->getData(),
-                v.getValue()->vlength(),
-                workspace.begin());
+    const auto value = v.getValue();
+    std::vector<uint8_t> workspace(value->vlength());
+    std::copy_n(value->getData(), value->vlength(), workspace.begin());
 
     // Now attach to the XATTRs in the document
     auto sz = cb::xattr::get_body_offset(
@@ -2538,8 +2778,8 @@ std::unique_ptr<Item> VBucket::pruneXattrDocument(
                 Blob::New(reinterpret_cast<const char*>(prunedXattrs.data()),
                           prunedXattrs.size(),
                           const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(
-                                  v.getValue()->getExtMeta())),
-                          v.getValue()->getExtLen());
+                                  value->getExtMeta())),
+                          value->getExtLen());
         auto rv = v.toItem(false, getId());
         rv->setCas(itemMeta.cas);
         rv->setFlags(itemMeta.flags);
@@ -143,7 +143,8 @@ public:
             uint64_t maxCas = 0,
             int64_t hlcEpochSeqno = HlcCasSeqnoUninitialised,
             bool mightContainXattrs = false,
-            const std::string& collectionsManifest = "");
+            const std::string& collectionsManifest = "",
+            std::shared_ptr<HashTable::LockSet> htLocks = {});
 
     virtual ~VBucket();
 
@@ -520,8 +521,12 @@ public:
     /**
      * BloomFilter operations for vbucket
      */
-    void createFilter(size_t key_count, double probability);
-    void initTempFilter(size_t key_count, double probability);
+    void createFilter(size_t key_count,
+                      double probability,
+                      bool blocked = false);
+    void initTempFilter(size_t key_count,
+                        double probability,
+                        bool blocked = false);
     void addToFilter(const DocKey& key);
     virtual bool maybeKeyExistsInFilter(const DocKey& key);
     bool isTempFilterAvailable();
@@ -533,6 +538,29 @@ public:
     size_t getFilterSize();
     size_t getNumOfKeysInFilter();
 
+    /**
+     * Write the bloom filter to path, for restoreFilter() to read on the
+     * next warmup. Must only be called once every item has been persisted.
+     *
+     * @return true if the filter was written; false if there's no usable
+     *         filter or the write failed
+     */
+    bool persistFilter(const std::string& path);
+
+    /**
+     * Read the bloom filter written by persistFilter(), if it matches the
+     * vbucket's state (as loaded from disk) and eviction policy.
+     *
+     * @return true if the filter was restored
+     */
+    bool restoreFilter(const std::string& path);
+
+    /**
+     * Note that a fetch of a key the bloom filter said may exist found it
+     * doesn't; counted towards the filter's false positive rate.
+     */
+    void recordFilterFalsePositive();
+
     uint64_t nextHLCCas() {
         return hlc.nextHLC();
     }
@@ -1140,6 +1168,35 @@ public:
         return {mightContainXattrs()};
     }
 
+    /**
+     * @return true if getLocked() has given an item a CAS which wasn't
+     *         persisted, so the hash table no longer matches the disk.
+     */
+    bool hasUnpersistedCas() const {
+        return unpersistedCas.load();
+    }
+
+    /**
+     * Keep deleted items in the hash table once persisted, rather than
+     * removing them, and only eject the values of items (even under full
+     * eviction). Warmup does so while it serves traffic, as it may yet load
+     * the (older) versions of the items from disk.
+     */
+    void retainPersistedDeletes() {
+        retainDeletes.store(true);
+    }
+
+    /// @return true if retainPersistedDeletes() is in effect
+    bool isRetainingPersistedDeletes() const {
+        return retainDeletes.load();
+    }
+
+    /**
+     * Stop keeping deleted items in the hash table once persisted, and
+     * remove those which were kept.
+     */
+    void releasePersistedDeletes();
+
     static size_t getCheckpointFlushTimeout();
 
     /**
@@ -1151,6 +1208,9 @@ public:
     static void setMutationMemoryThreshold(double memThreshold);
 
     std::queue<queued_item> rejectQueue;
+    // Set while a batch of this vbucket's items, prepared by
+    // KVBucket::prepareFlushBatch(), is waiting to be committed.
+    std::atomic<bool> flushBatchPending;
     std::unique_ptr<FailoverTable> failovers;
 
     std::atomic<size_t>  opsCreate;
@@ -1578,6 +1638,21 @@ private:
                          int bgFetchDelay,
                          bool isMeta = false) = 0;
 
+    /**
+     * Build the GetValue returned by getInternal() for a resident key.
+     *
+     * @param v the stored value to return; the caller must either hold its
+     *        hash bucket lock or a valid HashTable::MutexFreeReadGuard
+     * @param options flags indicating some retrieval related info
+     * @param getKeyOnly if GetKeyOnly::Yes only the key (and metadata) of
+     *        the item is returned
+     *
+     * @return the result of the operation
+     */
+    GetValue getInternalResident(const StoredValue& v,
+                                 get_options_t options,
+                                 GetKeyOnly getKeyOnly);
+
     /**
      * Get metadata and value for a non-resident key
      *
@@ -1666,6 +1741,9 @@ private:
     std::mutex bfMutex;
     std::unique_ptr<BloomFilter> bFilter;
     std::unique_ptr<BloomFilter> tempFilter;    // Used during compaction.
+    // Lookups of absent keys the filter did / didn't rule out.
+    std::atomic<size_t> bfTrueNegatives;
+    std::atomic<size_t> bfFalsePositives;
 
     std::atomic<uint64_t> rollbackItemCount;
 
@@ -1698,6 +1776,15 @@ private:
      */
     std::atomic<bool> mayContainXattrs;
 
+    /// Whether deletedOnDiskCbk() keeps deleted items in the hash table.
+    std::atomic<bool> retainDeletes;
+
+    /**
+     * Set by getLocked(), which changes an item's CAS in memory only. Not
+     * cleared, as the item may since have been unlocked without a mutation.
+     */
+    std::atomic<bool> unpersistedCas;
+
     static std::atomic<size_t> chkFlushTimeout;
 
     static double mutationMemThreshold;
@@ -0,0 +1,153 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "vbucket_image.h"
+
+#include <platform/crc32c.h>
+#include <platform/dirutils.h>
+#include <platform/platform.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int syncFd(int fd) {
+    int ret;
+    while ((ret = fsync(fd)) == -1 && errno == EINTR) {
+        /* Retry */
+    }
+    return ret;
+}
+
+VBucketImageWriter::VBucketImageWriter(const std::string& path,
+                                       const VBucketImageHeader& header)
+    : path(path), tmpPath(path + ".new"), fp(fopen(tmpPath.c_str(), "wb")) {
+    if (fp == nullptr) {
+        error = errno;
+        return;
+    }
+    setvbuf(fp, nullptr, _IOFBF, 1024 * 1024);
+    const VBucketImageHeader netHeader{htonll(header.magic),
+                                       htonll(header.vbid),
+                                       htonll(header.persistedSeqno),
+                                       htonll(header.failoverUuid),
+                                       htonll(header.flags)};
+    write(&netHeader, sizeof(netHeader));
+}
+
+VBucketImageWriter::~VBucketImageWriter() {
+    if (fp != nullptr) {
+        fclose(fp);
+    }
+    if (!committed) {
+        remove(tmpPath.c_str());
+    }
+}
+
+bool VBucketImageWriter::fail() {
+    if (error == 0) {
+        error = errno;
+    }
+    return false;
+}
+
+bool VBucketImageWriter::write(const void* buf, size_t len) {
+    if (fp == nullptr || error != 0) {
+        return false;
+    }
+    crc = crc32c(static_cast<const uint8_t*>(buf), len, crc);
+    if (fwrite(buf, 1, len, fp) != len) {
+        return fail();
+    }
+    return true;
+}
+
+bool VBucketImageWriter::commit() {
+    const uint32_t checksum = htonl(crc);
+    if (!write(&checksum, sizeof(checksum))) {
+        return false;
+    }
+    if (fflush(fp) != 0 || syncFd(fileno(fp)) != 0) {
+        return fail();
+    }
+    const int closed = fclose(fp);
+    fp = nullptr;
+    if (closed != 0 || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        return fail();
+    }
+    committed = true;
+
+    // Make the rename durable too.
+    const int dir = open(cb::io::dirname(path).c_str(), O_RDONLY);
+    if (dir == -1) {
+        return fail();
+    }
+    const bool synced = syncFd(dir) == 0;
+    if (!synced) {
+        fail();
+    }
+    close(dir);
+    return synced;
+}
+
+VBucketImageReader::VBucketImageReader(const std::string& path,
+                                       const VBucketImageHeader& expected) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    status = Status::Invalid;
+    struct stat st;
+    const size_t minSize = sizeof(VBucketImageHeader) + sizeof(uint32_t);
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= minSize) {
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == nullptr || map == MAP_FAILED) {
+        map = nullptr;
+        return;
+    }
+    size = st.st_size;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char* const data = static_cast<const char*>(map);
+    const size_t end = size - sizeof(uint32_t);
+    VBucketImageHeader header;
+    uint32_t checksum;
+    std::memcpy(&header, data, sizeof(header));
+    std::memcpy(&checksum, data + end, sizeof(checksum));
+    if (ntohll(header.magic) != expected.magic ||
+        ntohll(header.vbid) != expected.vbid ||
+        ntohll(header.persistedSeqno) != expected.persistedSeqno ||
+        ntohll(header.failoverUuid) != expected.failoverUuid ||
+        crc32c(reinterpret_cast<const uint8_t*>(data), end, 0) !=
+                ntohl(checksum)) {
+        return;
+    }
+    status = Status::Valid;
+    flags = ntohll(header.flags);
+    body = {data + sizeof(header), end - sizeof(header)};
+}
+
+VBucketImageReader::~VBucketImageReader() {
+    if (map != nullptr) {
+        munmap(map, size);
+    }
+}
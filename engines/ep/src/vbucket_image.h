@@ -0,0 +1,133 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * Files a vbucket writes at shutdown for warmup to restore state from (its
+ * bloom filter, its metadata image), each valid only for the vbucket in the
+ * state it was written in.
+ *
+ * An image file holds a VBucketImageHeader, the body, then a crc32c of all
+ * that precedes it (uint32_t). The header and checksum are in network byte
+ * order; the body is the image's own.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <platform/sized_buffer.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+struct VBucketImageHeader {
+    // Identifies the kind (and version) of image.
+    uint64_t magic;
+    uint64_t vbid;
+    uint64_t persistedSeqno;
+    uint64_t failoverUuid;
+    // Specific to the kind of image.
+    uint64_t flags;
+};
+
+/**
+ * Writes an image file. The image is written to "<path>.new", which
+ * commit() syncs and renames over path (then syncs the directory), so a
+ * crash leaves either the previous file or the complete new one.
+ */
+class VBucketImageWriter {
+public:
+    /// @param header the image's header, in host byte order
+    VBucketImageWriter(const std::string& path,
+                       const VBucketImageHeader& header);
+
+    /// Removes the partly written image, unless committed.
+    ~VBucketImageWriter();
+
+    /// Append to the body. @return false if the write failed
+    bool write(const void* buf, size_t len);
+
+    /**
+     * Append the checksum and make the image durable at path.
+     * @return false if any write, the sync or the rename failed
+     */
+    bool commit();
+
+    /// The errno of the first failure.
+    int getError() const {
+        return error;
+    }
+
+private:
+    bool fail();
+
+    const std::string path;
+    const std::string tmpPath;
+    FILE* fp;
+    uint32_t crc = 0;
+    int error = 0;
+    bool committed = false;
+};
+
+/**
+ * Reads (memory maps) an image file written by VBucketImageWriter.
+ */
+class VBucketImageReader {
+public:
+    enum class Status {
+        // There's no image file.
+        Missing,
+        // The image is corrupt, or for another kind of image or vbucket
+        // state than expected.
+        Invalid,
+        Valid
+    };
+
+    /**
+     * @param expected the header the image must have (other than its
+     *        flags), in host byte order
+     */
+    VBucketImageReader(const std::string& path,
+                       const VBucketImageHeader& expected);
+
+    ~VBucketImageReader();
+
+    VBucketImageReader(const VBucketImageReader&) = delete;
+    VBucketImageReader& operator=(const VBucketImageReader&) = delete;
+
+    Status getStatus() const {
+        return status;
+    }
+
+    /// The image's flags, if Valid.
+    uint64_t getFlags() const {
+        return flags;
+    }
+
+    /// The image's body, if Valid.
+    cb::const_char_buffer getBody() const {
+        return body;
+    }
+
+private:
+    Status status = Status::Missing;
+    void* map = nullptr;
+    size_t size = 0;
+    uint64_t flags = 0;
+    cb::const_char_buffer body;
+};
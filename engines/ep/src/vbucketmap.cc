@@ -21,6 +21,7 @@
 
 #include <vector>
 
+#include "couch-kvstore/couch-block-cache.h"
 #include "kv_bucket_iface.h"
 #include "ep_engine.h"
 #include "vbucketmap.h"
@@ -28,8 +29,16 @@
 VBucketMap::VBucketMap(Configuration& config, KVBucket& store)
     : size(config.getMaxVbuckets()) {
     WorkLoadPolicy &workload = store.getEPEngine().getWorkLoadPolicy();
+    // One block cache for the KVStores of every shard.
+    std::shared_ptr<CouchBlockCache> blockCache;
+    if (config.getBackend() == "couchdb" &&
+        config.getCouchstoreBlockCacheSize() > 0) {
+        blockCache = std::make_shared<CouchBlockCache>(
+                config.getCouchstoreBlockCacheSize());
+    }
     for (size_t shardId = 0; shardId < workload.getNumShards(); shardId++) {
-        shards.push_back(std::make_unique<KVShard>(shardId, store));
+        shards.push_back(
+                std::make_unique<KVShard>(shardId, store, blockCache));
     }
 
     config.addValueChangedListener("hlc_drift_ahead_threshold_us",
@@ -30,6 +30,7 @@
 
 #include <platform/make_unique.h>
 
+#include <algorithm>
 #include <limits>
 #include <string>
 #include <utility>
@@ -134,9 +135,10 @@ private:
 
 class WarmupKeyDump : public GlobalTask {
 public:
-    WarmupKeyDump(KVBucket& st, uint16_t sh, Warmup* w)
+    WarmupKeyDump(KVBucket& st, uint16_t sh, bool preferValues, Warmup* w)
         : GlobalTask(&st.getEPEngine(), TaskId::WarmupKeyDump, 0, false),
           _shardId(sh),
+          _preferValues(preferValues),
           _warmup(w),
           _description("Warmup - key dump: shard " + std::to_string(_shardId)) {
         _warmup->addToTaskSet(uid);
@@ -148,13 +150,14 @@ public:
 
     bool run() {
         TRACE_EVENT0("ep-engine/task", "WarmupKeyDump");
-        _warmup->keyDumpforShard(_shardId);
+        _warmup->keyDumpforShard(_shardId, _preferValues);
         _warmup->removeFromTaskSet(uid);
         return false;
     }
 
 private:
     uint16_t _shardId;
+    bool _preferValues;
     Warmup* _warmup;
     const std::string _description;
 };
@@ -186,7 +189,12 @@ private:
 class WarmupLoadAccessLog : public GlobalTask {
 public:
     WarmupLoadAccessLog(KVBucket& st, uint16_t sh, Warmup* w)
-        : GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadAccessLog, 0, false),
+        : GlobalTask(&st.getEPEngine(),
+                     w->isServingTraffic()
+                             ? TaskId::WarmupBackgroundLoadAccessLog
+                             : TaskId::WarmupLoadAccessLog,
+                     0,
+                     false),
           _shardId(sh),
           _warmup(w),
           _description("Warmup - loading access log: shard " +
@@ -200,7 +208,9 @@ public:
 
     bool run() {
         TRACE_EVENT0("ep-engine/task", "WarmupLoadAccessLog");
-        _warmup->loadingAccessLog(_shardId);
+        if (_warmup->loadingAccessLog(_shardId)) {
+            return true;
+        }
         _warmup->removeFromTaskSet(uid);
         return false;
     }
@@ -214,7 +224,12 @@ private:
 class WarmupLoadingKVPairs : public GlobalTask {
 public:
     WarmupLoadingKVPairs(KVBucket& st, uint16_t sh, Warmup* w)
-        : GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadingKVPairs, 0, false),
+        : GlobalTask(&st.getEPEngine(),
+                     w->isServingTraffic()
+                             ? TaskId::WarmupBackgroundLoadingKVPairs
+                             : TaskId::WarmupLoadingKVPairs,
+                     0,
+                     false),
           _shardId(sh),
           _warmup(w),
           _description("Warmup - loading KV Pairs: shard " +
@@ -228,7 +243,9 @@ public:
 
     bool run() {
         TRACE_EVENT0("ep-engine/task", "WarmupLoadingKVPairs");
-        _warmup->loadKVPairsforShard(_shardId);
+        if (_warmup->loadKVPairsforShard(_shardId)) {
+            return true;
+        }
         _warmup->removeFromTaskSet(uid);
         return false;
     }
@@ -242,7 +259,11 @@ private:
 class WarmupLoadingData : public GlobalTask {
 public:
     WarmupLoadingData(KVBucket& st, uint16_t sh, Warmup* w) :
-        GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadingData, 0, false),
+        GlobalTask(&st.getEPEngine(),
+                   w->isServingTraffic() ? TaskId::WarmupBackgroundLoadingData
+                                         : TaskId::WarmupLoadingData,
+                   0,
+                   false),
         _shardId(sh),
         _warmup(w),
         _description("Warmup - loading data: shard " +
@@ -256,7 +277,9 @@ public:
 
     bool run() {
         TRACE_EVENT0("ep-engine/task", "WarmupLoadingData");
-        _warmup->loadDataforShard(_shardId);
+        if (_warmup->loadDataforShard(_shardId)) {
+            return true;
+        }
         _warmup->removeFromTaskSet(uid);
         return false;
     }
@@ -292,7 +315,7 @@ private:
 
 
 static bool batchWarmupCallback(uint16_t vbId,
-                                const std::set<StoredDocKey>& fetches,
+                                const std::vector<StoredDocKey>& fetches,
                                 void *arg)
 {
     WarmupCookie *c = static_cast<WarmupCookie *>(arg);
@@ -389,6 +412,16 @@ const int WarmupState::LoadingKVPairs = 6;
 const int WarmupState::LoadingData = 7;
 const int WarmupState::Done = 8;
 
+// Name of each state (bar Done) in the stat of the time spent in it.
+static const char* phaseStatNames[] = {"initialize",
+                                       "create_vbuckets",
+                                       "estimate_item_count",
+                                       "key_dump",
+                                       "check_access_log",
+                                       "load_access_log",
+                                       "load_kv_pairs",
+                                       "load_data"};
+
 const char *WarmupState::toString(void) const {
     return getStateDescription(state.load());
 }
@@ -467,14 +500,16 @@ std::ostream& operator <<(std::ostream &out, const WarmupState &state)
 
 LoadStorageKVPairCallback::LoadStorageKVPairCallback(KVBucket& ep,
                                                      bool _maybeEnableTraffic,
-                                                     int _warmupState)
+                                                     int _warmupState,
+                                                     bool _pipelinedValues)
     : vbuckets(ep.vbMap),
       stats(ep.getEPEngine().getEpStats()),
       epstore(ep),
       startTime(ep_real_time()),
       hasPurged(false),
       maybeEnableTraffic(_maybeEnableTraffic),
-      warmupState(_warmupState) {
+      warmupState(_warmupState),
+      pipelinedValues(_pipelinedValues) {
 }
 
 void LoadStorageKVPairCallback::callback(GetValue &val) {
@@ -486,6 +521,13 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
         return;
     }
 
+    // Values loaded ahead of LoadingData must not take memory the keys still
+    // to be loaded need: stop this vbucket at the threshold, not after it.
+    if (pipelinedValues && epstore.getWarmup()->maybeHaltValuePipeline()) {
+        setStatus(ENGINE_ENOMEM);
+        return;
+    }
+
     bool stopLoading = false;
     if (i != NULL && !epstore.getWarmup()->isComplete()) {
         VBucketPtr vb = vbuckets.getBucket(i->getVBucketId());
@@ -514,6 +556,12 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                     epVb->insertFromWarmup(*i, shouldEject(), val.isPartial());
             switch (res) {
             case MutationStatus::NoMem:
+                if (pipelinedValues) {
+                    // Leave the item (and any purge) to LoadingData.
+                    epstore.getWarmup()->maybeHaltValuePipeline(true);
+                    setStatus(ENGINE_ENOMEM);
+                    return;
+                }
                 if (retry == 2) {
                     if (hasPurged) {
                         if (++stats.warmOOM == 1) {
@@ -604,9 +652,6 @@ void LoadStorageKVPairCallback::purge() {
     class EmergencyPurgeVisitor : public VBucketVisitor,
                                   public HashTableVisitor {
     public:
-        EmergencyPurgeVisitor(KVBucket& store) :
-            epstore(store) {}
-
         void visitBucket(VBucketPtr &vb) override {
             if (vBucketFilter(vb->getId())) {
                 currentBucket = vb;
@@ -617,18 +662,16 @@ void LoadStorageKVPairCallback::purge() {
         bool visit(const HashTable::HashBucketLock& lh,
                    StoredValue& v) override {
             StoredValue* vPtr = &v;
-            currentBucket->ht.unlocked_ejectItem(
-                    vPtr, epstore.getItemEvictionPolicy());
+            currentBucket->pageOut(lh, vPtr);
             return true;
         }
 
     private:
-        KVBucket& epstore;
         VBucketPtr currentBucket;
     };
 
     auto vbucketIds(vbuckets.getBuckets());
-    EmergencyPurgeVisitor epv(epstore);
+    EmergencyPurgeVisitor epv;
     for (auto vbid : vbucketIds) {
         VBucketPtr vb = vbuckets.getBucket(vbid);
         if (vb) {
@@ -664,6 +707,140 @@ void LoadValueCallback::callback(CacheLookup &lookup)
 //                                                                          //
 //    Implementation of the warmup class                                    //
 //                                                                          //
+/**
+ * The loading of a shard's access log (or of the old one, if it can't be
+ * read), a batch at a time. To constrain the number of elements from the
+ * access log we have to keep alive (there may be millions of items
+ * per-vBucket), each batch is applied to the store as it's read.
+ */
+class Warmup::AccessLogLoad {
+public:
+    AccessLogLoad(KVBucket& store,
+                  const std::map<uint16_t, vbucket_state>& vbStates,
+                  const std::string& logFile)
+        : store(store),
+          vbStates(vbStates),
+          cb(store, true, WarmupState::LoadingAccessLog),
+          cookie(&store, cb),
+          paths{logFile, logFile + ".old"},
+          nextPath(0),
+          startTime(gethrtime()),
+          loadDuration(0),
+          applyDuration(0),
+          complete(false),
+          corrupt(false) {
+    }
+
+    /**
+     * Load and apply the next batch of the log, opening the log first.
+     *
+     * @return true if there's more to load
+     */
+    bool loadBatch(size_t batchSize) {
+        try {
+            if (!iter && !open()) {
+                return false;
+            }
+
+            // Load a chunk of the access log file
+            hrtime_t start = gethrtime();
+            *iter = harvester->loadBatch(*iter, batchSize);
+            loadDuration += (gethrtime() - start);
+
+            // .. then apply it to the store.
+            hrtime_t applyStart = gethrtime();
+            if (store.multiBGFetchEnabled()) {
+                harvester->apply(&cookie, &batchWarmupCallback);
+            } else {
+                harvester->apply(&cookie, &warmupCallback);
+            }
+            applyDuration += (gethrtime() - applyStart);
+
+            if (*iter == log->end()) {
+                complete = true;
+                return false;
+            }
+            return true;
+        } catch (MutationLog::ReadException& e) {
+            corrupt = true;
+            LOG(EXTENSION_LOG_WARNING,
+                "Error reading warmup access log %s: %s",
+                paths[nextPath - 1].c_str(),
+                e.what());
+            // Try the old log.
+            iter.reset();
+            harvester.reset();
+            log.reset();
+            return nextPath < paths.size();
+        }
+    }
+
+    /// @return true if a log was loaded in full
+    bool isComplete() const {
+        return complete;
+    }
+
+    /// @return true if a log couldn't be read
+    bool isCorrupt() const {
+        return corrupt;
+    }
+
+    hrtime_t getStartTime() const {
+        return startTime;
+    }
+
+    /// Log the loaded log's statistics, @return its number of entries
+    size_t logCompletion() {
+        size_t total = harvester->total();
+        LOG(EXTENSION_LOG_DEBUG, "Completed log read in %s with %ld entries",
+            hrtime2text(loadDuration).c_str(), total);
+
+        LOG(EXTENSION_LOG_DEBUG,
+            "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
+            hrtime2text(applyDuration).c_str(), cookie.loaded, cookie.skipped,
+            cookie.error);
+        return total;
+    }
+
+private:
+    /// Open the next log which exists. @return false if there's none
+    bool open() {
+        while (nextPath < paths.size()) {
+            auto next = std::make_unique<MutationLog>(paths[nextPath++]);
+            if (next->exists()) {
+                next->open();
+                log = std::move(next);
+                harvester = std::make_unique<MutationLogHarvester>(
+                        *log, &store.getEPEngine());
+                for (const auto& vbState : vbStates) {
+                    harvester->setVBucket(vbState.first);
+                }
+                iter = std::make_unique<MutationLog::iterator>(log->begin());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    KVBucket& store;
+    const std::map<uint16_t, vbucket_state>& vbStates;
+    LoadStorageKVPairCallback cb;
+    WarmupCookie cookie;
+
+    /// The current log, then the old one.
+    const std::vector<std::string> paths;
+    size_t nextPath;
+    std::unique_ptr<MutationLog> log;
+    std::unique_ptr<MutationLogHarvester> harvester;
+    std::unique_ptr<MutationLog::iterator> iter;
+
+    const hrtime_t startTime;
+    hrtime_t loadDuration;
+    hrtime_t applyDuration;
+    bool complete;
+    bool corrupt;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 
 Warmup::Warmup(KVBucket& st, Configuration& config_)
@@ -676,7 +853,24 @@ Warmup::Warmup(KVBucket& st, Configuration& config_)
       shardVbStates(store.vbMap.getNumShards()),
       threadtask_count(0),
       shardKeyDumpStatus(store.vbMap.getNumShards()),
+      tasksPerShard(std::max(size_t(2),
+                             (ExecutorPool::get()->getNumReaders() +
+                              store.vbMap.getNumShards() - 1) /
+                                     store.vbMap.getNumShards())),
+      phaseTaskCount(0),
+      shardNextVb(store.vbMap.getNumShards()),
+      shardStopped(store.vbMap.getNumShards()),
+      pipelineValues(false),
+      pipelineHalted(false),
+      shardValueQueue(store.vbMap.getNumShards()),
+      phaseTimes(WarmupState::Done),
+      phaseStart(0),
+      useMetadataImage(store.vbMap.getSize()),
+      metadataImagesLoaded(0),
       shardVbIds(store.vbMap.getNumShards()),
+      serveTraffic(config.isWarmupServeTraffic()),
+      servingTraffic(false),
+      shardAccessLogLoads(store.vbMap.getNumShards()),
       estimateTime(0),
       estimatedItemCount(std::numeric_limits<size_t>::max()),
       cleanShutdown(true),
@@ -687,6 +881,8 @@ Warmup::Warmup(KVBucket& st, Configuration& config_)
       createVBucketsComplete(false) {
 }
 
+Warmup::~Warmup() = default;
+
 void Warmup::addToTaskSet(size_t taskId) {
     LockHolder lh(taskSetMutex);
     taskSet.insert(taskId);
@@ -737,6 +933,7 @@ void Warmup::scheduleInitialize()
 void Warmup::initialize()
 {
     startTime.store(gethrtime());
+    phaseStart.store(startTime);
 
     std::map<std::string, std::string> session_stats;
     store.getOneROUnderlying()->getPersistedStats(session_stats);
@@ -765,6 +962,13 @@ void Warmup::scheduleCreateVBuckets()
 void Warmup::createVBuckets(uint16_t shardId) {
     size_t maxEntries = store.getEPEngine().getMaxFailoverEntries();
 
+    const bool restoreFilters = cleanShutdown && config.isBfilterEnabled() &&
+                                config.isBfilterPersist();
+    size_t restoredFilters = 0;
+    // Only the key dump, under value eviction, can load an image.
+    const bool useImages = cleanShutdown && config.isWarmupMetadataImage() &&
+                           store.getItemEvictionPolicy() == VALUE_ONLY;
+
     // Iterate over all VBucket states defined for this shard, creating VBucket
     // objects if they do not already exist.
     for (const auto itr : shardVbStates[shardId]) {
@@ -772,6 +976,7 @@ void Warmup::createVBuckets(uint16_t shardId) {
         vbucket_state vbs = itr.second;
 
         VBucketPtr vb = store.getVBucket(vbid);
+        const bool created = !vb;
         if (!vb) {
             std::unique_ptr<FailoverTable> table;
             if (vbs.failovers.empty()) {
@@ -821,6 +1026,28 @@ void Warmup::createVBuckets(uint16_t shardId) {
         vb->setPersistenceCheckpointId(vbs.checkpointId);
         // For each vbucket, set the last persisted seqno checkpoint
         vb->setPersistenceSeqno(vbs.highSeqno);
+
+        // Reuse the bloom filter written at shutdown. The file is removed
+        // regardless, as it's stale once the vbucket is next written to.
+        const auto filterFile = store.getBloomFilterFile(vbid);
+        if (created && restoreFilters && vb->restoreFilter(filterFile)) {
+            ++restoredFilters;
+        }
+        remove(filterFile.c_str());
+
+        // Likewise the metadata image, once the key dump has tried it.
+        useMetadataImage[vbid] = created && useImages;
+        if (!useMetadataImage[vbid]) {
+            remove(store.getMetadataImageFile(vbid).c_str());
+        }
+    }
+
+    if (restoredFilters) {
+        LOG(EXTENSION_LOG_NOTICE,
+            "Warmup::createVBuckets: Restored %" PRIu64
+            " bloom filter(s) for shard %" PRIu16,
+            uint64_t(restoredFilters),
+            shardId);
     }
 
     if (++threadtask_count == store.vbMap.getNumShards()) {
@@ -890,6 +1117,9 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
         if (store.getItemEvictionPolicy() == VALUE_ONLY) {
             transition(WarmupState::KeyDump);
         } else {
+            // Items not yet loaded are fetched from disk as for any which
+            // aren't resident.
+            maybeServeTraffic();
             transition(WarmupState::CheckForAccessLog);
         }
     }
@@ -897,38 +1127,65 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
 
 void Warmup::scheduleKeyDump()
 {
-    threadtask_count = 0;
+    // Without an access log to load values by, each vbucket's values can be
+    // loaded as soon as its keys are, while later vbuckets' keys load.
+    pipelineValues = !accessLogsAvailable();
+    pipelineHalted = false;
+    beginVBucketPhase();
     for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = std::make_shared<WarmupKeyDump>(store, i, this);
-        ExecutorPool::get()->schedule(task);
+        for (size_t t = 0; t < getPhaseTasksPerShard(); t++) {
+            ExTask task = std::make_shared<WarmupKeyDump>(
+                    store, i, pipelineValues && (t % 2) == 1, this);
+            ExecutorPool::get()->schedule(task);
+        }
     }
-
 }
 
-void Warmup::keyDumpforShard(uint16_t shardId)
+void Warmup::keyDumpforShard(uint16_t shardId, bool preferValues)
 {
-    KVStore* kvstore = store.getROUnderlyingByShard(shardId);
     auto cb = std::make_shared<LoadStorageKVPairCallback>(
             store, false, state.getState());
     auto cl = std::make_shared<NoLookupCallback>();
 
-    for (const auto vbid : shardVbIds[shardId]) {
-        ScanContext* ctx = kvstore->initScanContext(cb, cl, vbid, 0,
-                                                    DocumentFilter::NO_DELETES,
-                                                    ValueFilter::KEYS_ONLY);
-        if (ctx) {
-            auto errorCode = kvstore->scan(ctx);
-            kvstore->destroyScanContext(ctx);
-            if (errorCode == scan_again) { // ENGINE_ENOMEM
-                // skip loading remaining VBuckets as memory limit was reached
-                break;
-            }
+    // Values loaded now never enable traffic: not all keys are loaded yet.
+    std::shared_ptr<LoadStorageKVPairCallback> valueCb;
+    std::shared_ptr<LoadValueCallback> valueCl;
+    if (preferValues) {
+        valueCb = std::make_shared<LoadStorageKVPairCallback>(
+                store,
+                false,
+                WarmupState::LoadingData,
+                /*pipelinedValues*/ true);
+        valueCl = std::make_shared<LoadValueCallback>(store.vbMap,
+                                                      WarmupState::LoadingData);
+    }
+
+    uint16_t vbid;
+    while (true) {
+        if (preferValues && !maybeHaltValuePipeline() &&
+            nextValueVBucket(shardId, vbid)) {
+            scanVBucket(shardId,
+                        vbid,
+                        valueCb,
+                        valueCl,
+                        ValueFilter::VALUES_DECOMPRESSED,
+                        /*pipelinedValues*/ true);
+            continue;
+        }
+        if (!nextVBucket(shardId, vbid)) {
+            break;
+        }
+        if (!loadMetadataImage(vbid)) {
+            scanVBucket(shardId, vbid, cb, cl, ValueFilter::KEYS_ONLY);
+        }
+        if (pipelineValues) {
+            queueValueVBucket(shardId, vbid);
         }
     }
 
     shardKeyDumpStatus[shardId] = true;
 
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (phaseTaskDone()) {
         bool success = false;
         for (size_t i = 0; i < store.vbMap.getNumShards(); i++) {
             if (shardKeyDumpStatus[i]) {
@@ -940,6 +1197,7 @@ void Warmup::keyDumpforShard(uint16_t shardId)
         }
 
         if (success) {
+            maybeServeTraffic();
             transition(WarmupState::CheckForAccessLog);
         } else {
             LOG(EXTENSION_LOG_WARNING,
@@ -949,6 +1207,23 @@ void Warmup::keyDumpforShard(uint16_t shardId)
     }
 }
 
+void Warmup::maybeServeTraffic() {
+    if (!serveTraffic) {
+        return;
+    }
+    for (const auto& vbids : shardVbIds) {
+        for (const auto vbid : vbids) {
+            VBucketPtr vb = store.getVBucket(vbid);
+            if (vb) {
+                vb->retainPersistedDeletes();
+            }
+        }
+    }
+    servingTraffic = true;
+    LOG(EXTENSION_LOG_NOTICE,
+        "Warmup::maybeServeTraffic: Serving traffic while loading values");
+}
+
 void Warmup::scheduleCheckForAccessLog()
 {
     ExTask task = std::make_shared<WarmupCheckforAccessLog>(store, this);
@@ -965,20 +1240,14 @@ void Warmup::checkForAccessLog()
         transition(WarmupState::Done);
     }
 
-    size_t accesslogs = 0;
-    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        std::string curr = store.accessLog[i].getLogFile();
-        std::string old = store.accessLog[i].getLogFile();
-        old.append(".old");
-        if (access(curr.c_str(), F_OK) == 0 ||
-            access(old.c_str(), F_OK) == 0) {
-            accesslogs++;
-        }
-    }
-    if (accesslogs == store.vbMap.shards.size()) {
+    // If values were pipelined with the keys, the access log wasn't there
+    // when they started; load those of the vbuckets left over (whatever the
+    // eviction policy, as all the keys are loaded).
+    if (!pipelineValues && accessLogsAvailable()) {
         transition(WarmupState::LoadingAccessLog);
     } else {
-        if (store.getItemEvictionPolicy() == VALUE_ONLY) {
+        if (pipelineValues ||
+            store.getItemEvictionPolicy() == VALUE_ONLY) {
             transition(WarmupState::LoadingData);
         } else {
             transition(WarmupState::LoadingKVPairs);
@@ -987,6 +1256,19 @@ void Warmup::checkForAccessLog()
 
 }
 
+bool Warmup::accessLogsAvailable() const {
+    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
+        std::string curr = store.accessLog[i].getLogFile();
+        std::string old = store.accessLog[i].getLogFile();
+        old.append(".old");
+        if (access(curr.c_str(), F_OK) != 0 &&
+            access(old.c_str(), F_OK) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void Warmup::scheduleLoadingAccessLog()
 {
     threadtask_count = 0;
@@ -996,56 +1278,38 @@ void Warmup::scheduleLoadingAccessLog()
     }
 }
 
-void Warmup::loadingAccessLog(uint16_t shardId)
+bool Warmup::loadingAccessLog(uint16_t shardId)
 {
-    LoadStorageKVPairCallback load_cb(store, true, state.getState());
-    bool success = false;
-    hrtime_t stTime = gethrtime();
-    if (store.accessLog[shardId].exists()) {
-        try {
-            store.accessLog[shardId].open();
-            if (doWarmup(store.accessLog[shardId],
-                         shardVbStates[shardId],
-                         load_cb) != (size_t)-1) {
-                success = true;
-            }
-        } catch (MutationLog::ReadException &e) {
-            corruptAccessLog = true;
-            LOG(EXTENSION_LOG_WARNING, "Error reading warmup access log:  %s",
-                    e.what());
+    auto& load = shardAccessLogLoads[shardId];
+    if (!load) {
+        load = std::make_unique<AccessLogLoad>(
+                store,
+                shardVbStates[shardId],
+                store.accessLog[shardId].getLogFile());
+    }
+    while (load->loadBatch(config.getWarmupBatchSize())) {
+        if (servingTraffic) {
+            return true;
         }
     }
 
-    if (!success) {
-        // Do we have the previous file?
-        std::string nm = store.accessLog[shardId].getLogFile();
-        nm.append(".old");
-        MutationLog old(nm);
-        if (old.exists()) {
-            try {
-                old.open();
-                if (doWarmup(old, shardVbStates[shardId], load_cb) !=
-                    (size_t)-1) {
-                    success = true;
-                }
-            } catch (MutationLog::ReadException &e) {
-                corruptAccessLog = true;
-                LOG(EXTENSION_LOG_WARNING, "Error reading old access log:  %s",
-                        e.what());
-            }
-        }
+    if (load->isCorrupt()) {
+        corruptAccessLog = true;
     }
-
     size_t numItems = store.getEPEngine().getEpStats().warmedUpValues;
-    if (success && numItems) {
+    if (load->isComplete()) {
+        setEstimatedWarmupCount(load->logCompletion());
+    }
+    if (load->isComplete() && numItems) {
         LOG(EXTENSION_LOG_NOTICE,
             "%" PRIu64 " items loaded from access log, completed in %s",
             uint64_t(numItems),
-            hrtime2text((gethrtime() - stTime) / 1000).c_str());
+            hrtime2text((gethrtime() - load->getStartTime()) / 1000).c_str());
     } else {
         size_t estimatedCount= store.getEPEngine().getEpStats().warmedUpKeys;
         setEstimatedWarmupCount(estimatedCount);
     }
+    load.reset();
 
     if (++threadtask_count == store.vbMap.getNumShards()) {
         if (!store.maybeEnableTraffic()) {
@@ -1055,52 +1319,7 @@ void Warmup::loadingAccessLog(uint16_t shardId)
         }
 
     }
-}
-
-size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
-                        vbucket_state> &vbmap, Callback<GetValue> &cb)
-{
-    MutationLogHarvester harvester(lf, &store.getEPEngine());
-    std::map<uint16_t, vbucket_state>::const_iterator it;
-    for (it = vbmap.begin(); it != vbmap.end(); ++it) {
-        harvester.setVBucket(it->first);
-    }
-
-    // To constrain the number of elements from the access log we have to keep
-    // alive (there may be millions of items per-vBucket), process it
-    // a batch at a time.
-    hrtime_t log_load_duration{};
-    hrtime_t log_apply_duration{};
-    WarmupCookie cookie(&store, cb);
-
-    auto alog_iter = lf.begin();
-    do {
-        // Load a chunk of the access log file
-        hrtime_t start = gethrtime();
-        alog_iter = harvester.loadBatch(alog_iter, config.getWarmupBatchSize());
-        log_load_duration += (gethrtime() - start);
-
-        // .. then apply it to the store.
-        hrtime_t apply_start = gethrtime();
-        if (store.multiBGFetchEnabled()) {
-            harvester.apply(&cookie, &batchWarmupCallback);
-        } else {
-            harvester.apply(&cookie, &warmupCallback);
-        }
-        log_apply_duration += (gethrtime() - apply_start);
-    } while (alog_iter != lf.end());
-
-    size_t total = harvester.total();
-    setEstimatedWarmupCount(total);
-    LOG(EXTENSION_LOG_DEBUG, "Completed log read in %s with %ld entries",
-        hrtime2text(log_load_duration).c_str(), total);
-
-    LOG(EXTENSION_LOG_DEBUG,
-        "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
-        hrtime2text(log_apply_duration).c_str(), cookie.loaded, cookie.skipped,
-        cookie.error);
-
-    return cookie.loaded;
+    return false;
 }
 
 void Warmup::scheduleLoadingKVPairs()
@@ -1111,45 +1330,42 @@ void Warmup::scheduleLoadingKVPairs()
     // keys have been warmed up at this point.
     setEstimatedWarmupCount(estimatedItemCount);
 
-    threadtask_count = 0;
+    beginVBucketPhase();
     for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = std::make_shared<WarmupLoadingKVPairs>(store, i, this);
-        ExecutorPool::get()->schedule(task);
+        for (size_t t = 0; t < getPhaseTasksPerShard(); t++) {
+            ExTask task =
+                    std::make_shared<WarmupLoadingKVPairs>(store, i, this);
+            ExecutorPool::get()->schedule(task);
+        }
     }
 
 }
 
-void Warmup::loadKVPairsforShard(uint16_t shardId)
+bool Warmup::loadKVPairsforShard(uint16_t shardId)
 {
     bool maybe_enable_traffic = false;
-    scan_error_t errorCode = scan_success;
 
     if (store.getItemEvictionPolicy() == FULL_EVICTION) {
         maybe_enable_traffic = true;
     }
 
-    KVStore* kvstore = store.getROUnderlyingByShard(shardId);
     auto cb = std::make_shared<LoadStorageKVPairCallback>(
             store, maybe_enable_traffic, state.getState());
     auto cl =
             std::make_shared<LoadValueCallback>(store.vbMap, state.getState());
 
-    for (const auto vbid : shardVbIds[shardId]) {
-        ScanContext* ctx = kvstore->initScanContext(cb, cl, vbid, 0,
-                                                    DocumentFilter::NO_DELETES,
-                                                    ValueFilter::VALUES_DECOMPRESSED);
-        if (ctx) {
-            errorCode = kvstore->scan(ctx);
-            kvstore->destroyScanContext(ctx);
-            if (errorCode == scan_again) { // ENGINE_ENOMEM
-                // skip loading remaining VBuckets as memory limit was reached
-                break;
-            }
+    uint16_t vbid;
+    while (nextVBucket(shardId, vbid)) {
+        scanVBucket(
+                shardId, vbid, cb, cl, ValueFilter::VALUES_DECOMPRESSED);
+        if (servingTraffic) {
+            return true;
         }
     }
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (phaseTaskDone()) {
         transition(WarmupState::Done);
     }
+    return false;
 }
 
 void Warmup::scheduleLoadingData()
@@ -1157,40 +1373,151 @@ void Warmup::scheduleLoadingData()
     size_t estimatedCount = store.getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
 
-    threadtask_count = 0;
+    // The vbuckets whose values weren't loaded with their keys.
+    if (!pipelineValues) {
+        std::lock_guard<std::mutex> lh(valueQueueMutex);
+        for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
+            shardValueQueue[i].assign(shardVbIds[i].begin(),
+                                      shardVbIds[i].end());
+        }
+    }
+
+    beginVBucketPhase();
     for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = std::make_shared<WarmupLoadingData>(store, i, this);
-        ExecutorPool::get()->schedule(task);
+        for (size_t t = 0; t < getPhaseTasksPerShard(); t++) {
+            ExTask task = std::make_shared<WarmupLoadingData>(store, i, this);
+            ExecutorPool::get()->schedule(task);
+        }
     }
 }
 
-void Warmup::loadDataforShard(uint16_t shardId)
+bool Warmup::loadDataforShard(uint16_t shardId)
 {
-    scan_error_t errorCode = scan_success;
-
-    KVStore* kvstore = store.getROUnderlyingByShard(shardId);
     auto cb = std::make_shared<LoadStorageKVPairCallback>(
             store, true, state.getState());
     auto cl =
             std::make_shared<LoadValueCallback>(store.vbMap, state.getState());
 
-    for (const auto vbid : shardVbIds[shardId]) {
-        ScanContext* ctx = kvstore->initScanContext(cb, cl, vbid, 0,
-                                                    DocumentFilter::NO_DELETES,
-                                                    ValueFilter::VALUES_DECOMPRESSED);
-        if (ctx) {
-            errorCode = kvstore->scan(ctx);
-            kvstore->destroyScanContext(ctx);
-            if (errorCode == scan_again) { // ENGINE_ENOMEM
-                // skip loading remaining VBuckets as memory limit was reached
-                break;
-            }
+    uint16_t vbid;
+    while (!shardStopped[shardId] && nextValueVBucket(shardId, vbid)) {
+        scanVBucket(
+                shardId, vbid, cb, cl, ValueFilter::VALUES_DECOMPRESSED);
+        if (servingTraffic) {
+            return true;
         }
     }
 
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (phaseTaskDone()) {
         transition(WarmupState::Done);
     }
+    return false;
+}
+
+size_t Warmup::getPhaseTasksPerShard() const {
+    // Leave the other reader threads to background fetches.
+    return servingTraffic ? 1 : tasksPerShard;
+}
+
+void Warmup::beginVBucketPhase() {
+    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
+        shardNextVb[i] = 0;
+        shardStopped[i] = false;
+    }
+    threadtask_count = 0;
+    phaseTaskCount = store.vbMap.shards.size() * getPhaseTasksPerShard();
+}
+
+bool Warmup::nextVBucket(uint16_t shardId, uint16_t& vbid) {
+    if (shardStopped[shardId]) {
+        return false;
+    }
+    const size_t idx = shardNextVb[shardId]++;
+    if (idx >= shardVbIds[shardId].size()) {
+        return false;
+    }
+    vbid = shardVbIds[shardId][idx];
+    return true;
+}
+
+bool Warmup::nextValueVBucket(uint16_t shardId, uint16_t& vbid) {
+    std::lock_guard<std::mutex> lh(valueQueueMutex);
+    auto& queue = shardValueQueue[shardId];
+    if (queue.empty()) {
+        return false;
+    }
+    vbid = queue.front();
+    queue.pop_front();
+    return true;
+}
+
+void Warmup::queueValueVBucket(uint16_t shardId, uint16_t vbid) {
+    std::lock_guard<std::mutex> lh(valueQueueMutex);
+    shardValueQueue[shardId].push_back(vbid);
+}
+
+void Warmup::scanVBucket(uint16_t shardId,
+                         uint16_t vbid,
+                         std::shared_ptr<Callback<GetValue>> cb,
+                         std::shared_ptr<Callback<CacheLookup>> cl,
+                         ValueFilter valFilter,
+                         bool pipelinedValues) {
+    KVStore* kvstore = store.getROUnderlyingByShard(shardId);
+    ScanContext* ctx = kvstore->initScanContext(
+            cb, cl, vbid, 0, DocumentFilter::NO_DELETES, valFilter);
+    if (ctx) {
+        auto errorCode = kvstore->scan(ctx);
+        kvstore->destroyScanContext(ctx);
+        if (errorCode == scan_again) { // ENGINE_ENOMEM
+            if (pipelinedValues) {
+                // Only the value pipeline stopped; the keys must still be
+                // loaded, and LoadingData loads the rest of the values
+                // (skipping those already resident).
+                queueValueVBucket(shardId, vbid);
+            } else {
+                // skip loading remaining VBuckets as memory limit was
+                // reached
+                shardStopped[shardId] = true;
+            }
+        }
+    }
+}
+
+bool Warmup::loadMetadataImage(uint16_t vbid) {
+    if (!useMetadataImage[vbid].exchange(false)) {
+        return false;
+    }
+    const auto imageFile = store.getMetadataImageFile(vbid);
+    VBucketPtr vb = store.getVBucket(vbid);
+    auto* epVb = dynamic_cast<EPVBucket*>(vb.get());
+    size_t restored = 0;
+    const bool loaded =
+            epVb && epVb->restoreMetadataImage(imageFile, restored);
+    // Stale once the vbucket is next written to.
+    remove(imageFile.c_str());
+    if (!loaded) {
+        return false;
+    }
+    store.getEPEngine().getEpStats().warmedUpKeys += restored;
+    ++metadataImagesLoaded;
+    return true;
+}
+
+bool Warmup::phaseTaskDone() {
+    return ++threadtask_count == phaseTaskCount;
+}
+
+bool Warmup::reachedMemoryThreshold() const {
+    EPStats& stats = store.getEPEngine().getEpStats();
+    const double memoryUsed = stats.getTotalMemoryUsed();
+    return memoryUsed >= stats.mem_low_wat ||
+           memoryUsed > stats.getMaxDataSize() * stats.warmupMemUsedCap;
+}
+
+bool Warmup::maybeHaltValuePipeline(bool force) {
+    if (!pipelineHalted && (force || reachedMemoryThreshold())) {
+        pipelineHalted = true;
+    }
+    return pipelineHalted;
 }
 
 void Warmup::scheduleCompletion() {
@@ -1246,6 +1573,11 @@ void Warmup::step() {
 void Warmup::transition(int to, bool force) {
     int old = state.getState();
     if (old != WarmupState::Done) {
+        const hrtime_t now = gethrtime();
+        const hrtime_t entered = phaseStart.exchange(now);
+        if (entered) {
+            phaseTimes[old] += now - entered;
+        }
         state.transition(to, force);
         step();
     }
@@ -1280,6 +1612,13 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
     addStat("value_count", stats.warmedUpValues, add_stat, c);
     addStat("dups", stats.warmDups, add_stat, c);
     addStat("oom", stats.warmOOM, add_stat, c);
+    addStat("metadata_images", metadataImagesLoaded.load(), add_stat, c);
+    addStat("serving_traffic",
+            servingTraffic.load() ? "true" : "false",
+            add_stat,
+            c);
+    addStat("ops_served", stats.warmupOpsServed, add_stat, c);
+    addStat("bg_fetched", stats.warmupBgFetched, add_stat, c);
     addStat("min_memory_threshold",
             stats.warmupMemUsedCap * 100.0,
             add_stat,
@@ -1296,6 +1635,22 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
         addStat("time", w_time / 1000, add_stat, c);
     }
 
+    // Time spent in each phase entered (so far, for the current one).
+    const int current = state.getState();
+    for (int phase = 0; phase < WarmupState::Done; ++phase) {
+        hrtime_t p_time = phaseTimes[phase].load();
+        const hrtime_t entered = phaseStart.load();
+        if (phase == current && entered) {
+            p_time += gethrtime() - entered;
+        }
+        if (p_time > 0) {
+            addStat((std::string(phaseStatNames[phase]) + "_time").c_str(),
+                    p_time / 1000,
+                    add_stat,
+                    c);
+        }
+    }
+
     size_t itemCount = estimatedItemCount.load();
     if (itemCount == std::numeric_limits<size_t>::max()) {
         addStat("estimated_key_count", "unknown", add_stat, c);
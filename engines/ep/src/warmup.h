@@ -23,7 +23,10 @@
 #include "utility.h"
 
 #include <atomic>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <unordered_set>
@@ -39,6 +42,8 @@ class VBucketMap;
 
 struct vbucket_state;
 
+enum class ValueFilter;
+
 class WarmupState {
 public:
     static const int Initialize;
@@ -79,9 +84,15 @@ private:
  */
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
+    /**
+     * @param _pipelinedValues true if loading values during KeyDump (see
+     *        Warmup::pipelineValues): loading stops - halting only the value
+     *        pipeline - once memory use reaches the warmup threshold.
+     */
     LoadStorageKVPairCallback(KVBucket& ep,
                               bool _maybeEnableTraffic,
-                              int _warmupState);
+                              int _warmupState,
+                              bool _pipelinedValues = false);
 
     void callback(GetValue &val);
 
@@ -97,6 +108,7 @@ private:
     bool        hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    bool        pipelinedValues;
 };
 
 class LoadValueCallback : public Callback<CacheLookup> {
@@ -119,7 +131,7 @@ public:
     void addToTaskSet(size_t taskId);
     void removeFromTaskSet(size_t taskId);
 
-    ~Warmup() = default;
+    ~Warmup();
 
     void step();
     void start(void);
@@ -133,13 +145,19 @@ public:
 
     hrtime_t getTime(void) { return warmup; }
 
+    /**
+     * @return true if data traffic is served while warmup continues (with
+     *         warmup_serve_traffic, once the keys are loaded under value
+     *         eviction, or the vbuckets are created under full eviction)
+     */
+    bool isServingTraffic() const {
+        return servingTraffic.load();
+    }
+
     void setWarmupTime(void) {
         warmup.store(gethrtime() + gethrtime_period() - startTime);
     }
 
-    size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
-                    vbucket_state> &vbmap, Callback<GetValue> &cb);
-
     bool isComplete() const {
         return warmupComplete.load();
     }
@@ -172,14 +190,37 @@ public:
 
     bool hasOOMFailure() { return warmupOOMFailure.load(); }
 
+    /**
+     * Stop loading values during KeyDump if memory use has reached the
+     * threshold at which traffic is enabled (or if force is set); the
+     * remainder are loaded by LoadingData.
+     *
+     * @return true if the value pipeline is halted
+     */
+    bool maybeHaltValuePipeline(bool force = false);
+
     void initialize();
     void createVBuckets(uint16_t shardId);
     void estimateDatabaseItemCount(uint16_t shardId);
-    void keyDumpforShard(uint16_t shardId);
+
+    /**
+     * Load the keys of the shard's vbuckets, sharing them with the phase's
+     * other tasks for the shard.
+     *
+     * @param preferValues when values are pipelined, load the values of
+     *        vbuckets whose keys are loaded before loading more keys
+     */
+    void keyDumpforShard(uint16_t shardId, bool preferValues);
     void checkForAccessLog();
-    void loadingAccessLog(uint16_t shardId);
-    void loadKVPairsforShard(uint16_t shardId);
-    void loadDataforShard(uint16_t shardId);
+
+    /*
+     * The loading phases' tasks. While traffic is served, each returns after
+     * a batch (or vbucket) of work, yielding its reader thread to background
+     * fetches, and returns true while there's more to do.
+     */
+    bool loadingAccessLog(uint16_t shardId);
+    bool loadKVPairsforShard(uint16_t shardId);
+    bool loadDataforShard(uint16_t shardId);
     void done();
 
 private:
@@ -193,6 +234,74 @@ private:
 
     void populateShardVbStates();
 
+    /// @return true if every shard has an access log (current or old)
+    bool accessLogsAvailable() const;
+
+    /// @return true if memory use is at the level which enables traffic
+    bool reachedMemoryThreshold() const;
+
+    /// Start serving data traffic, if warmup_serve_traffic is set.
+    void maybeServeTraffic();
+
+    /**
+     * @return the number of tasks per shard for a phase which scans the
+     *         shards' vbuckets: tasksPerShard, or one if traffic is served
+     */
+    size_t getPhaseTasksPerShard() const;
+
+    /**
+     * Start a phase which scans the shards' vbuckets, with
+     * getPhaseTasksPerShard() tasks per shard.
+     */
+    void beginVBucketPhase();
+
+    /**
+     * Claim the next of the shard's vbuckets for the current phase.
+     *
+     * @return false if there are none left (or the shard's loading stopped)
+     */
+    bool nextVBucket(uint16_t shardId, uint16_t& vbid);
+
+    /**
+     * Claim the next of the shard's vbuckets whose values are to be loaded.
+     *
+     * @return false if there are none (yet)
+     */
+    bool nextValueVBucket(uint16_t shardId, uint16_t& vbid);
+
+    /// Queue a vbucket of the shard to have its values loaded.
+    void queueValueVBucket(uint16_t shardId, uint16_t vbid);
+
+    /**
+     * Load a vbucket's keys and metadata from the image written at shutdown,
+     * if it is to be used and matches the vbucket. The image is removed.
+     *
+     * @return true if the keys were loaded; false if they must be scanned
+     */
+    bool loadMetadataImage(uint16_t vbid);
+
+    /**
+     * Scan a vbucket, stopping the shard's other tasks if the scan was
+     * cancelled (memory is full or warmup is complete).
+     *
+     * @param pipelinedValues true if loading values during KeyDump; a
+     *        cancelled scan then only halts the value pipeline, and the
+     *        vbucket is requeued for LoadingData to finish.
+     */
+    void scanVBucket(uint16_t shardId,
+                     uint16_t vbid,
+                     std::shared_ptr<Callback<GetValue>> cb,
+                     std::shared_ptr<Callback<CacheLookup>> cl,
+                     ValueFilter valFilter,
+                     bool pipelinedValues = false);
+
+    /**
+     * Note that one of the current phase's tasks is done.
+     *
+     * @return true if it was the last
+     */
+    bool phaseTaskDone();
+
     void scheduleInitialize();
     void scheduleCreateVBuckets();
     void scheduleEstimateDatabaseItemCount();
@@ -222,10 +331,49 @@ private:
     std::atomic<size_t> threadtask_count;
     std::vector<std::atomic<bool>> shardKeyDumpStatus;
 
+    /// Number of tasks scanning each shard's vbuckets in a phase (enough
+    /// for the phase to use every reader thread).
+    const size_t tasksPerShard;
+    /// Number of tasks the current phase scheduled.
+    std::atomic<size_t> phaseTaskCount;
+    /// Per shard: index in shardVbIds of the current phase's next vbucket.
+    std::vector<std::atomic<size_t>> shardNextVb;
+    /// Per shard: set once a scan is cancelled, to stop the phase's other
+    /// tasks for the shard.
+    std::vector<std::atomic<bool>> shardStopped;
+
+    /// Whether the values of vbuckets are loaded as soon as their keys are
+    /// (in KeyDump, rather than waiting for LoadingData); only done when
+    /// there is no access log to load them by.
+    bool pipelineValues;
+    /// Set when memory use stops the values loaded during KeyDump; the
+    /// remainder are loaded by LoadingData.
+    std::atomic<bool> pipelineHalted;
+    /// Per shard: the vbuckets whose values are to be loaded.
+    std::mutex valueQueueMutex;
+    std::vector<std::deque<uint16_t>> shardValueQueue;
+
+    /// Time spent in each state, and when the current one was entered.
+    std::vector<std::atomic<hrtime_t>> phaseTimes;
+    std::atomic<hrtime_t> phaseStart;
+
+    /// Whether the key dump should try each vbucket's metadata image.
+    std::vector<std::atomic<bool>> useMetadataImage;
+    std::atomic<size_t> metadataImagesLoaded;
+
     /// vector of vectors of VBucket IDs (one vector per shard). Each vector
     /// contains all vBucket IDs which are present for the given shard.
     std::vector<std::vector<uint16_t>> shardVbIds;
 
+    /// Whether to serve traffic once the keys are loaded.
+    const bool serveTraffic;
+    /// Set once traffic is served.
+    std::atomic<bool> servingTraffic;
+
+    /// Per shard: its access log being loaded (a batch per task run).
+    class AccessLogLoad;
+    std::vector<std::unique_ptr<AccessLogLoad>> shardAccessLogLoads;
+
     std::atomic<hrtime_t> estimateTime;
     std::atomic<size_t> estimatedItemCount;
     bool cleanShutdown;
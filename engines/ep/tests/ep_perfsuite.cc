@@ -1306,6 +1306,66 @@ static enum test_result perf_slow_stat_latency_100vb_sets_and_dcp(
                                      BackgroundWork::Dcp), 100);
 }
 
+/*
+ * Benchmark how quickly the flusher drains the disk write queue. Each round
+ * loads a batch of items spread over several vbuckets with persistence
+ * stopped, then restarts persistence and times until ep_queue_size is zero.
+ */
+static enum test_result perf_flusher_drain(ENGINE_HANDLE* h,
+                                           ENGINE_HANDLE_V1* h1,
+                                           const char* title) {
+    const int num_vbuckets = 16;
+    const int docs_per_round = 20000;
+    const int rounds = 10;
+
+    for (int vb = 0; vb < num_vbuckets; vb++) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed set_vbucket_state for vbucket");
+    }
+    wait_for_stat_to_be(h, h1, "ep_persist_vbstate_total", num_vbuckets);
+
+    const std::string data(256, 'x');
+    std::vector<size_t> drain_rates;
+    drain_rates.reserve(rounds);
+
+    for (int round = 0; round < rounds; round++) {
+        stop_persistence(h, h1);
+        for (int i = 0; i < docs_per_round; i++) {
+            const std::string key = "drain_" + std::to_string(round) + "_" +
+                                    std::to_string(i);
+            checkeq(ENGINE_SUCCESS,
+                    store(h, h1, nullptr, OPERATION_SET, key.c_str(),
+                          data.c_str(), nullptr, 0, i % num_vbuckets),
+                    "Failed to store a value");
+        }
+
+        const hrtime_t start = gethrtime();
+        start_persistence(h, h1);
+        wait_for_stat_to_be(h, h1, "ep_queue_size", 0);
+        const hrtime_t elapsed = gethrtime() - start;
+        drain_rates.push_back((docs_per_round * 1000000000ull) / elapsed);
+    }
+
+    std::vector<std::pair<std::string, std::vector<size_t>*> > all_rates;
+    all_rates.emplace_back("Drain rate", &drain_rates);
+    std::string description(std::string("Drain rate [") + title + "] - " +
+                            std::to_string(docs_per_round) + " items over " +
+                            std::to_string(num_vbuckets) +
+                            " vbuckets (items/s)");
+    output_result(title, description, all_rates, "items/s");
+    return SUCCESS;
+}
+
+static enum test_result perf_flusher_drain_serial(ENGINE_HANDLE* h,
+                                                  ENGINE_HANDLE_V1* h1) {
+    return perf_flusher_drain(h, h1, "Serial flusher");
+}
+
+static enum test_result perf_flusher_drain_pipelined(ENGINE_HANDLE* h,
+                                                     ENGINE_HANDLE_V1* h1) {
+    return perf_flusher_drain(h, h1, "Pipelined flusher");
+}
+
 /*****************************************************************************
  * List of testcases
  *****************************************************************************/
@@ -1384,6 +1444,16 @@ BaseTestCase testsuite_testcases[] = {
                  perf_slow_stat_latency_100vb_sets_and_dcp, test_setup,
                  teardown, "backend=couchdb;ht_size=393209", prepare, cleanup),
 
+        TestCase("Flusher drain rate", perf_flusher_drain_serial,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209",
+                 prepare, cleanup),
+        TestCase("Pipelined flusher drain rate", perf_flusher_drain_pipelined,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209"
+                 ";flusher_pipeline_depth=2",
+                 prepare, cleanup),
+
         TestCase(NULL, NULL, NULL, NULL,
                  "backend=couchdb", prepare, cleanup)
 };
@@ -2435,6 +2435,12 @@ static enum test_result test_bloomfilter_conf(ENGINE_HANDLE *h,
     check(get_float_stat(h, h1, "ep_bfilter_residency_threshold") == (float)0.15,
           "Incorrect bfilter_residency_threshold.");
 
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+          "bfilter_blocked", "false"),
+          "Set bfilter_blocked should have worked.");
+    check(get_bool_stat(h, h1, "ep_bfilter_blocked") == false,
+          "Blocked bloom filters should have been disabled.");
+
     return SUCCESS;
 }
 
@@ -3112,7 +3118,9 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
                                   "ep_warmup_key_count",
                                   "ep_warmup_dups",
                                   "ep_warmup_oom",
-                                  "ep_warmup_time"};
+                                  "ep_warmup_time",
+                                  "ep_warmup_initialize_time",
+                                  "ep_warmup_create_vbuckets_time"};
     for (const auto* key : warmup_keys) {
         check(warmup_stats.find(key) != warmup_stats.end(),
               (std::string("Found no ") + key).c_str());
@@ -6238,6 +6246,9 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "vb_0:mem_size_counted",
                 "vb_0:min_depth",
                 "vb_0:reported",
+                "vb_0:resize_max_lock_hold_us",
+                "vb_0:resize_migrated",
+                "vb_0:resize_pending",
                 "vb_0:resized",
                 "vb_0:size",
                 "vb_0:state"
@@ -6251,8 +6262,11 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
             {
                 "vb_0",
                 "vb_0:bloom_filter",
+                "vb_0:bloom_filter_false_positives",
+                "vb_0:bloom_filter_fp_rate",
                 "vb_0:bloom_filter_key_count",
                 "vb_0:bloom_filter_size",
+                "vb_0:bloom_filter_true_negatives",
                 "vb_0:drift_ahead_threshold",
                 "vb_0:drift_ahead_threshold_exceeded",
                 "vb_0:drift_behind_threshold",
@@ -6323,6 +6337,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
         },
         {"checkpoint",
             {
+                "vb_0:key_index_mem_usage",
                 "vb_0:last_closed_checkpoint_id",
                 "vb_0:mem_usage",
                 "vb_0:num_checkpoint_items",
@@ -6336,6 +6351,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
         },
         {"checkpoint 0",
             {
+                "vb_0:key_index_mem_usage",
                 "vb_0:last_closed_checkpoint_id",
                 "vb_0:mem_usage",
                 "vb_0:num_checkpoint_items",
@@ -6369,13 +6385,17 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
             {
                 "ep_backend",
                 "ep_backfill_mem_threshold",
+                "ep_bfilter_blocked",
                 "ep_bfilter_enabled",
                 "ep_bfilter_fp_prob",
                 "ep_bfilter_key_count",
                 "ep_bfilter_residency_threshold",
                 "ep_bg_fetch_delay",
+                "ep_bg_fetch_max_window",
+                "ep_bg_fetch_tasks_per_shard",
                 "ep_bucket_type",
                 "ep_cache_size",
+                "ep_chk_expel_enabled",
                 "ep_chk_max_items",
                 "ep_chk_period",
                 "ep_chk_remover_stime",
@@ -6419,16 +6439,23 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_exp_pager_enabled",
                 "ep_exp_pager_initial_run_time",
                 "ep_exp_pager_stime",
+                "ep_exp_pager_use_index",
                 "ep_failpartialwarmup",
                 "ep_flushall_enabled",
+                "ep_flusher_group_commit_size",
+                "ep_flusher_pipeline_depth",
                 "ep_getl_default_timeout",
                 "ep_getl_max_timeout",
                 "ep_hlc_drift_ahead_threshold_us",
                 "ep_hlc_drift_behind_threshold_us",
+                "ep_ht_fingerprints",
                 "ep_ht_locks",
                 "ep_ht_resize_interval",
+                "ep_ht_resize_step",
+                "ep_ht_shared_locks",
                 "ep_ht_size",
                 "ep_initfile",
+                "ep_item_eviction_strategy",
                 "ep_item_num_based_new_chk",
                 "ep_keep_closed_chks",
                 "ep_max_checkpoints",
@@ -6531,20 +6558,29 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_active_hlc_drift_count",
                 "ep_backend",
                 "ep_backfill_mem_threshold",
+                "ep_bfilter_blocked",
                 "ep_bfilter_enabled",
                 "ep_bfilter_fp_prob",
                 "ep_bfilter_key_count",
                 "ep_bfilter_residency_threshold",
                 "ep_bg_fetch_delay",
+                "ep_bg_fetch_max_window",
+                "ep_bg_fetch_tasks_per_shard",
                 "ep_bg_fetched",
                 "ep_bg_meta_fetched",
                 "ep_bg_remaining_items",
                 "ep_bg_remaining_jobs",
                 "ep_blob_num",
                 "ep_blob_overhead",
+                "ep_block_cache_hits",
+                "ep_block_cache_misses",
                 "ep_bucket_priority",
                 "ep_bucket_type",
+                "ep_cache_hit_ratio",
+                "ep_cache_hits",
+                "ep_cache_misses",
                 "ep_cache_size",
+                "ep_chk_expel_enabled",
                 "ep_chk_max_items",
                 "ep_chk_period",
                 "ep_chk_persistence_remains",
@@ -6601,31 +6637,41 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_exp_pager_enabled",
                 "ep_exp_pager_initial_run_time",
                 "ep_exp_pager_stime",
+                "ep_exp_pager_use_index",
                 "ep_expired_access",
                 "ep_expired_compactor",
                 "ep_expired_pager",
+                "ep_expiry_index_memory",
                 "ep_expiry_pager_task_time",
                 "ep_failpartialwarmup",
                 "ep_flush_all",
                 "ep_flush_duration_total",
                 "ep_flushall_enabled",
+                "ep_flusher_group_commit_size",
+                "ep_flusher_pipeline_depth",
                 "ep_getl_default_timeout",
                 "ep_getl_max_timeout",
                 "ep_hlc_drift_ahead_threshold_us",
                 "ep_hlc_drift_behind_threshold_us",
+                "ep_ht_fingerprints",
                 "ep_ht_locks",
                 "ep_ht_resize_interval",
+                "ep_ht_resize_step",
+                "ep_ht_shared_locks",
                 "ep_ht_size",
                 "ep_initfile",
                 "ep_io_compaction_read_bytes",
                 "ep_io_compaction_write_bytes",
                 "ep_io_total_read_bytes",
                 "ep_io_total_write_bytes",
+                "ep_item_eviction_strategy",
                 "ep_item_num",
                 "ep_item_num_based_new_chk",
+                "ep_items_expelled_from_checkpoints",
                 "ep_items_rm_from_checkpoints",
                 "ep_keep_closed_chks",
                 "ep_kv_size",
+                "ep_lfu_admission_rejects",
                 "ep_max_bg_remaining_jobs",
                 "ep_max_checkpoints",
                 "ep_max_failover_entries",
@@ -6640,6 +6686,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_max_size",
                 "ep_max_threads",
                 "ep_max_vbuckets",
+                "ep_mem_freed_by_checkpoint_item_expel",
                 "ep_mem_high_wat",
                 "ep_mem_high_wat_percent",
                 "ep_mem_low_wat",
@@ -6821,8 +6868,10 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                          std::initializer_list<std::string>{"ep_db_data_size",
                                                             "ep_db_file_size"});
         eng_stats.insert(eng_stats.end(),
-                         std::initializer_list<std::string>{"ep_flusher_state",
-                                                            "ep_flusher_todo"});
+                         std::initializer_list<std::string>{
+                                 "ep_flusher_state",
+                                 "ep_flusher_todo",
+                                 "ep_flusher_drain_rate"});
         eng_stats.insert(eng_stats.end(),
                          {"ep_commit_num",
                           "ep_commit_time",
@@ -6844,7 +6893,20 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                           "ep_alog_resident_ratio_threshold",
                           "ep_alog_sleep_time",
                           "ep_alog_task_time",
-                          "ep_item_eviction_policy"});
+                          "ep_bfilter_persist",
+                          "ep_couchstore_block_cache_size",
+                          "ep_couchstore_db_handle_cache_size",
+                          "ep_couchstore_read_backend",
+                          "ep_couchstore_read_queue_depth",
+                          "ep_couchstore_value_compression",
+                          "ep_couchstore_value_log_gc_ratio",
+                          "ep_couchstore_value_log_threshold",
+                          "ep_ht_inline_value_size",
+                          "ep_ht_mutex_free_reads",
+                          "ep_item_eviction_policy",
+                          "ep_rocksdb_block_cache_size",
+                          "ep_warmup_metadata_image",
+                          "ep_warmup_serve_traffic"});
 
         // 'diskinfo and 'diskinfo detail' keys should be present now.
         statsKeys["diskinfo"] = {"ep_db_data_size", "ep_db_file_size"};
@@ -6876,7 +6938,20 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                              "ep_alog_resident_ratio_threshold",
                              "ep_alog_sleep_time",
                              "ep_alog_task_time",
-                             "ep_item_eviction_policy"});
+                             "ep_bfilter_persist",
+                             "ep_couchstore_block_cache_size",
+                             "ep_couchstore_db_handle_cache_size",
+                             "ep_couchstore_read_backend",
+                             "ep_couchstore_read_queue_depth",
+                             "ep_couchstore_value_compression",
+                             "ep_couchstore_value_log_gc_ratio",
+                             "ep_couchstore_value_log_threshold",
+                             "ep_ht_inline_value_size",
+                             "ep_ht_mutex_free_reads",
+                             "ep_item_eviction_policy",
+                             "ep_rocksdb_block_cache_size",
+                             "ep_warmup_metadata_image",
+                             "ep_warmup_serve_traffic"});
     }
 
     if (isEphemeralBucket(h, h1)) {
@@ -7010,6 +7085,7 @@ static enum test_result test_mb19687_variable(ENGINE_HANDLE* h,
                 "bytes",
                 "ep_blob_num",
                 "ep_blob_overhead",
+                "ep_expiry_index_memory",
                 "ep_item_num",
                 "ep_kv_size",
                 "ep_max_size",
@@ -7019,6 +7095,9 @@ static enum test_result test_mb19687_variable(ENGINE_HANDLE* h,
                 "ep_mem_low_wat_percent",
                 "ep_oom_errors",
                 "ep_overhead",
+                "ep_storedval_inline_num",
+                "ep_storedval_inline_saved",
+                "ep_storedval_inline_size",
                 "ep_storedval_num",
                 "ep_storedval_overhead",
                 "ep_storedval_size",
@@ -7052,6 +7131,10 @@ static enum test_result test_mb19687_variable(ENGINE_HANDLE* h,
                                         "ep_warmup_value_count",
                                         "ep_warmup_dups",
                                         "ep_warmup_oom",
+                                        "ep_warmup_metadata_images",
+                                        "ep_warmup_serving_traffic",
+                                        "ep_warmup_ops_served",
+                                        "ep_warmup_bg_fetched",
                                         "ep_warmup_min_memory_threshold",
                                         "ep_warmup_min_item_threshold",
                                         "ep_warmup_estimated_key_count",
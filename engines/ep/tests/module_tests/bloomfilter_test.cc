@@ -89,3 +89,78 @@ INSTANTIATE_TEST_CASE_P(
         BloomFilterDocKeyTest,
         ::testing::Combine(::testing::ValuesIn(allDocNamespaces),
                            ::testing::ValuesIn(allDocNamespaces)), );
+
+/// Tests run against both the standard and the blocked layout.
+class BloomFilterLayoutTest : public ::testing::TestWithParam<bool> {
+protected:
+    static StoredDocKey makeKey(size_t i) {
+        return makeStoredDocKey("key_" + std::to_string(i));
+    }
+
+    /// Add keys [0, count) to the filter.
+    void fill(BloomFilter& filter, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            filter.addKey(makeKey(i));
+        }
+    }
+
+    /// The fraction of count keys (not added) the filter reports may exist.
+    double falsePositiveRate(BloomFilter& filter, size_t count) {
+        size_t positives = 0;
+        for (size_t i = 0; i < count; i++) {
+            positives += filter.maybeKeyExists(makeKey(keys + i));
+        }
+        return double(positives) / count;
+    }
+
+    const size_t keys = 10000;
+    const double fpProb = 0.01;
+};
+
+TEST_P(BloomFilterLayoutTest, NoFalseNegatives) {
+    BloomFilter filter(keys, fpProb, BFILTER_ENABLED, GetParam());
+    EXPECT_EQ(GetParam(), filter.isBlocked());
+    fill(filter, keys);
+    for (size_t i = 0; i < keys; i++) {
+        EXPECT_TRUE(filter.maybeKeyExists(makeKey(i))) << i;
+    }
+}
+
+TEST_P(BloomFilterLayoutTest, FalsePositiveRate) {
+    BloomFilter filter(keys, fpProb, BFILTER_ENABLED, GetParam());
+    fill(filter, keys);
+    // Both layouts meet the configured rate (within sampling error).
+    EXPECT_LT(falsePositiveRate(filter, 100000), 1.15 * fpProb);
+}
+
+TEST_P(BloomFilterLayoutTest, Serialize) {
+    BloomFilter filter(keys, fpProb, BFILTER_ENABLED, GetParam());
+    fill(filter, keys / 2);
+
+    auto copy = BloomFilter::deserialize(filter.serialize());
+    ASSERT_TRUE(copy);
+    EXPECT_EQ(BFILTER_ENABLED, copy->getStatus());
+    EXPECT_EQ(GetParam(), copy->isBlocked());
+    EXPECT_EQ(filter.getFilterSize(), copy->getFilterSize());
+    EXPECT_EQ(filter.getNumOfKeysInFilter(), copy->getNumOfKeysInFilter());
+    for (size_t i = 0; i < keys; i++) {
+        EXPECT_EQ(filter.maybeKeyExists(makeKey(i)),
+                  copy->maybeKeyExists(makeKey(i)));
+    }
+
+    // The header is in network byte order, starting with whether blocked.
+    std::string data = filter.serialize();
+    EXPECT_EQ(std::string(7, '\0'), data.substr(0, 7));
+    EXPECT_EQ(char(GetParam()), data[7]);
+
+    data.pop_back();
+    EXPECT_FALSE(BloomFilter::deserialize(data));
+    EXPECT_FALSE(BloomFilter::deserialize(""));
+}
+
+INSTANTIATE_TEST_CASE_P(Layout,
+                        BloomFilterLayoutTest,
+                        ::testing::Bool(),
+                        [](const ::testing::TestParamInfo<bool>& info) {
+                            return info.param ? "Blocked" : "Standard";
+                        });
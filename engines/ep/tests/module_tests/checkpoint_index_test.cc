@@ -0,0 +1,105 @@
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "checkpoint_index.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <gtest/gtest.h>
+
+/**
+ * Test fixture for CheckpointIndex tests; index entries must refer to items
+ * in a queue, so provides one.
+ */
+class CheckpointIndexTest : public ::testing::Test {
+protected:
+    /// Queue an item for the given key and return its index entry.
+    index_entry queueItem(const std::string& key, int64_t seqno) {
+        queue.push_back(queued_item(new Item(makeStoredDocKey(key),
+                                             0,
+                                             queue_op::set,
+                                             /*revSeq*/ 0,
+                                             seqno)));
+        return {--queue.end(), seqno};
+    }
+
+    CheckpointQueue queue;
+    CheckpointIndex index;
+};
+
+TEST_F(CheckpointIndexTest, SetAndFind) {
+    EXPECT_EQ(nullptr, index.find(makeStoredDocKey("key")));
+
+    EXPECT_TRUE(index.set(makeStoredDocKey("key"), queueItem("key", 1)));
+    EXPECT_EQ(1, index.size());
+    auto* entry = index.find(makeStoredDocKey("key"));
+    ASSERT_NE(nullptr, entry);
+    EXPECT_EQ(1, entry->mutation_id);
+    EXPECT_EQ(makeStoredDocKey("key"), (*entry->position)->getKey());
+
+    // Replace with a new item for the same key.
+    EXPECT_FALSE(index.set(makeStoredDocKey("key"), queueItem("key", 2)));
+    EXPECT_EQ(1, index.size());
+    EXPECT_EQ(2, index.find(makeStoredDocKey("key"))->mutation_id);
+
+    // Keys in different namespaces are distinct.
+    EXPECT_EQ(nullptr,
+              index.find(StoredDocKey("key", DocNamespace::System)));
+}
+
+TEST_F(CheckpointIndexTest, Grows) {
+    const size_t initialMemory = index.memorySize();
+    const int numKeys = 1000;
+    for (int ii = 0; ii < numKeys; ++ii) {
+        const auto key = "key_" + std::to_string(ii);
+        EXPECT_TRUE(index.set(makeStoredDocKey(key), queueItem(key, ii)));
+    }
+    EXPECT_EQ(numKeys, index.size());
+    EXPECT_LT(initialMemory, index.memorySize());
+    for (int ii = 0; ii < numKeys; ++ii) {
+        auto* entry = index.find(makeStoredDocKey("key_" + std::to_string(ii)));
+        ASSERT_NE(nullptr, entry) << "key_" << ii;
+        EXPECT_EQ(ii, entry->mutation_id);
+    }
+
+    index.clear();
+    EXPECT_EQ(0, index.size());
+    EXPECT_EQ(initialMemory, index.memorySize());
+    EXPECT_EQ(nullptr, index.find(makeStoredDocKey("key_0")));
+}
+
+// Erasing an entry must not hide any other entries which collided with it.
+TEST_F(CheckpointIndexTest, Erase) {
+    const int numKeys = 100;
+    for (int ii = 0; ii < numKeys; ++ii) {
+        const auto key = "key_" + std::to_string(ii);
+        index.set(makeStoredDocKey(key), queueItem(key, ii));
+    }
+    for (int ii = 0; ii < numKeys; ii += 2) {
+        EXPECT_TRUE(index.erase(makeStoredDocKey("key_" + std::to_string(ii))));
+    }
+    EXPECT_FALSE(index.erase(makeStoredDocKey("key_0")));
+    EXPECT_EQ(numKeys / 2, index.size());
+
+    for (int ii = 0; ii < numKeys; ++ii) {
+        auto* entry = index.find(makeStoredDocKey("key_" + std::to_string(ii)));
+        if (ii % 2 == 0) {
+            EXPECT_EQ(nullptr, entry) << "key_" << ii;
+        } else {
+            ASSERT_NE(nullptr, entry) << "key_" << ii;
+            EXPECT_EQ(ii, entry->mutation_id);
+        }
+    }
+}
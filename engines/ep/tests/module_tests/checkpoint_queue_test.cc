@@ -0,0 +1,197 @@
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "checkpoint_queue.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+static queued_item makeQueuedItem(int64_t seqno) {
+    queued_item qi(new Item(makeStoredDocKey("key_" + std::to_string(seqno)),
+                            0,
+                            queue_op::set,
+                            /*revSeq*/ 0,
+                            seqno));
+    return qi;
+}
+
+static std::vector<int64_t> seqnosOf(const CheckpointQueue& queue) {
+    std::vector<int64_t> seqnos;
+    for (const auto& qi : queue) {
+        seqnos.push_back(qi->getBySeqno());
+    }
+    return seqnos;
+}
+
+TEST(CheckpointQueueTest, Empty) {
+    CheckpointQueue queue;
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(0, queue.size());
+    EXPECT_EQ(queue.begin(), queue.end());
+    EXPECT_EQ(queue.rbegin(), queue.rend());
+}
+
+TEST(CheckpointQueueTest, PushBackSpansChunks) {
+    CheckpointQueue queue;
+    const size_t numItems = 3 * CheckpointQueue::ChunkSize + 1;
+    std::vector<int64_t> expected;
+    for (size_t ii = 1; ii <= numItems; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+        expected.push_back(ii);
+    }
+    EXPECT_EQ(numItems, queue.size());
+    EXPECT_EQ(4, queue.getNumChunks());
+    EXPECT_EQ(expected, seqnosOf(queue));
+    EXPECT_EQ(numItems, queue.back()->getBySeqno());
+
+    // Reverse iteration.
+    std::vector<int64_t> reversed;
+    for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+        reversed.push_back((*it)->getBySeqno());
+    }
+    EXPECT_EQ(std::vector<int64_t>(expected.rbegin(), expected.rend()),
+              reversed);
+}
+
+TEST(CheckpointQueueTest, EraseSkipsTombstones) {
+    CheckpointQueue queue;
+    std::vector<CheckpointQueue::iterator> positions;
+    for (int64_t ii = 1; ii <= 5; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+        positions.push_back(--queue.end());
+    }
+    queue.erase(positions[1]);
+    queue.erase(positions[3]);
+    EXPECT_EQ(3, queue.size());
+    EXPECT_EQ(std::vector<int64_t>({1, 3, 5}), seqnosOf(queue));
+
+    // Iterators to other items remain valid, and step over the tombstones.
+    auto it = positions[2];
+    EXPECT_EQ(3, (*it)->getBySeqno());
+    EXPECT_EQ(5, (*++it)->getBySeqno());
+    EXPECT_EQ(3, (*--it)->getBySeqno());
+    EXPECT_EQ(1, (*--it)->getBySeqno());
+
+    queue.pop_back();
+    EXPECT_EQ(std::vector<int64_t>({1, 3}), seqnosOf(queue));
+    EXPECT_EQ(3, queue.back()->getBySeqno());
+}
+
+// Decrementing past the first item (or end() of an empty queue) must throw,
+// not follow the first chunk's null prev pointer.
+TEST(CheckpointQueueTest, DecrementBeginThrows) {
+    CheckpointQueue queue;
+    EXPECT_THROW(--queue.end(), std::out_of_range);
+
+    std::vector<CheckpointQueue::iterator> positions;
+    for (int64_t ii = 1; ii <= int64_t(CheckpointQueue::ChunkSize) + 2; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+        positions.push_back(--queue.end());
+    }
+    auto it = queue.begin();
+    EXPECT_THROW(--it, std::out_of_range);
+    EXPECT_EQ(queue.begin(), it);
+
+    // With the leading items erased, the first item is in a later slot (and
+    // chunk); there is still nothing before it.
+    for (size_t ii = 0; ii <= CheckpointQueue::ChunkSize; ++ii) {
+        queue.erase(positions[ii]);
+    }
+    it = queue.begin();
+    EXPECT_EQ(int64_t(CheckpointQueue::ChunkSize) + 2, (*it)->getBySeqno());
+    EXPECT_THROW(--it, std::out_of_range);
+}
+
+// An iterator at the last item should reach items appended after it was
+// obtained.
+TEST(CheckpointQueueTest, IteratorSeesAppendedItems) {
+    CheckpointQueue queue;
+    queue.push_back(makeQueuedItem(1));
+    auto it = queue.begin();
+    for (int64_t ii = 2; ii <= int64_t(CheckpointQueue::ChunkSize) + 1; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+        ++it;
+        ASSERT_NE(queue.end(), it);
+        EXPECT_EQ(ii, (*it)->getBySeqno());
+    }
+    EXPECT_EQ(queue.end(), ++it);
+}
+
+// Chunks whose items have all been erased are freed.
+TEST(CheckpointQueueTest, EmptyChunksFreed) {
+    CheckpointQueue queue;
+    queue.push_back(makeQueuedItem(1));
+    auto last = queue.begin();
+    const int64_t numItems = 10 * CheckpointQueue::ChunkSize;
+    // Repeatedly replace the last item (as de-duplication does).
+    for (int64_t ii = 2; ii < numItems; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+        if (ii > 2) {
+            queue.erase(last);
+        }
+        last = --queue.end();
+    }
+    EXPECT_EQ(2, queue.size());
+    EXPECT_LE(queue.getNumChunks(), 2);
+    EXPECT_EQ(std::vector<int64_t>({1, numItems - 1}), seqnosOf(queue));
+}
+
+TEST(CheckpointQueueTest, Clear) {
+    CheckpointQueue queue;
+    for (int64_t ii = 1; ii <= 100; ++ii) {
+        queue.push_back(makeQueuedItem(ii));
+    }
+    queue.clear();
+    EXPECT_TRUE(queue.empty());
+    EXPECT_EQ(1, queue.getNumChunks());
+    EXPECT_EQ(queue.begin(), queue.end());
+
+    queue.push_back(makeQueuedItem(1));
+    EXPECT_EQ(std::vector<int64_t>({1}), seqnosOf(queue));
+}
+
+// Prepended items come before the existing ones, which iterators still
+// reach.
+TEST(CheckpointQueueTest, Prepend) {
+    CheckpointQueue queue;
+    const int64_t numPrepended = CheckpointQueue::ChunkSize + 1;
+    queue.push_back(makeQueuedItem(numPrepended + 1));
+    queue.push_back(makeQueuedItem(numPrepended + 2));
+    auto it = queue.begin();
+
+    std::vector<queued_item> items;
+    std::vector<int64_t> expected;
+    for (int64_t ii = 1; ii <= numPrepended; ++ii) {
+        items.push_back(makeQueuedItem(ii));
+        expected.push_back(ii);
+    }
+    queue.prepend(items);
+    expected.push_back(numPrepended + 1);
+    expected.push_back(numPrepended + 2);
+
+    EXPECT_EQ(expected, seqnosOf(queue));
+    EXPECT_EQ(size_t(numPrepended + 2), queue.size());
+    EXPECT_EQ(3, queue.getNumChunks());
+    EXPECT_EQ(numPrepended + 1, (*it)->getBySeqno());
+    EXPECT_EQ(numPrepended, (*std::prev(it))->getBySeqno());
+
+    queue.erase(it++);
+    queue.erase(it);
+    expected.resize(numPrepended);
+    EXPECT_EQ(expected, seqnosOf(queue));
+}
@@ -997,6 +997,92 @@ TYPED_TEST(CheckpointTest, MB25056_backfill_not_required) {
     EXPECT_FALSE(result.second) << "Backfill is unexpectedly required.";
 }
 
+// Test that items which every cursor has processed are expelled from the open
+// checkpoint, and the remaining items are still returned to the cursors.
+TYPED_TEST(CheckpointTest, ExpelUnreferencedItems) {
+    for (unsigned int ii = 0; ii < 10; ii++) {
+        ASSERT_TRUE(this->queueNewItem("key" + std::to_string(ii)));
+    }
+
+    std::string dcp_cursor(DCP_CURSOR_PREFIX + std::to_string(1));
+    this->manager->registerCursorBySeqno(
+            dcp_cursor.c_str(), 0, MustSendCheckpointEnd::NO);
+
+    // Persistence cursor processes everything; DCP cursor stops at key3
+    // (having read checkpoint_start, key0, key1, key2, key3).
+    std::vector<queued_item> items;
+    this->manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    ASSERT_EQ(11, items.size());
+    bool isLastMutationItem;
+    for (int ii = 0; ii < 5; ++ii) {
+        this->manager->nextItem(dcp_cursor, isLastMutationItem);
+    }
+
+    const size_t numItems = this->manager->getNumItems();
+    const size_t memUsage = this->manager->getMemoryUsage();
+    ASSERT_EQ(6, this->manager->getNumItemsForCursor(dcp_cursor));
+
+    // key0 to key2 can be expelled; key3 is where the DCP cursor is.
+    auto result = this->manager->expelUnreferencedCheckpointItems();
+    EXPECT_EQ(3, result.count);
+    EXPECT_LT(0, result.memory);
+    EXPECT_EQ(3, this->global_stats.itemsExpelledFromCheckpoints);
+    EXPECT_EQ(result.memory,
+              this->global_stats.memFreedByCheckpointItemExpel);
+
+    // The checkpoint itself is still open, with fewer items.
+    EXPECT_EQ(1, this->manager->getNumCheckpoints());
+    EXPECT_EQ(7, this->manager->getNumOpenChkItems());
+    EXPECT_EQ(numItems - 3, this->manager->getNumItems());
+    EXPECT_GT(memUsage, this->manager->getMemoryUsage());
+
+    // Nothing more can be expelled until the DCP cursor moves.
+    EXPECT_EQ(0, this->manager->expelUnreferencedCheckpointItems().count);
+
+    // The DCP cursor still gets all the items it hasn't processed.
+    EXPECT_EQ(6, this->manager->getNumItemsForCursor(dcp_cursor));
+    items.clear();
+    this->manager->getAllItemsForCursor(dcp_cursor, items);
+    ASSERT_EQ(6, items.size());
+    EXPECT_EQ(makeStoredDocKey("key4"), items.front()->getKey());
+    EXPECT_EQ(makeStoredDocKey("key9"), items.back()->getKey());
+
+    // An expelled key is queued afresh.
+    EXPECT_TRUE(this->queueNewItem("key0"));
+    EXPECT_EQ(1, this->manager->getNumItemsForCursor(dcp_cursor));
+    EXPECT_EQ(1, this->manager->getNumItemsForCursor(
+                         CheckpointManager::pCursorName));
+}
+
+// Test that a cursor registered at a seqno which has been expelled is told
+// to backfill.
+TYPED_TEST(CheckpointTest, RegisterCursorAfterExpel) {
+    for (unsigned int ii = 0; ii < 10; ii++) {
+        ASSERT_TRUE(this->queueNewItem("key" + std::to_string(ii)));
+    }
+
+    // Move the persistence cursor to key4 (seqno 1005): expels seqnos 1001
+    // to 1004.
+    bool isLastMutationItem;
+    for (int ii = 0; ii < 6; ++ii) {
+        this->manager->nextItem(CheckpointManager::pCursorName,
+                                isLastMutationItem);
+    }
+    ASSERT_EQ(4, this->manager->expelUnreferencedCheckpointItems().count);
+
+    std::string dcp_cursor(DCP_CURSOR_PREFIX + std::to_string(1));
+    CursorRegResult result = this->manager->registerCursorBySeqno(
+            dcp_cursor.c_str(), 1002, MustSendCheckpointEnd::NO);
+    EXPECT_EQ(1005, result.first);
+    EXPECT_TRUE(result.second) << "Expelled items need backfilling";
+
+    // A cursor which has already got the expelled items doesn't backfill.
+    result = this->manager->registerCursorBySeqno(
+            dcp_cursor.c_str(), 1004, MustSendCheckpointEnd::NO);
+    EXPECT_EQ(1005, result.first);
+    EXPECT_FALSE(result.second);
+}
+
 //
 // It's critical that the HLC (CAS) is ordered with seqno generation
 // otherwise XDCR may drop a newer bySeqno mutation because the CAS is not
@@ -0,0 +1,339 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "src/couch-kvstore/couch-async-io.h"
+#include "src/couch-kvstore/couch-block-cache.h"
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Tests of AsyncReader backends and the FileOps using them, reading a file
+ * where every 4 byte word holds its own offset.
+ */
+class AsyncReaderTest : public ::testing::TestWithParam<std::string> {
+protected:
+    void SetUp() override {
+        path = "couch-async-io_test." + std::to_string(getpid());
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        ASSERT_NE(-1, fd);
+        std::vector<uint32_t> words(fileSize / sizeof(uint32_t));
+        for (size_t ii = 0; ii < words.size(); ++ii) {
+            words[ii] = uint32_t(ii * sizeof(uint32_t));
+        }
+        ASSERT_EQ(ssize_t(fileSize), ::pwrite(fd, words.data(), fileSize, 0));
+        reader = AsyncReader::create(GetParam(), queueDepth);
+    }
+
+    void TearDown() override {
+        reader.reset();
+        ::close(fd);
+        std::remove(path.c_str());
+    }
+
+    /// Read the 4KiB blocks at the given offsets as one batch and check them.
+    void readBlocks(const std::vector<cs_off_t>& offsets) {
+        std::vector<std::vector<uint32_t>> bufs(offsets.size());
+        std::vector<AsyncReader::Request> reqs;
+        for (size_t ii = 0; ii < offsets.size(); ++ii) {
+            bufs[ii].resize(blockSize / sizeof(uint32_t));
+            reqs.push_back({fd, bufs[ii].data(), blockSize, offsets[ii], 0});
+        }
+        reader->read(reqs.data(), reqs.size());
+        for (size_t ii = 0; ii < offsets.size(); ++ii) {
+            ASSERT_EQ(ssize_t(blockSize), reqs[ii].result);
+            EXPECT_EQ(uint32_t(offsets[ii]), bufs[ii].front());
+            EXPECT_EQ(uint32_t(offsets[ii] + blockSize - sizeof(uint32_t)),
+                      bufs[ii].back());
+        }
+    }
+
+    static const size_t fileSize = 4 * 1024 * 1024;
+    static const size_t blockSize = 4096;
+    static const size_t queueDepth = 8;
+
+    std::string path;
+    int fd = -1;
+    std::unique_ptr<AsyncReader> reader;
+};
+
+// A batch larger than the queue depth completes, in any order.
+TEST_P(AsyncReaderTest, Batch) {
+    std::vector<cs_off_t> offsets;
+    for (size_t ii = 0; ii < 100; ++ii) {
+        offsets.push_back(((ii * 7919) % (fileSize / blockSize)) * blockSize);
+    }
+    readBlocks(offsets);
+}
+
+// Batches from concurrent callers all complete.
+TEST_P(AsyncReaderTest, ConcurrentBatches) {
+    std::vector<std::thread> threads;
+    for (size_t tt = 0; tt < 4; ++tt) {
+        threads.emplace_back([this, tt] {
+            for (size_t round = 0; round < 20; ++round) {
+                std::vector<cs_off_t> offsets;
+                for (size_t ii = 0; ii < 1 + round % 16; ++ii) {
+                    offsets.push_back(
+                            ((tt * 1000 + round * 16 + ii) %
+                             (fileSize / blockSize)) *
+                            blockSize);
+                }
+                readBlocks(offsets);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Short reads and errors are reported per request.
+TEST_P(AsyncReaderTest, ShortReadAndError) {
+    char buf[blockSize];
+    std::vector<AsyncReader::Request> reqs{
+            {fd, buf, blockSize, cs_off_t(fileSize - 100), 0},
+            {fd, buf, blockSize, cs_off_t(fileSize), 0},
+            {-1, buf, blockSize, 0, 0}};
+    reader->read(reqs.data(), reqs.size());
+    EXPECT_EQ(100, reqs[0].result);
+    EXPECT_EQ(0, reqs[1].result);
+    EXPECT_EQ(-EBADF, reqs[2].result);
+}
+
+// couchstore's view of a file through AsyncFileOps.
+TEST_P(AsyncReaderTest, FileOps) {
+    AsyncFileOps ops(*reader);
+    couchstore_error_info_t errinfo;
+    couch_file_handle h = ops.constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, ops.open(&errinfo, &h, path.c_str(), O_RDWR));
+
+    EXPECT_EQ(cs_off_t(fileSize), ops.goto_eof(&errinfo, h));
+    const uint32_t word = 0xdeadbeef;
+    EXPECT_EQ(ssize_t(sizeof(word)),
+              ops.pwrite(&errinfo, h, &word, sizeof(word), fileSize));
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.sync(&errinfo, h));
+
+    uint32_t words[2];
+    EXPECT_EQ(ssize_t(sizeof(words)),
+              ops.pread(&errinfo, h, words, sizeof(words), fileSize - 4));
+    EXPECT_EQ(uint32_t(fileSize - 4), words[0]);
+    EXPECT_EQ(word, words[1]);
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    ops.destructor(h);
+
+    h = ops.constructor(&errinfo);
+    EXPECT_EQ(COUCHSTORE_ERROR_NO_SUCH_FILE,
+              ops.open(&errinfo, &h, "no-such-file", O_RDONLY));
+    EXPECT_EQ(ENOENT, errinfo.error);
+    ops.destructor(h);
+}
+
+// Reading ahead keeps what it read in its stage, which serves a pass
+// through the file (reads straddling where the window moved included), and
+// doesn't fail whatever it's asked to read.
+TEST_P(AsyncReaderTest, ReadAhead) {
+    FilePrefetcher prefetcher(*reader, path);
+    prefetcher.readAhead({0, 1000});
+
+    // Overwrite the file, so reads served from it can be told apart; from
+    // here on only what was read ahead holds the original contents.
+    std::vector<char> zeros(fileSize);
+    ASSERT_EQ(ssize_t(fileSize), ::pwrite(fd, zeros.data(), fileSize, 0));
+
+    AsyncFileOps asyncOps(*reader);
+    ReadStageOps ops(asyncOps);
+    couchstore_error_info_t errinfo;
+    couch_file_handle h = ops.constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, ops.open(&errinfo, &h, path.c_str(), O_RDWR));
+    uint32_t words[2];
+    // The first window, which is less than the file.
+    const size_t window = queueDepth * FilePrefetcher::chunkSize;
+    {
+        ReadStage::Scope scope(prefetcher.getAheadStage());
+        for (size_t offset = 0; offset + 8 <= window; offset += 1000) {
+            prefetcher.readAhead({offset, 8});
+            ASSERT_EQ(ssize_t(sizeof(words)),
+                      ops.pread(&errinfo, h, words, sizeof(words), offset));
+            EXPECT_EQ(uint32_t(offset), words[0]);
+        }
+    }
+    // Outside the scope reads go to the file.
+    EXPECT_EQ(ssize_t(sizeof(words)),
+              ops.pread(&errinfo, h, words, sizeof(words), 0));
+    EXPECT_EQ(0u, words[0]);
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    ops.destructor(h);
+
+    for (size_t offset = 0; offset < fileSize + 4096; offset += 1000) {
+        prefetcher.readAhead({offset, 1000});
+    }
+    FilePrefetcher missing(*reader, "no-such-file");
+    missing.readAhead({0, 4096});
+}
+
+// Extents fetched into a ReadStage serve the reads they cover through
+// ReadStageOps, on the thread the stage is active on; other reads go to the
+// file.
+TEST_P(AsyncReaderTest, Fetch) {
+    ReadStage stage(path);
+    FilePrefetcher prefetcher(*reader, path);
+    // The first two are merged into one read of [4096, 16384).
+    const auto fetched =
+            prefetcher.fetch({{12288, 4096},
+                              {4096, 4096},
+                              {64 * 1024, 300 * 1024},
+                              {cs_off_t(fileSize - 100), 4096}},
+                             4096,
+                             stage);
+    EXPECT_EQ(3u, fetched.reads);
+    EXPECT_EQ(size_t(12288 + 300 * 1024 + 100), fetched.bytes);
+
+    // Overwrite the file, so reads served from it can be told apart.
+    std::vector<char> zeros(fileSize);
+    ASSERT_EQ(ssize_t(fileSize), ::pwrite(fd, zeros.data(), fileSize, 0));
+
+    AsyncFileOps asyncOps(*reader);
+    ReadStageOps ops(asyncOps);
+    couchstore_error_info_t errinfo;
+    couch_file_handle h = ops.constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, ops.open(&errinfo, &h, path.c_str(), O_RDWR));
+    uint32_t words[2];
+    auto readWords = [&](cs_off_t offset) {
+        EXPECT_EQ(ssize_t(sizeof(words)),
+                  ops.pread(&errinfo, h, words, sizeof(words), offset));
+    };
+
+    readWords(4096);
+    EXPECT_EQ(0u, words[0]);
+    {
+        ReadStage::Scope scope(stage);
+        readWords(4096);
+        EXPECT_EQ(4096u, words[0]);
+        readWords(12288 + 4096 - 8);
+        EXPECT_EQ(uint32_t(12288 + 4096 - 8), words[0]);
+        readWords(64 * 1024 + 300 * 1024 - 8);
+        EXPECT_EQ(uint32_t(64 * 1024 + 300 * 1024 - 8), words[0]);
+        EXPECT_EQ(uint32_t(64 * 1024 + 300 * 1024 - 4), words[1]);
+        // The gap merged between two extents isn't theirs.
+        readWords(8192);
+        EXPECT_EQ(0u, words[0]);
+        // Straddling the end of a region, or outside them all.
+        readWords(8192 - 4);
+        EXPECT_EQ(0u, words[0]);
+        readWords(0);
+        EXPECT_EQ(0u, words[0]);
+        // The last region reached the end of the file, so is served short.
+        EXPECT_EQ(4, ops.pread(&errinfo, h, words, sizeof(words), fileSize - 4));
+        EXPECT_EQ(uint32_t(fileSize - 4), words[0]);
+        std::thread([&] {
+            readWords(4096);
+            EXPECT_EQ(0u, words[0]);
+        }).join();
+    }
+    readWords(4096);
+    EXPECT_EQ(0u, words[0]);
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    ops.destructor(h);
+
+    // Nothing is read (or staged) from a file that can't be opened.
+    FilePrefetcher missing(*reader, "no-such-file");
+    EXPECT_EQ(0u, missing.fetch({{0, 4096}}, 0, stage).bytes);
+}
+
+// With a block cache as well, the stage sits above it: reads the stage
+// covers are served without reaching the cache (which would widen them to
+// blocks the stage only partly holds), others go through the cache.
+TEST_P(AsyncReaderTest, StageAboveBlockCache) {
+    ReadStage stage(path);
+    // Not block aligned.
+    FilePrefetcher(*reader, path).fetch({{5000, 3000}}, 0, stage);
+
+    std::vector<char> zeros(fileSize);
+    ASSERT_EQ(ssize_t(fileSize), ::pwrite(fd, zeros.data(), fileSize, 0));
+
+    CouchBlockCache cache(1024 * 1024);
+    Couchbase::RelaxedAtomic<size_t> hits(0);
+    Couchbase::RelaxedAtomic<size_t> misses(0);
+    AsyncFileOps asyncOps(*reader);
+    BlockCacheOps cacheOps(cache, asyncOps, true /*populate*/, hits, misses);
+    ReadStageOps ops(cacheOps);
+    couchstore_error_info_t errinfo;
+    couch_file_handle h = ops.constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS, ops.open(&errinfo, &h, path.c_str(), O_RDWR));
+    uint32_t words[2];
+    auto readWords = [&](cs_off_t offset) {
+        EXPECT_EQ(ssize_t(sizeof(words)),
+                  ops.pread(&errinfo, h, words, sizeof(words), offset));
+    };
+    {
+        ReadStage::Scope scope(stage);
+        readWords(5000);
+        EXPECT_EQ(5000u, words[0]);
+        readWords(8000 - 8);
+        EXPECT_EQ(uint32_t(8000 - 8), words[0]);
+        EXPECT_EQ(0u, hits + misses);
+
+        readWords(12000);
+        EXPECT_EQ(0u, words[0]);
+        EXPECT_EQ(1u, misses);
+    }
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    ops.destructor(h);
+}
+
+// Extents are sorted, and merged when overlapping or close.
+TEST(FilePrefetcherTest, Coalesce) {
+    using Extent = FilePrefetcher::Extent;
+    EXPECT_EQ(std::vector<Extent>(), FilePrefetcher::coalesce({}, 4096));
+    EXPECT_EQ((std::vector<Extent>{{0, 300}, {10000, 100}, {20000, 5000}}),
+              FilePrefetcher::coalesce({{20000, 100},
+                                        {10000, 100},
+                                        {0, 100},
+                                        {24000, 1000},
+                                        {200, 100},
+                                        {20050, 10}},
+                                       4096));
+    EXPECT_EQ((std::vector<Extent>{{0, 100}, {101, 100}}),
+              FilePrefetcher::coalesce({{101, 100}, {0, 100}}, 0));
+    EXPECT_EQ((std::vector<Extent>{{0, 201}}),
+              FilePrefetcher::coalesce({{100, 101}, {0, 100}}, 0));
+}
+
+TEST(AsyncReaderCreateTest, Invalid) {
+    EXPECT_THROW(AsyncReader::create("bogus", 8), std::invalid_argument);
+    EXPECT_THROW(AsyncReader::create("pread", 0), std::invalid_argument);
+    EXPECT_STREQ("pread", AsyncReader::create("pread", 8)->getName());
+}
+
+// "auto" is io_uring where the kernel supports it, else pread.
+INSTANTIATE_TEST_CASE_P(Backends,
+                        AsyncReaderTest,
+                        ::testing::Values("pread", "auto"),
+                        [](const ::testing::TestParamInfo<std::string>& info) {
+                            return info.param;
+                        });
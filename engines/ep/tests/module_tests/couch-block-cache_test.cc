@@ -0,0 +1,266 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "src/couch-kvstore/couch-block-cache.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static const size_t blockSize = CouchBlockCache::blockSize;
+
+class CouchBlockCacheTest : public ::testing::Test {
+protected:
+    /// Read a block as BlockCacheOps would: from the cache, else "disk".
+    bool read(uint64_t block) {
+        std::vector<char> buf(blockSize);
+        if (cache.lookup(file, block, buf.data())) {
+            EXPECT_EQ(char(block), buf.front());
+            return true;
+        }
+        std::fill(buf.begin(), buf.end(), char(block));
+        cache.insert(file, block, buf.data());
+        return false;
+    }
+
+    // 16 blocks per shard.
+    CouchBlockCache cache{256 * blockSize};
+    CouchBlockCache::FileId file = cache.identify(1, 1, true);
+};
+
+TEST_F(CouchBlockCacheTest, LookupInsert) {
+    EXPECT_FALSE(read(7));
+    EXPECT_TRUE(read(7));
+    EXPECT_EQ(blockSize, cache.getSize());
+
+    // Another file, or a new file with the same inode, doesn't see it.
+    char buf[blockSize];
+    EXPECT_FALSE(cache.lookup(cache.identify(1, 2, false), 7, buf));
+    EXPECT_TRUE(cache.lookup(cache.identify(1, 1, false), 7, buf));
+    EXPECT_FALSE(cache.lookup(cache.identify(1, 1, true), 7, buf));
+}
+
+TEST_F(CouchBlockCacheTest, Forget) {
+    for (uint64_t block = 0; block < 8; ++block) {
+        read(block);
+    }
+    // A later generation of the inode, and another file.
+    char buf[blockSize] = {};
+    cache.insert(cache.identify(1, 1, true), 0, buf);
+    const auto other = cache.identify(1, 2, true);
+    cache.insert(other, 0, buf);
+    EXPECT_EQ(10 * blockSize, cache.getSize());
+
+    cache.forget(1, 1);
+    EXPECT_EQ(blockSize, cache.getSize());
+    EXPECT_TRUE(cache.lookup(other, 0, buf));
+
+    // The inode reused gets a generation never used before.
+    const auto reused = cache.identify(1, 1, false);
+    EXPECT_NE(file.generation, reused.generation);
+    EXPECT_FALSE(cache.lookup(reused, 0, buf));
+}
+
+TEST_F(CouchBlockCacheTest, Bounded) {
+    for (uint64_t block = 0; block < 10000; ++block) {
+        read(block);
+    }
+    EXPECT_EQ(cache.getCapacity(), cache.getSize());
+}
+
+// A long scan reading blocks once doesn't evict a hot set read repeatedly.
+TEST_F(CouchBlockCacheTest, ScanResistant) {
+    const uint64_t hotBlocks = 32;
+    uint64_t scanBlock = 1000;
+    for (int round = 0; round < 20; ++round) {
+        for (uint64_t block = 0; block < hotBlocks; ++block) {
+            read(block);
+        }
+        for (int ii = 0; ii < 32; ++ii) {
+            read(scanBlock++);
+        }
+    }
+
+    for (int ii = 0; ii < 20000; ++ii) {
+        read(scanBlock++);
+    }
+
+    size_t hits = 0;
+    for (uint64_t block = 0; block < hotBlocks; ++block) {
+        hits += read(block);
+    }
+    EXPECT_EQ(hotBlocks, hits);
+}
+
+/// BlockCacheOps over couchstore's default ops, reading a file whose every
+/// byte holds its block number.
+class BlockCacheOpsTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        path = "couch-block-cache_test." + std::to_string(getpid());
+        writeFile();
+    }
+
+    void TearDown() override {
+        std::remove(path.c_str());
+    }
+
+    /// (Re)write the file, in place.
+    void writeFile() {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        ASSERT_NE(-1, fd);
+        for (size_t block = 0; block < fileBlocks; ++block) {
+            std::vector<char> data(blockSize, char(block + generation));
+            ASSERT_EQ(ssize_t(blockSize), ::write(fd, data.data(), blockSize));
+        }
+        // And a partial block.
+        ASSERT_EQ(10, ::write(fd, "0123456789", 10));
+        ::close(fd);
+    }
+
+    /// Read through ops, checking the data.
+    ssize_t read(FileOpsInterface& ops, cs_off_t offset, size_t len) {
+        couch_file_handle h = ops.constructor(&errinfo);
+        EXPECT_EQ(COUCHSTORE_SUCCESS,
+                  ops.open(&errinfo, &h, path.c_str(), O_RDONLY));
+        std::vector<char> buf(len);
+        ssize_t got = ops.pread(&errinfo, h, buf.data(), len, offset);
+        for (ssize_t ii = 0; ii < got; ++ii) {
+            const cs_off_t pos = offset + ii;
+            if (size_t(pos) < fileBlocks * blockSize) {
+                EXPECT_EQ(char(pos / blockSize + generation), buf[ii]);
+            } else {
+                EXPECT_EQ(char('0' + pos % blockSize), buf[ii]);
+            }
+        }
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+        ops.destructor(h);
+        return got;
+    }
+
+    const size_t fileBlocks = 8;
+    int generation = 0;
+    std::string path;
+    couchstore_error_info_t errinfo;
+    CouchBlockCache cache{1024 * blockSize};
+    Couchbase::RelaxedAtomic<size_t> hits;
+    Couchbase::RelaxedAtomic<size_t> misses;
+};
+
+TEST_F(BlockCacheOpsTest, Reads) {
+    BlockCacheOps ops(cache,
+                      *couchstore_get_default_file_ops(),
+                      BlockCacheOps::Mode::Cached,
+                      hits,
+                      misses);
+
+    // Spanning two blocks.
+    EXPECT_EQ(100, read(ops, blockSize - 50, 100));
+    EXPECT_EQ(0, hits);
+    EXPECT_EQ(2, misses);
+    EXPECT_EQ(10, read(ops, blockSize + 10, 10));
+    EXPECT_EQ(1, hits);
+
+    // Reaching the partial last block, which isn't cached.
+    const cs_off_t end = fileBlocks * blockSize + 10;
+    EXPECT_EQ(20, read(ops, end - 20, 100));
+    EXPECT_EQ(20, read(ops, end - 20, 100));
+    EXPECT_EQ(2, hits);
+    EXPECT_EQ(5, misses);
+    EXPECT_EQ(0, read(ops, end, 100));
+
+    // Large reads bypass the cache.
+    EXPECT_EQ(ssize_t(BlockCacheOps::maxCachedRead + 1),
+              read(ops, 0, BlockCacheOps::maxCachedRead + 1));
+    EXPECT_EQ(2, hits);
+    EXPECT_EQ(6, misses);
+    EXPECT_EQ(3 * blockSize, cache.getSize());
+}
+
+// Blocks of a replaced file aren't served for its successor.
+TEST_F(BlockCacheOpsTest, ReplacedFile) {
+    BlockCacheOps ops(cache,
+                      *couchstore_get_default_file_ops(),
+                      BlockCacheOps::Mode::Cached,
+                      hits,
+                      misses);
+    EXPECT_EQ(10, read(ops, 0, 10));
+
+    // Recreated through the ops (as couchstore does); the new file's
+    // contents are then written to the same inode.
+    generation = 1;
+    std::remove(path.c_str());
+    couch_file_handle h = ops.constructor(&errinfo);
+    ASSERT_EQ(COUCHSTORE_SUCCESS,
+              ops.open(&errinfo, &h, path.c_str(), O_RDWR | O_CREAT));
+    ops.close(&errinfo, h);
+    ops.destructor(h);
+    writeFile();
+
+    EXPECT_EQ(10, read(ops, 0, 10));
+    EXPECT_EQ(0, hits);
+}
+
+// Compaction's and backfills' reads neither use nor populate the cache.
+TEST_F(BlockCacheOpsTest, Bypass) {
+    BlockCacheOps cached(cache,
+                         *couchstore_get_default_file_ops(),
+                         BlockCacheOps::Mode::Cached,
+                         hits,
+                         misses);
+    BlockCacheOps bypass(cache,
+                         *couchstore_get_default_file_ops(),
+                         BlockCacheOps::Mode::Bypass,
+                         hits,
+                         misses);
+    EXPECT_EQ(10, read(bypass, 0, 10));
+    EXPECT_EQ(10, read(bypass, 0, 10));
+    EXPECT_EQ(0, hits);
+    EXPECT_EQ(0, misses);
+    EXPECT_EQ(0, cache.getSize());
+
+    EXPECT_EQ(10, read(cached, 0, 10));
+    EXPECT_EQ(10, read(bypass, 0, 10));
+    EXPECT_EQ(0, hits);
+    EXPECT_EQ(1, misses);
+}
+
+// A removed file's blocks are dropped, and its inode forgotten.
+TEST_F(BlockCacheOpsTest, Forget) {
+    BlockCacheOps ops(cache,
+                      *couchstore_get_default_file_ops(),
+                      BlockCacheOps::Mode::Cached,
+                      hits,
+                      misses);
+    EXPECT_EQ(10, read(ops, 0, 10));
+    EXPECT_EQ(10, read(ops, blockSize, 10));
+    EXPECT_EQ(2 * blockSize, cache.getSize());
+
+    cache.forget(path);
+    EXPECT_EQ(0, cache.getSize());
+    EXPECT_EQ(10, read(ops, 0, 10));
+    EXPECT_EQ(0, hits);
+    EXPECT_EQ(3, misses);
+
+    // Forgetting a missing file is a no-op.
+    cache.forget(path + ".missing");
+    EXPECT_EQ(blockSize, cache.getSize());
+}
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "src/couch-kvstore/couch-db-handle-cache.h"
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+/// The handles are never dereferenced, so fake them.
+static Db* handle(uintptr_t n) {
+    return reinterpret_cast<Db*>(n);
+}
+
+class DbHandleCacheTest : public ::testing::Test {
+protected:
+    std::set<Db*> closed;
+    DbGenerations generations{4};
+    DbHandleCache cache{2, generations, [this](Db* db) { closed.insert(db); }};
+};
+
+TEST_F(DbHandleCacheTest, TakePut) {
+    EXPECT_EQ(nullptr, cache.take(0, 1));
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    EXPECT_EQ(handle(1), cache.take(0, 1));
+    // Taken, so no longer cached.
+    EXPECT_EQ(nullptr, cache.take(0, 1));
+    EXPECT_TRUE(closed.empty());
+}
+
+TEST_F(DbHandleCacheTest, OneHandlePerVBucket) {
+    const auto generation = cache.getGeneration(0);
+    cache.put(0, 1, generation, handle(1));
+    cache.put(0, 1, generation, handle(2));
+    EXPECT_EQ(std::set<Db*>{handle(2)}, closed);
+    EXPECT_EQ(handle(1), cache.take(0, 1));
+}
+
+TEST_F(DbHandleCacheTest, StaleRevision) {
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    EXPECT_EQ(nullptr, cache.take(0, 2));
+    EXPECT_EQ(std::set<Db*>{handle(1)}, closed);
+}
+
+// A commit doesn't touch the cache; the stale handle is closed when taken.
+TEST_F(DbHandleCacheTest, WrittenTo) {
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    generations.advance(0);
+    EXPECT_TRUE(closed.empty());
+    EXPECT_EQ(nullptr, cache.take(0, 1));
+    EXPECT_EQ(std::set<Db*>{handle(1)}, closed);
+
+    // A handle in use when the file is written to isn't cached.
+    const auto generation = cache.getGeneration(0);
+    generations.advance(0);
+    cache.put(0, 1, generation, handle(2));
+    EXPECT_EQ(1, closed.count(handle(2)));
+    EXPECT_EQ(nullptr, cache.take(0, 1));
+}
+
+// Once a file is replaced, the next take (of any vbucket) closes every
+// stale handle, so none keeps an unlinked file open.
+TEST_F(DbHandleCacheTest, Replaced) {
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    cache.put(1, 1, cache.getGeneration(1), handle(2));
+    generations.replace(0);
+    EXPECT_TRUE(closed.empty());
+    EXPECT_EQ(nullptr, cache.take(2, 1));
+    EXPECT_EQ(std::set<Db*>{handle(1)}, closed);
+    EXPECT_EQ(handle(2), cache.take(1, 1));
+}
+
+TEST_F(DbHandleCacheTest, EvictsLeastRecentlyUsed) {
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    cache.put(1, 1, cache.getGeneration(1), handle(2));
+    // Use vb:0's handle, leaving vb:1's the least recently used.
+    cache.put(0, 1, cache.getGeneration(0), cache.take(0, 1));
+    cache.put(2, 1, cache.getGeneration(2), handle(3));
+    EXPECT_EQ(std::set<Db*>{handle(2)}, closed);
+    EXPECT_EQ(handle(1), cache.take(0, 1));
+    EXPECT_EQ(handle(3), cache.take(2, 1));
+}
+
+TEST_F(DbHandleCacheTest, Clear) {
+    cache.put(0, 1, cache.getGeneration(0), handle(1));
+    cache.put(1, 1, cache.getGeneration(1), handle(2));
+    cache.clear();
+    EXPECT_EQ((std::set<Db*>{handle(1), handle(2)}), closed);
+    EXPECT_EQ(nullptr, cache.take(0, 1));
+}
@@ -0,0 +1,299 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "src/couch-kvstore/couch-deferred-sync.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * FileOps which don't touch the filesystem, recording the operations
+ * performed on each file ("w" for a write, "s" for a sync).
+ */
+class RecordingOps : public FileOpsInterface {
+public:
+    struct File {
+        std::string ops;
+        bool open = false;
+    };
+
+    couch_file_handle constructor(couchstore_error_info_t*) override {
+        files.emplace_back(new File);
+        return reinterpret_cast<couch_file_handle>(files.back().get());
+    }
+    couchstore_error_t open(couchstore_error_info_t*,
+                            couch_file_handle* h,
+                            const char*,
+                            int) override {
+        file(*h).open = true;
+        return COUCHSTORE_SUCCESS;
+    }
+    couchstore_error_t close(couchstore_error_info_t*,
+                             couch_file_handle h) override {
+        file(h).open = false;
+        return COUCHSTORE_SUCCESS;
+    }
+    ssize_t pread(couchstore_error_info_t*,
+                  couch_file_handle,
+                  void*,
+                  size_t nbytes,
+                  cs_off_t) override {
+        return nbytes;
+    }
+    ssize_t pwrite(couchstore_error_info_t*,
+                   couch_file_handle h,
+                   const void*,
+                   size_t nbytes,
+                   cs_off_t) override {
+        std::lock_guard<std::mutex> lh(mutex);
+        file(h).ops += "w";
+        return nbytes;
+    }
+    cs_off_t goto_eof(couchstore_error_info_t*, couch_file_handle) override {
+        return 0;
+    }
+    couchstore_error_t sync(couchstore_error_info_t*,
+                            couch_file_handle h) override {
+        std::lock_guard<std::mutex> lh(mutex);
+        file(h).ops += "s";
+        return syncResult;
+    }
+    couchstore_error_t advise(couchstore_error_info_t*,
+                              couch_file_handle,
+                              cs_off_t,
+                              cs_off_t,
+                              couchstore_file_advice_t) override {
+        return COUCHSTORE_SUCCESS;
+    }
+    void destructor(couch_file_handle) override {
+    }
+
+    static File& file(couch_file_handle h) {
+        return *reinterpret_cast<File*>(h);
+    }
+
+    std::vector<std::unique_ptr<File>> files;
+    couchstore_error_t syncResult = COUCHSTORE_SUCCESS;
+    std::mutex mutex;
+};
+
+/// Runs each helper on its own thread, standing in for an ExecutorPool task.
+class ThreadHelpers {
+public:
+    ~ThreadHelpers() {
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    DeferredSyncOps::HelperScheduler scheduler() {
+        return [this](std::function<void()> help) {
+            std::lock_guard<std::mutex> lh(mutex);
+            threads.emplace_back(std::move(help));
+        };
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+};
+
+class DeferredSyncOpsTest : public ::testing::TestWithParam<bool> {
+protected:
+    DeferredSyncOpsTest()
+        : ops(base,
+              GetParam() ? helpers.scheduler()
+                         : DeferredSyncOps::HelperScheduler()) {
+    }
+
+    couch_file_handle openFile() {
+        couch_file_handle h = ops.constructor(&errinfo);
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.open(&errinfo, &h, "file", 0));
+        return h;
+    }
+
+    /// Write, sync, write, sync - as couchstore_commit() does.
+    void commit(couch_file_handle h) {
+        char buf[8] = {};
+        EXPECT_EQ(8, ops.pwrite(&errinfo, h, buf, sizeof(buf), 0));
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.sync(&errinfo, h));
+        EXPECT_EQ(8, ops.pwrite(&errinfo, h, buf, sizeof(buf), 8));
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.sync(&errinfo, h));
+    }
+
+    RecordingOps base;
+    // Joined after ops is destroyed; a helper never needs it once
+    // syncDeferred() has returned.
+    ThreadHelpers helpers;
+    DeferredSyncOps ops;
+    couchstore_error_info_t errinfo;
+};
+
+// A sync is performed before the next write, so writes are still ordered
+// with respect to it; the final sync is deferred.
+TEST_P(DeferredSyncOpsTest, SyncDeferredUntilNextWrite) {
+    auto h = openFile();
+    commit(h);
+    EXPECT_EQ("wsw", base.files[0]->ops);
+    EXPECT_EQ(1, ops.getNumDeferred());
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.syncDeferred());
+    EXPECT_EQ("wsws", base.files[0]->ops);
+    EXPECT_EQ(0, ops.getNumDeferred());
+
+    // Nothing left to sync.
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.syncDeferred());
+    EXPECT_EQ("wsws", base.files[0]->ops);
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    ops.destructor(h);
+}
+
+// All files of a group are synced by syncDeferred().
+TEST_P(DeferredSyncOpsTest, GroupSync) {
+    std::vector<couch_file_handle> handles;
+    for (int ii = 0; ii < 16; ++ii) {
+        handles.push_back(openFile());
+        commit(handles.back());
+    }
+    EXPECT_EQ(16, ops.getNumDeferred());
+
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.syncDeferred());
+    for (const auto& file : base.files) {
+        EXPECT_EQ("wsws", file->ops);
+    }
+
+    for (auto h : handles) {
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+        ops.destructor(h);
+    }
+}
+
+// Closing a file performs its deferred sync.
+TEST_P(DeferredSyncOpsTest, CloseSyncs) {
+    auto h = openFile();
+    commit(h);
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+    EXPECT_EQ("wsws", base.files[0]->ops);
+    EXPECT_FALSE(base.files[0]->open);
+    EXPECT_EQ(0, ops.getNumDeferred());
+    ops.destructor(h);
+}
+
+// A failed sync is reported by syncDeferred().
+TEST_P(DeferredSyncOpsTest, SyncError) {
+    std::vector<couch_file_handle> handles;
+    for (int ii = 0; ii < 4; ++ii) {
+        handles.push_back(openFile());
+        commit(handles.back());
+    }
+    base.syncResult = COUCHSTORE_ERROR_WRITE;
+    EXPECT_EQ(COUCHSTORE_ERROR_WRITE, ops.syncDeferred());
+    EXPECT_EQ(0, ops.getNumDeferred());
+
+    base.syncResult = COUCHSTORE_SUCCESS;
+    for (auto h : handles) {
+        EXPECT_EQ(COUCHSTORE_SUCCESS, ops.close(&errinfo, h));
+        ops.destructor(h);
+    }
+}
+
+// A helper which only runs after syncDeferred() has returned (e.g. all
+// writer threads were busy) finds nothing to do: the caller synced every file.
+TEST(DeferredSyncOpsHelperTest, LateHelper) {
+    RecordingOps base;
+    std::vector<std::function<void()>> scheduled;
+    DeferredSyncOps ops(base, [&scheduled](std::function<void()> help) {
+        scheduled.push_back(std::move(help));
+    });
+
+    couchstore_error_info_t errinfo;
+    std::vector<couch_file_handle> handles;
+    char buf[8] = {};
+    for (int file = 0; file < 4; ++file) {
+        handles.push_back(ops.constructor(&errinfo));
+        ops.open(&errinfo, &handles.back(), "file", 0);
+        ops.pwrite(&errinfo, handles.back(), buf, sizeof(buf), 0);
+        ops.sync(&errinfo, handles.back());
+    }
+    EXPECT_EQ(COUCHSTORE_SUCCESS, ops.syncDeferred());
+    ASSERT_EQ(1, scheduled.size());
+    for (auto h : handles) {
+        ops.close(&errinfo, h);
+        ops.destructor(h);
+    }
+
+    scheduled.front()();
+    for (const auto& file : base.files) {
+        EXPECT_EQ("ws", file->ops);
+    }
+}
+
+// Several DeferredSyncOps (one per KVStore) group syncing at once, each with
+// its own helpers; every pass must complete with all its files synced.
+TEST(DeferredSyncOpsHelperTest, ConcurrentPasses) {
+    const int numStores = 4;
+    std::vector<std::unique_ptr<RecordingOps>> bases;
+    ThreadHelpers helpers;
+    std::vector<std::unique_ptr<DeferredSyncOps>> stores;
+    for (int ii = 0; ii < numStores; ++ii) {
+        bases.emplace_back(new RecordingOps);
+        stores.emplace_back(
+                new DeferredSyncOps(*bases.back(), helpers.scheduler()));
+    }
+
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < numStores; ++ii) {
+        threads.emplace_back([&stores, ii]() {
+            auto& ops = *stores[ii];
+            couchstore_error_info_t errinfo;
+            std::vector<couch_file_handle> handles;
+            char buf[8] = {};
+            for (int file = 0; file < 16; ++file) {
+                handles.push_back(ops.constructor(&errinfo));
+                ops.open(&errinfo, &handles.back(), "file", 0);
+                ops.pwrite(&errinfo, handles.back(), buf, sizeof(buf), 0);
+                ops.sync(&errinfo, handles.back());
+            }
+            EXPECT_EQ(COUCHSTORE_SUCCESS, ops.syncDeferred());
+            for (auto h : handles) {
+                ops.close(&errinfo, h);
+                ops.destructor(h);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (const auto& base : bases) {
+        for (const auto& file : base->files) {
+            EXPECT_EQ("ws", file->ops);
+        }
+    }
+}
+
+// Without and with a helper.
+INSTANTIATE_TEST_CASE_P(Helpers,
+                        DeferredSyncOpsTest,
+                        ::testing::Bool(),
+                        ::testing::PrintToStringParamName());
@@ -0,0 +1,235 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "src/couch-kvstore/couch-value-log.h"
+
+#include <gtest/gtest.h>
+#include <platform/dirutils.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+class ValueLogTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        cb::io::rmrf(dir);
+        cb::io::mkdirp(dir);
+    }
+
+    void TearDown() override {
+        cb::io::rmrf(dir);
+    }
+
+    static cb::const_char_buffer buf(const std::string& str) {
+        return {str.data(), str.size()};
+    }
+
+    const std::string dir = "couch-value-log_test.db";
+};
+
+TEST_F(ValueLogTest, AppendRead) {
+    ValueLog log(dir, 3);
+    const std::string value1(1000, 'a');
+    const std::string value2 = "value2";
+    auto ref1 = log.append(buf("key1"), 1, buf(value1), 0);
+    auto ref2 = log.append(buf("key2"), 2, buf(value2),
+                           ValueLog::Ref::Compressed);
+    log.sync();
+
+    EXPECT_EQ(ref1.generation, ref2.generation);
+    EXPECT_FALSE(ref1.isCompressed());
+    EXPECT_TRUE(ref2.isCompressed());
+
+    std::string value;
+    ASSERT_TRUE(log.read(ref1, value));
+    EXPECT_EQ(value1, value);
+    ASSERT_TRUE(log.read(ref2, value));
+    EXPECT_EQ(value2, value);
+    EXPECT_EQ(2 * ValueLog::headerSize + 8 + value1.size() + value2.size(),
+              log.getTotalSize());
+}
+
+TEST_F(ValueLogTest, RefEncoding) {
+    ValueLog::Ref ref{5, 1234567890123, 42, 0xdeadbeef,
+                      ValueLog::Ref::Compressed};
+    char encoded[ValueLog::Ref::encodedSize];
+    ref.encode(encoded);
+
+    ValueLog::Ref decoded;
+    ASSERT_TRUE(ValueLog::Ref::decode({encoded, sizeof(encoded)}, decoded));
+    EXPECT_EQ(ref.generation, decoded.generation);
+    EXPECT_EQ(ref.offset, decoded.offset);
+    EXPECT_EQ(ref.length, decoded.length);
+    EXPECT_EQ(ref.crc, decoded.crc);
+    EXPECT_EQ(ref.flags, decoded.flags);
+
+    EXPECT_FALSE(ValueLog::Ref::decode({encoded, sizeof(encoded) - 1},
+                                       decoded));
+}
+
+TEST_F(ValueLogTest, CorruptValue) {
+    ValueLog log(dir, 0);
+    auto ref = log.append(buf("key"), 1, buf("value"), 0);
+    ref.crc++;
+    std::string value;
+    EXPECT_FALSE(log.read(ref, value));
+    ref.generation++;
+    EXPECT_FALSE(log.read(ref, value));
+}
+
+TEST_F(ValueLogTest, ReopenStartsNewGeneration) {
+    ValueLog::Ref ref1;
+    {
+        ValueLog log(dir, 0);
+        ref1 = log.append(buf("key1"), 1, buf("value1"), 0);
+        log.sync();
+    }
+
+    ValueLog log(dir, 0);
+    auto ref2 = log.append(buf("key2"), 2, buf("value2"), 0);
+    EXPECT_EQ(ref1.generation + 1, ref2.generation);
+
+    std::string value;
+    ASSERT_TRUE(log.read(ref1, value));
+    EXPECT_EQ("value1", value);
+
+    // Another vbucket's log is separate.
+    ValueLog other(dir, 10);
+    EXPECT_EQ(0, other.getTotalSize());
+}
+
+TEST_F(ValueLogTest, SealAndRemove) {
+    ValueLog log(dir, 0);
+    auto ref1 = log.append(buf("key1"), 1, buf("value1"), 0);
+    EXPECT_EQ(std::vector<uint64_t>{ref1.generation}, log.seal());
+    // Sealing again without appends doesn't add a generation.
+    EXPECT_EQ(std::vector<uint64_t>{ref1.generation}, log.seal());
+
+    auto ref2 = log.append(buf("key2"), 2, buf("value2"), 0);
+    EXPECT_EQ(ref1.generation + 1, ref2.generation);
+
+    // Still readable while pinned (by a reader from before the removal).
+    std::string value;
+    {
+        auto pin = log.pin();
+        log.remove({ref1.generation});
+        EXPECT_EQ(0, log.getSize(ref1.generation));
+        EXPECT_TRUE(cb::io::findFilesWithPrefix(dir, "0.vlog.1").empty());
+        EXPECT_TRUE(log.read(ref1, value));
+    }
+    EXPECT_FALSE(log.read(ref1, value));
+
+    EXPECT_TRUE(log.read(ref2, value));
+    log.removeAll();
+    EXPECT_EQ(0, log.getTotalSize());
+    auto ref3 = log.append(buf("key3"), 3, buf("value3"), 0);
+    EXPECT_GT(ref3.generation, ref2.generation);
+}
+
+// A pin keeps every generation removed after it was taken readable, across
+// any number of removals; later pins don't keep earlier removals.
+TEST_F(ValueLogTest, PinAcrossRemovals) {
+    ValueLog log(dir, 0);
+    auto ref1 = log.append(buf("key1"), 1, buf("value1"), 0);
+    log.seal();
+    auto ref2 = log.append(buf("key2"), 2, buf("value2"), 0);
+    log.seal();
+
+    std::string value;
+    auto pin1 = log.pin();
+    log.remove({ref1.generation});
+    auto pin2 = log.pin();
+    log.remove({ref2.generation});
+    log.remove({});
+    EXPECT_TRUE(log.read(ref1, value));
+    EXPECT_EQ("value1", value);
+    EXPECT_TRUE(log.read(ref2, value));
+
+    pin1 = ValueLog::Pin();
+    EXPECT_FALSE(log.read(ref1, value));
+    EXPECT_TRUE(log.read(ref2, value));
+    EXPECT_EQ("value2", value);
+
+    pin2 = ValueLog::Pin();
+    EXPECT_FALSE(log.read(ref2, value));
+}
+
+TEST_F(ValueLogTest, ForEach) {
+    ValueLog log(dir, 0);
+    std::vector<ValueLog::Ref> refs;
+    for (int i = 0; i < 3; i++) {
+        refs.push_back(log.append(buf("key" + std::to_string(i)),
+                                  i + 1,
+                                  buf(std::string(i * 100, 'x')),
+                                  0));
+    }
+    log.sync();
+
+    std::vector<std::string> keys;
+    std::vector<uint64_t> seqnos;
+    std::vector<uint64_t> offsets;
+    EXPECT_TRUE(log.forEach(refs[0].generation,
+                            [&](cb::const_char_buffer key,
+                                uint64_t seqno,
+                                const ValueLog::Ref& ref) {
+                                keys.emplace_back(key.data(), key.size());
+                                seqnos.push_back(seqno);
+                                offsets.push_back(ref.offset);
+                                EXPECT_EQ(refs[seqno - 1].crc, ref.crc);
+                                EXPECT_EQ(refs[seqno - 1].length, ref.length);
+                            }));
+    EXPECT_EQ((std::vector<std::string>{"key0", "key1", "key2"}), keys);
+    EXPECT_EQ((std::vector<uint64_t>{1, 2, 3}), seqnos);
+    EXPECT_EQ((std::vector<uint64_t>{
+                      refs[0].offset, refs[1].offset, refs[2].offset}),
+              offsets);
+}
+
+TEST_F(ValueLogTest, ForEachTornAndCorrupt) {
+    std::string path;
+    ValueLog::Ref ref;
+    {
+        ValueLog log(dir, 0);
+        log.append(buf("key1"), 1, buf("value1"), 0);
+        ref = log.append(buf("key2"), 2, buf("value2"), 0);
+        path = dir + "/0.vlog." + std::to_string(ref.generation);
+    }
+
+    // Lose the end of the last entry, as a crash might.
+    ASSERT_EQ(0, truncate(path.c_str(), ref.offset + 2));
+    size_t count = 0;
+    {
+        ValueLog log(dir, 0);
+        EXPECT_TRUE(log.forEach(ref.generation,
+                                [&count](cb::const_char_buffer,
+                                         uint64_t,
+                                         const ValueLog::Ref&) { count++; }));
+        EXPECT_EQ(1, count);
+    }
+
+    // Corrupt the key of the first entry.
+    int fd = open(path.c_str(), O_WRONLY);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(1, pwrite(fd, "K", 1, ValueLog::headerSize));
+    close(fd);
+    count = 0;
+    ValueLog log(dir, 0);
+    EXPECT_FALSE(log.forEach(ref.generation,
+                             [&count](cb::const_char_buffer,
+                                      uint64_t,
+                                      const ValueLog::Ref&) { count++; }));
+    EXPECT_EQ(0, count);
+}
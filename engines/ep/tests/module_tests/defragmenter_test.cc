@@ -20,6 +20,7 @@
 #include "daemon/alloc_hooks.h"
 #include "defragmenter.h"
 #include "defragmenter_visitor.h"
+#include "tests/module_tests/test_helpers.h"
 #include "vbucket.h"
 
 #include <valgrind/valgrind.h>
@@ -338,6 +339,34 @@ TEST_P(DefragmenterTest, DISABLED_RefCountMemUsage) {
     EXPECT_LE(mem_used_after_defrag, mem_used_before_defrag);
 }
 
+// A Blob referenced only by its StoredValue, and old enough, must be
+// reallocated. This doesn't depend on the allocator - it checks the
+// visitor's reference count test doesn't count a reference of its own.
+TEST_P(DefragmenterTest, ReallocatesUnsharedValue) {
+    {
+        // Too large to be stored inline.
+        auto item = make_item(0, makeStoredDocKey("key"),
+                              std::string(200, 'x'));
+        ASSERT_EQ(MutationStatus::WasClean, vbucket->ht.set(item));
+    }
+    const auto* v = vbucket->ht.find(makeStoredDocKey("key"),
+                                     TrackReference::No,
+                                     WantsDeleted::No);
+    ASSERT_NE(nullptr, v);
+    ASSERT_FALSE(v->isValueInline());
+    const auto* blobBefore = v->getNonInlineValue().get();
+
+    PauseResumeVBAdapter prAdapter(
+            std::make_unique<DefragmentVisitor>(0, 1024 * 1024));
+    prAdapter.visit(*vbucket);
+
+    auto& visitor = dynamic_cast<DefragmentVisitor&>(prAdapter.getHTVisitor());
+    EXPECT_EQ(1, visitor.getVisitedCount());
+    EXPECT_EQ(1, visitor.getDefragCount());
+    EXPECT_NE(blobBefore, v->getNonInlineValue().get());
+    EXPECT_EQ(std::string(200, 'x'), v->getNonInlineValue()->to_s());
+}
+
 #if defined(HAVE_JEMALLOC)
 TEST_P(DefragmenterTest, MaxDefragValueSize) {
 #else
@@ -23,14 +23,18 @@
 #include "bgfetcher.h"
 #include "dcp/dcpconnmap.h"
 #include "ep_time.h"
+#include "ep_vb.h"
 #include "evp_store_test.h"
 #include "fakes/fake_executorpool.h"
 #include "programs/engine_testapp/mock_server.h"
 #include "taskqueue.h"
+#include "warmup.h"
 #include "tests/module_tests/test_helpers.h"
 #include "tests/module_tests/test_task.h"
 
 #include <libcouchstore/couch_db.h>
+#include <platform/compress.h>
+#include <platform/dirutils.h>
 #include <string_utilities.h>
 #include <xattr/blob.h>
 #include <xattr/utils.h>
@@ -1415,6 +1419,78 @@ TEST_F(SingleThreadedEPBucketTest, pre_expiry_xattrs) {
 
 }
 
+/**
+ * Store "key" as an expired, snappy-compressed document with xattrs; return
+ * it as stored.
+ */
+static Item storeCompressedXattrs(SingleThreadedEPBucketTest& test,
+                                  uint16_t vbid) {
+    const auto xattr_data = createXattrValue("value");
+    cb::compression::Buffer deflated;
+    EXPECT_TRUE(cb::compression::deflate(cb::compression::Algorithm::Snappy,
+                                         xattr_data.data(),
+                                         xattr_data.size(),
+                                         deflated));
+    return test.store_item(vbid,
+                           makeStoredDocKey("key"),
+                           {deflated.data.get(), deflated.len},
+                           1,
+                           {cb::engine_errc::success},
+                           PROTOCOL_BINARY_DATATYPE_XATTR |
+                                   PROTOCOL_BINARY_DATATYPE_SNAPPY);
+}
+
+/// Check pre_expiry pruned the (inflated) xattrs of the expired "key".
+static void checkPreExpiredXattrs(KVBucket& kvbucket,
+                                  uint16_t vbid,
+                                  const void* cookie) {
+    get_options_t options = static_cast<get_options_t>(
+            QUEUE_BG_FETCH | HONOR_STATES | TRACK_REFERENCE | DELETE_TEMP |
+            HIDE_LOCKED_CAS | TRACK_STATISTICS | GET_DELETED_VALUE);
+    GetValue gv = kvbucket.get(makeStoredDocKey("key"), vbid, cookie, options);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+
+    auto get_itm = gv.item.get();
+    EXPECT_TRUE(get_itm->isDeleted());
+    EXPECT_EQ(PROTOCOL_BINARY_DATATYPE_XATTR, get_itm->getDataType());
+    cb::byte_buffer value_buf{
+            reinterpret_cast<uint8_t*>(const_cast<char*>(get_itm->getData())),
+            get_itm->getNBytes()};
+    cb::xattr::Blob new_blob(value_buf);
+    EXPECT_EQ("{\"cas\":\"0xdeadbeefcafefeed\"}",
+              to_string(new_blob.get(to_const_byte_buffer("_sync"))));
+    EXPECT_TRUE(new_blob.get(to_const_byte_buffer("user")).empty());
+    EXPECT_TRUE(new_blob.get(to_const_byte_buffer("meta")).empty());
+}
+
+// A compressed value is inflated before pre_expiry sees it, when expired by
+// the pager or compactor...
+TEST_F(SingleThreadedEPBucketTest, pre_expiry_xattrs_compressed) {
+    auto& kvbucket = *engine->getKVBucket();
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+
+    auto itm = storeCompressedXattrs(*this, vbid);
+    itm.setRevSeqno(1);
+    kvbucket.deleteExpiredItem(itm, ep_real_time() + 1, ExpireBy::Pager);
+
+    checkPreExpiredXattrs(kvbucket, vbid, cookie);
+}
+
+// ... and when expired on access.
+TEST_F(SingleThreadedEPBucketTest, pre_expiry_xattrs_compressed_on_access) {
+    auto& kvbucket = *engine->getKVBucket();
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+
+    storeCompressedXattrs(*this, vbid);
+    GetValue gv = kvbucket.get(makeStoredDocKey("key"),
+                               vbid,
+                               cookie,
+                               static_cast<get_options_t>(HONOR_STATES));
+    EXPECT_EQ(ENGINE_KEY_ENOENT, gv.getStatus());
+
+    checkPreExpiredXattrs(kvbucket, vbid, cookie);
+}
+
 class WarmupTest : public SingleThreadedKVBucketTest {
 public:
     /**
@@ -1598,6 +1674,232 @@ TEST_F(WarmupTest, MB_25197) {
     }
 }
 
+static void addStatToMap(const char* key,
+                         const uint16_t klen,
+                         const char* val,
+                         const uint32_t vlen,
+                         const void* cookie) {
+    auto* map = static_cast<std::map<std::string, std::string>*>(
+            const_cast<void*>(cookie));
+    map->emplace(std::string(key, klen), std::string(val, vlen));
+}
+
+// Without an access log, values are loaded during the key dump (by the
+// shard's second task, once the first has loaded the vbucket's keys), and
+// the time of each phase is reported.
+TEST_F(WarmupTest, PipelinedValueLoad) {
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    for (int i = 0; i < 10; ++i) {
+        store_item(vbid, makeStoredDocKey("key" + std::to_string(i)), "value");
+    }
+    flush_vbucket_to_disk(vbid, 10);
+
+    resetEngineAndWarmup();
+
+    auto& stats = engine->getEpStats();
+    EXPECT_EQ(10, stats.warmedUpKeys);
+    EXPECT_EQ(10, stats.warmedUpValues);
+    EXPECT_EQ(0,
+              engine->getKVBucket()
+                      ->getVBucket(vbid)
+                      ->ht.getNumInMemoryNonResItems());
+
+    std::map<std::string, std::string> warmupStats;
+    engine->getKVBucket()->getWarmup()->addStats(addStatToMap, &warmupStats);
+    EXPECT_EQ(1, warmupStats.count("ep_warmup_key_dump_time"));
+    EXPECT_EQ(1, warmupStats.count("ep_warmup_check_access_log_time"));
+}
+
+// Values loaded during the key dump stop as soon as memory use reaches the
+// warmup threshold - halting only the value pipeline, so every key is still
+// loaded and warmup doesn't fail for lack of memory.
+TEST_F(WarmupTest, PipelinedValueLoadHaltsAtThreshold) {
+    config_string += ";warmup_min_memory_threshold=0";
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    for (int i = 0; i < 10; ++i) {
+        store_item(vbid, makeStoredDocKey("key" + std::to_string(i)), "value");
+    }
+    flush_vbucket_to_disk(vbid, 10);
+
+    resetEngineAndWarmup();
+
+    auto& stats = engine->getEpStats();
+    EXPECT_EQ(10, stats.warmedUpKeys);
+    EXPECT_LT(stats.warmedUpValues, 10);
+    EXPECT_EQ(0, stats.warmOOM);
+    EXPECT_FALSE(engine->getKVBucket()->getWarmup()->hasOOMFailure());
+}
+
+// The keys of a vbucket are loaded from the metadata image written at a
+// clean shutdown, which is removed once used.
+TEST_F(WarmupTest, MetadataImage) {
+    engine->getConfiguration().setWarmupMetadataImage(true);
+    config_string += ";warmup_metadata_image=true";
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    for (int i = 0; i < 10; ++i) {
+        store_item(vbid, makeStoredDocKey("key" + std::to_string(i)), "value");
+    }
+    flush_vbucket_to_disk(vbid, 10);
+
+    resetEngineAndWarmup();
+
+    std::map<std::string, std::string> warmupStats;
+    engine->getKVBucket()->getWarmup()->addStats(addStatToMap, &warmupStats);
+    EXPECT_EQ("1", warmupStats["ep_warmup_metadata_images"]);
+    EXPECT_EQ(10, engine->getEpStats().warmedUpKeys);
+    EXPECT_EQ(10, engine->getEpStats().warmedUpValues);
+    EXPECT_FALSE(cb::io::isFile(
+            engine->getKVBucket()->getMetadataImageFile(vbid)));
+
+    auto options = static_cast<get_options_t>(QUEUE_BG_FETCH | HONOR_STATES |
+                                              TRACK_REFERENCE | DELETE_TEMP |
+                                              HIDE_LOCKED_CAS | TRACK_STATISTICS);
+    auto gv = store->get(makeStoredDocKey("key3"), vbid, cookie, options);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_EQ("value", gv.item->getValue()->to_s());
+}
+
+// getLocked() changes an item's CAS in memory only, so no image is written
+// for a vbucket where an item was locked: warmup scans its keys instead.
+TEST_F(WarmupTest, MetadataImageNotWrittenAfterGetLocked) {
+    engine->getConfiguration().setWarmupMetadataImage(true);
+    config_string += ";warmup_metadata_image=true";
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    auto key = makeStoredDocKey("key");
+    store_item(vbid, key, "value");
+    flush_vbucket_to_disk(vbid, 1);
+
+    auto gv = store->getLocked(key, vbid, ep_current_time(), 15, cookie);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    ASSERT_TRUE(store->getVBucket(vbid)->hasUnpersistedCas());
+    EXPECT_FALSE(dynamic_cast<EPVBucket&>(*store->getVBucket(vbid))
+                         .persistMetadataImage(
+                                 store->getMetadataImageFile(vbid)));
+
+    resetEngineAndWarmup();
+
+    std::map<std::string, std::string> warmupStats;
+    engine->getKVBucket()->getWarmup()->addStats(addStatToMap, &warmupStats);
+    EXPECT_EQ("0", warmupStats["ep_warmup_metadata_images"]);
+    EXPECT_EQ(1, engine->getEpStats().warmedUpKeys);
+}
+
+// With warmup_serve_traffic (and full eviction), traffic is served once the
+// vbuckets are created: items not yet loaded are fetched from disk, and a
+// delete stays in memory (so warmup can't load the item over it) until
+// warmup completes.
+TEST_F(WarmupTest, ServeTraffic) {
+    config_string += ";item_eviction_policy=full_eviction";
+    config_string += ";warmup_serve_traffic=true";
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    for (int i = 0; i < 10; ++i) {
+        store_item(vbid, makeStoredDocKey("key" + std::to_string(i)), "value");
+    }
+    flush_vbucket_to_disk(vbid, 10);
+
+    resetEngineAndEnableWarmup();
+    auto& readerQueue = *task_executor->getLpTaskQ()[READER_TASK_IDX];
+    while (!store->isWarmupServingTraffic()) {
+        ASSERT_TRUE(store->isWarmingUp());
+        runNextTask(readerQueue);
+    }
+    EXPECT_FALSE(engine->isDegradedMode());
+    EXPECT_EQ(0, engine->getEpStats().warmedUpValues);
+
+    auto options = static_cast<get_options_t>(QUEUE_BG_FETCH | HONOR_STATES |
+                                              TRACK_REFERENCE | DELETE_TEMP |
+                                              HIDE_LOCKED_CAS | TRACK_STATISTICS);
+    auto key = makeStoredDocKey("key3");
+    item* itm = nullptr;
+    EXPECT_EQ(ENGINE_EWOULDBLOCK,
+              engine->get(cookie, &itm, key, vbid, options));
+    runBGFetcherTask();
+    ASSERT_EQ(ENGINE_SUCCESS, engine->get(cookie, &itm, key, vbid, options));
+    EXPECT_EQ("value", static_cast<Item*>(itm)->getValue()->to_s());
+    engine->itemRelease(cookie, itm);
+
+    auto& stats = engine->getEpStats();
+    EXPECT_EQ(1, stats.warmupOpsServed);
+    EXPECT_EQ(1, stats.warmupBgFetched);
+
+    uint64_t cas = 0;
+    mutation_descr_t mutInfo;
+    EXPECT_EQ(ENGINE_SUCCESS,
+              engine->itemDelete(cookie, key, cas, vbid, nullptr, &mutInfo));
+    EXPECT_EQ(2, stats.warmupOpsServed);
+    flush_vbucket_to_disk(vbid, 1);
+    auto vb = store->getVBucket(vbid);
+    EXPECT_EQ(1, vb->getNumInMemoryDeletes());
+
+    runReadersUntilWarmedUp();
+    EXPECT_EQ(9, stats.warmedUpValues);
+    EXPECT_EQ(0, vb->getNumInMemoryDeletes());
+
+    std::map<std::string, std::string> warmupStats;
+    engine->getKVBucket()->getWarmup()->addStats(addStatToMap, &warmupStats);
+    EXPECT_EQ("true", warmupStats["ep_warmup_serving_traffic"]);
+    EXPECT_EQ("2", warmupStats["ep_warmup_ops_served"]);
+}
+
+// While warmup serves traffic under full eviction, an item written (and
+// persisted) by a client is only value-ejected, so that a warmup scan whose
+// snapshot predates the write can't load the older version over it.
+TEST_F(WarmupTest, ServeTrafficEvictDuringScan) {
+    config_string += ";item_eviction_policy=full_eviction";
+    config_string += ";warmup_serve_traffic=true";
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    auto key = makeStoredDocKey("key");
+    store_item(vbid, key, "old");
+    flush_vbucket_to_disk(vbid, 1);
+
+    resetEngineAndEnableWarmup();
+    auto& readerQueue = *task_executor->getLpTaskQ()[READER_TASK_IDX];
+    while (!store->isWarmupServingTraffic()) {
+        ASSERT_TRUE(store->isWarmingUp());
+        runNextTask(readerQueue);
+    }
+
+    // The version a scan started before the write would find on disk.
+    auto options = static_cast<get_options_t>(QUEUE_BG_FETCH | HONOR_STATES |
+                                              TRACK_REFERENCE | DELETE_TEMP |
+                                              HIDE_LOCKED_CAS | TRACK_STATISTICS);
+    EXPECT_EQ(ENGINE_EWOULDBLOCK,
+              store->get(key, vbid, cookie, options).getStatus());
+    runBGFetcherTask();
+    auto gv = store->get(key, vbid, cookie, options);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    Item stale(*gv.item);
+
+    // Write, flush and evict.
+    store_item(vbid, key, "new");
+    flush_vbucket_to_disk(vbid, 1);
+    const char* msg = nullptr;
+    ASSERT_EQ(PROTOCOL_BINARY_RESPONSE_SUCCESS,
+              store->evictKey(key, vbid, &msg));
+    auto& vb = dynamic_cast<EPVBucket&>(*store->getVBucket(vbid));
+    {
+        auto hbl = vb.ht.getLockedBucket(key);
+        auto* v = vb.ht.unlocked_find(
+                key, hbl.getBucketNum(), WantsDeleted::No, TrackReference::No);
+        ASSERT_NE(nullptr, v);
+        EXPECT_FALSE(v->isResident());
+    }
+
+    // The scan: its callback finds the newer item and skips the stale one.
+    EXPECT_NE(MutationStatus::NotFound,
+              vb.insertFromWarmup(stale, false, false));
+    runReadersUntilWarmedUp();
+
+    // The rest of warmup may have loaded the (new) value back.
+    gv = store->get(key, vbid, cookie, options);
+    if (gv.getStatus() == ENGINE_EWOULDBLOCK) {
+        runBGFetcherTask();
+        gv = store->get(key, vbid, cookie, options);
+    }
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_EQ("new", gv.item->getValue()->to_s());
+}
+
 // Test that we can push a DCP_DELETION which pretends to be from a delete
 // with xattrs, i.e. the delete has a value containing only system xattrs
 // The MB was created because this code would actually trigger an exception
@@ -1699,3 +2001,128 @@ TEST_F(SingleThreadedEPBucketTest, mb25273) {
     EXPECT_EQ(3, gv.item->getCas());
     EXPECT_EQ(value.size(), gv.item->getValue()->vlength());
 }
+
+// A fetch is only delayed when requests arrive fast enough to grow a shallow
+// queue's batch, and by no more than a quarter of the disk latency (capped
+// by the maximum window).
+TEST(BgFetcherWindowTest, ComputeFetchWindow) {
+    using std::chrono::microseconds;
+    const microseconds maxWindow(1000);
+    const microseconds none(0);
+
+    // Busy (0.1 requests/µs) with a shallow queue.
+    EXPECT_EQ(microseconds(500),
+              BgFetcher::computeFetchWindow(maxWindow, 0.1, 2000, 4));
+    EXPECT_EQ(maxWindow,
+              BgFetcher::computeFetchWindow(maxWindow, 0.1, 10000, 4));
+    // Disabled.
+    EXPECT_EQ(none, BgFetcher::computeFetchWindow(none, 0.1, 2000, 4));
+    // Low load: under one request expected during the window.
+    EXPECT_EQ(none,
+              BgFetcher::computeFetchWindow(maxWindow, 0.0001, 2000, 4));
+    // A deep queue is already a good batch.
+    EXPECT_EQ(none, BgFetcher::computeFetchWindow(maxWindow, 0.1, 2000, 200));
+    // Nothing to fetch.
+    EXPECT_EQ(none, BgFetcher::computeFetchWindow(maxWindow, 0.1, 2000, 0));
+}
+
+class BgFetcherTest : public SingleThreadedEPBucketTest {
+protected:
+    void SetUp() override {
+        config_string += "bg_fetch_tasks_per_shard=2";
+        SingleThreadedEPBucketTest::SetUp();
+    }
+
+    /// Store, persist and evict the keys, then request each from disk.
+    void queueFetches(const std::vector<StoredDocKey>& keys) {
+        for (const auto& key : keys) {
+            store_item(vbid, key, "value");
+        }
+        flush_vbucket_to_disk(vbid, keys.size());
+        for (const auto& key : keys) {
+            evict_key(vbid, key);
+            EXPECT_EQ(ENGINE_EWOULDBLOCK,
+                      store->get(key, vbid, cookie, options)
+                              .getStatus());
+        }
+    }
+
+    BgFetcher& getBgFetcher() {
+        return *store->getVBucket(vbid)->getShard()->getBgFetcher();
+    }
+
+    const get_options_t options = static_cast<get_options_t>(
+            QUEUE_BG_FETCH | HONOR_STATES | TRACK_REFERENCE | DELETE_TEMP |
+            HIDE_LOCKED_CAS | TRACK_STATISTICS);
+};
+
+// bg_fetch_tasks_per_shard tasks are scheduled for the shard, and whichever
+// runs first takes the whole batch.
+TEST_F(BgFetcherTest, TasksPerShard) {
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    auto& readerQueue = *task_executor->getLpTaskQ()[READER_TASK_IDX];
+    const size_t scheduled = readerQueue.getFutureQueueSize() +
+                             readerQueue.getReadyQueueSize();
+    getBgFetcher().start();
+    EXPECT_EQ(scheduled + 2,
+              readerQueue.getFutureQueueSize() +
+                      readerQueue.getReadyQueueSize());
+
+    const std::vector<StoredDocKey> keys{makeStoredDocKey("key1"),
+                                         makeStoredDocKey("key2")};
+    queueFetches(keys);
+    runNextTask(readerQueue, "Batching background fetch");
+    for (const auto& key : keys) {
+        EXPECT_EQ(ENGINE_SUCCESS,
+                  store->get(key, vbid, cookie, options).getStatus());
+    }
+    getBgFetcher().stop();
+}
+
+// A request wakes just one of the shard's idle tasks, rather than all of them.
+TEST_F(BgFetcherTest, WakeOneTask) {
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    auto& readerQueue = *task_executor->getLpTaskQ()[READER_TASK_IDX];
+    getBgFetcher().start();
+    // With nothing to fetch, both tasks run and go idle.
+    runNextTask(readerQueue, "Batching background fetch");
+    runNextTask(readerQueue, "Batching background fetch");
+    ASSERT_EQ(0, readerQueue.getReadyQueueSize());
+
+    const auto key = makeStoredDocKey("key1");
+    queueFetches({key});
+    runNextTask(readerQueue, "Batching background fetch");
+    // The other task is still snoozing.
+    EXPECT_EQ(0, readerQueue.getReadyQueueSize());
+    EXPECT_EQ(ENGINE_SUCCESS,
+              store->get(key, vbid, cookie, options).getStatus());
+    getBgFetcher().stop();
+}
+
+// The batch size and queued time of each fetch are recorded in the shard's
+// histograms, which are reset with the other kvstore stats.
+TEST_F(BgFetcherTest, Histograms) {
+    setVBucketStateAndRunPersistTask(vbid, vbucket_state_active);
+    queueFetches({makeStoredDocKey("key1"), makeStoredDocKey("key2")});
+    runBGFetcherTask();
+
+    auto count = [](const std::map<std::string, std::string>& stats,
+                    const std::string& prefix) {
+        uint64_t total = 0;
+        for (const auto& stat : stats) {
+            if (stat.first.compare(0, prefix.size(), prefix) == 0) {
+                total += std::stoull(stat.second);
+            }
+        }
+        return total;
+    };
+    std::map<std::string, std::string> stats;
+    getBgFetcher().addStats("bgfetcher", addStatToMap, &stats);
+    EXPECT_EQ(1u, count(stats, "bgfetcher:batch_size_"));
+    EXPECT_EQ(2u, count(stats, "bgfetcher:wait_"));
+
+    store->resetUnderlyingStats();
+    stats.clear();
+    getBgFetcher().addStats("bgfetcher", addStatToMap, &stats);
+    EXPECT_TRUE(stats.empty());
+}
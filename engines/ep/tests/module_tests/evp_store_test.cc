@@ -82,6 +82,22 @@ TEST_F(EPBucketTest, test_mb20751_deadlock_on_disconnect_delete) {
     frontend_thread_handling_disconnect.join();
 }
 
+// A prepared flush batch abandoned (as on a forced flusher stop) releases
+// its vbucket and returns its items to it, so they're flushed later.
+TEST_F(EPBucketTest, AbandonedFlushBatchIsFlushedLater) {
+    store_item(vbid, makeStoredDocKey("key"), "value");
+
+    VBucketFlushBatch batch;
+    ASSERT_EQ(1, store->prepareFlushBatch(vbid, batch));
+    VBucketFlushBatch second;
+    EXPECT_EQ(RETRY_FLUSH_VBUCKET, store->prepareFlushBatch(vbid, second));
+
+    store->abandonFlushBatch(batch);
+    EXPECT_EQ(1, engine->getEpStats().diskQueueSize.load());
+    EXPECT_EQ(1, store->flushVBucket(vbid));
+    EXPECT_EQ(0, engine->getEpStats().diskQueueSize.load());
+}
+
 class EPStoreEvictionTest : public EPBucketTest,
                              public ::testing::WithParamInterface<std::string> {
     void SetUp() override {
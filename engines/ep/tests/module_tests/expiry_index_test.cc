@@ -0,0 +1,109 @@
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "expiry_index.h"
+#include "stats.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <gtest/gtest.h>
+
+class ExpiryIndexTest : public ::testing::Test {
+protected:
+    EPStats stats;
+};
+
+TEST_F(ExpiryIndexTest, TakeExpired) {
+    ExpiryIndex index(stats);
+    index.update(makeStoredDocKey("a"), 0, 10);
+    index.update(makeStoredDocKey("b"), 0, 20);
+    index.update(makeStoredDocKey("c"), 0, 20);
+    EXPECT_EQ(3, index.size());
+
+    // Expiry is strictly before now.
+    EXPECT_TRUE(index.takeExpired(10).empty());
+
+    auto expired = index.takeExpired(11);
+    ASSERT_EQ(1, expired.size());
+    EXPECT_EQ(makeStoredDocKey("a"), expired[0]);
+    EXPECT_EQ(2, index.size());
+
+    EXPECT_EQ(2, index.takeExpired(100).size());
+    EXPECT_EQ(0, index.size());
+}
+
+TEST_F(ExpiryIndexTest, Update) {
+    ExpiryIndex index(stats);
+    const auto key = makeStoredDocKey("key");
+    index.update(key, 0, 10);
+    // Extended; should no longer be expired at 11.
+    index.update(key, 10, 20);
+    EXPECT_TRUE(index.takeExpired(11).empty());
+    EXPECT_EQ(1, index.size());
+
+    // Removed (e.g. deleted).
+    index.update(key, 20, 0);
+    EXPECT_EQ(0, index.size());
+    EXPECT_TRUE(index.takeExpired(100).empty());
+}
+
+// An update which doesn't change the expiry time must re-insert a key which
+// was taken in the meantime.
+TEST_F(ExpiryIndexTest, UnchangedUpdateReinserts) {
+    ExpiryIndex index(stats);
+    const auto key = makeStoredDocKey("key");
+    index.update(key, 0, 10);
+    ASSERT_EQ(1, index.takeExpired(11).size());
+
+    index.update(key, 10, 10);
+    EXPECT_EQ(1, index.size());
+    index.update(key, 10, 10);
+    EXPECT_EQ(1, index.size());
+}
+
+TEST_F(ExpiryIndexTest, TakeExpiredLimit) {
+    ExpiryIndex index(stats);
+    for (int i = 0; i < 10; i++) {
+        index.update(makeStoredDocKey("key_" + std::to_string(i)), 0, 1 + i);
+    }
+    EXPECT_EQ(3, index.takeExpired(100, 3).size());
+    EXPECT_EQ(7, index.size());
+}
+
+TEST_F(ExpiryIndexTest, MemoryAccounting) {
+    const size_t initialOverhead = stats.memOverhead->load();
+    {
+        ExpiryIndex index(stats);
+        const size_t empty = index.memorySize();
+        EXPECT_EQ(empty, stats.expiryIndexMemory.load());
+        EXPECT_EQ(initialOverhead + empty, stats.memOverhead->load());
+
+        for (int i = 0; i < 100; i++) {
+            index.update(makeStoredDocKey("key_" + std::to_string(i)), 0, i);
+        }
+        EXPECT_LT(empty, index.memorySize());
+        EXPECT_EQ(index.memorySize(), stats.expiryIndexMemory.load());
+        EXPECT_EQ(initialOverhead + index.memorySize(),
+                  stats.memOverhead->load());
+
+        index.takeExpired(50);
+        EXPECT_EQ(index.memorySize(), stats.expiryIndexMemory.load());
+
+        index.clear();
+        EXPECT_EQ(empty, index.memorySize());
+    }
+    EXPECT_EQ(0, stats.expiryIndexMemory.load());
+    EXPECT_EQ(initialOverhead, stats.memOverhead->load());
+}
@@ -0,0 +1,142 @@
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "frequency_sketch.h"
+#include "tests/module_tests/test_helpers.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+static uint32_t hashOf(const std::string& key) {
+    return makeStoredDocKey(key).hash();
+}
+
+TEST(FrequencySketchTest, WidthIsPowerOfTwo) {
+    EXPECT_EQ(16, FrequencySketch(0).getWidth());
+    EXPECT_EQ(64, FrequencySketch(47).getWidth());
+    EXPECT_EQ(1024, FrequencySketch(1024).getWidth());
+}
+
+TEST(FrequencySketchTest, Increment) {
+    FrequencySketch sketch(1000);
+    const auto hash = hashOf("key");
+    EXPECT_EQ(0, sketch.estimate(hash));
+    for (int i = 1; i <= 10; i++) {
+        sketch.increment(hash);
+        EXPECT_EQ(i, sketch.estimate(hash));
+    }
+}
+
+TEST(FrequencySketchTest, Saturates) {
+    FrequencySketch sketch(1000);
+    const auto hash = hashOf("key");
+    for (int i = 0; i < 100; i++) {
+        sketch.increment(hash);
+    }
+    EXPECT_EQ(FrequencySketch::MaxFrequency, sketch.estimate(hash));
+}
+
+TEST(FrequencySketchTest, Age) {
+    FrequencySketch sketch(1000);
+    const auto hash = hashOf("key");
+    for (int i = 0; i < 8; i++) {
+        sketch.increment(hash);
+    }
+    sketch.age();
+    EXPECT_EQ(4, sketch.estimate(hash));
+    EXPECT_EQ(1, sketch.getNumAgings());
+}
+
+// Once enough increments have been recorded the counters are aged
+// automatically, so formerly popular keys are forgotten.
+TEST(FrequencySketchTest, AgesAutomatically) {
+    FrequencySketch sketch(16);
+    const auto hot = hashOf("hot");
+    for (int i = 0; i < 15; i++) {
+        sketch.increment(hot);
+    }
+
+    for (int i = 0; sketch.getNumAgings() == 0 && i < 10000; i++) {
+        sketch.increment(hashOf("key_" + std::to_string(i)));
+    }
+    EXPECT_EQ(1, sketch.getNumAgings());
+    EXPECT_LE(sketch.estimate(hot), 8);
+}
+
+// A frequently accessed key should stand out from many keys accessed once.
+TEST(FrequencySketchTest, HotKeyStandsOut) {
+    const size_t numKeys = 1000;
+    FrequencySketch sketch(numKeys);
+    for (size_t i = 0; i < numKeys; i++) {
+        sketch.increment(hashOf("key_" + std::to_string(i)));
+    }
+    const auto hot = hashOf("hot");
+    for (int i = 0; i < 10; i++) {
+        sketch.increment(hot);
+    }
+
+    size_t overEstimated = 0;
+    for (size_t i = 0; i < numKeys; i++) {
+        if (sketch.estimate(hashOf("key_" + std::to_string(i))) > 1) {
+            overEstimated++;
+        }
+    }
+    EXPECT_GE(sketch.estimate(hot), 10);
+    EXPECT_LT(overEstimated, numKeys / 10);
+}
+
+TEST(FrequencySketchTest, ConcurrentIncrement) {
+    FrequencySketch sketch(1000);
+    const auto hash = hashOf("key");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&sketch, hash]() {
+            for (int i = 0; i < 3; i++) {
+                sketch.increment(hash);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(12, sketch.estimate(hash));
+}
+
+// Resizing a sketch (as HashTable::resize does) must keep the counters:
+// growing preserves every estimate, shrinking may only over-estimate.
+TEST(FrequencySketchTest, ResizeCarriesCounters) {
+    FrequencySketch sketch(1000);
+    std::vector<uint8_t> estimates;
+    for (int i = 0; i < 100; i++) {
+        const auto hash = hashOf("key_" + std::to_string(i));
+        for (int j = 0; j < i % 8; j++) {
+            sketch.increment(hash);
+        }
+        estimates.push_back(sketch.estimate(hash));
+    }
+
+    FrequencySketch grown(4000, sketch);
+    EXPECT_EQ(4096, grown.getWidth());
+    FrequencySketch shrunk(100, sketch);
+    EXPECT_EQ(128, shrunk.getWidth());
+    for (int i = 0; i < 100; i++) {
+        const auto hash = hashOf("key_" + std::to_string(i));
+        EXPECT_EQ(estimates[i], grown.estimate(hash));
+        EXPECT_GE(shrunk.estimate(hash), estimates[i]);
+    }
+}
@@ -30,7 +30,10 @@
 #include <platform/cb_malloc.h>
 
 #include <algorithm>
+#include <future>
 #include <limits>
+#include <map>
+#include <thread>
 #include <signal.h>
 
 EPStats global_stats;
@@ -227,6 +230,56 @@ TEST_F(HashTableTest, Find) {
     testFind(h);
 }
 
+TEST_F(HashTableTest, FindWithoutFingerprints) {
+    HashTable h(global_stats,
+                makeFactory(),
+                5,
+                1,
+                /*resizeStepSize*/ 0,
+                /*useFingerprints*/ false);
+    testFind(h);
+}
+
+// Check that a table without fingerprints doesn't pay for their memory, and
+// that with them each group of four buckets occupies one cache line.
+TEST_F(HashTableTest, FingerprintsMemorySize) {
+    const size_t size = 1009;
+    HashTable with(global_stats, makeFactory(), size, 1);
+    HashTable without(global_stats,
+                      makeFactory(),
+                      size,
+                      1,
+                      /*resizeStepSize*/ 0,
+                      /*useFingerprints*/ false);
+    const size_t groups = (size + 3) / 4;
+    EXPECT_EQ(groups * 64 - size * sizeof(StoredValue::UniquePtr),
+              with.memorySize() - without.memorySize());
+}
+
+// Check that bucket fingerprints are maintained correctly as keys are removed
+// from a (long) chain - remaining keys must still be found, and removed keys
+// not.
+TEST_F(HashTableTest, FingerprintsAfterDelete) {
+    HashTable h(global_stats, makeFactory(), 3, 1);
+
+    auto keys = generateKeys(200);
+    storeMany(h, keys);
+
+    std::vector<StoredDocKey> remaining;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (i % 2) {
+            EXPECT_TRUE(del(h, keys[i]));
+        } else {
+            remaining.push_back(keys[i]);
+        }
+    }
+
+    verifyFound(h, remaining);
+    for (size_t i = 1; i < keys.size(); i += 2) {
+        EXPECT_FALSE(h.find(keys[i], TrackReference::No, WantsDeleted::Yes));
+    }
+}
+
 TEST_F(HashTableTest, Resize) {
     HashTable h(global_stats, makeFactory(), 5, 3);
 
@@ -251,6 +304,36 @@ TEST_F(HashTableTest, Resize) {
     verifyFound(h, keys);
 }
 
+TEST_F(HashTableTest, ResizeIncremental) {
+    HashTable h(global_stats, makeFactory(), 5, 3, /*resizeStepSize*/ 7);
+
+    auto keys = generateKeys(1000);
+    storeMany(h, keys);
+
+    verifyFound(h, keys);
+
+    h.resize(6143);
+    EXPECT_EQ(6143, h.getSize());
+    EXPECT_FALSE(h.isResizing());
+    EXPECT_EQ(0, h.getResizeBucketsPending());
+    EXPECT_EQ(6143, h.getNumBucketsTotal());
+
+    verifyFound(h, keys);
+    EXPECT_EQ(1000, count(h));
+
+    h.resize(769);
+    EXPECT_EQ(769, h.getSize());
+    EXPECT_FALSE(h.isResizing());
+
+    verifyFound(h, keys);
+    EXPECT_EQ(1000, count(h));
+
+    h.resize(static_cast<size_t>(std::numeric_limits<int>::max()) + 17);
+    EXPECT_EQ(769, h.getSize());
+
+    verifyFound(h, keys);
+}
+
 class AccessGenerator : public Generator<bool> {
 public:
 
@@ -295,6 +378,246 @@ TEST_F(HashTableTest, ConcurrentAccessResize) {
     getCompletedThreads(4, &gen);
 }
 
+TEST_F(HashTableTest, ConcurrentAccessResizeIncremental) {
+    HashTable h(global_stats, makeFactory(), 5, 3, /*resizeStepSize*/ 16);
+
+    auto keys = generateKeys(2000);
+    h.resize(keys.size());
+    storeMany(h, keys);
+
+    verifyFound(h, keys);
+
+    srand(918475);
+    AccessGenerator gen(keys, h);
+    getCompletedThreads(4, &gen);
+    EXPECT_EQ(0, h.getNumItems());
+}
+
+TEST_F(HashTableTest, FindMutexFree) {
+    HashTable h(global_stats,
+                makeFactory(),
+                5,
+                1,
+                /*resizeStepSize*/ 0,
+                /*useFingerprints*/ true,
+                /*mutexFreeReads*/ true);
+    testFind(h);
+}
+
+// Mutex-free reads must not be started while the bucket's lock is held, nor
+// when they are disabled.
+TEST_F(HashTableTest, MutexFreeReadExcludesWriter) {
+    HashTable h(global_stats,
+                makeFactory(),
+                5,
+                1,
+                /*resizeStepSize*/ 0,
+                /*useFingerprints*/ true,
+                /*mutexFreeReads*/ true);
+    auto key = makeStoredDocKey("key");
+    store(h, key);
+
+    {
+        auto guard = h.tryMutexFreeRead(key);
+        ASSERT_TRUE(guard);
+        auto* v = h.mutex_free_find(guard, key, WantsDeleted::No);
+        ASSERT_NE(nullptr, v);
+        EXPECT_TRUE(v->hasKey(key));
+    }
+
+    {
+        auto hbl = h.getLockedBucket(key);
+        EXPECT_FALSE(h.tryMutexFreeRead(key));
+    }
+    EXPECT_TRUE(h.tryMutexFreeRead(key));
+
+    HashTable disabled(global_stats, makeFactory(), 5, 1);
+    store(disabled, key);
+    EXPECT_FALSE(disabled.tryMutexFreeRead(key));
+}
+
+// Readers which find items without the bucket lock must never observe freed
+// StoredValues while other threads replace, delete and resize concurrently
+// (most useful under ASan / TSan).
+TEST_F(HashTableTest, ConcurrentMutexFreeReads) {
+    HashTable h(global_stats,
+                makeFactory(),
+                5,
+                3,
+                /*resizeStepSize*/ 16,
+                /*useFingerprints*/ true,
+                /*mutexFreeReads*/ true);
+
+    auto keys = generateKeys(1000);
+    storeMany(h, keys);
+
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&h, &keys, &done]() {
+            while (!done) {
+                for (const auto& key : keys) {
+                    auto guard = h.tryMutexFreeRead(key);
+                    if (!guard) {
+                        continue;
+                    }
+                    auto* v = h.mutex_free_find(guard, key, WantsDeleted::No);
+                    if (v) {
+                        EXPECT_TRUE(v->hasKey(key));
+                        auto item = v->toItem(false, 0);
+                        EXPECT_EQ(key.size(), item->getNBytes());
+                    }
+                }
+            }
+        });
+    }
+
+    for (int iter = 0; iter < 20; iter++) {
+        for (const auto& key : keys) {
+            Item item(key, 0, 0, key.data(), key.size());
+            h.set(item);
+        }
+        h.resize(iter % 2 ? 3000 : 1000);
+        for (size_t i = iter % 2; i < keys.size(); i += 2) {
+            del(h, keys[i]);
+        }
+    }
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+}
+
+// HashTables sharing one LockSet (as the vBuckets of a bucket do with
+// ht_shared_locks) must each behave as independent tables.
+TEST_F(HashTableTest, SharedLocks) {
+    auto locks = std::make_shared<HashTable::LockSet>(3, false);
+    HashTable h1(global_stats,
+                 makeFactory(),
+                 5,
+                 /*locks (ignored)*/ 7,
+                 /*resizeStepSize*/ 0,
+                 /*useFingerprints*/ true,
+                 /*mutexFreeReads*/ false,
+                 locks);
+    HashTable h2(global_stats,
+                 makeFactory(),
+                 5,
+                 7,
+                 /*resizeStepSize*/ 0,
+                 /*useFingerprints*/ true,
+                 /*mutexFreeReads*/ false,
+                 locks);
+    EXPECT_EQ(3, h1.getNumLocks());
+    EXPECT_EQ(3, h2.getNumLocks());
+
+    // The shared locks are not accounted to either table.
+    HashTable owned(global_stats, makeFactory(), 5, 3);
+    EXPECT_EQ(owned.memorySize(), h1.memorySize() + locks->memorySize());
+
+    auto keys1 = generateKeys(500);
+    auto keys2 = generateKeys(1000, 500);
+    storeMany(h1, keys1);
+    storeMany(h2, keys2);
+
+    h1.resize(6143);
+    verifyFound(h1, keys1);
+    verifyFound(h2, keys2);
+    EXPECT_EQ(500, count(h1));
+    EXPECT_EQ(500, count(h2));
+
+    for (const auto& key : keys2) {
+        EXPECT_FALSE(h1.find(key, TrackReference::No, WantsDeleted::Yes));
+    }
+
+    h2.clear();
+    EXPECT_EQ(0, h2.getNumItems());
+    EXPECT_EQ(500, count(h1));
+
+    EXPECT_THROW(HashTable::LockSet(0, false), std::invalid_argument);
+}
+
+// Whole-table operations on a HashTable sharing a LockSet stall the other
+// tables sharing it: a resize of h1 cannot proceed while any bucket of h2
+// is locked (and equally blocks h2's bucket operations while running).
+TEST_F(HashTableTest, SharedLocksResizeStallsOtherTables) {
+    auto locks = std::make_shared<HashTable::LockSet>(3, false);
+    HashTable h1(global_stats,
+                 makeFactory(),
+                 5,
+                 /*locks (ignored)*/ 7,
+                 /*resizeStepSize*/ 0,
+                 /*useFingerprints*/ true,
+                 /*mutexFreeReads*/ false,
+                 locks);
+    HashTable h2(global_stats,
+                 makeFactory(),
+                 5,
+                 7,
+                 /*resizeStepSize*/ 0,
+                 /*useFingerprints*/ true,
+                 /*mutexFreeReads*/ false,
+                 locks);
+    storeMany(h1, generateKeys(100));
+
+    std::future<void> resized;
+    {
+        auto lh = h2.getLockedBucket(0);
+        resized = std::async(std::launch::async, [&h1]() { h1.resize(97); });
+        EXPECT_EQ(std::future_status::timeout,
+                  resized.wait_for(std::chrono::milliseconds(100)));
+        EXPECT_EQ(5, h1.getSize());
+    }
+    resized.get();
+    EXPECT_EQ(97, h1.getSize());
+    EXPECT_EQ(100, count(h1));
+}
+
+// With frequency tracking enabled, finds (with TrackReference::Yes) and
+// writes record accesses instead of updating the items' NRU state.
+TEST_F(HashTableTest, TrackFrequency) {
+    HashTable h(global_stats,
+                makeFactory(),
+                5,
+                1,
+                /*resizeStepSize*/ 0,
+                /*useFingerprints*/ true,
+                /*mutexFreeReads*/ true,
+                /*sharedLocks*/ {},
+                /*trackFrequency*/ true);
+    ASSERT_TRUE(h.isTrackingFrequency());
+
+    auto hot = makeStoredDocKey("hot");
+    auto cold = makeStoredDocKey("cold");
+    store(h, hot);
+    store(h, cold);
+
+    for (int i = 0; i < 5; i++) {
+        auto* v = h.find(hot, TrackReference::Yes, WantsDeleted::No);
+        ASSERT_NE(nullptr, v);
+        EXPECT_EQ(INITIAL_NRU_VALUE, v->getNRUValue());
+    }
+    h.find(cold, TrackReference::No, WantsDeleted::No);
+
+    {
+        auto hbl = h.getLockedBucket(hot);
+        EXPECT_EQ(6, h.estimateFrequency(hot));
+    }
+    {
+        auto hbl = h.getLockedBucket(cold);
+        EXPECT_EQ(1, h.estimateFrequency(cold));
+    }
+
+    // The sketch is resized with the table, keeping its history.
+    h.resize(47);
+    auto hbl = h.getLockedBucket(hot);
+    EXPECT_EQ(6, h.estimateFrequency(hot));
+
+    HashTable untracked(global_stats, makeFactory(), 5, 1);
+    EXPECT_FALSE(untracked.isTrackingFrequency());
+    EXPECT_EQ(0, untracked.estimateFrequency(hot));
+}
+
 TEST_F(HashTableTest, AutoResize) {
     HashTable h(global_stats, makeFactory(), 5, 3);
 
@@ -550,7 +873,7 @@ TEST_F(HashTableTest, ReleaseItem) {
     /* Validate the HT count */
     EXPECT_EQ(numItems - 1, ht.getNumItems());
 
-    hbl.getHTLock().unlock();
+    hbl.unlock();
 
     /* Remove the element added last. This is certainly the head element of a
        hash bucket */
@@ -710,3 +1033,58 @@ TEST_F(HashTableTest, PauseResumeHashBucket) {
     HashTable::Position start;
     ht.pauseResumeVisit(mockVisitor, start);
 }
+
+// A paused visit stops incremental resize migration until its position is
+// dropped, so every item is visited exactly once while a migration is
+// pending, and the visit still ends at endPosition() once migration
+// proceeds.
+TEST_F(HashTableTest, PauseResumeAcrossMigration) {
+    HashTable h(global_stats, makeFactory(), 5, 3, /*resizeStepSize*/ 1);
+    auto keys = generateKeys(200);
+    storeMany(h, keys);
+
+    // Visits one item per call.
+    class PausingVisitor : public HashTableVisitor {
+    public:
+        bool visit(const HashTable::HashBucketLock& lh,
+                   StoredValue& v) override {
+            StoredDocKey key(v.getKey());
+            ++visited[key.c_str()];
+            return false;
+        }
+        std::map<std::string, int> visited;
+    };
+
+    // Starts an incremental resize, which can't migrate while a visit is
+    // paused.
+    PausingVisitor first;
+    HashTable::Position firstPos;
+    firstPos = h.pauseResumeVisit(first, firstPos);
+    ASSERT_NE(h.endPosition(), firstPos);
+    h.resize(1543);
+    ASSERT_TRUE(h.isResizing());
+    const size_t pending = h.getResizeBucketsPending();
+
+    PausingVisitor visitor;
+    HashTable::Position pos;
+    firstPos = HashTable::Position();
+    while (pos != h.endPosition()) {
+        pos = h.pauseResumeVisit(visitor, pos);
+        // Would migrate a bucket, were no visit paused.
+        h.resize(1543);
+        if (pos != h.endPosition()) {
+            EXPECT_EQ(pending, h.getResizeBucketsPending());
+        }
+    }
+
+    EXPECT_EQ(keys.size(), visitor.visited.size());
+    for (const auto& entry : visitor.visited) {
+        EXPECT_EQ(1, entry.second) << entry.first;
+    }
+
+    // The end position stays the end as the migration completes.
+    h.resize(1543);
+    EXPECT_FALSE(h.isResizing());
+    EXPECT_EQ(h.endPosition(), pos);
+    verifyFound(h, keys);
+}
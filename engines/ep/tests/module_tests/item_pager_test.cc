@@ -404,6 +404,48 @@ TEST_P(STEphemeralItemPagerTest, ReplicaNotPaged) {
     }
 }
 
+/**
+ * Test fixture for item pager tests using the lfu item_eviction_strategy.
+ */
+class STItemPagerLfuTest : public STItemPagerTest {
+protected:
+    void SetUp() override {
+        config_string += "item_eviction_strategy=lfu;";
+        STItemPagerTest::SetUp();
+    }
+};
+
+// With the lfu strategy, frequently read items should not be paged out
+// (even though all items have the same NRU value).
+TEST_P(STItemPagerLfuTest, FrequentlyUsedItemsNotPaged) {
+    size_t count = populateUntilTmpFail(vbid);
+    ASSERT_GE(count, 50) << "Too few documents stored";
+
+    const size_t numHot = 10;
+    for (int access = 0; access < 5; access++) {
+        for (size_t ii = 0; ii < numHot; ii++) {
+            auto key = makeStoredDocKey("xxx_" + std::to_string(ii));
+            auto result = store->get(
+                    key, vbid, nullptr, get_options_t(TRACK_REFERENCE));
+            ASSERT_EQ(ENGINE_SUCCESS, result.getStatus()) << "For key:" << key;
+        }
+    }
+
+    runHighMemoryPager();
+
+    auto vb = store->getVBucket(vbid);
+    for (size_t ii = 0; ii < numHot; ii++) {
+        auto key = makeStoredDocKey("xxx_" + std::to_string(ii));
+        auto* v = vb->ht.find(key, TrackReference::No, WantsDeleted::No);
+        ASSERT_NE(nullptr, v) << "For key:" << key;
+        EXPECT_TRUE(v->isResident()) << "For key:" << key;
+    }
+
+    const auto numResidentItems =
+            vb->getNumItems() - vb->getNumNonResidentItems();
+    EXPECT_LT(numResidentItems, count);
+}
+
 /**
  * Test fixture for expiry pager tests - enables the Expiry Pager (in addition
  * to what the parent class does).
@@ -669,6 +711,51 @@ TEST_P(STExpiryPagerTest, MB_25671) {
     EXPECT_EQ(metadata.revSeqno, item.item->getRevSeqno());
 }
 
+/**
+ * Test fixture for expiry pager tests with the expiry index enabled.
+ */
+class STExpiryPagerIndexTest : public STExpiryPagerTest {
+protected:
+    void SetUp() override {
+        config_string += "exp_pager_use_index=true;";
+        STExpiryPagerTest::SetUp();
+    }
+};
+
+// Test that when the expiry pager runs using the index, all expired items
+// are deleted.
+TEST_P(STExpiryPagerIndexTest, ExpiredItemsDeleted) {
+    expiredItemsDeleted();
+    EXPECT_TRUE(engine->getVBucket(vbid)
+                        ->ht.takeExpiredKeys(ep_real_time() + 1000)
+                        .empty())
+            << "Index should be empty once all items have expired";
+}
+
+// Test that an item whose expiry time has been extended (touched) is not
+// expired by the pager at its original expiry time.
+TEST_P(STExpiryPagerIndexTest, TouchedItemNotExpired) {
+    auto key = makeStoredDocKey("key");
+    auto item = make_item(
+            vbid, key, "value", ep_abs_time(ep_current_time() + 10));
+    ASSERT_EQ(ENGINE_SUCCESS, storeItem(item));
+    if (std::get<0>(GetParam()) == "persistent") {
+        EXPECT_EQ(1, store->flushVBucket(vbid));
+    }
+
+    auto gv = store->getAndUpdateTtl(
+            key, vbid, cookie, ep_abs_time(ep_current_time() + 100));
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+
+    TimeTraveller docBrown(11);
+    wakeUpExpiryPager();
+
+    EXPECT_EQ(1, engine->getVBucket(vbid)->getNumItems());
+    EXPECT_EQ(ENGINE_SUCCESS,
+              store->get(key, vbid, nullptr, get_options_t()).getStatus())
+            << "Touched key should still exist.";
+}
+
 // TODO: Ideally all of these tests should run with or without jemalloc,
 // however we currently rely on jemalloc for accurate memory tracking; and
 // hence it is required currently.
@@ -692,6 +779,19 @@ INSTANTIATE_TEST_CASE_P(EphemeralOrPersistent,
                         STExpiryPagerTest,
                         allConfigValues, );
 
+INSTANTIATE_TEST_CASE_P(EphemeralOrPersistent,
+                        STExpiryPagerIndexTest,
+                        allConfigValues, );
+
 INSTANTIATE_TEST_CASE_P(Ephemeral, STEphemeralItemPagerTest, ephConfigValues, );
 
+// The lfu strategy only applies to buckets which use the item pager.
+INSTANTIATE_TEST_CASE_P(
+        EphemeralOrPersistent,
+        STItemPagerLfuTest,
+        ::testing::Values(std::make_tuple(std::string("ephemeral"),
+                                          std::string("auto_delete")),
+                          std::make_tuple(std::string("persistent"),
+                                          std::string{})), );
+
 #endif
@@ -206,3 +206,29 @@ TEST_F(ItemPruneTest, testPruneValueWithNoXattrs) {
     // should not have value
     EXPECT_EQ(0, item->getNBytes());
 }
+
+// A compressed value which can't be inflated is left unpruned.
+TEST_F(ItemPruneTest, testPruneCorruptCompressedValue) {
+    std::string valueData = "not snappy";
+    uint8_t ext_meta[EXT_META_LEN] = {PROTOCOL_BINARY_DATATYPE_SNAPPY |
+                                      PROTOCOL_BINARY_DATATYPE_XATTR};
+    item = std::make_unique<Item>(
+            makeStoredDocKey("key"),
+            0,
+            0,
+            valueData.data(),
+            valueData.size(),
+            ext_meta,
+            sizeof(ext_meta));
+
+    EXPECT_FALSE(item->pruneValueAndOrXattrs(IncludeValue::Yes,
+                                             IncludeXattrs::No));
+    EXPECT_EQ(ext_meta[0], item->getDataType());
+    EXPECT_EQ(valueData, std::string(item->getData(), item->getNBytes()));
+
+    // Nothing kept, so nothing to inflate.
+    EXPECT_TRUE(item->pruneValueAndOrXattrs(IncludeValue::No,
+                                            IncludeXattrs::No));
+    EXPECT_TRUE(mcbp::datatype::is_raw(item->getDataType()));
+    EXPECT_EQ(0, item->getNBytes());
+}
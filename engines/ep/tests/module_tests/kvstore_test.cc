@@ -22,6 +22,9 @@
 #include "callbacks.h"
 #include "couch-kvstore/couch-kvstore.h"
 #include "kvstore.h"
+#ifdef EP_USE_ROCKSDB
+#include "rocksdb-kvstore/rocksdb-kvstore.h"
+#endif
 #include "src/internal.h"
 #include "tests/module_tests/test_helpers.h"
 #include "tests/test_fileops.h"
@@ -246,6 +249,320 @@ TEST_P(CouchAndForestTest, BasicTest) {
     checkGetValue(gv);
 }
 
+// Writes "key0".."key<count-1>" to vb 0 with seqnos 1..count, then deletes
+// the keys of deletes with the following seqnos.
+static void write_items(KVStore& kvstore,
+                        size_t count,
+                        const std::vector<size_t>& deletes = {}) {
+    WriteCallback wc;
+    CustomCallback<int> dc;
+    kvstore.begin();
+    int64_t seqno = 1;
+    for (size_t ii = 0; ii < count; ++ii) {
+        Item item(makeStoredDocKey("key" + std::to_string(ii)),
+                  0, 0, "value", 5, nullptr, 0, 0, seqno++);
+        kvstore.set(item, wc);
+    }
+    for (auto ii : deletes) {
+        Item item(makeStoredDocKey("key" + std::to_string(ii)),
+                  0, 0, nullptr, 0, nullptr, 0, 0, seqno++);
+        item.setDeleted();
+        kvstore.del(item, dc);
+    }
+    EXPECT_TRUE(kvstore.commit(nullptr /*no collections manifest*/));
+}
+
+/* Test a batch of gets, including of a missing key */
+TEST_P(CouchAndForestTest, GetMulti) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 10);
+
+    vb_bgfetch_queue_t itms;
+    for (int ii = 0; ii < 10; ++ii) {
+        itms[makeStoredDocKey("key" + std::to_string(ii))].isMetaOnly =
+                GetMetaOnly::No;
+    }
+    const auto missing = makeStoredDocKey("missing");
+    itms[missing].isMetaOnly = GetMetaOnly::No;
+
+    kvstore->getMulti(0, itms);
+    for (auto& it : itms) {
+        if (it.first == missing) {
+            EXPECT_EQ(ENGINE_KEY_ENOENT, it.second.value.getStatus());
+        } else {
+            checkGetValue(it.second.value);
+        }
+    }
+}
+
+/* Test a batch of gets spanning two vbuckets, including a missing key */
+TEST_P(CouchAndForestTest, GetMultiVBuckets) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    vbucket_state state(
+            vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+    kvstore->snapshotVBucket(
+            1, state, VBStatePersist::VBSTATE_PERSIST_WITHOUT_COMMIT);
+
+    WriteCallback wc;
+    for (uint16_t vb = 0; vb < 2; ++vb) {
+        kvstore->begin();
+        for (int ii = 0; ii < 5; ++ii) {
+            const std::string value = "value" + std::to_string(vb);
+            Item item(makeStoredDocKey("vb" + std::to_string(vb) + "key" +
+                                       std::to_string(ii)),
+                      0, 0, value.data(), value.size(),
+                      nullptr, 0, 0, ii + 1, vb);
+            kvstore->set(item, wc);
+        }
+        EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+    }
+
+    multi_vb_bgfetch_queue_t itms;
+    for (uint16_t vb = 0; vb < 2; ++vb) {
+        for (int ii = 0; ii < 5; ++ii) {
+            itms[vb][makeStoredDocKey("vb" + std::to_string(vb) + "key" +
+                                      std::to_string(ii))]
+                    .isMetaOnly = GetMetaOnly::No;
+        }
+    }
+    // Present in vb 0, but asked of vb 1.
+    const auto missing = makeStoredDocKey("vb0key0");
+    itms[1][missing].isMetaOnly = GetMetaOnly::No;
+
+    kvstore->getMultiVBuckets(itms);
+    for (auto& vb : itms) {
+        for (auto& it : vb.second) {
+            if (vb.first == 1 && it.first == missing) {
+                EXPECT_EQ(ENGINE_KEY_ENOENT, it.second.value.getStatus());
+            } else {
+                ASSERT_EQ(ENGINE_SUCCESS, it.second.value.getStatus());
+                EXPECT_EQ("value" + std::to_string(vb.first),
+                          it.second.value.item->getValue()->to_s());
+            }
+        }
+    }
+}
+
+/* Test a deletion is persisted, and counted */
+TEST_P(CouchAndForestTest, Delete) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 3);
+
+    CustomCallback<int> dc([](int rv) {
+        EXPECT_EQ(1, rv) << "the deleted item should have existed";
+    });
+    kvstore->begin();
+    Item item(makeStoredDocKey("key1"), 0, 0, nullptr, 0, nullptr, 0, 0, 4);
+    item.setDeleted();
+    kvstore->del(item, dc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+
+    GetValue gv = kvstore->get(makeStoredDocKey("key1"), 0, true);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_TRUE(gv.item->isDeleted());
+    EXPECT_EQ(4, gv.item->getBySeqno());
+    EXPECT_EQ(2u, kvstore->getItemCount(0));
+    EXPECT_EQ(1u, kvstore->getNumPersistedDeletes(0));
+}
+
+/* Test a backfill scan, in full and from part way through */
+TEST_P(CouchAndForestTest, Scan) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 5, {0});
+
+    std::vector<int64_t> seqnos;
+    size_t deleted = 0;
+    auto cb = std::make_shared<CustomCallback<GetValue>>(
+            [&seqnos, &deleted](GetValue gv) {
+                ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+                seqnos.push_back(gv.item->getBySeqno());
+                if (gv.item->isDeleted()) {
+                    ++deleted;
+                } else {
+                    checkGetValue(gv);
+                }
+            });
+    auto cl = std::make_shared<CustomCallback<CacheLookup>>();
+
+    auto* ctx = kvstore->initScanContext(cb,
+                                         cl,
+                                         0,
+                                         1,
+                                         DocumentFilter::ALL_ITEMS,
+                                         ValueFilter::VALUES_DECOMPRESSED);
+    ASSERT_NE(nullptr, ctx);
+    EXPECT_EQ(6u, ctx->maxSeqno);
+    EXPECT_EQ(5u, ctx->documentCount);
+    EXPECT_EQ(scan_success, kvstore->scan(ctx));
+    EXPECT_EQ(std::vector<int64_t>({2, 3, 4, 5, 6}), seqnos);
+    EXPECT_EQ(1u, deleted);
+    kvstore->destroyScanContext(ctx);
+
+    seqnos.clear();
+    ctx = kvstore->initScanContext(cb,
+                                   cl,
+                                   0,
+                                   4,
+                                   DocumentFilter::NO_DELETES,
+                                   ValueFilter::VALUES_DECOMPRESSED);
+    ASSERT_NE(nullptr, ctx);
+    EXPECT_EQ(scan_success, kvstore->scan(ctx));
+    EXPECT_EQ(std::vector<int64_t>({4, 5}), seqnos);
+    kvstore->destroyScanContext(ctx);
+}
+
+/* Test the keys are listed in order from the start key, without deletes */
+TEST_P(CouchAndForestTest, GetAllKeys) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 5, {2});
+
+    std::vector<std::string> keys;
+    auto cb = std::make_shared<CustomCallback<const DocKey&>>(
+            [&keys](const DocKey& key) {
+                keys.emplace_back(reinterpret_cast<const char*>(key.data()),
+                                  key.size());
+            });
+    EXPECT_EQ(ENGINE_SUCCESS,
+              kvstore->getAllKeys(0, makeStoredDocKey("key1"), 2, cb));
+    EXPECT_EQ(std::vector<std::string>({"key1", "key3"}), keys);
+}
+
+/* Test the vbucket state and documents are read back by a new KVStore */
+TEST_P(CouchAndForestTest, VBStatePersisted) {
+    KVStoreConfig config(
+            1024, 4, data_dir, GetParam(), 0, false /*persistnamespace*/);
+    const std::string failovers("[{\"id\":1,\"seq\":0}]");
+    {
+        auto kvstore = setup_kv_store(config);
+        write_items(*kvstore, 3);
+        vbucket_state state(vbucket_state_replica,
+                            0, 0, 3, 0, 1, 3, 0, 0, false, failovers);
+        EXPECT_TRUE(kvstore->snapshotVBucket(
+                0, state, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT));
+    }
+
+    auto kvstore = std::move(KVStoreFactory::create(config).rw);
+    auto* state = kvstore->listPersistedVbuckets()[0];
+    ASSERT_NE(nullptr, state);
+    EXPECT_EQ(vbucket_state_replica, state->state);
+    EXPECT_EQ(3, state->highSeqno);
+    EXPECT_EQ(1u, state->lastSnapStart);
+    EXPECT_EQ(3u, state->lastSnapEnd);
+    EXPECT_EQ(failovers, state->failovers);
+
+    GetValue gv = kvstore->get(makeStoredDocKey("key2"), 0);
+    checkGetValue(gv);
+}
+
+#ifdef EP_USE_ROCKSDB
+/// Test fixture for tests which run only on RocksDB.
+class RocksDBKVStoreTest : public KVStoreTest {
+};
+
+/* RocksDB can't rewind a vbucket, so a partial rollback must fail */
+TEST_F(RocksDBKVStoreTest, PartialRollbackFails) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "rocksdb", 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 3);
+
+    auto rcb(std::make_shared<CustomRBCallback>());
+    RollbackResult result = kvstore->rollback(0, 2, rcb);
+    EXPECT_FALSE(result.success);
+
+    // Nothing was rewound.
+    GetValue gv = kvstore->get(makeStoredDocKey("key2"), 0);
+    checkGetValue(gv);
+}
+
+/* Dead vbuckets lose their keys and state; live ones are left alone */
+TEST_F(RocksDBKVStoreTest, DestroyInvalidVBuckets) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "rocksdb", 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 3);
+
+    vbucket_state dead(
+            vbucket_state_dead, 0, 0, 3, 0, 0, 3, 0, 0, false, "");
+    ASSERT_TRUE(kvstore->snapshotVBucket(
+            0, dead, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT));
+    vbucket_state active(
+            vbucket_state_active, 0, 0, 0, 0, 0, 0, 0, 0, false, "");
+    ASSERT_TRUE(kvstore->snapshotVBucket(
+            1, active, VBStatePersist::VBSTATE_PERSIST_WITH_COMMIT));
+
+    auto& rocks = dynamic_cast<RocksDBKVStore&>(*kvstore);
+    rocks.destroyInvalidVBuckets(false);
+
+    EXPECT_EQ(nullptr, kvstore->listPersistedVbuckets()[0]);
+    EXPECT_NE(nullptr, kvstore->listPersistedVbuckets()[1]);
+    EXPECT_EQ(0u, kvstore->getItemCount(0));
+    GetValue gv = kvstore->get(makeStoredDocKey("key1"), 0);
+    EXPECT_EQ(ENGINE_KEY_ENOENT, gv.getStatus());
+}
+
+/*
+ * An overwrite leaves the seqno index entry of the previous version, which
+ * scans skip and compaction drops.
+ */
+TEST_F(RocksDBKVStoreTest, StaleSeqnoIndexEntries) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "rocksdb", 0, false /*persistnamespace*/);
+    auto kvstore = setup_kv_store(config);
+    write_items(*kvstore, 3);
+
+    WriteCallback wc;
+    kvstore->begin();
+    Item item(makeStoredDocKey("key1"), 0, 0, "value", 5, nullptr, 0, 0, 4);
+    kvstore->set(item, wc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+    EXPECT_EQ(3u, kvstore->getItemCount(0));
+
+    std::vector<int64_t> seqnos;
+    auto cb = std::make_shared<CustomCallback<GetValue>>(
+            [&seqnos](GetValue gv) {
+                seqnos.push_back(gv.item->getBySeqno());
+            });
+    auto cl = std::make_shared<CustomCallback<CacheLookup>>();
+    auto scanFrom2 = [&]() {
+        seqnos.clear();
+        auto* ctx = kvstore->initScanContext(cb,
+                                             cl,
+                                             0,
+                                             2,
+                                             DocumentFilter::ALL_ITEMS,
+                                             ValueFilter::VALUES_DECOMPRESSED);
+        EXPECT_EQ(scan_success, kvstore->scan(ctx));
+        EXPECT_EQ(std::vector<int64_t>({3, 4}), seqnos);
+        const auto count = ctx->documentCount;
+        kvstore->destroyScanContext(ctx);
+        return count;
+    };
+    // The stale entry of seqno 2 is still counted.
+    EXPECT_EQ(3u, scanFrom2());
+
+    compaction_ctx cctx;
+    cctx.purge_before_seq = 0;
+    cctx.purge_before_ts = 0;
+    cctx.curr_time = 0;
+    cctx.drop_deletes = 0;
+    cctx.db_file_id = 0;
+    EXPECT_TRUE(kvstore->compactDB(&cctx));
+    EXPECT_EQ(2u, scanFrom2());
+    EXPECT_EQ(3u, kvstore->getItemCount(0));
+}
+#endif
+
 TEST_F(CouchKVStoreTest, CompressedTest) {
     KVStoreConfig config(
             1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
@@ -309,6 +626,245 @@ TEST_F(CouchKVStoreTest, StatsTest) {
     EXPECT_GE(io_total_write_bytes, io_write_bytes);
 }
 
+// Verify a batched bgfetch through an async read backend fetches every
+// document, merging the reads of neighbouring ones.
+TEST_F(CouchKVStoreTest, AsyncReadGetMulti) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    config.setReadBackend("pread").setReadQueueDepth(4);
+    auto kvstore = setup_kv_store(config);
+
+    kvstore->begin();
+    vb_bgfetch_queue_t itms;
+    WriteCallback wc;
+    for (int ii = 0; ii < 20; ++ii) {
+        Item item(makeStoredDocKey("key" + std::to_string(ii)),
+                  0, 0, "value", 5);
+        kvstore->set(item, wc);
+        itms[item.getKey()].isMetaOnly = GetMetaOnly::No;
+    }
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+
+    kvstore->getMulti(0, itms);
+    for (auto& it : itms) {
+        checkGetValue(it.second.value);
+    }
+
+    std::map<std::string, std::string> stats;
+    kvstore->addStats(add_stat_callback, &stats);
+    // The documents were written together, so are all within a few KiB.
+    EXPECT_EQ("19", stats["rw_0:io_bgfetch_reads_merged"]);
+    EXPECT_GT(stoul(stats["rw_0:io_bgfetch_read_bytes"]), 20 * 5);
+}
+
+// Verify repeated reads of a file are served from the block cache.
+TEST_F(CouchKVStoreTest, BlockCache) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    config.setBlockCache(std::make_shared<CouchBlockCache>(1024 * 1024));
+    auto kvstore = setup_kv_store(config);
+
+    // Only blocks the file has grown past are cached, so pad it out.
+    kvstore->begin();
+    const std::string filler(3 * CouchBlockCache::blockSize, 'x');
+    Item fillerItem(makeStoredDocKey("filler"), 0, 0,
+                    filler.data(), filler.size());
+    StoredDocKey key = makeStoredDocKey("key");
+    Item item(key, 0, 0, "value", 5);
+    WriteCallback wc;
+    kvstore->set(fillerItem, wc);
+    kvstore->set(item, wc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+
+    GetValue gv = kvstore->get(key, 0);
+    checkGetValue(gv);
+    std::map<std::string, std::string> stats;
+    kvstore->addStats(add_stat_callback, &stats);
+    EXPECT_GT(stoul(stats["rw_0:block_cache_misses"]), 0);
+
+    gv = kvstore->get(key, 0);
+    checkGetValue(gv);
+    stats.clear();
+    kvstore->addStats(add_stat_callback, &stats);
+    // (The header, in the file's partial last block, is read again.)
+    EXPECT_GT(stoul(stats["rw_0:block_cache_hits"]), 0);
+}
+
+TEST_F(CouchKVStoreTest, DbHandleCache) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    config.setDbHandleCacheSize(4);
+    auto kvstore = setup_kv_store(config);
+
+    kvstore->begin();
+    StoredDocKey key = makeStoredDocKey("key");
+    Item item(key, 0, 0, "value", 5);
+    WriteCallback wc;
+    kvstore->set(item, wc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+
+    std::map<std::string, std::string> stats;
+    kvstore->addStats(add_stat_callback, &stats);
+    const size_t opens = stoul(stats["rw_0:open"]);
+
+    // The second get reuses the file opened by the first.
+    GetValue gv = kvstore->get(key, 0);
+    checkGetValue(gv);
+    gv = kvstore->get(key, 0);
+    checkGetValue(gv);
+    stats.clear();
+    kvstore->addStats(add_stat_callback, &stats);
+    EXPECT_EQ(opens + 1, stoul(stats["rw_0:open"]));
+
+    // The read-only store has its own cache.
+    auto ro = dynamic_cast<CouchKVStore&>(*kvstore).makeReadOnlyStore();
+    gv = ro->get(key, 0);
+    checkGetValue(gv);
+
+    // A commit makes the handles stale, so both stores read the new value.
+    kvstore->begin();
+    Item item2(key, 0, 0, "value2", 6);
+    kvstore->set(item2, wc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+    for (auto* store : {kvstore.get(), static_cast<KVStore*>(ro.get())}) {
+        gv = store->get(key, 0);
+        ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+        EXPECT_EQ("value2",
+                  std::string(gv.item->getData(), gv.item->getNBytes()));
+    }
+}
+
+// With snappy value compression values are stored compressed (if that
+// shrinks them) and read back as stored; in couchstore mode they're read
+// back uncompressed.
+TEST_F(CouchKVStoreTest, ValueCompression) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    config.setValueCompression("snappy");
+    auto kvstore = setup_kv_store(config);
+
+    const std::string value(1024, 'x');
+    StoredDocKey compressible = makeStoredDocKey("compressible");
+    StoredDocKey incompressible = makeStoredDocKey("incompressible");
+    uint8_t datatype = PROTOCOL_BINARY_RAW_BYTES;
+    kvstore->begin();
+    WriteCallback wc;
+    Item item(compressible, 0, 0, value.data(), value.size(), &datatype, 1);
+    kvstore->set(item, wc);
+    Item item2(incompressible, 0, 0, "value", 5, &datatype, 1);
+    kvstore->set(item2, wc);
+    EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+
+    GetValue gv = kvstore->get(compressible, 0);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_TRUE(mcbp::datatype::is_snappy(gv.item->getDataType()));
+    EXPECT_LT(gv.item->getNBytes(), value.size());
+    ASSERT_TRUE(gv.item->decompressValue());
+    EXPECT_EQ(value, std::string(gv.item->getData(), gv.item->getNBytes()));
+
+    gv = kvstore->get(incompressible, 0);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_EQ(PROTOCOL_BINARY_RAW_BYTES, gv.item->getDataType());
+    kvstore.reset();
+
+    KVStoreConfig config2(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    auto kvstore2 = std::move(KVStoreFactory::create(config2).rw);
+    gv = kvstore2->get(compressible, 0);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_EQ(PROTOCOL_BINARY_RAW_BYTES, gv.item->getDataType());
+    EXPECT_EQ(value, std::string(gv.item->getData(), gv.item->getNBytes()));
+
+    // A value which is already compressed is stored as is.
+    Item item3(compressible, 0, 0, value.data(), value.size(), &datatype, 1);
+    ASSERT_TRUE(item3.compressValue());
+    kvstore2->begin();
+    kvstore2->set(item3, wc);
+    EXPECT_TRUE(kvstore2->commit(nullptr /*no collections manifest*/));
+    gv = kvstore2->get(compressible, 0);
+    ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+    EXPECT_EQ(PROTOCOL_BINARY_RAW_BYTES, gv.item->getDataType());
+    EXPECT_EQ(value, std::string(gv.item->getData(), gv.item->getNBytes()));
+}
+
+// Values of at least the threshold size are kept in the value log, whose
+// garbage compaction collects.
+TEST_F(CouchKVStoreTest, ValueLog) {
+    KVStoreConfig config(
+            1024, 4, data_dir, "couchdb", 0, false /*persistnamespace*/);
+    config.setValueLogThreshold(1024);
+    auto kvstore = setup_kv_store(config);
+
+    const std::string small("value");
+    std::string large(4096, 'x');
+    StoredDocKey smallKey = makeStoredDocKey("small");
+    StoredDocKey largeKey = makeStoredDocKey("large");
+    WriteCallback wc;
+    for (int i = 0; i < 2; ++i) {
+        large[0] = char('a' + i);
+        kvstore->begin();
+        Item item(smallKey, 0, 0, small.data(), small.size(),
+                  nullptr, 0, 0, 2 * i + 1);
+        kvstore->set(item, wc);
+        Item item2(largeKey, 0, 0, large.data(), large.size(),
+                   nullptr, 0, 0, 2 * i + 2);
+        kvstore->set(item2, wc);
+        EXPECT_TRUE(kvstore->commit(nullptr /*no collections manifest*/));
+    }
+    EXPECT_LT(0u, kvstore->getKVStoreStat().io_value_log_write_bytes);
+    EXPECT_FALSE(cb::io::findFilesWithPrefix(data_dir, "0.vlog.").empty());
+
+    auto check = [&]() {
+        GetValue gv = kvstore->get(largeKey, 0);
+        ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+        EXPECT_EQ(large,
+                  std::string(gv.item->getData(), gv.item->getNBytes()));
+        gv = kvstore->get(smallKey, 0);
+        ASSERT_EQ(ENGINE_SUCCESS, gv.getStatus());
+        EXPECT_EQ(small,
+                  std::string(gv.item->getData(), gv.item->getNBytes()));
+
+        size_t scanned = 0;
+        auto cb = std::make_shared<CustomCallback<GetValue>>(
+                [&](GetValue result) {
+                    ++scanned;
+                    const auto& it = *result.item;
+                    EXPECT_EQ(it.getKey() == largeKey ? large : small,
+                              std::string(it.getData(), it.getNBytes()));
+                });
+        auto cl = std::make_shared<CustomCallback<CacheLookup>>();
+        auto* ctx = kvstore->initScanContext(cb,
+                                             cl,
+                                             0,
+                                             1,
+                                             DocumentFilter::ALL_ITEMS,
+                                             ValueFilter::VALUES_DECOMPRESSED);
+        ASSERT_NE(nullptr, ctx);
+        EXPECT_EQ(scan_success, kvstore->scan(ctx));
+        kvstore->destroyScanContext(ctx);
+        EXPECT_EQ(2u, scanned);
+    };
+    check();
+
+    // Half of the first generation is the overwritten value: compaction
+    // copies the other half and removes it.
+    compaction_ctx cctx;
+    cctx.purge_before_seq = 0;
+    cctx.purge_before_ts = 0;
+    cctx.curr_time = 0;
+    cctx.drop_deletes = 0;
+    cctx.db_file_id = 0;
+    EXPECT_TRUE(kvstore->compactDB(&cctx));
+    EXPECT_LT(0u, kvstore->getKVStoreStat().io_value_log_gc_bytes);
+    EXPECT_TRUE(cb::io::findFilesWithPrefix(data_dir, "0.vlog.1").empty());
+    check();
+
+    // And the values are found by a new store.
+    kvstore.reset();
+    kvstore = std::move(KVStoreFactory::create(config).rw);
+    check();
+}
+
 // Verify the compaction stats returned from operations are accurate.
 TEST_F(CouchKVStoreTest, CompactStatsTest) {
     KVStoreConfig config(
@@ -106,7 +106,7 @@ TEST_F(MutationLogTest, Unconfigured) {
     MutationLog ml("");
     ml.open();
     ASSERT_FALSE(ml.isEnabled());
-    ml.newItem(3, makeStoredDocKey("somekey"));
+    ml.newItem(3, makeStoredDocKey("somekey"), 0);
     ml.commit1();
     ml.commit2();
     ml.flush();
@@ -199,10 +199,10 @@ TEST_F(MutationLogTest, Logging) {
         MutationLog ml(tmp_log_filename.c_str());
         ml.open();
 
-        ml.newItem(2, makeStoredDocKey("key1"));
+        ml.newItem(2, makeStoredDocKey("key1"), 0);
         ml.commit1();
         ml.commit2();
-        ml.newItem(3, makeStoredDocKey("key2"));
+        ml.newItem(3, makeStoredDocKey("key2"), 0);
         ml.commit1();
         ml.commit2();
         // Remaining:   3:key2, 2:key1
@@ -253,13 +253,13 @@ TEST_F(MutationLogTest, LoggingDirty) {
         MutationLog ml(tmp_log_filename.c_str());
         ml.open();
 
-        ml.newItem(3, makeStoredDocKey("key1"));
-        ml.newItem(2, makeStoredDocKey("key1"));
+        ml.newItem(3, makeStoredDocKey("key1"), 0);
+        ml.newItem(2, makeStoredDocKey("key1"), 0);
         ml.commit1();
         ml.commit2();
         // This will be dropped from the normal loading path
         // because there's no commit.
-        ml.newItem(3, makeStoredDocKey("key2"));
+        ml.newItem(3, makeStoredDocKey("key2"), 0);
         // Remaining:   3:key1, 2:key1
 
         EXPECT_EQ(3, ml.itemsLogged[int(MutationLogType::New)]);
@@ -310,10 +310,10 @@ TEST_F(MutationLogTest, LoggingBadCRC) {
         MutationLog ml(tmp_log_filename.c_str());
         ml.open();
 
-        ml.newItem(2, makeStoredDocKey("key1"));
+        ml.newItem(2, makeStoredDocKey("key1"), 0);
         ml.commit1();
         ml.commit2();
-        ml.newItem(3, makeStoredDocKey("key2"));
+        ml.newItem(3, makeStoredDocKey("key2"), 0);
         ml.commit1();
         ml.commit2();
         // Remaining:   3:key2, 2:key1
@@ -323,12 +323,13 @@ TEST_F(MutationLogTest, LoggingBadCRC) {
         EXPECT_EQ(2, ml.itemsLogged[int(MutationLogType::Commit2)]);
     }
 
-    // Break the log
+    // Break the log (the compressed entries of its first block)
+    const off_t corrupt = MIN_LOG_HEADER_SIZE + COMPRESSED_HEADER_RESERVED;
     int file = open(tmp_log_filename.c_str(), O_RDWR, FilePerms::Read | FilePerms::Write);
-    EXPECT_EQ(5000, lseek(file, 5000, SEEK_SET));
+    EXPECT_EQ(corrupt, lseek(file, corrupt, SEEK_SET));
     uint8_t b;
     EXPECT_EQ(1, read(file, &b, sizeof(b)));
-    EXPECT_EQ(5000, lseek(file, 5000, SEEK_SET));
+    EXPECT_EQ(corrupt, lseek(file, corrupt, SEEK_SET));
     b = ~b;
     EXPECT_EQ(1, write(file, &b, sizeof(b)));
     close(file);
@@ -374,10 +375,10 @@ TEST_F(MutationLogTest, LoggingShortRead) {
         MutationLog ml(tmp_log_filename.c_str());
         ml.open();
 
-        ml.newItem(2, makeStoredDocKey("key1"));
+        ml.newItem(2, makeStoredDocKey("key1"), 0);
         ml.commit1();
         ml.commit2();
-        ml.newItem(3, makeStoredDocKey("key2"));
+        ml.newItem(3, makeStoredDocKey("key2"), 0);
         ml.commit1();
         ml.commit2();
         // Remaining:   3:key2, 2:key1
@@ -387,8 +388,10 @@ TEST_F(MutationLogTest, LoggingShortRead) {
         EXPECT_EQ(2, ml.itemsLogged[int(MutationLogType::Commit2)]);
     }
 
-    // Break the log
-    EXPECT_EQ(0, truncate(tmp_log_filename.c_str(), 5000));
+    // Break the log (mid-way through the entries of its first block)
+    EXPECT_EQ(0,
+              truncate(tmp_log_filename.c_str(),
+                       MIN_LOG_HEADER_SIZE + COMPRESSED_HEADER_RESERVED + 1));
 
     {
         MutationLog ml(tmp_log_filename.c_str());
@@ -428,9 +431,9 @@ TEST_F(MutationLogTest, Iterator) {
     {
         MutationLog ml(tmp_log_filename.c_str());
         ml.open();
-        ml.newItem(0, makeStoredDocKey("key1"));
-        ml.newItem(0, makeStoredDocKey("key2"));
-        ml.newItem(0, makeStoredDocKey("key3"));
+        ml.newItem(0, makeStoredDocKey("key1"), 0);
+        ml.newItem(0, makeStoredDocKey("key2"), 0);
+        ml.newItem(0, makeStoredDocKey("key3"), 0);
         ml.commit1();
         ml.commit2();
 
@@ -469,7 +472,7 @@ TEST_F(MutationLogTest, BatchLoad) {
         // the requested number.
         for (size_t ii = 0; ii < 10; ii++) {
             std::string key = std::string("key") + std::to_string(ii);
-            ml.newItem(ii % 2, makeStoredDocKey(key));
+            ml.newItem(ii % 2, makeStoredDocKey(key), 0);
         }
         ml.commit1();
         ml.commit2();
@@ -519,14 +522,14 @@ TEST_F(MutationLogTest, ReadOnly) {
 
     MutationLog m2(tmp_log_filename);
     m2.open();
-    m2.newItem(3, makeStoredDocKey("key1"));
+    m2.newItem(3, makeStoredDocKey("key1"), 0);
     m2.close();
 
     // We should be able to open the file now
     ml.open(true);
 
     // But we should not be able to add items to a read only stream
-    EXPECT_THROW(ml.newItem(4, makeStoredDocKey("key2")),
+    EXPECT_THROW(ml.newItem(4, makeStoredDocKey("key2"), 0),
                  MutationLog::WriteException);
 }
 
@@ -646,3 +649,146 @@ TEST_F(MutationLogTest, upgrade) {
         }
     }
 }
+
+// Test that the seqno of each entry is read back, and that the blocks are
+// compressed.
+TEST_F(MutationLogTest, Seqnos) {
+    const size_t items = 1000;
+    size_t entriesSize = 0;
+    {
+        MutationLog ml(tmp_log_filename.c_str());
+        ml.open();
+        for (size_t ii = 0; ii < items; ii++) {
+            auto key = makeStoredDocKey("key" + std::to_string(ii));
+            ml.newItem(0, key, ii + 1);
+            entriesSize += MutationLogEntry::len(key.size());
+        }
+        ml.commit1();
+        ml.commit2();
+        EXPECT_LT(ml.logSize.load() - MIN_LOG_HEADER_SIZE, entriesSize);
+    }
+
+    MutationLog ml(tmp_log_filename.c_str());
+    ml.open(true);
+    uint64_t seqno = 0;
+    for (const auto& le : ml) {
+        if (le->type() != MutationLogType::New) {
+            continue;
+        }
+        EXPECT_EQ(seqno + 1, le->bySeqno());
+        EXPECT_EQ(makeStoredDocKey("key" + std::to_string(seqno)),
+                  StoredDocKey(le->key()));
+        seqno = le->bySeqno();
+    }
+    EXPECT_EQ(items, seqno);
+}
+
+static bool appendKey(void* arg, uint16_t vb, const DocKey& k) {
+    static_cast<std::vector<StoredDocKey>*>(arg)->emplace_back(k);
+    return true;
+}
+
+// The harvester applies keys in the order they were logged (seqno order),
+// not key order, and a key logged again keeps its first position.
+TEST_F(MutationLogTest, ApplyInSeqnoOrder) {
+    std::vector<StoredDocKey> logged;
+    {
+        MutationLog ml(tmp_log_filename.c_str());
+        ml.open();
+        for (size_t ii = 0; ii < 10; ii++) {
+            logged.push_back(makeStoredDocKey("key" + std::to_string(9 - ii)));
+            ml.newItem(0, logged.back(), ii + 1);
+        }
+        ml.newItem(0, logged.front(), 11);
+        ml.commit1();
+        ml.commit2();
+    }
+
+    MutationLog ml(tmp_log_filename.c_str());
+    ml.open(true);
+    {
+        MutationLogHarvester h(ml);
+        h.setVBucket(0);
+        EXPECT_TRUE(h.load());
+        std::vector<StoredDocKey> applied;
+        h.apply(&applied, appendKey);
+        EXPECT_EQ(logged, applied);
+    }
+    {
+        MutationLogHarvester h(ml);
+        h.setVBucket(0);
+        EXPECT_EQ(ml.end(), h.loadBatch(ml.begin(), 0));
+        std::vector<StoredDocKey> applied;
+        h.apply(&applied, appendKey);
+        EXPECT_EQ(logged, applied);
+    }
+}
+
+TEST_F(MutationLogTest, upgradeV2) {
+    // Craft a V2 format file: its blocks are padded and uncompressed.
+    LogHeaderBlock headerBlock(MutationLogVersion::V2);
+    headerBlock.set(MIN_LOG_HEADER_SIZE);
+    const auto* ptr = reinterpret_cast<uint8_t*>(&headerBlock);
+
+    std::vector<uint8_t> toWrite(ptr, ptr + sizeof(LogHeaderBlock));
+    toWrite.resize(MIN_LOG_HEADER_SIZE);
+
+    // Space for the 2 byte CRC, then the item count.
+    const uint16_t items = 10;
+    toWrite.resize(MIN_LOG_HEADER_SIZE + sizeof(uint16_t));
+    uint16_t swapped = htons(items + 2);
+    toWrite.insert(toWrite.end(),
+                   reinterpret_cast<uint8_t*>(&swapped),
+                   reinterpret_cast<uint8_t*>(&swapped) + sizeof(uint16_t));
+
+    const uint16_t vbid = 3;
+    std::vector<StoredDocKey> keys;
+    for (int ii = 0; ii < items; ii++) {
+        keys.push_back(makeStoredDocKey("mykey" + std::to_string(ii)));
+        std::vector<uint8_t> bytes(MutationLogEntryV2::len(keys.back().size()));
+        (void)MutationLogEntryV2::newEntry(
+                bytes.data(), MutationLogType::New, vbid, keys.back());
+        toWrite.insert(toWrite.end(), bytes.begin(), bytes.end());
+    }
+    for (auto t : {MutationLogType::Commit1, MutationLogType::Commit2}) {
+        std::vector<uint8_t> bytes(MutationLogEntryV2::len(0));
+        (void)MutationLogEntryV2::newEntry(bytes.data(), t, vbid);
+        toWrite.insert(toWrite.end(), bytes.begin(), bytes.end());
+    }
+
+    ASSERT_LT(toWrite.size(), MIN_LOG_HEADER_SIZE * 2);
+    toWrite.resize(MIN_LOG_HEADER_SIZE * 2);
+
+    uint32_t crc32(crc32buf(&toWrite[MIN_LOG_HEADER_SIZE + 2],
+                            MIN_LOG_HEADER_SIZE - 2));
+    uint16_t crc16(htons(crc32 & 0xffff));
+    std::copy_n(reinterpret_cast<uint8_t*>(&crc16),
+                sizeof(uint16_t),
+                toWrite.begin() + MIN_LOG_HEADER_SIZE);
+
+    {
+        std::ofstream logFile(tmp_log_filename,
+                              std::ios::out | std::ofstream::binary);
+        std::copy(toWrite.begin(),
+                  toWrite.end(),
+                  std::ostreambuf_iterator<char>(logFile));
+    }
+
+    MutationLog ml(tmp_log_filename.c_str());
+    ml.open();
+    size_t count = 0;
+    for (const auto& le : ml) {
+        if (le->type() == MutationLogType::New) {
+            EXPECT_EQ(vbid, le->vbucket());
+            EXPECT_EQ(keys[count], StoredDocKey(le->key()));
+            // V2 didn't record seqnos.
+            EXPECT_EQ(0, le->bySeqno());
+            ++count;
+        }
+    }
+    EXPECT_EQ(items, count);
+
+    // The log can't be appended to in the current format.
+    EXPECT_THROW(ml.newItem(vbid, makeStoredDocKey("key"), 1),
+                 MutationLog::WriteException);
+}
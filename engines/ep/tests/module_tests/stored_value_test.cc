@@ -241,3 +241,154 @@ TEST(OrderedStoredValueTest, expectedSize) {
             << "Unexpected change in OrderedStoredValue storage size for item: "
             << item;
 }
+
+/**
+ * Test fixture for StoredValues created by InlineStoredValueFactory, with
+ * values of up to 16 bytes stored inline.
+ */
+class InlineStoredValueTest : public ::testing::Test {
+public:
+    InlineStoredValueTest()
+        : factory(stats, 16),
+          item(make_item(0, makeStoredDocKey("key"), "value")) {
+    }
+
+    void SetUp() override {
+        sv = factory(item, {});
+    }
+
+protected:
+    EPStats stats;
+    InlineStoredValueFactory factory;
+    Item item;
+    StoredValue::UniquePtr sv;
+};
+
+TEST_F(InlineStoredValueTest, SmallValueStoredInline) {
+    ASSERT_TRUE(sv->isValueInline());
+    EXPECT_EQ(/*value length*/ 5 + /*extmeta*/ 2, sv->valuelen());
+    EXPECT_LE(sv->valuelen(), sv->getInlineCapacity());
+    EXPECT_EQ(sizeof(StoredValue) + /*key*/ 3 + /*len*/ 1 + /*namespace*/ 1 +
+                      StoredValue::inlineValueOverhead +
+                      sv->getInlineCapacity(),
+              sv->getObjectSize());
+    EXPECT_EQ(sv->getObjectSize(),
+              StoredValue::getRequiredStorage(item, sv->getInlineCapacity()));
+
+    // Value is returned as a copy, equal to the original.
+    auto value = sv->getValue();
+    ASSERT_TRUE(value);
+    EXPECT_NE(item.getValue().get(), value.get());
+    EXPECT_EQ(*item.getValue(), *value);
+    EXPECT_EQ(PROTOCOL_BINARY_DATATYPE_JSON, value->getDataType());
+}
+
+// The inline value is part of the object; size() must count it once, and
+// metaDataSize() must not count the inline storage at all.
+TEST_F(InlineStoredValueTest, SizeCountsInlineValueOnce) {
+    ASSERT_TRUE(sv->isValueInline());
+    EXPECT_EQ(sv->getObjectSize(), sv->size());
+    EXPECT_EQ(sv->getObjectSize() - sv->getInlineCapacity(),
+              sv->metaDataSize());
+
+    // Removing the value frees no memory, and doesn't change the metadata.
+    const auto metaSize = sv->metaDataSize();
+    sv->markClean();
+    sv->ejectValue();
+    EXPECT_EQ(sv->getObjectSize(), sv->size());
+    EXPECT_EQ(metaSize, sv->metaDataSize());
+}
+
+// The inline capacity is rounded up to fill the allocation's 16-byte
+// quantum (up to the factory's limit), so a slightly larger value still
+// fits.
+TEST_F(InlineStoredValueTest, CapacityFillsAllocationQuantum) {
+    InlineStoredValueFactory roomy(stats, 255);
+    auto v = roomy(item, {});
+    ASSERT_TRUE(v->isValueInline());
+    EXPECT_EQ(0, v->getObjectSize() % 16);
+    EXPECT_LT(v->getInlineCapacity(), v->valuelen() + 16);
+
+    const auto spare = v->getInlineCapacity() - v->valuelen();
+    auto larger = make_item(
+            0, makeStoredDocKey("key"), "value" + std::string(spare, 'x'));
+    v->setValue(larger);
+    EXPECT_TRUE(v->isValueInline());
+
+    // The factory's limit still applies.
+    EXPECT_LE(sv->getInlineCapacity(), 16);
+}
+
+// getValueBody() reads the value in place, inline or not.
+TEST_F(InlineStoredValueTest, ValueBody) {
+    auto body = sv->getValueBody();
+    EXPECT_EQ("value", std::string(body.data(), body.size()));
+
+    auto large = make_item(0, makeStoredDocKey("key"), std::string(100, 'x'));
+    auto v = factory(large, {});
+    body = v->getValueBody();
+    EXPECT_EQ(large.getValue()->getData(), body.data());
+    EXPECT_EQ(100, body.size());
+}
+
+TEST_F(InlineStoredValueTest, LargeValueNotInline) {
+    auto large = make_item(0, makeStoredDocKey("key"), std::string(100, 'x'));
+    auto v = factory(large, {});
+    EXPECT_FALSE(v->isValueInline());
+    EXPECT_EQ(StoredValue::getRequiredStorage(large), v->getObjectSize());
+    EXPECT_EQ(large.getValue().get(), v->getValue().get());
+}
+
+TEST_F(InlineStoredValueTest, ToItem) {
+    auto itm = sv->toItem(false, 0);
+    EXPECT_TRUE(item.getKey() == itm->getKey());
+    EXPECT_EQ(*item.getValue(), *itm->getValue());
+    EXPECT_EQ(PROTOCOL_BINARY_DATATYPE_JSON, itm->getDataType());
+
+    // The Item's value must remain valid after the StoredValue is freed.
+    sv.reset();
+    EXPECT_EQ("value", itm->getValue()->to_s());
+}
+
+TEST_F(InlineStoredValueTest, SetValueSpillsAndReturns) {
+    // Larger than the inline capacity - stored in a Blob.
+    auto larger = make_item(0, makeStoredDocKey("key"), "a much larger value");
+    sv->setValue(larger);
+    EXPECT_FALSE(sv->isValueInline());
+    EXPECT_EQ(larger.getValue().get(), sv->getValue().get());
+
+    // Fits again - stored inline.
+    auto smaller = make_item(0, makeStoredDocKey("key"), "val");
+    sv->setValue(smaller);
+    EXPECT_TRUE(sv->isValueInline());
+    EXPECT_EQ("val", sv->getValue()->to_s());
+}
+
+TEST_F(InlineStoredValueTest, EjectAndRestore) {
+    sv->markClean();
+    sv->ejectValue();
+    EXPECT_FALSE(sv->isValueInline());
+    EXPECT_FALSE(sv->isResident());
+    EXPECT_EQ(0, sv->valuelen());
+    EXPECT_FALSE(sv->getValue());
+
+    sv->restoreValue(item);
+    EXPECT_TRUE(sv->isValueInline());
+    EXPECT_TRUE(sv->isResident());
+    EXPECT_EQ("value", sv->getValue()->to_s());
+}
+
+TEST_F(InlineStoredValueTest, Delete) {
+    EXPECT_TRUE(sv->del());
+    EXPECT_FALSE(sv->isValueInline());
+    EXPECT_EQ(0, sv->valuelen());
+    EXPECT_FALSE(sv->del());
+}
+
+TEST_F(InlineStoredValueTest, ItemInfo) {
+    auto info = sv->getItemInfo(0);
+    ASSERT_TRUE(info);
+    EXPECT_EQ("value",
+              std::string(static_cast<const char*>(info->value[0].iov_base),
+                          info->value[0].iov_len));
+}
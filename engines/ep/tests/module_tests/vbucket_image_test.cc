@@ -0,0 +1,143 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2017 Couchbase, Inc
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "vbucket_image.h"
+
+#include <gtest/gtest.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+class VBucketImageTest : public ::testing::Test {
+protected:
+    void TearDown() override {
+        remove(path.c_str());
+        remove((path + ".new").c_str());
+    }
+
+    bool write(const VBucketImageHeader& header, const std::string& body) {
+        VBucketImageWriter writer(path, header);
+        return writer.write(body.data(), body.size()) && writer.commit();
+    }
+
+    std::string readFile() {
+        std::string data;
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            return data;
+        }
+        char buf[1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            data.append(buf, n);
+        }
+        fclose(fp);
+        return data;
+    }
+
+    void writeFile(const std::string& data) {
+        FILE* fp = fopen(path.c_str(), "wb");
+        ASSERT_NE(nullptr, fp);
+        ASSERT_EQ(data.size(), fwrite(data.data(), 1, data.size(), fp));
+        fclose(fp);
+    }
+
+    const std::string path = "vbucket_image_test.image";
+    const VBucketImageHeader header{0x74657374696d6731, // "testimg1"
+                                    3,
+                                    100,
+                                    0xabcd,
+                                    1};
+};
+
+TEST_F(VBucketImageTest, WriteRead) {
+    ASSERT_TRUE(write(header, "body"));
+
+    // Header fields are in network byte order.
+    EXPECT_EQ(0, readFile().compare(0, 8, "testimg1"));
+
+    VBucketImageReader reader(path, header);
+    ASSERT_EQ(VBucketImageReader::Status::Valid, reader.getStatus());
+    EXPECT_EQ(header.flags, reader.getFlags());
+    EXPECT_EQ("body",
+              std::string(reader.getBody().data(), reader.getBody().size()));
+}
+
+TEST_F(VBucketImageTest, Missing) {
+    VBucketImageReader reader(path, header);
+    EXPECT_EQ(VBucketImageReader::Status::Missing, reader.getStatus());
+}
+
+// An image is only valid for the vbucket state it was written in.
+TEST_F(VBucketImageTest, HeaderMismatch) {
+    ASSERT_TRUE(write(header, "body"));
+    for (auto field : {&VBucketImageHeader::magic,
+                       &VBucketImageHeader::vbid,
+                       &VBucketImageHeader::persistedSeqno,
+                       &VBucketImageHeader::failoverUuid}) {
+        auto expected = header;
+        ++(expected.*field);
+        VBucketImageReader reader(path, expected);
+        EXPECT_EQ(VBucketImageReader::Status::Invalid, reader.getStatus());
+    }
+}
+
+TEST_F(VBucketImageTest, Corrupt) {
+    ASSERT_TRUE(write(header, "body"));
+    const std::string data = readFile();
+
+    auto flipped = data;
+    flipped[sizeof(VBucketImageHeader)] ^= 1;
+    writeFile(flipped);
+    EXPECT_EQ(VBucketImageReader::Status::Invalid,
+              VBucketImageReader(path, header).getStatus());
+
+    writeFile(data.substr(0, data.size() - 1));
+    EXPECT_EQ(VBucketImageReader::Status::Invalid,
+              VBucketImageReader(path, header).getStatus());
+
+    writeFile("short");
+    EXPECT_EQ(VBucketImageReader::Status::Invalid,
+              VBucketImageReader(path, header).getStatus());
+}
+
+// An image not committed replaces nothing, and leaves nothing behind.
+TEST_F(VBucketImageTest, NotCommitted) {
+    ASSERT_TRUE(write(header, "old"));
+    {
+        VBucketImageWriter writer(path, header);
+        ASSERT_TRUE(writer.write("new", 3));
+    }
+    VBucketImageReader reader(path, header);
+    ASSERT_EQ(VBucketImageReader::Status::Valid, reader.getStatus());
+    EXPECT_EQ("old",
+              std::string(reader.getBody().data(), reader.getBody().size()));
+    FILE* fp = fopen((path + ".new").c_str(), "rb");
+    EXPECT_EQ(nullptr, fp);
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+TEST_F(VBucketImageTest, WriteFailure) {
+    VBucketImageWriter writer("no_such_dir/" + path, header);
+    EXPECT_FALSE(writer.write("body", 4));
+    EXPECT_FALSE(writer.commit());
+    EXPECT_EQ(ENOENT, writer.getError());
+}
@@ -30,6 +30,8 @@
 
 #include <platform/cb_malloc.h>
 
+#include <cstring>
+
 void VBucketTest::SetUp() {
     const auto eviction_policy = GetParam();
     vbucket.reset(new EPVBucket(0,
@@ -254,6 +256,55 @@ TEST_P(EPVBucketTest, GetBGFetchItemsPerformance) {
     auto items = this->vbucket->getBGFetchItems();
 }
 
+// A metadata image is only written once every item is persisted, and only
+// under value eviction; it rebuilds the hash table as a key dump would. (The
+// file format, and matching it to the vbucket's state, is tested by
+// VBucketImageTest.)
+TEST_P(EPVBucketTest, PersistRestoreMetadataImage) {
+    const std::string path = "vbucket_test.metaimage";
+    auto& vb = dynamic_cast<EPVBucket&>(*this->vbucket);
+    vb.failovers = std::make_unique<FailoverTable>(1);
+    auto keys = generateKeys(10);
+    addMany(keys, AddStatus::Success);
+    EXPECT_FALSE(vb.persistMetadataImage(path));
+
+    std::map<StoredDocKey, uint64_t> cas;
+    for (const auto& key : keys) {
+        auto hbl_sv = lockAndFind(key);
+        hbl_sv.second->markClean();
+        cas[key] = hbl_sv.second->getCas();
+    }
+    if (GetParam() == FULL_EVICTION) {
+        EXPECT_FALSE(vb.persistMetadataImage(path));
+        return;
+    }
+
+    // An unpersisted delete would leave the item in the file.
+    auto deleted = makeStoredDocKey("deleted");
+    ASSERT_EQ(AddStatus::Success, addOne(deleted));
+    lockAndFind(deleted).second->markClean();
+    softDeleteOne(deleted, MutationStatus::WasClean);
+    EXPECT_FALSE(vb.persistMetadataImage(path));
+    lockAndFind(deleted).second->markClean();
+
+    ASSERT_TRUE(vb.persistMetadataImage(path));
+
+    vb.ht.clear();
+    size_t restored = 0;
+    ASSERT_TRUE(vb.restoreMetadataImage(path, restored));
+    EXPECT_EQ(keys.size(), restored);
+    EXPECT_EQ(keys.size(), vb.ht.getNumInMemoryItems());
+    EXPECT_EQ(keys.size(), vb.ht.getNumInMemoryNonResItems());
+    for (auto& key : keys) {
+        auto* v = findValue(key);
+        ASSERT_NE(nullptr, v);
+        EXPECT_FALSE(v->isResident());
+        EXPECT_EQ(cas[key], v->getCas());
+    }
+
+    remove(path.c_str());
+}
+
 // Check the existence of bloom filter after performing a
 // swap of existing filter with a temporary filter.
 TEST_P(VBucketTest, SwapFilter) {
@@ -264,6 +315,31 @@ TEST_P(VBucketTest, SwapFilter) {
     EXPECT_NE("DOESN'T EXIST", this->vbucket->getFilterStatusString());
 }
 
+// A persisted filter is restored; under full eviction with the resident keys
+// too.
+TEST_P(VBucketTest, PersistRestoreFilter) {
+    const std::string path = "vbucket_test.bloom";
+    this->vbucket->failovers = std::make_unique<FailoverTable>(1);
+    this->vbucket->createFilter(1000, 0.01, /*blocked*/ true);
+    auto keys = generateKeys(10);
+    addMany(keys, AddStatus::Success);
+    StoredDocKey deleted = makeStoredDocKey("deleted");
+    this->vbucket->addToFilter(deleted);
+    ASSERT_TRUE(this->vbucket->persistFilter(path));
+
+    this->vbucket->clearFilter();
+    ASSERT_TRUE(this->vbucket->restoreFilter(path));
+    EXPECT_EQ("ENABLED", this->vbucket->getFilterStatusString());
+    EXPECT_TRUE(this->vbucket->maybeKeyExistsInFilter(deleted));
+    if (GetParam() == FULL_EVICTION) {
+        // The resident keys, which won't be after warmup, are added too.
+        for (const auto& key : keys) {
+            EXPECT_TRUE(this->vbucket->maybeKeyExistsInFilter(key));
+        }
+    }
+    remove(path.c_str());
+}
+
 TEST_P(VBucketTest, Add) {
     const auto eviction_policy = GetParam();
     if (eviction_policy != VALUE_ONLY) {